@@ -0,0 +1,215 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Microbenchmark of the LServe decode-side kernels over batch x context length x page budget x KV dtype.
+
+    python kernels/bench/bench_attention.py --ops selector,sparse_decode --batch 1,8,32 \
+        --context-len 16384,65536 --page-budget 2048,4096 --kv-dtype kv4,kv8 --output attn.jsonl
+
+ops:
+    selector        single_query_page_selector_topk, reads the sub-chunk min / max K stats of every page.
+    min_max_pool    paged_min_max_pool of a whole prompt (context stage), writes the K stats.
+    sparse_decode   fine-grained sparse single_query_attention over the budget pages (all heads are retrieval
+                    heads), reads the quantized K / V of the selected pages.
+
+All the kernels are memory bound; the reported GB/s counts the bytes they have to read (and write) once.
+The cache pools are random bytes laid out like BaseCacheEngine (omniserve/worker/cache_engine.py) with
+B x 2 x M block tables.
+"""
+
+import argparse
+from typing import Callable, Dict, Tuple
+
+import omniserve_backend.fused_attention_ctx_pool as fused_attention_ctx_pool
+import omniserve_backend.fused_attention_fine_grained_sparse as fused_attention_fine_grained_sparse
+import omniserve_backend.fused_attention_selector as fused_attention_selector
+import torch
+
+from bench_utils import ResultWriter, add_common_args, int_list, str_list, time_op
+
+OPS = ["selector", "min_max_pool", "sparse_decode"]
+KV_DTYPES = ["kv4", "kv8", "fp8"]
+
+
+class PagedKVCache:
+    """Retrieval pages of batch_size sequences of context_len tokens, num_kv_heads heads each."""
+
+    def __init__(self, args: argparse.Namespace, batch_size: int, context_len: int, kv_dtype: str):
+        self.batch_size = batch_size
+        self.context_len = context_len
+        self.int4_kv = kv_dtype == "kv4"
+        self.fp8_kv = kv_dtype == "fp8"
+        self.kv_with_zeros = not self.fp8_kv
+        self.num_kv_heads = args.num_kv_heads
+        self.head_dim = args.head_dim
+        self.tokens_per_block = args.tokens_per_block
+        self.tokens_per_sub_chunk = args.tokens_per_block // args.sub_chunk_per_block
+
+        self.size_per_token = self.num_kv_heads * self.head_dim // (2 if self.int4_kv else 1)
+        # Payload, then the fp16 scales and zeros of every token-head; the K rows end with the K stats.
+        self.num_bytes_per_block = self.tokens_per_block * (self.size_per_token + self.num_kv_heads * 4)
+        self.num_bytes_k_stats_per_block = 2 * args.sub_chunk_per_block * self.num_kv_heads * self.head_dim * 2
+        self.pages_per_seq = (context_len + self.tokens_per_block - 1) // self.tokens_per_block
+        num_blocks = batch_size * self.pages_per_seq
+
+        k_row_bytes = self.num_bytes_per_block + self.num_bytes_k_stats_per_block
+        self.k_pool = torch.randint(0, 64, (num_blocks, k_row_bytes), dtype=torch.uint8, device="cuda")
+        self.v_pool = torch.randint(0, 64, (num_blocks, self.num_bytes_per_block), dtype=torch.uint8, device="cuda")
+        block_ids = torch.arange(num_blocks, dtype=torch.int64, device="cuda").view(batch_size, self.pages_per_seq)
+        self.block_table = torch.stack(
+            [self.k_pool.data_ptr() + block_ids * k_row_bytes, self.v_pool.data_ptr() + block_ids * self.num_bytes_per_block],
+            dim=1,
+        ).contiguous()
+        self.lengths = torch.full((batch_size,), context_len, dtype=torch.int32, device="cuda")
+        self.retrieval_head_flags = torch.ones(self.num_kv_heads, dtype=torch.int32, device="cuda")
+        self.head_rank_table = torch.arange(self.num_kv_heads, dtype=torch.int32, device="cuda")
+
+    def page_bytes(self, num_pages: int) -> int:
+        """K and V bytes (payload, scales and zeros) of num_pages pages of every sequence."""
+        return 2 * self.batch_size * num_pages * self.num_bytes_per_block
+
+    def k_stats_bytes(self) -> int:
+        return self.batch_size * self.pages_per_seq * self.num_bytes_k_stats_per_block
+
+
+def make_decode_qkv(cache: PagedKVCache, num_heads: int) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+    # Strided views into one QKV buffer, like the decode step of the models.
+    q_size = num_heads * cache.head_dim
+    kv_size = cache.num_kv_heads * cache.head_dim
+    qkv = torch.randn(cache.batch_size, q_size + 2 * kv_size, dtype=torch.float16, device="cuda")
+    q, k, v = qkv.split([q_size, kv_size, kv_size], dim=-1)
+    return (
+        q.view(cache.batch_size, num_heads, cache.head_dim),
+        k.view(cache.batch_size, cache.num_kv_heads, cache.head_dim),
+        v.view(cache.batch_size, cache.num_kv_heads, cache.head_dim),
+    )
+
+
+def select_pages(args, cache: PagedKVCache, q, k, v, page_budget: int) -> torch.Tensor:
+    return fused_attention_selector.single_query_page_selector_topk(
+        q, k, v,
+        cache.block_table, None,
+        cache.retrieval_head_flags, cache.head_rank_table,
+        None,
+        cache.lengths,
+        None,                                       # alibi_slopes
+        cache.context_len + cache.tokens_per_block,  # memory_max_len
+        cache.tokens_per_block,
+        cache.size_per_token, 0,
+        0, 0, 0, 0,                                 # sink / local tokens and blocks of the streaming heads
+        cache.num_kv_heads, 0,
+        cache.context_len,                          # timestep
+        cache.head_dim, args.rope_theta, 1.0, True,
+        cache.int4_kv, cache.kv_with_zeros,
+        cache.tokens_per_sub_chunk,
+        cache.num_kv_heads * cache.head_dim,
+        args.multiblock_switch,
+        min(page_budget, cache.context_len),
+        0, 0,                                       # no super-pages
+        None,
+        args.gqa_page_selection != "none", args.gqa_page_selection == "sum",
+        None,                                       # rotary_cos_sin: computed in the kernel
+        None,                                       # page_scores: no page eviction
+    )
+
+
+def make_op(op: str, args, cache: PagedKVCache, page_budget: int) -> Tuple[Callable[[], object], int]:
+    """Returns (launch, bytes moved by one launch)."""
+    num_heads = cache.num_kv_heads * args.gqa_group
+    if op == "min_max_pool":
+        keys = torch.randn(cache.batch_size * cache.context_len, cache.num_kv_heads, cache.head_dim,
+                           dtype=torch.float16, device="cuda")
+        cu_seqlens = torch.arange(0, cache.batch_size + 1, dtype=torch.int32, device="cuda") * cache.context_len
+        launch = lambda: fused_attention_ctx_pool.paged_min_max_pool(
+            keys, cache.block_table, cu_seqlens, cache.head_rank_table, cache.context_len,
+            cache.tokens_per_sub_chunk, cache.tokens_per_block, cache.size_per_token, cache.kv_with_zeros, 0, None,
+        )
+        return launch, keys.numel() * 2 + cache.k_stats_bytes()
+
+    q, k, v = make_decode_qkv(cache, num_heads)
+    if op == "selector":
+        return lambda: select_pages(args, cache, q, k, v, page_budget), cache.k_stats_bytes() + q.numel() * 2
+
+    if op == "sparse_decode":
+        page_idxes = select_pages(args, cache, q, k, v, page_budget)
+        num_pages = page_idxes.size(-1)
+        launch = lambda: fused_attention_fine_grained_sparse.single_query_attention(
+            q, k, v,
+            cache.block_table, None,
+            cache.retrieval_head_flags, cache.head_rank_table,
+            page_idxes,
+            cache.lengths,
+            None,
+            cache.context_len + cache.tokens_per_block,
+            cache.tokens_per_block,
+            cache.size_per_token, 0,
+            0, 0, 0, 0,
+            cache.num_kv_heads, 0,
+            cache.context_len,
+            cache.head_dim, args.rope_theta, 1.0, True,
+            cache.int4_kv, cache.int4_kv, cache.kv_with_zeros,
+            cache.tokens_per_sub_chunk,
+            cache.num_kv_heads * cache.head_dim,
+            args.multiblock_switch,
+            args.persistent,
+            cache.fp8_kv,
+            None,
+            None,
+        )
+        return launch, cache.page_bytes(num_pages) + 2 * q.numel() * 2
+    raise ValueError(f"Unknown attention op {op}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--ops", type=str_list, default=OPS, help=f"Comma separated subset of {OPS}.")
+    parser.add_argument("--batch", type=int_list, default=[1, 4, 16, 64])
+    parser.add_argument("--context-len", type=int_list, default=[8192, 32768, 131072])
+    parser.add_argument("--page-budget", type=int_list, default=[4096],
+                        help="Dynamic sparse token budget (selector / sparse_decode).")
+    parser.add_argument("--kv-dtype", type=str_list, default=["kv4", "kv8"], help=f"Subset of {KV_DTYPES}.")
+    parser.add_argument("--num-kv-heads", type=int, default=8)
+    parser.add_argument("--gqa-group", type=int, default=4, help="Query heads per KV head.")
+    parser.add_argument("--gqa-page-selection", type=str, default="none", choices=["none", "max", "sum"],
+                        help="Select one page set per KV head (selector / sparse_decode).")
+    parser.add_argument("--head-dim", type=int, default=128)
+    parser.add_argument("--tokens-per-block", type=int, default=64)
+    parser.add_argument("--sub-chunk-per-block", type=int, default=4)
+    parser.add_argument("--rope-theta", type=float, default=500000.0)
+    parser.add_argument("--multiblock-switch", type=int, default=2048)
+    parser.add_argument("--persistent", action="store_true", help="Persistent sparse decode kernel.")
+    add_common_args(parser)
+    args = parser.parse_args()
+
+    writer = ResultWriter(args)
+    for kv_dtype in args.kv_dtype:
+        assert kv_dtype in KV_DTYPES, f"Unknown KV dtype {kv_dtype}"
+        for batch_size in args.batch:
+            for context_len in args.context_len:
+                cache = PagedKVCache(args, batch_size, context_len, kv_dtype)
+                for op in args.ops:
+                    # The page budget only changes the selector and the sparse decode.
+                    budgets = args.page_budget if op != "min_max_pool" else [0]
+                    for page_budget in budgets:
+                        launch, num_bytes = make_op(op, args, cache, page_budget)
+                        time_ms = time_op(launch, args.warmup, args.iters)
+                        shape: Dict = {
+                            "batch": batch_size, "context_len": context_len, "page_budget": page_budget,
+                            "kv_dtype": kv_dtype, "num_kv_heads": cache.num_kv_heads, "head_dim": cache.head_dim,
+                        }
+                        writer.add(op, shape, time_ms, num_bytes=num_bytes)
+                del cache
+                torch.cuda.empty_cache()
+    writer.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,125 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Microbenchmark of the W8A8 / W4A8 GEMMs over an M x N x K grid.
+
+    python kernels/bench/bench_gemm.py --ops w8a8,w4a8_per_chn --m 1,16,128,1024,8192 \
+        --nk 4096x4096,14336x4096,4096x14336 --output gemm.jsonl
+
+Reports int8 TOPS (2 * M * N * K) and the DRAM traffic of one pass over A, the weights and C (GB/s) against
+the device peaks. config_id = -1 times the built-in tile heuristic; --config-ids sweeps the tile configs too.
+"""
+
+import argparse
+from typing import Callable, Dict, List, Tuple
+
+import omniserve_backend.qgemm_w4a8_per_chn as qgemm_w4a8_per_chn
+import omniserve_backend.qgemm_w4a8_per_group as qgemm_w4a8_per_group
+import omniserve_backend.qgemm_w8a8 as qgemm_w8a8
+import torch
+
+from bench_utils import ResultWriter, add_common_args, int_list, str_list, time_op
+
+_GROUP_SIZE = 128  # G of the per-group W4A8 kernel
+
+OPS = ["w8a8", "w4a8_per_chn", "w4a8_per_chn_quant_a", "w4a8_per_group"]
+
+
+def make_gemm(op: str, m: int, n: int, k: int, config_id: int) -> Tuple[Callable[[], object], float]:
+    """Returns (launch, bytes moved by one launch)."""
+    device = torch.device("cuda")
+    x = torch.randint(-127, 127, (m, k), dtype=torch.int8, device=device)
+    ascales = torch.rand(m, dtype=torch.float16, device=device) * 1e-2
+    wscales = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+    out = torch.empty(m, n, dtype=torch.float16, device=device)
+    out_bytes = m * n * 2
+    if op == "w8a8":
+        w = torch.randint(-127, 127, (n, k), dtype=torch.int8, device=device)
+        return (
+            lambda: qgemm_w8a8.w8a8_gemm_forward_cuda(x, w, wscales, ascales, out, config_id),
+            m * k + n * k + out_bytes,
+        )
+    w = torch.randint(-127, 127, (n, k // 2), dtype=torch.int8, device=device)
+    if op == "w4a8_per_chn":
+        w_szs = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+        a_ssums = torch.rand(m, dtype=torch.float16, device=device)
+        return (
+            lambda: qgemm_w4a8_per_chn.gemm_forward_cuda(x, w, wscales, ascales, w_szs, a_ssums, out, config_id=config_id),
+            m * k + n * k // 2 + out_bytes,
+        )
+    if op == "w4a8_per_chn_quant_a":
+        # fp16 A, quantized per token in the GEMM prologue.
+        x_fp16 = torch.randn(m, k, dtype=torch.float16, device=device)
+        w_szs = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+        a_ssums = torch.empty(m, dtype=torch.float16, device=device)
+        return (
+            lambda: qgemm_w4a8_per_chn.gemm_quant_a_forward_cuda(
+                x_fp16, w, wscales, ascales, w_szs, a_ssums, out, config_id=config_id
+            ),
+            m * k * 2 + n * k // 2 + out_bytes,
+        )
+    if op == "w4a8_per_group":
+        zeros = torch.randint(-8, 8, (k // _GROUP_SIZE, n), dtype=torch.int8, device=device)
+        scales_i8 = torch.randint(1, 16, (k // _GROUP_SIZE, n), dtype=torch.int8, device=device)
+        return (
+            lambda: qgemm_w4a8_per_group.gemm_forward_cuda(
+                x, w, zeros, scales_i8, wscales, ascales, out, config_id=config_id
+            ),
+            m * k + n * k // 2 + 2 * (k // _GROUP_SIZE) * n + out_bytes,
+        )
+    raise ValueError(f"Unknown GEMM op {op}")
+
+
+def config_fits(op: str, config_id: int, n: int, k: int) -> bool:
+    if config_id < 0:
+        return True
+    if op == "w8a8":
+        configs = qgemm_w8a8.w8a8_gemm_tile_configs()
+    elif op == "w4a8_per_group":
+        configs = qgemm_w4a8_per_group.gemm_tile_configs()
+    else:
+        configs = qgemm_w4a8_per_chn.gemm_tile_configs()
+    if config_id >= len(configs):
+        return False
+    cta_m, cta_n, cta_k, *_ = configs[config_id]
+    return n % cta_n == 0 and k % cta_k == 0
+
+
+def parse_nk(value: str) -> List[Tuple[int, int]]:
+    return [tuple(int(d) for d in nk.split("x")) for nk in value.split(",") if nk]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--ops", type=str_list, default=OPS, help=f"Comma separated subset of {OPS}.")
+    parser.add_argument("--m", type=int_list, default=[1, 8, 32, 128, 512, 2048, 8192])
+    parser.add_argument("--nk", type=parse_nk, default=[(4096, 4096), (12288, 4096), (28672, 4096), (4096, 14336)],
+                        help="Comma separated NxK weight shapes.")
+    parser.add_argument("--config-ids", type=int_list, default=[-1], help="Tile configs to time (-1: heuristic).")
+    add_common_args(parser)
+    args = parser.parse_args()
+
+    writer = ResultWriter(args)
+    for op in args.ops:
+        for n, k in args.nk:
+            for m in args.m:
+                for config_id in args.config_ids:
+                    if not config_fits(op, config_id, n, k):
+                        continue
+                    launch, num_bytes = make_gemm(op, m, n, k, config_id)
+                    time_ms = time_op(launch, args.warmup, args.iters)
+                    shape: Dict = {"m": m, "n": n, "k": k, "config_id": config_id}
+                    writer.add(op, shape, time_ms, flops=2.0 * m * n * k, num_bytes=num_bytes)
+    writer.close()
+
+
+if __name__ == "__main__":
+    main()
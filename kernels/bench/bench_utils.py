@@ -0,0 +1,107 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Timing, device peaks and result records shared by the kernel microbenchmarks."""
+
+import argparse
+import json
+import sys
+from typing import Callable, Dict, List, Optional
+
+import torch
+
+# Dense peaks: (int8 tensor TOPS, fp16 tensor TFLOPS, HBM GB/s), matched against torch.cuda.get_device_name().
+DEVICE_PEAKS = {
+    "H100": (1979.0, 989.0, 3350.0),
+    "A100": (624.0, 312.0, 2039.0),
+    "L40S": (733.0, 362.0, 864.0),
+    "L40": (362.0, 181.0, 864.0),
+    "A6000": (310.0, 155.0, 768.0),
+    "4090": (661.0, 165.0, 1008.0),
+}
+
+
+def int_list(value: str) -> List[int]:
+    return [int(v) for v in value.split(",") if v]
+
+
+def str_list(value: str) -> List[str]:
+    return [v for v in value.split(",") if v]
+
+
+def add_common_args(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument("--warmup", type=int, default=10)
+    parser.add_argument("--iters", type=int, default=50)
+    parser.add_argument("--output", type=str, default=None, help="Append the results as JSON lines to this file.")
+    parser.add_argument("--peak-tops", type=float, default=None, help="Override the int8 peak (TOPS) of the device.")
+    parser.add_argument("--peak-tflops", type=float, default=None, help="Override the fp16 peak (TFLOPS).")
+    parser.add_argument("--peak-gbps", type=float, default=None, help="Override the DRAM bandwidth peak (GB/s).")
+
+
+def get_device_peaks(args: argparse.Namespace) -> Dict[str, Optional[float]]:
+    name = torch.cuda.get_device_name()
+    peaks = (None, None, None)
+    for key, value in DEVICE_PEAKS.items():
+        if key in name:
+            peaks = value
+            break
+    return {
+        "int8_tops": args.peak_tops if args.peak_tops is not None else peaks[0],
+        "fp16_tflops": args.peak_tflops if args.peak_tflops is not None else peaks[1],
+        "dram_gbps": args.peak_gbps if args.peak_gbps is not None else peaks[2],
+    }
+
+
+@torch.no_grad()
+def time_op(fn: Callable[[], object], warmup: int, iters: int) -> float:
+    """Average time of fn in ms, measured with CUDA events over iters back-to-back launches."""
+    for _ in range(warmup):
+        fn()
+    start = torch.cuda.Event(enable_timing=True)
+    end = torch.cuda.Event(enable_timing=True)
+    start.record()
+    for _ in range(iters):
+        fn()
+    end.record()
+    torch.cuda.synchronize()
+    return start.elapsed_time(end) / iters
+
+
+class ResultWriter:
+    """One JSON record per measurement: op, shape, time, achieved TOPS / GB/s and the fraction of the peak."""
+
+    def __init__(self, args: argparse.Namespace):
+        self.peaks = get_device_peaks(args)
+        self.device = torch.cuda.get_device_name()
+        self.file = open(args.output, "a") if args.output is not None else None
+
+    def add(self, op: str, shape: Dict, time_ms: float, flops: float = 0.0, num_bytes: float = 0.0,
+            compute: str = "int8_tops") -> Dict:
+        record = {"device": self.device, "op": op, **shape, "time_ms": time_ms}
+        time_s = time_ms * 1e-3
+        if flops > 0:
+            record["tflops"] = flops / time_s / 1e12
+            if self.peaks[compute] is not None:
+                record["compute_util"] = record["tflops"] / self.peaks[compute]
+        if num_bytes > 0:
+            record["gbps"] = num_bytes / time_s / 1e9
+            if self.peaks["dram_gbps"] is not None:
+                record["bandwidth_util"] = record["gbps"] / self.peaks["dram_gbps"]
+        line = json.dumps(record)
+        print(line, file=sys.stdout, flush=True)
+        if self.file is not None:
+            self.file.write(line + "\n")
+            self.file.flush()
+        return record
+
+    def close(self) -> None:
+        if self.file is not None:
+            self.file.close()
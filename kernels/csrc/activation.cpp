@@ -1,5 +1,6 @@
 // Inspired by vLLM-SmoothQuant: https://github.com/vllm-project/vllm/pull/1112.
 #include <torch/extension.h>
+#include "nvtx_utils.h"
 
 void silu_and_mul(torch::Tensor &out,    // [..., d]
                   torch::Tensor &input); // [..., 2 * d]
@@ -23,17 +24,17 @@ void invoke_dequant_silu_and_mul_quant(torch::Tensor &out,   // [..., d]
 );
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-  m.def("silu_and_mul", &silu_and_mul, "Activation function used in SwiGLU.");
-  m.def("gelu_new", &gelu_new, "GELU implementation used in GPT-2.");
-  m.def("gelu_fast", &gelu_fast, "Approximate GELU implementation.");
+  m.def("silu_and_mul", omniserve::nvtx_wrap("silu_and_mul", &silu_and_mul), "Activation function used in SwiGLU.");
+  m.def("gelu_new", omniserve::nvtx_wrap("gelu_new", &gelu_new), "GELU implementation used in GPT-2.");
+  m.def("gelu_fast", omniserve::nvtx_wrap("gelu_fast", &gelu_fast), "Approximate GELU implementation.");
   m.def(
       "invoke_dequant_silu_and_mul_quant",
-      py::overload_cast<torch::Tensor &, torch::Tensor &, float, float, float>(
-          &invoke_dequant_silu_and_mul_quant),
+      omniserve::nvtx_wrap("invoke_dequant_silu_and_mul_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, float, float, float>(
+          &invoke_dequant_silu_and_mul_quant)),
       "Dequant input, apply silu act and quant output");
   m.def("invoke_dequant_silu_and_mul_quant",
-        py::overload_cast<torch::Tensor &, torch::Tensor &, float, float,
+        omniserve::nvtx_wrap("invoke_dequant_silu_and_mul_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, float, float,
                           torch::Tensor &, torch::Tensor &>(
-            &invoke_dequant_silu_and_mul_quant),
+            &invoke_dequant_silu_and_mul_quant)),
         "Dequant input, apply silu act and quant output");
 }
@@ -78,6 +78,109 @@ __global__ void dequant_silu_and_mul_quant_kernel(
     }
   }
 }
+
+// Vectorized dequant_silu_and_mul_quant for the common MLP intermediate sizes (and their tensor parallel
+// shards). Gate and up are read with 128-bit loads, and the products stay in registers between the amax
+// reduction and the quantization instead of a round trip through tmp, so a row is read once and the int8
+// outputs are stored 4 at a time. One CTA of kThreadsPerRow threads per row.
+#define ACT_QUANT_VEC_ELEMS 4
+
+// X(D, THREADS_PER_ROW)
+#define ACT_QUANT_VEC_SIZES(X) \
+  X(3584, 128)                 \
+  X(5504, 256)                 \
+  X(7168, 256)                 \
+  X(11008, 256)                \
+  X(13824, 384)                \
+  X(14336, 512)                \
+  X(28672, 1024)
+
+template <int kD, int kThreadsPerRow, typename scale_type, bool use_per_token_quant>
+__global__ void dequant_silu_and_mul_quant_vec_kernel(
+    int8_t *__restrict__ out,          // [..., d]
+    const int32_t *__restrict__ input, // [..., 2 * d]
+    const float scale_gate, const float scale_up,
+    scale_type scale_out               // [num_tokens]
+) {
+  constexpr int kNumVecs = kD / ACT_QUANT_VEC_ELEMS;
+  // The last vector of a thread may fall past the row when the row does not split evenly.
+  constexpr int kVecs = (kNumVecs + kThreadsPerRow - 1) / kThreadsPerRow;
+  constexpr bool kEvenSplit = kNumVecs % kThreadsPerRow == 0;
+  static_assert(kNumVecs * ACT_QUANT_VEC_ELEMS == kD, "d must be a multiple of the vector size.");
+
+  const int token_idx = blockIdx.x;
+  const int64_t token_idx_d = token_idx * int64_t(kD);
+  const int64_t token_idx_2d = token_idx_d * 2;
+
+  float4 t[kVecs];
+  float amax_val = 0.0f;
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v) {
+    const int idx = (v * kThreadsPerRow + threadIdx.x) * ACT_QUANT_VEC_ELEMS;
+    if (kEvenSplit || idx < kD) {
+      const int4 x = __ldg(reinterpret_cast<const int4 *>(input + token_idx_2d + idx));
+      const int4 y = __ldg(reinterpret_cast<const int4 *>(input + token_idx_2d + kD + idx));
+      t[v] = make_float4(silu((float)x.x * scale_gate) * ((float)y.x * scale_up),
+                         silu((float)x.y * scale_gate) * ((float)y.y * scale_up),
+                         silu((float)x.z * scale_gate) * ((float)y.z * scale_up),
+                         silu((float)x.w * scale_gate) * ((float)y.w * scale_up));
+      if constexpr (use_per_token_quant) {
+        amax_val = fmaxf(amax_val, fmaxf(fmaxf(fabsf(t[v].x), fabsf(t[v].y)), fmaxf(fabsf(t[v].z), fabsf(t[v].w))));
+      }
+    }
+  }
+
+  float tmp_scale = 0.0f;
+  if constexpr (use_per_token_quant) {
+    const float row_amax_val = rowReduceMax<kThreadsPerRow>(amax_val);
+    if (threadIdx.x == 0) {
+      scale_out[token_idx] = row_amax_val / 127.0f;
+    }
+    tmp_scale = 127.0f / row_amax_val;
+  }
+
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v) {
+    const int idx = (v * kThreadsPerRow + threadIdx.x) * ACT_QUANT_VEC_ELEMS;
+    if (kEvenSplit || idx < kD) {
+      char4 o;
+      if constexpr (use_per_token_quant) {
+        o.x = float_to_int8_rn(tmp_scale * t[v].x);
+        o.y = float_to_int8_rn(tmp_scale * t[v].y);
+        o.z = float_to_int8_rn(tmp_scale * t[v].z);
+        o.w = float_to_int8_rn(tmp_scale * t[v].w);
+      } else {
+        o.x = float_to_int8_rn(t[v].x / scale_out);
+        o.y = float_to_int8_rn(t[v].y / scale_out);
+        o.z = float_to_int8_rn(t[v].z / scale_out);
+        o.w = float_to_int8_rn(t[v].w / scale_out);
+      }
+      *reinterpret_cast<char4 *>(out + token_idx_d + idx) = o;
+    }
+  }
+}
+
+#define ACT_QUANT_VEC_LAUNCH_CASE(D, THREADS_PER_ROW)                                                     \
+  case D:                                                                                                 \
+    dequant_silu_and_mul_quant_vec_kernel<D, THREADS_PER_ROW, scale_type, use_per_token_quant>            \
+        <<<num_tokens, THREADS_PER_ROW, 0, stream>>>(out, input, scale_gate, scale_up, scale_out);       \
+    return true;
+
+// Launches the vectorized kernel if d is specialized and the rows are aligned for 128-bit loads.
+// Returns false (and launches nothing) otherwise, so the caller can fall back to the generic kernel.
+template <typename scale_type, bool use_per_token_quant>
+bool launch_dequant_silu_and_mul_quant_vec(int8_t *out, const int32_t *input, int64_t num_tokens, int d,
+                                           const float scale_gate, const float scale_up, scale_type scale_out,
+                                           const cudaStream_t &stream) {
+  if (num_tokens == 0 || reinterpret_cast<uintptr_t>(input) % 16 != 0 ||
+      reinterpret_cast<uintptr_t>(out) % 4 != 0)
+    return false;
+  switch (d) {
+    ACT_QUANT_VEC_SIZES(ACT_QUANT_VEC_LAUNCH_CASE)
+  default:
+    return false;
+  }
+}
 } // namespace vllm
 
 
@@ -105,6 +208,11 @@ void invoke_dequant_silu_and_mul_quant(
   dim3 grid(num_tokens);
   dim3 block(std::min(d, 1024));
   const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  if (vllm::launch_dequant_silu_and_mul_quant_vec<float, false>(
+          out.data_ptr<int8_t>(), input.data_ptr<int32_t>(), num_tokens, d, scale_gate, scale_up, scale_out,
+          stream)) {
+    return;
+  }
   vllm::dequant_silu_and_mul_quant_kernel<float, false><<<grid, block, 0, stream>>>(
       out.data_ptr<int8_t>(), input.data_ptr<int32_t>(), d, scale_gate,
       scale_up, scale_out);
@@ -123,6 +231,11 @@ void invoke_dequant_silu_and_mul_quant(
   dim3 grid(num_tokens);
   dim3 block(std::min(d, 1024));
   const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  if (vllm::launch_dequant_silu_and_mul_quant_vec<float *, true>(
+          out.data_ptr<int8_t>(), input.data_ptr<int32_t>(), num_tokens, d, scale_gate, scale_up,
+          scale_out.data_ptr<float>(), stream)) {
+    return;
+  }
   vllm::dequant_silu_and_mul_quant_kernel<float*, true><<<grid, block, 0, stream>>>(
       out.data_ptr<int8_t>(), input.data_ptr<int32_t>(),
        d, scale_gate, scale_up, scale_out.data_ptr<float>(), tmp.data_ptr<float>());
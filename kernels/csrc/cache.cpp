@@ -0,0 +1,66 @@
+// Adapted from vLLM: https://github.com/vllm-project/vllm/blob/main/csrc/cache.h
+// Modified by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+#include <torch/extension.h>
+
+#include <map>
+#include <vector>
+#include "nvtx_utils.h"
+
+void swap_blocks(torch::Tensor &src,  // [num_src_blocks, num_bytes_per_block]
+                 torch::Tensor &dst,  // [num_dst_blocks, num_bytes_per_block]
+                 const std::map<int64_t, int64_t> &block_mapping);
+
+void copy_blocks(std::vector<torch::Tensor> &key_caches,   // num_layers x [num_blocks, num_bytes_per_block_k]
+                 std::vector<torch::Tensor> &value_caches, // num_layers x [num_blocks, num_bytes_per_block_v]
+                 const std::map<int64_t, std::vector<int64_t>> &block_mapping);
+
+void scatter_block_table_entries(torch::Tensor &tables,      // num_layers x table_len, ragged block tables
+                                 torch::Tensor &base_ptrs,   // 2 x num_layers, K / V pool base pointers
+                                 torch::Tensor &block_bytes, // 2 x num_layers, K / V bytes per block
+                                 torch::Tensor &deltas,      // 3 x num_entries
+                                 c10::optional<torch::Tensor> cold_base_ptrs,   // 2 x num_layers, K stats / host V
+                                 c10::optional<torch::Tensor> cold_block_bytes, // 2 x num_layers
+                                 const int64_t num_gpu_blocks);
+
+void gather_offloaded_pages(torch::Tensor &table,          // table_len, ragged block table of one layer
+                            torch::Tensor &page_idxes,     // b x num_heads x num_pages int32
+                            c10::optional<torch::Tensor> page_nums,  // b int32
+                            torch::Tensor &context_lens,   // b int32
+                            const int tokens_per_block,
+                            torch::Tensor &host_key_cache,    // [num_cpu_blocks, num_bytes_per_block_k], pinned
+                            torch::Tensor &host_value_cache,  // [num_cpu_blocks, num_bytes_per_block_v], pinned
+                            torch::Tensor &staging_key,    // [num_staging_blocks, >= copy_bytes]
+                            torch::Tensor &staging_value,  // [num_staging_blocks, >= copy_bytes]
+                            torch::Tensor &num_staged,     // 1 int32, staging slots in use
+                            const int64_t copy_bytes);
+
+void move_block_table_rows(torch::Tensor &dst_tables,  // num_layers x dst_table_len
+                           torch::Tensor &src_tables,  // num_layers x src_table_len
+                           torch::Tensor &row_moves);  // num_rows x 5
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+  m.def("swap_blocks", omniserve::nvtx_wrap("swap_blocks", &swap_blocks),
+        "Swap in (out) the cache blocks from src to dst (async on the current stream).");
+  m.def("copy_blocks", omniserve::nvtx_wrap("copy_blocks", &copy_blocks),
+        "Copy the cache blocks from src to dst for all the given layers in one launch.");
+  m.def("scatter_block_table_entries", omniserve::nvtx_wrap("scatter_block_table_entries", &scatter_block_table_entries),
+        "Write the K / V pointers of the given blocks into the block tables of all the layers.",
+        py::arg("tables"), py::arg("base_ptrs"), py::arg("block_bytes"), py::arg("deltas"),
+        py::arg("cold_base_ptrs") = py::none(), py::arg("cold_block_bytes") = py::none(),
+        py::arg("num_gpu_blocks") = -1);
+  m.def("gather_offloaded_pages", omniserve::nvtx_wrap("gather_offloaded_pages", &gather_offloaded_pages),
+        "Copy the selected cold retrieval pages from the host pool to staging slots and redirect the table.");
+  m.def("move_block_table_rows", omniserve::nvtx_wrap("move_block_table_rows", &move_block_table_rows),
+        "Copy rows of the ragged block tables of all the layers into a new layout.");
+}
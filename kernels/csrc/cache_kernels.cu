@@ -0,0 +1,417 @@
+// Adapted from vLLM: https://github.com/vllm-project/vllm/blob/main/csrc/cache_kernels.cu
+// Modified by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/extension.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// NOTE: Each KV cache block is stored as one flat byte row of [num_blocks, num_bytes_per_block]:
+// the (packed INT4 / INT8) payload, followed by the per-token scales/zeros and, for retrieval K
+// blocks, the per-sub-chunk min/max key stats (see KVBlockArray::mBytesPerSeq). Copying whole rows
+// therefore keeps every region of a page consistent, and K/V rows may have different widths.
+
+void swap_blocks(torch::Tensor &src, torch::Tensor &dst,
+                 const std::map<int64_t, int64_t> &block_mapping) {
+  torch::Device src_device = src.device();
+  torch::Device dst_device = dst.device();
+  cudaMemcpyKind memcpy_type;
+  if (src_device.is_cuda() && dst_device.is_cuda()) {
+    TORCH_CHECK(src_device.index() == dst_device.index(),
+                "src and dst must be on the same GPU");
+    memcpy_type = cudaMemcpyDeviceToDevice;
+  } else if (src_device.is_cuda() && dst_device.is_cpu()) {
+    memcpy_type = cudaMemcpyDeviceToHost;
+  } else if (src_device.is_cpu() && dst_device.is_cuda()) {
+    memcpy_type = cudaMemcpyHostToDevice;
+  } else {
+    TORCH_CHECK(false, "Invalid device combination");
+  }
+  TORCH_CHECK(src.dim() == 2 && dst.dim() == 2, "swap_blocks expects [num_blocks, num_bytes_per_block] caches");
+  TORCH_CHECK(src.size(1) == dst.size(1), "src and dst must have the same block size");
+  TORCH_CHECK(src.is_contiguous() && dst.is_contiguous(), "src and dst must be contiguous");
+  if (block_mapping.empty() || src.size(1) == 0) {
+    return;
+  }
+
+  char *src_ptr = static_cast<char *>(src.data_ptr());
+  char *dst_ptr = static_cast<char *>(dst.data_ptr());
+  const int64_t block_size_in_bytes = src.element_size() * src[0].numel();
+  const at::cuda::OptionalCUDAGuard device_guard(
+      src_device.is_cuda() ? src_device : dst_device);
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  // Coalesce runs of consecutive src/dst blocks into a single copy. The block
+  // allocator hands out neighbouring blocks often enough for this to matter.
+  auto it = block_mapping.begin();
+  while (it != block_mapping.end()) {
+    const int64_t src_block_start = it->first;
+    const int64_t dst_block_start = it->second;
+    int64_t num_blocks = 1;
+    auto next = std::next(it);
+    while (next != block_mapping.end() &&
+           next->first == src_block_start + num_blocks &&
+           next->second == dst_block_start + num_blocks) {
+      ++num_blocks;
+      ++next;
+    }
+    cudaMemcpyAsync(dst_ptr + dst_block_start * block_size_in_bytes,
+                    src_ptr + src_block_start * block_size_in_bytes,
+                    num_blocks * block_size_in_bytes, memcpy_type, stream);
+    it = next;
+  }
+}
+
+namespace vllm {
+
+// Grid: (num_caches, num_pairs). Each cache may have its own row width, since the
+// retrieval/streaming head counts (and therefore the block sizes) vary across layers.
+__global__ void copy_blocks_kernel(int64_t *cache_ptrs,
+                                   const int64_t *__restrict__ cache_row_bytes,
+                                   const int64_t *__restrict__ block_mapping) {
+  const int cache_idx = blockIdx.x;
+  const int pair_idx = blockIdx.y;
+
+  const int64_t row_bytes = cache_row_bytes[cache_idx];
+  char *cache = reinterpret_cast<char *>(cache_ptrs[cache_idx]);
+  const int64_t src_block_number = block_mapping[2 * pair_idx];
+  const int64_t dst_block_number = block_mapping[2 * pair_idx + 1];
+
+  char *src = cache + src_block_number * row_bytes;
+  char *dst = cache + dst_block_number * row_bytes;
+  if (row_bytes % sizeof(int4) == 0 &&
+      reinterpret_cast<uintptr_t>(cache) % sizeof(int4) == 0) {
+    const int64_t num_vecs = row_bytes / sizeof(int4);
+    const int4 *src_vec = reinterpret_cast<const int4 *>(src);
+    int4 *dst_vec = reinterpret_cast<int4 *>(dst);
+    for (int64_t i = threadIdx.x; i < num_vecs; i += blockDim.x) {
+      dst_vec[i] = src_vec[i];
+    }
+  } else {
+    for (int64_t i = threadIdx.x; i < row_bytes; i += blockDim.x) {
+      dst[i] = src[i];
+    }
+  }
+}
+
+} // namespace vllm
+
+void copy_blocks(std::vector<torch::Tensor> &key_caches,
+                 std::vector<torch::Tensor> &value_caches,
+                 const std::map<int64_t, std::vector<int64_t>> &block_mapping) {
+  TORCH_CHECK(key_caches.size() == value_caches.size(),
+              "key_caches and value_caches must have the same length");
+  const int num_layers = key_caches.size();
+  if (num_layers == 0 || block_mapping.empty()) {
+    return;
+  }
+  torch::Device cache_device = key_caches[0].device();
+  TORCH_CHECK(cache_device.is_cuda());
+
+  // K and V caches are flattened into one list so that all the layers are copied in one launch.
+  std::vector<int64_t> cache_ptrs;
+  std::vector<int64_t> cache_row_bytes;
+  cache_ptrs.reserve(2 * num_layers);
+  cache_row_bytes.reserve(2 * num_layers);
+  for (auto *caches : {&key_caches, &value_caches}) {
+    for (auto &cache : *caches) {
+      TORCH_CHECK(cache.device() == cache_device, "all caches must be on the same device");
+      TORCH_CHECK(cache.dim() == 2 && cache.is_contiguous());
+      if (cache.size(0) == 0 || cache.size(1) == 0) {
+        continue; // e.g. a layer without streaming heads
+      }
+      cache_ptrs.push_back(reinterpret_cast<int64_t>(cache.data_ptr()));
+      cache_row_bytes.push_back(cache.element_size() * cache.size(1));
+    }
+  }
+  const int num_caches = cache_ptrs.size();
+
+  std::vector<int64_t> block_mapping_vec;
+  for (const auto &pair : block_mapping) {
+    const int64_t src_block_number = pair.first;
+    for (const int64_t dst_block_number : pair.second) {
+      block_mapping_vec.push_back(src_block_number);
+      block_mapping_vec.push_back(dst_block_number);
+    }
+  }
+  const int num_pairs = block_mapping_vec.size() / 2;
+  if (num_caches == 0 || num_pairs == 0) {
+    return;
+  }
+
+  // Pack the pointers, row widths and the mapping into a single H2D transfer.
+  std::vector<int64_t> packed;
+  packed.reserve(2 * num_caches + block_mapping_vec.size());
+  packed.insert(packed.end(), cache_ptrs.begin(), cache_ptrs.end());
+  packed.insert(packed.end(), cache_row_bytes.begin(), cache_row_bytes.end());
+  packed.insert(packed.end(), block_mapping_vec.begin(), block_mapping_vec.end());
+  torch::Tensor packed_tensor =
+      torch::from_blob(packed.data(), {static_cast<int64_t>(packed.size())}, torch::kInt64)
+          .to(cache_device);
+  int64_t *packed_ptr = packed_tensor.data_ptr<int64_t>();
+
+  int64_t max_row_bytes = *std::max_element(cache_row_bytes.begin(), cache_row_bytes.end());
+  dim3 grid(num_caches, num_pairs);
+  dim3 block(std::min<int64_t>(1024, std::max<int64_t>(32, max_row_bytes / sizeof(int4))));
+  const at::cuda::OptionalCUDAGuard device_guard(cache_device);
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  vllm::copy_blocks_kernel<<<grid, block, 0, stream>>>(
+      packed_ptr, packed_ptr + num_caches, packed_ptr + 2 * num_caches);
+}
+
+namespace vllm {
+
+// Grid: (ceil(num_entries / blockDim.x), num_layers). deltas is [3, num_entries]: the table positions of the
+// K and V pointers of every entry and its block number (see RaggedBlockTables in cache_engine.py). With a cold
+// tier, block numbers from num_gpu_blocks on are cold pages (block number - num_gpu_blocks in the host pool),
+// whose pointers are taken from cold_base_ptrs / cold_block_bytes instead.
+__global__ void scatter_block_table_entries_kernel(int64_t *__restrict__ tables,
+                                                   const int64_t table_stride,
+                                                   const int64_t *__restrict__ base_ptrs,
+                                                   const int64_t *__restrict__ block_bytes,
+                                                   const int64_t *__restrict__ cold_base_ptrs,
+                                                   const int64_t *__restrict__ cold_block_bytes,
+                                                   const int64_t num_gpu_blocks,
+                                                   const int64_t *__restrict__ deltas,
+                                                   const int num_entries,
+                                                   const int num_layers) {
+  const int layer_idx = blockIdx.y;
+  const int entry_idx = blockIdx.x * blockDim.x + threadIdx.x;
+  if (entry_idx >= num_entries) {
+    return;
+  }
+  int64_t *table = tables + layer_idx * table_stride;
+  int64_t block_number = deltas[2 * num_entries + entry_idx];
+  if (cold_base_ptrs != nullptr && block_number >= num_gpu_blocks) {
+    base_ptrs = cold_base_ptrs;
+    block_bytes = cold_block_bytes;
+    block_number -= num_gpu_blocks;
+  }
+  table[deltas[entry_idx]] = base_ptrs[layer_idx] + block_number * block_bytes[layer_idx];
+  table[deltas[num_entries + entry_idx]] =
+      base_ptrs[num_layers + layer_idx] + block_number * block_bytes[num_layers + layer_idx];
+}
+
+// Grid: (num_rows, num_layers). Every row of row_moves is (src start, dst start, number of blocks,
+// src capacity, dst capacity): the K pointers of a row start at its start, its V pointers one capacity later.
+__global__ void move_block_table_rows_kernel(int64_t *__restrict__ dst_tables,
+                                             const int64_t dst_stride,
+                                             const int64_t *__restrict__ src_tables,
+                                             const int64_t src_stride,
+                                             const int64_t *__restrict__ row_moves) {
+  const int64_t *move = row_moves + 5 * blockIdx.x;
+  const int64_t *src = src_tables + blockIdx.y * src_stride + move[0];
+  int64_t *dst = dst_tables + blockIdx.y * dst_stride + move[1];
+  for (int64_t i = threadIdx.x; i < move[2]; i += blockDim.x) {
+    dst[i] = src[i];
+    dst[move[4] + i] = src[move[3] + i];
+  }
+}
+
+// Grid: (batch_size, num_heads). Tiered KV cache (see RetrievalPageOffload in cache_engine.py): the V pointer of
+// a cold retrieval page points into the pinned host pool, its K pointer at the slot of its K stats on the device
+// (the selector only reads the stats). The first head that selects a cold page claims it (the V pointer is reset
+// to 0 meanwhile), copies its payload and scales to the next staging slot and redirects both pointers there. Once
+// the staging pool is full, the pointers are redirected to the host page, which the attention then reads directly
+// (pinned memory is device-accessible under UVA).
+template <int NUM_THREADS>
+__global__ void gather_offloaded_pages_kernel(int64_t *__restrict__ table,
+                                              const int *__restrict__ page_idxes,
+                                              const int *__restrict__ page_nums,
+                                              const int *__restrict__ context_lens,
+                                              const int max_pages,
+                                              const int tokens_per_block,
+                                              const int64_t host_k_base,
+                                              const int64_t host_v_base,
+                                              const int64_t host_k_bytes,
+                                              const int64_t host_v_bytes,
+                                              const int64_t num_host_blocks,
+                                              int8_t *__restrict__ staging_k,
+                                              int8_t *__restrict__ staging_v,
+                                              const int64_t staging_k_bytes,
+                                              const int64_t staging_v_bytes,
+                                              const int64_t copy_bytes,
+                                              int *__restrict__ num_staged,
+                                              const int capacity) {
+  const int batch_idx = blockIdx.x;
+  // Ragged layout, see KVBlockArray::getRowPtr.
+  const int64_t row_start = table[batch_idx];
+  const int64_t row_capacity = table[batch_idx + 1] - row_start;
+  int64_t *k_row = table + gridDim.x + 1 + row_start * 2;
+  int64_t *v_row = k_row + row_capacity;
+  const int num_pages = page_nums == nullptr ? max_pages : page_nums[batch_idx];
+  const int64_t num_blocks =
+      min(static_cast<int64_t>((context_lens[batch_idx] + tokens_per_block - 1) / tokens_per_block), row_capacity);
+  const int *pages = page_idxes + (static_cast<int64_t>(batch_idx) * gridDim.y + blockIdx.y) * max_pages;
+
+  __shared__ const int4 *s_src[2];
+  __shared__ int4 *s_dst[2];
+  for (int i = 0; i < num_pages; i++) {
+    if (threadIdx.x == 0) {
+      s_src[0] = nullptr;
+      const int page = pages[i];
+      const int64_t v_ptr = page >= 0 && page < num_blocks ? v_row[page] : 0;
+      if (v_ptr >= host_v_base && v_ptr < host_v_base + num_host_blocks * host_v_bytes &&
+          atomicCAS(reinterpret_cast<unsigned long long *>(v_row + page), static_cast<unsigned long long>(v_ptr),
+                    0ull) == static_cast<unsigned long long>(v_ptr)) {
+        const int64_t k_ptr = host_k_base + (v_ptr - host_v_base) / host_v_bytes * host_k_bytes;
+        const int slot = atomicAdd(num_staged, 1);
+        if (slot < capacity) {
+          s_src[0] = reinterpret_cast<const int4 *>(k_ptr);
+          s_src[1] = reinterpret_cast<const int4 *>(v_ptr);
+          s_dst[0] = reinterpret_cast<int4 *>(staging_k + slot * staging_k_bytes);
+          s_dst[1] = reinterpret_cast<int4 *>(staging_v + slot * staging_v_bytes);
+          k_row[page] = reinterpret_cast<int64_t>(s_dst[0]);
+          v_row[page] = reinterpret_cast<int64_t>(s_dst[1]);
+        } else {
+          k_row[page] = k_ptr;
+          v_row[page] = v_ptr;
+        }
+      }
+    }
+    __syncthreads();
+    if (s_src[0] != nullptr) {
+      // Both pointers are read by the attention kernel only, which runs after this one.
+      for (int64_t j = threadIdx.x; j < copy_bytes / static_cast<int64_t>(sizeof(int4)); j += NUM_THREADS) {
+        s_dst[0][j] = s_src[0][j];
+        s_dst[1][j] = s_src[1][j];
+      }
+    }
+    __syncthreads();
+  }
+}
+
+} // namespace vllm
+
+void scatter_block_table_entries(torch::Tensor &tables,
+                                 torch::Tensor &base_ptrs,
+                                 torch::Tensor &block_bytes,
+                                 torch::Tensor &deltas,
+                                 c10::optional<torch::Tensor> cold_base_ptrs,
+                                 c10::optional<torch::Tensor> cold_block_bytes,
+                                 const int64_t num_gpu_blocks) {
+  TORCH_CHECK(tables.is_cuda() && tables.dim() == 2 && tables.is_contiguous());
+  TORCH_CHECK(tables.scalar_type() == torch::kInt64);
+  const int num_layers = tables.size(0);
+  TORCH_CHECK(base_ptrs.device() == tables.device() && base_ptrs.numel() == 2 * num_layers && base_ptrs.is_contiguous());
+  TORCH_CHECK(block_bytes.device() == tables.device() && block_bytes.numel() == 2 * num_layers && block_bytes.is_contiguous());
+  TORCH_CHECK(deltas.device() == tables.device() && deltas.dim() == 2 && deltas.size(0) == 3 && deltas.is_contiguous());
+  TORCH_CHECK(cold_base_ptrs.has_value() == cold_block_bytes.has_value(),
+              "cold_base_ptrs and cold_block_bytes must be given together");
+  const int64_t *cold_base_ptrs_ptr = nullptr;
+  const int64_t *cold_block_bytes_ptr = nullptr;
+  if (cold_base_ptrs.has_value()) {
+    TORCH_CHECK(cold_base_ptrs->device() == tables.device() && cold_base_ptrs->numel() == 2 * num_layers &&
+                cold_base_ptrs->is_contiguous());
+    TORCH_CHECK(cold_block_bytes->device() == tables.device() && cold_block_bytes->numel() == 2 * num_layers &&
+                cold_block_bytes->is_contiguous());
+    TORCH_CHECK(num_gpu_blocks >= 0, "num_gpu_blocks is required with a cold tier");
+    cold_base_ptrs_ptr = cold_base_ptrs->data_ptr<int64_t>();
+    cold_block_bytes_ptr = cold_block_bytes->data_ptr<int64_t>();
+  }
+  const int num_entries = deltas.size(1);
+  if (num_entries == 0 || num_layers == 0) {
+    return;
+  }
+
+  dim3 block(128);
+  dim3 grid((num_entries + block.x - 1) / block.x, num_layers);
+  const at::cuda::OptionalCUDAGuard device_guard(tables.device());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  vllm::scatter_block_table_entries_kernel<<<grid, block, 0, stream>>>(
+      tables.data_ptr<int64_t>(), tables.stride(0), base_ptrs.data_ptr<int64_t>(),
+      block_bytes.data_ptr<int64_t>(), cold_base_ptrs_ptr, cold_block_bytes_ptr, num_gpu_blocks,
+      deltas.data_ptr<int64_t>(), num_entries, num_layers);
+}
+
+void move_block_table_rows(torch::Tensor &dst_tables,
+                           torch::Tensor &src_tables,
+                           torch::Tensor &row_moves) {
+  TORCH_CHECK(dst_tables.is_cuda() && dst_tables.dim() == 2 && dst_tables.is_contiguous());
+  TORCH_CHECK(src_tables.device() == dst_tables.device() && src_tables.dim() == 2 && src_tables.is_contiguous());
+  TORCH_CHECK(dst_tables.size(0) == src_tables.size(0), "src and dst tables must have the same number of layers");
+  TORCH_CHECK(row_moves.device() == dst_tables.device() && row_moves.dim() == 2 && row_moves.size(1) == 5 &&
+              row_moves.is_contiguous());
+  const int num_rows = row_moves.size(0);
+  const int num_layers = dst_tables.size(0);
+  if (num_rows == 0 || num_layers == 0) {
+    return;
+  }
+
+  dim3 grid(num_rows, num_layers);
+  dim3 block(128);
+  const at::cuda::OptionalCUDAGuard device_guard(dst_tables.device());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  vllm::move_block_table_rows_kernel<<<grid, block, 0, stream>>>(
+      dst_tables.data_ptr<int64_t>(), dst_tables.stride(0), src_tables.data_ptr<int64_t>(),
+      src_tables.stride(0), row_moves.data_ptr<int64_t>());
+}
+
+void gather_offloaded_pages(torch::Tensor &table,
+                            torch::Tensor &page_idxes,
+                            c10::optional<torch::Tensor> page_nums,
+                            torch::Tensor &context_lens,
+                            const int tokens_per_block,
+                            torch::Tensor &host_key_cache,
+                            torch::Tensor &host_value_cache,
+                            torch::Tensor &staging_key,
+                            torch::Tensor &staging_value,
+                            torch::Tensor &num_staged,
+                            const int64_t copy_bytes) {
+  TORCH_CHECK(table.is_cuda() && table.dim() == 1 && table.is_contiguous() && table.scalar_type() == torch::kInt64);
+  TORCH_CHECK(page_idxes.device() == table.device() && page_idxes.dim() == 3 && page_idxes.is_contiguous() &&
+              page_idxes.scalar_type() == torch::kInt32);
+  const int batch_size = page_idxes.size(0);
+  const int num_heads = page_idxes.size(1);
+  const int max_pages = page_idxes.size(2);
+  TORCH_CHECK(context_lens.device() == table.device() && context_lens.numel() == batch_size &&
+              context_lens.scalar_type() == torch::kInt32);
+  const int *page_nums_ptr = nullptr;
+  if (page_nums.has_value()) {
+    TORCH_CHECK(page_nums->device() == table.device() && page_nums->numel() == batch_size &&
+                page_nums->scalar_type() == torch::kInt32);
+    page_nums_ptr = page_nums->data_ptr<int>();
+  }
+  TORCH_CHECK(host_key_cache.is_pinned() && host_value_cache.is_pinned(), "the host pool must be pinned");
+  TORCH_CHECK(host_key_cache.dim() == 2 && host_value_cache.dim() == 2 &&
+              host_key_cache.size(0) == host_value_cache.size(0));
+  TORCH_CHECK(staging_key.device() == table.device() && staging_value.device() == table.device() &&
+              staging_key.dim() == 2 && staging_value.dim() == 2 && staging_key.size(0) == staging_value.size(0));
+  TORCH_CHECK(num_staged.device() == table.device() && num_staged.numel() == 1 &&
+              num_staged.scalar_type() == torch::kInt32);
+  const int64_t host_k_bytes = host_key_cache.stride(0) * host_key_cache.element_size();
+  const int64_t host_v_bytes = host_value_cache.stride(0) * host_value_cache.element_size();
+  const int64_t staging_k_bytes = staging_key.stride(0) * staging_key.element_size();
+  const int64_t staging_v_bytes = staging_value.stride(0) * staging_value.element_size();
+  TORCH_CHECK(copy_bytes % sizeof(int4) == 0 && copy_bytes <= std::min(host_v_bytes, host_k_bytes) &&
+              copy_bytes <= std::min(staging_k_bytes, staging_v_bytes));
+  TORCH_CHECK(host_k_bytes % sizeof(int4) == 0 && host_v_bytes % sizeof(int4) == 0 &&
+              staging_k_bytes % sizeof(int4) == 0 && staging_v_bytes % sizeof(int4) == 0);
+  if (batch_size == 0 || num_heads == 0 || max_pages == 0) {
+    return;
+  }
+
+  constexpr int kNumThreads = 256;
+  dim3 grid(batch_size, num_heads);
+  const at::cuda::OptionalCUDAGuard device_guard(table.device());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  vllm::gather_offloaded_pages_kernel<kNumThreads><<<grid, kNumThreads, 0, stream>>>(
+      table.data_ptr<int64_t>(), page_idxes.data_ptr<int>(), page_nums_ptr, context_lens.data_ptr<int>(), max_pages,
+      tokens_per_block, reinterpret_cast<int64_t>(host_key_cache.data_ptr()),
+      reinterpret_cast<int64_t>(host_value_cache.data_ptr()), host_k_bytes, host_v_bytes, host_key_cache.size(0),
+      reinterpret_cast<int8_t *>(staging_key.data_ptr()), reinterpret_cast<int8_t *>(staging_value.data_ptr()),
+      staging_k_bytes, staging_v_bytes, copy_bytes, num_staged.data_ptr<int>(), staging_key.size(0));
+}
@@ -13,6 +13,7 @@
 // }
 #include <torch/extension.h>
 #include <cuda_fp16.h>
+#include "nvtx_utils.h"
 
 void invoke_dequant_add_residual(
     torch::Tensor &out,      // [..., hidden_size]
@@ -51,26 +52,26 @@ void invoke_quant_fuse_sum(torch::Tensor &out,   // [..., hidden_size]
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("invoke_dequant_add_residual",
-        py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
-                          at::Half>(&invoke_dequant_add_residual),
+        omniserve::nvtx_wrap("invoke_dequant_add_residual", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
+                          at::Half>(&invoke_dequant_add_residual)),
         "Add the dequanted result and residual.");
   m.def("invoke_dequant_add_residual",
-        py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
-                          torch::Tensor &>(&invoke_dequant_add_residual),
+        omniserve::nvtx_wrap("invoke_dequant_add_residual", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
+                          torch::Tensor &>(&invoke_dequant_add_residual)),
         "Add the dequanted result and residual.");
-  m.def("invoke_dequant", &invoke_dequant, "Dequant.");
+  m.def("invoke_dequant", omniserve::nvtx_wrap("invoke_dequant", &invoke_dequant), "Dequant.");
   m.def(
       "invoke_quant",
-      py::overload_cast<torch::Tensor &, torch::Tensor &, at::Half>(&invoke_quant),
+      omniserve::nvtx_wrap("invoke_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, at::Half>(&invoke_quant)),
       "Quant.");
-  m.def("invoke_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &>(
-      &invoke_quant),
+  m.def("invoke_quant", omniserve::nvtx_wrap("invoke_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &>(
+      &invoke_quant)),
       "Quant.");
   m.def(
       "invoke_quant_fuse_sum",
-      py::overload_cast<torch::Tensor &, torch::Tensor &, at::Half, at::Half>(&invoke_quant_fuse_sum),
+      omniserve::nvtx_wrap("invoke_quant_fuse_sum", py::overload_cast<torch::Tensor &, torch::Tensor &, at::Half, at::Half>(&invoke_quant_fuse_sum)),
       "Quant & get input sum.");
-  m.def("invoke_quant_fuse_sum", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &, torch::Tensor &>(
-      &invoke_quant_fuse_sum),
+  m.def("invoke_quant_fuse_sum", omniserve::nvtx_wrap("invoke_quant_fuse_sum", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &, torch::Tensor &>(
+      &invoke_quant_fuse_sum)),
       "Quant & get input sum.");
 }
@@ -156,6 +156,33 @@ namespace mmha
         using type = int64_t;
     };
 
+#ifdef ENABLE_FP8
+    // FP8 (E4M3) KV cache: packed into the same integer storage as the int8 cache.
+    template <>
+    struct packed_type<__nv_fp8_e4m3, 1>
+    {
+        using type = int8_t;
+    };
+
+    template <>
+    struct packed_type<__nv_fp8_e4m3, 2>
+    {
+        using type = int16_t;
+    };
+
+    template <>
+    struct packed_type<__nv_fp8_e4m3, 4>
+    {
+        using type = int32_t;
+    };
+
+    template <>
+    struct packed_type<__nv_fp8_e4m3, 8>
+    {
+        using type = int64_t;
+    };
+#endif // ENABLE_FP8
+
     template <>
     struct packed_type<uint16_t, 2>
     {
@@ -1149,9 +1176,18 @@ namespace mmha
         }
     }
 
-    inline __device__ float2 rotary_embedding_coefficient(
-        const int zid, const int rot_embed_dim, const float base, const float scale, const float t_step)
+    // rotary_cos_sin: optional [max_positions, rot_embed_dim / 2] table of (cos, sin) with the frequency scaling
+    // (linear / llama3 / YaRN) baked in, see omniserve/modeling/layers/rotary_embedding.py. With it, base and
+    // scale are ignored and no transcendental is evaluated.
+    inline __device__ float2 rotary_embedding_coefficient(const int zid, const int rot_embed_dim, const float base,
+        const float scale, const float t_step, const float2 *rotary_cos_sin = nullptr)
     {
+        if (rotary_cos_sin != nullptr)
+        {
+            // Out-of-range pairs (masked by the callers) must not read past the row.
+            return zid < rot_embed_dim ? rotary_cos_sin[static_cast<int64_t>(t_step) * (rot_embed_dim / 2) + zid / 2]
+                                       : make_float2(1.f, 0.f);
+        }
         const float inv_freq = (t_step * scale) / pow(base, zid / (float)rot_embed_dim);
         return {cos(inv_freq), sin(inv_freq)};
     }
@@ -1171,42 +1207,47 @@ namespace mmha
         return float2_to_half2(rot_fv);
     }
 
-    inline __device__ void apply_rotary_embedding(float &q, int zid, int rot_embed_dim, float base, float scale, int t_step)
+    inline __device__ void apply_rotary_embedding(float &q, int zid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         return;
     }
 
     inline __device__ void apply_rotary_embedding(
-        float &q, float &k, int zid, int rot_embed_dim, float base, float scale, int t_step)
+        float &q, float &k, int zid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         return;
     }
 
     inline __device__ void apply_rotary_embedding(
-        float2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        float2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (2 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q = rotary_embedding_transform(q, coef);
     }
 
     inline __device__ void apply_rotary_embedding(
-        float2 &q, float2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        float2 &q, float2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (2 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q = rotary_embedding_transform(q, coef);
         k = rotary_embedding_transform(k, coef);
     }
 
     inline __device__ void apply_rotary_embedding(
-        float4 &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        float4 &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (4 * tid >= rot_embed_dim)
         {
@@ -1214,14 +1255,15 @@ namespace mmha
         }
 
         Float4_ &q_ = *reinterpret_cast<Float4_ *>(&q);
-        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q_.x = rotary_embedding_transform(q_.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q_.y = rotary_embedding_transform(q_.y, coef1);
     }
 
     inline __device__ void apply_rotary_embedding(
-        float4 &q, float4 &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        float4 &q, float4 &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (4 * tid >= rot_embed_dim)
         {
@@ -1230,109 +1272,117 @@ namespace mmha
 
         Float4_ &q_ = *reinterpret_cast<Float4_ *>(&q);
         Float4_ &k_ = *reinterpret_cast<Float4_ *>(&k);
-        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q_.x = rotary_embedding_transform(q_.x, coef0);
         k_.x = rotary_embedding_transform(k_.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q_.y = rotary_embedding_transform(q_.y, coef1);
         k_.y = rotary_embedding_transform(k_.y, coef1);
     }
 
     inline __device__ void apply_rotary_embedding(
-        uint32_t &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        uint32_t &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (2 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q = rotary_embedding_transform(q, coef);
     }
 
     inline __device__ void apply_rotary_embedding(
-        uint32_t &q, uint32_t &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        uint32_t &q, uint32_t &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (2 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef = rotary_embedding_coefficient(2 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q = rotary_embedding_transform(q, coef);
         k = rotary_embedding_transform(k, coef);
     }
 
-    inline __device__ void apply_rotary_embedding(half2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+    inline __device__ void apply_rotary_embedding(half2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
-        return apply_rotary_embedding(*reinterpret_cast<uint32_t *>(&q), tid, rot_embed_dim, base, scale, t_step);
+        return apply_rotary_embedding(*reinterpret_cast<uint32_t *>(&q), tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
     }
 
     inline __device__ void apply_rotary_embedding(
-        half2 &q, half2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        half2 &q, half2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         return apply_rotary_embedding(
-            *reinterpret_cast<uint32_t *>(&q), *reinterpret_cast<uint32_t *>(&k), tid, rot_embed_dim, base, scale, t_step);
+            *reinterpret_cast<uint32_t *>(&q), *reinterpret_cast<uint32_t *>(&k), tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
     }
 
-    inline __device__ void apply_rotary_embedding(uint2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+    inline __device__ void apply_rotary_embedding(uint2 &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (4 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.x = rotary_embedding_transform(q.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.y = rotary_embedding_transform(q.y, coef1);
     }
 
     inline __device__ void apply_rotary_embedding(
-        uint2 &q, uint2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        uint2 &q, uint2 &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (4 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(4 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.x = rotary_embedding_transform(q.x, coef0);
         k.x = rotary_embedding_transform(k.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(4 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.y = rotary_embedding_transform(q.y, coef1);
         k.y = rotary_embedding_transform(k.y, coef1);
     }
 
-    inline __device__ void apply_rotary_embedding(uint4 &q, int tid, int rot_embed_dim, float base, float scale, int t_step)
+    inline __device__ void apply_rotary_embedding(uint4 &q, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (8 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef0 = rotary_embedding_coefficient(8 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(8 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.x = rotary_embedding_transform(q.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(8 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(8 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.y = rotary_embedding_transform(q.y, coef1);
-        const auto coef2 = rotary_embedding_coefficient(8 * tid + 4, rot_embed_dim, base, scale, t_step);
+        const auto coef2 = rotary_embedding_coefficient(8 * tid + 4, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.z = rotary_embedding_transform(q.z, coef2);
-        const auto coef3 = rotary_embedding_coefficient(8 * tid + 6, rot_embed_dim, base, scale, t_step);
+        const auto coef3 = rotary_embedding_coefficient(8 * tid + 6, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.w = rotary_embedding_transform(q.w, coef3);
     }
 
     inline __device__ void apply_rotary_embedding(
-        uint4 &q, uint4 &k, int tid, int rot_embed_dim, float base, float scale, int t_step)
+        uint4 &q, uint4 &k, int tid, int rot_embed_dim, float base, float scale, int t_step,
+        const float2 *rotary_cos_sin = nullptr)
     {
         if (8 * tid >= rot_embed_dim)
         {
             return;
         }
-        const auto coef0 = rotary_embedding_coefficient(8 * tid, rot_embed_dim, base, scale, t_step);
+        const auto coef0 = rotary_embedding_coefficient(8 * tid, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.x = rotary_embedding_transform(q.x, coef0);
         k.x = rotary_embedding_transform(k.x, coef0);
-        const auto coef1 = rotary_embedding_coefficient(8 * tid + 2, rot_embed_dim, base, scale, t_step);
+        const auto coef1 = rotary_embedding_coefficient(8 * tid + 2, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.y = rotary_embedding_transform(q.y, coef1);
         k.y = rotary_embedding_transform(k.y, coef1);
-        const auto coef2 = rotary_embedding_coefficient(8 * tid + 4, rot_embed_dim, base, scale, t_step);
+        const auto coef2 = rotary_embedding_coefficient(8 * tid + 4, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.z = rotary_embedding_transform(q.z, coef2);
         k.z = rotary_embedding_transform(k.z, coef2);
-        const auto coef3 = rotary_embedding_coefficient(8 * tid + 6, rot_embed_dim, base, scale, t_step);
+        const auto coef3 = rotary_embedding_coefficient(8 * tid + 6, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         q.w = rotary_embedding_transform(q.w, coef3);
         k.w = rotary_embedding_transform(k.w, coef3);
     }
@@ -2059,6 +2109,87 @@ inline __device__ Float8_ float_from_int4(int32_t u)
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef ENABLE_FP8
+    // E4M3 values scaled by (kv_cache_8bits_max / absmax); the conversion saturates to +-448.
+    inline __device__ int16_t cast_to_fp8_e4m3(float2 val)
+    {
+        __nv_fp8x2_e4m3 out(val);
+        return *reinterpret_cast<int16_t *>(&out);
+    }
+
+    inline __device__ int32_t cast_to_fp8_e4m3(float4 val)
+    {
+        union
+        {
+            int16_t int16[2];
+            int32_t int32;
+        };
+
+        int16[0] = cast_to_fp8_e4m3(make_float2(val.x, val.y));
+        int16[1] = cast_to_fp8_e4m3(make_float2(val.z, val.w));
+        return int32;
+    }
+
+    inline __device__ int64_t cast_to_fp8_e4m3(Float8_ val)
+    {
+        union
+        {
+            int16_t int16[4];
+            int64_t int64;
+        };
+
+        int16[0] = cast_to_fp8_e4m3(val.x);
+        int16[1] = cast_to_fp8_e4m3(val.y);
+        int16[2] = cast_to_fp8_e4m3(val.z);
+        int16[3] = cast_to_fp8_e4m3(val.w);
+        return int64;
+    }
+
+    inline __device__ float2 float_from_fp8_e4m3(int16_t u)
+    {
+        return static_cast<float2>(*reinterpret_cast<const __nv_fp8x2_e4m3 *>(&u));
+    }
+
+    inline __device__ float4 float_from_fp8_e4m3(int32_t u)
+    {
+        union
+        {
+            int32_t int32;
+            int16_t int16[2];
+        };
+
+        int32 = u;
+        float2 lo = float_from_fp8_e4m3(int16[0]);
+        float2 hi = float_from_fp8_e4m3(int16[1]);
+        return make_float4(lo.x, lo.y, hi.x, hi.y);
+    }
+
+    inline __device__ Float8_ float_from_fp8_e4m3(int64_t u)
+    {
+        union
+        {
+            int64_t int64;
+            int16_t int16[4];
+        };
+
+        int64 = u;
+        return Float8_{float_from_fp8_e4m3(int16[0]), float_from_fp8_e4m3(int16[1]),
+                       float_from_fp8_e4m3(int16[2]), float_from_fp8_e4m3(int16[3])};
+    }
+
+    template <typename Vec_k>
+    inline __device__ void store_8bits_kv_cache_vec(__nv_fp8_e4m3 *pointer, const Vec_k &vec, int idx, float scale)
+    {
+        using Packed_8bits_t = typename packed_type<__nv_fp8_e4m3, num_elems<Vec_k>::value>::type;
+        using Packed_Float_t = typename packed_type<float, num_elems<Vec_k>::value>::type;
+        Packed_8bits_t out_quant = cast_to_fp8_e4m3(mul<Packed_Float_t>(scale, convert_to_float(vec)));
+
+        *reinterpret_cast<Packed_8bits_t *>(&pointer[idx]) = out_quant;
+    }
+#endif // ENABLE_FP8
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////
 
     template <typename Vec_k>
@@ -2091,6 +2222,13 @@ inline __device__ Float8_ float_from_int4(int32_t u)
             using Packed_Float_t = typename packed_type<float, num_elems<Vec_out>::value>::type;
             convert_from_float(vec_o, mul<Packed_Float_t>(scale, float_from_int8(vec_i)));
         }
+#ifdef ENABLE_FP8
+        else if constexpr (std::is_same<T_cache, __nv_fp8_e4m3>::value)
+        {
+            using Packed_Float_t = typename packed_type<float, num_elems<Vec_out>::value>::type;
+            convert_from_float(vec_o, mul<Packed_Float_t>(scale, float_from_fp8_e4m3(vec_i)));
+        }
+#endif // ENABLE_FP8
         else
         {
             ; // not supported.
@@ -2238,6 +2376,21 @@ inline __device__ Float8_ float_from_int4(int32_t u)
     {
         using Type = float;
     };
+
+    // Largest magnitude of the 8-bit KV cache type; the per-token-head scale is absmax / value.
+    template <typename T_cache>
+    struct kv_cache_8bits_max
+    {
+        static constexpr float value = 127.f;
+    };
+
+#ifdef ENABLE_FP8
+    template <>
+    struct kv_cache_8bits_max<__nv_fp8_e4m3>
+    {
+        static constexpr float value = 448.f;
+    };
+#endif // ENABLE_FP8
     ////////////////////////////////////////////////////////////////////////////////////////////////////
 
     template <typename Vec_T, typename T>
@@ -2539,10 +2692,11 @@ inline __device__ Float8_ float_from_int4(int32_t u)
     ////////////////////////////////////////////////////////////////////////////////////////////////////
 
     inline __device__ void apply_rotary_embedding(uint32_t &q, uint32_t q_pair, uint32_t &k, uint32_t k_pair, int tid0,
-                                                  int tid1, int rot_embed_dim, float base, float scale, int t_step, int first_half)
+                                                  int tid1, int rot_embed_dim, float base, float scale, int t_step, int first_half,
+                                                  const float2 *rotary_cos_sin = nullptr)
     {
-        const float2 coef0 = rotary_embedding_coefficient(tid0, rot_embed_dim, base, scale, t_step);
-        const float2 coef1 = rotary_embedding_coefficient(tid1, rot_embed_dim, base, scale, t_step);
+        const float2 coef0 = rotary_embedding_coefficient(tid0, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
+        const float2 coef1 = rotary_embedding_coefficient(tid1, rot_embed_dim, base, scale, t_step, rotary_cos_sin);
         float2 cos = make_float2(coef0.x, coef1.x);
         float2 sin = make_float2(coef0.y, coef1.y);
         float2 q_, k_;
@@ -2563,7 +2717,8 @@ inline __device__ Float8_ float_from_int4(int32_t u)
 
     template <typename Vec_type, typename Packed_type, typename T>
     inline __device__ void apply_rotary_embedding_gptneox(Vec_type &q, Vec_type &k, int tidx, int rotary_embedding_dim,
-                                                          float rotary_embedding_base, float rotary_embedding_scale, int t_step, bool first_half)
+                                                          float rotary_embedding_base, float rotary_embedding_scale, int t_step, bool first_half,
+                                                          const float2 *rotary_cos_sin = nullptr)
     {
         // 32 threads: each hold VEC_SIZE elements (half)
         Vec_type q_pair, k_pair;
@@ -2607,7 +2762,7 @@ inline __device__ Float8_ float_from_int4(int32_t u)
             Packed_type k_pair_ = reinterpret_cast<Packed_type *>(&k_pair)[elt_id];
 
             apply_rotary_embedding(q_, q_pair_, k_, k_pair_, rotary_emd_pos0_id, rotary_emd_pos1_id, rotary_embedding_dim,
-                                   rotary_embedding_base, rotary_embedding_scale, t_step, first_half);
+                                   rotary_embedding_base, rotary_embedding_scale, t_step, first_half, rotary_cos_sin);
 
             if (valid_rotary_pos)
             {
@@ -12,6 +12,7 @@
 //   year={2025}
 // }
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
 
 __global__ void computePaddingOffsets(int *paddingOffsets, const int *seqOffsets, int maxSeqLength)
 {
@@ -43,8 +44,131 @@ torch::Tensor compute_padding_offsets(torch::Tensor &cu_seqlens,
         torch::TensorOptions().dtype(torch::kInt32).device(cu_seqlens.device());
     at::Tensor padding_offsets =
         torch::empty({tot_num_tokens}, options);
-    computePaddingOffsets<<<batch_size, 256>>>(
+    const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    computePaddingOffsets<<<batch_size, 256, 0, stream>>>(
         padding_offsets.data_ptr<int>(), cu_seqlens.data_ptr<int>(),
         max_seqlen);
     return padding_offsets;
 }
+
+__device__ __forceinline__ void expandBlockPointers(int64_t *ptrs, const int64_t *blocks, const int64_t *basePtrs,
+                                                    const int64_t *blockBytes, int batchIdx, int batchSize,
+                                                    int maxBlocks, int numLayers)
+{
+    // ptrs is [layers, B, 2, M]; basePtrs / blockBytes are [2, layers].
+    for (int idx = threadIdx.x; idx < numLayers * 2 * maxBlocks; idx += blockDim.x)
+    {
+        int layerIdx = idx / (2 * maxBlocks);
+        int kvIdx = idx / maxBlocks % 2;
+        int pageIdx = idx % maxBlocks;
+        ptrs[((int64_t)(layerIdx * batchSize + batchIdx) * 2 + kvIdx) * maxBlocks + pageIdx] =
+            basePtrs[kvIdx * numLayers + layerIdx]
+            + blocks[(int64_t)batchIdx * maxBlocks + pageIdx] * blockBytes[kvIdx * numLayers + layerIdx];
+    }
+}
+
+__global__ void expandPromptMetadata(const int64_t *lens, int *lens32, int *cuSeqlens, int *paddingOffsets,
+                                     int maxSeqLength, int numLayers,
+                                     const int64_t *retrievalBlocks, const int64_t *retrievalBasePtrs,
+                                     const int64_t *retrievalBlockBytes, int64_t *retrievalPtrs, int retrievalMaxBlocks,
+                                     const int64_t *streamingBlocks, const int64_t *streamingBasePtrs,
+                                     const int64_t *streamingBlockBytes, int64_t *streamingPtrs, int streamingMaxBlocks)
+{
+    // The index of the sequence in the batch.
+    int batchIdx = blockIdx.x;
+    int batchSize = gridDim.x;
+
+    // The beginning of the sequence: the sum of the lengths of the previous sequences.
+    __shared__ int seqBeginSmem;
+    if (threadIdx.x == 0)
+    {
+        seqBeginSmem = 0;
+    }
+    __syncthreads();
+    int partial = 0;
+    for (int i = threadIdx.x; i < batchIdx; i += blockDim.x)
+    {
+        partial += (int)lens[i];
+    }
+#pragma unroll
+    for (int mask = 16; mask > 0; mask >>= 1)
+    {
+        partial += __shfl_xor_sync(0xffffffff, partial, mask);
+    }
+    if ((threadIdx.x & 31) == 0 && partial != 0)
+    {
+        atomicAdd(&seqBeginSmem, partial);
+    }
+    __syncthreads();
+    int seqBegin = seqBeginSmem;
+    // The length of the sequence.
+    int seqLength = (int)lens[batchIdx];
+
+    if (threadIdx.x < 3)
+    {
+        lens32[threadIdx.x * batchSize + batchIdx] = (int)lens[threadIdx.x * batchSize + batchIdx];
+    }
+    if (threadIdx.x == 0)
+    {
+        if (batchIdx == 0)
+        {
+            cuSeqlens[0] = 0;
+        }
+        cuSeqlens[batchIdx + 1] = seqBegin + seqLength;
+    }
+
+    // The number of padded tokens in the previous sequences.
+    int paddingOffset = batchIdx * maxSeqLength - seqBegin;
+
+    // Iterate over the tokens to update the number of padded elements.
+    for (int tokenIdx = threadIdx.x; tokenIdx < seqLength; tokenIdx += blockDim.x)
+    {
+        paddingOffsets[seqBegin + tokenIdx] = paddingOffset;
+    }
+
+    expandBlockPointers(retrievalPtrs, retrievalBlocks, retrievalBasePtrs, retrievalBlockBytes, batchIdx, batchSize,
+                        retrievalMaxBlocks, numLayers);
+    if (streamingBlocks != nullptr)
+    {
+        expandBlockPointers(streamingPtrs, streamingBlocks, streamingBasePtrs, streamingBlockBytes, batchIdx,
+                            batchSize, streamingMaxBlocks, numLayers);
+    }
+}
+
+std::vector<torch::Tensor> expand_prompt_metadata(torch::Tensor &lens, int max_seqlen, int tot_num_tokens,
+                                                  torch::Tensor &retrieval_blocks,
+                                                  torch::Tensor &retrieval_base_ptrs,
+                                                  torch::Tensor &retrieval_block_bytes,
+                                                  c10::optional<torch::Tensor> streaming_blocks_,
+                                                  c10::optional<torch::Tensor> streaming_base_ptrs_,
+                                                  c10::optional<torch::Tensor> streaming_block_bytes_)
+{
+    TORCH_CHECK(lens.scalar_type() == torch::kInt64 && lens.dim() == 2 && lens.size(0) == 3,
+                "lens must be int64 [3, batch]");
+    TORCH_CHECK(lens.is_contiguous() && retrieval_blocks.is_contiguous(), "packed metadata must be contiguous");
+    int batch_size = lens.size(1);
+    int num_layers = retrieval_base_ptrs.size(1);
+    int retrieval_max_blocks = retrieval_blocks.size(1);
+    bool has_streaming = streaming_blocks_.has_value();
+    int streaming_max_blocks = has_streaming ? streaming_blocks_.value().size(1) : 0;
+
+    auto int_options = torch::TensorOptions().dtype(torch::kInt32).device(lens.device());
+    auto long_options = torch::TensorOptions().dtype(torch::kInt64).device(lens.device());
+    at::Tensor lens32 = torch::empty({3, batch_size}, int_options);
+    at::Tensor cu_seqlens = torch::empty({batch_size + 1}, int_options);
+    at::Tensor padding_offsets = torch::empty({tot_num_tokens}, int_options);
+    at::Tensor retrieval_ptrs = torch::empty({num_layers, batch_size, 2, retrieval_max_blocks}, long_options);
+    at::Tensor streaming_ptrs = torch::empty({num_layers, batch_size, 2, streaming_max_blocks}, long_options);
+
+    const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    expandPromptMetadata<<<batch_size, 256, 0, stream>>>(
+        lens.data_ptr<int64_t>(), lens32.data_ptr<int>(), cu_seqlens.data_ptr<int>(), padding_offsets.data_ptr<int>(),
+        max_seqlen, num_layers,
+        retrieval_blocks.data_ptr<int64_t>(), retrieval_base_ptrs.data_ptr<int64_t>(),
+        retrieval_block_bytes.data_ptr<int64_t>(), retrieval_ptrs.data_ptr<int64_t>(), retrieval_max_blocks,
+        has_streaming ? streaming_blocks_.value().data_ptr<int64_t>() : nullptr,
+        has_streaming ? streaming_base_ptrs_.value().data_ptr<int64_t>() : nullptr,
+        has_streaming ? streaming_block_bytes_.value().data_ptr<int64_t>() : nullptr,
+        has_streaming ? streaming_ptrs.data_ptr<int64_t>() : nullptr, streaming_max_blocks);
+    return {lens32, cu_seqlens, padding_offsets, retrieval_ptrs, streaming_ptrs};
+}
@@ -16,3 +16,16 @@
 
 torch::Tensor compute_padding_offsets(torch::Tensor &cu_seqlens,
                                       int max_seqlen, int tot_num_tokens);
+
+// Expands the prompt metadata uploaded by a single packed H2D copy (see PinnedStagingRing in
+// omniserve/utils/utils.py). `lens` is int64 [3, B] (new tokens, streaming lengths, prompt KV lengths), the block
+// tables int64 [B, M] block numbers and the base pointers / block strides int64 [2, layers] (K, V). Returns the
+// int32 lens [3, B], cu_seqlens [B + 1], padding offsets [tot_num_tokens] and the retrieval / streaming pointer
+// tables [layers, B, 2, M] (the streaming one is empty without streaming tables).
+std::vector<torch::Tensor> expand_prompt_metadata(torch::Tensor &lens, int max_seqlen, int tot_num_tokens,
+                                                  torch::Tensor &retrieval_blocks,
+                                                  torch::Tensor &retrieval_base_ptrs,
+                                                  torch::Tensor &retrieval_block_bytes,
+                                                  c10::optional<torch::Tensor> streaming_blocks_,
+                                                  c10::optional<torch::Tensor> streaming_base_ptrs_,
+                                                  c10::optional<torch::Tensor> streaming_block_bytes_);
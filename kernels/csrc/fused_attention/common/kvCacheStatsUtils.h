@@ -0,0 +1,207 @@
+// Implemented by Shang Yang and Haotian Tang.
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Sub-chunk min/max K statistics maintained by the update-KV-cache kernels (see KVBlockArray::getKStatsMaxPtr).
+// Several warps write the tokens of one sub-chunk, so the stats are merged with fp16 atomics after a reset pass.
+// The per-page K/V scales of the per-tensor kernels (see KVBlockArray::getPageAbsmaxPtr) are maintained the same way.
+#pragma once
+
+#include <cuda_fp16.h>
+#include <cuda_runtime.h>
+#include "kvCacheUtils.h"
+
+namespace mmha
+{
+
+// fp16 min / max through a 32-bit CAS on the packed pair (no native fp16 atomicMax / atomicMin).
+inline __device__ void atomic_hmax2(half2 *address, half2 val)
+{
+    unsigned int *address_as_uint = reinterpret_cast<unsigned int *>(address);
+    unsigned int old = *address_as_uint, assumed;
+    do
+    {
+        assumed = old;
+        half2 res = __hmax2(*reinterpret_cast<half2 *>(&assumed), val);
+        unsigned int res_as_uint = *reinterpret_cast<unsigned int *>(&res);
+        if (res_as_uint == assumed)
+            break;
+        old = atomicCAS(address_as_uint, assumed, res_as_uint);
+    } while (assumed != old);
+}
+
+inline __device__ void atomic_hmin2(half2 *address, half2 val)
+{
+    unsigned int *address_as_uint = reinterpret_cast<unsigned int *>(address);
+    unsigned int old = *address_as_uint, assumed;
+    do
+    {
+        assumed = old;
+        half2 res = __hmin2(*reinterpret_cast<half2 *>(&assumed), val);
+        unsigned int res_as_uint = *reinterpret_cast<unsigned int *>(&res);
+        if (res_as_uint == assumed)
+            break;
+        old = atomicCAS(address_as_uint, assumed, res_as_uint);
+    } while (assumed != old);
+}
+
+// Merges the (fp16) key vector k into the sub-chunk stats of its token. stats_offset is the offset of k inside
+// the indicator of the sub-chunk (head_rank * head_dim + channel).
+template <typename Vec_type, typename KVCacheBuffer>
+inline __device__ void update_k_stats_atomic(KVCacheBuffer &kvCacheBuffer, void *kBlockPtr, const int num_heads,
+                                             const int token_idx, const int stats_offset, const Vec_type &k)
+{
+    static_assert(sizeof(Vec_type) % sizeof(half2) == 0, "The K stats are updated by half2.");
+    const int sub_chunk_idx = kvCacheBuffer.getLocalIdx(token_idx) / kvCacheBuffer.tokensPerSubChunk;
+    const int offset = sub_chunk_idx * kvCacheBuffer.mElesPerIndicator + stats_offset;
+    half2 *max_ptr = reinterpret_cast<half2 *>(kvCacheBuffer.getKStatsMaxPtr(kBlockPtr, num_heads) + offset);
+    half2 *min_ptr = reinterpret_cast<half2 *>(kvCacheBuffer.getKStatsMinPtr(kBlockPtr, num_heads) + offset);
+    const half2 *k_ptr = reinterpret_cast<const half2 *>(&k);
+#pragma unroll
+    for (int i = 0; i < sizeof(Vec_type) / sizeof(half2); i++)
+    {
+        atomic_hmax2(max_ptr + i, k_ptr[i]);
+        atomic_hmin2(min_ptr + i, k_ptr[i]);
+    }
+}
+
+// Merges k into the stats of its super-page (behind the sub-chunk stats of the first page of the super-page,
+// see KVBlockArray::getKSuperStatsMaxPtr), so prefill needs no separate super-page pooling pass.
+template <typename Vec_type, typename KVCacheBuffer>
+inline __device__ void update_k_super_stats_atomic(KVCacheBuffer &kvCacheBuffer, const int batch_idx, const int num_heads,
+                                                   const int token_idx, const int stats_offset, const Vec_type &k)
+{
+    static_assert(sizeof(Vec_type) % sizeof(half2) == 0, "The K stats are updated by half2.");
+    const int tokens_per_super_page = kvCacheBuffer.superPageSize * kvCacheBuffer.mTokensPerBlock;
+    void *first_block = kvCacheBuffer.getKBlockPtr(batch_idx, token_idx / tokens_per_super_page * tokens_per_super_page);
+    half *super_stats_ptr = kvCacheBuffer.getKSuperStatsMaxPtr(first_block, num_heads) + stats_offset;
+    half2 *max_ptr = reinterpret_cast<half2 *>(super_stats_ptr);
+    half2 *min_ptr = reinterpret_cast<half2 *>(super_stats_ptr + kvCacheBuffer.mElesPerIndicator);
+    const half2 *k_ptr = reinterpret_cast<const half2 *>(&k);
+#pragma unroll
+    for (int i = 0; i < sizeof(Vec_type) / sizeof(half2); i++)
+    {
+        atomic_hmax2(max_ptr + i, k_ptr[i]);
+        atomic_hmin2(min_ptr + i, k_ptr[i]);
+    }
+}
+
+// Resets the stats of the sub-chunks that start inside [kv_seq_len - seq_len, kv_seq_len) of every sequence,
+// and those of the super-pages starting there when superPageSize > 0.
+// Sub-chunks that already hold tokens from a previous step keep their stats and are merged into.
+template <typename KVCacheBuffer>
+__global__ void resetKStatsKernel(KVCacheBuffer kvCacheBuffer, const int *seq_lens, const int *kv_seq_lens,
+                                  const int num_heads)
+{
+    const int bi = blockIdx.y;
+    const int kv_len = kv_seq_lens[bi];
+    const int past_len = kv_len - seq_lens[bi];
+    const int first_sub_chunk = (past_len + kvCacheBuffer.tokensPerSubChunk - 1) / kvCacheBuffer.tokensPerSubChunk;
+    const int token_idx = (first_sub_chunk + blockIdx.x) * kvCacheBuffer.tokensPerSubChunk;
+    if (token_idx >= kv_len)
+        return;
+    void *k_block = kvCacheBuffer.getKBlockPtr(bi, token_idx);
+    const int offset = kvCacheBuffer.getLocalIdx(token_idx) / kvCacheBuffer.tokensPerSubChunk * kvCacheBuffer.mElesPerIndicator;
+    half *max_ptr = kvCacheBuffer.getKStatsMaxPtr(k_block, num_heads) + offset;
+    half *min_ptr = kvCacheBuffer.getKStatsMinPtr(k_block, num_heads) + offset;
+    for (int i = threadIdx.x; i < kvCacheBuffer.mElesPerIndicator; i += blockDim.x)
+    {
+        max_ptr[i] = __float2half(-65504.f);
+        min_ptr[i] = __float2half(65504.f);
+    }
+    if (kvCacheBuffer.superPageSize > 0 && token_idx % (kvCacheBuffer.superPageSize * kvCacheBuffer.mTokensPerBlock) == 0)
+    {
+        half *super_stats_ptr = kvCacheBuffer.getKSuperStatsMaxPtr(k_block, num_heads);
+        for (int i = threadIdx.x; i < kvCacheBuffer.mElesPerIndicator; i += blockDim.x)
+        {
+            super_stats_ptr[i] = __float2half(-65504.f);
+            super_stats_ptr[kvCacheBuffer.mElesPerIndicator + i] = __float2half(65504.f);
+        }
+    }
+}
+
+template <typename KVCacheBuffer>
+void invokeResetKStats(KVCacheBuffer &kvCacheBuffer, const int *seq_lens, const int *kv_seq_lens, const int batch_size,
+                       const int max_seq_len, const int num_heads, cudaStream_t stream)
+{
+    dim3 grid((max_seq_len + kvCacheBuffer.tokensPerSubChunk - 1) / kvCacheBuffer.tokensPerSubChunk, batch_size);
+    dim3 block(128);
+    resetKStatsKernel<KVCacheBuffer><<<grid, block, 0, stream>>>(kvCacheBuffer, seq_lens, kv_seq_lens, num_heads);
+}
+
+// Per-page scales. A page opened by a prefill launch takes the absmax of all its tokens in that launch: the update
+// kernel merges the absmax of each token and quantizes the page afterwards. Tokens appended to a page opened earlier
+// reuse its scale (saturating), and a page opened by decoding inherits the static per-tensor scale.
+template <typename KVCacheBuffer>
+inline __device__ bool is_new_kv_page(KVCacheBuffer &kvCacheBuffer, const int token_idx, const int first_token_idx)
+{
+    return token_idx - kvCacheBuffer.getLocalIdx(token_idx) >= first_token_idx;
+}
+
+template <typename KVCacheBuffer>
+inline __device__ void merge_kv_page_absmax(KVCacheBuffer &kvCacheBuffer, void *blockPtr, const int head_idx,
+                                            const float absmax)
+{
+    // Rounded up so that the largest element of the page never saturates.
+    atomic_hmax2(reinterpret_cast<half2 *>(kvCacheBuffer.getPageAbsmaxPtr(blockPtr, head_idx)),
+                 __half2half2(__float2half_ru(absmax)));
+}
+
+template <typename KVCacheBuffer>
+inline __device__ void store_kv_page_absmax(KVCacheBuffer &kvCacheBuffer, void *blockPtr, const int head_idx,
+                                            const float absmax)
+{
+    *reinterpret_cast<half2 *>(kvCacheBuffer.getPageAbsmaxPtr(blockPtr, head_idx)) = __half2half2(__float2half_ru(absmax));
+}
+
+// Dequantization scale (quant -> orig) of a page.
+template <bool INT4KV, typename KVCacheBuffer>
+inline __device__ float load_kv_page_scale(KVCacheBuffer &kvCacheBuffer, void *blockPtr, const int head_idx)
+{
+    constexpr float QUANT_MAX = INT4KV ? 7.f : 127.f;
+    return __half2float(*kvCacheBuffer.getPageAbsmaxPtr(blockPtr, head_idx)) / QUANT_MAX;
+}
+
+// Quantization scale (orig -> quant) of a page; an all-zero page quantizes to zeros.
+template <bool INT4KV, typename KVCacheBuffer>
+inline __device__ float load_kv_page_scale_orig_quant(KVCacheBuffer &kvCacheBuffer, void *blockPtr, const int head_idx)
+{
+    constexpr float QUANT_MAX = INT4KV ? 7.f : 127.f;
+    const float absmax = __half2float(*kvCacheBuffer.getPageAbsmaxPtr(blockPtr, head_idx));
+    return absmax > 0.f ? QUANT_MAX / absmax : 0.f;
+}
+
+// Resets the K and V scales of the pages that start inside [kv_seq_len - seq_len, kv_seq_len) of every sequence.
+template <typename KVCacheBuffer>
+__global__ void resetKVPageAbsmaxKernel(KVCacheBuffer kvCacheBuffer, const int *seq_lens, const int *kv_seq_lens,
+                                        const int num_heads)
+{
+    const int bi = blockIdx.y;
+    const int kv_len = kv_seq_lens[bi];
+    const int past_len = kv_len - seq_lens[bi];
+    const int first_page = (past_len + kvCacheBuffer.mTokensPerBlock - 1) / kvCacheBuffer.mTokensPerBlock;
+    const int token_idx = (first_page + blockIdx.x) * kvCacheBuffer.mTokensPerBlock;
+    if (token_idx >= kv_len)
+        return;
+    void *k_block = kvCacheBuffer.getKBlockPtr(bi, token_idx);
+    void *v_block = kvCacheBuffer.getVBlockPtr(bi, token_idx);
+    for (int i = threadIdx.x; i < num_heads; i += blockDim.x)
+    {
+        *reinterpret_cast<half2 *>(kvCacheBuffer.getPageAbsmaxPtr(k_block, i)) = __float2half2_rn(0.f);
+        *reinterpret_cast<half2 *>(kvCacheBuffer.getPageAbsmaxPtr(v_block, i)) = __float2half2_rn(0.f);
+    }
+}
+
+template <typename KVCacheBuffer>
+void invokeResetKVPageAbsmax(KVCacheBuffer &kvCacheBuffer, const int *seq_lens, const int *kv_seq_lens,
+                             const int batch_size, const int max_seq_len, const int num_heads, cudaStream_t stream)
+{
+    dim3 grid((max_seq_len + kvCacheBuffer.mTokensPerBlock - 1) / kvCacheBuffer.mTokensPerBlock, batch_size);
+    dim3 block(128);
+    resetKVPageAbsmaxKernel<KVCacheBuffer><<<grid, block, 0, stream>>>(kvCacheBuffer, seq_lens, kv_seq_lens, num_heads);
+}
+
+} // namespace mmha
@@ -75,6 +75,10 @@ struct KVBlockArray
     // M is Max number of blocks per sequence
     // int64_t reinterpred to void* pointing to the KV cache data
     int64_t *data;
+    // Ragged (CSR) tables: row seqIdx spans [mRowOffsets[seqIdx], mRowOffsets[seqIdx + 1]) blocks of capacity,
+    // with the K pointers of the row first and the V pointers right behind them (see setRagged).
+    // nullptr for the dense [B, 2, M] tables above.
+    const int64_t *mRowOffsets = nullptr;
 
     int32_t sinkTokenLen, localTokenLen;
     int32_t sinkBlockNum, localBlockNum;
@@ -83,6 +87,8 @@ struct KVBlockArray
     int32_t tokensPerSubChunk;      // How many tokens in a sub-chunk
     int32_t SubChunkGroupSize;      // How many sub-chunks in a kv page
     int32_t mElesPerIndicator;      // Element per dynamic_sparse indicator (vector in FP16 with the shape k: num_kv_heads*head_dim)
+    int32_t superPageSize = 0;      // Pages per super-page whose stats the update kernels maintain (0: not maintained)
+    bool pageScales = false;        // Per-page symmetric scales instead of the static per-tensor ones (see getPageAbsmaxPtr)
     // int32_t mIndicatorPerSubChunk;  // How many indicators in a sub-chunk (min-max: 2, mean: 1)
 
     KVBlockArray() {}
@@ -106,10 +112,27 @@ struct KVBlockArray
         }
     }
 
+    // Switches to the ragged layout when the table is a flat int64 tensor [B + 1 offsets | pointers] instead of
+    // [B, 2, M]. Must be called after data is set. mMaxBlocksPerSeq is unused in the ragged layout.
+    __host__ inline void setRagged(bool ragged)
+    {
+        if (ragged && data != nullptr)
+        {
+            mRowOffsets = data;
+            data = data + mMaxSeqs + 1;
+        }
+    }
+
     __host__ __device__ inline void **getRowPtr(KVIdxType kvIdx, int32_t seqIdx)
     {
         // Returns pointer to array of pointers to K or V cache for one specific sequence seqIdx.
         // seqIdx is in range [0; B]
+        if (mRowOffsets != nullptr)
+        {
+            const int64_t rowStart = mRowOffsets[seqIdx];
+            const int64_t rowCapacity = mRowOffsets[seqIdx + 1] - rowStart;
+            return reinterpret_cast<void **>(data + rowStart * 2 + static_cast<int32_t>(kvIdx) * rowCapacity);
+        }
         return reinterpret_cast<void **>(
             data + seqIdx * mMaxBlocksPerSeq * 2 + static_cast<int32_t>(kvIdx) * mMaxBlocksPerSeq);
     }
@@ -161,6 +184,34 @@ struct KVBlockArray
         // NOTE: we have remapped K layout as the same of V.
         return headIdx * mTokensPerBlock * dimsPerHead + getLocalIdx(globalTokenIdx) * dimsPerHead + channelIdx;
     }
+
+    // dynamic_sparse statistics of a K block (retrieval heads only). After the quantized K data, each block holds
+    //   [numHeads, tokensPerBlock] scales and [numHeads, tokensPerBlock] zeros (always allocated, see cache_engine.py),
+    //   [SubChunkGroupSize, mElesPerIndicator] sub-chunk max, then the same for the sub-chunk min,
+    //   [mElesPerIndicator] super-page max and min (only when hierarchical selection is enabled).
+    // The offsets do not depend on whether the zeros are used, so writers and readers always agree.
+    __host__ __device__ inline half *getKStatsMaxPtr(void *kBlockPtr, int32_t numHeads)
+    {
+        return reinterpret_cast<half *>(reinterpret_cast<int8_t *>(kBlockPtr) + mBytesPerSeq) + mTokensPerBlock * numHeads * 2;
+    }
+
+    __host__ __device__ inline half *getKStatsMinPtr(void *kBlockPtr, int32_t numHeads)
+    {
+        return getKStatsMaxPtr(kBlockPtr, numHeads) + SubChunkGroupSize * mElesPerIndicator;
+    }
+
+    __host__ __device__ inline half *getKSuperStatsMaxPtr(void *kBlockPtr, int32_t numHeads)
+    {
+        return getKStatsMaxPtr(kBlockPtr, numHeads) + 2 * SubChunkGroupSize * mElesPerIndicator;
+    }
+
+    // Per-page quantization scale of a K or V block (per-tensor kernels with pageScales set). The fp16 absmax of the
+    // page is kept as a half2 (absmax, absmax) in the first two slots of the head's row of the per-token scales above,
+    // which the per-tensor kernels otherwise leave unused.
+    __host__ __device__ inline half *getPageAbsmaxPtr(void *blockPtr, int32_t headIdx)
+    {
+        return reinterpret_cast<half *>(reinterpret_cast<int8_t *>(blockPtr) + mBytesPerSeq) + headIdx * mTokensPerBlock;
+    }
 };
 
 
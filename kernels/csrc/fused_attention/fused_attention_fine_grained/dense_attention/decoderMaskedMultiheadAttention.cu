@@ -33,6 +33,7 @@
 #include <float.h>
 #include <type_traits>
 #include "decoderMaskedMultiheadAttentionTemplate.hpp"
+#include "../../../launch_plan_utils.h"
 
 namespace mmha
 {
@@ -74,11 +75,11 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh,  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
                                                    DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,              \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&available_blocks,                                                   \
+    available_blocks = omniserve::cached_max_active_blocks_per_sm(                                                     \
         mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,      \
             DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                      \
         DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);
@@ -90,10 +91,10 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(                                                                        \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,  \
                  DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                 \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
     mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,          \
          DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                                          \
@@ -148,8 +149,6 @@ void mmha_launch_kernel_ex(
         // The max number of warps we can launch per SM is 32 limited by registers.
         if (kernel_total_blocks >= params.multi_processor_count * 4)
         {
-            int max_shared_mem;
-            cudaDeviceGetAttribute(&max_shared_mem, cudaDevAttrMaxSharedMemoryPerBlockOptin, 0);
             MMHA_KERNEL(THDS_PER_BLOCK);
             return;
         }
@@ -157,7 +156,7 @@ void mmha_launch_kernel_ex(
         int num_blocks_per_sm = -1;
         // Set 0 dynamic shared memory size as we need the number of available blocks limited by registers.
         // Dynamic shared memory is fixed for different block size.
-        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks_per_sm,
+        num_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,
             THDS_PER_BLOCK, 0);
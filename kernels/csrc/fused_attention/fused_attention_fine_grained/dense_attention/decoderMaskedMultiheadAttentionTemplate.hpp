@@ -1124,7 +1124,7 @@ namespace mmha
                 if (tidx == 0)
                 {
                     // params.v_scale_quant_orig[(bi * max_seq_len + tlength) * num_heads_kv + hi_kv] = __float2half_rn(v_max / 127);
-                    *v_scale_cur_ptr = __float2half_rn(v_max / 127);
+                    *v_scale_cur_ptr = __float2half_rn(v_max / kv_cache_8bits_max<Tcache>::value);
                 }
             }
             __syncthreads();
@@ -1208,14 +1208,14 @@ namespace mmha
                     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
 
                     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
 
                     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
                 }
                 else
                 {
                     apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
                 }
                 write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
             }
@@ -1300,7 +1300,7 @@ namespace mmha
                 if (tidx == 0)
                 {
                     // params.k_scale_quant_orig[(bi * max_seq_len + tlength) * num_heads_kv + hi_kv] = __float2half_rn(k_max / 127);
-                    *k_scale_cur_ptr = __float2half_rn(k_max / 127);
+                    *k_scale_cur_ptr = __float2half_rn(k_max / kv_cache_8bits_max<Tcache>::value);
                 }
             }
             __syncthreads();
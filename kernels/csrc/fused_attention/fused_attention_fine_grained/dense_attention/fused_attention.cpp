@@ -21,6 +21,7 @@
 #include "../fine_grained_common/update_kv_cache.h"
 #include "fused_attention.h"
 #include "decoderMaskedMultiheadAttention.h"
+#include "../../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -214,7 +215,9 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
                                      const bool kv_cache_with_zeros,
-                                     const int multiblock_switch) {  
+                                     const int multiblock_switch,
+                                     const bool fp8_kv_cache,
+                                     c10::optional<torch::Tensor> rotary_cos_sin_) {  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); //CHECK_DEVICE(kv_pointers);
     int batch_size = q.size(0);
     int nheads = q.size(1);
@@ -267,7 +270,9 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     KVBlockArray<true> streaming_kv_buffer(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
     
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
     streaming_kv_buffer.data = _streaming_kv_pointers.has_value() ? _streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streaming_kv_buffer.setRagged(_streaming_kv_pointers.has_value() && _streaming_kv_pointers->dim() == 1);
      
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
@@ -315,7 +320,14 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 
         Masked_multihead_attention_params<DataType> params;
         
-        params.int8_kv_cache = true; 
+        // fp8_kv_cache: E4M3 cache with per-token-head scales, written by apply_bias_rope_update_kv_cache.
+#ifdef ENABLE_FP8
+        TORCH_CHECK(!fp8_kv_cache || (!int4_kv_cache && !kv_cache_with_zeros), "The FP8 KV cache is symmetric 8-bit");
+#else
+        TORCH_CHECK(!fp8_kv_cache, "The FP8 KV cache requires building with ENABLE_FP8 (CUDA >= 11.8)");
+#endif
+        params.int8_kv_cache = !fp8_kv_cache;
+        params.fp8_kv_cache = fp8_kv_cache;
         set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, 
                    timestep, rotary_embedding_dim, rotary_base, rotary_embedding_scale, rotary_embedding_scale_type,
                    neox_rotary_style, q.stride(0),
@@ -342,6 +354,8 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    partial_max,
                    block_counter
                    );
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
         auto stream = at::cuda::getCurrentCUDAStream();
         masked_multihead_attention(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
     });
@@ -353,14 +367,18 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_attention",
-    &single_query_attention,
+    omniserve::nvtx_wrap("single_query_attention", &single_query_attention),
     "single query attention kernel from trtllm");
   m.def(
     "apply_bias_rope_update_kv_cache",
-    &apply_bias_rope_update_kv_cache,
+    omniserve::nvtx_wrap("apply_bias_rope_update_kv_cache", &apply_bias_rope_update_kv_cache),
     "(context stage) add bias, apply rope and update kv cache");
   m.def(
     "compute_padding_offsets",
-    &compute_padding_offsets,
+    omniserve::nvtx_wrap("compute_padding_offsets", &compute_padding_offsets),
     "compute padding offsets");
+  m.def(
+    "expand_prompt_metadata",
+    omniserve::nvtx_wrap("expand_prompt_metadata", &expand_prompt_metadata),
+    "expand the packed prompt metadata into lens, cu_seqlens, padding offsets and block pointer tables");
 }
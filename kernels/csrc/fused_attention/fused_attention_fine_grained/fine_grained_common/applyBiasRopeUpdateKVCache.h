@@ -16,6 +16,7 @@
 #include "../../common/decoderMaskedMultiheadAttentionUtils.h"
 #include "../../common/gptKernels.h"
 #include "../../common/kvCacheUtils.h"
+#include "../../common/kvCacheStatsUtils.h"
 
 #define WARP_SIZE 32
 #define HALF_WARP_SIZE 16
@@ -105,7 +106,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
                                            const int sink_token_len, const int head_num, const int kv_head_num, const int qheads_per_kv_head, 
                                            const int num_hybrid_kv_heads, const int size_per_head, const int rotary_embedding_dim, float rotary_embedding_base,
                                            RotaryScalingType const rotary_scale_type, float rotary_embedding_scale, const int rotary_embedding_max_positions,
-                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const int beam_width)
+                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const float2 *rotary_cos_sin, const int beam_width)
 {
     // if (!is_retrieval_head){
     //     return;
@@ -223,7 +224,10 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
         const bool valid_seq = IS_GENERATE || (token_idx_in_seq < actual_seq_len || !has_padding);
         // NOTE: only Medusa needs the position offsets.
         // In the generation phase, we assume all sequences should have the same input length.
-        const int rotary_position = token_idx_in_seq;
+        // Speculative decoding: the draft tokens are cached at consecutive slots but take the position of their
+        // depth in the draft tree (per packed token) for RoPE.
+        const int rotary_position = (!IS_GENERATE && medusa_position_offsets != nullptr)
+            ? (final_kv_seq_len - actual_seq_len) + medusa_position_offsets[token_idx] : token_idx_in_seq;
 
         // only update the base and/or scale if needed based on scale_type
         // we have already updated the scale in host if it is linear scale.
@@ -276,7 +280,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
         case PositionEmbeddingType::kROPE_GPTJ:
         {
             mmha::apply_rotary_embedding(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, rotary_cos_sin);
             break;
         }
         // Rotate by half rotary embedding.
@@ -291,7 +295,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
             // e.g. 80 head size (next power of 2 is 128, so each thread will process 4 elements),
             //  which means only thread 0 ~ 10 (exclusive), and 16 ~ 26 (exclusive) have work to do.
             mmha::apply_rotary_embedding_gptneox<Vec_type, Packed_type, T>(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half, rotary_cos_sin);
             break;
         }
         }
@@ -300,13 +304,15 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
         // added by JXGuo: tokenIdxLowerBound indicates the minimum idx of the token that can be processed
         
         bool valid_kv_cache_pos = kvCacheBuffer.data != nullptr; // In KV-cache-less mode. No need to store KV values
+        // Tokens of the sequence including the cached prefix.
+        const int kv_len = (!IS_GENERATE) ? final_kv_seq_len : actual_seq_len;
         if (is_retrieval_head){
-            const int tokenIdxLowerBound = max(actual_seq_len - cyclic_kv_cache_len + sink_token_len, sink_token_len);
+            const int tokenIdxLowerBound = max(kv_len - cyclic_kv_cache_len + sink_token_len, sink_token_len);
             valid_kv_cache_pos = valid_kv_cache_pos && (token_idx_in_seq >= tokenIdxLowerBound || token_idx_in_seq < sink_token_len);
         } else {
             int streaming_sink_len = kvCacheBuffer.sinkTokenLen;
             int streaming_local_len = kvCacheBuffer.localTokenLen;
-            const int tokenIdxLowerBound = actual_seq_len - streaming_local_len;
+            const int tokenIdxLowerBound = kv_len - streaming_local_len;
             valid_kv_cache_pos = valid_kv_cache_pos && (token_idx_in_seq >= tokenIdxLowerBound || token_idx_in_seq < streaming_sink_len);
         }                           
                                         
@@ -400,8 +406,8 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
                 {
                     if (tidx == 0)
                     {
-                        *k_scale_cur_ptr = __float2half_rn(k_max / 127);
-                        *v_scale_cur_ptr = __float2half_rn(v_max / 127);
+                        *k_scale_cur_ptr = __float2half_rn(k_max / mmha::kv_cache_8bits_max<T_cache>::value);
+                        *v_scale_cur_ptr = __float2half_rn(v_max / mmha::kv_cache_8bits_max<T_cache>::value);
                     }
                 }
                 __syncthreads();
@@ -496,6 +502,20 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
                             reinterpret_cast<Vec_type *>(vDst)[inBlockIdx] = v;
                         }
                     }
+                    if constexpr (is_retrieval_head)
+                    {
+                        // Fused dynamic_sparse stats: sub-chunk (and super-page) min / max of the cached keys, read by the page selector.
+                        if (kvCacheBuffer.tokensPerSubChunk > 0)
+                        {
+                            mmha::update_k_stats_atomic<Vec_type>(kvCacheBuffer, kDst, num_hybrid_kv_heads, token_kv_idx,
+                                                                  head_rank * size_per_head + channelIdx * VEC_SIZE, k_to_cache);
+                            if (kvCacheBuffer.superPageSize > 0)
+                            {
+                                mmha::update_k_super_stats_atomic<Vec_type>(kvCacheBuffer, batch_beam_idx, num_hybrid_kv_heads, token_kv_idx,
+                                                                            head_rank * size_per_head + channelIdx * VEC_SIZE, k_to_cache);
+                            }
+                        }
+                    }
                 }
             }
         }
@@ -508,7 +528,8 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
 
 
 template <typename T, typename T_cache, int Dh_MAX, bool ADD_BIAS, bool STORE_QKV, bool POS_SHIFT,
-          typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV = false, bool KV_CACHE_WITH_ZEROS = false>
+          typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV = false, bool KV_CACHE_WITH_ZEROS = false,
+          bool STREAMING_INT4KV = INT4KV>
 __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer retrieval_kvCacheBuffer, StreamingKVCacheBuffer streaming_kvCacheBuffer, const int *retrieval_head_flags_ptr, 
                                            const int *head_rank_table_ptr, const T *__restrict qkv_bias,
                                            const int *seq_lens, const int *kv_seq_lens, const int *padding_offset,
@@ -517,7 +538,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
                                            const int num_retrieval_kv_heads, const int num_streaming_kv_heads,
                                            const int size_per_head, const int rotary_embedding_dim, float rotary_embedding_base,
                                            RotaryScalingType const rotary_scale_type, float rotary_embedding_scale, const int rotary_embedding_max_positions,
-                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const int beam_width)
+                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const float2 *rotary_cos_sin, const int beam_width)
 {
     const int kv_head_idx = blockIdx.y / qheads_per_kv_head;
     const int is_retrieval_head = retrieval_head_flags_ptr[kv_head_idx]!=0;
@@ -525,12 +546,12 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
     if (is_retrieval_head)
     {
         applyBiasRopeUpdateKVCacheCompute<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, RetrievalKVCacheBuffer, IS_GENERATE, true, INT4KV, KV_CACHE_WITH_ZEROS>(
-            QKV, Q, retrieval_kvCacheBuffer, head_rank, qkv_bias, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_retrieval_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, beam_width);
+            QKV, Q, retrieval_kvCacheBuffer, head_rank, qkv_bias, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_retrieval_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
     }
     else
     {
-        applyBiasRopeUpdateKVCacheCompute<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, StreamingKVCacheBuffer, IS_GENERATE, false, INT4KV, KV_CACHE_WITH_ZEROS>(
-            QKV, Q, streaming_kvCacheBuffer, head_rank, qkv_bias, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_streaming_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, beam_width);
+        applyBiasRopeUpdateKVCacheCompute<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, StreamingKVCacheBuffer, IS_GENERATE, false, STREAMING_INT4KV, KV_CACHE_WITH_ZEROS>(
+            QKV, Q, streaming_kvCacheBuffer, head_rank, qkv_bias, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_streaming_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
     }
 }
 
@@ -542,19 +563,32 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
 
 // Grid_block_cache (grid dim, block dim).
 // This caches the block_size, grid_size calculated by cudaOccupancyMaxPotentialBlockSize.
+// INT4KV is the cache type of the retrieval heads; the streaming heads can use the other 8-bit / 4-bit layout
+// (streaming_int4_kv_cache), with the same zeros setting.
+#define APPLY_BIAS_ROPE_UPDATE_KV_CACHE_LAUNCH(Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, INT4KV, KV_CACHE_WITH_ZEROS, STREAMING_INT4KV)     \
+    applyBiasRopeUpdateKVCache<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, INT4KV, KV_CACHE_WITH_ZEROS, \
+                               STREAMING_INT4KV>                                                                                            \
+        <<<grid, block, 0, stream>>>(QKV, Q, retrieval_kvTable, streaming_kvTable, retrieval_head_flags_ptr, head_rank_table_ptr, qkv_bias, seq_lens, kv_seq_lens, padding_offset,                                      \
+                                     token_num, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num,                         \
+                                     kv_head_num, head_num / kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,                   \
+                                     size_per_head, rotary_embedding_dim, rotary_embedding_base,                                            \
+                                     rotary_scale_type, updated_rotary_embedding_scale, rotary_embedding_max_positions,                     \
+                                     position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
+
 #define APPLY_BIAS_ROPE_UPDATE_KV_CACHE(Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, INT4KV, KV_CACHE_WITH_ZEROS)                                \
     int block_size = grid_block_cache.x, grid_size = grid_block_cache.y;                                                                    \
     int tokens_per_block = (block_size + WARP_SIZE - 1) / WARP_SIZE;                                                                        \
     dim3 block(WARP_SIZE, tokens_per_block);                                                                                                \
     int blocks_per_sequence = std::min((grid_size + head_num - 1) / head_num, (token_num + tokens_per_block - 1) / tokens_per_block);       \
     dim3 grid(blocks_per_sequence, head_num);                                                                                               \
-    applyBiasRopeUpdateKVCache<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, INT4KV, KV_CACHE_WITH_ZEROS> \
-        <<<grid, block, 0, stream>>>(QKV, Q, retrieval_kvTable, streaming_kvTable, retrieval_head_flags_ptr, head_rank_table_ptr, qkv_bias, seq_lens, kv_seq_lens, padding_offset,                                      \
-                                     token_num, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num,                         \
-                                     kv_head_num, head_num / kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,                   \
-                                     size_per_head, rotary_embedding_dim, rotary_embedding_base,                                            \
-                                     rotary_scale_type, updated_rotary_embedding_scale, rotary_embedding_max_positions,                     \
-                                     position_embedding_type, medusa_position_offsets, beam_width);
+    if (streaming_int4_kv_cache)                                                                                                            \
+    {                                                                                                                                       \
+        APPLY_BIAS_ROPE_UPDATE_KV_CACHE_LAUNCH(Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, INT4KV, KV_CACHE_WITH_ZEROS, true);                  \
+    }                                                                                                                                       \
+    else                                                                                                                                    \
+    {                                                                                                                                       \
+        APPLY_BIAS_ROPE_UPDATE_KV_CACHE_LAUNCH(Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, INT4KV, KV_CACHE_WITH_ZEROS, false);                 \
+    }
 
 template <int Dh_MAX, typename T, typename T_cache, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV, bool KV_CACHE_WITH_ZEROS>
 void kernelDispatchHeadSize(T *QKV, T *Q, RetrievalKVCacheBuffer &retrieval_kvTable, StreamingKVCacheBuffer &streaming_kvTable, 
@@ -566,9 +600,9 @@ void kernelDispatchHeadSize(T *QKV, T *Q, RetrievalKVCacheBuffer &retrieval_kvTa
                             const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                             const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                             const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                            const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                            const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                             const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
-                            int2 &grid_block_cache, cudaStream_t stream)
+                            const bool streaming_int4_kv_cache, int2 &grid_block_cache, cudaStream_t stream)
 {
     const bool add_bias = qkv_bias != nullptr;
     const bool store_contiguous_qkv = true; //! enable_paged_kv_fmha;
@@ -611,9 +645,9 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                               const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                               const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                               const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                              const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                                              const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                                               const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
-                                              int2 &grid_block_cache, cudaStream_t stream)
+                                              const bool streaming_int4_kv_cache, int2 &grid_block_cache, cudaStream_t stream)
 {
     if (int8_mode == 2)
     {
@@ -649,9 +683,9 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                         kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                         kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                         size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                         position_shift_enabled, scale,
-                                                                                                        int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                        int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                         grid_block_cache, stream);
     }
     else if (size_per_head <= 128)
@@ -661,9 +695,9 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                          size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
-                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                          grid_block_cache, stream);
     }
     else if (size_per_head <= 256)
@@ -673,9 +707,9 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                          size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
-                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width, grid_block_cache, stream);
+                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache, grid_block_cache, stream);
     }
     else
     {
@@ -694,10 +728,11 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                       const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                       const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                       const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                      const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale, const int int8_mode,
+                                      const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale, const int int8_mode,
                                       const KvCacheDataType cache_type,
                                       const bool enable_paged_kv_fmha,
-                                      const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
+                                      const int beam_width, int2 &grid_block_cache, cudaStream_t stream,
+                                      const bool streaming_int4_kv_cache)
 {
     // Block handles both K and V tile.
     constexpr int x = (sizeof(T) == 4) ? 4 : 8;
@@ -707,6 +742,11 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
         return;
     }
 
+    if (retrieval_kvTable.tokensPerSubChunk > 0 && retrieval_kvTable.data != nullptr)
+    {
+        mmha::invokeResetKStats(retrieval_kvTable, seq_lens, kv_seq_lens, batch_size, seq_len, num_retrieval_kv_heads, stream);
+    }
+
     if (cache_type == KvCacheDataType::INT4)
     {
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, true, false>(QKV, Q, retrieval_kvTable, streaming_kvTable, 
@@ -714,9 +754,9 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                      size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
-                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                      grid_block_cache, stream);
     }
 
@@ -727,9 +767,9 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                     seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                     head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,
                                                                                                     size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                     position_shift_enabled, scale,
-                                                                                                    int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                    int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                     grid_block_cache, stream);
     }
 
@@ -740,9 +780,9 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                       seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                       head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                       size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                       position_shift_enabled, scale,
-                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                       grid_block_cache, stream);
     }
 
@@ -753,12 +793,27 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                      size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
-                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width, streaming_int4_kv_cache,
                                                                                                      grid_block_cache, stream);
     }
 
+#ifdef ENABLE_FP8
+    else if (cache_type == KvCacheDataType::FP8)
+    {
+        invokeApplyBiasRopeUpdateKVCacheDispatch<T, __nv_fp8_e4m3, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, false, false>(QKV, Q, retrieval_kvTable, streaming_kvTable, 
+                                                                                                             retrieval_head_flags_ptr, head_rank_table_ptr, qkv_bias,
+                                                                                                             seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
+                                                                                                             head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
+                                                                                                             size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
+                                                                                                             rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
+                                                                                                             position_shift_enabled, scale,
+                                                                                                             int8_mode, enable_paged_kv_fmha, beam_width, false,
+                                                                                                             grid_block_cache, stream);
+    }
+#endif // ENABLE_FP8
+
     else
     {
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, false, false>(QKV, Q, retrieval_kvTable, streaming_kvTable,
@@ -766,9 +821,9 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                  seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, 
                                                                                                  head_num,kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,
                                                                                                  size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                  position_shift_enabled, scale,
-                                                                                                 int8_mode, enable_paged_kv_fmha, beam_width,
+                                                                                                 int8_mode, enable_paged_kv_fmha, beam_width, false,
                                                                                                  grid_block_cache, stream);
     }
 }
@@ -784,6 +839,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                   const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,        \
                                                                                   const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,                     \
                                                                                   const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,     \
-                                                                                  const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,         \
+                                                                                  const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,         \
                                                                                   const int int8_mode, const KvCacheDataType cache_type,                                             \
-                                                                                  const bool enable_paged_kv_fmha, const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
\ No newline at end of file
+                                                                                  const bool enable_paged_kv_fmha, const int beam_width, int2 &grid_block_cache, cudaStream_t stream, \
+                                                                                  const bool streaming_int4_kv_cache)
\ No newline at end of file
@@ -17,8 +17,8 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               torch::Tensor retrieval_seq_lens,
                                               c10::optional<torch::Tensor> streaming_seq_lens,
                                               torch::Tensor padding_offset,
-                                              c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                              c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                              c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                              c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                               torch::Tensor retrieval_head_flags, // H
                                               torch::Tensor head_rank_table, // H
                                               // virtual sequence length (after padding)
@@ -38,6 +38,13 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               const int rotary_embedding_max_positions,
                                               // neox_rotary_style = not interleaved
                                               const bool neox_rotary_style,
-                                              const bool int4_kv_cache,
-                                              const bool kv_cache_with_zeros
+                                              const bool int4_kv_cache,         // retrieval heads
+                                              const bool streaming_int4_kv_cache,  // streaming heads (both int8-family, same zeros setting)
+                                              const bool kv_cache_with_zeros,
+                                              const int tokens_per_sub_chunk,  // > 0: maintain the dynamic_sparse K stats of the retrieval heads
+                                              const bool fp8_kv_cache,         // E4M3 cache with per-token-head scales (no zeros)
+                                              const int super_page_size,       // > 0: also maintain the super-page K stats (needs tokens_per_sub_chunk > 0)
+                                              c10::optional<torch::Tensor> retrieval_kv_seq_lens,  // b, cached + new tokens (None: no cached prefix)
+                                              c10::optional<torch::Tensor> spec_position_offsets, // num_tokens, draft-tree depth of every token (RoPE only)
+                                              c10::optional<torch::Tensor> rotary_cos_sin  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
                                               );
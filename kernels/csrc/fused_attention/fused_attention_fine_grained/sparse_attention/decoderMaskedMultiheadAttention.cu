@@ -30,9 +30,11 @@
 #include "decoderMaskedMultiheadAttention.h"
 #include <assert.h>
 #include <cuda_runtime.h>
+#include <algorithm>
 #include <float.h>
 #include <type_traits>
 #include "decoderMaskedMultiheadAttentionTemplate.hpp"
+#include "../../../launch_plan_utils.h"
 
 namespace mmha
 {
@@ -81,13 +83,13 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh,  \
-                                                   DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,              \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+                                                   DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,              \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&available_blocks,                                                   \
+    available_blocks = omniserve::cached_max_active_blocks_per_sm(                                                     \
         mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,      \
-            DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                      \
+            DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,                                                      \
         DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);
 
            
@@ -97,16 +99,43 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(                                                                        \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,  \
-                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                 \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,                                                 \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
     mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,          \
-         DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                                          \
+         DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>                                                          \
         <<<grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz, stream>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
 
 
+// One wave of persistent CTAs (limited by occupancy), never more CTAs than work items.
+#define MMHA_PERSISTENT_KERNEL(DYNAMIC_THDS_PER_BLOCK)                                                                 \
+    std::size_t const dynamic_smem_sz{                                                                                 \
+        mmha::smem_size_in_bytes<T, Dh, DO_MULTI_BLOCK>(params, DYNAMIC_THDS_PER_BLOCK)};                              \
+    if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
+    {                                                                                                                  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
+            mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+                DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,                          \
+            dynamic_smem_sz);                                                                                          \
+    }                                                                                                                  \
+    int persistent_blocks_per_sm = -1;                                                                                 \
+    persistent_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(                                             \
+        mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+            DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,                              \
+        DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);                                                                      \
+    const int multi_processor_count = omniserve::cached_device_attribute(cudaDevAttrMultiProcessorCount);              \
+    const int num_retrieval_qheads = params.num_retrieval_kv_heads * (params.num_heads / params.num_kv_heads);         \
+    const int num_streaming_qheads = params.skip_streaming_heads ? 0 : params.num_heads - num_retrieval_qheads;       \
+    const int num_work_items                                                                                           \
+        = params.batch_size * (num_retrieval_qheads * static_cast<int>(seq_len_tile) + num_streaming_qheads);          \
+    dim3 persistent_grid{static_cast<unsigned>(                                                                        \
+        std::min(std::max(persistent_blocks_per_sm, 1) * multi_processor_count, num_work_items))};                     \
+    mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+        DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>                                   \
+        <<<persistent_grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz, stream>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
+
 // if resources are not enough to launch 512 threads per block, we will fallback to 256.
 #define MMHA_LAUNCH_512_BLOCKSIZE()                                                                                    \
     int available_blocks = -1;                                                                                         \
@@ -136,7 +165,7 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
 ////////////////////////////////////////////////////////////////////////////////////////////////////
                   
 template <typename T, typename T_cache, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
-    bool DO_MULTI_BLOCK, bool INT4KV, bool KV_WITH_ZEROS, bool SMEM_PRELOAD>
+    bool DO_MULTI_BLOCK, bool INT4KV, bool KV_WITH_ZEROS, bool SMEM_PRELOAD, bool STREAMING_INT4KV = INT4KV>
 void mmha_launch_kernel_ex(
     const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream, int tlength)
 {
@@ -144,6 +173,11 @@ void mmha_launch_kernel_ex(
         params, THDS_PER_BLOCK, tlength, DO_MULTI_BLOCK)};
     dim3 grid{static_cast<unsigned>(params.num_heads), static_cast<unsigned>(params.batch_size),
         static_cast<unsigned>(seq_len_tile)};
+    if (params.persistent_mode)
+    {
+        MMHA_PERSISTENT_KERNEL(THDS_PER_BLOCK);
+        return;
+    }
     if (DO_MULTI_BLOCK)
     {
         MMHA_KERNEL(THDS_PER_BLOCK);
@@ -155,8 +189,6 @@ void mmha_launch_kernel_ex(
         // The max number of warps we can launch per SM is 32 limited by registers.
         if (kernel_total_blocks >= params.multi_processor_count * 4)
         {
-            int max_shared_mem;
-            cudaDeviceGetAttribute(&max_shared_mem, cudaDevAttrMaxSharedMemoryPerBlockOptin, 0);
             MMHA_KERNEL(THDS_PER_BLOCK);
             return;
         }
@@ -164,9 +196,9 @@ void mmha_launch_kernel_ex(
         int num_blocks_per_sm = -1;
         // Set 0 dynamic shared memory size as we need the number of available blocks limited by registers.
         // Dynamic shared memory is fixed for different block size.
-        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks_per_sm,
+        num_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THDS_PER_BLOCK,
-                DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,
+                DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, STREAMING_INT4KV>,
             THDS_PER_BLOCK, 0);
         int block_size_factor = min(
             mmha::divUp(params.multi_processor_count * num_blocks_per_sm, kernel_total_blocks), num_blocks_per_sm);
@@ -191,6 +223,25 @@ void mmha_launch_kernel_ex(
     }
 }
 
+// Int8-family caches: the streaming heads can be 4-bit with 8-bit retrieval heads or the other way round
+// (params.streaming_int4_kv_cache), e.g. to keep the retrieval heads that feed the page selector at 8 bits.
+template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
+    bool DO_MULTI_BLOCK, bool INT4KV, bool KV_WITH_ZEROS, bool SMEM_PRELOAD>
+void mmha_launch_kernel_dispatch_streaming_kv_cache(
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream, int tlength)
+{
+    if (params.streaming_int4_kv_cache)
+    {
+        mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+            DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, true>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
+    }
+    else
+    {
+        mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+            DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
+    }
+}
+
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
     bool DO_MULTI_BLOCK>
 void mmha_launch_kernel_dispatch_4bits_kv_cache(
@@ -203,13 +254,13 @@ void mmha_launch_kernel_dispatch_4bits_kv_cache(
             if (params.timestep < params.smem_preload_switch)
             {
                 // Note: the 4bit kv_cache is still packed in int8_t.
-                mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+                mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                     DO_MULTI_BLOCK, true, true, true>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
             else
             {
                 // Note: the 4bit kv_cache is still packed in int8_t.
-                mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+                mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                     DO_MULTI_BLOCK, true, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
         }
@@ -218,13 +269,13 @@ void mmha_launch_kernel_dispatch_4bits_kv_cache(
             if (params.timestep < params.smem_preload_switch)
             {
                 // Note: the 4bit kv_cache is still packed in int8_t.
-                mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+                mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                     DO_MULTI_BLOCK, true, false, true>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
             else
             {
                 // Note: the 4bit kv_cache is still packed in int8_t.
-                mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+                mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                     DO_MULTI_BLOCK, true, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
 
@@ -247,12 +298,12 @@ void mmha_launch_kernel_dispatch_8bits_kv_cache(
     {
         if (params.kv_cache_with_zeros)
         {
-            mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+            mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, false, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
         else
         {
-            mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
+            mmha_launch_kernel_dispatch_streaming_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, false, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
     }
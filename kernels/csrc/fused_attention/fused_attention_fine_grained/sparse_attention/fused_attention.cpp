@@ -21,6 +21,8 @@
 #include "../fine_grained_common/update_kv_cache.h"
 #include "fused_attention.h"
 #include "decoderMaskedMultiheadAttention.h"
+#include "streamingHeadAttention.h"
+#include "../../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -83,6 +85,7 @@ void set_params(Masked_multihead_attention_params<T> &params,
                 // T *v_cache_ptr,
                 int *length_per_sample,
                 bool int4_kv_cache,
+                bool streaming_int4_kv_cache,
                 bool kv_cache_with_zeros,
                 float *alibi_slopes_ptr,
                 T *out_ptr,
@@ -152,6 +155,7 @@ void set_params(Masked_multihead_attention_params<T> &params,
     params.memory_length_per_sample = nullptr;
     params.length_per_sample = length_per_sample;
     params.int4_kv_cache = int4_kv_cache;
+    params.streaming_int4_kv_cache = streaming_int4_kv_cache;
     params.kv_cache_with_zeros = kv_cache_with_zeros;
     params.retrieval_head_flags_ptr = retrieval_head_flags_ptr;
     params.head_rank_table_ptr = head_rank_table_ptr;
@@ -222,11 +226,16 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
+                                     const bool streaming_int4_kv_cache,
                                      const bool kv_cache_with_zeros,
                                      const int tokens_per_sub_chunk,
                                      const int hidden_dim_per_retrieval_token,
                                     //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                     const int multiblock_switch) {  
+                                     const int multiblock_switch,
+                                     const bool persistent_mode,
+                                     const bool fp8_kv_cache,
+                                     c10::optional<torch::Tensor> dynamic_sparse_page_nums_,  // B, per-sequence token budgets
+                                     c10::optional<torch::Tensor> rotary_cos_sin_) {  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); //CHECK_DEVICE(kv_pointers);
     int batch_size = q.size(0);
     int nheads = q.size(1);
@@ -264,10 +273,21 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     if (dynamic_sparse_page_idxes_.has_value()) {
       auto dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_.value();
       CHECK_DEVICE(dynamic_sparse_page_idxes);
-      CHECK_SHAPE(dynamic_sparse_page_idxes, batch_size, nheads, num_dynamic_sparse_pages);
+      // One page set per query head, or per KV head (group-shared selection).
+      TORCH_CHECK(dynamic_sparse_page_idxes.dim() == 3 && dynamic_sparse_page_idxes.size(0) == batch_size
+                  && (dynamic_sparse_page_idxes.size(1) == nheads || dynamic_sparse_page_idxes.size(1) == nheads_kv),
+                  "dynamic_sparse_page_idxes must be batch_size x (num_heads or num_kv_heads) x num_dynamic_sparse_pages");
       CHECK_CONTIGUOUS(dynamic_sparse_page_idxes);
       TORCH_CHECK(dynamic_sparse_page_idxes.dtype() == torch::kInt32);
     }
+    if (dynamic_sparse_page_nums_.has_value()) {
+      auto dynamic_sparse_page_nums = dynamic_sparse_page_nums_.value();
+      TORCH_CHECK(do_dynamic_sparse, "dynamic_sparse_page_nums requires dynamic_sparse_page_idxes");
+      CHECK_DEVICE(dynamic_sparse_page_nums);
+      CHECK_SHAPE(dynamic_sparse_page_nums, batch_size);
+      CHECK_CONTIGUOUS(dynamic_sparse_page_nums);
+      TORCH_CHECK(dynamic_sparse_page_nums.dtype() == torch::kInt32);
+    }
 
     int retrieval_max_blocks_per_seq = 0;
     int streaming_max_blocks_per_seq = 0;
@@ -288,7 +308,9 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     KVBlockArray<false> retrieval_kv_buffer(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0, tokens_per_sub_chunk, hidden_dim_per_retrieval_token);
     KVBlockArray<true> streaming_kv_buffer(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
     streaming_kv_buffer.data = _streaming_kv_pointers.has_value() ? _streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streaming_kv_buffer.setRagged(_streaming_kv_pointers.has_value() && _streaming_kv_pointers->dim() == 1);
      
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
@@ -339,7 +361,15 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 
         Masked_multihead_attention_params<DataType> params;
         
-        params.int8_kv_cache = true; 
+        // fp8_kv_cache: E4M3 cache with per-token-head scales, written by apply_bias_rope_update_kv_cache.
+#ifdef ENABLE_FP8
+        TORCH_CHECK(!fp8_kv_cache || (!int4_kv_cache && !streaming_int4_kv_cache && !kv_cache_with_zeros),
+                    "The FP8 KV cache is symmetric 8-bit");
+#else
+        TORCH_CHECK(!fp8_kv_cache, "The FP8 KV cache requires building with ENABLE_FP8 (CUDA >= 11.8)");
+#endif
+        params.int8_kv_cache = !fp8_kv_cache;
+        params.fp8_kv_cache = fp8_kv_cache;
         set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, 
                    timestep, rotary_embedding_dim, rotary_base, rotary_embedding_scale, rotary_embedding_scale_type,
                    neox_rotary_style, q.stride(0), tokens_per_block,
@@ -349,6 +379,7 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    length_per_sample_.has_value()
                        ? length_per_sample_.value().data_ptr<int>() : nullptr,
                    int4_kv_cache,
+                   streaming_int4_kv_cache,
                    kv_cache_with_zeros,
                    alibi_slopes_.has_value() 
                        ? alibi_slopes_.value().data_ptr<float>(): nullptr,
@@ -369,8 +400,23 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    partial_max,
                    block_counter
                    );
+        if (dynamic_sparse_page_nums_.has_value()) {
+            params.dynamic_sparse_page_nums_ptr = dynamic_sparse_page_nums_.value().data_ptr<int>();
+        }
+        params.num_dynamic_sparse_page_heads = do_dynamic_sparse ? dynamic_sparse_page_idxes_.value().size(1) : 0;
+        at::Tensor _work_counter;
+        if (persistent_mode) {
+            _work_counter = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt32).device(q.device()));
+            params.persistent_mode = true;
+            params.work_counter = reinterpret_cast<int*>(_work_counter.data_ptr());
+        }
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
         auto stream = at::cuda::getCurrentCUDAStream();
-        masked_multihead_attention(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
+        // Streaming heads go to the window-specialised kernel when one matches, the rest to the generic one.
+        params.skip_streaming_heads = streaming_head_attention(params, streaming_kv_buffer, stream);
+        if (!params.skip_streaming_heads || num_retrieval_kv_heads > 0)
+            masked_multihead_attention(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
     });
     // return torch::zeros_like(q);
     return out;
@@ -380,14 +426,18 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_attention",
-    &single_query_attention,
+    omniserve::nvtx_wrap("single_query_attention", &single_query_attention),
     "single query attention kernel from trtllm");
   m.def(
     "apply_bias_rope_update_kv_cache",
-    &apply_bias_rope_update_kv_cache,
+    omniserve::nvtx_wrap("apply_bias_rope_update_kv_cache", &apply_bias_rope_update_kv_cache),
     "(context stage) add bias, apply rope and update kv cache");
   m.def(
     "compute_padding_offsets",
-    &compute_padding_offsets,
+    omniserve::nvtx_wrap("compute_padding_offsets", &compute_padding_offsets),
     "compute padding offsets");
+  m.def(
+    "expand_prompt_metadata",
+    omniserve::nvtx_wrap("expand_prompt_metadata", &expand_prompt_metadata),
+    "expand the packed prompt metadata into lens, cu_seqlens, padding offsets and block pointer tables");
 }
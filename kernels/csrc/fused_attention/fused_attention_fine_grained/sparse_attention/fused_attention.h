@@ -18,8 +18,8 @@
 torch::Tensor single_query_attention(const torch::Tensor q,
                                      const torch::Tensor k,
                                      const torch::Tensor v,
-                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                      torch::Tensor retrieval_head_flags, // H
                                      torch::Tensor head_rank_table, // H
                                      c10::optional<torch::Tensor> dynamic_sparse_page_idxes,      // B x N_head x dynamic_sparse_page_num
@@ -39,9 +39,14 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const float rotary_embedding_scale,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
-                                     const bool int4_kv_cache,
+                                     const bool int4_kv_cache,            // retrieval heads
+                                     const bool streaming_int4_kv_cache,  // streaming heads, same zeros setting
                                      const bool kv_cache_with_zeros,
                                      const int tokens_per_sub_chunk,
                                      const int hidden_dim_per_retrieval_token,
                                     //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                     const int multiblock_switch);
\ No newline at end of file
+                                     const int multiblock_switch,
+                                     const bool persistent_mode,
+                                     const bool fp8_kv_cache,
+                                     c10::optional<torch::Tensor> dynamic_sparse_page_nums_, // B, per-sequence token budgets
+                                     c10::optional<torch::Tensor> rotary_cos_sin_); // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
\ No newline at end of file
@@ -0,0 +1,490 @@
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include "streamingHeadAttention.h"
+#include <assert.h>
+#include <cuda_runtime.h>
+#include <float.h>
+#include "decoderMaskedMultiheadAttentionTemplate.hpp"
+#include "../../../launch_plan_utils.h"
+
+// Sink + local windows with a specialised kernel. Other windows use the generic decoding kernel.
+#define STREAMING_HEAD_WINDOWS(X) \
+    X(128)                        \
+    X(256)                        \
+    X(384)                        \
+    X(512)
+
+namespace mmha
+{
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+constexpr unsigned STREAMING_HEAD_THREADS = 256;
+// Query heads per KV head held in shared memory.
+constexpr unsigned STREAMING_HEAD_MAX_QHEADS_PER_KV = 8;
+
+template <unsigned Dh, unsigned WINDOW, bool INT4KV>
+struct Streaming_head_traits
+{
+    // Every lane handles 8 channels (one uint4 of halves), a group of lanes one token.
+    static constexpr unsigned VEC_SIZE = 8;
+    static constexpr unsigned THREADS_PER_TOKEN = Dh / VEC_SIZE;
+    static constexpr unsigned TOKEN_GROUPS = STREAMING_HEAD_THREADS / THREADS_PER_TOKEN;
+    // The window holds WINDOW - 1 cached tokens and the current one.
+    static constexpr unsigned CACHED_SLOTS = WINDOW - 1;
+    static constexpr unsigned TOKENS_PER_GROUP = (WINDOW + TOKEN_GROUPS - 1) / TOKEN_GROUPS;
+    static constexpr unsigned ROW_BYTES = Dh / (INT4KV ? 2 : 1);
+    static constexpr unsigned CHUNKS_PER_ROW = ROW_BYTES / 16;
+    static constexpr unsigned CHUNKS_PER_THREAD
+        = (CACHED_SLOTS * CHUNKS_PER_ROW + STREAMING_HEAD_THREADS - 1) / STREAMING_HEAD_THREADS;
+    static constexpr unsigned SLOTS_PER_THREAD = (CACHED_SLOTS + STREAMING_HEAD_THREADS - 1) / STREAMING_HEAD_THREADS;
+
+    // K and V rows, their scales and zeros in fp32, then the partial outputs of the token groups.
+    static constexpr size_t SMEM_BYTES
+        = 2 * CACHED_SLOTS * ROW_BYTES + 4 * CACHED_SLOTS * sizeof(float) + TOKEN_GROUPS * Dh * sizeof(float);
+
+    static_assert(Dh % (VEC_SIZE * 2) == 0 && ROW_BYTES % 16 == 0);
+    static_assert(32 % THREADS_PER_TOKEN == 0, "A token must not span warps");
+    static_assert(Dh <= STREAMING_HEAD_THREADS);
+};
+
+// One CTA per (streaming KV head, sequence), serving every query head of the KV head from a single copy of the
+// window. The cached sink + local tokens are fetched with one cp.async burst (K, then V) while the current token is
+// roped, quantized and appended to the cache. With the window known at compile time the score, softmax and value
+// loops are fully unrolled and the scores stay in registers: a group of THREADS_PER_TOKEN lanes owns the tokens
+// group, group + TOKEN_GROUPS, ... for the whole head.
+// Same layout and arithmetic as masked_multihead_attention_kernel with IS_RETRIEVAL_HEAD = false, KV_WITH_ZEROS.
+template <unsigned Dh, unsigned WINDOW, bool INT4KV>
+__global__ void __launch_bounds__(STREAMING_HEAD_THREADS) streaming_head_attention_kernel(
+    Multihead_attention_params<uint16_t> params, KVBlockArray<true> kvCacheBuffer)
+{
+    using Traits = Streaming_head_traits<Dh, WINDOW, INT4KV>;
+    constexpr unsigned VEC_SIZE = Traits::VEC_SIZE;
+    constexpr unsigned THREADS_PER_TOKEN = Traits::THREADS_PER_TOKEN;
+    constexpr unsigned TOKEN_GROUPS = Traits::TOKEN_GROUPS;
+    constexpr unsigned CACHED_SLOTS = Traits::CACHED_SLOTS;
+    constexpr unsigned ROW_BYTES = Traits::ROW_BYTES;
+    constexpr unsigned CHUNKS_PER_ROW = Traits::CHUNKS_PER_ROW;
+    constexpr unsigned WARP_SIZE = 32;
+    constexpr unsigned WARPS_PER_BLOCK = STREAMING_HEAD_THREADS / WARP_SIZE;
+    constexpr float QUANT_MAX = INT4KV ? 15.f : 255.f;
+    // 8 quantized channels of a row.
+    using Vec_m = typename packed_type<int8_t, VEC_SIZE / (INT4KV ? 2 : 1)>::type;
+
+    extern __shared__ __align__(16) char smem_[];
+    int8_t *k_smem = reinterpret_cast<int8_t *>(smem_);
+    int8_t *v_smem = k_smem + CACHED_SLOTS * ROW_BYTES;
+    float *k_scale_smem = reinterpret_cast<float *>(v_smem + CACHED_SLOTS * ROW_BYTES);
+    float *k_zero_smem = k_scale_smem + CACHED_SLOTS;
+    float *v_scale_smem = k_zero_smem + CACHED_SLOTS;
+    float *v_zero_smem = v_scale_smem + CACHED_SLOTS;
+    float *out_red_smem = v_zero_smem + CACHED_SLOTS;
+
+    __shared__ __align__(16) half q_smem[STREAMING_HEAD_MAX_QHEADS_PER_KV][Dh];
+    __shared__ __align__(16) half k_cur_smem[Dh];
+    __shared__ __align__(16) half v_cur_smem[Dh];
+    __shared__ __align__(16) half out_smem[Dh];
+    __shared__ half2 cur_sz_smem[2];
+    __shared__ float red_smem[WARPS_PER_BLOCK * 2];
+
+    const unsigned tidx = threadIdx.x;
+    const unsigned warp = tidx / WARP_SIZE;
+    const unsigned lane = tidx % WARP_SIZE;
+    const int head_rank = blockIdx.x;
+    const int bi = blockIdx.y;
+    const int num_head_kv_buffer = params.num_streaming_kv_heads;
+    const int qhead_per_kv = params.num_heads / params.num_kv_heads;
+
+    // The KV head with this rank among the streaming heads.
+    int hi_kv = 0;
+    for (int kv_head_idx = 0; kv_head_idx < params.num_kv_heads; kv_head_idx++)
+    {
+        if (params.retrieval_head_flags_ptr[kv_head_idx] == 0 && params.head_rank_table_ptr[kv_head_idx] == head_rank)
+        {
+            hi_kv = kv_head_idx;
+        }
+    }
+
+    const int tlength = params.length_per_sample ? (params.length_per_sample[bi] - 1) : params.timestep;
+    // Window slot -> token: the sink tokens, then the last WINDOW - 1 - sink cached tokens. Slot valid_slots is the
+    // current token.
+    const int valid_slots = min(static_cast<int>(CACHED_SLOTS), tlength);
+    const int sink_local_gap = tlength - valid_slots;
+    const int sink_token_num = kvCacheBuffer.sinkTokenLen;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Burst-load the cached window: one commit group for K, one for V.
+#pragma unroll
+    for (unsigned kv = 0; kv < 2; ++kv)
+    {
+        int8_t *dst_base = kv == 0 ? k_smem : v_smem;
+#pragma unroll
+        for (unsigned c = 0; c < Traits::CHUNKS_PER_THREAD; ++c)
+        {
+            const unsigned chunk = c * STREAMING_HEAD_THREADS + tidx;
+            const int slot = chunk / CHUNKS_PER_ROW;
+            const int col = (chunk % CHUNKS_PER_ROW) * 16;
+            const bool pred = slot < valid_slots;
+            const uint4 *src = nullptr;
+            if (pred)
+            {
+                const int token = slot < sink_token_num ? slot : slot + sink_local_gap;
+                const int8_t *block = reinterpret_cast<const int8_t *>(kv == 0 ? kvCacheBuffer.getKBlockPtr(bi, token)
+                                                                               : kvCacheBuffer.getVBlockPtr(bi, token));
+                src = reinterpret_cast<const uint4 *>(block + kvCacheBuffer.getKVLocalIdx(token, head_rank, ROW_BYTES, col));
+            }
+            cp_async_launch(dst_base + slot * ROW_BYTES + col, src, pred);
+        }
+        __pipeline_commit();
+    }
+
+    // The scales and zeros are 2-byte values, strided by the head: plain loads, overlapped with the burst.
+#pragma unroll
+    for (unsigned s = 0; s < Traits::SLOTS_PER_THREAD; ++s)
+    {
+        const int slot = s * STREAMING_HEAD_THREADS + tidx;
+        if (slot < valid_slots)
+        {
+            const int token = slot < sink_token_num ? slot : slot + sink_local_gap;
+            const int sz_idx = head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(token);
+            const half *k_sz = reinterpret_cast<const half *>(
+                reinterpret_cast<const int8_t *>(kvCacheBuffer.getKBlockPtr(bi, token)) + kvCacheBuffer.mBytesPerSeq);
+            const half *v_sz = reinterpret_cast<const half *>(
+                reinterpret_cast<const int8_t *>(kvCacheBuffer.getVBlockPtr(bi, token)) + kvCacheBuffer.mBytesPerSeq);
+            k_scale_smem[slot] = __half2float(k_sz[sz_idx]);
+            k_zero_smem[slot] = __half2float(k_sz[sz_idx + num_head_kv_buffer * kvCacheBuffer.mTokensPerBlock]);
+            v_scale_smem[slot] = __half2float(v_sz[sz_idx]);
+            v_zero_smem[slot] = __half2float(v_sz[sz_idx + num_head_kv_buffer * kvCacheBuffer.mTokensPerBlock]);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Current token: load Q of the query heads and K / V, apply RoPE, append K / V to the cache.
+    const uint32_t q_stride = params.stride ? static_cast<uint32_t>(params.stride) : (params.num_heads * Dh);
+    const uint32_t kv_stride = params.stride ? static_cast<uint32_t>(params.stride) : (params.num_kv_heads * Dh);
+    const half *q_in = reinterpret_cast<const half *>(params.q);
+    const half *k_in = reinterpret_cast<const half *>(params.k);
+    const half *v_in = reinterpret_cast<const half *>(params.v);
+    for (int idx = tidx; idx < (qhead_per_kv + 2) * static_cast<int>(Dh); idx += STREAMING_HEAD_THREADS)
+    {
+        const uint32_t row = idx / Dh;
+        const uint32_t ch = idx % Dh;
+        const uint32_t bi_ = bi;
+        if (row < static_cast<uint32_t>(qhead_per_kv))
+        {
+            q_smem[row][ch] = q_in[flat_index_strided3(bi_, hi_kv * qhead_per_kv + row, ch, q_stride, Dh)];
+        }
+        else if (row == static_cast<uint32_t>(qhead_per_kv))
+        {
+            k_cur_smem[ch] = k_in[flat_index_strided3(bi_, static_cast<uint32_t>(hi_kv), ch, kv_stride, Dh)];
+        }
+        else
+        {
+            v_cur_smem[ch] = v_in[flat_index_strided3(bi_, static_cast<uint32_t>(hi_kv), ch, kv_stride, Dh)];
+        }
+    }
+    __syncthreads();
+
+    // GPT-NeoX RoPE: channel i pairs with i + rotary_embedding_dim / 2.
+    {
+        float rotary_embedding_base = params.rotary_embedding_base;
+        float rotary_embedding_scale = params.rotary_embedding_scale;
+        update_rotary_base_n_scale(rotary_embedding_base, rotary_embedding_scale, params.rotary_embedding_scale_type,
+            params.rotary_embedding_dim, params.rotary_embedding_max_positions, tlength);
+        const int half_rotary_dim = params.rotary_embedding_dim / 2;
+        for (int idx = tidx; idx < (qhead_per_kv + 1) * half_rotary_dim; idx += STREAMING_HEAD_THREADS)
+        {
+            const int row = idx / half_rotary_dim;
+            const int pair = idx % half_rotary_dim;
+            half *x = row < qhead_per_kv ? q_smem[row] : k_cur_smem;
+            const float2 coef = rotary_embedding_coefficient(2 * pair, params.rotary_embedding_dim,
+                rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
+            const float2 rot = rotary_embedding_transform(
+                make_float2(__half2float(x[pair]), __half2float(x[pair + half_rotary_dim])), coef);
+            x[pair] = __float2half_rn(rot.x);
+            x[pair + half_rotary_dim] = __float2half_rn(rot.y);
+        }
+    }
+    __syncthreads();
+
+    // Warp 0 quantizes K, warp 1 V, with the asymmetric per-token scale / zero.
+    if (warp < 2)
+    {
+        const half *x = warp == 0 ? k_cur_smem : v_cur_smem;
+        float x_max = -FLT_MAX, x_min = FLT_MAX;
+#pragma unroll
+        for (unsigned ch = lane; ch < Dh; ch += WARP_SIZE)
+        {
+            x_max = fmaxf(x_max, __half2float(x[ch]));
+            x_min = fminf(x_min, __half2float(x[ch]));
+        }
+#pragma unroll
+        for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2)
+        {
+            x_max = fmaxf(x_max, __shfl_xor_sync(uint32_t(-1), x_max, mask));
+            x_min = fminf(x_min, __shfl_xor_sync(uint32_t(-1), x_min, mask));
+        }
+        if (lane == 0)
+        {
+            const half2 sz = make_half2(
+                __float2half_rn((x_max - x_min) / QUANT_MAX), __float2half_rn(-QUANT_MAX * x_min / (x_max - x_min)));
+            cur_sz_smem[warp] = sz;
+            half *sz_ptr = reinterpret_cast<half *>(reinterpret_cast<int8_t *>(warp == 0
+                                   ? kvCacheBuffer.getKBlockPtr(bi, tlength) : kvCacheBuffer.getVBlockPtr(bi, tlength))
+                               + kvCacheBuffer.mBytesPerSeq)
+                + head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(tlength);
+            sz_ptr[0] = sz.x;
+            sz_ptr[num_head_kv_buffer * kvCacheBuffer.mTokensPerBlock] = sz.y;
+        }
+    }
+    __syncthreads();
+
+    if (tidx < 2 * THREADS_PER_TOKEN)
+    {
+        const bool is_v = tidx >= THREADS_PER_TOKEN;
+        const int col = (tidx % THREADS_PER_TOKEN) * VEC_SIZE;
+        const uint4 x = *reinterpret_cast<const uint4 *>(&(is_v ? v_cur_smem : k_cur_smem)[col]);
+        const half2 sz = cur_sz_smem[is_v ? 1 : 0];
+        int8_t *block = reinterpret_cast<int8_t *>(
+            is_v ? kvCacheBuffer.getVBlockPtr(bi, tlength) : kvCacheBuffer.getKBlockPtr(bi, tlength));
+        const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(tlength, head_rank, ROW_BYTES, col / (INT4KV ? 2 : 1));
+        if constexpr (INT4KV)
+        {
+            store_4bits_kv_cache_vec(block, x, inBlockIdx, 1.0f / __half2float(sz.x), __half2float(sz.y));
+        }
+        else
+        {
+            store_8bits_kv_cache_vec(block, x, inBlockIdx, 1.0f / __half2float(sz.x), __half2float(sz.y));
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Attention of every query head over the window.
+    const unsigned group = tidx / THREADS_PER_TOKEN;
+    const unsigned col = (tidx % THREADS_PER_TOKEN) * VEC_SIZE;
+    // Dequantized 4-bit vectors come out as 04152637: permute the fp16 operands the same way.
+    uint4 k_cur_vec = *reinterpret_cast<const uint4 *>(&k_cur_smem[col]);
+    uint4 v_cur_vec = *reinterpret_cast<const uint4 *>(&v_cur_smem[col]);
+    if constexpr (INT4KV)
+    {
+        k_cur_vec = reorder_8xfp16(k_cur_vec);
+        v_cur_vec = reorder_8xfp16(v_cur_vec);
+    }
+
+    // K has landed, V may still be in flight.
+    __pipeline_wait_prior(1);
+    __syncthreads();
+
+    for (int qi = 0; qi < qhead_per_kv; ++qi)
+    {
+        const unsigned hi = hi_kv * qhead_per_kv + qi;
+        uint4 q_vec = *reinterpret_cast<const uint4 *>(&q_smem[qi][col]);
+        if constexpr (INT4KV)
+        {
+            q_vec = reorder_8xfp16(q_vec);
+        }
+
+        float qk[Traits::TOKENS_PER_GROUP];
+        float qk_max = -FLT_MAX;
+#pragma unroll
+        for (unsigned i = 0; i < Traits::TOKENS_PER_GROUP; ++i)
+        {
+            const int slot = group + i * TOKEN_GROUPS;
+            // Out-of-window slots read a valid row and are masked below.
+            const int row = min(slot, static_cast<int>(CACHED_SLOTS) - 1);
+            uint4 k_vec;
+            const Vec_m k_m = *reinterpret_cast<const Vec_m *>(&k_smem[row * ROW_BYTES + col / (INT4KV ? 2 : 1)]);
+            if constexpr (INT4KV)
+            {
+                convert_from_4bit_kv_cache<Vec_m, uint4, int8_t, float>(&k_vec, k_m, k_scale_smem[row], k_zero_smem[row]);
+            }
+            else
+            {
+                convert_from_8bit_kv_cache<Vec_m, uint4, int8_t, float>(&k_vec, k_m, k_scale_smem[row], k_zero_smem[row]);
+            }
+            if (slot == valid_slots)
+            {
+                k_vec = k_cur_vec;
+            }
+            // All the lanes of the warp enter: the dot product reduces over the group with shuffles.
+            const float qk_ = qk_hmma_dot_simple<THREADS_PER_TOKEN>(q_vec, k_vec) * params.inv_sqrt_dh;
+            qk[i] = slot <= valid_slots ? qk_ : -FLT_MAX;
+            qk_max = fmaxf(qk_max, qk[i]);
+        }
+
+        // Softmax. The lanes of a group hold the same scores: reduce over the groups of the warp, then the warps.
+#pragma unroll
+        for (int mask = WARP_SIZE / 2; mask >= static_cast<int>(THREADS_PER_TOKEN); mask /= 2)
+        {
+            qk_max = fmaxf(qk_max, __shfl_xor_sync(uint32_t(-1), qk_max, mask));
+        }
+        if (lane == 0)
+        {
+            red_smem[warp] = qk_max;
+        }
+        __syncthreads();
+#pragma unroll
+        for (unsigned w = 0; w < WARPS_PER_BLOCK; ++w)
+        {
+            qk_max = fmaxf(qk_max, red_smem[w]);
+        }
+
+        float sum = 0.f;
+#pragma unroll
+        for (unsigned i = 0; i < Traits::TOKENS_PER_GROUP; ++i)
+        {
+            qk[i] = __expf(qk[i] - qk_max);
+            sum += qk[i];
+        }
+#pragma unroll
+        for (int mask = WARP_SIZE / 2; mask >= static_cast<int>(THREADS_PER_TOKEN); mask /= 2)
+        {
+            sum += __shfl_xor_sync(uint32_t(-1), sum, mask);
+        }
+        if (lane == 0)
+        {
+            red_smem[WARPS_PER_BLOCK + warp] = sum;
+        }
+
+        // V has landed as well.
+        __pipeline_wait_prior(0);
+        __syncthreads();
+        sum = 0.f;
+#pragma unroll
+        for (unsigned w = 0; w < WARPS_PER_BLOCK; ++w)
+        {
+            sum += red_smem[WARPS_PER_BLOCK + w];
+        }
+        const float inv_sum = __fdividef(1.f, sum + 1.e-6f);
+
+        Float8_ out;
+        zero(out);
+#pragma unroll
+        for (unsigned i = 0; i < Traits::TOKENS_PER_GROUP; ++i)
+        {
+            const int slot = group + i * TOKEN_GROUPS;
+            const int row = min(slot, static_cast<int>(CACHED_SLOTS) - 1);
+            uint4 v_vec;
+            const Vec_m v_m = *reinterpret_cast<const Vec_m *>(&v_smem[row * ROW_BYTES + col / (INT4KV ? 2 : 1)]);
+            if constexpr (INT4KV)
+            {
+                convert_from_4bit_kv_cache<Vec_m, uint4, int8_t, float>(&v_vec, v_m, v_scale_smem[row], v_zero_smem[row]);
+            }
+            else
+            {
+                convert_from_8bit_kv_cache<Vec_m, uint4, int8_t, float>(&v_vec, v_m, v_scale_smem[row], v_zero_smem[row]);
+            }
+            if (slot == valid_slots)
+            {
+                v_vec = v_cur_vec;
+            }
+            if (slot <= valid_slots)
+            {
+                out = fma(qk[i], convert_to_float(v_vec), out);
+            }
+        }
+
+        // Reduce the partial outputs of the token groups.
+        *reinterpret_cast<Float8_ *>(&out_red_smem[group * Dh + col]) = out;
+        __syncthreads();
+        if (tidx < Dh)
+        {
+            float acc = 0.f;
+#pragma unroll
+            for (unsigned g = 0; g < TOKEN_GROUPS; ++g)
+            {
+                acc += out_red_smem[g * Dh + tidx];
+            }
+            out_smem[tidx] = __float2half_rn(acc * inv_sum);
+        }
+        __syncthreads();
+        if (tidx < THREADS_PER_TOKEN)
+        {
+            uint4 final_out = *reinterpret_cast<const uint4 *>(&out_smem[col]);
+            if constexpr (INT4KV)
+            {
+                // 01234567->02461357
+                final_out = reorder_8xfp16_type2(final_out);
+            }
+            *reinterpret_cast<uint4 *>(&params.out[flat_index2(flat_index2(static_cast<unsigned>(bi), hi,
+                static_cast<unsigned>(params.num_heads)), col, Dh)]) = final_out;
+        }
+        // red_smem, out_red_smem and out_smem are reused by the next query head.
+        __syncthreads();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <unsigned Dh, unsigned WINDOW, bool INT4KV>
+bool streaming_head_attention_launch(const Multihead_attention_params<uint16_t> &params,
+    const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream)
+{
+    constexpr size_t dynamic_smem_sz = Streaming_head_traits<Dh, WINDOW, INT4KV>::SMEM_BYTES;
+    auto kernel = streaming_head_attention_kernel<Dh, WINDOW, INT4KV>;
+
+    const int max_shared_mem = omniserve::cached_device_attribute(cudaDevAttrMaxSharedMemoryPerBlockOptin);
+    cudaFuncAttributes attributes;
+    cudaFuncGetAttributes(&attributes, kernel);
+    // The whole window must fit in shared memory.
+    if (dynamic_smem_sz + attributes.sharedSizeBytes > static_cast<size_t>(max_shared_mem))
+    {
+        return false;
+    }
+    /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */
+    if (dynamic_smem_sz >= 46 * 1024)
+    {
+        omniserve::cached_set_max_dynamic_smem(kernel, dynamic_smem_sz);
+    }
+    dim3 grid{static_cast<unsigned>(params.num_streaming_kv_heads), static_cast<unsigned>(params.batch_size)};
+    kernel<<<grid, STREAMING_HEAD_THREADS, dynamic_smem_sz, stream>>>(params, streaming_kv_buffer);
+    return true;
+}
+
+template <unsigned Dh, unsigned WINDOW>
+bool streaming_head_attention_dispatch_kv_cache(const Multihead_attention_params<uint16_t> &params,
+    const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream)
+{
+    if (params.streaming_int4_kv_cache)
+    {
+        return streaming_head_attention_launch<Dh, WINDOW, true>(params, streaming_kv_buffer, stream);
+    }
+    return streaming_head_attention_launch<Dh, WINDOW, false>(params, streaming_kv_buffer, stream);
+}
+
+template <unsigned Dh>
+bool streaming_head_attention_dispatch_window(const Multihead_attention_params<uint16_t> &params,
+    const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream)
+{
+    switch (params.streaming_sink_token_num + params.streaming_local_token_num)
+    {
+#define STREAMING_HEAD_WINDOW_CASE(WINDOW)                                                                             \
+    case WINDOW: return streaming_head_attention_dispatch_kv_cache<Dh, WINDOW>(params, streaming_kv_buffer, stream);
+        STREAMING_HEAD_WINDOWS(STREAMING_HEAD_WINDOW_CASE)
+#undef STREAMING_HEAD_WINDOW_CASE
+    default: return false;
+    }
+}
+
+} // namespace mmha
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool streaming_head_attention(const Multihead_attention_params<uint16_t> &params,
+                              const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream)
+{
+    // Fine-grained int8-family caches with zeros only (the layout of every deployed fine-grained config but FP8).
+    if (params.num_streaming_kv_heads == 0 || !params.int8_kv_cache || !params.kv_cache_with_zeros
+        || params.finished != nullptr || params.num_heads / params.num_kv_heads > mmha::STREAMING_HEAD_MAX_QHEADS_PER_KV)
+    {
+        return false;
+    }
+    switch (params.hidden_size_per_head)
+    {
+    case 128: return mmha::streaming_head_attention_dispatch_window<128>(params, streaming_kv_buffer, stream);
+    default: return false;
+    }
+}
@@ -0,0 +1,15 @@
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+#pragma once
+
+#include "decoderMaskedMultiheadAttention.h"
+
+// Decoding attention of all the streaming heads of a batch in one launch, with kernels specialised on the
+// sink + local window (see STREAMING_HEAD_WINDOWS in streamingHeadAttention.cu) and the head dim. Handles the
+// fine-grained 8-bit / 4-bit caches with zeros. Returns false, without launching anything, when no specialisation
+// matches: the streaming heads are then left to masked_multihead_attention.
+bool streaming_head_attention(const Multihead_attention_params<uint16_t> &params,
+                              const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream);
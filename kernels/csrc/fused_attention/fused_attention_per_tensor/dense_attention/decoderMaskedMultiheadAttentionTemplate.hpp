@@ -32,6 +32,7 @@
 #include "../../common/memoryUtils.h"
 #include "../../common/decoderMaskedMultiheadAttentionUtils.h"
 #include "../../common/kvCacheUtils.h"
+#include "../../common/kvCacheStatsUtils.h"
 #include "decoderMaskedMultiheadAttention.h"
 #include <cuda_fp16.h>
 #include <cuda_pipeline_primitives.h>
@@ -1001,6 +1002,9 @@ namespace mmha
                 convert_from_float(&kv_zero[i], (ENABLE_8BITS_CACHE ? 0.0f : 0.0f));        // Placeholder for kv_zero
             }
         }
+        // Per-page scales (retrieval heads, see KVBlockArray::getPageAbsmaxPtr): the cached tokens are dequantized with
+        // the scale of their page instead of kv_scale_quant_orig.
+        const bool page_scales = IS_RETRIEVAL_HEAD && ENABLE_8BITS_CACHE && kvCacheBuffer.pageScales;
 
         // Up to QK_VECS_PER_Dh_MAX threads load Q and K + the bias values for the current timestep.
         // Trigger the loads from the Q and K buffers.
@@ -1221,14 +1225,14 @@ namespace mmha
                     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
 
                     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
 
                     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
                 }
                 else
                 {
                     apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
                 }
                 write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
             }
@@ -1347,6 +1351,19 @@ namespace mmha
                 const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(tlength, head_rank, Dh / (ENABLE_4BITS_CACHE ? 2 : 1), k_idx / (ENABLE_4BITS_CACHE ? 2 : 1));
                 // The base pointer for the value in the cache buffer.
                 Tcache *k_cache = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(bi, tlength));
+                if (page_scales)
+                {
+                    // A page opened by this step inherits the static scale, later tokens take the one of their page.
+                    if (kvCacheBuffer.getLocalIdx(tlength) == 0)
+                    {
+                        if (tidx == 0)
+                            store_kv_page_absmax(kvCacheBuffer, k_cache, head_rank, kv_scale_quant_orig[0] * (ENABLE_4BITS_CACHE ? 7.f : 127.f));
+                    }
+                    else
+                    {
+                        kv_scale_orig_quant[0] = load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache, head_rank);
+                    }
+                }
                 if constexpr (ENABLE_ZEROS)
                 {
                     if constexpr (ENABLE_4BITS_CACHE)
@@ -1542,7 +1559,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
                 // The keys loaded from the key cache.
                 K_vec_m k_vec_cache[K_LOOP_UNROLL][K_VECS_PER_THREAD];
-                // float k_scale_quant_orig_local[K_LOOP_UNROLL];
+                float k_scale_quant_orig_local[K_LOOP_UNROLL];
                 // float k_zeros_local[K_LOOP_UNROLL];
 
 #pragma unroll
@@ -1557,6 +1574,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int seqIdx = bi;
                     // Base pointer to k cache block fo r beam's batch
                     Tcache *k_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(seqIdx, logic_time_now));
+                    k_scale_quant_orig_local[k_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache_batch, head_rank) : kv_scale_quant_orig[0];
                     // half *k_scale_quant_orig_local_ptr = reinterpret_cast<half *>(k_cache_batch + kvCacheBuffer.mBytesPerSeq);
                     // half *k_zeros_local_ptr = k_scale_quant_orig_local_ptr + kvCacheBuffer.mTokensPerBlock * num_head_kv_buffer;
                     // int k_scale_quant_orig_local_index = head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(logic_time_now);
@@ -1606,14 +1624,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale, k_zero);
                             convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0], kv_zero[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop], kv_zero[0]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale, k_zero);
                             convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0], kv_zero[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop], kv_zero[0]);
                         }
                         else
                         {
@@ -1658,7 +1676,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
                 // The keys loaded from the key cache.
                 K_vec_m k_vec_cache[K_LOOP_UNROLL][K_VECS_PER_THREAD];
-                // float k_scale_quant_orig_local[K_LOOP_UNROLL];
+                float k_scale_quant_orig_local[K_LOOP_UNROLL];
 
 #pragma unroll
                 for (int k_loop = 0; k_loop < K_LOOP_UNROLL; ++k_loop)
@@ -1671,6 +1689,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int seqIdx = bi;
                     // Base pointer to k cache block fo r beam's batch
                     Tcache *k_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(seqIdx, logic_time_now));
+                    k_scale_quant_orig_local[k_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache_batch, head_rank) : kv_scale_quant_orig[0];
                     // half *k_scale_quant_orig_local_ptr = reinterpret_cast<half *>(k_cache_batch + kvCacheBuffer.mBytesPerSeq);
                     // int k_scale_quant_orig_local_index = kvCacheBuffer.getLocalIdx(logic_time_now) * num_head_kv_buffer + head_rank;
                     // // k_scale_quant_orig_local[k_loop] = __half2float(params.k_scale_quant_orig[(seqIdx * max_seq_len + valid_time_now) * num_heads_kv + hi_kv]);
@@ -1707,14 +1726,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale);
                             convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale);
                             convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop]);
                         }
                         else
                         {
@@ -1925,7 +1944,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int physic_time_base = ti;
                     const int logic_time_base = ti + c_tile_times_timesteps_per_block;
                     V_vec_m v_vec_cache[V_LOOP_UNROLL];
-                    // float v_scale_quant_orig_local[V_LOOP_UNROLL];
+                    float v_scale_quant_orig_local[V_LOOP_UNROLL];
                     // float v_zeros_local[V_LOOP_UNROLL];
 #pragma unroll
                     for (int v_loop = 0; v_loop < V_LOOP_UNROLL; v_loop++)
@@ -1942,6 +1961,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(logic_time_now, head_rank, Dh / (ENABLE_4BITS_CACHE ? 2 : 1), vi / (ENABLE_4BITS_CACHE ? 2 : 1));
                         // The base pointer for the value in the cache buffer.
                         Tcache *v_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getVBlockPtr(rowIdx, logic_time_now));
+                        v_scale_quant_orig_local[v_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_batch, head_rank) : kv_scale_quant_orig[1];
 
                         // half *v_scale_quant_orig_local_ptr = reinterpret_cast<half *>(v_cache_batch + kvCacheBuffer.mBytesPerSeq);
                         // int v_scale_quant_orig_local_index = head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(logic_time_now);
@@ -1970,14 +1990,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], v_zeros_local[v_loop]);
                             convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1], kv_zero[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], kv_zero[1]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], v_zeros_local[v_loop]);
                             convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1], kv_zero[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], kv_zero[1]);
                         }
                         else
                         {
@@ -2013,7 +2033,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int physic_time_base = ti;
                     const int logic_time_base = ti + c_tile_times_timesteps_per_block;
                     V_vec_m v_vec_cache[V_LOOP_UNROLL];
-                    // float v_scale_quant_orig_local[V_LOOP_UNROLL];
+                    float v_scale_quant_orig_local[V_LOOP_UNROLL];
 #pragma unroll
                     for (int v_loop = 0; v_loop < V_LOOP_UNROLL; v_loop++)
                     {
@@ -2028,6 +2048,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(logic_time_now, head_rank, Dh / (ENABLE_4BITS_CACHE ? 2 : 1), vi / (ENABLE_4BITS_CACHE ? 2 : 1));
                         // The base pointer for the value in the cache buffer.
                         Tcache *v_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getVBlockPtr(rowIdx, logic_time_now));
+                        v_scale_quant_orig_local[v_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_batch, head_rank) : kv_scale_quant_orig[1];
 
                         // half *v_scale_quant_orig_local_ptr = reinterpret_cast<half *>(v_cache_batch + kvCacheBuffer.mBytesPerSeq);
                         // int v_scale_quant_orig_local_index = kvCacheBuffer.getLocalIdx(logic_time_now) * num_head_kv_buffer + head_rank;
@@ -2047,14 +2068,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                             convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                             convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                         }
                         else
                         {
@@ -2132,6 +2153,18 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
             // For MQA/GQA mode, write only with the first Q head of each group per KV head.
             if (hi == (hi_kv * qhead_per_kv))
             {
+                if (page_scales)
+                {
+                    if (kvCacheBuffer.getLocalIdx(tlength) == 0)
+                    {
+                        if (vi == 0)
+                            store_kv_page_absmax(kvCacheBuffer, v_cache_base, head_rank, kv_scale_quant_orig[1] * (ENABLE_4BITS_CACHE ? 7.f : 127.f));
+                    }
+                    else
+                    {
+                        kv_scale_orig_quant[1] = load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_base, head_rank);
+                    }
+                }
                 if constexpr (ENABLE_ZEROS)
                 {
                     if constexpr (ENABLE_4BITS_CACHE)
@@ -21,6 +21,7 @@
 #include "../per_tensor_common/update_kv_cache.h"
 #include "fused_attention.h"
 #include "decoderMaskedMultiheadAttention.h"
+#include "../../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -220,7 +221,9 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
                                      const bool kv_cache_with_zeros,
-                                     const int multiblock_switch) {  
+                                     const bool kv_page_scales,  // per-page K / V scales of the retrieval heads (kv_quant_granularity per_page)
+                                     const int multiblock_switch,
+                                     c10::optional<torch::Tensor> rotary_cos_sin_) {  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); //CHECK_DEVICE(kv_pointers);
     int batch_size = q.size(0);
     int nheads = q.size(1);
@@ -283,7 +286,10 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     KVBlockArray<false> retrieval_kv_buffer(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0, 0, 0);
     KVBlockArray<true> streaming_kv_buffer(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
+    retrieval_kv_buffer.pageScales = kv_page_scales;
     streaming_kv_buffer.data = _streaming_kv_pointers.has_value() ? _streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streaming_kv_buffer.setRagged(_streaming_kv_pointers.has_value() && _streaming_kv_pointers->dim() == 1);
      
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
@@ -362,6 +368,8 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    partial_max,
                    block_counter
                    );
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
         auto stream = at::cuda::getCurrentCUDAStream();
         masked_multihead_attention(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
     });
@@ -373,14 +381,18 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_attention",
-    &single_query_attention,
+    omniserve::nvtx_wrap("single_query_attention", &single_query_attention),
     "single query attention kernel from trtllm");
   m.def(
     "apply_bias_rope_update_kv_cache",
-    &apply_bias_rope_update_kv_cache,
+    omniserve::nvtx_wrap("apply_bias_rope_update_kv_cache", &apply_bias_rope_update_kv_cache),
     "(context stage) add bias, apply rope and update kv cache");
   m.def(
     "compute_padding_offsets",
-    &compute_padding_offsets,
+    omniserve::nvtx_wrap("compute_padding_offsets", &compute_padding_offsets),
     "compute padding offsets");
+  m.def(
+    "expand_prompt_metadata",
+    omniserve::nvtx_wrap("expand_prompt_metadata", &expand_prompt_metadata),
+    "expand the packed prompt metadata into lens, cu_seqlens, padding offsets and block pointer tables");
 }
@@ -20,8 +20,8 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const torch::Tensor v,
                                      c10::optional<const torch::Tensor> kv_scale_quant_orig_,
                                      c10::optional<const torch::Tensor> kv_scale_orig_quant_,
-                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                      torch::Tensor retrieval_head_flags, // H
                                      torch::Tensor head_rank_table, // H
                                      c10::optional<const torch::Tensor> length_per_sample_,
@@ -42,4 +42,6 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
                                      const bool kv_cache_with_zeros,
-                                     const int multiblock_switch);
\ No newline at end of file
+                                     const bool kv_page_scales,  // per-page K / V scales of the retrieval heads (kv_quant_granularity per_page)
+                                     const int multiblock_switch,
+                                     c10::optional<torch::Tensor> rotary_cos_sin_); // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
\ No newline at end of file
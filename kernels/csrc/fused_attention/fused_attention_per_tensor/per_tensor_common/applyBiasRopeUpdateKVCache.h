@@ -16,6 +16,7 @@
 #include "../../common/decoderMaskedMultiheadAttentionUtils.h"
 #include "../../common/gptKernels.h"
 #include "../../common/kvCacheUtils.h"
+#include "../../common/kvCacheStatsUtils.h"
 
 #define WARP_SIZE 32
 #define HALF_WARP_SIZE 16
@@ -105,7 +106,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
                                            const int sink_token_len, const int head_num, const int kv_head_num, const int qheads_per_kv_head, 
                                            const int num_hybrid_kv_heads, const int size_per_head, const int rotary_embedding_dim, float rotary_embedding_base,
                                            RotaryScalingType const rotary_scale_type, float rotary_embedding_scale, const int rotary_embedding_max_positions,
-                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const int beam_width)
+                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const float2 *rotary_cos_sin, const int beam_width)
 {
     // if (!is_retrieval_head){
     //     return;
@@ -278,7 +279,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
         case PositionEmbeddingType::kROPE_GPTJ:
         {
             mmha::apply_rotary_embedding(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, rotary_cos_sin);
             break;
         }
         // Rotate by half rotary embedding.
@@ -293,7 +294,7 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
             // e.g. 80 head size (next power of 2 is 128, so each thread will process 4 elements),
             //  which means only thread 0 ~ 10 (exclusive), and 16 ~ 26 (exclusive) have work to do.
             mmha::apply_rotary_embedding_gptneox<Vec_type, Packed_type, T>(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half, rotary_cos_sin);
             break;
         }
         }
@@ -337,8 +338,36 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
         float kv_zeros[2] = {0.0f, 0.0f};
 
         float k_max, v_max, k_min, v_min, cur_k_scale_orig_quant, cur_v_scale_orig_quant, cur_k_zeros, cur_v_zeros;
+        // Per-page scales (retrieval heads, see mmha::is_new_kv_page): the tokens of the pages opened by this launch only
+        // merge their absmax here and are stored by quantizeNewKVPages; the others are quantized with their page scale.
+        bool new_page = false;
         // printf("$$$Modified$$$");
-        if (valid_kv_cache_pos)
+        if (ENABLE_8BITS_CACHE && is_retrieval_head && kvCacheBuffer.pageScales && valid_kv_cache_pos)
+        {
+            new_page = mmha::is_new_kv_page(kvCacheBuffer, token_kv_idx, token_idx_in_seq - seq_idx);
+            if (new_page)
+            {
+                k_max = mmha::vec_max<Vec_type>(k);
+                v_max = mmha::vec_max<Vec_type>(v);
+    #pragma unroll
+                for (int mask = threads_per_head / 2; mask >= 1; mask /= 2)
+                {
+                    k_max = fmaxf(k_max, __shfl_xor_sync(mmha::shfl_mask(threads_per_head), k_max, mask));
+                    v_max = fmaxf(v_max, __shfl_xor_sync(mmha::shfl_mask(threads_per_head), v_max, mask));
+                }
+                if (tidx == 0 && ((head_num == kv_head_num) || (head_idx == (kv_head_idx * qheads_per_kv_head))))
+                {
+                    mmha::merge_kv_page_absmax(kvCacheBuffer, kDst, head_rank, k_max);
+                    mmha::merge_kv_page_absmax(kvCacheBuffer, vDst, head_rank, v_max);
+                }
+            }
+            else
+            {
+                kv_scale_orig_quant[0] = mmha::load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, kDst, head_rank);
+                kv_scale_orig_quant[1] = mmha::load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, vDst, head_rank);
+            }
+        }
+        else if (valid_kv_cache_pos)
         {
             if constexpr (ENABLE_ZEROS)
             {
@@ -454,7 +483,11 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
 
                 if (valid_kv_cache_pos)
                 {
-                    if (ENABLE_ZEROS)
+                    if (new_page)
+                    {
+                        // Stored by quantizeNewKVPages once the absmax of the page is complete.
+                    }
+                    else if (ENABLE_ZEROS)
                     {
                         if constexpr (ENABLE_4BITS_CACHE)
                         {
@@ -516,6 +549,20 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
                             reinterpret_cast<Vec_type *>(vDst)[inBlockIdx] = v;
                         }
                     }
+                    if constexpr (is_retrieval_head)
+                    {
+                        // Fused dynamic_sparse stats: sub-chunk (and super-page) min / max of the cached keys, read by the page selector.
+                        if (kvCacheBuffer.tokensPerSubChunk > 0)
+                        {
+                            mmha::update_k_stats_atomic<Vec_type>(kvCacheBuffer, kDst, num_hybrid_kv_heads, token_kv_idx,
+                                                                  head_rank * size_per_head + channelIdx * VEC_SIZE, k_to_cache);
+                            if (kvCacheBuffer.superPageSize > 0)
+                            {
+                                mmha::update_k_super_stats_atomic<Vec_type>(kvCacheBuffer, batch_beam_idx, num_hybrid_kv_heads, token_kv_idx,
+                                                                            head_rank * size_per_head + channelIdx * VEC_SIZE, k_to_cache);
+                            }
+                        }
+                    }
                 }
             }
         }
@@ -527,6 +574,65 @@ inline __device__ void applyBiasRopeUpdateKVCacheCompute(T *QKV, T *Q, KVCacheBu
 
 
 
+// Stores the tokens of the retrieval-head pages opened by applyBiasRopeUpdateKVCache (per-page scales), once the
+// absmax of each page has been merged. Reads back the roped K and the (biased) V that the update kernel wrote into QKV;
+// the token and position checks mirror the ones of the retrieval heads there.
+template <typename T, typename T_cache, int Dh_MAX, typename KVCacheBuffer, bool INT4KV>
+__global__ void quantizeNewKVPages(const T *QKV, KVCacheBuffer kvCacheBuffer, const int *retrieval_head_flags_ptr,
+                                   const int *head_rank_table_ptr, const int *seq_lens, const int *kv_seq_lens,
+                                   const int *padding_offset, const int num_tokens, const int seq_len,
+                                   const int cyclic_kv_cache_len, const int sink_token_len, const int head_num,
+                                   const int kv_head_num, const int size_per_head)
+{
+    constexpr int VEC_SIZE = Rotary_vec_t<T, Dh_MAX>::size;
+    using Vec_type = typename Rotary_vec_t<T, Dh_MAX>::Type;
+    const int kv_head_idx = blockIdx.y;
+    const int channel_idx = threadIdx.x;
+    if (retrieval_head_flags_ptr[kv_head_idx] == 0 || channel_idx * VEC_SIZE >= size_per_head)
+        return;
+    const int head_rank = head_rank_table_ptr[kv_head_idx];
+    const bool has_padding = padding_offset == nullptr;
+    const int n = (head_num + 2 * kv_head_num) * size_per_head;
+    const int src_k_offset = head_num * size_per_head + kv_head_idx * size_per_head + channel_idx * VEC_SIZE;
+    const int src_v_offset = src_k_offset + kv_head_num * size_per_head;
+
+    for (int token_idx = blockIdx.x * blockDim.y + threadIdx.y; token_idx < num_tokens;
+         token_idx += gridDim.x * blockDim.y)
+    {
+        const int global_token_idx = token_idx + (has_padding ? 0 : padding_offset[token_idx]);
+        const int batch_idx = global_token_idx / seq_len;
+        const int seq_idx = global_token_idx % seq_len;
+        const int actual_seq_len = seq_lens[batch_idx];
+        const int first_token_idx = kv_seq_lens[batch_idx] - actual_seq_len;
+        const int token_idx_in_seq = first_token_idx + seq_idx;
+        const int tokenIdxLowerBound = max(actual_seq_len - cyclic_kv_cache_len + sink_token_len, sink_token_len);
+        const bool valid_seq = token_idx_in_seq < actual_seq_len || !has_padding;
+        const bool valid_kv_cache_pos = token_idx_in_seq >= tokenIdxLowerBound || token_idx_in_seq < sink_token_len;
+        if (!valid_seq || !valid_kv_cache_pos || !mmha::is_new_kv_page(kvCacheBuffer, token_idx_in_seq, first_token_idx))
+            continue;
+
+        auto kDst = reinterpret_cast<T_cache *>(kvCacheBuffer.getKBlockPtr(batch_idx, token_idx_in_seq));
+        auto vDst = reinterpret_cast<T_cache *>(kvCacheBuffer.getVBlockPtr(batch_idx, token_idx_in_seq));
+        const Vec_type k = *reinterpret_cast<const Vec_type *>(&QKV[static_cast<size_t>(token_idx) * n + src_k_offset]);
+        const Vec_type v = *reinterpret_cast<const Vec_type *>(&QKV[static_cast<size_t>(token_idx) * n + src_v_offset]);
+        const float k_scale_orig_quant = mmha::load_kv_page_scale_orig_quant<INT4KV>(kvCacheBuffer, kDst, head_rank);
+        const float v_scale_orig_quant = mmha::load_kv_page_scale_orig_quant<INT4KV>(kvCacheBuffer, vDst, head_rank);
+        int inBlockIdx = kvCacheBuffer.getKVLocalIdx(token_idx_in_seq, head_rank, size_per_head / VEC_SIZE, channel_idx);
+        if constexpr (INT4KV)
+        {
+            inBlockIdx = inBlockIdx * VEC_SIZE / 2;
+            mmha::store_4bits_kv_cache_vec(kDst, k, inBlockIdx, k_scale_orig_quant);
+            mmha::store_4bits_kv_cache_vec(vDst, v, inBlockIdx, v_scale_orig_quant);
+        }
+        else
+        {
+            inBlockIdx = inBlockIdx * VEC_SIZE;
+            mmha::store_8bits_kv_cache_vec(kDst, k, inBlockIdx, k_scale_orig_quant);
+            mmha::store_8bits_kv_cache_vec(vDst, v, inBlockIdx, v_scale_orig_quant);
+        }
+    }
+}
+
 template <typename T, typename T_cache, int Dh_MAX, bool ADD_BIAS, bool STORE_QKV, bool POS_SHIFT,
           typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV = false, bool KV_CACHE_WITH_ZEROS = false>
 __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer retrieval_kvCacheBuffer, StreamingKVCacheBuffer streaming_kvCacheBuffer, const int *retrieval_head_flags_ptr, 
@@ -537,7 +643,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
                                            const int num_retrieval_kv_heads, const int num_streaming_kv_heads,
                                            const int size_per_head, const int rotary_embedding_dim, float rotary_embedding_base,
                                            RotaryScalingType const rotary_scale_type, float rotary_embedding_scale, const int rotary_embedding_max_positions,
-                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const int beam_width)
+                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const float2 *rotary_cos_sin, const int beam_width)
 {
     const int kv_head_idx = blockIdx.y / qheads_per_kv_head;
     const int is_retrieval_head = retrieval_head_flags_ptr[kv_head_idx]!=0;
@@ -545,12 +651,12 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
     if (is_retrieval_head)
     {
         applyBiasRopeUpdateKVCacheCompute<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, RetrievalKVCacheBuffer, IS_GENERATE, true, INT4KV, KV_CACHE_WITH_ZEROS>(
-            QKV, Q, retrieval_kvCacheBuffer, head_rank, qkv_bias, kv_scale_orig_quant_, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_retrieval_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, beam_width);
+            QKV, Q, retrieval_kvCacheBuffer, head_rank, qkv_bias, kv_scale_orig_quant_, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_retrieval_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
     }
     else
     {
         applyBiasRopeUpdateKVCacheCompute<T, T_cache, Dh_MAX, ADD_BIAS, STORE_QKV, POS_SHIFT, StreamingKVCacheBuffer, IS_GENERATE, false, INT4KV, KV_CACHE_WITH_ZEROS>(
-            QKV, Q, streaming_kvCacheBuffer, head_rank, qkv_bias, kv_scale_orig_quant_, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_streaming_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, beam_width);
+            QKV, Q, streaming_kvCacheBuffer, head_rank, qkv_bias, kv_scale_orig_quant_, seq_lens, kv_seq_lens, padding_offset, num_tokens, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, qheads_per_kv_head, num_streaming_kv_heads, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
     }
 }
 
@@ -574,7 +680,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer
                                      kv_head_num, head_num / kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,                   \
                                      size_per_head, rotary_embedding_dim, rotary_embedding_base,                                            \
                                      rotary_scale_type, updated_rotary_embedding_scale, rotary_embedding_max_positions,                     \
-                                     position_embedding_type, medusa_position_offsets, beam_width);
+                                     position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
 
 template <int Dh_MAX, typename T, typename T_cache, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV, bool KV_CACHE_WITH_ZEROS>
 void kernelDispatchHeadSize(T *QKV, T *Q, RetrievalKVCacheBuffer &retrieval_kvTable, StreamingKVCacheBuffer &streaming_kvTable, 
@@ -586,7 +692,7 @@ void kernelDispatchHeadSize(T *QKV, T *Q, RetrievalKVCacheBuffer &retrieval_kvTa
                             const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                             const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                             const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                            const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                            const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                             const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
                             int2 &grid_block_cache, cudaStream_t stream)
 {
@@ -620,6 +726,20 @@ void kernelDispatchHeadSize(T *QKV, T *Q, RetrievalKVCacheBuffer &retrieval_kvTa
             APPLY_BIAS_ROPE_UPDATE_KV_CACHE(Dh_MAX, false, true, false, INT4KV, KV_CACHE_WITH_ZEROS);
         }
     }
+
+    if constexpr (sizeof(T_cache) == 1)
+    {
+        if (retrieval_kvTable.pageScales && retrieval_kvTable.data != nullptr)
+        {
+            // The new pages are complete only once every token of the launch has merged its absmax.
+            constexpr int tokens_per_block = 4;
+            dim3 block(WARP_SIZE, tokens_per_block);
+            dim3 grid((token_num + tokens_per_block - 1) / tokens_per_block, kv_head_num);
+            quantizeNewKVPages<T, T_cache, Dh_MAX, RetrievalKVCacheBuffer, INT4KV><<<grid, block, 0, stream>>>(
+                QKV, retrieval_kvTable, retrieval_head_flags_ptr, head_rank_table_ptr, seq_lens, kv_seq_lens, padding_offset,
+                token_num, seq_len, cyclic_kv_cache_len, sink_token_len, head_num, kv_head_num, size_per_head);
+        }
+    }
 }
 
 template <typename T, typename T_cache, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, bool IS_GENERATE, bool INT4KV, bool KV_CACHE_WITH_ZEROS>
@@ -631,7 +751,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                               const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                               const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                               const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                              const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                                              const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                                               const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
                                               int2 &grid_block_cache, cudaStream_t stream)
 {
@@ -669,7 +789,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                         kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                         kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                         size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                         position_shift_enabled, scale,
                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                         grid_block_cache, stream);
@@ -681,7 +801,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                          size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
                                                                                                          int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                          grid_block_cache, stream);
@@ -693,7 +813,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, RetrievalKVCacheBuff
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                          size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
                                                                                                          int8_mode, enable_paged_kv_fmha, beam_width, grid_block_cache, stream);
     }
@@ -714,7 +834,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                       const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                       const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                       const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                      const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale, const int int8_mode,
+                                      const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale, const int int8_mode,
                                       const KvCacheDataType cache_type,
                                       const bool enable_paged_kv_fmha,
                                       const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
@@ -727,6 +847,15 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
         return;
     }
 
+    if (retrieval_kvTable.tokensPerSubChunk > 0 && retrieval_kvTable.data != nullptr)
+    {
+        mmha::invokeResetKStats(retrieval_kvTable, seq_lens, kv_seq_lens, batch_size, seq_len, num_retrieval_kv_heads, stream);
+    }
+    if (retrieval_kvTable.pageScales && retrieval_kvTable.data != nullptr)
+    {
+        mmha::invokeResetKVPageAbsmax(retrieval_kvTable, seq_lens, kv_seq_lens, batch_size, seq_len, num_retrieval_kv_heads, stream);
+    }
+
     if (cache_type == KvCacheDataType::INT4)
     {
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, IS_GENERATE, true, false>(QKV, Q, retrieval_kvTable, streaming_kvTable, 
@@ -734,7 +863,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                      size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                      grid_block_cache, stream);
@@ -747,7 +876,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                     seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                     head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,
                                                                                                     size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                     position_shift_enabled, scale,
                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                     grid_block_cache, stream);
@@ -760,7 +889,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                       seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                       head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                       size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                       position_shift_enabled, scale,
                                                                                                       int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                       grid_block_cache, stream);
@@ -773,7 +902,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads, 
                                                                                                      size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                      grid_block_cache, stream);
@@ -786,7 +915,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                                  seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, 
                                                                                                  head_num,kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,
                                                                                                  size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                  position_shift_enabled, scale,
                                                                                                  int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                  grid_block_cache, stream);
@@ -804,6 +933,6 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, RetrievalKVCacheBuffer &retr
                                                                                   const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,        \
                                                                                   const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,                     \
                                                                                   const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,     \
-                                                                                  const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,         \
+                                                                                  const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,         \
                                                                                   const int int8_mode, const KvCacheDataType cache_type,                                             \
                                                                                   const bool enable_paged_kv_fmha, const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
\ No newline at end of file
@@ -53,7 +53,11 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
-                                     const bool kv_cache_with_zeros
+                                     const bool kv_cache_with_zeros,
+                                     const int tokens_per_sub_chunk,  // > 0: maintain the dynamic_sparse K stats of the retrieval heads
+                                     const int super_page_size,       // > 0: also maintain the super-page K stats (needs tokens_per_sub_chunk > 0)
+                                     const bool kv_page_scales,       // true: per-page K / V scales for the retrieval heads (kv_quant_granularity per_page)
+                                     c10::optional<torch::Tensor> rotary_cos_sin  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
                                      )
 {
     half *q_ptr = nullptr;
@@ -67,11 +71,21 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
     int batch_size = retrieval_seq_lens.size(0);
     int retrieval_max_blocks_per_seq = retrieval_kv_pointers.has_value() ? retrieval_kv_pointers.value().size(-1) : 0;
     int streaming_max_blocks_per_seq = streaming_kv_pointers.has_value() ? streaming_kv_pointers.value().size(-1) : 0;
-    KVBlockArray<false> retrievalkvTable(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0, 0, 0);
+    TORCH_CHECK(tokens_per_sub_chunk == 0 || tokens_per_block % tokens_per_sub_chunk == 0,
+                "tokens_per_block must be a multiple of tokens_per_sub_chunk");
+    TORCH_CHECK(super_page_size == 0 || tokens_per_sub_chunk > 0, "The super-page K stats require tokens_per_sub_chunk > 0");
+    // The sub-chunk min / max stats of the retrieval heads are updated in the same kernel (no separate pooling pass).
+    KVBlockArray<false> retrievalkvTable(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0,
+                                         tokens_per_sub_chunk, tokens_per_sub_chunk > 0 ? num_retrieval_kv_heads * rotary_embedding_dim : 0);
+    // The super-page stats are merged in the same kernel as well, replacing the separate prefill pooling pass.
+    retrievalkvTable.superPageSize = super_page_size;
+    retrievalkvTable.pageScales = kv_page_scales;
     KVBlockArray<true> streamingkvTable(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
 
     retrievalkvTable.data = retrieval_kv_pointers.has_value() ? retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrievalkvTable.setRagged(retrieval_kv_pointers.has_value() && retrieval_kv_pointers->dim() == 1);
     streamingkvTable.data = streaming_kv_pointers.has_value() ? streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streamingkvTable.setRagged(streaming_kv_pointers.has_value() && streaming_kv_pointers->dim() == 1);
 
     int *retrieval_head_flags_ptr = retrieval_head_flags.data_ptr<int>();
     int *head_rank_table_ptr = head_rank_table.data_ptr<int>();
@@ -86,6 +100,8 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
     // float rotary_embedding_scale = 1.0f;
     PositionEmbeddingType position_embedding_type = PositionEmbeddingType::kROPE_GPT_NEOX;
     int *medusa_position_offsets_ptr = nullptr;
+    // The cached cos / sin table of the layer (rotary_embedding.py), with the frequency scaling baked in.
+    const float2 *rotary_cos_sin_ptr = rotary_cos_sin.has_value() ? reinterpret_cast<const float2 *>(rotary_cos_sin.value().data_ptr<float>()) : nullptr;
     bool position_shift_enabled = false;
     float *scale_ptr = nullptr;
     int int8_mode = 1;
@@ -122,7 +138,7 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
         sink_token_len, token_num, head_num, kv_head_num, num_retrieval_kv_heads, num_streaming_kv_heads,
         size_per_head, rotary_embedding_dim, rotary_embedding_base,
         rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions,
-        position_embedding_type, medusa_position_offsets_ptr, position_shift_enabled,
+        position_embedding_type, medusa_position_offsets_ptr, rotary_cos_sin_ptr, position_shift_enabled,
         scale_ptr, int8_mode, cache_type,
         enable_paged_kv_fmha, beam_width, grid_block_cache, stream);
 
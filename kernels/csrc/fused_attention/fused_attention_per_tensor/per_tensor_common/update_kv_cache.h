@@ -18,8 +18,8 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               torch::Tensor retrieval_seq_lens,
                                               c10::optional<torch::Tensor> streaming_seq_lens,
                                               torch::Tensor padding_offset,
-                                              c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                              c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                              c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                              c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                               torch::Tensor retrieval_head_flags, // H
                                               torch::Tensor head_rank_table, // H
                                               // virtual sequence length (after padding)
@@ -40,5 +40,9 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               // neox_rotary_style = not interleaved
                                               const bool neox_rotary_style,
                                               const bool int4_kv_cache,
-                                              const bool kv_cache_with_zeros
+                                              const bool kv_cache_with_zeros,
+                                              const int tokens_per_sub_chunk,  // > 0: maintain the dynamic_sparse K stats of the retrieval heads
+                                              const int super_page_size,       // > 0: also maintain the super-page K stats (needs tokens_per_sub_chunk > 0)
+                                              const bool kv_page_scales,       // true: per-page K / V scales for the retrieval heads (kv_quant_granularity per_page)
+                                              c10::optional<torch::Tensor> rotary_cos_sin  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
                                               );
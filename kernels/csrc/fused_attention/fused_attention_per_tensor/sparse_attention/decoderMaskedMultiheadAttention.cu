@@ -30,9 +30,11 @@
 #include "decoderMaskedMultiheadAttention.h"
 #include <assert.h>
 #include <cuda_runtime.h>
+#include <algorithm>
 #include <float.h>
 #include <type_traits>
 #include "decoderMaskedMultiheadAttentionTemplate.hpp"
+#include "../../../launch_plan_utils.h"
 
 namespace mmha
 {
@@ -81,11 +83,11 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh,  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
                                                    DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,              \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&available_blocks,                                                   \
+    available_blocks = omniserve::cached_max_active_blocks_per_sm(                                                     \
         mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,      \
             DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                      \
         DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);
@@ -97,16 +99,42 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(                                                                        \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,  \
                  DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                 \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
     mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,          \
          DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                                          \
         <<<grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz, stream>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
 
 
+// One wave of persistent CTAs (limited by occupancy), never more CTAs than work items.
+#define MMHA_PERSISTENT_KERNEL(DYNAMIC_THDS_PER_BLOCK)                                                                 \
+    std::size_t const dynamic_smem_sz{                                                                                 \
+        mmha::smem_size_in_bytes<T, Dh, DO_MULTI_BLOCK>(params, DYNAMIC_THDS_PER_BLOCK)};                              \
+    if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
+    {                                                                                                                  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
+            mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+                DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                          \
+            dynamic_smem_sz);                                                                                          \
+    }                                                                                                                  \
+    int persistent_blocks_per_sm = -1;                                                                                 \
+    persistent_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(                                             \
+        mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+            DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                              \
+        DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);                                                                      \
+    const int multi_processor_count = omniserve::cached_device_attribute(cudaDevAttrMultiProcessorCount);              \
+    const int num_retrieval_qheads = params.num_retrieval_kv_heads * (params.num_heads / params.num_kv_heads);         \
+    const int num_work_items = params.batch_size                                                                       \
+        * (num_retrieval_qheads * static_cast<int>(seq_len_tile) + params.num_heads - num_retrieval_qheads);           \
+    dim3 persistent_grid{static_cast<unsigned>(                                                                        \
+        std::min(std::max(persistent_blocks_per_sm, 1) * multi_processor_count, num_work_items))};                     \
+    mmha::masked_multihead_attention_persistent_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
+        DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                   \
+        <<<persistent_grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz, stream>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
+
 // if resources are not enough to launch 512 threads per block, we will fallback to 256.
 #define MMHA_LAUNCH_512_BLOCKSIZE()                                                                                    \
     int available_blocks = -1;                                                                                         \
@@ -144,6 +172,11 @@ void mmha_launch_kernel_ex(
         params, THDS_PER_BLOCK, tlength, DO_MULTI_BLOCK)};
     dim3 grid{static_cast<unsigned>(params.num_heads), static_cast<unsigned>(params.batch_size),
         static_cast<unsigned>(seq_len_tile)};
+    if (params.persistent_mode)
+    {
+        MMHA_PERSISTENT_KERNEL(THDS_PER_BLOCK);
+        return;
+    }
     if (DO_MULTI_BLOCK)
     {
         MMHA_KERNEL(THDS_PER_BLOCK);
@@ -155,8 +188,6 @@ void mmha_launch_kernel_ex(
         // The max number of warps we can launch per SM is 32 limited by registers.
         if (kernel_total_blocks >= params.multi_processor_count * 4)
         {
-            int max_shared_mem;
-            cudaDeviceGetAttribute(&max_shared_mem, cudaDevAttrMaxSharedMemoryPerBlockOptin, 0);
             MMHA_KERNEL(THDS_PER_BLOCK);
             return;
         }
@@ -164,7 +195,7 @@ void mmha_launch_kernel_ex(
         int num_blocks_per_sm = -1;
         // Set 0 dynamic shared memory size as we need the number of available blocks limited by registers.
         // Dynamic shared memory is fixed for different block size.
-        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks_per_sm,
+        num_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(
             mmha::masked_multihead_attention_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,
             THDS_PER_BLOCK, 0);
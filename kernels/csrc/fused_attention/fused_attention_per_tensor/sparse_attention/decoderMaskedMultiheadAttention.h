@@ -130,6 +130,8 @@ struct Multihead_attention_params_base
     RotaryScalingType rotary_embedding_scale_type = RotaryScalingType::kNONE;
     float rotary_embedding_scale = 1.0f;
     int rotary_embedding_max_positions = 0;
+    // Optional [max_positions, rotary_embedding_dim / 2] (cos, sin) table; replaces base / scale when set.
+    const float2 *rotary_cos_sin = nullptr;
     // The current timestep. TODO Check that do we only this param in cross attention?
     int timestep = 0;
     // The current timestep of each sentences (support different timestep for different sentences)
@@ -231,8 +233,21 @@ struct Multihead_attention_params : public Multihead_attention_params_base<T>
 
     int num_dynamic_sparse_pages = 0;
 
+    // B, pages selected by every row of dynamic_sparse_page_idxes_ptr (num_dynamic_sparse_pages is then the row
+    // stride). nullptr: every row selects num_dynamic_sparse_pages pages.
+    const int *dynamic_sparse_page_nums_ptr = nullptr;
+
+    // Rows of dynamic_sparse_page_idxes_ptr per sequence: num_heads, or num_kv_heads when the selector shares one
+    // page set per KV head (GQA group-shared selection).
+    int num_dynamic_sparse_page_heads = 0;
+
     bool do_dynamic_sparse = false;
 
+    // Persistent decoding: one wave of CTAs drains a device-side queue of (batch, head, KV tile) work items.
+    bool persistent_mode = false;
+    // Work queue head, zero before the launch.
+    int *work_counter = nullptr;
+
 };
 template <class T>
 using Masked_multihead_attention_params = Multihead_attention_params<T>;
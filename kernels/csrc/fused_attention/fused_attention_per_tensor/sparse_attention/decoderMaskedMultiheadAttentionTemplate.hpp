@@ -32,6 +32,7 @@
 #include "../../common/memoryUtils.h"
 #include "../../common/decoderMaskedMultiheadAttentionUtils.h"
 #include "../../common/kvCacheUtils.h"
+#include "../../common/kvCacheStatsUtils.h"
 #include "decoderMaskedMultiheadAttention.h"
 #include <cuda_fp16.h>
 #include <cuda_pipeline_primitives.h>
@@ -749,6 +750,16 @@ namespace mmha
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+    // One unit of decoding attention work: query head hi of sequence bi, and KV tile c_tile out of num_c_tiles
+    // (multi-block mode). The regular kernel reads it from its grid, the persistent kernel from a work queue.
+    struct Mmha_work_item
+    {
+        unsigned hi;
+        unsigned bi;
+        unsigned c_tile;
+        unsigned num_c_tiles;
+    };
+
 
     template <
         // The type of the inputs. Supported types: float, uint16_t, nv_bfloat16.
@@ -780,7 +791,7 @@ namespace mmha
         // Set it default to 4 for higher occupancy (by reducing registers usage).
         unsigned V_LOOP_UNROLL = 4>
     inline __device__ void masked_multihead_attention_kernel(
-        Multihead_attention_params<T> params, KVCacheBuffer kvCacheBuffer, const int head_rank){
+        Multihead_attention_params<T> params, KVCacheBuffer kvCacheBuffer, const int head_rank, const Mmha_work_item work){
 
         // if (blockIdx.x == 0 && blockIdx.y == 0 && blockIdx.z == 0 && threadIdx.x ==0 ){
         //     printf("Here in masked_multihead_attention_kernel DO_MULTI_BLOCK is %d\n", DO_MULTI_BLOCK);
@@ -907,7 +918,7 @@ namespace mmha
         static_assert(THREADS_PER_BLOCK >= QK_VECS_PER_Dh_MAX);
 
         // The batch/beam idx
-        const auto bi = blockIdx.y;
+        const auto bi = work.bi;
         // half *k_scale_quant_orig_ptr = params.k_scale_quant_orig[bi];
         // half *v_scale_quant_orig_ptr = params.v_scale_quant_orig[bi];
         if (params.finished != nullptr && params.finished[bi])
@@ -915,7 +926,7 @@ namespace mmha
             return;
         }
         // The head.
-        const unsigned hi{blockIdx.x};
+        const unsigned hi{work.hi};
         // The head index of keys and values adjusted for MQA/GQA.
         const int qhead_per_kv{params.num_heads / params.num_kv_heads};
         const unsigned hi_kv{hi / qhead_per_kv};
@@ -924,7 +935,13 @@ namespace mmha
         // The number of heads for keys and values adjusted for MQA/GQA.
         const auto num_heads_kv = static_cast<unsigned>(params.num_kv_heads);
 
-        const auto dynamic_sparse_page_idxes_base_ptr = DO_DYNAMIC_SPARSE ? (params.dynamic_sparse_page_idxes_ptr + ((bi * num_heads) + hi) * params.num_dynamic_sparse_pages) : nullptr;
+        // A group-shared selection has one row per KV head, read by all the query heads of the group.
+        const bool page_idxes_per_kv_head = params.num_dynamic_sparse_page_heads == params.num_kv_heads && qhead_per_kv > 1;
+        const auto dynamic_sparse_page_idxes_base_ptr = DO_DYNAMIC_SPARSE ? (params.dynamic_sparse_page_idxes_ptr
+            + (page_idxes_per_kv_head ? (bi * num_heads_kv) + hi_kv : (bi * num_heads) + hi) * params.num_dynamic_sparse_pages) : nullptr;
+        // With per-sequence token budgets every row selects its own number of pages (at most the row stride above).
+        const int num_dynamic_sparse_pages = (DO_DYNAMIC_SPARSE && params.dynamic_sparse_page_nums_ptr != nullptr)
+            ? params.dynamic_sparse_page_nums_ptr[bi] : params.num_dynamic_sparse_pages;
         // printf("Local dynamic_sparse page idxes ptr: %d\n", *dynamic_sparse_page_idxes_base_ptr);
 
         // The thread in the block.
@@ -932,8 +949,8 @@ namespace mmha
 
         // The column tile along L dimension on K^T -- noted as T_c in flash-attention paper
         // const unsigned c_tile{0}; // const unsigned c_tile{MULTI_BLOCK_FLAG ? blockIdx.z : 0};
-        const unsigned c_tile{MULTI_BLOCK_FLAG ? blockIdx.z : 0};
-        if (!IS_RETRIEVAL_HEAD && blockIdx.z != 0)
+        const unsigned c_tile{MULTI_BLOCK_FLAG ? work.c_tile : 0};
+        if (!IS_RETRIEVAL_HEAD && work.c_tile != 0)
         {
             return;
         }
@@ -1002,6 +1019,9 @@ namespace mmha
                 convert_from_float(&kv_zero[i], (ENABLE_8BITS_CACHE ? 0.0f : 0.0f));        // Placeholder for kv_zero
             }
         }
+        // Per-page scales (retrieval heads, see KVBlockArray::getPageAbsmaxPtr): the cached tokens are dequantized with
+        // the scale of their page instead of kv_scale_quant_orig.
+        const bool page_scales = IS_RETRIEVAL_HEAD && ENABLE_8BITS_CACHE && kvCacheBuffer.pageScales;
 
         // Up to QK_VECS_PER_Dh_MAX threads load Q and K + the bias values for the current timestep.
         // Trigger the loads from the Q and K buffers.
@@ -1104,14 +1124,14 @@ namespace mmha
                     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
 
                     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
 
                     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
                 }
                 else
                 {
                     apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
                 }
                 write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
             }
@@ -1160,6 +1180,19 @@ namespace mmha
                 // This getKVLocalIdx() might be helpful
                 // The base pointer for the value in the cache buffer.
                 Tcache *k_cache = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(bi, tlength));
+                if (page_scales)
+                {
+                    // A page opened by this step inherits the static scale, later tokens take the one of their page.
+                    if (kvCacheBuffer.getLocalIdx(tlength) == 0)
+                    {
+                        if (tidx == 0)
+                            store_kv_page_absmax(kvCacheBuffer, k_cache, head_rank, kv_scale_quant_orig[0] * (ENABLE_4BITS_CACHE ? 7.f : 127.f));
+                    }
+                    else
+                    {
+                        kv_scale_orig_quant[0] = load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache, head_rank);
+                    }
+                }
                 if constexpr (ENABLE_ZEROS)
                 {
                     if constexpr (ENABLE_4BITS_CACHE)
@@ -1196,19 +1229,29 @@ namespace mmha
                 }
                 if constexpr (DO_DYNAMIC_SPARSE){
                     // Store the statistics to the k cache buffer (Only implemented min_max for now)
-                    half *k_cache_stats_max_ptr = reinterpret_cast<half *>(k_cache + kvCacheBuffer.mBytesPerSeq) + kvCacheBuffer.mTokensPerBlock * num_head_kv_buffer * (ENABLE_ZEROS? 2 : 1);
-                    half *k_cache_stats_min_ptr = k_cache_stats_max_ptr + kvCacheBuffer.SubChunkGroupSize * kvCacheBuffer.mElesPerIndicator;
+                    half *k_cache_stats_max_ptr = kvCacheBuffer.getKStatsMaxPtr(k_cache, num_head_kv_buffer);
+                    half *k_cache_stats_min_ptr = kvCacheBuffer.getKStatsMinPtr(k_cache, num_head_kv_buffer);
                     int sub_chunk_idx = (tlength % kvCacheBuffer.mTokensPerBlock) / kvCacheBuffer.tokensPerSubChunk;
                     half *k_cache_stats_max_ptr_local = k_cache_stats_max_ptr + sub_chunk_idx * kvCacheBuffer.mElesPerIndicator + head_rank * Dh;
                     half *k_cache_stats_min_ptr_local = k_cache_stats_min_ptr + sub_chunk_idx * kvCacheBuffer.mElesPerIndicator + head_rank * Dh;
 
-                    Qk_vec_k k_buffer;
-                    k_buffer = *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_max_ptr_local[k_idx]);
-                    vec_ele_wise_max<Qk_vec_k, half, QK_VEC_SIZE>(k_buffer, k);    // Make element-wise max_value to k_buffer
+                    // The first token of a sub-chunk overwrites the stats: the page may be recycled from another sequence.
+                    // Only the block handling the kv head writes its stats, so no atomics are needed here.
+                    const bool first_token_of_sub_chunk = tlength % kvCacheBuffer.tokensPerSubChunk == 0;
+                    Qk_vec_k k_buffer = k;
+                    if (!first_token_of_sub_chunk)
+                    {
+                        k_buffer = *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_max_ptr_local[k_idx]);
+                        vec_ele_wise_max<Qk_vec_k, half, QK_VEC_SIZE>(k_buffer, k);    // Make element-wise max_value to k_buffer
+                    }
                     *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_max_ptr_local[k_idx]) = vec_conversion<Qk_vec_m, Qk_vec_k>(k_buffer);
 
-                    k_buffer = *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_min_ptr_local[k_idx]);
-                    vec_ele_wise_min<Qk_vec_k, half, QK_VEC_SIZE>(k_buffer, k);    // Make element-wise min_value to k_buffer
+                    k_buffer = k;
+                    if (!first_token_of_sub_chunk)
+                    {
+                        k_buffer = *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_min_ptr_local[k_idx]);
+                        vec_ele_wise_min<Qk_vec_k, half, QK_VEC_SIZE>(k_buffer, k);    // Make element-wise min_value to k_buffer
+                    }
                     *reinterpret_cast<Qk_vec_m *>(&k_cache_stats_min_ptr_local[k_idx]) = vec_conversion<Qk_vec_m, Qk_vec_k>(k_buffer);
                 }
             }
@@ -1322,9 +1365,9 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
         // const auto context_ti_end = divUp(static_cast<unsigned>(context_length), UNROLLED_K_PER_WARP) * UNROLLED_K_PER_WARP;
 
         // NOTE (Shang): Please be careful when the current token is the first token in the new page!
-        // params.num_dynamic_sparse_pages - 1 because we always have the last page in the num_dynamic_sparse_pages
+        // num_dynamic_sparse_pages - 1 because we always have the last page in the num_dynamic_sparse_pages
         // (context_length - 1) % tokens_per_block + 1 is for the case when the current token is the first token in the new page
-        const int dynamic_sparse_valid_context_length = DO_DYNAMIC_SPARSE ? (params.num_dynamic_sparse_pages - 1) * tokens_per_block + (context_length - 1) % tokens_per_block + 1 : context_length;  // Considering dynamic sparse for reducing the context length.
+        const int dynamic_sparse_valid_context_length = DO_DYNAMIC_SPARSE ? (num_dynamic_sparse_pages - 1) * tokens_per_block + (context_length - 1) % tokens_per_block + 1 : context_length;  // Considering dynamic sparse for reducing the context length.
         
         const int global_valid_context_length = IS_RETRIEVAL_HEAD ? dynamic_sparse_valid_context_length: min(kvCacheBuffer.sinkTokenLen + kvCacheBuffer.localTokenLen - 1, context_length);  // NOTE (Shang): DO_DYNAMIC_SPARSE is always false on the STREAMING Heads.
         // NOTE (Shang): Shall we add - 1 to the kvCacheBuffer.sinkTokenLen + kvCacheBuffer.localTokenLen? Need to verify later.
@@ -1394,7 +1437,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     assert (params.tokens_per_block % (K_LOOP_UNROLL * K_PER_ITER) == 0);     // Otherwise, we cannot make sure that the page idx will not change during the loop. K_LOOP_UNROLL * K_PER_ITER = UNROLLED_K_PER_ITER
 
                     const int page_idx = logic_time_base / tokens_per_block;
-                    if (page_idx < params.num_dynamic_sparse_pages){
+                    if (page_idx < num_dynamic_sparse_pages){
                         const int page_offset = logic_time_base % tokens_per_block;
                         const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                         logic_time_base_shifted = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -1417,6 +1460,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int seqIdx = bi;
                     // Base pointer to k cache block fo r beam's batch
                     Tcache *k_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(seqIdx, logic_time_now));
+                    k_scale_quant_orig_local[k_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache_batch, head_rank) : kv_scale_quant_orig[0];
                     // half *k_scale_quant_orig_local_ptr = reinterpret_cast<half *>(k_cache_batch + kvCacheBuffer.mBytesPerSeq);
                     // half *k_zeros_local_ptr = k_scale_quant_orig_local_ptr + kvCacheBuffer.mTokensPerBlock * num_head_kv_buffer;
                     // int k_scale_quant_orig_local_index = head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(logic_time_now);
@@ -1468,14 +1512,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale, k_zero);
                             convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0], kv_zero[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop], kv_zero[0]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale, k_zero);
                             convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0], kv_zero[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop], kv_zero[0]);
                         }
                         else
                         {
@@ -1525,7 +1569,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     assert (params.tokens_per_block % (K_LOOP_UNROLL * K_PER_ITER) == 0);     // Otherwise, we cannot make sure that the page idx will not change during the loop. K_LOOP_UNROLL * K_PER_ITER = UNROLLED_K_PER_ITER
 
                     const int page_idx = logic_time_base / tokens_per_block;
-                    if (page_idx < params.num_dynamic_sparse_pages){
+                    if (page_idx < num_dynamic_sparse_pages){
                         const int page_offset = logic_time_base % tokens_per_block;
                         const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                         logic_time_base_shifted = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -1537,7 +1581,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
                 // The keys loaded from the key cache.
                 K_vec_m k_vec_cache[K_LOOP_UNROLL][K_VECS_PER_THREAD];
-                // float k_scale_quant_orig_local[K_LOOP_UNROLL];
+                float k_scale_quant_orig_local[K_LOOP_UNROLL];
 
 #pragma unroll
                 for (int k_loop = 0; k_loop < K_LOOP_UNROLL; ++k_loop)
@@ -1551,6 +1595,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                     const int seqIdx = bi;
                     // Base pointer to k cache block fo r beam's batch
                     Tcache *k_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(seqIdx, logic_time_now));
+                    k_scale_quant_orig_local[k_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, k_cache_batch, head_rank) : kv_scale_quant_orig[0];
                     // half *k_scale_quant_orig_local_ptr = reinterpret_cast<half *>(k_cache_batch + kvCacheBuffer.mBytesPerSeq);
                     // int k_scale_quant_orig_local_index = kvCacheBuffer.getLocalIdx(logic_time_now) * num_head_kv_buffer + head_rank;
                     // // k_scale_quant_orig_local[k_loop] = __half2float(params.k_scale_quant_orig[(seqIdx * max_seq_len + valid_time_now) * num_heads_kv + hi_kv]);
@@ -1587,14 +1632,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale);
                             convert_from_4bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
                             //     &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale);
                             convert_from_8bit_kv_cache<K_vec_m, K_vec_k, Tcache, T_scale>(
-                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], kv_scale_quant_orig[0]);
+                                &k_vec[k_vec_i], k_vec_cache[k_loop][k_vec_i], k_scale_quant_orig_local[k_loop]);
                         }
                         else
                         {
@@ -1694,7 +1739,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 // {
                     const int page_idx = _logic_time_now / tokens_per_block;
                     // printf("Softmax page_idx: %d\n", page_idx);
-                    if (page_idx < params.num_dynamic_sparse_pages){
+                    if (page_idx < num_dynamic_sparse_pages){
                         const int page_offset = _logic_time_now % tokens_per_block;
                         const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                         _logic_time_now = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -1776,7 +1821,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 // {
                     const int page_idx = _logic_time_now / tokens_per_block;
                     // printf("Softmax page_idx: %d\n", page_idx);
-                    if (page_idx < params.num_dynamic_sparse_pages){
+                    if (page_idx < num_dynamic_sparse_pages){
                         const int page_offset = _logic_time_now % tokens_per_block;
                         const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                         _logic_time_now = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -1882,7 +1927,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         assert (params.tokens_per_block % (V_LOOP_UNROLL * V_PER_ITER) == 0);     // Otherwise, we cannot make sure that the page idx will not change during the loop. K_LOOP_UNROLL * K_PER_ITER = UNROLLED_K_PER_ITER
 
                         const int page_idx = logic_time_base / tokens_per_block;
-                        if (page_idx < params.num_dynamic_sparse_pages){
+                        if (page_idx < num_dynamic_sparse_pages){
                             const int page_offset = logic_time_base % tokens_per_block;
                             const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                             logic_time_base_shifted = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -1894,7 +1939,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
 
                     V_vec_m v_vec_cache[V_LOOP_UNROLL];
-                    // float v_scale_quant_orig_local[V_LOOP_UNROLL];
+                    float v_scale_quant_orig_local[V_LOOP_UNROLL];
                     // float v_zeros_local[V_LOOP_UNROLL];
 #pragma unroll
                     for (int v_loop = 0; v_loop < V_LOOP_UNROLL; v_loop++)
@@ -1909,6 +1954,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(logic_time_now, head_rank, Dh / (ENABLE_4BITS_CACHE ? 2 : 1), vi / (ENABLE_4BITS_CACHE ? 2 : 1));
                         // The base pointer for the value in the cache buffer.
                         Tcache *v_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getVBlockPtr(rowIdx, logic_time_now));
+                        v_scale_quant_orig_local[v_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_batch, head_rank) : kv_scale_quant_orig[1];
 
                         // half *v_scale_quant_orig_local_ptr = reinterpret_cast<half *>(v_cache_batch + kvCacheBuffer.mBytesPerSeq);
                         // int v_scale_quant_orig_local_index = head_rank * kvCacheBuffer.mTokensPerBlock + kvCacheBuffer.getLocalIdx(logic_time_now);
@@ -1937,14 +1983,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], v_zeros_local[v_loop]);
                             convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1], kv_zero[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], kv_zero[1]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], v_zeros_local[v_loop]);
                             convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1], kv_zero[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop], kv_zero[1]);
                         }
                         else
                         {
@@ -1996,7 +2042,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         assert (params.tokens_per_block % (V_LOOP_UNROLL * V_PER_ITER) == 0);     // Otherwise, we cannot make sure that the page idx will not change during the loop. K_LOOP_UNROLL * K_PER_ITER = UNROLLED_K_PER_ITER
 
                         const int page_idx = logic_time_base / tokens_per_block;
-                        if (page_idx < params.num_dynamic_sparse_pages){
+                        if (page_idx < num_dynamic_sparse_pages){
                             const int page_offset = logic_time_base % tokens_per_block;
                             const int dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_base_ptr[page_idx];
                             logic_time_base_shifted = dynamic_sparse_page_idxes * tokens_per_block + page_offset;
@@ -2022,6 +2068,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                         const int inBlockIdx = kvCacheBuffer.getKVLocalIdx(logic_time_now, head_rank, Dh / (ENABLE_4BITS_CACHE ? 2 : 1), vi / (ENABLE_4BITS_CACHE ? 2 : 1));
                         // The base pointer for the value in the cache buffer.
                         Tcache *v_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getVBlockPtr(rowIdx, logic_time_now));
+                        v_scale_quant_orig_local[v_loop] = page_scales ? load_kv_page_scale<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_batch, head_rank) : kv_scale_quant_orig[1];
 
                         // half *v_scale_quant_orig_local_ptr = reinterpret_cast<half *>(v_cache_batch + kvCacheBuffer.mBytesPerSeq);
                         // int v_scale_quant_orig_local_index = kvCacheBuffer.getLocalIdx(logic_time_now) * num_head_kv_buffer + head_rank;
@@ -2041,14 +2088,14 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                             // convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                             convert_from_4bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                         }
                         else if constexpr (ENABLE_8BITS_CACHE)
                         {
                             // convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
                             //     &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                             convert_from_8bit_kv_cache<V_vec_m, V_vec_k, Tcache, T_scale>(
-                                &v_vec, v_vec_cache[v_loop], kv_scale_quant_orig[1]);
+                                &v_vec, v_vec_cache[v_loop], v_scale_quant_orig_local[v_loop]);
                         }
                         else
                         {
@@ -2084,7 +2131,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
         // if (vo == tlength % V_PER_ITER && is_valid_vi && (!MULTI_BLOCK_FLAG || (c_tile == gridDim.z - 1)))
 
         // NOTE: This part is a bit weird, we need to make sure the vo is valid
-        if (vo == (global_valid_context_length) % V_PER_ITER && is_valid_vi && (!MULTI_BLOCK_FLAG || (c_tile == gridDim.z - 1)))
+        if (vo == (global_valid_context_length) % V_PER_ITER && is_valid_vi && (!MULTI_BLOCK_FLAG || (c_tile == work.num_c_tiles - 1)))
         {
             const int physic_token_idx = block_valid_context_length;
             const int logic_token_idx = tlength;
@@ -2128,6 +2175,18 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
             // For MQA/GQA mode, write only with the first Q head of each group per KV head.
             if (hi == (hi_kv * qhead_per_kv))
             {
+                if (page_scales)
+                {
+                    if (kvCacheBuffer.getLocalIdx(tlength) == 0)
+                    {
+                        if (vi == 0)
+                            store_kv_page_absmax(kvCacheBuffer, v_cache_base, head_rank, kv_scale_quant_orig[1] * (ENABLE_4BITS_CACHE ? 7.f : 127.f));
+                    }
+                    else
+                    {
+                        kv_scale_orig_quant[1] = load_kv_page_scale_orig_quant<ENABLE_4BITS_CACHE>(kvCacheBuffer, v_cache_base, head_rank);
+                    }
+                }
                 if constexpr (ENABLE_ZEROS)
                 {
                     if constexpr (ENABLE_4BITS_CACHE)
@@ -2287,7 +2346,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
             bool last_block{false};
             if (tidx == 0)
             {
-                if (count_ref.fetch_add(1, cuda::memory_order_acq_rel) == (gridDim.z - 1))
+                if (count_ref.fetch_add(1, cuda::memory_order_acq_rel) == (work.num_c_tiles - 1))
                 {
                     last_block = true;
                 }
@@ -2309,7 +2368,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
                 float final_max = -FLT_MAX;
                 float thread_partial_max = -FLT_MAX;
-                if (tidx < gridDim.z)
+                if (tidx < work.num_c_tiles)
                     thread_partial_max = params.partial_max[bhi_seq_len_tile + tidx];
                 // final_max = fmaxf(final_max, thread_partial_max);
 
@@ -2322,7 +2381,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 __shared__ typename BlockReduce::TempStorage temp_storage;
                 // Obtain a segment of consecutive items that are blocked across threads (final_max from above)
                 // Compute the block-wide max for thread0
-                final_max = BlockReduce(temp_storage).Reduce(thread_partial_max, cub::Max(), gridDim.z);
+                final_max = BlockReduce(temp_storage).Reduce(thread_partial_max, cub::Max(), work.num_c_tiles);
 
                 __shared__ float final_max_smem;
                 if (tidx == 0)
@@ -2340,7 +2399,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 ////////////////////
 
                 float final_sum = 0.f;
-                if (tidx < gridDim.z)
+                if (tidx < work.num_c_tiles)
                 {
                     thread_partial_max = params.partial_max[bhi_seq_len_tile + tidx];
                     const auto thread_partial_sum = params.partial_sum[bhi_seq_len_tile + tidx];
@@ -2360,7 +2419,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
 
                 // Number of threads to utilize: THREADS_PER_VALUE * gridDim.z (THREADS_PER_VALUE for vectorized output
                 // and gridDim.z for all the partial outputs)
-                int threads_boundary = THREADS_PER_VALUE * gridDim.z; // should be smaller than THREADS_PER_BLOCK
+                int threads_boundary = THREADS_PER_VALUE * work.num_c_tiles; // should be smaller than THREADS_PER_BLOCK
                 assert(threads_boundary <= THREADS_PER_BLOCK);
 
                 const auto o_idx = chunk_index<T, V_vec_k, THREADS_PER_VALUE>(tidx);
@@ -2391,7 +2450,7 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 __syncthreads();
 
                 // The reduction iteration should start with a number which is a power of 2
-                const auto reduction_iteration = static_cast<int>(cuda::std::bit_ceil(gridDim.z));
+                const auto reduction_iteration = static_cast<int>(cuda::std::bit_ceil(work.num_c_tiles));
 
                 // Run the final reduction amongst the different groups computing different partial outputs.
 #pragma unroll
@@ -2475,10 +2534,11 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
         // The unroll factor for loading from V cache.
         // Set it default to 4 for higher occupancy (by reducing registers usage).
         unsigned V_LOOP_UNROLL = 4>
-    __global__ void masked_multihead_attention_compute(
-        Multihead_attention_params<T> params, RetrievalKVCacheBuffer retrieval_kv_buffer, StreamingKVCacheBuffer streaming_kv_buffer){
+    inline __device__ void masked_multihead_attention_work_item(
+        const Multihead_attention_params<T> &params, const RetrievalKVCacheBuffer &retrieval_kv_buffer, const StreamingKVCacheBuffer &streaming_kv_buffer,
+        const Mmha_work_item &work){
             const int qheads_per_kv_head = params.num_heads / params.num_kv_heads;
-            const int kv_head_idx = blockIdx.x / qheads_per_kv_head;
+            const int kv_head_idx = work.hi / qheads_per_kv_head;
             
             const int is_retrieval_head = params.retrieval_head_flags_ptr[kv_head_idx]!=0;
             const int head_rank = params.head_rank_table_ptr[kv_head_idx];
@@ -2492,13 +2552,136 @@ if constexpr (ENABLE_4BITS_CACHE && ENABLE_ZEROS)
                 // NOTE: We cannot set two branches for do_dynamic_sparse and !do_dynamic_sparse, because the smem will overflow.
                 // NOTE: We can probably move the do_dynamic_sparse branch to the outer wrapper in the future.
                 // if (do_dynamic_sparse){
-                    masked_multihead_attention_kernel<T, Tcache, RetrievalKVCacheBuffer, Dh, THREADS_PER_BLOCK, true /*IS_RETRIEVAL_HEAD*/, DO_MULTI_BLOCK, true /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, retrieval_kv_buffer, head_rank);
+                    masked_multihead_attention_kernel<T, Tcache, RetrievalKVCacheBuffer, Dh, THREADS_PER_BLOCK, true /*IS_RETRIEVAL_HEAD*/, DO_MULTI_BLOCK, true /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, retrieval_kv_buffer, head_rank, work);
                 // }
                 // else{
-                //     masked_multihead_attention_kernel<T, Tcache, RetrievalKVCacheBuffer, Dh, THREADS_PER_BLOCK, true /*IS_RETRIEVAL_HEAD*/, DO_MULTI_BLOCK, false /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, retrieval_kv_buffer, head_rank);
+                //     masked_multihead_attention_kernel<T, Tcache, RetrievalKVCacheBuffer, Dh, THREADS_PER_BLOCK, true /*IS_RETRIEVAL_HEAD*/, DO_MULTI_BLOCK, false /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, retrieval_kv_buffer, head_rank, work);
                 // }
             }else{
-                masked_multihead_attention_kernel<T, Tcache, StreamingKVCacheBuffer, Dh, THREADS_PER_BLOCK, false, false /*DO_MULTI_BLOCK*/, false /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, streaming_kv_buffer, head_rank);
+                masked_multihead_attention_kernel<T, Tcache, StreamingKVCacheBuffer, Dh, THREADS_PER_BLOCK, false, false /*DO_MULTI_BLOCK*/, false /*DO_DYNAMIC_SPARSE*/, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(params, streaming_kv_buffer, head_rank, work);
+            }
+        }
+
+    template <
+        // The type of the inputs. Supported types: float, uint16_t, nv_bfloat16.
+        typename T,
+        // The type of the cache.
+        typename Tcache,
+        // Type of struct containing KV cache
+        typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, 
+        // The hidden dimension per head.
+        unsigned Dh,
+        // The number of threads in a threadblock.
+        unsigned THREADS_PER_BLOCK,
+        // Whether enable multi-block mode for long-sequence-length.
+        bool DO_MULTI_BLOCK = false,
+        // Whether use INT4KV
+        bool INT4KV = false,
+        bool KV_WITH_ZEROS = false,
+        bool SMEM_PRELOAD = false,
+        // The number of threads per key.
+        unsigned THREADS_PER_KEY = mmha::threads_per_key<T, dh_max(Dh)>(),
+        // The number of threads per value.
+        unsigned THREADS_PER_VALUE = mmha::threads_per_value<T>(dh_max(Dh)),
+        // The unroll factor for loading from K cache.
+        // unsigned K_LOOP_UNROLL = 8, // 8,
+        // The unroll factor for loading from V cache.
+        // Set it default to 4 for higher occupancy (by reducing registers usage).
+        unsigned V_LOOP_UNROLL = 4>
+    __global__ void masked_multihead_attention_compute(
+        Multihead_attention_params<T> params, RetrievalKVCacheBuffer retrieval_kv_buffer, StreamingKVCacheBuffer streaming_kv_buffer){
+            const Mmha_work_item work{blockIdx.x, blockIdx.y, blockIdx.z, gridDim.z};
+            masked_multihead_attention_work_item<T, Tcache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THREADS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(
+                params, retrieval_kv_buffer, streaming_kv_buffer, work);
+        }
+
+    // The q head with the given rank among the retrieval (or streaming) q heads, in head order.
+    inline __device__ unsigned persistent_qhead_of_rank(
+        const int *retrieval_head_flags, const unsigned qheads_per_kv_head, const int num_kv_heads, const bool is_retrieval, const unsigned rank){
+            const unsigned kv_rank = rank / qheads_per_kv_head;
+            unsigned seen = 0;
+            for (int kv_head_idx = 0; kv_head_idx < num_kv_heads; kv_head_idx++){
+                if ((retrieval_head_flags[kv_head_idx] != 0) == is_retrieval){
+                    if (seen == kv_rank){
+                        return kv_head_idx * qheads_per_kv_head + rank % qheads_per_kv_head;
+                    }
+                    seen++;
+                }
+            }
+            return 0;
+        }
+
+    // Persistent variant: a grid of (at most) one wave of CTAs pulls work items from params.work_counter until the
+    // queue is drained. The queue holds all retrieval-head items first ([B x retrieval q heads x KV tiles]), then
+    // the streaming-head items ([B x streaming q heads]), so the short sink + local items fill the SMs that the
+    // long retrieval-head tails leave idle instead of waiting behind them in grid order.
+    template <
+        // The type of the inputs. Supported types: float, uint16_t, nv_bfloat16.
+        typename T,
+        // The type of the cache.
+        typename Tcache,
+        // Type of struct containing KV cache
+        typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, 
+        // The hidden dimension per head.
+        unsigned Dh,
+        // The number of threads in a threadblock.
+        unsigned THREADS_PER_BLOCK,
+        // Whether enable multi-block mode for long-sequence-length.
+        bool DO_MULTI_BLOCK = false,
+        // Whether use INT4KV
+        bool INT4KV = false,
+        bool KV_WITH_ZEROS = false,
+        bool SMEM_PRELOAD = false,
+        // The number of threads per key.
+        unsigned THREADS_PER_KEY = mmha::threads_per_key<T, dh_max(Dh)>(),
+        // The number of threads per value.
+        unsigned THREADS_PER_VALUE = mmha::threads_per_value<T>(dh_max(Dh)),
+        // The unroll factor for loading from K cache.
+        // unsigned K_LOOP_UNROLL = 8, // 8,
+        // The unroll factor for loading from V cache.
+        // Set it default to 4 for higher occupancy (by reducing registers usage).
+        unsigned V_LOOP_UNROLL = 4>
+    __global__ void masked_multihead_attention_persistent_compute(
+        Multihead_attention_params<T> params, RetrievalKVCacheBuffer retrieval_kv_buffer, StreamingKVCacheBuffer streaming_kv_buffer){
+            const unsigned qheads_per_kv_head = params.num_heads / params.num_kv_heads;
+            const unsigned num_retrieval_qheads = params.num_retrieval_kv_heads * qheads_per_kv_head;
+            const unsigned num_streaming_qheads = params.num_heads - num_retrieval_qheads;
+            const unsigned num_c_tiles = DO_MULTI_BLOCK ? params.seq_len_tile : 1;
+            const unsigned num_retrieval_items = params.batch_size * num_retrieval_qheads * num_c_tiles;
+            const unsigned num_items = num_retrieval_items + params.batch_size * num_streaming_qheads;
+
+            __shared__ unsigned work_item_idx_smem;
+            while (true){
+                if (threadIdx.x == 0){
+                    work_item_idx_smem = atomicAdd(params.work_counter, 1);
+                }
+                __syncthreads();
+                const unsigned item = work_item_idx_smem;
+                __syncthreads();
+                if (item >= num_items){
+                    break;
+                }
+
+                const bool is_retrieval = item < num_retrieval_items;
+                unsigned rank;
+                Mmha_work_item work;
+                work.num_c_tiles = is_retrieval ? num_c_tiles : 1;
+                if (is_retrieval){
+                    work.c_tile = item % num_c_tiles;
+                    rank = (item / num_c_tiles) % num_retrieval_qheads;
+                    work.bi = item / num_c_tiles / num_retrieval_qheads;
+                }else{
+                    const unsigned streaming_item = item - num_retrieval_items;
+                    work.c_tile = 0;
+                    rank = streaming_item % num_streaming_qheads;
+                    work.bi = streaming_item / num_streaming_qheads;
+                }
+                work.hi = persistent_qhead_of_rank(params.retrieval_head_flags_ptr, qheads_per_kv_head, params.num_kv_heads, is_retrieval, rank);
+
+                masked_multihead_attention_work_item<T, Tcache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THREADS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD, THREADS_PER_KEY, THREADS_PER_VALUE, V_LOOP_UNROLL>(
+                    params, retrieval_kv_buffer, streaming_kv_buffer, work);
+                // The shared memory is reused by the next item.
+                __syncthreads();
             }
         }
     
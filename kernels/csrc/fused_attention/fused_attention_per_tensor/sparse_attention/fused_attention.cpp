@@ -21,6 +21,7 @@
 #include "../per_tensor_common/update_kv_cache.h"
 #include "fused_attention.h"
 #include "decoderMaskedMultiheadAttention.h"
+#include "../../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -220,10 +221,14 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
                                      const bool kv_cache_with_zeros,
+                                     const bool kv_page_scales,  // per-page K / V scales of the retrieval heads (kv_quant_granularity per_page)
                                      const int tokens_per_sub_chunk,
                                      const int hidden_dim_per_retrieval_token,
                                     //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                     const int multiblock_switch) {  
+                                     const int multiblock_switch,
+                                     const bool persistent_mode,
+                                     c10::optional<torch::Tensor> dynamic_sparse_page_nums_,  // B, per-sequence token budgets
+                                     c10::optional<torch::Tensor> rotary_cos_sin_) {  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); //CHECK_DEVICE(kv_pointers);
     int batch_size = q.size(0);
     int nheads = q.size(1);
@@ -273,10 +278,21 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     if (dynamic_sparse_page_idxes_.has_value()) {
       auto dynamic_sparse_page_idxes = dynamic_sparse_page_idxes_.value();
       CHECK_DEVICE(dynamic_sparse_page_idxes);
-      CHECK_SHAPE(dynamic_sparse_page_idxes, batch_size, nheads, num_dynamic_sparse_pages);
+      // One page set per query head, or per KV head (group-shared selection).
+      TORCH_CHECK(dynamic_sparse_page_idxes.dim() == 3 && dynamic_sparse_page_idxes.size(0) == batch_size
+                  && (dynamic_sparse_page_idxes.size(1) == nheads || dynamic_sparse_page_idxes.size(1) == nheads_kv),
+                  "dynamic_sparse_page_idxes must be batch_size x (num_heads or num_kv_heads) x num_dynamic_sparse_pages");
       CHECK_CONTIGUOUS(dynamic_sparse_page_idxes);
       TORCH_CHECK(dynamic_sparse_page_idxes.dtype() == torch::kInt32);
     }
+    if (dynamic_sparse_page_nums_.has_value()) {
+      auto dynamic_sparse_page_nums = dynamic_sparse_page_nums_.value();
+      TORCH_CHECK(do_dynamic_sparse, "dynamic_sparse_page_nums requires dynamic_sparse_page_idxes");
+      CHECK_DEVICE(dynamic_sparse_page_nums);
+      CHECK_SHAPE(dynamic_sparse_page_nums, batch_size);
+      CHECK_CONTIGUOUS(dynamic_sparse_page_nums);
+      TORCH_CHECK(dynamic_sparse_page_nums.dtype() == torch::kInt32);
+    }
 
     int retrieval_max_blocks_per_seq = 0;
     int streaming_max_blocks_per_seq = 0;
@@ -297,7 +313,10 @@ torch::Tensor single_query_attention(const torch::Tensor q,
     KVBlockArray<false> retrieval_kv_buffer(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0, tokens_per_sub_chunk, hidden_dim_per_retrieval_token);
     KVBlockArray<true> streaming_kv_buffer(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
+    retrieval_kv_buffer.pageScales = kv_page_scales;
     streaming_kv_buffer.data = _streaming_kv_pointers.has_value() ? _streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streaming_kv_buffer.setRagged(_streaming_kv_pointers.has_value() && _streaming_kv_pointers->dim() == 1);
      
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
@@ -382,6 +401,18 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    partial_max,
                    block_counter
                    );
+        if (dynamic_sparse_page_nums_.has_value()) {
+            params.dynamic_sparse_page_nums_ptr = dynamic_sparse_page_nums_.value().data_ptr<int>();
+        }
+        params.num_dynamic_sparse_page_heads = do_dynamic_sparse ? dynamic_sparse_page_idxes_.value().size(1) : 0;
+        at::Tensor _work_counter;
+        if (persistent_mode) {
+            _work_counter = torch::zeros({1}, torch::TensorOptions().dtype(torch::kInt32).device(q.device()));
+            params.persistent_mode = true;
+            params.work_counter = reinterpret_cast<int*>(_work_counter.data_ptr());
+        }
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
         auto stream = at::cuda::getCurrentCUDAStream();
         masked_multihead_attention(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
     });
@@ -393,7 +424,7 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_attention",
-    &single_query_attention,
+    omniserve::nvtx_wrap("single_query_attention", &single_query_attention),
     "single query attention kernel from trtllm");
   // m.def(
   //   "apply_bias_rope_update_kv_cache",
@@ -401,6 +432,10 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   //   "(context stage) add bias, apply rope and update kv cache");
   m.def(
     "compute_padding_offsets",
-    &compute_padding_offsets,
+    omniserve::nvtx_wrap("compute_padding_offsets", &compute_padding_offsets),
     "compute padding offsets");
+  m.def(
+    "expand_prompt_metadata",
+    omniserve::nvtx_wrap("expand_prompt_metadata", &expand_prompt_metadata),
+    "expand the packed prompt metadata into lens, cu_seqlens, padding offsets and block pointer tables");
 }
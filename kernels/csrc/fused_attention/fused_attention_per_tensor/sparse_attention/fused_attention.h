@@ -20,8 +20,8 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const torch::Tensor v,
                                      c10::optional<const torch::Tensor> kv_scale_quant_orig_,
                                      c10::optional<const torch::Tensor> kv_scale_orig_quant_,
-                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                     c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                     c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                      torch::Tensor retrieval_head_flags, // H
                                      torch::Tensor head_rank_table, // H
                                      c10::optional<torch::Tensor> dynamic_sparse_page_idxes,      // B x N_head x dynamic_sparse_page_num
@@ -43,7 +43,11 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
                                      const bool kv_cache_with_zeros,
+                                     const bool kv_page_scales,  // per-page K / V scales of the retrieval heads (kv_quant_granularity per_page)
                                      const int tokens_per_sub_chunk,
                                      const int hidden_dim_per_retrieval_token,
                                     //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                     const int multiblock_switch);
\ No newline at end of file
+                                     const int multiblock_switch,
+                                     const bool persistent_mode,
+                                     c10::optional<torch::Tensor> dynamic_sparse_page_nums_, // B, per-sequence token budgets
+                                     c10::optional<torch::Tensor> rotary_cos_sin_); // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
\ No newline at end of file
@@ -99,7 +99,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer kvCacheBu
                                            const int sink_token_len, const int head_num, const int kv_head_num, const int qheads_per_kv_head,
                                            const int size_per_head, const int rotary_embedding_dim, float rotary_embedding_base,
                                            RotaryScalingType const rotary_scale_type, float rotary_embedding_scale, const int rotary_embedding_max_positions,
-                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const int beam_width)
+                                           PositionEmbeddingType const position_embedding_type, const int *medusa_position_offsets, const float2 *rotary_cos_sin, const int beam_width)
 {
     // This kernel add bias to QKV, which has shape [batch_size, seq_len, 3, head_num, size_per_head]
     // Extract the Q input when using paged KV FMHA.
@@ -248,7 +248,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer kvCacheBu
         case PositionEmbeddingType::kROPE_GPTJ:
         {
             mmha::apply_rotary_embedding(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, rotary_cos_sin);
             break;
         }
         // Rotate by half rotary embedding.
@@ -263,7 +263,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer kvCacheBu
             // e.g. 80 head size (next power of 2 is 128, so each thread will process 4 elements),
             //  which means only thread 0 ~ 10 (exclusive), and 16 ~ 26 (exclusive) have work to do.
             mmha::apply_rotary_embedding_gptneox<Vec_type, Packed_type, T>(
-                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half);
+                q, k, tidx, rotary_embedding_dim, updated_base, updated_scale, rotary_position, first_half, rotary_cos_sin);
             break;
         }
         }
@@ -467,7 +467,7 @@ __global__ void applyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer kvCacheBu
                                      token_num, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, head_num,                         \
                                      kv_head_num, head_num / kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base,       \
                                      rotary_scale_type, updated_rotary_embedding_scale, rotary_embedding_max_positions,                     \
-                                     position_embedding_type, medusa_position_offsets, beam_width);
+                                     position_embedding_type, medusa_position_offsets, rotary_cos_sin, beam_width);
 
 template <int Dh_MAX, typename T, typename T_cache, typename KVCacheBuffer, bool IS_GENERATE, bool INT4KV, bool KV_CACHE_WITH_ZEROS>
 void kernelDispatchHeadSize(T *QKV, T *Q, KVCacheBuffer &kvTable, const T *qkv_bias, const int *seq_lens,
@@ -476,7 +476,7 @@ void kernelDispatchHeadSize(T *QKV, T *Q, KVCacheBuffer &kvTable, const T *qkv_b
                             const int kv_head_num, const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                             const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                             const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                            const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                            const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                             const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
                             int2 &grid_block_cache, cudaStream_t stream)
 {
@@ -519,7 +519,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, KVCacheBuffer &kvTab
                                               const int kv_head_num, const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                               const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                               const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                              const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,
+                                              const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,
                                               const int int8_mode, const bool enable_paged_kv_fmha, const int beam_width,
                                               int2 &grid_block_cache, cudaStream_t stream)
 {
@@ -555,7 +555,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, KVCacheBuffer &kvTab
         kernelDispatchHeadSize<64, T, T_cache, KVCacheBuffer, IS_GENERATE, INT4KV, KV_CACHE_WITH_ZEROS>(QKV, Q, kvTable, qkv_bias, seq_lens,
                                                                                                         kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                         kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                        rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                         position_shift_enabled, scale,
                                                                                                         int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                         grid_block_cache, stream);
@@ -565,7 +565,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, KVCacheBuffer &kvTab
         kernelDispatchHeadSize<128, T, T_cache, KVCacheBuffer, IS_GENERATE, INT4KV, KV_CACHE_WITH_ZEROS>(QKV, Q, kvTable, qkv_bias, seq_lens,
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
                                                                                                          int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                          grid_block_cache, stream);
@@ -575,7 +575,7 @@ void invokeApplyBiasRopeUpdateKVCacheDispatch(T *QKV, T *Q, KVCacheBuffer &kvTab
         kernelDispatchHeadSize<256, T, T_cache, KVCacheBuffer, IS_GENERATE, INT4KV, KV_CACHE_WITH_ZEROS>(QKV, Q, kvTable, qkv_bias, seq_lens,
                                                                                                          kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                          kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                         rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                          position_shift_enabled, scale,
                                                                                                          int8_mode, enable_paged_kv_fmha, beam_width, grid_block_cache, stream);
     }
@@ -593,7 +593,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
                                       const int kv_head_num, const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
                                       const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
                                       const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-                                      const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale, const int int8_mode,
+                                      const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale, const int int8_mode,
                                       const KvCacheDataType cache_type,
                                       const bool enable_paged_kv_fmha,
                                       const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
@@ -611,7 +611,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, KVCacheBuffer, IS_GENERATE, true, false>(QKV, Q, kvTable, qkv_bias,
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                      grid_block_cache, stream);
@@ -622,7 +622,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, KVCacheBuffer, IS_GENERATE, true, true>(QKV, Q, kvTable, qkv_bias,
                                                                                                     seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                     head_num, kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                    rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                     position_shift_enabled, scale,
                                                                                                     int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                     grid_block_cache, stream);
@@ -633,7 +633,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, KVCacheBuffer, IS_GENERATE, false, false>(QKV, Q, kvTable, qkv_bias,
                                                                                                       seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                       head_num, kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                      rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                       position_shift_enabled, scale,
                                                                                                       int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                       grid_block_cache, stream);
@@ -644,7 +644,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, int8_t, KVCacheBuffer, IS_GENERATE, false, true>(QKV, Q, kvTable, qkv_bias,
                                                                                                      seq_lens, kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num,
                                                                                                      head_num, kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                     rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                      position_shift_enabled, scale,
                                                                                                      int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                      grid_block_cache, stream);
@@ -655,7 +655,7 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
         invokeApplyBiasRopeUpdateKVCacheDispatch<T, T, KVCacheBuffer, IS_GENERATE, false, false>(QKV, Q, kvTable, qkv_bias, seq_lens,
                                                                                                  kv_seq_lens, padding_offset, batch_size, seq_len, cyclic_kv_cache_len, sink_token_len, token_num, head_num,
                                                                                                  kv_head_num, size_per_head, rotary_embedding_dim, rotary_embedding_base, rotary_scale_type,
-                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets,
+                                                                                                 rotary_embedding_scale, rotary_embedding_max_positions, position_embedding_type, medusa_position_offsets, rotary_cos_sin,
                                                                                                  position_shift_enabled, scale,
                                                                                                  int8_mode, enable_paged_kv_fmha, beam_width,
                                                                                                  grid_block_cache, stream);
@@ -670,6 +670,6 @@ void invokeApplyBiasRopeUpdateKVCache(T *QKV, T *Q, KVCacheBuffer &kvTable, cons
                                                                                   const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,        \
                                                                                   const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,                     \
                                                                                   const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,     \
-                                                                                  const int *medusa_position_offsets, const bool position_shift_enabled, const float *scale,         \
+                                                                                  const int *medusa_position_offsets, const float2 *rotary_cos_sin, const bool position_shift_enabled, const float *scale,         \
                                                                                   const int int8_mode, const KvCacheDataType cache_type,                                             \
                                                                                   const bool enable_paged_kv_fmha, const int beam_width, int2 &grid_block_cache, cudaStream_t stream)
\ No newline at end of file
@@ -28,6 +28,7 @@
 #include <float.h>
 #include <type_traits>
 #include "decoderMaskedMultiheadAttentionTemplate.hpp"
+#include "../../launch_plan_utils.h"
 
 namespace mmha
 {
@@ -68,11 +69,11 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh,  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh, \
                                                    DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                 \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&available_blocks,                                                   \
+    available_blocks = omniserve::cached_max_active_blocks_per_sm(                                                     \
         mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,      \
             DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                                                           \
         DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);
@@ -84,10 +85,10 @@ inline size_t multi_block_grid_setup(const Multihead_attention_params<T>& params
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(                                                                        \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
             mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,             \
                  DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                      \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
     mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,                     \
          DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                               \
@@ -151,7 +152,7 @@ void mmha_launch_kernel_ex(
         int num_blocks_per_sm = -1;
         // Set 0 dynamic shared memory size as we need the number of available blocks limited by registers.
         // Dynamic shared memory is fixed for different block size.
-        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks_per_sm,
+        num_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(
             mmha::masked_multihead_attention_kernel<T, T_cache, KVCacheBuffer, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,
             THDS_PER_BLOCK, 0);
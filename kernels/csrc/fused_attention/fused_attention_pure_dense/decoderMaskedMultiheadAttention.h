@@ -125,6 +125,8 @@ struct Multihead_attention_params_base
     RotaryScalingType rotary_embedding_scale_type = RotaryScalingType::kNONE;
     float rotary_embedding_scale = 1.0f;
     int rotary_embedding_max_positions = 0;
+    // Optional [max_positions, rotary_embedding_dim / 2] (cos, sin) table; replaces base / scale when set.
+    const float2 *rotary_cos_sin = nullptr;
     // The current timestep. TODO Check that do we only this param in cross attention?
     int timestep = 0;
     // The current timestep of each sentences (support different timestep for different sentences)
@@ -1189,14 +1189,14 @@ namespace mmha
                     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
 
                     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
 
                     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
                 }
                 else
                 {
                     apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                                           rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
                 }
                 write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
             }
@@ -16,6 +16,7 @@
 #include "update_kv_cache.h"
 #include "decoderMaskedMultiheadAttention.h"
 #include "kvCacheUtils.h"
+#include "../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -164,9 +165,11 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
-                                     const bool kv_cache_with_zeros) {
+                                     const bool kv_cache_with_zeros,
+                                     c10::optional<torch::Tensor> rotary_cos_sin_) {  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); CHECK_DEVICE(kv_pointers);
-    int batch_size = kv_pointers.size(0);
+    // Ragged tables are flat, see KVBlockArray::setRagged.
+    int batch_size = kv_pointers.dim() == 1 ? q.size(0) : kv_pointers.size(0);
     int nheads = q.size(1);
     int nheads_kv = k.size(1);
     int headdim = k.size(-1);
@@ -210,6 +213,7 @@ torch::Tensor single_query_attention(const torch::Tensor q,
         // KVLinearBuffer kv_buffer{batch_size, 1, memory_max_seqlen, nheads_kv * headdim * sizeof(kv_cache.scalar_type())};
         KVBlockArray kv_buffer(batch_size, kv_pointers.size(-1), tokens_per_block, size_per_token);
         kv_buffer.data = reinterpret_cast<int64_t*>(kv_pointers.data_ptr());
+        kv_buffer.setRagged(kv_pointers.dim() == 1);
         params.int8_kv_cache = true; 
         set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, 
                    timestep, rotary_embedding_dim, rotary_base, neox_rotary_style, q.stride(0),
@@ -233,6 +237,8 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                    alibi_slopes_.has_value() 
                        ? alibi_slopes_.value().data_ptr<float>(): nullptr,
                    reinterpret_cast<DataType*>(out.data_ptr()));
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
         auto stream = at::cuda::getCurrentCUDAStream();
         masked_multihead_attention(params, kv_buffer, stream);
     });
@@ -243,14 +249,14 @@ torch::Tensor single_query_attention(const torch::Tensor q,
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_attention",
-    &single_query_attention,
+    omniserve::nvtx_wrap("single_query_attention", &single_query_attention),
     "single query attention kernel from trtllm");
   m.def(
     "apply_bias_rope_update_kv_cache",
-    &apply_bias_rope_update_kv_cache,
+    omniserve::nvtx_wrap("apply_bias_rope_update_kv_cache", &apply_bias_rope_update_kv_cache),
     "(context stage) add bias, apply rope and update kv cache");
   m.def(
     "compute_padding_offsets",
-    &compute_padding_offsets,
+    omniserve::nvtx_wrap("compute_padding_offsets", &compute_padding_offsets),
     "compute padding offsets");
 }
@@ -13,7 +13,7 @@
 torch::Tensor single_query_attention(const torch::Tensor q,
                                      const torch::Tensor k,
                                      const torch::Tensor v,
-                                     torch::Tensor kv_pointers, // B x 2 x M
+                                     torch::Tensor kv_pointers, // B x 2 x M or ragged
                                      c10::optional<const torch::Tensor> length_per_sample_,
                                      c10::optional<const torch::Tensor> alibi_slopes_,
                                      int memory_max_seqlen,
@@ -25,4 +25,5 @@ torch::Tensor single_query_attention(const torch::Tensor q,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
-                                     const bool kv_cache_with_zeros);
\ No newline at end of file
+                                     const bool kv_cache_with_zeros,
+                                     c10::optional<torch::Tensor> rotary_cos_sin_); // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
\ No newline at end of file
@@ -7,6 +7,7 @@
 //   year={2024}
 // }
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
 
 __global__ void computePaddingOffsets(int *paddingOffsets, const int *seqOffsets, int maxSeqLength)
 {
@@ -38,7 +39,8 @@ torch::Tensor compute_padding_offsets(torch::Tensor &cu_seqlens,
         torch::TensorOptions().dtype(torch::kInt32).device(cu_seqlens.device());
     at::Tensor padding_offsets =
         torch::empty({tot_num_tokens}, options);
-    computePaddingOffsets<<<batch_size, 256>>>(
+    const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    computePaddingOffsets<<<batch_size, 256, 0, stream>>>(
         padding_offsets.data_ptr<int>(), cu_seqlens.data_ptr<int>(),
         max_seqlen);
     return padding_offsets;
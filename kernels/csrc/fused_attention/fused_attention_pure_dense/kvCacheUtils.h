@@ -68,6 +68,10 @@ struct KVBlockArray
     // M is Max number of blocks per sequence
     // int64_t reinterpred to void* pointing to the KV cache data
     int64_t *data;
+    // Ragged (CSR) tables: row seqIdx spans [mRowOffsets[seqIdx], mRowOffsets[seqIdx + 1]) blocks of capacity,
+    // with the K pointers of the row first and the V pointers right behind them (see setRagged).
+    // nullptr for the dense [B, 2, M] tables above.
+    const int64_t *mRowOffsets = nullptr;
 
     KVBlockArray() {}
 
@@ -81,10 +85,27 @@ struct KVBlockArray
         mTokensPerBlockLog2 = static_cast<int>(tokensPerBlockSeqLog2);
     }
 
+    // Switches to the ragged layout when the table is a flat int64 tensor [B + 1 offsets | pointers] instead of
+    // [B, 2, M]. Must be called after data is set. mMaxBlocksPerSeq is unused in the ragged layout.
+    __host__ inline void setRagged(bool ragged)
+    {
+        if (ragged && data != nullptr)
+        {
+            mRowOffsets = data;
+            data = data + mMaxSeqs + 1;
+        }
+    }
+
     __host__ __device__ inline void **getRowPtr(KVIdxType kvIdx, int32_t seqIdx)
     {
         // Returns pointer to array of pointers to K or V cache for one specific sequence seqIdx.
         // seqIdx is in range [0; B]
+        if (mRowOffsets != nullptr)
+        {
+            const int64_t rowStart = mRowOffsets[seqIdx];
+            const int64_t rowCapacity = mRowOffsets[seqIdx + 1] - rowStart;
+            return reinterpret_cast<void **>(data + rowStart * 2 + static_cast<int32_t>(kvIdx) * rowCapacity);
+        }
         return reinterpret_cast<void **>(
             data + seqIdx * mMaxBlocksPerSeq * 2 + static_cast<int32_t>(kvIdx) * mMaxBlocksPerSeq);
     }
@@ -33,7 +33,9 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                      // neox_rotary_style = not interleaved
                                      const bool neox_rotary_style,
                                      const bool int4_kv_cache,
-                                     const bool kv_cache_with_zeros)
+                                     const bool kv_cache_with_zeros,
+                                     c10::optional<torch::Tensor> rotary_cos_sin  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
+                                     )
 {
     half *q_ptr = nullptr;
     half *qkv_ptr = reinterpret_cast<half *>(qkv.data_ptr<at::Half>());
@@ -46,6 +48,7 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
     int max_blocks_per_seq = kv_pointers.has_value() ? kv_pointers.value().size(-1) : 0;
     KVBlockArray kvTable(batch_size, max_blocks_per_seq, tokens_per_block, size_per_token);
     kvTable.data = kv_pointers.has_value() ? kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    kvTable.setRagged(kv_pointers.has_value() && kv_pointers->dim() == 1);
     // NOTE: cyclic_kv_cache_len should not be 0.
     int cyclic_kv_cache_len = rotary_embedding_max_positions;
     int sink_token_len = 0;
@@ -56,6 +59,8 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
     float rotary_embedding_scale = 1.0f;
     PositionEmbeddingType position_embedding_type = PositionEmbeddingType::kROPE_GPT_NEOX;
     int *medusa_position_offsets_ptr = nullptr;
+    // The cached cos / sin table of the layer (rotary_embedding.py), with the frequency scaling baked in.
+    const float2 *rotary_cos_sin_ptr = rotary_cos_sin.has_value() ? reinterpret_cast<const float2 *>(rotary_cos_sin.value().data_ptr<float>()) : nullptr;
     bool position_shift_enabled = false;
     float *scale_ptr = nullptr;
     int int8_mode = 1;
@@ -91,7 +96,7 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
         sink_token_len, token_num, head_num, kv_head_num,
         size_per_head, rotary_embedding_dim, rotary_embedding_base,
         rotary_scale_type, rotary_embedding_scale, rotary_embedding_max_positions,
-        position_embedding_type, medusa_position_offsets_ptr, position_shift_enabled,
+        position_embedding_type, medusa_position_offsets_ptr, rotary_cos_sin_ptr, position_shift_enabled,
         scale_ptr, int8_mode, cache_type,
         enable_paged_kv_fmha, beam_width, grid_block_cache, stream);
 
@@ -102,7 +107,7 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
     //     const int size_per_head, const int rotary_embedding_dim, const float rotary_embedding_base,
     //     const RotaryScalingType rotary_scale_type, const float rotary_embedding_scale,
     //     const int rotary_embedding_max_positions, const PositionEmbeddingType position_embedding_type,
-    //     const int* medusa_position_offsets, const bool position_shift_enabled, const float* scale,
+    //     const int* medusa_position_offsets, const float2* rotary_cos_sin, const bool position_shift_enabled, const float* scale,
     //     const int int8_mode, const KvCacheDataType cache_type, const float* kvScaleOrigQuant,
     //     const bool enable_paged_kv_fmha, const int beam_width, int2& grid_block_cache, cudaStream_t stream);
 }
\ No newline at end of file
@@ -11,7 +11,7 @@
 void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               torch::Tensor seq_lens,
                                               torch::Tensor padding_offset,
-                                              c10::optional<torch::Tensor> kv_pointers, // B x 2 x M
+                                              c10::optional<torch::Tensor> kv_pointers, // B x 2 x M or ragged
                                               // virtual sequence length (after padding)
                                               const int head_num,
                                               const int kv_head_num,
@@ -24,4 +24,6 @@ void apply_bias_rope_update_kv_cache(const torch::Tensor qkv,
                                               // neox_rotary_style = not interleaved
                                               const bool neox_rotary_style,
                                               const bool int4_kv_cache,
-                                              const bool kv_cache_with_zeros);
+                                              const bool kv_cache_with_zeros,
+                                              c10::optional<torch::Tensor> rotary_cos_sin  // max_positions x rotary_embedding_dim / 2 x 2 fp32 (cos, sin), None: computed in the kernel
+                                              );
@@ -0,0 +1,671 @@
+// Implemented by Shang Yang and Haotian Tang.
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <mma.h>
+#include <type_traits>
+#ifdef ENABLE_FP8
+#include <cuda_fp8.h>
+#endif
+#include "ATen/cuda/CUDAContext.h"
+#include <c10/cuda/CUDAGuard.h>
+
+#include "paged_context_attention.h"
+#include "../../launch_plan_utils.h"
+
+// One CTA computes kBlockM query rows of one head; every warp owns 16 rows of the S / P / O tiles, so the online
+// softmax only needs warp-level synchronization. K / V tiles of kBlockN tokens are staged in shared memory as fp16.
+template <int kBlockM_, int kBlockN_, int HeadDim_, int kNWarps_>
+struct Paged_context_attention_traits
+{
+    static constexpr int kBlockM = kBlockM_;
+    static constexpr int kBlockN = kBlockN_;
+    static constexpr int HeadDim = HeadDim_;
+    static constexpr int kNWarps = kNWarps_;
+    static constexpr int kNThreads = kNWarps * 32;
+    static constexpr int kRowsPerWarp = kBlockM / kNWarps;
+    static constexpr int kChunksPerRow = HeadDim / 8;     // 16B of fp16 per chunk
+
+    // Padded rows to avoid bank conflicts; all strides keep the 32B alignment wmma requires.
+    static constexpr int kSmemQStride = HeadDim + 8;
+    static constexpr int kSmemKVStride = HeadDim + 8;
+    static constexpr int kSmemSStride = kBlockN + 4;
+    static constexpr int kSmemPStride = kBlockN + 8;
+    static constexpr int kSmemOStride = HeadDim + 4;
+
+    static constexpr int kSmemSize = (kBlockM * kSmemOStride + kBlockM * kSmemSStride) * sizeof(float)
+        + (kBlockM * kSmemQStride + 2 * kBlockN * kSmemKVStride + kBlockM * kSmemPStride) * sizeof(half);
+
+    static_assert(kRowsPerWarp == 16, "Every warp owns one 16-row wmma tile.");
+    static_assert(kBlockN == 32, "The softmax maps one key of the tile to one lane.");
+    static_assert(HeadDim == 32 * 4, "Every lane writes 4 outputs of a row.");
+};
+
+// 8 cached elements of one token-head -> 8 fp16 values, in the layouts written by apply_bias_rope_update_kv_cache.
+template <typename T_cache, bool INT4_KV_CACHE, bool KV_WITH_ZEROS>
+inline __device__ uint4 dequant_kv_vec8(const int8_t *src, const float scale, const float zero)
+{
+    half out[8];
+    if constexpr (INT4_KV_CACHE)
+    {
+        // Element i is nibble i (low nibble first); unsigned with zeros, signed otherwise.
+        const uint32_t packed = *reinterpret_cast<const uint32_t *>(src);
+#pragma unroll
+        for (int i = 0; i < 8; i++)
+        {
+            int quant = (packed >> (4 * i)) & 0xF;
+            if constexpr (!KV_WITH_ZEROS)
+                quant = (quant ^ 8) - 8;
+            out[i] = __float2half((KV_WITH_ZEROS ? quant - zero : quant) * scale);
+        }
+    }
+#ifdef ENABLE_FP8
+    else if constexpr (std::is_same<T_cache, __nv_fp8_e4m3>::value)
+    {
+        const uint2 packed = *reinterpret_cast<const uint2 *>(src);
+        const __nv_fp8_e4m3 *quant = reinterpret_cast<const __nv_fp8_e4m3 *>(&packed);
+#pragma unroll
+        for (int i = 0; i < 8; i++)
+            out[i] = __float2half(float(quant[i]) * scale);
+    }
+#endif // ENABLE_FP8
+    else
+    {
+        const uint2 packed = *reinterpret_cast<const uint2 *>(src);
+        const int8_t *quant = reinterpret_cast<const int8_t *>(&packed);
+#pragma unroll
+        for (int i = 0; i < 8; i++)
+            out[i] = KV_WITH_ZEROS ? __float2half((uint8_t(quant[i]) - zero) * scale) : __float2half(quant[i] * scale);
+    }
+    return *reinterpret_cast<uint4 *>(out);
+}
+
+// Stages keys / values [n0, n0 + kBlockN) in shared memory. Keys before past_len are dequantized from the pages,
+// keys of the current chunk are copied from the fp16 K / V. Keys no row of the CTA can see are zero-filled so
+// that stale pages (e.g. evicted local pages of a streaming head) never reach the P * V product.
+template <typename T_cache, bool INT4_KV_CACHE, bool KV_WITH_ZEROS, typename Traits, typename KVCacheBuffer>
+inline __device__ void load_kv_tile(const Paged_context_attention_params &params, KVCacheBuffer &kv_buffer,
+                                    const int num_table_heads, const int head_rank, const int bidb, const int kv_head,
+                                    const int q_begin, const int past_len, const int visible_lo, const int visible_hi,
+                                    const int n0, half *k_smem, half *v_smem)
+{
+    constexpr int kBytesPerChunk = INT4_KV_CACHE ? 4 : 8;
+    for (int idx = threadIdx.x; idx < Traits::kBlockN * Traits::kChunksPerRow; idx += Traits::kNThreads)
+    {
+        const int row = idx / Traits::kChunksPerRow;
+        const int chunk = idx % Traits::kChunksPerRow;
+        const int kv_idx = n0 + row;
+        uint4 k_vec = make_uint4(0, 0, 0, 0);
+        uint4 v_vec = make_uint4(0, 0, 0, 0);
+        const bool visible = kv_idx <= visible_hi && (kv_idx < params.sink_size || kv_idx >= visible_lo);
+        if (visible && kv_idx < past_len)
+        {
+            const int8_t *k_block = reinterpret_cast<const int8_t *>(kv_buffer.getKBlockPtr(bidb, kv_idx));
+            const int8_t *v_block = reinterpret_cast<const int8_t *>(kv_buffer.getVBlockPtr(bidb, kv_idx));
+            // [numHeads, tokensPerBlock] scales, then the zeros, after the quantized data of the page.
+            const half *k_scales = reinterpret_cast<const half *>(k_block + kv_buffer.mBytesPerSeq);
+            const half *v_scales = reinterpret_cast<const half *>(v_block + kv_buffer.mBytesPerSeq);
+            const int scale_idx = head_rank * kv_buffer.mTokensPerBlock + kv_buffer.getLocalIdx(kv_idx);
+            const int zero_idx = scale_idx + num_table_heads * kv_buffer.mTokensPerBlock;
+            const float k_zero = KV_WITH_ZEROS ? __half2float(k_scales[zero_idx]) : 0.f;
+            const float v_zero = KV_WITH_ZEROS ? __half2float(v_scales[zero_idx]) : 0.f;
+            const int offset = kv_buffer.getKVLocalIdx(kv_idx, head_rank, Traits::HeadDim / 8 * kBytesPerChunk,
+                                                       chunk * kBytesPerChunk);
+            k_vec = dequant_kv_vec8<T_cache, INT4_KV_CACHE, KV_WITH_ZEROS>(k_block + offset,
+                                                                            __half2float(k_scales[scale_idx]), k_zero);
+            v_vec = dequant_kv_vec8<T_cache, INT4_KV_CACHE, KV_WITH_ZEROS>(v_block + offset,
+                                                                            __half2float(v_scales[scale_idx]), v_zero);
+        }
+        else if (visible)
+        {
+            const int64_t token_idx = q_begin + kv_idx - past_len;
+            k_vec = *reinterpret_cast<const uint4 *>(params.k_ptr + token_idx * params.k_row_stride
+                                                     + kv_head * params.k_head_stride + chunk * 8);
+            v_vec = *reinterpret_cast<const uint4 *>(params.v_ptr + token_idx * params.v_row_stride
+                                                     + kv_head * params.v_head_stride + chunk * 8);
+        }
+        *reinterpret_cast<uint4 *>(k_smem + row * Traits::kSmemKVStride + chunk * 8) = k_vec;
+        *reinterpret_cast<uint4 *>(v_smem + row * Traits::kSmemKVStride + chunk * 8) = v_vec;
+    }
+}
+
+// STREAMING_INT4_KV_CACHE: cache type of the streaming heads (same T_cache and zeros setting as the retrieval heads).
+template <typename T_cache, bool INT4_KV_CACHE, bool STREAMING_INT4_KV_CACHE, bool KV_WITH_ZEROS, typename Traits>
+__global__ void __launch_bounds__(Traits::kNThreads) paged_context_attention_kernel(const Paged_context_attention_params params)
+{
+    using namespace nvcuda;
+    constexpr int kBlockM = Traits::kBlockM;
+    constexpr int kBlockN = Traits::kBlockN;
+    constexpr int HeadDim = Traits::HeadDim;
+    constexpr int kRowsPerWarp = Traits::kRowsPerWarp;
+
+    const int m_block = blockIdx.x;
+    // The block index for the head.
+    const int bidh = blockIdx.y;
+    // The block index for the batch.
+    const int bidb = blockIdx.z;
+    const int q_begin = params.cu_seqlens_q[bidb];
+    const int q_len = params.cu_seqlens_q[bidb + 1] - q_begin;
+    const int m0 = m_block * kBlockM;
+    if (m0 >= q_len) return;
+    const int past_len = params.kv_lens[bidb] - q_len;
+    const int kv_head = bidh / (params.h / params.h_kv);
+    const bool is_retrieval = params.retrieval_head_flags[kv_head] != 0;
+    const int head_rank = params.head_rank_table[kv_head];
+
+    extern __shared__ __align__(128) char smem_[];
+    float *o_smem = reinterpret_cast<float *>(smem_);
+    float *s_smem = o_smem + kBlockM * Traits::kSmemOStride;
+    half *q_smem = reinterpret_cast<half *>(s_smem + kBlockM * Traits::kSmemSStride);
+    half *k_smem = q_smem + kBlockM * Traits::kSmemQStride;
+    half *v_smem = k_smem + kBlockN * Traits::kSmemKVStride;
+    half *p_smem = v_smem + kBlockN * Traits::kSmemKVStride;
+
+    const int warp_id = threadIdx.x / 32;
+    const int lane = threadIdx.x % 32;
+    const int warp_row = warp_id * kRowsPerWarp;
+
+    for (int idx = threadIdx.x; idx < kBlockM * Traits::kChunksPerRow; idx += Traits::kNThreads)
+    {
+        const int row = idx / Traits::kChunksPerRow;
+        const int chunk = idx % Traits::kChunksPerRow;
+        uint4 q_vec = make_uint4(0, 0, 0, 0);
+        if (m0 + row < q_len)
+        {
+            q_vec = *reinterpret_cast<const uint4 *>(params.q_ptr + int64_t(q_begin + m0 + row) * params.q_row_stride
+                                                     + bidh * params.q_head_stride + chunk * 8);
+        }
+        *reinterpret_cast<uint4 *>(q_smem + row * Traits::kSmemQStride + chunk * 8) = q_vec;
+    }
+    for (int idx = threadIdx.x; idx < kBlockM * HeadDim; idx += Traits::kNThreads)
+    {
+        o_smem[idx / HeadDim * Traits::kSmemOStride + idx % HeadDim] = 0.f;
+    }
+    __syncthreads();
+
+    // Positions (in the whole sequence) of the first and last query rows of this CTA.
+    const int q_pos_lo = past_len + m0;
+    const int q_pos_hi = past_len + min(m0 + kBlockM, q_len) - 1;
+    const int n_block_max = q_pos_hi / kBlockN + 1;
+    // First key after the sink that any streaming row of the CTA can see. Tree queries (a single CTA per
+    // sequence) are at positions >= past_len = q_pos_lo, so this also holds with a tree mask.
+    const int visible_lo = is_retrieval ? 0 : q_pos_lo - params.local_size + 1;
+
+    // Shared dynamic sparse pages: the selected pages before the one holding the first chunk token come first as
+    // virtual tiles n_block < n_block_begin, then the tiles from that page on, which are always attended.
+    const bool do_dynamic_sparse = is_retrieval && params.dynamic_sparse_page_idxes != nullptr;
+    const int tiles_per_page = params.tokens_per_block / kBlockN;
+    const int dense_begin = do_dynamic_sparse ? past_len / params.tokens_per_block * params.tokens_per_block : 0;
+    const int n_block_begin = dense_begin / kBlockN;
+    const int *page_idxes = nullptr;
+    int num_sparse_tiles = 0;
+    if (do_dynamic_sparse)
+    {
+        const int page_row = params.dynamic_sparse_page_heads == params.h ? bidh : kv_head;
+        page_idxes = params.dynamic_sparse_page_idxes + (int64_t(bidb) * params.dynamic_sparse_page_heads + page_row) * params.num_dynamic_sparse_pages;
+        const int num_pages = params.dynamic_sparse_page_nums != nullptr ? params.dynamic_sparse_page_nums[bidb]
+                                                                         : params.num_dynamic_sparse_pages;
+        num_sparse_tiles = num_pages * tiles_per_page;
+    }
+
+    float row_max[kRowsPerWarp];
+    float row_sum[kRowsPerWarp];
+#pragma unroll
+    for (int r = 0; r < kRowsPerWarp; r++)
+    {
+        row_max[r] = -INFINITY;
+        row_sum[r] = 0.f;
+    }
+
+    for (int n_block = n_block_begin - num_sparse_tiles; n_block < n_block_max; n_block++)
+    {
+        int n0 = n_block * kBlockN;
+        if (n_block < n_block_begin)
+        {
+            const int tile = n_block - (n_block_begin - num_sparse_tiles);
+            const int page = page_idxes[tile / tiles_per_page];
+            // The selection also holds the most recent page, which is already among the dense tiles.
+            if (page * params.tokens_per_block >= dense_begin)
+                continue;
+            n0 = page * params.tokens_per_block + tile % tiles_per_page * kBlockN;
+        }
+        // Streaming heads skip the tiles between the sink and the local window (uniform across the CTA).
+        if (!is_retrieval && n0 >= params.sink_size && n0 + kBlockN <= visible_lo)
+            continue;
+        if (is_retrieval)
+        {
+            load_kv_tile<T_cache, INT4_KV_CACHE, KV_WITH_ZEROS, Traits>(params, params.retrieval_kv_buffer,
+                params.num_retrieval_kv_heads, head_rank, bidb, kv_head, q_begin, past_len, visible_lo, q_pos_hi,
+                n0, k_smem, v_smem);
+        }
+        else
+        {
+            load_kv_tile<T_cache, STREAMING_INT4_KV_CACHE, KV_WITH_ZEROS, Traits>(params, params.streaming_kv_buffer,
+                params.num_streaming_kv_heads, head_rank, bidb, kv_head, q_begin, past_len, visible_lo, q_pos_hi,
+                n0, k_smem, v_smem);
+        }
+        __syncthreads();
+
+        // S = Q * K^T for the 16 rows of this warp.
+#pragma unroll
+        for (int nf = 0; nf < kBlockN / 16; nf++)
+        {
+            wmma::fragment<wmma::accumulator, 16, 16, 16, float> acc;
+            wmma::fill_fragment(acc, 0.f);
+#pragma unroll
+            for (int kk = 0; kk < HeadDim / 16; kk++)
+            {
+                wmma::fragment<wmma::matrix_a, 16, 16, 16, half, wmma::row_major> a_frag;
+                wmma::fragment<wmma::matrix_b, 16, 16, 16, half, wmma::col_major> b_frag;
+                wmma::load_matrix_sync(a_frag, q_smem + warp_row * Traits::kSmemQStride + kk * 16, Traits::kSmemQStride);
+                wmma::load_matrix_sync(b_frag, k_smem + nf * 16 * Traits::kSmemKVStride + kk * 16, Traits::kSmemKVStride);
+                wmma::mma_sync(acc, a_frag, b_frag, acc);
+            }
+            wmma::store_matrix_sync(s_smem + warp_row * Traits::kSmemSStride + nf * 16, acc, Traits::kSmemSStride,
+                                    wmma::mem_row_major);
+        }
+        __syncwarp();
+
+        // Online softmax, one row at a time; lane i holds key n0 + i.
+        const int kv_idx = n0 + lane;
+#pragma unroll
+        for (int r = 0; r < kRowsPerWarp; r++)
+        {
+            const int row = warp_row + r;
+            const int q_pos = q_pos_lo + row;
+            bool visible = kv_idx <= q_pos && m0 + row < q_len;
+            // Position of the query for the streaming window: its depth in the draft tree with a tree mask.
+            int window_pos = q_pos;
+            if (params.spec_tree_mask != nullptr && m0 + row < q_len)
+            {
+                const int64_t tree_mask = params.spec_tree_mask[q_begin + m0 + row];
+                if (kv_idx >= past_len)
+                    visible = visible && ((tree_mask >> (kv_idx - past_len)) & 1);
+                if (params.spec_position_offsets != nullptr)
+                    window_pos = past_len + params.spec_position_offsets[q_begin + m0 + row];
+            }
+            if (!is_retrieval)
+                visible = visible && (kv_idx < params.sink_size || kv_idx > window_pos - params.local_size);
+            const float x = visible ? s_smem[row * Traits::kSmemSStride + lane] * params.scale_softmax_log2 : -INFINITY;
+            float tile_max = x;
+#pragma unroll
+            for (int mask = 16; mask >= 1; mask /= 2)
+                tile_max = fmaxf(tile_max, __shfl_xor_sync(0xffffffff, tile_max, mask));
+            const float new_max = fmaxf(row_max[r], tile_max);
+            const float p = new_max == -INFINITY ? 0.f : exp2f(x - new_max);
+            float p_sum = p;
+#pragma unroll
+            for (int mask = 16; mask >= 1; mask /= 2)
+                p_sum += __shfl_xor_sync(0xffffffff, p_sum, mask);
+            const float alpha = new_max == -INFINITY ? 1.f : exp2f(row_max[r] - new_max);
+            row_sum[r] = row_sum[r] * alpha + p_sum;
+            row_max[r] = new_max;
+            p_smem[row * Traits::kSmemPStride + lane] = __float2half(p);
+#pragma unroll
+            for (int col = lane; col < HeadDim; col += 32)
+                o_smem[row * Traits::kSmemOStride + col] *= alpha;
+        }
+        __syncwarp();
+
+        // O += P * V
+#pragma unroll
+        for (int of = 0; of < HeadDim / 16; of++)
+        {
+            wmma::fragment<wmma::accumulator, 16, 16, 16, float> acc;
+            float *o_tile = o_smem + warp_row * Traits::kSmemOStride + of * 16;
+            wmma::load_matrix_sync(acc, o_tile, Traits::kSmemOStride, wmma::mem_row_major);
+#pragma unroll
+            for (int kk = 0; kk < kBlockN / 16; kk++)
+            {
+                wmma::fragment<wmma::matrix_a, 16, 16, 16, half, wmma::row_major> a_frag;
+                wmma::fragment<wmma::matrix_b, 16, 16, 16, half, wmma::row_major> b_frag;
+                wmma::load_matrix_sync(a_frag, p_smem + warp_row * Traits::kSmemPStride + kk * 16, Traits::kSmemPStride);
+                wmma::load_matrix_sync(b_frag, v_smem + kk * 16 * Traits::kSmemKVStride + of * 16, Traits::kSmemKVStride);
+                wmma::mma_sync(acc, a_frag, b_frag, acc);
+            }
+            wmma::store_matrix_sync(o_tile, acc, Traits::kSmemOStride, wmma::mem_row_major);
+        }
+        // K / V are overwritten by the next tile.
+        __syncthreads();
+    }
+    __syncwarp();
+
+#pragma unroll
+    for (int r = 0; r < kRowsPerWarp; r++)
+    {
+        const int row = warp_row + r;
+        if (m0 + row >= q_len)
+            break;
+        const float inv_sum = row_sum[r] > 0.f ? 1.f / row_sum[r] : 0.f;
+        const float *o_row = o_smem + row * Traits::kSmemOStride + lane * 4;
+        half2 *out = reinterpret_cast<half2 *>(params.o_ptr + int64_t(q_begin + m0 + row) * params.o_row_stride
+                                               + bidh * params.o_head_stride + lane * 4);
+        out[0] = __floats2half2_rn(o_row[0] * inv_sum, o_row[1] * inv_sum);
+        out[1] = __floats2half2_rn(o_row[2] * inv_sum, o_row[3] * inv_sum);
+    }
+}
+
+template <typename T_cache, bool INT4_KV_CACHE, bool KV_WITH_ZEROS, bool STREAMING_INT4_KV_CACHE = INT4_KV_CACHE>
+void launch_paged_context_attention(const Paged_context_attention_params &params, cudaStream_t stream)
+{
+    using Traits = Paged_context_attention_traits<64, 32, 128, 4>;
+    constexpr int smem_size = Traits::kSmemSize;
+    auto kernel = &paged_context_attention_kernel<T_cache, INT4_KV_CACHE, STREAMING_INT4_KV_CACHE, KV_WITH_ZEROS, Traits>;
+    omniserve::cached_set_max_dynamic_smem(kernel, smem_size);
+    dim3 grid((params.max_seqlen_q + Traits::kBlockM - 1) / Traits::kBlockM, params.h, params.b);
+    kernel<<<grid, Traits::kNThreads, smem_size, stream>>>(params);
+}
+
+template <bool INT4_KV_CACHE, bool KV_WITH_ZEROS>
+void launch_paged_context_attention_int8(const Paged_context_attention_params &params,
+                                         const bool streaming_int4_kv_cache, cudaStream_t stream)
+{
+    if (streaming_int4_kv_cache)
+        launch_paged_context_attention<int8_t, INT4_KV_CACHE, KV_WITH_ZEROS, true>(params, stream);
+    else
+        launch_paged_context_attention<int8_t, INT4_KV_CACHE, KV_WITH_ZEROS, false>(params, stream);
+}
+
+// One CTA per (sequence, head rank of the table). Thread t always moves the same bytes of a token-head, so moving
+// the accepted tokens in ascending order (destination <= source) needs no synchronization. The sub-chunk K stats
+// are not recomputed: they still bound the accepted keys, at the cost of a slightly looser page selection.
+template <typename KVCacheBuffer>
+__global__ void accept_draft_tokens_kernel(KVCacheBuffer kv_buffer, const int *past_lens, const int *accepted_idxes,
+                                           const int *num_accepted, const int max_accepted, const int num_table_heads,
+                                           const int bytes_per_head, const bool kv_with_zeros)
+{
+    const int bidb = blockIdx.x;
+    const int head_rank = blockIdx.y;
+    const int past_len = past_lens[bidb];
+    for (int a = 0; a < num_accepted[bidb]; a++)
+    {
+        const int src_idx = past_len + accepted_idxes[bidb * max_accepted + a];
+        const int dst_idx = past_len + a;
+        if (src_idx == dst_idx)
+            continue;
+#pragma unroll
+        for (int kv = 0; kv < 2; kv++)
+        {
+            const int8_t *src_block = reinterpret_cast<const int8_t *>(
+                kv == 0 ? kv_buffer.getKBlockPtr(bidb, src_idx) : kv_buffer.getVBlockPtr(bidb, src_idx));
+            int8_t *dst_block = reinterpret_cast<int8_t *>(
+                kv == 0 ? kv_buffer.getKBlockPtr(bidb, dst_idx) : kv_buffer.getVBlockPtr(bidb, dst_idx));
+            const int src_offset = kv_buffer.getKVLocalIdx(src_idx, head_rank, bytes_per_head, 0);
+            const int dst_offset = kv_buffer.getKVLocalIdx(dst_idx, head_rank, bytes_per_head, 0);
+            for (int i = threadIdx.x * 4; i < bytes_per_head; i += blockDim.x * 4)
+            {
+                *reinterpret_cast<uint32_t *>(dst_block + dst_offset + i)
+                    = *reinterpret_cast<const uint32_t *>(src_block + src_offset + i);
+            }
+            // The scale (thread 0) and the zero (thread 1) of the token-head, see load_kv_tile.
+            if (threadIdx.x < (kv_with_zeros ? 2 : 1))
+            {
+                const half *src_scales = reinterpret_cast<const half *>(src_block + kv_buffer.mBytesPerSeq);
+                half *dst_scales = reinterpret_cast<half *>(dst_block + kv_buffer.mBytesPerSeq);
+                const int stat_offset = head_rank * kv_buffer.mTokensPerBlock
+                    + threadIdx.x * num_table_heads * kv_buffer.mTokensPerBlock;
+                dst_scales[stat_offset + kv_buffer.getLocalIdx(dst_idx)] = src_scales[stat_offset + kv_buffer.getLocalIdx(src_idx)];
+            }
+        }
+    }
+}
+
+#define CHECK_DEVICE(x) TORCH_CHECK(x.is_cuda(), #x " must be on CUDA")
+#define CHECK_CONTIGUOUS(x) TORCH_CHECK(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_LAST_DIM_CONTIGUOUS(x) TORCH_CHECK(x.stride(-1) == 1, #x " must have a contiguous last dimension")
+
+at::Tensor paged_context_attention(
+    at::Tensor q,
+    at::Tensor k,
+    at::Tensor v,
+    at::Tensor cu_seqlens_q,
+    at::Tensor kv_lens,
+    c10::optional<torch::Tensor> retrieval_kv_pointers,
+    c10::optional<torch::Tensor> streaming_kv_pointers,
+    at::Tensor retrieval_head_flags,
+    at::Tensor head_rank_table,
+    const int max_seqlen_q,
+    const int max_seqlen_k,
+    const int tokens_per_block,
+    const int size_per_retrieval_token,
+    const int size_per_streaming_token,
+    const int sink_token_num, const int local_token_num,
+    const int sink_block_num, const int local_block_num,
+    const int num_retrieval_kv_heads,
+    const int num_streaming_kv_heads,
+    const int ctx_sink_size, const int ctx_local_size,
+    const float softmax_scale,
+    const bool int4_kv_cache,
+    const bool streaming_int4_kv_cache,
+    const bool kv_cache_with_zeros,
+    const bool fp8_kv_cache,
+    c10::optional<torch::Tensor> spec_tree_mask,
+    c10::optional<torch::Tensor> spec_position_offsets,
+    c10::optional<torch::Tensor> dynamic_sparse_page_idxes,
+    c10::optional<torch::Tensor> dynamic_sparse_page_nums
+){
+    TORCH_CHECK(q.dtype() == torch::kFloat16 && k.dtype() == torch::kFloat16 && v.dtype() == torch::kFloat16,
+                "paged context attention only support fp16 for q, k and v");
+    TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "paged context attention only support int32 for cu_seqlens_q");
+    TORCH_CHECK(kv_lens.dtype() == torch::kInt32, "paged context attention only support int32 for kv_lens");
+    CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v);
+    CHECK_DEVICE(cu_seqlens_q); CHECK_DEVICE(kv_lens);
+    CHECK_LAST_DIM_CONTIGUOUS(q); CHECK_LAST_DIM_CONTIGUOUS(k); CHECK_LAST_DIM_CONTIGUOUS(v);
+    CHECK_CONTIGUOUS(cu_seqlens_q); CHECK_CONTIGUOUS(kv_lens);
+    CHECK_CONTIGUOUS(retrieval_head_flags); CHECK_CONTIGUOUS(head_rank_table);
+
+    const int batch_size = cu_seqlens_q.numel() - 1;
+    const int total_q = q.size(0);
+    const int num_heads = q.size(1);
+    const int num_kv_heads = k.size(1);
+    const int head_size = q.size(2);
+    TORCH_CHECK(head_size == 128, "paged context attention only support head_size 128");
+    TORCH_CHECK(k.size(0) == total_q && v.size(0) == total_q && v.size(1) == num_kv_heads
+                && k.size(2) == head_size && v.size(2) == head_size, "k and v must be total_q x num_kv_heads x head_size");
+    TORCH_CHECK(num_heads % num_kv_heads == 0, "num_heads must be divisible by num_kv_heads");
+    TORCH_CHECK(kv_lens.numel() == batch_size, "kv_lens must have batch_size elements");
+    TORCH_CHECK(retrieval_head_flags.numel() == num_kv_heads && head_rank_table.numel() == num_kv_heads,
+                "retrieval_head_flags and head_rank_table must have num_kv_heads elements");
+    TORCH_CHECK(num_retrieval_kv_heads + num_streaming_kv_heads == num_kv_heads,
+                "every kv head is either a retrieval or a streaming head");
+    if (num_streaming_kv_heads > 0 && max_seqlen_k > max_seqlen_q)
+    {
+        // The history of a streaming head is read from its sink pages and its cyclic local pages, which
+        // apply_bias_rope_update_kv_cache has already advanced past the current chunk.
+        TORCH_CHECK(ctx_sink_size <= sink_token_num, "the context sink of a streaming head must be cached");
+        TORCH_CHECK(ctx_local_size <= local_token_num, "the context local window of a streaming head must be cached");
+        // A sequence with cached tokens must also keep chunk_len + ctx_local_size <= (local_block_num - 1) * tokens_per_block,
+        // or its chunk overwrites local pages its queries still attend to. This is per sequence (sequences without
+        // history read their chunk from k / v only), so the scheduler checks it (BlockSpaceManager) rather than max_seqlen_q here.
+    }
+
+    int retrieval_max_blocks_per_seq = 0;
+    int streaming_max_blocks_per_seq = 0;
+    if (retrieval_kv_pointers.has_value())
+    {
+        CHECK_DEVICE(retrieval_kv_pointers.value());
+        CHECK_CONTIGUOUS(retrieval_kv_pointers.value());
+        retrieval_max_blocks_per_seq = retrieval_kv_pointers->size(-1);
+    }
+    if (streaming_kv_pointers.has_value())
+    {
+        CHECK_DEVICE(streaming_kv_pointers.value());
+        CHECK_CONTIGUOUS(streaming_kv_pointers.value());
+        streaming_max_blocks_per_seq = streaming_kv_pointers->size(-1);
+    }
+    TORCH_CHECK(max_seqlen_k <= max_seqlen_q || num_retrieval_kv_heads == 0 || retrieval_kv_pointers.has_value(),
+                "retrieval_kv_pointers are required to attend to cached tokens");
+    TORCH_CHECK(max_seqlen_k <= max_seqlen_q || num_streaming_kv_heads == 0 || streaming_kv_pointers.has_value(),
+                "streaming_kv_pointers are required to attend to cached tokens");
+
+    if (spec_tree_mask.has_value())
+    {
+        TORCH_CHECK(spec_tree_mask->dtype() == torch::kInt64, "spec_tree_mask must be int64");
+        CHECK_DEVICE(spec_tree_mask.value()); CHECK_CONTIGUOUS(spec_tree_mask.value());
+        TORCH_CHECK(spec_tree_mask->numel() == total_q, "spec_tree_mask must have total_q elements");
+        // One bit per chunk token, and all the queries of a sequence in one CTA (see visible_lo).
+        TORCH_CHECK(max_seqlen_q <= 64, "tree masks support at most 64 draft tokens per sequence");
+    }
+    if (spec_position_offsets.has_value())
+    {
+        TORCH_CHECK(spec_tree_mask.has_value(), "spec_position_offsets requires spec_tree_mask");
+        TORCH_CHECK(spec_position_offsets->dtype() == torch::kInt32, "spec_position_offsets must be int32");
+        CHECK_DEVICE(spec_position_offsets.value()); CHECK_CONTIGUOUS(spec_position_offsets.value());
+        TORCH_CHECK(spec_position_offsets->numel() == total_q, "spec_position_offsets must have total_q elements");
+    }
+    int num_dynamic_sparse_pages = 0;
+    if (dynamic_sparse_page_idxes.has_value())
+    {
+        TORCH_CHECK(dynamic_sparse_page_idxes->dtype() == torch::kInt32, "dynamic_sparse_page_idxes must be int32");
+        CHECK_DEVICE(dynamic_sparse_page_idxes.value()); CHECK_CONTIGUOUS(dynamic_sparse_page_idxes.value());
+        TORCH_CHECK(dynamic_sparse_page_idxes->dim() == 3 && dynamic_sparse_page_idxes->size(0) == batch_size
+                    && (dynamic_sparse_page_idxes->size(1) == num_heads || dynamic_sparse_page_idxes->size(1) == num_kv_heads),
+                    "dynamic_sparse_page_idxes must be batch_size x (num_heads or num_kv_heads) x num_dynamic_sparse_pages");
+        TORCH_CHECK(tokens_per_block % 32 == 0, "dynamic sparse pages must hold whole key tiles");
+        num_dynamic_sparse_pages = dynamic_sparse_page_idxes->size(2);
+    }
+    if (dynamic_sparse_page_nums.has_value())
+    {
+        TORCH_CHECK(dynamic_sparse_page_idxes.has_value(), "dynamic_sparse_page_nums requires dynamic_sparse_page_idxes");
+        TORCH_CHECK(dynamic_sparse_page_nums->dtype() == torch::kInt32, "dynamic_sparse_page_nums must be int32");
+        CHECK_DEVICE(dynamic_sparse_page_nums.value()); CHECK_CONTIGUOUS(dynamic_sparse_page_nums.value());
+        TORCH_CHECK(dynamic_sparse_page_nums->numel() == batch_size, "dynamic_sparse_page_nums must have batch_size elements");
+    }
+
+    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    at::Tensor out = torch::empty({total_q, num_heads, head_size}, q.options());
+
+    Paged_context_attention_params params = {};
+    params.q_ptr = reinterpret_cast<half *>(q.data_ptr());
+    params.k_ptr = reinterpret_cast<half *>(k.data_ptr());
+    params.v_ptr = reinterpret_cast<half *>(v.data_ptr());
+    params.o_ptr = reinterpret_cast<half *>(out.data_ptr());
+    params.q_row_stride = q.stride(0);
+    params.q_head_stride = q.stride(1);
+    params.k_row_stride = k.stride(0);
+    params.k_head_stride = k.stride(1);
+    params.v_row_stride = v.stride(0);
+    params.v_head_stride = v.stride(1);
+    params.o_row_stride = out.stride(0);
+    params.o_head_stride = out.stride(1);
+    params.cu_seqlens_q = cu_seqlens_q.data_ptr<int>();
+    params.kv_lens = kv_lens.data_ptr<int>();
+    params.retrieval_head_flags = retrieval_head_flags.data_ptr<int>();
+    params.head_rank_table = head_rank_table.data_ptr<int>();
+    params.b = batch_size;
+    params.h = num_heads;
+    params.h_kv = num_kv_heads;
+    params.d = head_size;
+    params.max_seqlen_q = max_seqlen_q;
+    params.num_retrieval_kv_heads = num_retrieval_kv_heads;
+    params.num_streaming_kv_heads = num_streaming_kv_heads;
+    params.sink_size = ctx_sink_size;
+    params.local_size = ctx_local_size;
+    params.scale_softmax_log2 = softmax_scale * M_LOG2E;
+    params.spec_tree_mask = spec_tree_mask.has_value() ? spec_tree_mask->data_ptr<int64_t>() : nullptr;
+    params.spec_position_offsets = spec_position_offsets.has_value() ? spec_position_offsets->data_ptr<int>() : nullptr;
+    params.dynamic_sparse_page_idxes = dynamic_sparse_page_idxes.has_value() ? dynamic_sparse_page_idxes->data_ptr<int>() : nullptr;
+    params.dynamic_sparse_page_nums = dynamic_sparse_page_nums.has_value() ? dynamic_sparse_page_nums->data_ptr<int>() : nullptr;
+    params.num_dynamic_sparse_pages = num_dynamic_sparse_pages;
+    params.dynamic_sparse_page_heads = dynamic_sparse_page_idxes.has_value() ? dynamic_sparse_page_idxes->size(1) : 0;
+    params.tokens_per_block = tokens_per_block;
+    params.retrieval_kv_buffer = KVBlockArray<false>(batch_size, retrieval_max_blocks_per_seq, tokens_per_block,
+                                                     size_per_retrieval_token, 0, 0, 0, 0, 0, 0);
+    params.streaming_kv_buffer = KVBlockArray<true>(batch_size, streaming_max_blocks_per_seq, tokens_per_block,
+                                                    size_per_streaming_token, sink_token_num, local_token_num,
+                                                    sink_block_num, local_block_num, 0, 0);
+    params.retrieval_kv_buffer.data = retrieval_kv_pointers.has_value() ? retrieval_kv_pointers->data_ptr<int64_t>() : nullptr;
+    params.retrieval_kv_buffer.setRagged(retrieval_kv_pointers.has_value() && retrieval_kv_pointers->dim() == 1);
+    params.streaming_kv_buffer.data = streaming_kv_pointers.has_value() ? streaming_kv_pointers->data_ptr<int64_t>() : nullptr;
+    params.streaming_kv_buffer.setRagged(streaming_kv_pointers.has_value() && streaming_kv_pointers->dim() == 1);
+
+    auto stream = at::cuda::getCurrentCUDAStream();
+    if (fp8_kv_cache)
+    {
+#ifdef ENABLE_FP8
+        TORCH_CHECK(!int4_kv_cache && !streaming_int4_kv_cache && !kv_cache_with_zeros,
+                    "The FP8 KV cache is symmetric 8-bit");
+        launch_paged_context_attention<__nv_fp8_e4m3, false, false>(params, stream);
+#else
+        TORCH_CHECK(false, "The FP8 KV cache requires building with ENABLE_FP8 (CUDA >= 11.8)");
+#endif
+    }
+    else if (int4_kv_cache)
+    {
+        if (kv_cache_with_zeros)
+            launch_paged_context_attention_int8<true, true>(params, streaming_int4_kv_cache, stream);
+        else
+            launch_paged_context_attention_int8<true, false>(params, streaming_int4_kv_cache, stream);
+    }
+    else
+    {
+        if (kv_cache_with_zeros)
+            launch_paged_context_attention_int8<false, true>(params, streaming_int4_kv_cache, stream);
+        else
+            launch_paged_context_attention_int8<false, false>(params, streaming_int4_kv_cache, stream);
+    }
+    return out;
+}
+
+void accept_draft_tokens(
+    c10::optional<torch::Tensor> retrieval_kv_pointers,
+    c10::optional<torch::Tensor> streaming_kv_pointers,
+    at::Tensor past_lens,
+    at::Tensor accepted_idxes,
+    at::Tensor num_accepted,
+    const int tokens_per_block,
+    const int head_size,
+    const int size_per_retrieval_token,
+    const int size_per_streaming_token,
+    const int sink_token_num, const int local_token_num,
+    const int sink_block_num, const int local_block_num,
+    const int num_retrieval_kv_heads,
+    const int num_streaming_kv_heads,
+    const bool int4_kv_cache,
+    const bool streaming_int4_kv_cache,
+    const bool kv_cache_with_zeros
+){
+    TORCH_CHECK(past_lens.dtype() == torch::kInt32 && accepted_idxes.dtype() == torch::kInt32
+                && num_accepted.dtype() == torch::kInt32, "accept_draft_tokens only support int32 indices");
+    CHECK_DEVICE(past_lens); CHECK_DEVICE(accepted_idxes); CHECK_DEVICE(num_accepted);
+    CHECK_CONTIGUOUS(past_lens); CHECK_CONTIGUOUS(accepted_idxes); CHECK_CONTIGUOUS(num_accepted);
+    const int batch_size = past_lens.numel();
+    TORCH_CHECK(accepted_idxes.dim() == 2 && accepted_idxes.size(0) == batch_size,
+                "accepted_idxes must be batch_size x max_accepted");
+    TORCH_CHECK(num_accepted.numel() == batch_size, "num_accepted must have batch_size elements");
+    const int max_accepted = accepted_idxes.size(1);
+    const int bytes_per_head = int4_kv_cache ? head_size / 2 : head_size;
+    const int streaming_bytes_per_head = streaming_int4_kv_cache ? head_size / 2 : head_size;
+    TORCH_CHECK(bytes_per_head % 4 == 0 && streaming_bytes_per_head % 4 == 0, "head_size must be a multiple of 8");
+    if (batch_size == 0 || max_accepted == 0)
+        return;
+
+    at::cuda::CUDAGuard device_guard{(char)past_lens.get_device()};
+    auto stream = at::cuda::getCurrentCUDAStream();
+    if (retrieval_kv_pointers.has_value() && num_retrieval_kv_heads > 0)
+    {
+        CHECK_DEVICE(retrieval_kv_pointers.value()); CHECK_CONTIGUOUS(retrieval_kv_pointers.value());
+        KVBlockArray<false> kv_buffer(batch_size, retrieval_kv_pointers->size(-1), tokens_per_block,
+                                      size_per_retrieval_token, 0, 0, 0, 0, 0, 0);
+        kv_buffer.data = retrieval_kv_pointers->data_ptr<int64_t>();
+        kv_buffer.setRagged(retrieval_kv_pointers->dim() == 1);
+        accept_draft_tokens_kernel<<<dim3(batch_size, num_retrieval_kv_heads), 128, 0, stream>>>(
+            kv_buffer, past_lens.data_ptr<int>(), accepted_idxes.data_ptr<int>(), num_accepted.data_ptr<int>(),
+            max_accepted, num_retrieval_kv_heads, bytes_per_head, kv_cache_with_zeros);
+    }
+    if (streaming_kv_pointers.has_value() && num_streaming_kv_heads > 0)
+    {
+        CHECK_DEVICE(streaming_kv_pointers.value()); CHECK_CONTIGUOUS(streaming_kv_pointers.value());
+        KVBlockArray<true> kv_buffer(batch_size, streaming_kv_pointers->size(-1), tokens_per_block,
+                                     size_per_streaming_token, sink_token_num, local_token_num,
+                                     sink_block_num, local_block_num, 0, 0);
+        kv_buffer.data = streaming_kv_pointers->data_ptr<int64_t>();
+        kv_buffer.setRagged(streaming_kv_pointers->dim() == 1);
+        accept_draft_tokens_kernel<<<dim3(batch_size, num_streaming_kv_heads), 128, 0, stream>>>(
+            kv_buffer, past_lens.data_ptr<int>(), accepted_idxes.data_ptr<int>(), num_accepted.data_ptr<int>(),
+            max_accepted, num_streaming_kv_heads, streaming_bytes_per_head, kv_cache_with_zeros);
+    }
+}
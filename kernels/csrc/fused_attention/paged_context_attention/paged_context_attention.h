@@ -0,0 +1,121 @@
+// Implemented by Shang Yang and Haotian Tang.
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Prefill attention over the paged (quantized) KV cache. The tokens cached before the current chunk are read from
+// the retrieval / streaming page tables and dequantized in shared memory; the tokens of the chunk itself come from
+// the fp16 QKV buffer written by apply_bias_rope_update_kv_cache. Retrieval heads attend causally to the whole
+// sequence, streaming heads (full_attention_heads.tsv == 0) only to the sink and local tokens.
+//
+// Speculative decoding runs the verification step through the same kernel: the K draft tokens of a sequence are
+// its chunk, a packed tree mask replaces the causal mask inside the chunk and the retrieval heads can be restricted
+// to one dynamic sparse page selection shared by all the K tokens. accept_draft_tokens then compacts the accepted
+// path of every tree so that the rejected tokens are dropped from the cache.
+#pragma once
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#include <torch/extension.h>
+
+#include "../common/kvCacheUtils.h"
+
+struct Paged_context_attention_params
+{
+    using index_t = int64_t;
+    half *q_ptr;
+    half *k_ptr;
+    half *v_ptr;
+    half *o_ptr;
+
+    // All strides are in elements, not bytes.
+    index_t q_row_stride, q_head_stride;
+    index_t k_row_stride, k_head_stride;
+    index_t v_row_stride, v_head_stride;
+    index_t o_row_stride, o_head_stride;
+
+    int *cu_seqlens_q;              // b + 1, tokens of the current chunk
+    int *kv_lens;                   // b, cached tokens including the current chunk
+    int *retrieval_head_flags;      // kv heads, 1: retrieval head
+    int *head_rank_table;           // kv heads, rank of the head inside its page table
+
+    int b, h, h_kv, d, max_seqlen_q;
+    int num_retrieval_kv_heads, num_streaming_kv_heads;
+
+    // Streaming-head mask: key j is visible to the query at position p iff j < sink_size or j > p - local_size.
+    int sink_size, local_size;
+
+    float scale_softmax_log2;
+
+    // total_q, bit j of the row of a query: it attends to token j of its chunk. nullptr: causal chunk.
+    const int64_t *spec_tree_mask;
+    // total_q, depth of a query in its draft tree (its position is past_len + depth). Only read with a tree mask.
+    const int *spec_position_offsets;
+
+    // b x h x num_dynamic_sparse_pages logical page indices of the retrieval heads, shared by all the queries of a
+    // sequence; the pages from the one holding the first chunk token on are always attended. nullptr: all pages.
+    const int *dynamic_sparse_page_idxes;
+    const int *dynamic_sparse_page_nums;   // b, selected pages of every row. nullptr: num_dynamic_sparse_pages.
+    int num_dynamic_sparse_pages;
+    int dynamic_sparse_page_heads;         // Rows per sequence: h, or h_kv for a group-shared selection.
+    int tokens_per_block;
+
+    mutable KVBlockArray<false> retrieval_kv_buffer;
+    mutable KVBlockArray<true> streaming_kv_buffer;
+};
+
+at::Tensor paged_context_attention(
+    at::Tensor q,                                        // total_q x num_heads x head_size
+    at::Tensor k,                                        // total_q x num_kv_heads x head_size, current chunk
+    at::Tensor v,                                        // total_q x num_kv_heads x head_size, current chunk
+    at::Tensor cu_seqlens_q,                             // b + 1
+    at::Tensor kv_lens,                                  // b, cached tokens including the current chunk
+    c10::optional<torch::Tensor> retrieval_kv_pointers,  // B x 2 x M or ragged
+    c10::optional<torch::Tensor> streaming_kv_pointers,  // B x 2 x M or ragged
+    at::Tensor retrieval_head_flags,                     // num_kv_heads
+    at::Tensor head_rank_table,                          // num_kv_heads
+    const int max_seqlen_q,
+    const int max_seqlen_k,
+    const int tokens_per_block,
+    const int size_per_retrieval_token,
+    const int size_per_streaming_token,
+    const int sink_token_num, const int local_token_num,   // layout of the streaming cache (decoding sink / local)
+    const int sink_block_num, const int local_block_num,
+    const int num_retrieval_kv_heads,
+    const int num_streaming_kv_heads,
+    const int ctx_sink_size, const int ctx_local_size,     // streaming-head mask of the context stage
+    const float softmax_scale,
+    const bool int4_kv_cache,                            // retrieval heads
+    const bool streaming_int4_kv_cache,                  // streaming heads, same zeros setting
+    const bool kv_cache_with_zeros,
+    const bool fp8_kv_cache,
+    c10::optional<torch::Tensor> spec_tree_mask,             // total_q int64, needs max_seqlen_q <= 64
+    c10::optional<torch::Tensor> spec_position_offsets,      // total_q int32
+    c10::optional<torch::Tensor> dynamic_sparse_page_idxes,  // b x (num_heads or num_kv_heads) x num_dynamic_sparse_pages int32
+    c10::optional<torch::Tensor> dynamic_sparse_page_nums    // b int32
+);
+
+// KV rollback after verification: moves the cached entries of the accepted draft tokens of every sequence
+// (chunk indices accepted_idxes[b, :num_accepted[b]], ascending) to the slots right behind its past_lens[b]
+// tokens, in both the retrieval and the streaming pages. Rejected slots are left to be overwritten.
+void accept_draft_tokens(
+    c10::optional<torch::Tensor> retrieval_kv_pointers,  // B x 2 x M or ragged
+    c10::optional<torch::Tensor> streaming_kv_pointers,  // B x 2 x M or ragged
+    at::Tensor past_lens,                                // b int32, cached tokens before the draft tokens
+    at::Tensor accepted_idxes,                           // b x max_accepted int32
+    at::Tensor num_accepted,                             // b int32
+    const int tokens_per_block,
+    const int head_size,
+    const int size_per_retrieval_token,
+    const int size_per_streaming_token,
+    const int sink_token_num, const int local_token_num,
+    const int sink_block_num, const int local_block_num,
+    const int num_retrieval_kv_heads,
+    const int num_streaming_kv_heads,
+    const bool int4_kv_cache,
+    const bool streaming_int4_kv_cache,
+    const bool kv_cache_with_zeros
+);
@@ -0,0 +1,11 @@
+#include <pybind11/pybind11.h>
+#include <torch/extension.h>
+#include "paged_context_attention.h"
+#include "../../nvtx_utils.h"
+
+
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+    m.def("paged_context_attention", omniserve::nvtx_wrap("paged_context_attention", &paged_context_attention), "Prefill attention over the paged quantized KV cache");
+    m.def("accept_draft_tokens", omniserve::nvtx_wrap("accept_draft_tokens", &accept_draft_tokens), "Compact the accepted draft tokens of speculative decoding in the KV cache");
+}
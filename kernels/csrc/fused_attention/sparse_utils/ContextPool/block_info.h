@@ -4,7 +4,8 @@
 struct BlockInfo {
     template<typename Params>
     __device__ BlockInfo(const Params &params, const int bidb)
-    : sum_s(params.cu_seqlens[bidb]), actual_seqlen(params.cu_seqlens[bidb + 1] - sum_s){}
+    : sum_s(params.cu_seqlens[bidb]), actual_seqlen(params.cu_seqlens[bidb + 1] - sum_s),
+      past_seqlen(params.past_kv_lens == nullptr ? 0 : params.past_kv_lens[bidb]){}
 
     template <typename index_t>
     __forceinline__ __device__ index_t input_offset(const index_t row_stride) const {
@@ -12,4 +13,6 @@ struct BlockInfo {
     }
     const int sum_s;
     const int actual_seqlen;
-};
\ No newline at end of file
+    // Tokens already in the KV cache before this chunk; the chunk occupies [past_seqlen, past_seqlen + actual_seqlen).
+    const int past_seqlen;
+};
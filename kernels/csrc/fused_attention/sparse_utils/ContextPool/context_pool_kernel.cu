@@ -6,6 +6,11 @@
 #include "block_info.h"
 #include "static_switch.h"
 
+// Tokens of a chunk are mapped to their position in the KV cache, starting from the sub-chunk boundary at or
+// before binfo.past_seqlen, so that every group of PoolBlock lanes covers exactly one sub-chunk. Lanes outside
+// the chunk read a clamped token of the same sub-chunk, which does not affect min max pooling. A sub-chunk
+// that already holds tokens of a previous chunk is merged into instead of overwritten.
+// PoolBlock > WarpSize: every lane pre-reduces PoolBlock / WarpSize tokens before the warp shuffle.
 template <
     typename T_cache,
     bool KV_WITH_ZEROS,
@@ -20,52 +25,80 @@ inline __device__ void context_min_max_pool_kernel(
     const int bidh, 
     const int m_block
 ){
+    constexpr int TokensPerLane = PoolBlock > WarpSize ? PoolBlock / WarpSize : 1;
+    constexpr int ShflWidth = PoolBlock > WarpSize ? WarpSize : PoolBlock;
     const BlockInfo binfo(params, bidb);
-    if (m_block * kBlockM >= binfo.actual_seqlen) return;
+    const int kv_begin = binfo.past_seqlen;
+    const int kv_end = kv_begin + binfo.actual_seqlen;
+    const int kv_base = kv_begin - kv_begin % PoolBlock + m_block * kBlockM;
+    if (kv_base >= kv_end) return;
     const int tid = threadIdx.x;
+    const int lane = tid % WarpSize;
     const int BlockSize = blockDim.x;
-    const int token_loop_max = kBlockM / BlockSize;     // How many tokens are processed in one thread
+    const int token_loop_max = kBlockM / (BlockSize * TokensPerLane);     // How many tokens are processed in one thread
     const int channel_loop_max = HeadDim / PackedNum;   // PackedNum = 8
     half min_buffer[PackedNum];
     half max_buffer[PackedNum];
+    half load_buffer[PackedNum];
     const int input_hid = params.pooling_heads_idx[bidh];       // Mapping to logic head idx
     # pragma unroll
     for (int token_loop = 0; token_loop < token_loop_max; token_loop++){
-        const int logic_token_idx_base = int(m_block * kBlockM + BlockSize * token_loop);
-        const int logic_token_idx = logic_token_idx_base + tid;
-        if (logic_token_idx_base >= binfo.actual_seqlen){
+        const int kv_idx_base = kv_base + BlockSize * TokensPerLane * token_loop;
+        if (kv_idx_base >= kv_end){
             break;
         }
-        const int token_idx = min(logic_token_idx, binfo.actual_seqlen - 1); // this will not affect min max pooling
-        const int page_idx = token_idx / params.page_size;
-        const int pool_idx = (token_idx % params.page_size) / params.pooling_size;
-        half *input_token_ptr = params.input_ptr + binfo.input_offset(params.input_row_stride) + token_idx * params.input_row_stride + input_hid * params.input_head_stride;
+        // First token of this lane; the others follow with a stride of WarpSize.
+        const int kv_idx = kv_idx_base + (tid / WarpSize) * WarpSize * TokensPerLane + lane;
+        const int kv_token_idx = min(max(kv_idx, kv_begin), kv_end - 1);
+        const int pool_idx = (kv_token_idx % params.page_size) / params.pooling_size;
         // add by JXGuo: note this is only right when tcache is int8_t, otherwise you cannot add a byte number
-        T_cache *k_cache_batch = reinterpret_cast<T_cache *>(params.kv_buffer.getKBlockPtr(bidb, token_idx));
-        half *k_cache_stats_max_ptr = reinterpret_cast<half *>(k_cache_batch + params.kv_buffer.mBytesPerSeq) + params.kv_buffer.mTokensPerBlock * params.pool_h * (KV_WITH_ZEROS? 2 : 1) + bidh * params.input_head_stride;
-        half *k_cache_stats_min_ptr = k_cache_stats_max_ptr + params.kv_buffer.SubChunkGroupSize * params.kv_buffer.mElesPerIndicator;
+        T_cache *k_cache_batch = reinterpret_cast<T_cache *>(params.kv_buffer.getKBlockPtr(bidb, kv_token_idx));
+        half *k_cache_stats_max_ptr = params.kv_buffer.getKStatsMaxPtr(k_cache_batch, params.pool_h) + bidh * params.input_head_stride;
+        half *k_cache_stats_min_ptr = params.kv_buffer.getKStatsMinPtr(k_cache_batch, params.pool_h) + bidh * params.input_head_stride;
+        const bool is_writer = lane % ShflWidth == 0 && kv_idx < kv_end;
+        const bool merge_with_cache = kv_idx < kv_begin;    // partial sub-chunk left by the previous chunk
 
         // const half *output_token_ptr = reinterpret_cast<half*>(params.o_ptrs[bidb * params.o_ptrs_batch_stride + page_idx]) + bidh * params.input_head_stride;
         #pragma unroll
         for (int channel_loop = 0; channel_loop < channel_loop_max; channel_loop++){
-            *reinterpret_cast<uint4 *>(min_buffer) = *(reinterpret_cast<uint4 *>(input_token_ptr) + channel_loop);// check here
-            // printf("min_buffer[0]: %f, logic_token_idx: %d, hidh: %d, input_hid: %d, bidb: %d\n", __half2float(min_buffer[0]), logic_token_idx, bidh, input_hid, bidb);
-            *reinterpret_cast<uint4 *>(max_buffer) = *reinterpret_cast<uint4 *>(min_buffer);
+            #pragma unroll
+            for (int lane_token = 0; lane_token < TokensPerLane; lane_token++){
+                const int token_idx = min(max(kv_idx + lane_token * int(WarpSize), kv_begin), kv_end - 1) - kv_begin;
+                half *input_token_ptr = params.input_ptr + binfo.input_offset(params.input_row_stride) + token_idx * params.input_row_stride + input_hid * params.input_head_stride;
+                *reinterpret_cast<uint4 *>(load_buffer) = *(reinterpret_cast<uint4 *>(input_token_ptr) + channel_loop);// check here
+                #pragma unroll
+                for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+                    max_buffer[pack_loop] = lane_token == 0 ? load_buffer[pack_loop] : __hmax(max_buffer[pack_loop], load_buffer[pack_loop]);
+                    min_buffer[pack_loop] = lane_token == 0 ? load_buffer[pack_loop] : __hmin(min_buffer[pack_loop], load_buffer[pack_loop]);
+                }
+            }
             #pragma unroll
             for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
                 #pragma unroll
-                for (int offset = PoolBlock/2; offset > 0; offset >>= 1){
+                for (int offset = ShflWidth/2; offset > 0; offset >>= 1){
                     max_buffer[pack_loop] = __hmax(max_buffer[pack_loop], __shfl_xor_sync(0xFFFFFFFF, max_buffer[pack_loop], offset));
                     min_buffer[pack_loop] = __hmin(min_buffer[pack_loop], __shfl_xor_sync(0xFFFFFFFF, min_buffer[pack_loop], offset));
                 }
             }
             // __syncthreads();
-            if (tid % PoolBlock == 0 && logic_token_idx < binfo.actual_seqlen){
+            if (is_writer){
                 const int pool_rank_offset = pool_idx * params.pool_h * params.input_head_stride;
-                *(reinterpret_cast<uint4 *>(k_cache_stats_max_ptr + pool_rank_offset) + channel_loop) = *reinterpret_cast<uint4 *>(max_buffer);
-                // printf("*(half*)((uint4*)(k_cache_stats_max_ptr + pool_rank_offset) + channel_loop): %f\n", __half2float(*(half*)((uint4*)(k_cache_stats_max_ptr + pool_rank_offset) + channel_loop)));
-
-                *(reinterpret_cast<uint4 *>(k_cache_stats_min_ptr + pool_rank_offset) + channel_loop) = *reinterpret_cast<uint4 *>(min_buffer);
+                uint4 *max_out = reinterpret_cast<uint4 *>(k_cache_stats_max_ptr + pool_rank_offset) + channel_loop;
+                uint4 *min_out = reinterpret_cast<uint4 *>(k_cache_stats_min_ptr + pool_rank_offset) + channel_loop;
+                if (merge_with_cache){
+                    *reinterpret_cast<uint4 *>(load_buffer) = *max_out;
+                    #pragma unroll
+                    for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+                        max_buffer[pack_loop] = __hmax(max_buffer[pack_loop], load_buffer[pack_loop]);
+                    }
+                    *reinterpret_cast<uint4 *>(load_buffer) = *min_out;
+                    #pragma unroll
+                    for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+                        min_buffer[pack_loop] = __hmin(min_buffer[pack_loop], load_buffer[pack_loop]);
+                    }
+                }
+                *max_out = *reinterpret_cast<uint4 *>(max_buffer);
+                *min_out = *reinterpret_cast<uint4 *>(min_buffer);
             }
         }
     }
@@ -88,12 +121,71 @@ template <typename T_cache, bool KV_WITH_ZEROS, size_t PoolBlock, size_t HeadDim
 void launch_context_paged_min_max_pool(const Context_pool_params &params, cudaStream_t stream){
     const int kBlockM = 1024;
     const int BLOCK_SIZE = 256;
-    const int num_m_block = (params.max_seqlen_rounded + kBlockM - 1) / kBlockM;
+    // A chunk that starts inside a sub-chunk spans one more sub-chunk.
+    const int max_pooled_len = params.max_seqlen_rounded + (params.past_kv_lens == nullptr ? 0 : params.pooling_size);
+    const int num_m_block = (max_pooled_len + kBlockM - 1) / kBlockM;
     dim3 grid(num_m_block, params.b, params.pool_h);
     dim3 block(BLOCK_SIZE);
-    context_min_max_pool_compute<T_cache, KV_WITH_ZEROS, kBlockM, PoolBlock, HeadDim, 32><<<grid, block>>>(params);
+    context_min_max_pool_compute<T_cache, KV_WITH_ZEROS, kBlockM, PoolBlock, HeadDim, 32><<<grid, block, 0, stream>>>(params);
+}
+
+// Second level of the hierarchical page selection: the min-max stats of every super-page (super_page_size
+// pages) are reduced from the sub-chunk stats written above and stored after the sub-chunk stats of its
+// first page. Only the super-pages touched by the chunk are recomputed. One thread per 8 channels.
+template <typename T_cache, bool KV_WITH_ZEROS, size_t HeadDim, size_t PackedNum>
+__global__ void context_super_page_min_max_pool_compute(Context_pool_params params){
+    const int bidb = blockIdx.y;
+    const int bidh = blockIdx.z;
+    const BlockInfo binfo(params, bidb);
+    const int tokens_per_super_page = params.super_page_size * params.page_size;
+    const int super_page_idx = binfo.past_seqlen / tokens_per_super_page + blockIdx.x;
+    const int kv_end = binfo.past_seqlen + binfo.actual_seqlen;
+    if (super_page_idx * tokens_per_super_page >= kv_end) return;
+    const int channel_idx = threadIdx.x * PackedNum;
+
+    half min_buffer[PackedNum];
+    half max_buffer[PackedNum];
+    half stats_buffer[PackedNum];
+    #pragma unroll
+    for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+        max_buffer[pack_loop] = __float2half(-65504.f);
+        min_buffer[pack_loop] = __float2half(65504.f);
+    }
+    const int n_pools = (kv_end + params.pooling_size - 1) / params.pooling_size;
+    const int pools_per_page = params.page_size / params.pooling_size;
+    const int pool_begin = super_page_idx * params.super_page_size * pools_per_page;
+    const int pool_end = min(pool_begin + params.super_page_size * pools_per_page, n_pools);
+    for (int pool = pool_begin; pool < pool_end; pool++){
+        T_cache *k_cache_batch = reinterpret_cast<T_cache *>(params.kv_buffer.getKBlockPtr(bidb, pool * params.pooling_size));
+        half *k_cache_stats_max_ptr = params.kv_buffer.getKStatsMaxPtr(k_cache_batch, params.pool_h) + bidh * params.input_head_stride;
+        half *k_cache_stats_min_ptr = params.kv_buffer.getKStatsMinPtr(k_cache_batch, params.pool_h) + bidh * params.input_head_stride;
+        const int pool_rank_offset = (pool % pools_per_page) * params.pool_h * params.input_head_stride + channel_idx;
+        *reinterpret_cast<uint4 *>(stats_buffer) = *reinterpret_cast<uint4 *>(k_cache_stats_max_ptr + pool_rank_offset);
+        #pragma unroll
+        for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+            max_buffer[pack_loop] = __hmax(max_buffer[pack_loop], stats_buffer[pack_loop]);
+        }
+        *reinterpret_cast<uint4 *>(stats_buffer) = *reinterpret_cast<uint4 *>(k_cache_stats_min_ptr + pool_rank_offset);
+        #pragma unroll
+        for (int pack_loop = 0; pack_loop < PackedNum; pack_loop++){
+            min_buffer[pack_loop] = __hmin(min_buffer[pack_loop], stats_buffer[pack_loop]);
+        }
+    }
+    T_cache *k_cache_first = reinterpret_cast<T_cache *>(params.kv_buffer.getKBlockPtr(bidb, super_page_idx * tokens_per_super_page));
+    half *super_stats_max_ptr = params.kv_buffer.getKSuperStatsMaxPtr(k_cache_first, params.pool_h) + bidh * params.input_head_stride + channel_idx;
+    *reinterpret_cast<uint4 *>(super_stats_max_ptr) = *reinterpret_cast<uint4 *>(max_buffer);
+    *reinterpret_cast<uint4 *>(super_stats_max_ptr + params.kv_buffer.mElesPerIndicator) = *reinterpret_cast<uint4 *>(min_buffer);
 }
 
+template <typename T_cache, bool KV_WITH_ZEROS, size_t HeadDim>
+void launch_context_super_page_min_max_pool(const Context_pool_params &params, cudaStream_t stream){
+    const int tokens_per_super_page = params.super_page_size * params.page_size;
+    const int num_super_pages = (params.max_seqlen_rounded + tokens_per_super_page - 1) / tokens_per_super_page
+        + (params.past_kv_lens == nullptr ? 0 : 1);
+    dim3 grid(num_super_pages, params.b, params.pool_h);
+    dim3 block(HeadDim / 8);
+    context_super_page_min_max_pool_compute<T_cache, KV_WITH_ZEROS, HeadDim, 8/*packed_load fp16*/><<<grid, block, 0, stream>>>(params);
+}
 
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.is_cuda(), #x " must be on CUDA")
@@ -116,6 +208,7 @@ void set_params(
     // const at::Tensor output_ptrs,
     void *cu_seqlens,
     void *pooling_heads_idx,
+    void *past_kv_lens,
     KVBlockArray<false> &kv_buffer
 ){
     // Reset the parameters
@@ -129,6 +222,7 @@ void set_params(
     // params.o_ptrs_batch_stride = output_ptrs.stride(-2);
     params.cu_seqlens = static_cast<int *>(cu_seqlens);
     params.pooling_heads_idx = static_cast<int *>(pooling_heads_idx);
+    params.past_kv_lens = static_cast<int *>(past_kv_lens);
 
     // Set the dimensions.
     params.b = batch_size;
@@ -151,7 +245,9 @@ void context_paged_min_max_pool(
     const int pooling_size,
     const int page_size,
     const int size_per_retrieval_token,   // default = hidden_size * sizeof(dtype)
-    const bool kv_cache_with_zeros
+    const bool kv_cache_with_zeros,
+    const int super_page_size,            // pages per super-page, 0 = no super-page stats
+    c10::optional<torch::Tensor> _past_kv_lens   // b, tokens cached before this chunk (chunked prefill)
 ){
     TORCH_CHECK(input.dtype() == torch::kFloat16, "context pooling only support fp16 for input");
     // TORCH_CHECK(output_ptrs.dtype() == torch::kInt64, "context pooling only support int32 for output_ptrs");
@@ -167,6 +263,16 @@ void context_paged_min_max_pool(
     // CHECK_CONTIGUOUS(output_ptrs);
     CHECK_CONTIGUOUS(cu_seqlens);
     CHECK_CONTIGUOUS(pooling_heads_idx);
+    TORCH_CHECK(pooling_size == 8 || pooling_size == 16 || pooling_size == 32 || pooling_size == 64,
+                "context pooling only support pooling_size 8, 16, 32 or 64, got ", pooling_size);
+    TORCH_CHECK(page_size % pooling_size == 0, "page_size must be divisible by pooling_size");
+    TORCH_CHECK(input.sizes()[2] == 128, "context pooling only support head_size 128");
+    if (_past_kv_lens.has_value()) {
+        TORCH_CHECK(_past_kv_lens->dtype() == torch::kInt32, "context pooling only support int32 for past_kv_lens");
+        CHECK_DEVICE(_past_kv_lens.value());
+        CHECK_CONTIGUOUS(_past_kv_lens.value());
+        TORCH_CHECK(_past_kv_lens->numel() == cu_seqlens.numel() - 1, "past_kv_lens must have batch_size elements");
+    }
     // printf("start");
     const int batch_size = cu_seqlens.numel() - 1;
     const int head_size = input.sizes()[2];
@@ -184,6 +290,7 @@ void context_paged_min_max_pool(
 
     KVBlockArray<false> retrieval_kv_buffer(batch_size, retrieval_max_blocks_per_seq, page_size, size_per_retrieval_token, 0, 0, 0, 0, pooling_size, num_pooling_heads * head_size);
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
 
 
     Context_pool_params params;
@@ -199,14 +306,19 @@ void context_paged_min_max_pool(
         // output_ptrs,
         cu_seqlens.data_ptr(),
         pooling_heads_idx.data_ptr(),
+        _past_kv_lens.has_value() ? _past_kv_lens->data_ptr() : nullptr,
         retrieval_kv_buffer
     );
+    params.super_page_size = super_page_size;
 
     auto stream = at::cuda::getCurrentCUDAStream();
     POOL_SWITCH(pooling_size, [&] {
         HEADDIM_SWITCH(head_size, [&] {
             KVZERO_SWITCH(kv_cache_with_zeros, [&] {
               launch_context_paged_min_max_pool<int8_t/*T_cache*/, EnableZero, PoolBlock, HeadDim>(params, stream);  
+              if (super_page_size > 0) {
+                launch_context_super_page_min_max_pool<int8_t/*T_cache*/, EnableZero, HeadDim>(params, stream);
+              }
             });
         });
     });
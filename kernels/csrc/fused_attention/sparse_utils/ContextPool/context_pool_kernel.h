@@ -11,12 +11,14 @@
 
 void context_paged_min_max_pool(
     at::Tensor input,              //total_seqlen x num_heads x head_size
-    c10::optional<torch::Tensor> _retrieval_kv_pointers, // B x 2 x M
+    c10::optional<torch::Tensor> _retrieval_kv_pointers, // B x 2 x M or ragged
     at::Tensor cu_seqlens,         // b + 1
     at::Tensor pooling_heads_idx,  // num_heads
     const int max_seqlen,
     const int pooling_size,
     const int page_size,
     const int size_per_retrieval_token,   // default = hidden_size * sizeof(dtype)
-    const bool kv_cache_with_zeros
+    const bool kv_cache_with_zeros,
+    const int super_page_size,            // pages per super-page, 0 = no super-page stats
+    c10::optional<torch::Tensor> _past_kv_lens   // b, tokens cached before this chunk (chunked prefill)
 );
\ No newline at end of file
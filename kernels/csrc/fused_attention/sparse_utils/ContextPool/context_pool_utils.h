@@ -7,6 +7,7 @@ struct Context_pool_params
     // int64_t * o_ptrs;
     int * cu_seqlens;
     int * pooling_heads_idx;
+    int * past_kv_lens;     // nullptr: every sequence is pooled from token 0
 
     index_t input_row_stride;
     index_t input_head_stride;
@@ -16,6 +17,8 @@ struct Context_pool_params
 
     int input_h, pool_h;
 
+    int super_page_size;
+
     mutable KVBlockArray<false> kv_buffer;
 };
 
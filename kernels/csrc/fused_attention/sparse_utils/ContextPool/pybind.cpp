@@ -1,6 +1,7 @@
 #include <pybind11/pybind11.h>
 #include <torch/extension.h>
 #include "context_pool_kernel.h"
+#include "../../../nvtx_utils.h"
 
 
 
@@ -9,5 +10,5 @@
 
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-    m.def("paged_min_max_pool", &context_paged_min_max_pool, "context_paged_min_max_pool");
+    m.def("paged_min_max_pool", omniserve::nvtx_wrap("paged_min_max_pool", &context_paged_min_max_pool), "context_paged_min_max_pool");
 }
\ No newline at end of file
@@ -1,11 +1,17 @@
 #define POOL_SWITCH(POOL_SIZE, ...)        \
   [&] {                                    \
-    if (POOL_SIZE == 16) {                 \
+    if (POOL_SIZE == 8) {                  \
+      constexpr static int PoolBlock = 8;  \
+      return __VA_ARGS__();                \
+    } else if (POOL_SIZE == 16) {          \
       constexpr static int PoolBlock = 16; \
       return __VA_ARGS__();                \
     } else if (POOL_SIZE == 32) {          \
       constexpr static int PoolBlock = 32; \
       return __VA_ARGS__();                \
+    } else if (POOL_SIZE == 64) {          \
+      constexpr static int PoolBlock = 64; \
+      return __VA_ARGS__();                \
     }                                      \
   }()
 
@@ -23,6 +29,9 @@
     if (KV_WITH_ZEROS) {                       \
       constexpr static bool EnableZero = true; \
       return __VA_ARGS__();                    \
+    } else {                                   \
+      constexpr static bool EnableZero = false;\
+      return __VA_ARGS__();                    \
     }                                          \
   }()
 
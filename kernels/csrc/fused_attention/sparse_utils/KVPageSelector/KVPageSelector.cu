@@ -3,40 +3,41 @@
 #include <assert.h>
 #include <cuda_runtime.h>
 #include <float.h>
+#include <algorithm>
 #include <type_traits>
 #include "KVPageSelectorTemplate.hpp"
+#include "../../../launch_plan_utils.h"
           
 namespace mmha
 {
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-// Forward declaration of the kernel launcher to avoid including decoderMaskedMultiheadAttentionLaunch.h
-template <typename T, int Dh>
+// The selector writes an independent stat per sub-chunk, so unlike the dense decoder the sequence split needs no
+// partial buffers: every tile owns a page-aligned range of sub-chunks and writes its stats directly.
+template <typename T, int Dh, typename RetrievalKVCacheBuffer>
 inline size_t multi_block_grid_setup(const Multihead_attention_page_selector_params<T>& params,
-    int threads_per_block, int tlength, bool do_multi_block)
+    const RetrievalKVCacheBuffer& retrieval_kv_buffer, int threads_per_block, int tlength, bool do_multi_block)
 {
     if (!do_multi_block)
     {
         return 1;
     }
 
-    auto constexpr threads_per_value = mmha::threads_per_value<T>(mmha::dh_max(Dh));
+    const int multi_processor_count = omniserve::cached_device_attribute(cudaDevAttrMultiProcessorCount);
 
-    // Make sure: seq_len_tile * threads_per_value <= threads_per_block (for multi_block_mode)
-    params.seq_len_tile = std::floor(threads_per_block / threads_per_value);
+    const int n_sub_chunks = mmha::divUp(tlength, retrieval_kv_buffer.tokensPerSubChunk);
+    const int n_pages = mmha::divUp(n_sub_chunks, retrieval_kv_buffer.SubChunkGroupSize);
+    const int kernel_total_blocks = params.batch_size * params.num_heads / params.gqa_group_size;
 
-    assert(params.seq_len_tile <= params.max_seq_len_tile);
+    // Aim for a few waves of CTAs over the whole device, with at least one page per tile.
+    int seq_len_tile = mmha::divUp(multi_processor_count * 4, kernel_total_blocks);
+    seq_len_tile = std::max(1, std::min({seq_len_tile, params.max_seq_len_tile, n_pages}));
 
-    int _tlength = tlength;
-    if (params.dynamic_sparse_page_idxes_ptr != nullptr){
-        _tlength = ((params.num_dynamic_sparse_pages - 1) * params.tokens_per_block + (tlength - 1) % params.tokens_per_block + 1);
-    }
-    params.timesteps_per_block = mmha::divUp(mmha::divUp(_tlength, params.seq_len_tile), params.tokens_per_block) * params.tokens_per_block ;     // This is the physical timesteps per block.
-
-    params.timesteps_per_block_logic = mmha::divUp(tlength, params.seq_len_tile); // This is the logical timesteps per block.
-
-    // printf("multi_block_grid_setup: tlength: %d, _tlength: %d, timesteps_per_block: %d\n", tlength, _tlength, params.timesteps_per_block); 
+    // This is the number of logical sub-chunks per tile (rounded up to whole pages).
+    params.timesteps_per_block_logic = mmha::divUp(n_pages, seq_len_tile) * retrieval_kv_buffer.SubChunkGroupSize;
+    params.seq_len_tile = mmha::divUp(n_sub_chunks, params.timesteps_per_block_logic);
+    params.timesteps_per_block = params.timesteps_per_block_logic * retrieval_kv_buffer.tokensPerSubChunk;
 
 #ifndef ENABLE_MULTI_BLOCK_OPTION
     do_multi_block = false;
@@ -53,11 +54,11 @@ inline size_t multi_block_grid_setup(const Multihead_attention_page_selector_par
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh,  \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, \
                                                    DYNAMIC_THDS_PER_BLOCK, DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,              \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
-    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&available_blocks,                                                   \
+    available_blocks = omniserve::cached_max_active_blocks_per_sm(                                                     \
         mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,      \
             DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                      \
         DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz);
@@ -69,14 +70,14 @@ inline size_t multi_block_grid_setup(const Multihead_attention_page_selector_par
     /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */              \
     if (dynamic_smem_sz >= 46 * 1024)                                                                                  \
     {                                                                                                                  \
-        cudaError_t res = cudaFuncSetAttribute(                                                                        \
+        cudaError_t res = omniserve::cached_set_max_dynamic_smem(                                                      \
             mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,  \
                  DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,                                                 \
-            cudaFuncAttributeMaxDynamicSharedMemorySize, dynamic_smem_sz);                                             \
+            dynamic_smem_sz);                                                                                          \
     }                                                                                                                  \
     mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, DYNAMIC_THDS_PER_BLOCK,          \
          DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>                                                          \
-        <<<grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
+        <<<grid, DYNAMIC_THDS_PER_BLOCK, dynamic_smem_sz, stream>>>(params, retrieval_kv_buffer, streaming_kv_buffer);
 
 
 // if resources are not enough to launch 512 threads per block, we will fallback to 256.
@@ -110,11 +111,12 @@ inline size_t multi_block_grid_setup(const Multihead_attention_page_selector_par
 template <typename T, typename T_cache, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
     bool DO_MULTI_BLOCK, bool INT4KV, bool KV_WITH_ZEROS, bool SMEM_PRELOAD>
 void mmha_launch_kernel_ex(
-    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, int tlength)
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream, int tlength)
 {
     std::size_t const seq_len_tile{mmha::multi_block_grid_setup<T, Dh>(
-        params, THDS_PER_BLOCK, tlength, DO_MULTI_BLOCK)};
-    dim3 grid{static_cast<unsigned>(params.num_heads), static_cast<unsigned>(params.batch_size),
+        params, retrieval_kv_buffer, THDS_PER_BLOCK, tlength, DO_MULTI_BLOCK)};
+    // One CTA per stats row: per query head, or per KV head with a group-shared selection.
+    dim3 grid{static_cast<unsigned>(params.num_heads / params.gqa_group_size), static_cast<unsigned>(params.batch_size),
         static_cast<unsigned>(seq_len_tile)};
     if (DO_MULTI_BLOCK)
     {
@@ -122,13 +124,11 @@ void mmha_launch_kernel_ex(
     }
     else
     {
-        const int kernel_total_blocks = params.batch_size * params.num_heads;
+        const int kernel_total_blocks = params.batch_size * params.num_heads / params.gqa_group_size;
         // Don't tune the block size if batchxhead is large enough.
         // The max number of warps we can launch per SM is 32 limited by registers.
         if (kernel_total_blocks >= params.multi_processor_count * 4)
         {
-            int max_shared_mem;
-            cudaDeviceGetAttribute(&max_shared_mem, cudaDevAttrMaxSharedMemoryPerBlockOptin, 0);
             MMHA_KERNEL(THDS_PER_BLOCK);
             return;
         }
@@ -136,7 +136,7 @@ void mmha_launch_kernel_ex(
         int num_blocks_per_sm = -1;
         // Set 0 dynamic shared memory size as we need the number of available blocks limited by registers.
         // Dynamic shared memory is fixed for different block size.
-        cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks_per_sm,
+        num_blocks_per_sm = omniserve::cached_max_active_blocks_per_sm(
             mmha::masked_multihead_attention_page_selector_compute<T, T_cache, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, Dh, THDS_PER_BLOCK,
                 DO_MULTI_BLOCK, INT4KV, KV_WITH_ZEROS, SMEM_PRELOAD>,
             THDS_PER_BLOCK, 0);
@@ -166,7 +166,7 @@ void mmha_launch_kernel_ex(
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
     bool DO_MULTI_BLOCK>
 void mmha_launch_kernel_dispatch_4bits_kv_cache(
-    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, int tlength)
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream, int tlength)
 {
     if (params.int4_kv_cache)
     {
@@ -183,7 +183,7 @@ void mmha_launch_kernel_dispatch_4bits_kv_cache(
                 // NOTE (Shang): No need to preload the smem for the page_selector.
                 // Note: the 4bit kv_cache is still packed in int8_t.
                 mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
-                    DO_MULTI_BLOCK, true, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                    DO_MULTI_BLOCK, true, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
         }
         else
@@ -199,7 +199,7 @@ void mmha_launch_kernel_dispatch_4bits_kv_cache(
                 // NOTE (Shang): No need to preload the smem for the page_selector.
                 // Note: the 4bit kv_cache is still packed in int8_t.
                 mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
-                    DO_MULTI_BLOCK, true, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                    DO_MULTI_BLOCK, true, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
 
         }
@@ -215,31 +215,31 @@ void mmha_launch_kernel_dispatch_4bits_kv_cache(
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh, int THDS_PER_BLOCK,
     bool DO_MULTI_BLOCK>
 void mmha_launch_kernel_dispatch_8bits_kv_cache(
-    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, int tlength)
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream, int tlength)
 {
     if (params.int8_kv_cache)       // True
     {
         if (params.kv_cache_with_zeros)
         {
             mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
-                DO_MULTI_BLOCK, false, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                DO_MULTI_BLOCK, false, true, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
         else
         {
             mmha_launch_kernel_ex<T, int8_t, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK,
-                DO_MULTI_BLOCK, false, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                DO_MULTI_BLOCK, false, false, false>(params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
     }
     else
     {
         mmha_launch_kernel_ex<T, T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, THDS_PER_BLOCK, DO_MULTI_BLOCK, false, false, false>(
-            params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+            params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
     }
 }
 
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh>
 void mmha_launch_kernel_dispatch(
-    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer)
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream)
 {
     int const tlength = params.timestep;
     bool int4_kv_cache = params.int4_kv_cache;
@@ -248,12 +248,12 @@ void mmha_launch_kernel_dispatch(
         if (!params.multi_block_mode)
         {
             mmha_launch_kernel_dispatch_4bits_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, 256, false>(
-                params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
         else
         {
             mmha_launch_kernel_dispatch_4bits_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, 256, true>(
-                params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
     }
     else    // int8_kv_cache
@@ -261,14 +261,14 @@ void mmha_launch_kernel_dispatch(
         if (!params.multi_block_mode)
         {
             mmha_launch_kernel_dispatch_8bits_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, 256, false>(
-                params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
         }
         else
         {
             // if (params.multi_block_mode)
             {
                 mmha_launch_kernel_dispatch_8bits_kv_cache<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh, 256, true>(
-                    params, retrieval_kv_buffer, streaming_kv_buffer, tlength);
+                    params, retrieval_kv_buffer, streaming_kv_buffer, stream, tlength);
             }
         }
     }
@@ -276,7 +276,7 @@ void mmha_launch_kernel_dispatch(
 
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KernelParamsType, int Dh>
 void mmha_launch_kernel(
-    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer)
+    const KernelParamsType& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream)
 {
     // assert((params.rotary_embedding_dim != 0)
     //     == (params.position_embedding_type == PositionEmbeddingType::kROPE_GPT_NEOX
@@ -289,7 +289,7 @@ void mmha_launch_kernel(
     // {
     //     mmha_launch_kernel_dispatch<T, KVCacheBuffer, KernelParamsType, Dh, true>(params, kv_cache_buffer, stream);
     // }
-    mmha_launch_kernel_dispatch<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh>(params, retrieval_kv_buffer, streaming_kv_buffer);
+    mmha_launch_kernel_dispatch<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KernelParamsType, Dh>(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
 }
 
 } // namespace mmha
@@ -298,12 +298,12 @@ namespace
 {
 
 #define MMHA_LAUNCH_KERNEL(Dh)                                                                                         \
-    mmha::mmha_launch_kernel<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KERNEL_PARAMS_TYPE, Dh>(params, retrieval_kv_buffer, streaming_kv_buffer);               \
+    mmha::mmha_launch_kernel<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KERNEL_PARAMS_TYPE, Dh>(params, retrieval_kv_buffer, streaming_kv_buffer, stream);               \
     break;
 
 template <typename T, typename RetrievalKVCacheBuffer, typename StreamingKVCacheBuffer, typename KERNEL_PARAMS_TYPE>
 void multihead_attention_page_selector_(
-    const KERNEL_PARAMS_TYPE& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer)
+    const KERNEL_PARAMS_TYPE& params, const RetrievalKVCacheBuffer& retrieval_kv_buffer, const StreamingKVCacheBuffer& streaming_kv_buffer, const cudaStream_t& stream)
 {
     switch (params.hidden_size_per_head)
     {
@@ -316,7 +316,7 @@ void multihead_attention_page_selector_(
     //     mmha::mmha_launch_kernel<T, KVCacheBuffer, KERNEL_PARAMS_TYPE, 112>(params, kv_cache_buffer, stream);
     //     break;
     case 128:
-        mmha::mmha_launch_kernel<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KERNEL_PARAMS_TYPE, 128>(params, retrieval_kv_buffer, streaming_kv_buffer);
+        mmha::mmha_launch_kernel<T, RetrievalKVCacheBuffer, StreamingKVCacheBuffer, KERNEL_PARAMS_TYPE, 128>(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
         break;
     // case 144:
     //     mmha::mmha_launch_kernel<T, KVCacheBuffer, KERNEL_PARAMS_TYPE, 144>(params, kv_cache_buffer, stream);
@@ -345,11 +345,11 @@ void multihead_attention_page_selector_(
 
 #define INSTANTIATE_MMHA_NORMAL_AND_PAGED(T)                                                           \
     void masked_multihead_attention_page_selector(const Multihead_attention_page_selector_params<T>& params,                       \
-        const KVBlockArray<false> &retrieval_kv_buffer, const KVBlockArray<true> &streaming_kv_buffer \
-        )                                                                    \
+        const KVBlockArray<false> &retrieval_kv_buffer, const KVBlockArray<true> &streaming_kv_buffer, \
+        const cudaStream_t &stream)                                                                      \
     {                                                                                                                  \
         multihead_attention_page_selector_<T, KVBlockArray<false>, KVBlockArray<true>, Multihead_attention_page_selector_params<T>>(         \
-            params, retrieval_kv_buffer, streaming_kv_buffer);                                                 \
+            params, retrieval_kv_buffer, streaming_kv_buffer, stream);                                         \
     }                                                                                                                  \
 
 INSTANTIATE_MMHA_NORMAL_AND_PAGED(uint16_t)
@@ -357,3 +357,328 @@ INSTANTIATE_MMHA_NORMAL_AND_PAGED(uint16_t)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+namespace mmha
+{
+
+// Argmax over (score, page_idx) pairs. Ties are broken towards the smaller page index so that the
+// selection is deterministic (and matches torch.topk on distinct scores).
+inline __device__ void page_argmax_update(float &best_score, int &best_idx, const float score, const int idx)
+{
+    if (score > best_score || (score == best_score && idx < best_idx))
+    {
+        best_score = score;
+        best_idx = idx;
+    }
+}
+
+// Block-wide argmax over scores_smem[0, n). The result is only valid in thread 0.
+template <int THREADS_PER_BLOCK>
+inline __device__ void page_block_argmax(const float *scores_smem, const int n, float *red_scores_smem,
+    int *red_idxes_smem, float &best_score, int &best_idx)
+{
+    constexpr int WARP_SIZE = 32;
+    constexpr int WARPS_PER_BLOCK = THREADS_PER_BLOCK / WARP_SIZE;
+    const int warp = threadIdx.x / WARP_SIZE;
+    const int lane = threadIdx.x % WARP_SIZE;
+
+    best_score = -INFINITY;
+    best_idx = n;
+    for (int pi = threadIdx.x; pi < n; pi += THREADS_PER_BLOCK)
+    {
+        page_argmax_update(best_score, best_idx, scores_smem[pi], pi);
+    }
+#pragma unroll
+    for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2)
+    {
+        const float other_score = __shfl_xor_sync(uint32_t(-1), best_score, mask);
+        const int other_idx = __shfl_xor_sync(uint32_t(-1), best_idx, mask);
+        page_argmax_update(best_score, best_idx, other_score, other_idx);
+    }
+    if (lane == 0)
+    {
+        red_scores_smem[warp] = best_score;
+        red_idxes_smem[warp] = best_idx;
+    }
+    __syncthreads();
+    if (warp == 0)
+    {
+        best_score = lane < WARPS_PER_BLOCK ? red_scores_smem[lane] : -INFINITY;
+        best_idx = lane < WARPS_PER_BLOCK ? red_idxes_smem[lane] : n;
+#pragma unroll
+        for (int mask = WARP_SIZE / 2; mask >= 1; mask /= 2)
+        {
+            const float other_score = __shfl_xor_sync(uint32_t(-1), best_score, mask);
+            const int other_idx = __shfl_xor_sync(uint32_t(-1), best_idx, mask);
+            page_argmax_update(best_score, best_idx, other_score, other_idx);
+        }
+    }
+}
+
+// One CTA per (head, batch). Pages are scored by the max over their sub-chunk stats, then the top-k
+// is extracted with k rounds of block-wide argmax. k is small (token_budget / tokens_per_block), so
+// this is cheaper than sorting all the pages of a 128K+ context.
+// With candidate_pages, entry pi of the stats belongs to page candidate_pages[pi] instead of page pi.
+// With page_scores, every selected history page adds 1 to its entry, and the pages with a negative entry (evicted)
+// are never selected.
+template <int THREADS_PER_BLOCK>
+__global__ void page_selector_topk_kernel(const half *__restrict__ stats, int *__restrict__ page_idxes,
+    const int *__restrict__ length_per_sample, const int *__restrict__ page_nums,
+    const int *__restrict__ candidate_pages, float *__restrict__ page_scores, const int page_scores_stride,
+    const int num_heads, const int stats_stride,
+    const int sub_chunk_group_size, const int tokens_per_block, const int timestep, const int num_selected_pages)
+{
+    constexpr int WARP_SIZE = 32;
+    constexpr int WARPS_PER_BLOCK = THREADS_PER_BLOCK / WARP_SIZE;
+
+    extern __shared__ float page_scores_smem[];
+    __shared__ float red_scores_smem[WARPS_PER_BLOCK];
+    __shared__ int red_idxes_smem[WARPS_PER_BLOCK];
+
+    const int hi = blockIdx.x;
+    const int bi = blockIdx.y;
+    const int tidx = threadIdx.x;
+
+    // Same convention as the selector kernel: tlength is the kv cache length (excluding the current token).
+    const int tlength = length_per_sample ? (length_per_sample[bi] - 1) : timestep;
+    const int n_pages = stats_stride / sub_chunk_group_size;
+    const int last_page = max(divUp(tlength, tokens_per_block) - 1, 0);
+    // Pages of this row (per-sequence token budget); num_selected_pages is the row stride.
+    const int row_selected_pages = page_nums ? max(min(page_nums[bi], num_selected_pages), 1) : num_selected_pages;
+
+    const half *stats_ptr = stats + static_cast<size_t>(bi * num_heads + hi) * stats_stride;
+    int *out_ptr = page_idxes + static_cast<size_t>(bi * num_heads + hi) * num_selected_pages;
+    const int *candidates_ptr = candidate_pages ? candidate_pages + static_cast<size_t>(bi * num_heads + hi) * n_pages : nullptr;
+    float *scores_ptr = page_scores ? page_scores + static_cast<size_t>(bi) * page_scores_stride : nullptr;
+
+    // Only the sub-chunks of full history pages are read, so the stats buffer does not need to be zero-initialized.
+    // The most recent page is marked as taken since it is always appended at the end.
+    for (int pi = tidx; pi < n_pages; pi += THREADS_PER_BLOCK)
+    {
+        const int page = candidates_ptr ? candidates_ptr[pi] : pi;
+        float score = page == last_page ? -INFINITY : -FLT_MAX;
+        if (scores_ptr && page >= 0 && page < last_page && scores_ptr[page] < 0.f)
+        {
+            // Evicted: its table entry points at a freed page.
+            score = -INFINITY;
+        }
+        else if (page >= 0 && page < last_page)
+        {
+            for (int si = 0; si < sub_chunk_group_size; ++si)
+            {
+                score = fmaxf(score, __half2float(stats_ptr[pi * sub_chunk_group_size + si]));
+            }
+        }
+        page_scores_smem[pi] = score;
+    }
+    __syncthreads();
+
+    // Short sequences of the candidate path pad with the pages after the last one, in order, which is what the
+    // flat path selects for them (-FLT_MAX ties go to the smaller page index).
+    const int n_padding_pages_max = max(divUp(timestep, tokens_per_block) - 1, last_page);
+    int n_padding_pages = 0;
+    for (int ki = 0; ki < row_selected_pages - 1; ++ki)
+    {
+        float best_score;
+        int best_idx;
+        page_block_argmax<THREADS_PER_BLOCK>(page_scores_smem, n_pages, red_scores_smem, red_idxes_smem,
+            best_score, best_idx);
+        if (tidx == 0)
+        {
+            best_idx = min(best_idx, n_pages - 1);
+            int page = best_idx;
+            if (candidates_ptr)
+            {
+                page = candidates_ptr[best_idx];
+                if (page < 0 || page >= last_page)
+                {
+                    page = min(last_page + 1 + n_padding_pages++, n_padding_pages_max);
+                }
+            }
+            out_ptr[ki] = page;
+            if (scores_ptr && page < last_page)
+            {
+                // Shared by the heads (and layers) of the sequence.
+                atomicAdd(scores_ptr + page, 1.f);
+            }
+            page_scores_smem[best_idx] = -INFINITY;
+        }
+        __syncthreads();
+    }
+
+    if (tidx == 0)
+    {
+        out_ptr[row_selected_pages - 1] = last_page;
+    }
+}
+
+// One CTA per (head, batch): the top super-pages from their stats, expanded to their full history pages.
+template <int THREADS_PER_BLOCK>
+__global__ void super_page_selector_topk_kernel(const half *__restrict__ stats, int *__restrict__ candidate_pages,
+    const int *__restrict__ length_per_sample, const int num_heads, const int stats_stride, const int super_page_size,
+    const int tokens_per_block, const int timestep, const int num_selected_super_pages)
+{
+    constexpr int WARP_SIZE = 32;
+    constexpr int WARPS_PER_BLOCK = THREADS_PER_BLOCK / WARP_SIZE;
+
+    extern __shared__ float super_page_scores_smem[];
+    __shared__ float red_scores_smem[WARPS_PER_BLOCK];
+    __shared__ int red_idxes_smem[WARPS_PER_BLOCK];
+
+    const int hi = blockIdx.x;
+    const int bi = blockIdx.y;
+    const int tidx = threadIdx.x;
+
+    const int tlength = length_per_sample ? (length_per_sample[bi] - 1) : timestep;
+    const int last_page = max(divUp(tlength, tokens_per_block) - 1, 0);
+    const int n_super_pages = divUp(last_page, super_page_size);
+
+    const half *stats_ptr = stats + static_cast<size_t>(bi * num_heads + hi) * stats_stride;
+    int *out_ptr = candidate_pages + static_cast<size_t>(bi * num_heads + hi) * num_selected_super_pages * super_page_size;
+
+    for (int si = tidx; si < stats_stride; si += THREADS_PER_BLOCK)
+    {
+        super_page_scores_smem[si] = si < n_super_pages ? __half2float(stats_ptr[si]) : -INFINITY;
+    }
+    __syncthreads();
+
+    for (int ki = 0; ki < num_selected_super_pages; ++ki)
+    {
+        float best_score;
+        int best_idx;
+        page_block_argmax<THREADS_PER_BLOCK>(super_page_scores_smem, stats_stride, red_scores_smem, red_idxes_smem,
+            best_score, best_idx);
+        // Thread 0 broadcasts the winner through red_idxes_smem, which is only rewritten after the next barrier.
+        if (tidx == 0)
+        {
+            red_idxes_smem[0] = best_score == -INFINITY ? -1 : best_idx;
+            if (best_score != -INFINITY)
+            {
+                super_page_scores_smem[best_idx] = -INFINITY;
+            }
+        }
+        __syncthreads();
+        const int super_page = red_idxes_smem[0];
+        for (int pi = tidx; pi < super_page_size; pi += THREADS_PER_BLOCK)
+        {
+            const int page = super_page * super_page_size + pi;
+            out_ptr[ki * super_page_size + pi] = super_page >= 0 && page < last_page ? page : -1;
+        }
+        __syncthreads();
+    }
+}
+
+// One CTA per (retrieval kv head, batch), one thread per 8 channels. Only the last two super-pages of each
+// sequence can have changed since the previous selection, so this is O(super_page_size) per sequence.
+template <typename T_cache, bool KV_WITH_ZEROS, int HEAD_DIM>
+__global__ void super_page_stats_refresh_kernel(KVBlockArray<false> kv_buffer, const int *__restrict__ length_per_sample,
+    const int num_retrieval_kv_heads, const int timestep, const int super_page_size)
+{
+    constexpr int PACKED_NUM = 8;
+    const int hr = blockIdx.x;
+    const int bi = blockIdx.y;
+    const int channel_idx = threadIdx.x * PACKED_NUM;
+
+    const int tlength = length_per_sample ? (length_per_sample[bi] - 1) : timestep;
+    const int n_sub_chunks = divUp(tlength, kv_buffer.tokensPerSubChunk);
+    const int tokens_per_super_page = super_page_size * kv_buffer.mTokensPerBlock;
+    const int n_super_pages = divUp(tlength, tokens_per_super_page);
+
+    for (int sp = max(n_super_pages - 2, 0); sp < n_super_pages; ++sp)
+    {
+        half max_buffer[PACKED_NUM], min_buffer[PACKED_NUM], stats_buffer[PACKED_NUM];
+#pragma unroll
+        for (int i = 0; i < PACKED_NUM; ++i)
+        {
+            max_buffer[i] = __float2half(-65504.f);
+            min_buffer[i] = __float2half(65504.f);
+        }
+        const int sub_chunk_begin = sp * super_page_size * kv_buffer.SubChunkGroupSize;
+        const int sub_chunk_end = min(sub_chunk_begin + super_page_size * kv_buffer.SubChunkGroupSize, n_sub_chunks);
+        for (int sc = sub_chunk_begin; sc < sub_chunk_end; ++sc)
+        {
+            T_cache *k_cache_batch = reinterpret_cast<T_cache *>(kv_buffer.getKBlockPtr(bi, sc * kv_buffer.tokensPerSubChunk));
+            half *k_cache_stats_max_ptr = kv_buffer.getKStatsMaxPtr(k_cache_batch, num_retrieval_kv_heads);
+            half *k_cache_stats_min_ptr = kv_buffer.getKStatsMinPtr(k_cache_batch, num_retrieval_kv_heads);
+            const int stats_offset = (sc % kv_buffer.SubChunkGroupSize) * kv_buffer.mElesPerIndicator + hr * HEAD_DIM + channel_idx;
+            *reinterpret_cast<uint4 *>(stats_buffer) = *reinterpret_cast<const uint4 *>(k_cache_stats_max_ptr + stats_offset);
+#pragma unroll
+            for (int i = 0; i < PACKED_NUM; ++i)
+            {
+                max_buffer[i] = __hmax(max_buffer[i], stats_buffer[i]);
+            }
+            *reinterpret_cast<uint4 *>(stats_buffer) = *reinterpret_cast<const uint4 *>(k_cache_stats_min_ptr + stats_offset);
+#pragma unroll
+            for (int i = 0; i < PACKED_NUM; ++i)
+            {
+                min_buffer[i] = __hmin(min_buffer[i], stats_buffer[i]);
+            }
+        }
+        T_cache *k_cache_first = reinterpret_cast<T_cache *>(kv_buffer.getKBlockPtr(bi, sp * tokens_per_super_page));
+        half *super_stats_max_ptr = kv_buffer.getKSuperStatsMaxPtr(k_cache_first, num_retrieval_kv_heads) + hr * HEAD_DIM + channel_idx;
+        *reinterpret_cast<uint4 *>(super_stats_max_ptr) = *reinterpret_cast<uint4 *>(max_buffer);
+        *reinterpret_cast<uint4 *>(super_stats_max_ptr + kv_buffer.mElesPerIndicator) = *reinterpret_cast<uint4 *>(min_buffer);
+    }
+}
+
+} // namespace mmha
+
+void page_selector_topk(const half *stats, int *page_idxes, const int *length_per_sample,
+                        const int batch_size, const int num_heads, const int stats_stride,
+                        const int sub_chunk_group_size, const int tokens_per_block,
+                        const int timestep, const int num_selected_pages, const int *page_nums,
+                        const int *candidate_pages, float *page_scores, const int page_scores_stride,
+                        const cudaStream_t &stream)
+{
+    constexpr int THDS_PER_BLOCK = 256;
+    const int n_pages = stats_stride / sub_chunk_group_size;
+    const std::size_t smem_sz = n_pages * sizeof(float);
+    /* Set 46KB threshold here because we have to take static/driver shared memory into consideration. */
+    if (smem_sz >= 46 * 1024)
+    {
+        omniserve::cached_set_max_dynamic_smem(mmha::page_selector_topk_kernel<THDS_PER_BLOCK>, smem_sz);
+    }
+    dim3 grid{static_cast<unsigned>(num_heads), static_cast<unsigned>(batch_size)};
+    mmha::page_selector_topk_kernel<THDS_PER_BLOCK><<<grid, THDS_PER_BLOCK, smem_sz, stream>>>(stats, page_idxes,
+        length_per_sample, page_nums, candidate_pages, page_scores, page_scores_stride, num_heads, stats_stride,
+        sub_chunk_group_size, tokens_per_block, timestep, num_selected_pages);
+}
+
+void super_page_selector_topk(const half *stats, int *candidate_pages, const int *length_per_sample,
+                              const int batch_size, const int num_heads, const int stats_stride,
+                              const int super_page_size, const int tokens_per_block, const int timestep,
+                              const int num_selected_super_pages, const cudaStream_t &stream)
+{
+    constexpr int THDS_PER_BLOCK = 256;
+    const std::size_t smem_sz = stats_stride * sizeof(float);
+    if (smem_sz >= 46 * 1024)
+    {
+        omniserve::cached_set_max_dynamic_smem(mmha::super_page_selector_topk_kernel<THDS_PER_BLOCK>, smem_sz);
+    }
+    dim3 grid{static_cast<unsigned>(num_heads), static_cast<unsigned>(batch_size)};
+    mmha::super_page_selector_topk_kernel<THDS_PER_BLOCK><<<grid, THDS_PER_BLOCK, smem_sz, stream>>>(stats,
+        candidate_pages, length_per_sample, num_heads, stats_stride, super_page_size, tokens_per_block, timestep,
+        num_selected_super_pages);
+}
+
+void super_page_stats_refresh(const KVBlockArray<false> &retrieval_kv_buffer, const int *length_per_sample,
+                              const int batch_size, const int num_retrieval_kv_heads, const int head_dim,
+                              const int timestep, const int super_page_size, const bool kv_cache_with_zeros,
+                              const cudaStream_t &stream)
+{
+    assert(head_dim == 128);
+    dim3 grid{static_cast<unsigned>(num_retrieval_kv_heads), static_cast<unsigned>(batch_size)};
+    dim3 block{128 / 8};
+    if (kv_cache_with_zeros)
+    {
+        mmha::super_page_stats_refresh_kernel<int8_t, true, 128><<<grid, block, 0, stream>>>(retrieval_kv_buffer,
+            length_per_sample, num_retrieval_kv_heads, timestep, super_page_size);
+    }
+    else
+    {
+        mmha::super_page_stats_refresh_kernel<int8_t, false, 128><<<grid, block, 0, stream>>>(retrieval_kv_buffer,
+            length_per_sample, num_retrieval_kv_heads, timestep, super_page_size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
@@ -45,6 +45,11 @@ inline int pow2roundup(int x)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Largest number of query heads per KV head scored by one CTA in the group-shared (GQA) selection.
+#define MAX_GQA_GROUP_SIZE 8
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 // The structure of parameters for the masked multihead attention kernel.
 //
 // We use the following terminology to describe the different dimensions.
@@ -61,6 +66,9 @@ struct Multihead_attention_page_selector_params_base
 
     // The output buffer. Dimensions B x D.
     T *out = nullptr;
+    // Row stride (in sub-chunks) of the output stats buffer B x H x padded_num_sub_chunks.
+    // Sized by the host with the max timestep so that rows stay aligned under ragged lengths.
+    int stats_stride = 0;
 
     // The input Qs and the associated bias. Dimensions B x D and D, resp.
     const T *q = nullptr, *q_bias = nullptr;
@@ -101,6 +109,8 @@ struct Multihead_attention_page_selector_params_base
     RotaryScalingType rotary_embedding_scale_type = RotaryScalingType::kNONE;
     float rotary_embedding_scale = 1.0f;
     int rotary_embedding_max_positions = 0;
+    // Optional [max_positions, rotary_embedding_dim / 2] (cos, sin) table; replaces base / scale when set.
+    const float2 *rotary_cos_sin = nullptr;
     // The current timestep. TODO Check that do we only this param in cross attention?
     int timestep = 0;
     // The current timestep of each sentences (support different timestep for different sentences)
@@ -202,6 +212,27 @@ struct Multihead_attention_page_selector_params : public Multihead_attention_pag
 
     bool do_dynamic_sparse = false;
 
+    // Hierarchical selection (retrieval heads only). Pages per super-page; the super-page min-max stats
+    // are stored in the first page of each super-page, right after its sub-chunk stats.
+    int super_page_size = 0;
+
+    // Score the super-pages (one entry per super-page) instead of the sub-chunks.
+    bool score_super_pages = false;
+
+    // Score only the sub-chunks of these pages (B x H x num_candidate_pages, -1 for padding).
+    // Entry e of the output stats is sub-chunk e % SubChunkGroupSize of candidate page e / SubChunkGroupSize.
+    const int *candidate_pages_ptr = nullptr;
+
+    int num_candidate_pages = 0;
+
+    // Query heads scored by one CTA. 1: one CTA and one stats row per query head. num_heads / num_kv_heads
+    // (group-shared selection): one CTA per KV head loads the stats once for the whole group and writes one
+    // stats row per KV head, so the out / candidate_pages rows are B x num_kv_heads.
+    int gqa_group_size = 1;
+
+    // Aggregate the scores of the group by their sum instead of their max.
+    bool gqa_sum_scores = false;
+
 };
 template <class T>
 using Masked_multihead_attention_page_selector_params = Multihead_attention_page_selector_params<T>;
@@ -210,11 +241,44 @@ using Masked_multihead_attention_page_selector_params = Multihead_attention_page
 #define DECLARE_MMHA_NORMAL_AND_PAGED(T)                                                                \
     void masked_multihead_attention_page_selector(const Masked_multihead_attention_page_selector_params<T> &params,                 \
                                     const KVBlockArray<false> &retrieval_kv_buffer,                  \
-                                    const KVBlockArray<true> &streaming_kv_buffer); \
+                                    const KVBlockArray<true> &streaming_kv_buffer, const cudaStream_t &stream); \
     // void masked_multihead_attention_page_selector(const Masked_multihead_attention_page_selector_params<T> &params,                 \
     //                                 const KVLinearBuffer &kv_cache_buffer, const cudaStream_t &stream); 
 DECLARE_MMHA_NORMAL_AND_PAGED(float);
 DECLARE_MMHA_NORMAL_AND_PAGED(uint16_t);
 #undef DECLARE_MMHA_NORMAL_AND_PAGED
 
+// Reduce the sub-chunk stats (B x H x stats_stride, H: stats rows per sequence, the KV heads with a group-shared
+// selection) to per-page scores and select the top
+// (num_selected_pages - 1) history pages per head. The most recent page is always appended last.
+// Writes B x H x num_selected_pages int32 page indices.
+// With candidate_pages (B x H x stats_stride / sub_chunk_group_size), the stats are those of the candidate
+// pages only (see Multihead_attention_page_selector_params::candidate_pages_ptr).
+// With page_nums (B), row b only fills its first min(page_nums[b], num_selected_pages) entries, the most recent
+// page last; num_selected_pages stays the row stride.
+// With page_scores (B x page_scores_stride fp32, page eviction), the selected history pages of row b add 1 to their
+// entries of row b for every head, and the pages whose entry is negative are never selected.
+void page_selector_topk(const half *stats, int *page_idxes, const int *length_per_sample,
+                        const int batch_size, const int num_heads, const int stats_stride,
+                        const int sub_chunk_group_size, const int tokens_per_block,
+                        const int timestep, const int num_selected_pages, const int *page_nums,
+                        const int *candidate_pages, float *page_scores, const int page_scores_stride,
+                        const cudaStream_t &stream);
+
+// First level of the hierarchical selection: select the top num_selected_super_pages super-pages per head
+// from their stats (B x H x stats_stride) and expand them to B x H x (num_selected_super_pages * super_page_size)
+// candidate history pages, -1 for the pages that do not exist or are not full yet.
+void super_page_selector_topk(const half *stats, int *candidate_pages, const int *length_per_sample,
+                              const int batch_size, const int num_heads, const int stats_stride,
+                              const int super_page_size, const int tokens_per_block, const int timestep,
+                              const int num_selected_super_pages, const cudaStream_t &stream);
+
+// Rebuild the super-page min-max stats of the last two super-pages of every sequence from their page stats.
+// The decoder only updates the sub-chunk stats, so this runs before each selection; the super-pages before
+// them were complete at the previous selection (requires selector_update_interval <= super-page tokens).
+void super_page_stats_refresh(const KVBlockArray<false> &retrieval_kv_buffer, const int *length_per_sample,
+                              const int batch_size, const int num_retrieval_kv_heads, const int head_dim,
+                              const int timestep, const int super_page_size, const bool kv_cache_with_zeros,
+                              const cudaStream_t &stream);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -785,9 +785,8 @@ namespace mmha
     inline __device__ void masked_multihead_attention_page_selector_kernel(
         Multihead_attention_page_selector_params<T> params, KVCacheBuffer kvCacheBuffer, const int head_rank){
 
-        assert(DO_MULTI_BLOCK == false);    // NOTE (Shang): We do not use multi-block mode for page selection now.
-
-        // Question: Do we need MULTI_BLOCK for the selector? -- Maybe. Better parallelism.
+        // NOTE: In multi-block mode, blockIdx.z splits the sub-chunks of a sequence into page-aligned tiles of
+        // params.timesteps_per_block_logic sub-chunks. Stats are independent per sub-chunk, so no cross-CTA reduction is needed.
         // NOTE (Shang): If streaming head. We can either directly return or fill the idxes with -1.
         if constexpr (!IS_RETRIEVAL_HEAD)
         {
@@ -866,7 +865,8 @@ namespace mmha
 
         // Use alignment for safely casting the shared buffers as Qk_vec_k and K_vec_k.
         // Shared memory to store Q inputs.
-        __shared__ __align__(const_max(sizeof(Qk_vec_k), sizeof(K_vec_k))) Tk q_smem[Dh_MAX];
+        // With a group-shared selection it holds the (rotated) queries of the whole group, Dh_MAX apart.
+        __shared__ __align__(const_max(sizeof(Qk_vec_k), sizeof(K_vec_k))) Tk q_smem[MAX_GQA_GROUP_SIZE * Dh_MAX];
 
         // Make sure the hidden dimension per head is a multiple of the number of threads per value.
         static_assert(Dh_MAX % THREADS_PER_VALUE == 0); // trivially satisfied since THREADS_PER_VALUE == Dh_MAX / p
@@ -889,11 +889,16 @@ namespace mmha
         {
             return;
         }
-        // The head.
-        const unsigned hi{blockIdx.x};
+        // The query heads scored by this CTA (one CTA per KV head with a group-shared selection), and the row
+        // of the output stats, which has num_heads / gqa_group_size rows per sequence.
+        const int gqa_group_size = params.gqa_group_size;
+        const unsigned stats_hi{blockIdx.x};
+        const auto num_stats_heads = static_cast<unsigned>(params.num_heads / gqa_group_size);
+        // The (first) head.
+        const unsigned hi_begin{blockIdx.x * gqa_group_size};
         // The head index of keys and values adjusted for MQA/GQA.
         const int qhead_per_kv{params.num_heads / params.num_kv_heads};
-        const unsigned hi_kv{hi / qhead_per_kv};
+        const unsigned hi_kv{hi_begin / qhead_per_kv};
         // The number of heads.
         const auto num_heads = static_cast<unsigned>(params.num_heads);
         // The number of heads for keys and values adjusted for MQA/GQA.
@@ -962,117 +967,123 @@ namespace mmha
         
         // Up to QK_VECS_PER_Dh_MAX threads load Q and K + the bias values for the current timestep.
         // Trigger the loads from the Q and K buffers.
-        Qk_vec_k q; //, k; //, q_bias, k_bias;
-        zero(q);
-        // zero(k);
-        // zero(q_bias);
-        // zero(k_bias);
-        float rotary_embedding_base = params.rotary_embedding_base;
-        float rotary_embedding_scale = params.rotary_embedding_scale;
-        if (is_valid_qk_vec)
+        // Every query head of the group is loaded and rotated in turn (the rotary scratch in smem_ is released by
+        // the barrier that ends the rotation).
+        for (int gi = 0; gi < gqa_group_size; ++gi)
         {
-            update_rotary_base_n_scale(rotary_embedding_base, rotary_embedding_scale,
-                                       params.rotary_embedding_scale_type, params.rotary_embedding_dim, params.rotary_embedding_max_positions,
-                                       tlength);
-            // Query
-            // The stride between tokens. We may be able to always use params.stride.
-            uint32_t q_stride = params.stride ? static_cast<uint32_t>(params.stride) : (num_heads * Dh);
-            // The offset.
-            const auto q_offset = flat_index_strided3(bi, hi, qk_vec_idx, q_stride, Dh);
-
-            // Note (shang): Load the current qk here. Not the quantized kv cache.
+            const unsigned hi{hi_begin + gi};
+            Qk_vec_k q; //, k; //, q_bias, k_bias;
+            zero(q);
+            // zero(k);
+            // zero(q_bias);
+            // zero(k_bias);
+            float rotary_embedding_base = params.rotary_embedding_base;
+            float rotary_embedding_scale = params.rotary_embedding_scale;
+            if (is_valid_qk_vec)
             {
-                // Removed a branch for load_qkv_quant (current step qkv)
-                q = vec_conversion<Qk_vec_k, Qk_vec_m>(*reinterpret_cast<const Qk_vec_m *>(&params.q[q_offset]));
-            }
-            // {
-                // Removed DO_CROSS_ATTENTION branch
-                // Key
+                update_rotary_base_n_scale(rotary_embedding_base, rotary_embedding_scale,
+                                           params.rotary_embedding_scale_type, params.rotary_embedding_dim, params.rotary_embedding_max_positions,
+                                           tlength);
+                // Query
                 // The stride between tokens. We may be able to always use params.stride.
-                // uint32_t k_stride = params.stride ? static_cast<uint32_t>(params.stride) : (num_heads_kv * Dh);
-                // // The offset.
-                // const auto k_offset = flat_index_strided3(bi, hi_kv, qk_vec_idx, k_stride, Dh);
+                uint32_t q_stride = params.stride ? static_cast<uint32_t>(params.stride) : (num_heads * Dh);
+                // The offset.
+                const auto q_offset = flat_index_strided3(bi, hi, qk_vec_idx, q_stride, Dh);
+
+                // Note (shang): Load the current qk here. Not the quantized kv cache.
+                {
+                    // Removed a branch for load_qkv_quant (current step qkv)
+                    q = vec_conversion<Qk_vec_k, Qk_vec_m>(*reinterpret_cast<const Qk_vec_m *>(&params.q[q_offset]));
+                }
                 // {
-                //     // Removed a branch for load_qkv_quant (current step qkv)
-                //     k = vec_conversion<Qk_vec_k, Qk_vec_m>(*reinterpret_cast<const Qk_vec_m *>(&params.k[k_offset]));
+                    // Removed DO_CROSS_ATTENTION branch
+                    // Key
+                    // The stride between tokens. We may be able to always use params.stride.
+                    // uint32_t k_stride = params.stride ? static_cast<uint32_t>(params.stride) : (num_heads_kv * Dh);
+                    // // The offset.
+                    // const auto k_offset = flat_index_strided3(bi, hi_kv, qk_vec_idx, k_stride, Dh);
+                    // {
+                    //     // Removed a branch for load_qkv_quant (current step qkv)
+                    //     k = vec_conversion<Qk_vec_k, Qk_vec_m>(*reinterpret_cast<const Qk_vec_m *>(&params.k[k_offset]));
+                    // }
                 // }
-            // }
-        }
+            }
 
-        // const bool do_ia3 = handle_kv && params.ia3_tasks != nullptr;
-        const auto beam_width = static_cast<unsigned>(params.beam_width);
-        {
-            const bool do_rotary = is_valid_qk_vec && QK_VEC_SIZE * tidx < params.rotary_embedding_dim;
+            // const bool do_ia3 = handle_kv && params.ia3_tasks != nullptr;
+            const auto beam_width = static_cast<unsigned>(params.beam_width);
+            {
+                const bool do_rotary = is_valid_qk_vec && QK_VEC_SIZE * tidx < params.rotary_embedding_dim;
 
-            T *q_smem_ = reinterpret_cast<T *>(smem_);
-            // T *k_smem = q_smem_ + params.rotary_embedding_dim;
+                T *q_smem_ = reinterpret_cast<T *>(smem_);
+                // T *k_smem = q_smem_ + params.rotary_embedding_dim;
 
-            const int half_rotary_dim = params.rotary_embedding_dim / 2;
-            const int half_idx = qk_vec_idx / half_rotary_dim;
-            const int intra_half_idx = qk_vec_idx % half_rotary_dim;
-            const int smem_pitch = half_rotary_dim; 
+                const int half_rotary_dim = params.rotary_embedding_dim / 2;
+                const int half_idx = qk_vec_idx / half_rotary_dim;
+                const int intra_half_idx = qk_vec_idx % half_rotary_dim;
+                const int smem_pitch = half_rotary_dim; 
 
-            assert(half_rotary_dim % QK_VEC_SIZE == 0);
+                assert(half_rotary_dim % QK_VEC_SIZE == 0);
 
-            if (do_rotary)
-            {
-                *reinterpret_cast<Qk_vec_k *>(q_smem_ + half_idx * smem_pitch + intra_half_idx) = q;
-                // if (handle_kv)
-                // {
-                //     *reinterpret_cast<Qk_vec_k *>(k_smem + half_idx * smem_pitch + intra_half_idx) = k;
-                // }
-            }
+                if (do_rotary)
+                {
+                    *reinterpret_cast<Qk_vec_k *>(q_smem_ + half_idx * smem_pitch + intra_half_idx) = q;
+                    // if (handle_kv)
+                    // {
+                    //     *reinterpret_cast<Qk_vec_k *>(k_smem + half_idx * smem_pitch + intra_half_idx) = k;
+                    // }
+                }
 
-            __syncthreads();
+                __syncthreads();
 
-            const int transpose_idx = half_idx * (half_rotary_dim / 2) + intra_half_idx / 2;
-            constexpr int tidx_factor = (QK_VEC_SIZE > 1) ? QK_VEC_SIZE / 2 : 1;
-            if (do_rotary)
-            {
-                vec_from_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
-                // if (handle_kv)
-                // {
-                //     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
+                const int transpose_idx = half_idx * (half_rotary_dim / 2) + intra_half_idx / 2;
+                constexpr int tidx_factor = (QK_VEC_SIZE > 1) ? QK_VEC_SIZE / 2 : 1;
+                if (do_rotary)
+                {
+                    vec_from_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
+                    // if (handle_kv)
+                    // {
+                    //     vec_from_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
+
+                    //     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
+                    //                            rotary_embedding_base, rotary_embedding_scale, tlength);
+
+                    //     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
+                    // }
+                    // else
+                    {
+                        apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
+                                               rotary_embedding_base, rotary_embedding_scale, tlength, params.rotary_cos_sin);
+                    }
+                    write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
+                }
 
-                //     apply_rotary_embedding(q, k, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                //                            rotary_embedding_base, rotary_embedding_scale, tlength);
+                __syncthreads();
 
-                //     write_smem_transpose(k, k_smem, transpose_idx, smem_pitch);
-                // }
-                // else
+                if (do_rotary)
                 {
-                    apply_rotary_embedding(q, transpose_idx / tidx_factor, params.rotary_embedding_dim,
-                                           rotary_embedding_base, rotary_embedding_scale, tlength);
+                    q = *reinterpret_cast<Qk_vec_k *>(q_smem_ + half_idx * smem_pitch + intra_half_idx);
+                    // if (handle_kv)
+                    // {
+                    //     k = *reinterpret_cast<Qk_vec_k *>(k_smem + half_idx * smem_pitch + intra_half_idx);
+                    // }
                 }
-                write_smem_transpose(q, q_smem_, transpose_idx, smem_pitch);
-            }
 
-            __syncthreads();
-
-            if (do_rotary)
-            {
-                q = *reinterpret_cast<Qk_vec_k *>(q_smem_ + half_idx * smem_pitch + intra_half_idx);
-                // if (handle_kv)
-                // {
-                //     k = *reinterpret_cast<Qk_vec_k *>(k_smem + half_idx * smem_pitch + intra_half_idx);
-                // }
+                __syncthreads();
             }
 
-            __syncthreads();
-        }
 
 
+            // For the same reason as handle_kv, no compute needed in Cross-Attention's 1st step
+            if (qk_vec_idx < Dh_MAX)
+            {
 
-        // For the same reason as handle_kv, no compute needed in Cross-Attention's 1st step
-        if (qk_vec_idx < Dh_MAX)
-        {
-
-            // Store the Q values to shared memory.
-            // Set padded Dh to 0 for the correctness of QK (when Dh != Dh_Max).
-            Qk_vec_k zero_q;
-            zero(zero_q);
+                // Store the Q values to shared memory.
+                // Set padded Dh to 0 for the correctness of QK (when Dh != Dh_Max).
+                Qk_vec_k zero_q;
+                zero(zero_q);
 
-            *reinterpret_cast<Qk_vec_k *>(&q_smem[qk_vec_idx]) = is_valid_qk_vec ? q : zero_q;
+                *reinterpret_cast<Qk_vec_k *>(&q_smem[gi * Dh_MAX + qk_vec_idx]) = is_valid_qk_vec ? q : zero_q;
+            }
         }
 
         // Make sure the data is in shared memory.
@@ -1127,13 +1138,38 @@ namespace mmha
         
         const int context_length = tlength; // const int context_length = HAS_BEAMS ? input_length : tlength;
 
-        const int n_sub_chunks = (context_length + kvCacheBuffer.tokensPerSubChunk - 1) / kvCacheBuffer.tokensPerSubChunk;
+        // Hierarchical selection: score one entry per super-page, or only the sub-chunks of the candidate pages.
+        // Each entry still writes one stat at its own index, so the loop below is shared by all the modes.
+        const bool score_super_pages = IS_RETRIEVAL_HEAD && params.score_super_pages;
+        const int *candidate_pages_ptr = IS_RETRIEVAL_HEAD && params.candidate_pages_ptr != nullptr
+            ? params.candidate_pages_ptr + ((bi * num_stats_heads) + stats_hi) * params.num_candidate_pages : nullptr;
+
+        int n_sub_chunks = (context_length + kvCacheBuffer.tokensPerSubChunk - 1) / kvCacheBuffer.tokensPerSubChunk;
+        if (score_super_pages)
+        {
+            // Super-pages holding at least one full history page.
+            const int n_history_pages = max(divUp(context_length, kvCacheBuffer.mTokensPerBlock) - 1, 0);
+            n_sub_chunks = divUp(n_history_pages, params.super_page_size);
+        }
+        else if (candidate_pages_ptr != nullptr)
+        {
+            n_sub_chunks = params.num_candidate_pages * kvCacheBuffer.SubChunkGroupSize;
+        }
         const int padded_n_sub_chunks = (n_sub_chunks + kvCacheBuffer.SubChunkGroupSize - 1) / kvCacheBuffer.SubChunkGroupSize * kvCacheBuffer.SubChunkGroupSize;
         
-        half *out_stats_ptr = (half*)(params.out) + ((bi * params.num_heads) + hi) * padded_n_sub_chunks; // NOTE (Shang): hoisting +logic_sub_chunk_now * params.num_heads;
+        const int stats_stride = params.stats_stride > 0 ? params.stats_stride : padded_n_sub_chunks;
+        half *out_stats_ptr = (half*)(params.out) + ((bi * num_stats_heads) + stats_hi) * stats_stride; // NOTE (Shang): hoisting +logic_sub_chunk_now * params.num_heads;
             
+        // The range of sub-chunks handled by this CTA.
+        const int tile_sub_chunk_begin = MULTI_BLOCK_FLAG ? static_cast<int>(c_tile) * params.timesteps_per_block_logic : 0;
+        const int tile_sub_chunk_end = MULTI_BLOCK_FLAG ? min(n_sub_chunks, tile_sub_chunk_begin + params.timesteps_per_block_logic) : n_sub_chunks;
+        if (tile_sub_chunk_begin >= tile_sub_chunk_end)
+        {
+            return;
+        }
+
         // const int block_valid_context_length = MULTI_BLOCK_FLAG ? timesteps_per_block : global_valid_context_length;
-        const auto valid_n_sub_chunks_end = divUp(static_cast<unsigned>(n_sub_chunks), UNROLLED_K_PER_WARP) * UNROLLED_K_PER_WARP;
+        const auto valid_n_sub_chunks_end = divUp(static_cast<unsigned>(tile_sub_chunk_end - tile_sub_chunk_begin), UNROLLED_K_PER_WARP) * UNROLLED_K_PER_WARP;
 
         // // if (!MULTI_BLOCK_FLAG)
         // {
@@ -1180,7 +1216,7 @@ namespace mmha
         {
             // const int time_now = MULTI_BLOCK_FLAG ? ti + c_tile_times_timesteps_per_block : ti;
             const int physic_sub_chunk_base = ti;
-            const int logic_sub_chunk_base = ti; // NOTE (Shang): Ignore multiblock for now.
+            const int logic_sub_chunk_base = ti + tile_sub_chunk_begin;
             // const int logic_sub_chunk_base = ti + c_tile_times_timesteps_per_block; // add by JXGuo: c_tile_times_timesteps_per_block is 0 if !MULTI_BLOCK_FLAG
 
             // The keys loaded from the key cache.
@@ -1199,8 +1235,19 @@ namespace mmha
                 // const int valid_time_now = min(time_now + k_loop * K_PER_ITER, context_length - 1);
 
                 const int _logic_sub_chunk_now = logic_sub_chunk_base + k_loop * K_PER_ITER;
-                const int logic_sub_chunk_now = min(_logic_sub_chunk_now, n_sub_chunks - 1);    // -1 because this is the idx
-                const int logic_time_now = logic_sub_chunk_now * kvCacheBuffer.tokensPerSubChunk;
+                const int logic_sub_chunk_now = min(_logic_sub_chunk_now, tile_sub_chunk_end - 1);    // -1 because this is the idx
+                int logic_time_now = logic_sub_chunk_now * kvCacheBuffer.tokensPerSubChunk;
+                if (score_super_pages)
+                {
+                    logic_time_now = logic_sub_chunk_now * params.super_page_size * kvCacheBuffer.mTokensPerBlock;
+                }
+                else if (candidate_pages_ptr != nullptr)
+                {
+                    // Padding candidates read page 0; page_selector_topk never selects them.
+                    const int candidate_page = max(candidate_pages_ptr[logic_sub_chunk_now / kvCacheBuffer.SubChunkGroupSize], 0);
+                    logic_time_now = candidate_page * kvCacheBuffer.mTokensPerBlock
+                        + (logic_sub_chunk_now % kvCacheBuffer.SubChunkGroupSize) * kvCacheBuffer.tokensPerSubChunk;
+                }
 
                 // const int seqIdx = bi / beam_width * beam_width;
                 const int seqIdx = bi;
@@ -1208,13 +1255,19 @@ namespace mmha
                 // Base pointer to k cache block fo r beam's batch
                 Tcache *k_cache_batch = reinterpret_cast<Tcache *>(kvCacheBuffer.getKBlockPtr(seqIdx, logic_time_now));
 
-                half *k_cache_stats_max_ptr = reinterpret_cast<half *>(k_cache_batch + kvCacheBuffer.mBytesPerSeq) + kvCacheBuffer.mTokensPerBlock * num_head_kv_buffer * (ENABLE_ZEROS? 2 : 1);
-                half *k_cache_stats_min_ptr = k_cache_stats_max_ptr + kvCacheBuffer.SubChunkGroupSize * kvCacheBuffer.mElesPerIndicator;
+                half *k_cache_stats_max_ptr = kvCacheBuffer.getKStatsMaxPtr(k_cache_batch, num_head_kv_buffer);
+                half *k_cache_stats_min_ptr = kvCacheBuffer.getKStatsMinPtr(k_cache_batch, num_head_kv_buffer);
 
                 // int sub_chunk_idx = (tlength % kvCacheBuffer.mTokensPerBlock) / kvCacheBuffer.tokensPerSubChunk;
                 const int sub_chunk_idx = logic_sub_chunk_now % kvCacheBuffer.SubChunkGroupSize;
                 half *k_cache_stats_max_ptr_local = k_cache_stats_max_ptr + sub_chunk_idx * kvCacheBuffer.mElesPerIndicator + head_rank * Dh;
                 half *k_cache_stats_min_ptr_local = k_cache_stats_min_ptr + sub_chunk_idx * kvCacheBuffer.mElesPerIndicator + head_rank * Dh;
+                if (score_super_pages)
+                {
+                    // The super-page stats follow the sub-chunk min stats of the first page of the super-page.
+                    k_cache_stats_max_ptr_local = k_cache_stats_min_ptr + kvCacheBuffer.SubChunkGroupSize * kvCacheBuffer.mElesPerIndicator + head_rank * Dh;
+                    k_cache_stats_min_ptr_local = k_cache_stats_max_ptr_local + kvCacheBuffer.mElesPerIndicator;
+                }
                 
 #pragma unroll
                 for (int k_vec_i = 0; k_vec_i < K_VECS_PER_THREAD; ++k_vec_i)
@@ -1250,6 +1303,13 @@ namespace mmha
                 // float qk_max = qk_hmma_dot_simple<THREADS_PER_KEY>(q_vec[0], k_vec_stats_max[k_loop][0]);   
                 // float qk_min = qk_hmma_dot_simple<THREADS_PER_KEY>(q_vec[0], k_vec_stats_min[k_loop][0]);  // If only one representative, we can use qk_hmma_dot_simple for calculation
                 float qk_min_max = qk_hmma_dot_min_max<THREADS_PER_KEY>(q_vec[0], k_vec_stats_min[k_loop][0], k_vec_stats_max[k_loop][0]);  
+                // The other query heads of the group reuse the loaded stats; their queries come from q_smem.
+                for (int gi = 1; gi < gqa_group_size; ++gi)
+                {
+                    const K_vec_k q_vec_gi = *reinterpret_cast<const K_vec_k *>(&q_smem[gi * Dh_MAX + k_idx.y]);
+                    const float qk_gi = qk_hmma_dot_min_max<THREADS_PER_KEY>(q_vec_gi, k_vec_stats_min[k_loop][0], k_vec_stats_max[k_loop][0]);
+                    qk_min_max = params.gqa_sum_scores ? qk_min_max + qk_gi : fmaxf(qk_min_max, qk_gi);
+                }
                 
                 // // NOTE (Shang): No need to do the reduction here. the hmma_dot above already does the reduction within the head.
                 // float qk_max_tmp = qk_max;
@@ -1275,7 +1335,7 @@ namespace mmha
                 // }
 
                 if (k_idx.y == 0){
-                    if (logic_sub_chunk_now < n_sub_chunks){
+                    if (logic_sub_chunk_now < tile_sub_chunk_end){
                         half *out_stats_ptr_local =  out_stats_ptr + logic_sub_chunk_now;
                         *out_stats_ptr_local = __float2half(qk_min_max);
                         // printf("logic_sub_chunk_now (sub_chunk_idx): %d, qk_min_max: %f, out_stats_ptr_local[0]: %f\n", logic_sub_chunk_now, qk_min_max, __half2float(out_stats_ptr_local[0]));
@@ -1316,7 +1376,7 @@ namespace mmha
     __global__ void masked_multihead_attention_page_selector_compute(
         Multihead_attention_page_selector_params<T> params, RetrievalKVCacheBuffer retrieval_kv_buffer, StreamingKVCacheBuffer streaming_kv_buffer){
             const int qheads_per_kv_head = params.num_heads / params.num_kv_heads;
-            const int kv_head_idx = blockIdx.x / qheads_per_kv_head;
+            const int kv_head_idx = blockIdx.x * params.gqa_group_size / qheads_per_kv_head;
             
             const int is_retrieval_head = params.retrieval_head_flags_ptr[kv_head_idx]!=0;
             const int head_rank = params.head_rank_table_ptr[kv_head_idx];
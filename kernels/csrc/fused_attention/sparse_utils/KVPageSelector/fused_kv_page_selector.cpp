@@ -22,6 +22,7 @@
 // #include "decoderMaskedMultiheadAttention.h"
 #include "KVPageSelector.h"
 #include "../../common/kvCacheUtils.h"
+#include "../../../nvtx_utils.h"
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.device().type() == torch::kCUDA, #x " must be on CUDA")
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
@@ -168,7 +169,7 @@ void set_params(Masked_multihead_attention_page_selector_params<T> &params,
 }
 
 
-torch::Tensor single_query_page_selector(const torch::Tensor q,
+static torch::Tensor compute_page_selector_stats(const torch::Tensor q,
                                         const torch::Tensor k,
                                         const torch::Tensor v,
                                         c10::optional<torch::Tensor> _retrieval_kv_pointers, // B x 2 x M
@@ -199,12 +200,23 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
                                         const int tokens_per_sub_chunk,
                                         const int hidden_dim_per_retrieval_token,
                                         //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                        const int multiblock_switch) {  
+                                        const int multiblock_switch,
+                                        // The top-k path only reads fully written pages, so it skips the memset.
+                                        const bool zero_init_stats,
+                                        // Hierarchical selection: score the super-pages, or only the candidate pages.
+                                        const int super_page_size = 0,
+                                        const bool score_super_pages = false,
+                                        c10::optional<torch::Tensor> candidate_pages_ = c10::nullopt,
+                                        // Group-shared selection: query heads scored per CTA, one stats row each.
+                                        const int gqa_group_size = 1,
+                                        const bool gqa_sum_scores = false,
+                                        c10::optional<torch::Tensor> rotary_cos_sin_ = c10::nullopt) {  
     CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v); //CHECK_DEVICE(kv_pointers);
     int batch_size = q.size(0);
     int nheads = q.size(1);
     int nheads_kv = k.size(1);
     int headdim = k.size(-1);
+    int stats_heads = nheads / gqa_group_size;
 
     // int max_blocks = kv_pointers.size(-1)
     // CHECK_SHAPE(q, batch_size, nheads, headdim);
@@ -262,7 +274,9 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
     KVBlockArray<false> retrieval_kv_buffer(batch_size, retrieval_max_blocks_per_seq, tokens_per_block, size_per_retrieval_token, 0, 0, 0, 0, tokens_per_sub_chunk, hidden_dim_per_retrieval_token);
     KVBlockArray<true> streaming_kv_buffer(batch_size, streaming_max_blocks_per_seq, tokens_per_block, size_per_streaming_token, sink_token_num, local_token_num, sink_block_num, local_block_num, 0, 0);
     retrieval_kv_buffer.data = _retrieval_kv_pointers.has_value() ? _retrieval_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    retrieval_kv_buffer.setRagged(_retrieval_kv_pointers.has_value() && _retrieval_kv_pointers->dim() == 1);
     streaming_kv_buffer.data = _streaming_kv_pointers.has_value() ? _streaming_kv_pointers.value().data_ptr<int64_t>() : nullptr;
+    streaming_kv_buffer.setRagged(_streaming_kv_pointers.has_value() && _streaming_kv_pointers->dim() == 1);
      
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
@@ -274,11 +288,30 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
     int num_sub_chunks = (timestep + tokens_per_sub_chunk - 1) / tokens_per_sub_chunk;  // timestep equals to the length of previous context tokens (i.e., the idx of current token)
     int sub_chunk_group_size = tokens_per_block / tokens_per_sub_chunk;
     int padded_num_sub_chunks = (num_sub_chunks + sub_chunk_group_size - 1) / sub_chunk_group_size * sub_chunk_group_size;
-    at::Tensor dynamic_sparse_qk_stats_ = torch::zeros({batch_size, nheads, padded_num_sub_chunks}, dynamic_sparse_qk_stats_options);
+    int num_candidate_pages = 0;
+    if (score_super_pages) {
+      TORCH_CHECK(super_page_size > 0, "score_super_pages requires super_page_size > 0");
+      int num_history_pages = std::max(padded_num_sub_chunks / sub_chunk_group_size - 1, 0);
+      padded_num_sub_chunks = std::max((num_history_pages + super_page_size - 1) / super_page_size, 1);
+    } else if (candidate_pages_.has_value()) {
+      auto candidate_pages = candidate_pages_.value();
+      CHECK_DEVICE(candidate_pages);
+      CHECK_CONTIGUOUS(candidate_pages);
+      TORCH_CHECK(candidate_pages.dtype() == torch::kInt32);
+      num_candidate_pages = candidate_pages.size(-1);
+      CHECK_SHAPE(candidate_pages, batch_size, stats_heads, num_candidate_pages);
+      padded_num_sub_chunks = num_candidate_pages * sub_chunk_group_size;
+    }
+    at::Tensor dynamic_sparse_qk_stats_ = zero_init_stats
+        ? torch::zeros({batch_size, stats_heads, padded_num_sub_chunks}, dynamic_sparse_qk_stats_options)
+        : torch::empty({batch_size, stats_heads, padded_num_sub_chunks}, dynamic_sparse_qk_stats_options);
 
     const int smem_preload_switch = 2048;
-    bool multi_block_mode = false;
-    int max_seq_len_tile = 1;
+    // Split the sub-chunks of long sequences across multiple CTAs. The selector does not need the
+    // partial_out/sum/max buffers since each tile writes disjoint stats.
+    // The hierarchical levels score few entries, one CTA per (head, batch) is enough.
+    bool multi_block_mode = timestep >= multiblock_switch && !score_super_pages && !candidate_pages_.has_value();
+    int max_seq_len_tile = multi_block_mode ? 100 : 1;
 
     RotaryScalingType rotary_embedding_scale_type;
     if (rotary_embedding_scale != 1.0f)
@@ -297,6 +330,7 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
         Masked_multihead_attention_page_selector_params<DataType> params;
         
         params.int8_kv_cache = true; 
+        params.stats_stride = padded_num_sub_chunks;
         set_params(params, batch_size, nheads, nheads_kv, memory_max_seqlen, headdim, 
                    timestep, rotary_embedding_dim, rotary_base, rotary_embedding_scale, rotary_embedding_scale_type, 
                    neox_rotary_style, q.stride(0), tokens_per_block,
@@ -326,17 +360,232 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
                    partial_max,
                    block_counter
                    );
-        auto stream = at::cuda::getCurrentCUDAStream();
-        masked_multihead_attention_page_selector(params, retrieval_kv_buffer, streaming_kv_buffer);
+        params.super_page_size = super_page_size;
+        params.score_super_pages = score_super_pages;
+        params.candidate_pages_ptr = candidate_pages_.has_value() ? candidate_pages_.value().data_ptr<int>() : nullptr;
+        params.num_candidate_pages = num_candidate_pages;
+        params.gqa_group_size = gqa_group_size;
+        params.gqa_sum_scores = gqa_sum_scores;
+        if (rotary_cos_sin_.has_value())
+            params.rotary_cos_sin = reinterpret_cast<const float2 *>(rotary_cos_sin_.value().data_ptr<float>());
+        auto stream = at::cuda::getCurrentCUDAStream().stream();
+        masked_multihead_attention_page_selector(params, retrieval_kv_buffer, streaming_kv_buffer, stream);
     });
     // return torch::zeros_like(q);
     return dynamic_sparse_qk_stats_;
 }
 
 
+torch::Tensor single_query_page_selector(const torch::Tensor q,
+                                        const torch::Tensor k,
+                                        const torch::Tensor v,
+                                        c10::optional<torch::Tensor> _retrieval_kv_pointers, // B x 2 x M
+                                        c10::optional<torch::Tensor> _streaming_kv_pointers, // B x 2 x M
+                                        torch::Tensor retrieval_head_flags, // H
+                                        torch::Tensor head_rank_table, // H
+                                        c10::optional<torch::Tensor> dynamic_sparse_page_idxes_,      // B x N_head x dynamic_sparse_page_num // NOTE (Shang): No use. Can delete in the future.
+                                        c10::optional<const torch::Tensor> length_per_sample_,
+                                        c10::optional<const torch::Tensor> alibi_slopes_,
+                                        //  c10::optional<const torch::Tensor> k_scale_orig_quant,
+                                        //  c10::optional<const torch::Tensor> v_scale_orig_quant,
+                                        int memory_max_seqlen,
+                                        int tokens_per_block,
+                                        const int size_per_retrieval_token,   // default = hidden_size * sizeof(dtype)
+                                        const int size_per_streaming_token,   // default = hidden_size * sizeof(dtype)
+                                        const int sink_token_num, const int local_token_num,
+                                        const int sink_block_num, const int local_block_num,
+                                        const int num_retrieval_kv_heads,
+                                        const int num_streaming_kv_heads,
+                                        const int timestep,
+                                        const int rotary_embedding_dim,
+                                        const float rotary_base,
+                                        const float rotary_embedding_scale,
+                                        // neox_rotary_style = not interleaved
+                                        const bool neox_rotary_style,
+                                        const bool int4_kv_cache,
+                                        const bool kv_cache_with_zeros,
+                                        const int tokens_per_sub_chunk,
+                                        const int hidden_dim_per_retrieval_token,
+                                        //  const int dynamic_sparse_n_indicator_per_sub_chunk,
+                                        const int multiblock_switch) {
+    return compute_page_selector_stats(q, k, v, _retrieval_kv_pointers, _streaming_kv_pointers,
+                                       retrieval_head_flags, head_rank_table, dynamic_sparse_page_idxes_,
+                                       length_per_sample_, alibi_slopes_, memory_max_seqlen, tokens_per_block,
+                                       size_per_retrieval_token, size_per_streaming_token,
+                                       sink_token_num, local_token_num, sink_block_num, local_block_num,
+                                       num_retrieval_kv_heads, num_streaming_kv_heads, timestep,
+                                       rotary_embedding_dim, rotary_base, rotary_embedding_scale, neox_rotary_style,
+                                       int4_kv_cache, kv_cache_with_zeros, tokens_per_sub_chunk,
+                                       hidden_dim_per_retrieval_token, multiblock_switch, true);
+}
+
+
+torch::Tensor single_query_page_selector_topk(const torch::Tensor q,
+                                        const torch::Tensor k,
+                                        const torch::Tensor v,
+                                        c10::optional<torch::Tensor> _retrieval_kv_pointers, // B x 2 x M
+                                        c10::optional<torch::Tensor> _streaming_kv_pointers, // B x 2 x M
+                                        torch::Tensor retrieval_head_flags, // H
+                                        torch::Tensor head_rank_table, // H
+                                        c10::optional<torch::Tensor> dynamic_sparse_page_idxes_,      // B x N_head x dynamic_sparse_page_num // NOTE (Shang): No use. Can delete in the future.
+                                        c10::optional<const torch::Tensor> length_per_sample_,
+                                        c10::optional<const torch::Tensor> alibi_slopes_,
+                                        //  c10::optional<const torch::Tensor> k_scale_orig_quant,
+                                        //  c10::optional<const torch::Tensor> v_scale_orig_quant,
+                                        int memory_max_seqlen,
+                                        int tokens_per_block,
+                                        const int size_per_retrieval_token,   // default = hidden_size * sizeof(dtype)
+                                        const int size_per_streaming_token,   // default = hidden_size * sizeof(dtype)
+                                        const int sink_token_num, const int local_token_num,
+                                        const int sink_block_num, const int local_block_num,
+                                        const int num_retrieval_kv_heads,
+                                        const int num_streaming_kv_heads,
+                                        const int timestep,
+                                        const int rotary_embedding_dim,
+                                        const float rotary_base,
+                                        const float rotary_embedding_scale,
+                                        // neox_rotary_style = not interleaved
+                                        const bool neox_rotary_style,
+                                        const bool int4_kv_cache,
+                                        const bool kv_cache_with_zeros,
+                                        const int tokens_per_sub_chunk,
+                                        const int hidden_dim_per_retrieval_token,
+                                        //  const int dynamic_sparse_n_indicator_per_sub_chunk,
+                                        const int multiblock_switch,
+                                        const int dynamic_sparse_token_budget,
+                                        const int super_page_size,
+                                        const int num_selected_super_pages,
+                                        c10::optional<torch::Tensor> dynamic_sparse_page_nums_,
+                                        const bool gqa_shared_selection,
+                                        const bool gqa_sum_scores,
+                                        c10::optional<torch::Tensor> rotary_cos_sin_,
+                                        c10::optional<torch::Tensor> page_scores_) {
+    int batch_size = q.size(0);
+    // With a group-shared selection every row (stats, candidates and selected pages) belongs to a KV head.
+    int gqa_group_size = gqa_shared_selection ? q.size(1) / k.size(1) : 1;
+    TORCH_CHECK(!gqa_shared_selection || q.size(1) % k.size(1) == 0, "num_heads must be divisible by num_kv_heads");
+    TORCH_CHECK(gqa_group_size <= MAX_GQA_GROUP_SIZE, "group-shared page selection supports up to ",
+                MAX_GQA_GROUP_SIZE, " query heads per kv head");
+    int nheads = q.size(1) / gqa_group_size;
+    int sub_chunk_group_size = tokens_per_block / tokens_per_sub_chunk;
+    int total_page_num = (timestep + tokens_per_block - 1) / tokens_per_block;
+    // Same budget rule as the python reference: at least 3 pages, at most all the history pages.
+    int num_selected_pages = std::min(std::max(3, dynamic_sparse_token_budget / tokens_per_block), total_page_num);
+    TORCH_CHECK(num_selected_pages > 0, "single_query_page_selector_topk requires a non-empty kv cache");
+    const int *page_nums = nullptr;
+    if (dynamic_sparse_page_nums_.has_value()) {
+      auto dynamic_sparse_page_nums = dynamic_sparse_page_nums_.value();
+      CHECK_DEVICE(dynamic_sparse_page_nums);
+      CHECK_SHAPE(dynamic_sparse_page_nums, batch_size);
+      CHECK_CONTIGUOUS(dynamic_sparse_page_nums);
+      TORCH_CHECK(dynamic_sparse_page_nums.dtype() == torch::kInt32);
+      page_nums = dynamic_sparse_page_nums.data_ptr<int>();
+    }
+    float *page_scores = nullptr;
+    int page_scores_stride = 0;
+    if (page_scores_.has_value()) {
+      auto page_scores_tensor = page_scores_.value();
+      CHECK_DEVICE(page_scores_tensor);
+      CHECK_CONTIGUOUS(page_scores_tensor);
+      TORCH_CHECK(page_scores_tensor.dtype() == torch::kFloat32);
+      TORCH_CHECK(page_scores_tensor.dim() == 2 && page_scores_tensor.size(0) >= batch_size
+                  && page_scores_tensor.size(1) >= total_page_num, "page_scores must be at least B x pages");
+      page_scores = page_scores_tensor.data_ptr<float>();
+      page_scores_stride = page_scores_tensor.size(1);
+    }
+
+    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    auto page_idxes_options = torch::TensorOptions().dtype(torch::kInt32).device(q.device());
+    at::Tensor dynamic_sparse_page_idxes = torch::empty({batch_size, nheads, num_selected_pages}, page_idxes_options);
+
+    // Hierarchical selection: score the super-pages, then only the pages of the top super-pages. By default
+    // twice the super-pages needed to hold the budget are kept. Falls back to the flat selection when that
+    // would cover (almost) every page anyway.
+    int num_history_pages = std::max(total_page_num - 1, 0);
+    int num_super_pages = super_page_size > 0 ? (num_history_pages + super_page_size - 1) / super_page_size : 0;
+    int num_candidate_super_pages = num_selected_super_pages > 0
+        ? num_selected_super_pages
+        : 2 * ((num_selected_pages - 1 + super_page_size - 1) / std::max(super_page_size, 1));
+    if (super_page_size > 0 && num_candidate_super_pages > 0 && num_candidate_super_pages < num_super_pages) {
+      TORCH_CHECK(k.size(-1) == 128, "hierarchical page selection only supports head_dim 128");
+      TORCH_CHECK(_retrieval_kv_pointers.has_value(), "hierarchical page selection requires the retrieval kv cache");
+      KVBlockArray<false> retrieval_kv_buffer(batch_size, _retrieval_kv_pointers.value().size(-1), tokens_per_block,
+                                              size_per_retrieval_token, 0, 0, 0, 0, tokens_per_sub_chunk,
+                                              hidden_dim_per_retrieval_token);
+      retrieval_kv_buffer.data = _retrieval_kv_pointers.value().data_ptr<int64_t>();
+      retrieval_kv_buffer.setRagged(_retrieval_kv_pointers->dim() == 1);
+      const int *length_per_sample = length_per_sample_.has_value() ? length_per_sample_.value().data_ptr<int>() : nullptr;
+      super_page_stats_refresh(retrieval_kv_buffer, length_per_sample, batch_size, num_retrieval_kv_heads,
+                               k.size(-1), timestep, super_page_size, kv_cache_with_zeros, stream);
+
+      at::Tensor super_page_stats = compute_page_selector_stats(
+                                       q, k, v, _retrieval_kv_pointers, _streaming_kv_pointers,
+                                       retrieval_head_flags, head_rank_table, dynamic_sparse_page_idxes_,
+                                       length_per_sample_, alibi_slopes_, memory_max_seqlen, tokens_per_block,
+                                       size_per_retrieval_token, size_per_streaming_token,
+                                       sink_token_num, local_token_num, sink_block_num, local_block_num,
+                                       num_retrieval_kv_heads, num_streaming_kv_heads, timestep,
+                                       rotary_embedding_dim, rotary_base, rotary_embedding_scale, neox_rotary_style,
+                                       int4_kv_cache, kv_cache_with_zeros, tokens_per_sub_chunk,
+                                       hidden_dim_per_retrieval_token, multiblock_switch, false,
+                                       super_page_size, true, c10::nullopt, gqa_group_size, gqa_sum_scores,
+                                       rotary_cos_sin_);
+      at::Tensor candidate_pages = torch::empty({batch_size, nheads, num_candidate_super_pages * super_page_size},
+                                                page_idxes_options);
+      super_page_selector_topk(reinterpret_cast<half*>(super_page_stats.data_ptr()), candidate_pages.data_ptr<int>(),
+                               length_per_sample, batch_size, nheads, super_page_stats.size(-1), super_page_size,
+                               tokens_per_block, timestep, num_candidate_super_pages, stream);
+
+      at::Tensor candidate_stats = compute_page_selector_stats(
+                                       q, k, v, _retrieval_kv_pointers, _streaming_kv_pointers,
+                                       retrieval_head_flags, head_rank_table, dynamic_sparse_page_idxes_,
+                                       length_per_sample_, alibi_slopes_, memory_max_seqlen, tokens_per_block,
+                                       size_per_retrieval_token, size_per_streaming_token,
+                                       sink_token_num, local_token_num, sink_block_num, local_block_num,
+                                       num_retrieval_kv_heads, num_streaming_kv_heads, timestep,
+                                       rotary_embedding_dim, rotary_base, rotary_embedding_scale, neox_rotary_style,
+                                       int4_kv_cache, kv_cache_with_zeros, tokens_per_sub_chunk,
+                                       hidden_dim_per_retrieval_token, multiblock_switch, false,
+                                       super_page_size, false, candidate_pages, gqa_group_size, gqa_sum_scores,
+                                       rotary_cos_sin_);
+      page_selector_topk(reinterpret_cast<half*>(candidate_stats.data_ptr()),
+                         dynamic_sparse_page_idxes.data_ptr<int>(), length_per_sample,
+                         batch_size, nheads, candidate_stats.size(-1), sub_chunk_group_size, tokens_per_block,
+                         timestep, num_selected_pages, page_nums, candidate_pages.data_ptr<int>(),
+                         page_scores, page_scores_stride, stream);
+      return dynamic_sparse_page_idxes;
+    }
+
+    at::Tensor dynamic_sparse_qk_stats_ = compute_page_selector_stats(
+                                       q, k, v, _retrieval_kv_pointers, _streaming_kv_pointers,
+                                       retrieval_head_flags, head_rank_table, dynamic_sparse_page_idxes_,
+                                       length_per_sample_, alibi_slopes_, memory_max_seqlen, tokens_per_block,
+                                       size_per_retrieval_token, size_per_streaming_token,
+                                       sink_token_num, local_token_num, sink_block_num, local_block_num,
+                                       num_retrieval_kv_heads, num_streaming_kv_heads, timestep,
+                                       rotary_embedding_dim, rotary_base, rotary_embedding_scale, neox_rotary_style,
+                                       int4_kv_cache, kv_cache_with_zeros, tokens_per_sub_chunk,
+                                       hidden_dim_per_retrieval_token, multiblock_switch, false,
+                                       0, false, c10::nullopt, gqa_group_size, gqa_sum_scores,
+                                       rotary_cos_sin_);
+    int stats_stride = dynamic_sparse_qk_stats_.size(-1);
+    page_selector_topk(reinterpret_cast<half*>(dynamic_sparse_qk_stats_.data_ptr()),
+                       dynamic_sparse_page_idxes.data_ptr<int>(),
+                       length_per_sample_.has_value() ? length_per_sample_.value().data_ptr<int>() : nullptr,
+                       batch_size, nheads, stats_stride, sub_chunk_group_size, tokens_per_block,
+                       timestep, num_selected_pages, page_nums, nullptr, page_scores, page_scores_stride, stream);
+    return dynamic_sparse_page_idxes;
+}
+
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def(
     "single_query_page_selector",
-    &single_query_page_selector,
+    omniserve::nvtx_wrap("single_query_page_selector", &single_query_page_selector),
     "single query page selector kernel for dynamic_sparse with min-max stats");
+  m.def(
+    "single_query_page_selector_topk",
+    omniserve::nvtx_wrap("single_query_page_selector_topk", &single_query_page_selector_topk),
+    "single query page selector with fused per-head top-k, returns int32 dynamic_sparse_page_idxes");
 }
@@ -50,8 +50,8 @@
 torch::Tensor single_query_page_selector(const torch::Tensor q,
                                         const torch::Tensor k,
                                         const torch::Tensor v,
-                                        c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M
-                                        c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M
+                                        c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                        c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
                                         torch::Tensor retrieval_head_flags, // H
                                         torch::Tensor head_rank_table, // H
                                         c10::optional<torch::Tensor> dynamic_sparse_page_idxes,      // B x N_blocks (total) x N_head // NOTE (Shang): No use. Can delete in the future.
@@ -76,4 +76,54 @@ torch::Tensor single_query_page_selector(const torch::Tensor q,
                                         const int tokens_per_sub_chunk,
                                         const int hidden_dim_per_retrieval_token,
                                         //  const int dynamic_sparse_n_indicator_per_sub_chunk,
-                                        const int multiblock_switch);
\ No newline at end of file
+                                        const int multiblock_switch);
+
+// Same inputs as single_query_page_selector. Returns B x N_head x num_selected_pages int32 page indices
+// (top pages by min-max stats, most recent page last) instead of the raw sub-chunk stats.
+// With super_page_size > 0 (the kv cache must hold super-page stats), only the pages of the top
+// num_selected_super_pages super-pages are scored (0: twice the super-pages needed for the budget).
+// With dynamic_sparse_page_nums (B, int32), row b only selects dynamic_sparse_page_nums[b] pages (its own token
+// budget, most recent page at index dynamic_sparse_page_nums[b] - 1); dynamic_sparse_token_budget is the largest one.
+// With gqa_shared_selection, one page set is selected per KV head (B x N_kv_head x num_selected_pages) from the
+// scores of its query heads, aggregated by their max (or sum with gqa_sum_scores); the stats are read once per group.
+// With rotary_cos_sin (max_positions x rotary_embedding_dim / 2 x 2 fp32), q is rotated with the precomputed table.
+// With page_scores (B x >= pages fp32, page eviction), the selection counts of the history pages are accumulated
+// in place and the pages with a negative entry (evicted) are skipped.
+torch::Tensor single_query_page_selector_topk(const torch::Tensor q,
+                                        const torch::Tensor k,
+                                        const torch::Tensor v,
+                                        c10::optional<torch::Tensor> retrieval_kv_pointers, // B x 2 x M or ragged
+                                        c10::optional<torch::Tensor> streaming_kv_pointers, // B x 2 x M or ragged
+                                        torch::Tensor retrieval_head_flags, // H
+                                        torch::Tensor head_rank_table, // H
+                                        c10::optional<torch::Tensor> dynamic_sparse_page_idxes,      // NOTE (Shang): No use. Can delete in the future.
+                                        c10::optional<const torch::Tensor> length_per_sample_,
+                                        c10::optional<const torch::Tensor> alibi_slopes_,
+                                        int memory_max_seqlen,
+                                        int tokens_per_block,
+                                        const int size_per_retrieval_token,   // default = hidden_size * sizeof(dtype)
+                                        const int size_per_streaming_token,   // default = hidden_size * sizeof(dtype)
+                                        const int sink_token_num, const int local_token_num,
+                                        const int sink_block_num, const int local_block_num,
+                                        const int num_retrieval_kv_heads,
+                                        const int num_streaming_kv_heads,
+                                        const int timestep,
+                                        const int rotary_embedding_dim,
+                                        const float rotary_base,
+                                        const float rotary_embedding_scale,
+                                        // neox_rotary_style = not interleaved
+                                        const bool neox_rotary_style,
+                                        const bool int4_kv_cache,
+                                        const bool kv_cache_with_zeros,
+                                        const int tokens_per_sub_chunk,
+                                        const int hidden_dim_per_retrieval_token,
+                                        //  const int dynamic_sparse_n_indicator_per_sub_chunk,
+                                        const int multiblock_switch,
+                                        const int dynamic_sparse_token_budget,
+                                        const int super_page_size,
+                                        const int num_selected_super_pages,
+                                        c10::optional<torch::Tensor> dynamic_sparse_page_nums_,
+                                        const bool gqa_shared_selection,
+                                        const bool gqa_sum_scores,
+                                        c10::optional<torch::Tensor> rotary_cos_sin_,
+                                        c10::optional<torch::Tensor> page_scores_);
@@ -140,6 +140,121 @@ __global__ void quant_kernel_fuse_sum(const T *__restrict__ input,
     }
   }
 }
+
+// Vectorized per-token quantization for the common row sizes (attention outputs and MLP intermediates).
+// A row is read from global memory once with 128-bit loads and kept in registers between the amax (and
+// sum) reduction and the quantization, and the int8 outputs are stored 8 at a time. kThreadsPerRow == 32
+// runs one warp per row (several rows per CTA), larger values one CTA per row.
+#define QUANT_VEC_ELEMS 8
+#define QUANT_VEC_WARP_ROWS_PER_CTA 4
+
+// X(HIDDEN_SIZE, THREADS_PER_ROW)
+#define QUANT_VEC_HIDDEN_SIZES(X) \
+  X(2048, 32)                     \
+  X(4096, 32)                     \
+  X(5120, 128)                    \
+  X(8192, 256)                    \
+  X(11008, 256)                   \
+  X(13824, 192)                   \
+  X(14336, 256)                   \
+  X(28672, 512)
+
+template <typename T, int kHiddenSize, int kThreadsPerRow, bool kFuseSum>
+__global__ void quant_vec_kernel(const T *__restrict__ input,
+                                 int8_t *__restrict__ output,
+                                 half *__restrict__ input_sum,
+                                 half *__restrict__ scale,
+                                 int num_tokens) {
+  using T2 = typename packed_as<T, 2>::type;
+  constexpr int kNumVecs = kHiddenSize / QUANT_VEC_ELEMS;
+  // The last vector of a thread may fall past the row when the row does not split evenly.
+  constexpr int kVecs = (kNumVecs + kThreadsPerRow - 1) / kThreadsPerRow;
+  constexpr bool kEvenSplit = kNumVecs % kThreadsPerRow == 0;
+  constexpr int kRowsPerCta = kThreadsPerRow == 32 ? QUANT_VEC_WARP_ROWS_PER_CTA : 1;
+  static_assert(kNumVecs * QUANT_VEC_ELEMS == kHiddenSize, "Hidden size must be a multiple of the vector size.");
+
+  const int row = blockIdx.x * kRowsPerCta + threadIdx.x / kThreadsPerRow;
+  const int tid = threadIdx.x % kThreadsPerRow;
+  // Warp-per-row CTAs never synchronize across warps, so idle warps can leave.
+  if (row >= num_tokens)
+    return;
+  const int64_t row_offset = row * int64_t(kHiddenSize);
+
+  uint4 x[kVecs];
+  float amax_val = 0.0f;
+  float sum_val = 0.0f;
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v) {
+    const int col = (v * kThreadsPerRow + tid) * QUANT_VEC_ELEMS;
+    if (kEvenSplit || col < kHiddenSize) {
+      x[v] = *reinterpret_cast<const uint4 *>(input + row_offset + col);
+      const T2 *x2 = reinterpret_cast<const T2 *>(&x[v]);
+#pragma unroll
+      for (int j = 0; j < QUANT_VEC_ELEMS / 2; ++j) {
+        const float2 f = cuda_cast<float2>(x2[j]);
+        amax_val = fmaxf(amax_val, fmaxf(fabsf(f.x), fabsf(f.y)));
+        if constexpr (kFuseSum)
+          sum_val += f.x + f.y;
+      }
+    }
+  }
+
+  const float row_amax_val = rowReduceMax<kThreadsPerRow>(amax_val);
+  if constexpr (kFuseSum)
+    sum_val = rowReduceSum<kThreadsPerRow>(sum_val);
+  if (tid == 0) {
+    scale[row] = __float2half_rn(row_amax_val / 127.0f);
+    if constexpr (kFuseSum)
+      input_sum[row] = __float2half_rn(sum_val);
+  }
+
+  const float tmp_scale = 127.0f / row_amax_val;
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v) {
+    const int col = (v * kThreadsPerRow + tid) * QUANT_VEC_ELEMS;
+    if (kEvenSplit || col < kHiddenSize) {
+      const T2 *x2 = reinterpret_cast<const T2 *>(&x[v]);
+      int8_t o[QUANT_VEC_ELEMS];
+#pragma unroll
+      for (int j = 0; j < QUANT_VEC_ELEMS / 2; ++j) {
+        const float2 f = cuda_cast<float2>(x2[j]);
+        o[2 * j] = float_to_int8_rn(f.x * tmp_scale);
+        o[2 * j + 1] = float_to_int8_rn(f.y * tmp_scale);
+      }
+      *reinterpret_cast<uint2 *>(output + row_offset + col) = *reinterpret_cast<uint2 *>(o);
+    }
+  }
+}
+
+#define QUANT_VEC_LAUNCH_CASE(HIDDEN_SIZE, THREADS_PER_ROW)                                                  \
+  case HIDDEN_SIZE:                                                                                          \
+  {                                                                                                          \
+    constexpr int kRowsPerCta = THREADS_PER_ROW == 32 ? QUANT_VEC_WARP_ROWS_PER_CTA : 1;                      \
+    dim3 grid((num_tokens + kRowsPerCta - 1) / kRowsPerCta);                                                 \
+    dim3 block(THREADS_PER_ROW * kRowsPerCta);                                                               \
+    quant_vec_kernel<T, HIDDEN_SIZE, THREADS_PER_ROW, kFuseSum><<<grid, block, 0, stream>>>(                 \
+        input, output, input_sum, scale, num_tokens);                                                        \
+    return true;                                                                                             \
+  }
+
+// Launches the vectorized per-token kernel if hidden_size is specialized and the rows are aligned for
+// 128-bit loads. Returns false (and launches nothing) otherwise, so the caller can fall back to quant_kernel.
+template <typename T, bool kFuseSum>
+bool launch_quant_vec(const T *input, int8_t *output, half *input_sum, half *scale, int num_tokens,
+                      int hidden_size, const cudaStream_t &stream) {
+  if constexpr (std::is_same<T, float>::value) {
+    return false;
+  } else {
+    if (num_tokens == 0 || reinterpret_cast<uintptr_t>(input) % 16 != 0 ||
+        reinterpret_cast<uintptr_t>(output) % 8 != 0)
+      return false;
+    switch (hidden_size) {
+      QUANT_VEC_HIDDEN_SIZES(QUANT_VEC_LAUNCH_CASE)
+    default:
+      return false;
+    }
+  }
+}
 } // namespace vllm
 
 void invoke_dequant_add_residual(
@@ -226,6 +341,12 @@ void invoke_quant(torch::Tensor &out,   // [..., hidden_size]
   dim3 block(std::min(hidden_size, 1024));
   const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
   VLLM_DISPATCH_FLOATING_TYPES(input.scalar_type(), "quant_kernel", [&] {
+    using T = typename FloatTypeConverter<scalar_t>::Type;
+    if (vllm::launch_quant_vec<T, false>(
+            reinterpret_cast<const T *>(input.data_ptr<scalar_t>()), out.data_ptr<int8_t>(), nullptr,
+            reinterpret_cast<half *>(scale.data_ptr<at::Half>()), num_tokens, hidden_size, stream)) {
+      return;
+    }
     vllm::quant_kernel<scalar_t, at::Half *, true><<<grid, block, 0, stream>>>(
         input.data_ptr<scalar_t>(), out.data_ptr<int8_t>(),
         scale.data_ptr<at::Half>(), num_tokens, hidden_size);
@@ -264,6 +385,13 @@ void invoke_quant_fuse_sum(torch::Tensor &out,   // [..., hidden_size]
   dim3 block(std::min(hidden_size, 1024));
   const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
   VLLM_DISPATCH_FLOATING_TYPES(input.scalar_type(), "quant_kernel_fuse_sum", [&] {
+    using T = typename FloatTypeConverter<scalar_t>::Type;
+    if (vllm::launch_quant_vec<T, true>(
+            reinterpret_cast<const T *>(input.data_ptr<scalar_t>()), out.data_ptr<int8_t>(),
+            reinterpret_cast<half *>(input_sum.data_ptr<at::Half>()),
+            reinterpret_cast<half *>(scale.data_ptr<at::Half>()), num_tokens, hidden_size, stream)) {
+      return;
+    }
     vllm::quant_kernel_fuse_sum<scalar_t, at::Half *, true><<<grid, block, 0, stream>>>(
         input.data_ptr<scalar_t>(), out.data_ptr<int8_t>(), input_sum.data_ptr<at::Half>(),
         scale.data_ptr<at::Half>(), num_tokens, hidden_size);
@@ -0,0 +1,109 @@
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Cached host-side launch setup of the kernel launchers. cudaFuncSetAttribute, cudaDeviceGetAttribute and the
+// occupancy calculator are queried once per (device, kernel, block size, dynamic smem) and then answered from a
+// thread-local table, so a repeated launch with the same configuration only does a hash lookup. The cached
+// answers never change for a given key: device attributes and occupancy are fixed per device and kernel, and the
+// dynamic smem limit of a kernel is only ever raised.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#include <cuda_runtime.h>
+
+namespace omniserve
+{
+
+namespace launch_plan
+{
+
+struct Key
+{
+    const void *func;
+    int device;
+    int64_t a;
+    int64_t b;
+
+    bool operator==(const Key &other) const
+    {
+        return func == other.func && device == other.device && a == other.a && b == other.b;
+    }
+};
+
+struct KeyHash
+{
+    std::size_t operator()(const Key &key) const
+    {
+        std::size_t h = std::hash<const void *>()(key.func);
+        h = h * 31 + static_cast<std::size_t>(key.device);
+        h = h * 1000003 + static_cast<std::size_t>(key.a);
+        h = h * 1000003 + static_cast<std::size_t>(key.b);
+        return h;
+    }
+};
+
+inline int current_device()
+{
+    int device = 0;
+    cudaGetDevice(&device);
+    return device;
+}
+
+} // namespace launch_plan
+
+// cudaDeviceGetAttribute of the current device.
+inline int cached_device_attribute(cudaDeviceAttr attr)
+{
+    thread_local std::unordered_map<launch_plan::Key, int, launch_plan::KeyHash> cache;
+    const launch_plan::Key key{nullptr, launch_plan::current_device(), static_cast<int64_t>(attr), 0};
+    auto it = cache.find(key);
+    if (it != cache.end())
+        return it->second;
+    int value = 0;
+    cudaDeviceGetAttribute(&value, attr, key.device);
+    cache.emplace(key, value);
+    return value;
+}
+
+// Raises the max dynamic shared memory of `func` to at least `smem_bytes`; a no-op once a limit at least as large
+// was set on this device.
+template <typename Kernel>
+inline cudaError_t cached_set_max_dynamic_smem(Kernel *func, std::size_t smem_bytes)
+{
+    thread_local std::unordered_map<launch_plan::Key, std::size_t, launch_plan::KeyHash> cache;
+    const launch_plan::Key key{reinterpret_cast<const void *>(func), launch_plan::current_device(), 0, 0};
+    auto it = cache.find(key);
+    if (it != cache.end() && it->second >= smem_bytes)
+        return cudaSuccess;
+    cudaError_t res
+        = cudaFuncSetAttribute(key.func, cudaFuncAttributeMaxDynamicSharedMemorySize, static_cast<int>(smem_bytes));
+    if (res == cudaSuccess)
+        cache[key] = smem_bytes;
+    return res;
+}
+
+// cudaOccupancyMaxActiveBlocksPerMultiprocessor of `func` on the current device.
+template <typename Kernel>
+inline int cached_max_active_blocks_per_sm(Kernel *func, int block_size, std::size_t smem_bytes)
+{
+    thread_local std::unordered_map<launch_plan::Key, int, launch_plan::KeyHash> cache;
+    const launch_plan::Key key{reinterpret_cast<const void *>(func), launch_plan::current_device(), block_size,
+        static_cast<int64_t>(smem_bytes)};
+    auto it = cache.find(key);
+    if (it != cache.end())
+        return it->second;
+    int num_blocks = -1;
+    if (cudaOccupancyMaxActiveBlocksPerMultiprocessor(&num_blocks, key.func, block_size, smem_bytes) != cudaSuccess)
+        return num_blocks;
+    cache.emplace(key, num_blocks);
+    return num_blocks;
+}
+
+} // namespace omniserve
@@ -13,6 +13,7 @@
 // }
 #include <torch/extension.h>
 #include <cuda_fp16.h>
+#include "nvtx_utils.h"
 
 void rms_norm(torch::Tensor &out,    // [num_tokens, hidden_size]
               torch::Tensor &input,  // [num_tokens, hidden_size]
@@ -49,29 +50,53 @@ void invoke_dequant_add_residual_rms_norm_quant(
     torch::Tensor &scale,    // [num_tokens]
     float epsilon);
 
+void add_residual_rms_norm_general(torch::Tensor &out,      // [..., hidden_size]
+              torch::Tensor &input,    // [..., hidden_size]
+              torch::Tensor &residual, // [..., hidden_size]
+              torch::Tensor &weight,   // [hidden_size]
+              torch::Tensor &scaling,  // [tokens]
+              float epsilon);
+
+void add_residual_rms_norm_general_fuse_sum(torch::Tensor &out,      // [..., hidden_size]
+              torch::Tensor &input,     // [..., hidden_size]
+              torch::Tensor &residual,  // [..., hidden_size]
+              torch::Tensor &weight,    // [hidden_size]
+              torch::Tensor &input_sum, // [tokens]
+              torch::Tensor &scaling,   // [tokens]
+              float epsilon);
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-  m.def("rms_norm", &rms_norm, py::arg("out"), py::arg("input"),
+  m.def("rms_norm", omniserve::nvtx_wrap("rms_norm", &rms_norm), py::arg("out"), py::arg("input"),
         py::arg("weight"), py::arg("epsilon"), py::arg("use_quant") = false,
         "Apply Root Mean Square (RMS) Normalization to the input tensor.");
 
-  m.def("rms_norm_general", &rms_norm_general, py::arg("out"), py::arg("input"),
+  m.def("rms_norm_general", omniserve::nvtx_wrap("rms_norm_general", &rms_norm_general), py::arg("out"), py::arg("input"),
         py::arg("weight"), py::arg("scaling"), py::arg("epsilon"), py::arg("use_per_token_quant") = false,
         "Apply Root Mean Square (RMS) Normalization to the input tensor (TRTLLM kernel).");
 
-  m.def("rms_norm_general_fuse_sum", &rms_norm_general_fuse_sum, py::arg("out"), py::arg("input"),
+  m.def("rms_norm_general_fuse_sum", omniserve::nvtx_wrap("rms_norm_general_fuse_sum", &rms_norm_general_fuse_sum), py::arg("out"), py::arg("input"),
         py::arg("weight"), py::arg("input_sum"), py::arg("scaling"), py::arg("epsilon"), py::arg("use_per_token_quant") = false,
         "Apply Root Mean Square (RMS) Normalization to the input tensor & get input sum (TRTLLM kernel).");
 
+  m.def("add_residual_rms_norm_general", omniserve::nvtx_wrap("add_residual_rms_norm_general", &add_residual_rms_norm_general), py::arg("out"), py::arg("input"),
+        py::arg("residual"), py::arg("weight"), py::arg("scaling"), py::arg("epsilon"),
+        "Add the input to the residual in place, then apply per-token quantized RMS Normalization to it.");
+
+  m.def("add_residual_rms_norm_general_fuse_sum", omniserve::nvtx_wrap("add_residual_rms_norm_general_fuse_sum", &add_residual_rms_norm_general_fuse_sum), py::arg("out"),
+        py::arg("input"), py::arg("residual"), py::arg("weight"), py::arg("input_sum"), py::arg("scaling"),
+        py::arg("epsilon"),
+        "Add the input to the residual in place, then apply per-token quantized RMS Normalization to it & get input sum.");
+
   m.def("invoke_dequant_add_residual_rms_norm_quant",
-        py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
+        omniserve::nvtx_wrap("invoke_dequant_add_residual_rms_norm_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
                           torch::Tensor &, at::Half, float>(
-            &invoke_dequant_add_residual_rms_norm_quant),
+            &invoke_dequant_add_residual_rms_norm_quant)),
         "Add the dequanted result and residual, then use RMS norm and quant "
         "output.");
   m.def("invoke_dequant_add_residual_rms_norm_quant",
-        py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
+        omniserve::nvtx_wrap("invoke_dequant_add_residual_rms_norm_quant", py::overload_cast<torch::Tensor &, torch::Tensor &, torch::Tensor &,
                           torch::Tensor &, torch::Tensor &, float>(
-            &invoke_dequant_add_residual_rms_norm_quant),
+            &invoke_dequant_add_residual_rms_norm_quant)),
         "Add the dequanted result and residual, then use RMS norm and quant "
         "output.");
 }
@@ -404,6 +404,241 @@ __global__ void dequant_add_residual_rms_norm_quant_kernel(
         (float)(gamma[i]));
   }
 }
+
+// Vectorized RMSNorm family for the common hidden sizes. Rows are read with 128-bit loads and
+// kept in registers between the reduction and the normalization, so every input (and the
+// residual) is read from global memory once. kThreadsPerRow == 32 runs one warp per row (several
+// rows per CTA), larger values one CTA per row.
+#define RMS_NORM_VEC_ELEMS 8
+#define RMS_NORM_VEC_WARP_ROWS_PER_CTA 4
+
+// X(HIDDEN_SIZE, THREADS_PER_ROW)
+#define RMS_NORM_VEC_HIDDEN_SIZES(X) \
+  X(2048, 32)                        \
+  X(4096, 32)                        \
+  X(5120, 128)                       \
+  X(8192, 256)
+
+enum RmsNormVecMode
+{
+  kRmsNormVecOutFp = 0,       // out = T(x * rsqrt) * w (rms_norm_kernel)
+  kRmsNormVecOutInt8 = 1,     // out = int8(x * rsqrt * w) (rms_norm_kernel / dequant_add_residual_rms_norm_quant_kernel)
+  kRmsNormVecPerTokenQuant = 2 // per-token int8 quant (+ row sum), same math as generalLayerNorm(_fuse_sum)
+};
+
+template <typename T>
+struct RmsNormVecParams
+{
+  const T *input = nullptr;
+  // With kDequantResidual, the row is dequant_input * dequant_scale + residual and is written back to residual.
+  // With kAddResidual, the row is input + residual (e.g. an all-reduced row parallel output) and is written back.
+  const int32_t *dequant_input = nullptr;
+  const half *dequant_scale_per_token = nullptr;
+  float dequant_scale = 1.0f;
+  T *residual = nullptr;
+  const T *gamma = nullptr;
+  void *out = nullptr;
+  half *scale_out = nullptr;
+  half *sum_out = nullptr;
+  float eps = 0.0f;
+  int num_tokens = 0;
+};
+
+template <typename T, int kHiddenSize, int kThreadsPerRow, int kMode, bool kDequantResidual, bool kPerTokenDequant,
+          bool kAddResidual>
+__global__ void rms_norm_vec_kernel(const RmsNormVecParams<T> p)
+{
+  using T2 = typename packed_as<T, 2>::type;
+  constexpr int kVecs = kHiddenSize / RMS_NORM_VEC_ELEMS / kThreadsPerRow;
+  constexpr int kRowsPerCta = kThreadsPerRow == 32 ? RMS_NORM_VEC_WARP_ROWS_PER_CTA : 1;
+  static_assert(kVecs * RMS_NORM_VEC_ELEMS * kThreadsPerRow == kHiddenSize, "Hidden size must split evenly.");
+
+  const int row = blockIdx.x * kRowsPerCta + threadIdx.x / kThreadsPerRow;
+  const int tid = threadIdx.x % kThreadsPerRow;
+  // Warp-per-row CTAs never synchronize across warps, so idle warps can leave.
+  if (row >= p.num_tokens)
+    return;
+  const int64_t row_offset = row * int64_t(kHiddenSize);
+
+  uint4 x[kVecs];
+  float local_sum = 0.0f;
+  float local_var_sum = 0.0f;
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v)
+  {
+    const int col = (v * kThreadsPerRow + tid) * RMS_NORM_VEC_ELEMS;
+    if constexpr (kDequantResidual)
+    {
+      const float scale = kPerTokenDequant ? __half2float(p.dequant_scale_per_token[row]) : p.dequant_scale;
+      const int4 q_lo = *reinterpret_cast<const int4 *>(p.dequant_input + row_offset + col);
+      const int4 q_hi = *reinterpret_cast<const int4 *>(p.dequant_input + row_offset + col + 4);
+      const int q[RMS_NORM_VEC_ELEMS] = {q_lo.x, q_lo.y, q_lo.z, q_lo.w, q_hi.x, q_hi.y, q_hi.z, q_hi.w};
+      x[v] = *reinterpret_cast<const uint4 *>(p.residual + row_offset + col);
+      T2 *x2 = reinterpret_cast<T2 *>(&x[v]);
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        const float2 r = cuda_cast<float2>(x2[j]);
+        const float2 diff = make_float2((float)q[2 * j] * scale + r.x, (float)q[2 * j + 1] * scale + r.y);
+        local_var_sum += diff.x * diff.x + diff.y * diff.y;
+        x2[j] = cuda_cast<T2>(diff);
+      }
+      *reinterpret_cast<uint4 *>(p.residual + row_offset + col) = x[v];
+    }
+    else if constexpr (kAddResidual)
+    {
+      const uint4 in = *reinterpret_cast<const uint4 *>(p.input + row_offset + col);
+      const T2 *in2 = reinterpret_cast<const T2 *>(&in);
+      x[v] = *reinterpret_cast<const uint4 *>(p.residual + row_offset + col);
+      T2 *x2 = reinterpret_cast<T2 *>(&x[v]);
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        x2[j] = cuda_cast<T2>(cuda_cast<float2>(x2[j]) + cuda_cast<float2>(in2[j]));
+        // Statistics of the rounded sum, like the unfused residual add followed by the norm.
+        const float2 f = cuda_cast<float2>(x2[j]);
+        local_sum += f.x + f.y;
+        local_var_sum += f.x * f.x + f.y * f.y;
+      }
+      *reinterpret_cast<uint4 *>(p.residual + row_offset + col) = x[v];
+    }
+    else
+    {
+      x[v] = *reinterpret_cast<const uint4 *>(p.input + row_offset + col);
+      const T2 *x2 = reinterpret_cast<const T2 *>(&x[v]);
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        const float2 f = cuda_cast<float2>(x2[j]);
+        local_sum += f.x + f.y;
+        local_var_sum += f.x * f.x + f.y * f.y;
+      }
+    }
+  }
+
+  const float s_variance = rsqrtf(rowReduceSum<kThreadsPerRow>(local_var_sum) / kHiddenSize + p.eps);
+  float s_mean = 0.0f;
+  if constexpr (kMode == kRmsNormVecPerTokenQuant)
+    s_mean = rowReduceSum<kThreadsPerRow>(local_sum) / kHiddenSize;
+
+  float amax = 1e-6f;
+  float sum = 0.0f;
+#pragma unroll
+  for (int v = 0; v < kVecs; ++v)
+  {
+    const int col = (v * kThreadsPerRow + tid) * RMS_NORM_VEC_ELEMS;
+    const uint4 w = *reinterpret_cast<const uint4 *>(p.gamma + col);
+    const T2 *x2 = reinterpret_cast<const T2 *>(&x[v]);
+    const T2 *w2 = reinterpret_cast<const T2 *>(&w);
+    if constexpr (kMode == kRmsNormVecOutFp)
+    {
+      uint4 o;
+      T2 *o2 = reinterpret_cast<T2 *>(&o);
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+        o2[j] = cuda_cast<T2>(cuda_cast<float2>(x2[j]) * s_variance) * w2[j];
+      *reinterpret_cast<uint4 *>(reinterpret_cast<T *>(p.out) + row_offset + col) = o;
+    }
+    else if constexpr (kMode == kRmsNormVecOutInt8)
+    {
+      int8_t o[RMS_NORM_VEC_ELEMS];
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        const float2 f = cuda_cast<float2>(x2[j]) * s_variance * cuda_cast<float2>(w2[j]);
+        o[2 * j] = float_to_int8_rn(f.x);
+        o[2 * j + 1] = float_to_int8_rn(f.y);
+      }
+      *reinterpret_cast<uint2 *>(reinterpret_cast<int8_t *>(p.out) + row_offset + col) =
+          *reinterpret_cast<uint2 *>(o);
+    }
+    else
+    {
+      // Scale and sum come from the rounded outputs, like generalLayerNorm_fuse_sum.
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        const float2 f = cuda_cast<float2>(
+            cuda_cast<T2>((cuda_cast<float2>(x2[j]) - s_mean) * s_variance * cuda_cast<float2>(w2[j])));
+        amax = fmaxf(amax, fmaxf(fabsf(f.x), fabsf(f.y)));
+        sum += f.x + f.y;
+      }
+    }
+  }
+
+  if constexpr (kMode == kRmsNormVecPerTokenQuant)
+  {
+    const float abs_max = rowReduceMax<kThreadsPerRow>(amax);
+    const float dynamic_per_token_scale = 127.f / abs_max;
+#pragma unroll
+    for (int v = 0; v < kVecs; ++v)
+    {
+      const int col = (v * kThreadsPerRow + tid) * RMS_NORM_VEC_ELEMS;
+      const uint4 w = *reinterpret_cast<const uint4 *>(p.gamma + col);
+      const T2 *x2 = reinterpret_cast<const T2 *>(&x[v]);
+      const T2 *w2 = reinterpret_cast<const T2 *>(&w);
+      int8_t o[RMS_NORM_VEC_ELEMS];
+#pragma unroll
+      for (int j = 0; j < RMS_NORM_VEC_ELEMS / 2; ++j)
+      {
+        const float2 f = (cuda_cast<float2>(x2[j]) - s_mean) * s_variance * cuda_cast<float2>(w2[j]) *
+                         dynamic_per_token_scale;
+        o[2 * j] = float_to_int8_rn(f.x);
+        o[2 * j + 1] = float_to_int8_rn(f.y);
+      }
+      *reinterpret_cast<uint2 *>(reinterpret_cast<int8_t *>(p.out) + row_offset + col) =
+          *reinterpret_cast<uint2 *>(o);
+    }
+    if (p.sum_out != nullptr)
+      sum = rowReduceSum<kThreadsPerRow>(sum);
+    if (tid == 0)
+    {
+      p.scale_out[row] = __float2half_rn(abs_max / 127.f);
+      if (p.sum_out != nullptr)
+        p.sum_out[row] = __float2half_rn(sum);
+    }
+  }
+}
+
+#define RMS_NORM_VEC_LAUNCH_CASE(HIDDEN_SIZE, THREADS_PER_ROW)                                               \
+  case HIDDEN_SIZE:                                                                                          \
+  {                                                                                                          \
+    constexpr int kRowsPerCta = THREADS_PER_ROW == 32 ? RMS_NORM_VEC_WARP_ROWS_PER_CTA : 1;                   \
+    dim3 grid((p.num_tokens + kRowsPerCta - 1) / kRowsPerCta);                                               \
+    dim3 block(THREADS_PER_ROW * kRowsPerCta);                                                               \
+    rms_norm_vec_kernel<T, HIDDEN_SIZE, THREADS_PER_ROW, kMode, kDequantResidual, kPerTokenDequant,          \
+                        kAddResidual><<<grid, block, 0, stream>>>(p);                                        \
+    return true;                                                                                             \
+  }
+
+inline bool rms_norm_vec_aligned(const void *ptr)
+{
+  return ptr == nullptr || reinterpret_cast<uintptr_t>(ptr) % 16 == 0;
+}
+
+// Launches the vectorized kernel if hidden_size is specialized and the rows are 16-byte aligned.
+// Returns false (and launches nothing) otherwise, so the caller can fall back to the generic kernel.
+template <typename T, int kMode, bool kDequantResidual = false, bool kPerTokenDequant = false,
+          bool kAddResidual = false>
+bool launch_rms_norm_vec(const RmsNormVecParams<T> &p, int hidden_size, const cudaStream_t &stream)
+{
+  if constexpr (std::is_same<T, float>::value)
+  {
+    return false;
+  }
+  else
+  {
+    if (p.num_tokens == 0 || !rms_norm_vec_aligned(p.input) || !rms_norm_vec_aligned(p.dequant_input) ||
+        !rms_norm_vec_aligned(p.residual) || !rms_norm_vec_aligned(p.gamma) || !rms_norm_vec_aligned(p.out))
+      return false;
+    switch (hidden_size)
+    {
+      RMS_NORM_VEC_HIDDEN_SIZES(RMS_NORM_VEC_LAUNCH_CASE)
+    default:
+      return false;
+    }
+  }
+}
 } // namespace vllm
 
 void rms_norm(torch::Tensor &out,    // [..., hidden_size]
@@ -417,6 +652,18 @@ void rms_norm(torch::Tensor &out,    // [..., hidden_size]
   dim3 block(std::min(hidden_size, 1024));
   const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
   VLLM_DISPATCH_FLOATING_TYPES(input.scalar_type(), "rms_norm_kernel", [&] {
+    using T = typename FloatTypeConverter<scalar_t>::Type;
+    vllm::RmsNormVecParams<T> p;
+    p.input = reinterpret_cast<const T *>(input.data_ptr<scalar_t>());
+    p.gamma = reinterpret_cast<const T *>(weight.data_ptr<scalar_t>());
+    p.out = out.data_ptr();
+    p.eps = epsilon;
+    p.num_tokens = num_tokens;
+    if (input.is_contiguous() &&
+        (use_quant ? vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecOutInt8>(p, hidden_size, stream)
+                   : vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecOutFp>(p, hidden_size, stream))) {
+      return;
+    }
     if (use_quant) {
       vllm::rms_norm_kernel<scalar_t, int8_t, true><<<grid, block, 0, stream>>>(
         out.data_ptr<int8_t>(), input.data_ptr<scalar_t>(),
@@ -446,6 +693,17 @@ void rms_norm_general(torch::Tensor &out,    // [..., hidden_size]
     using T = typename FloatTypeConverter<scalar_t>::Type;
     if (use_per_token_quant) {
       // per-token
+      vllm::RmsNormVecParams<T> p;
+      p.input = reinterpret_cast<const T *>(input.data_ptr<scalar_t>());
+      p.gamma = reinterpret_cast<const T *>(weight.data_ptr<scalar_t>());
+      p.out = out.data_ptr();
+      p.scale_out = reinterpret_cast<half *>(scaling.data_ptr<at::Half>());
+      p.eps = epsilon;
+      p.num_tokens = num_tokens;
+      if (input.is_contiguous() &&
+          vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecPerTokenQuant>(p, hidden_size, stream)) {
+        return;
+      }
       vllm::generalLayerNorm<T, at::Half><<<grid, block, 0, stream>>>(
         reinterpret_cast<T*>(input.data_ptr<scalar_t>()), 
         reinterpret_cast<T*>(weight.data_ptr<scalar_t>()), nullptr,
@@ -486,6 +744,18 @@ void rms_norm_general_fuse_sum(torch::Tensor &out,    // [..., hidden_size]
     using T = typename FloatTypeConverter<scalar_t>::Type;
     if (use_per_token_quant) {
       // per-token
+      vllm::RmsNormVecParams<T> p;
+      p.input = reinterpret_cast<const T *>(input.data_ptr<scalar_t>());
+      p.gamma = reinterpret_cast<const T *>(weight.data_ptr<scalar_t>());
+      p.out = out.data_ptr();
+      p.scale_out = reinterpret_cast<half *>(scaling.data_ptr<at::Half>());
+      p.sum_out = reinterpret_cast<half *>(input_sum.data_ptr<at::Half>());
+      p.eps = epsilon;
+      p.num_tokens = num_tokens;
+      if (input.is_contiguous() &&
+          vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecPerTokenQuant>(p, hidden_size, stream)) {
+        return;
+      }
       vllm::generalLayerNorm_fuse_sum<T, at::Half><<<grid, block, 0, stream>>>(
         reinterpret_cast<T*>(input.data_ptr<scalar_t>()), 
         reinterpret_cast<T*>(weight.data_ptr<scalar_t>()), nullptr,
@@ -529,6 +799,19 @@ void invoke_dequant_add_residual_rms_norm_quant(
   VLLM_DISPATCH_FLOATING_TYPES(
       residual.scalar_type(), "dequant_add_residual_rms_norm_quant_kernel",
       [&] {
+          using T = typename FloatTypeConverter<scalar_t>::Type;
+          vllm::RmsNormVecParams<T> p;
+          p.dequant_input = input.data_ptr<int32_t>();
+          p.dequant_scale = static_cast<float>(scale);
+          p.residual = reinterpret_cast<T *>(residual.data_ptr<scalar_t>());
+          p.gamma = reinterpret_cast<const T *>(gamma.data_ptr<scalar_t>());
+          p.out = out.data_ptr();
+          p.eps = epsilon;
+          p.num_tokens = num_tokens;
+          if (input.is_contiguous() && residual.is_contiguous() &&
+              vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecOutInt8, true, false>(p, hidden_size, stream)) {
+            return;
+          }
           vllm::dequant_add_residual_rms_norm_quant_kernel<scalar_t, at::Half, false>
             <<<grid, block, 0, stream>>>(
                 input.data_ptr<int32_t>(), residual.data_ptr<scalar_t>(),
@@ -554,6 +837,19 @@ void invoke_dequant_add_residual_rms_norm_quant(
   VLLM_DISPATCH_FLOATING_TYPES(
       residual.scalar_type(), "dequant_add_residual_rms_norm_quant_kernel",
       [&] {
+          using T = typename FloatTypeConverter<scalar_t>::Type;
+          vllm::RmsNormVecParams<T> p;
+          p.dequant_input = input.data_ptr<int32_t>();
+          p.dequant_scale_per_token = reinterpret_cast<const half *>(scale.data_ptr<at::Half>());
+          p.residual = reinterpret_cast<T *>(residual.data_ptr<scalar_t>());
+          p.gamma = reinterpret_cast<const T *>(gamma.data_ptr<scalar_t>());
+          p.out = out.data_ptr();
+          p.eps = epsilon;
+          p.num_tokens = num_tokens;
+          if (input.is_contiguous() && residual.is_contiguous() &&
+              vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecOutInt8, true, true>(p, hidden_size, stream)) {
+            return;
+          }
           vllm::dequant_add_residual_rms_norm_quant_kernel<scalar_t, at::Half*, true>
             <<<grid, block, 0, stream>>>(
                 input.data_ptr<int32_t>(), residual.data_ptr<scalar_t>(),
@@ -561,3 +857,65 @@ void invoke_dequant_add_residual_rms_norm_quant(
                 scale.data_ptr<at::Half>(), num_tokens, hidden_size);
       });
 }
+
+// residual += input, then the per-token quantized RMSNorm of the new residual. Used after the all-reduce of a
+// row parallel projection, so the reduced output is read once and the residual stream is updated in the same pass.
+void add_residual_rms_norm_general(torch::Tensor &out,      // [..., hidden_size]
+              torch::Tensor &input,    // [..., hidden_size]
+              torch::Tensor &residual, // [..., hidden_size]
+              torch::Tensor &weight,   // [hidden_size]
+              torch::Tensor &scaling,  // [tokens]
+              float epsilon) {
+  int hidden_size = input.size(-1);
+  int num_tokens = input.numel() / hidden_size;
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  bool launched = false;
+  VLLM_DISPATCH_FLOATING_TYPES(input.scalar_type(), "add_residual_rms_norm_general", [&] {
+    using T = typename FloatTypeConverter<scalar_t>::Type;
+    vllm::RmsNormVecParams<T> p;
+    p.input = reinterpret_cast<const T *>(input.data_ptr<scalar_t>());
+    p.residual = reinterpret_cast<T *>(residual.data_ptr<scalar_t>());
+    p.gamma = reinterpret_cast<const T *>(weight.data_ptr<scalar_t>());
+    p.out = out.data_ptr();
+    p.scale_out = reinterpret_cast<half *>(scaling.data_ptr<at::Half>());
+    p.eps = epsilon;
+    p.num_tokens = num_tokens;
+    launched = input.is_contiguous() && residual.is_contiguous() &&
+               vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecPerTokenQuant, false, false, true>(p, hidden_size, stream);
+  });
+  if (!launched) {
+    residual.add_(input);
+    rms_norm_general(out, residual, weight, scaling, epsilon, true);
+  }
+}
+
+void add_residual_rms_norm_general_fuse_sum(torch::Tensor &out,      // [..., hidden_size]
+              torch::Tensor &input,     // [..., hidden_size]
+              torch::Tensor &residual,  // [..., hidden_size]
+              torch::Tensor &weight,    // [hidden_size]
+              torch::Tensor &input_sum, // [tokens]
+              torch::Tensor &scaling,   // [tokens]
+              float epsilon) {
+  int hidden_size = input.size(-1);
+  int num_tokens = input.numel() / hidden_size;
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  bool launched = false;
+  VLLM_DISPATCH_FLOATING_TYPES(input.scalar_type(), "add_residual_rms_norm_general_fuse_sum", [&] {
+    using T = typename FloatTypeConverter<scalar_t>::Type;
+    vllm::RmsNormVecParams<T> p;
+    p.input = reinterpret_cast<const T *>(input.data_ptr<scalar_t>());
+    p.residual = reinterpret_cast<T *>(residual.data_ptr<scalar_t>());
+    p.gamma = reinterpret_cast<const T *>(weight.data_ptr<scalar_t>());
+    p.out = out.data_ptr();
+    p.scale_out = reinterpret_cast<half *>(scaling.data_ptr<at::Half>());
+    p.sum_out = reinterpret_cast<half *>(input_sum.data_ptr<at::Half>());
+    p.eps = epsilon;
+    p.num_tokens = num_tokens;
+    launched = input.is_contiguous() && residual.is_contiguous() &&
+               vllm::launch_rms_norm_vec<T, vllm::kRmsNormVecPerTokenQuant, false, false, true>(p, hidden_size, stream);
+  });
+  if (!launched) {
+    residual.add_(input);
+    rms_norm_general_fuse_sum(out, residual, weight, input_sum, scaling, epsilon, true);
+  }
+}
@@ -0,0 +1,289 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda_fp16.h>
+#include <float.h>
+#include <torch/extension.h>
+
+#include "../dispatch_utils.h"
+#include "moe_kernels.h"
+
+#define WARP_SIZE 32
+#define MOE_MAX_EXPERTS 256
+#define MOE_GATING_WARPS_PER_BLOCK 4
+
+// One warp per token; lane l holds the experts l, l + 32, ...
+template <typename scalar_t>
+__global__ void moe_topk_gating_softmax_kernel(const scalar_t *__restrict__ gating_output,
+                                               float *__restrict__ routing_weights, int *__restrict__ expert_indices,
+                                               const int num_tokens, const int num_experts, const int top_k,
+                                               const bool renormalize)
+{
+  constexpr int kExpertsPerLane = MOE_MAX_EXPERTS / WARP_SIZE;
+  const int token_idx = blockIdx.x * blockDim.y + threadIdx.y;
+  if (token_idx >= num_tokens)
+    return;
+  const int lane = threadIdx.x;
+  const scalar_t *logits = gating_output + token_idx * int64_t(num_experts);
+
+  float probs[kExpertsPerLane];
+  float max_logit = -FLT_MAX;
+#pragma unroll
+  for (int i = 0; i < kExpertsPerLane; ++i)
+  {
+    const int expert = i * WARP_SIZE + lane;
+    probs[i] = expert < num_experts ? (float)logits[expert] : -FLT_MAX;
+    max_logit = fmaxf(max_logit, probs[i]);
+  }
+#pragma unroll
+  for (int mask = WARP_SIZE / 2; mask > 0; mask >>= 1)
+    max_logit = fmaxf(max_logit, __shfl_xor_sync(0xffffffff, max_logit, mask));
+
+  float sum = 0.0f;
+#pragma unroll
+  for (int i = 0; i < kExpertsPerLane; ++i)
+  {
+    probs[i] = i * WARP_SIZE + lane < num_experts ? expf(probs[i] - max_logit) : 0.0f;
+    sum += probs[i];
+  }
+#pragma unroll
+  for (int mask = WARP_SIZE / 2; mask > 0; mask >>= 1)
+    sum += __shfl_xor_sync(0xffffffff, sum, mask);
+  const float inv_sum = 1.0f / sum;
+#pragma unroll
+  for (int i = 0; i < kExpertsPerLane; ++i)
+    probs[i] *= inv_sum;
+
+  // top_k rounds of a warp argmax; ties go to the lower expert index like torch.topk.
+  float selected_sum = 0.0f;
+  for (int k = 0; k < top_k; ++k)
+  {
+    float best_prob = -1.0f;
+    int best_expert = num_experts;
+#pragma unroll
+    for (int i = 0; i < kExpertsPerLane; ++i)
+    {
+      if (i * WARP_SIZE + lane < num_experts && probs[i] > best_prob)
+      {
+        best_prob = probs[i];
+        best_expert = i * WARP_SIZE + lane;
+      }
+    }
+#pragma unroll
+    for (int mask = WARP_SIZE / 2; mask > 0; mask >>= 1)
+    {
+      const float other_prob = __shfl_xor_sync(0xffffffff, best_prob, mask);
+      const int other_expert = __shfl_xor_sync(0xffffffff, best_expert, mask);
+      if (other_prob > best_prob || (other_prob == best_prob && other_expert < best_expert))
+      {
+        best_prob = other_prob;
+        best_expert = other_expert;
+      }
+    }
+#pragma unroll
+    for (int i = 0; i < kExpertsPerLane; ++i)
+    {
+      if (i * WARP_SIZE + lane == best_expert)
+        probs[i] = -1.0f;
+    }
+    selected_sum += best_prob;
+    if (lane == 0)
+    {
+      routing_weights[token_idx * top_k + k] = best_prob;
+      expert_indices[token_idx * top_k + k] = best_expert;
+    }
+  }
+  if (renormalize && lane == 0)
+  {
+    const float inv_selected_sum = 1.0f / selected_sum;
+    for (int k = 0; k < top_k; ++k)
+      routing_weights[token_idx * top_k + k] *= inv_selected_sum;
+  }
+}
+
+// Counting sort of the routed rows by expert in a single CTA (num_experts is small). The order of
+// the rows within an expert is not deterministic, which does not change any GEMM row.
+__global__ void moe_sort_by_expert_kernel(const int *__restrict__ expert_indices, int *__restrict__ expert_offsets,
+                                          int *__restrict__ permuted_loc_to_unpermuted_loc,
+                                          int *__restrict__ unpermuted_loc_to_permuted_loc, const int num_rows,
+                                          const int num_experts)
+{
+  extern __shared__ int moe_sort_smem[];
+  int *counts = moe_sort_smem;
+  int *cursors = moe_sort_smem + num_experts;
+  for (int e = threadIdx.x; e < num_experts; e += blockDim.x)
+    counts[e] = 0;
+  __syncthreads();
+  for (int i = threadIdx.x; i < num_rows; i += blockDim.x)
+    atomicAdd(counts + expert_indices[i], 1);
+  __syncthreads();
+  if (threadIdx.x == 0)
+  {
+    int offset = 0;
+    for (int e = 0; e < num_experts; ++e)
+    {
+      expert_offsets[e] = offset;
+      cursors[e] = offset;
+      offset += counts[e];
+    }
+    expert_offsets[num_experts] = offset;
+  }
+  __syncthreads();
+  for (int i = threadIdx.x; i < num_rows; i += blockDim.x)
+  {
+    const int permuted_loc = atomicAdd(cursors + expert_indices[i], 1);
+    permuted_loc_to_unpermuted_loc[permuted_loc] = i;
+    unpermuted_loc_to_permuted_loc[i] = permuted_loc;
+  }
+}
+
+__global__ void moe_expand_inputs_and_scales_kernel(const int8_t *__restrict__ in_feats,
+                                                    const half *__restrict__ input_sum,
+                                                    const half *__restrict__ input_scales,
+                                                    const int *__restrict__ permuted_loc_to_unpermuted_loc,
+                                                    int8_t *__restrict__ out_feats, half *__restrict__ out_sum,
+                                                    half *__restrict__ out_scales, const int hidden_size,
+                                                    const int top_k)
+{
+  const int permuted_loc = blockIdx.x;
+  const int token_idx = permuted_loc_to_unpermuted_loc[permuted_loc] / top_k;
+  if (threadIdx.x == 0)
+  {
+    out_sum[permuted_loc] = input_sum[token_idx];
+    out_scales[permuted_loc] = input_scales[token_idx];
+  }
+  const uint4 *src = reinterpret_cast<const uint4 *>(in_feats + token_idx * int64_t(hidden_size));
+  uint4 *dst = reinterpret_cast<uint4 *>(out_feats + permuted_loc * int64_t(hidden_size));
+  for (int i = threadIdx.x; i < hidden_size / 16; i += blockDim.x)
+    dst[i] = src[i];
+}
+
+// residual may alias out.
+__global__ void moe_finalize_routing_kernel(const half2 *__restrict__ expert_out,
+                                            const float *__restrict__ routing_weights,
+                                            const int *__restrict__ unpermuted_loc_to_permuted_loc,
+                                            const half2 *residual, half2 *out, const int hidden_size,
+                                            const int top_k)
+{
+  const int token_idx = blockIdx.x;
+  const int hidden_size_2 = hidden_size / 2;
+  for (int i = threadIdx.x; i < hidden_size_2; i += blockDim.x)
+  {
+    float2 acc = residual != nullptr ? __half22float2(residual[token_idx * int64_t(hidden_size_2) + i])
+                                     : make_float2(0.0f, 0.0f);
+    for (int k = 0; k < top_k; ++k)
+    {
+      const float weight = routing_weights[token_idx * top_k + k];
+      const int permuted_loc = unpermuted_loc_to_permuted_loc[token_idx * top_k + k];
+      const float2 val = __half22float2(expert_out[permuted_loc * int64_t(hidden_size_2) + i]);
+      acc.x += weight * val.x;
+      acc.y += weight * val.y;
+    }
+    out[token_idx * int64_t(hidden_size_2) + i] = __float22half2_rn(acc);
+  }
+}
+
+std::vector<torch::Tensor> moe_topk_gating_softmax(torch::Tensor gating_output, int top_k, bool renormalize)
+{
+  const int num_tokens = gating_output.size(0);
+  const int num_experts = gating_output.size(1);
+  TORCH_CHECK(gating_output.is_contiguous(), "gating_output must be contiguous");
+  TORCH_CHECK(num_experts <= MOE_MAX_EXPERTS, "At most ", MOE_MAX_EXPERTS, " experts are supported");
+  TORCH_CHECK(top_k > 0 && top_k <= num_experts, "Invalid top_k ", top_k);
+  auto routing_weights =
+      torch::empty({num_tokens, top_k}, gating_output.options().dtype(torch::kFloat32));
+  auto expert_indices = torch::empty({num_tokens, top_k}, gating_output.options().dtype(torch::kInt32));
+  if (num_tokens == 0)
+    return {routing_weights, expert_indices};
+
+  dim3 grid((num_tokens + MOE_GATING_WARPS_PER_BLOCK - 1) / MOE_GATING_WARPS_PER_BLOCK);
+  dim3 block(WARP_SIZE, MOE_GATING_WARPS_PER_BLOCK);
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  VLLM_DISPATCH_FLOATING_TYPES(gating_output.scalar_type(), "moe_topk_gating_softmax_kernel", [&] {
+    moe_topk_gating_softmax_kernel<scalar_t><<<grid, block, 0, stream>>>(
+        gating_output.data_ptr<scalar_t>(), routing_weights.data_ptr<float>(), expert_indices.data_ptr<int>(),
+        num_tokens, num_experts, top_k, renormalize);
+  });
+  return {routing_weights, expert_indices};
+}
+
+std::vector<torch::Tensor> moe_expand_inputs_and_scales(torch::Tensor in_feats, torch::Tensor input_sum,
+                                                        torch::Tensor input_scales, torch::Tensor expert_indices,
+                                                        int num_experts)
+{
+  const int num_tokens = in_feats.size(0);
+  const int hidden_size = in_feats.size(1);
+  const int top_k = expert_indices.size(-1);
+  const int num_rows = num_tokens * top_k;
+  TORCH_CHECK(expert_indices.scalar_type() == torch::kInt32 && expert_indices.numel() == num_rows,
+              "expert_indices must be [num_tokens, top_k] int32");
+  TORCH_CHECK(hidden_size % 16 == 0, "hidden_size must be a multiple of 16");
+  auto int_options = expert_indices.options();
+  auto out_feats = torch::empty({num_rows, hidden_size}, in_feats.options());
+  auto out_sum = torch::empty({num_rows}, input_sum.options());
+  auto out_scales = torch::empty({num_rows}, input_scales.options());
+  auto expert_offsets = torch::empty({num_experts + 1}, int_options);
+  auto permuted_loc_to_unpermuted_loc = torch::empty({num_rows}, int_options);
+  auto unpermuted_loc_to_permuted_loc = torch::empty({num_rows}, int_options);
+
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  moe_sort_by_expert_kernel<<<1, 1024, 2 * num_experts * sizeof(int), stream>>>(
+      expert_indices.data_ptr<int>(), expert_offsets.data_ptr<int>(), permuted_loc_to_unpermuted_loc.data_ptr<int>(),
+      unpermuted_loc_to_permuted_loc.data_ptr<int>(), num_rows, num_experts);
+  if (num_rows > 0)
+  {
+    dim3 grid(num_rows);
+    dim3 block(std::min(std::max(hidden_size / 16, WARP_SIZE), 1024));
+    moe_expand_inputs_and_scales_kernel<<<grid, block, 0, stream>>>(
+        in_feats.data_ptr<int8_t>(), reinterpret_cast<half *>(input_sum.data_ptr<at::Half>()),
+        reinterpret_cast<half *>(input_scales.data_ptr<at::Half>()), permuted_loc_to_unpermuted_loc.data_ptr<int>(),
+        out_feats.data_ptr<int8_t>(), reinterpret_cast<half *>(out_sum.data_ptr<at::Half>()),
+        reinterpret_cast<half *>(out_scales.data_ptr<at::Half>()), hidden_size, top_k);
+  }
+  return {out_feats, out_sum, out_scales, expert_offsets, unpermuted_loc_to_permuted_loc};
+}
+
+torch::Tensor moe_finalize_routing(torch::Tensor expert_out, torch::Tensor routing_weights,
+                                   torch::Tensor unpermuted_loc_to_permuted_loc,
+                                   c10::optional<torch::Tensor> residual)
+{
+  const int num_tokens = routing_weights.size(0);
+  const int top_k = routing_weights.size(1);
+  const int hidden_size = expert_out.size(-1);
+  TORCH_CHECK(routing_weights.scalar_type() == torch::kFloat32, "routing_weights must be fp32");
+  TORCH_CHECK(hidden_size % 2 == 0, "hidden_size must be even");
+  torch::Tensor out;
+  if (residual.has_value())
+  {
+    TORCH_CHECK(residual->is_contiguous() && residual->size(0) == num_tokens && residual->size(-1) == hidden_size,
+                "residual must be contiguous [num_tokens, hidden_size]");
+    out = *residual;
+  }
+  else
+  {
+    out = torch::empty({num_tokens, hidden_size}, expert_out.options());
+  }
+  if (num_tokens == 0)
+    return out;
+
+  dim3 grid(num_tokens);
+  dim3 block(std::min(hidden_size / 2, 1024));
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  moe_finalize_routing_kernel<<<grid, block, 0, stream>>>(
+      reinterpret_cast<half2 *>(expert_out.data_ptr<at::Half>()), routing_weights.data_ptr<float>(),
+      unpermuted_loc_to_permuted_loc.data_ptr<int>(),
+      residual.has_value() ? reinterpret_cast<half2 *>(out.data_ptr<at::Half>()) : nullptr,
+      reinterpret_cast<half2 *>(out.data_ptr<at::Half>()), hidden_size, top_k);
+  return out;
+}
@@ -0,0 +1,41 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Routing kernels around the grouped W4A8 GEMM (qgemm_w4a8_per_chn.grouped_gemm_forward_cuda).
+// A token routed to its j-th expert occupies the "unpermuted" row t * top_k + j; the expert GEMMs
+// run on "permuted" rows sorted by expert.
+#pragma once
+
+#include <torch/extension.h>
+
+// Softmax over the experts, then the top_k experts of every token. The routing weights are
+// renormalized over the selected experts (Mixtral).
+// Returns routing_weights [num_tokens, top_k] (fp32) and expert_indices [num_tokens, top_k] (int32).
+std::vector<torch::Tensor> moe_topk_gating_softmax(torch::Tensor gating_output, // [num_tokens, num_experts]
+                                                   int top_k, bool renormalize);
+
+// Sorts the unpermuted rows by expert and gathers the int8 activations with their per-token scales.
+// Returns the permuted in_feats [num_tokens * top_k, hidden], input_sum, input_scales,
+// expert_offsets [num_experts + 1] and unpermuted_loc_to_permuted_loc [num_tokens * top_k].
+std::vector<torch::Tensor> moe_expand_inputs_and_scales(torch::Tensor in_feats,       // [num_tokens, hidden] int8
+                                                        torch::Tensor input_sum,      // [num_tokens]
+                                                        torch::Tensor input_scales,   // [num_tokens]
+                                                        torch::Tensor expert_indices, // [num_tokens, top_k]
+                                                        int num_experts);
+
+// out[t] = (residual[t] +) sum_j routing_weights[t, j] * expert_out[unpermuted_loc_to_permuted_loc[t * top_k + j]].
+// With a residual, the result is written into it in place and returned.
+torch::Tensor moe_finalize_routing(torch::Tensor expert_out,                     // [num_tokens * top_k, hidden]
+                                   torch::Tensor routing_weights,                // [num_tokens, top_k]
+                                   torch::Tensor unpermuted_loc_to_permuted_loc, // [num_tokens * top_k]
+                                   c10::optional<torch::Tensor> residual);       // [num_tokens, hidden]
@@ -0,0 +1,30 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <pybind11/pybind11.h>
+#include <torch/extension.h>
+#include "moe_kernels.h"
+#include "../nvtx_utils.h"
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    m.def("moe_topk_gating_softmax", omniserve::nvtx_wrap("moe_topk_gating_softmax", &moe_topk_gating_softmax), "fused router softmax and top-k",
+          py::arg("gating_output"), py::arg("top_k"), py::arg("renormalize") = true);
+    m.def("moe_expand_inputs_and_scales", omniserve::nvtx_wrap("moe_expand_inputs_and_scales", &moe_expand_inputs_and_scales),
+          "sort the routed rows by expert and gather the quantized inputs",
+          py::arg("in_feats"), py::arg("input_sum"), py::arg("input_scales"), py::arg("expert_indices"),
+          py::arg("num_experts"));
+    m.def("moe_finalize_routing", omniserve::nvtx_wrap("moe_finalize_routing", &moe_finalize_routing), "weighted un-permute of the expert outputs",
+          py::arg("expert_out"), py::arg("routing_weights"), py::arg("unpermuted_loc_to_permuted_loc"),
+          py::arg("residual") = py::none());
+}
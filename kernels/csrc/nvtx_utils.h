@@ -0,0 +1,66 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// NVTX ranges around the python entry points of the extensions: m.def(name, nvtx_wrap(name, &fn), ...) names the
+// range after the binding. Opt-in with OMNISERVE_NVTX=1 (read once per extension), otherwise a range costs one
+// branch. nvtx3 is header-only, no extra library to link.
+#pragma once
+
+#include <cstdlib>
+#include <utility>
+
+#include <nvtx3/nvToolsExt.h>
+
+namespace omniserve
+{
+
+inline bool nvtx_enabled()
+{
+    static const bool enabled = []()
+    {
+        const char *env = std::getenv("OMNISERVE_NVTX");
+        return env != nullptr && env[0] != '\0' && env[0] != '0';
+    }();
+    return enabled;
+}
+
+struct NvtxRange
+{
+    const bool active;
+
+    explicit NvtxRange(const char *name) : active(nvtx_enabled())
+    {
+        if (active)
+            nvtxRangePushA(name);
+    }
+
+    ~NvtxRange()
+    {
+        if (active)
+            nvtxRangePop();
+    }
+};
+
+// Same signature as fn, so the pybind11 argument casters, py::arg names and defaults are unchanged.
+// Overloaded functions go through py::overload_cast first.
+template <typename R, typename... Args>
+auto nvtx_wrap(const char *name, R (*fn)(Args...))
+{
+    return [name, fn](Args... args) -> R
+    {
+        NvtxRange range(name);
+        return fn(std::forward<Args>(args)...);
+    };
+}
+
+} // namespace omniserve
@@ -0,0 +1,354 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Device side of the fused GEMM epilogues declared in gemm_epilogue.h.
+#pragma once
+
+#include <cuda_fp16.h>
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../utils.cuh"
+#include "gemm_epilogue.h"
+
+__device__ __forceinline__ half2 gemm_epilogue_silu_and_mul(half2 gate, half2 up)
+{
+  // Same rounding as silu_and_mul_kernel: silu in fp32, rounded to fp16, multiplied in fp16.
+  float2 g = __half22float2(gate);
+  half2 act = __floats2half2_rn(g.x / (1.0f + expf(-g.x)), g.y / (1.0f + expf(-g.y)));
+  return __hmul2(act, up);
+}
+
+__device__ __forceinline__ void gemm_epilogue_row_stats_update(float &amax, float &sum, half2 v)
+{
+  float2 f = __half22float2(v);
+  amax = fmaxf(amax, fmaxf(fabsf(f.x), fabsf(f.y)));
+  sum += f.x + f.y;
+}
+
+// Reduce over the lanes selected by lane_mask (xor butterfly).
+__device__ __forceinline__ void gemm_epilogue_row_stats_reduce(float &amax, float &sum, int lane_mask_begin,
+                                                               int lane_mask_end)
+{
+#pragma unroll
+  for (int mask = lane_mask_begin; mask < lane_mask_end; mask <<= 1)
+  {
+    amax = fmaxf(amax, __shfl_xor_sync(0xffffffff, amax, mask));
+    sum += __shfl_xor_sync(0xffffffff, sum, mask);
+  }
+}
+
+__device__ __forceinline__ void gemm_epilogue_row_stats_commit(float *row_stats, int row, float amax, float sum)
+{
+  // amax >= 0, so its bit pattern orders like the float value.
+  atomicMax(reinterpret_cast<int *>(row_stats + row * 2), __float_as_int(amax));
+  atomicAdd(row_stats + row * 2 + 1, sum);
+}
+
+// Second half of GEMM_EPILOGUE_SILU_AND_MUL: the dequantized CTA tile (CTA_M x CTA_N fp16, row-major)
+// has been staged in shared memory; one warp per row combines the gate and up blocks.
+template <int CTA_M, int CTA_N, int NUM_WARPS>
+__device__ __inline__ void gemm_epilogue_silu_and_mul_tile(const half *C_tile, half *C, float *row_stats,
+                                                           int cta_offset_m, int cta_offset_n, int M,
+                                                           int64_t N_out)
+{
+  static_assert(CTA_N % (2 * GEMM_EPILOGUE_GLU_BLOCK) == 0, "CTA_N must hold whole gate / up blocks.");
+  constexpr int kPairsPerRow = CTA_N / 4;
+  for (int r = threadIdx.y; r < CTA_M; r += NUM_WARPS)
+  {
+    int row = cta_offset_m + r;
+    if (row >= M)
+      break;
+    float amax = 0.0f, sum = 0.0f;
+    for (int p = threadIdx.x; p < kPairsPerRow; p += 32)
+    {
+      int col = p * 2;
+      int tile_col = col / GEMM_EPILOGUE_GLU_BLOCK * 2 * GEMM_EPILOGUE_GLU_BLOCK + col % GEMM_EPILOGUE_GLU_BLOCK;
+      half2 gate = *reinterpret_cast<const half2 *>(C_tile + r * CTA_N + tile_col);
+      half2 up = *reinterpret_cast<const half2 *>(C_tile + r * CTA_N + tile_col + GEMM_EPILOGUE_GLU_BLOCK);
+      half2 out = gemm_epilogue_silu_and_mul(gate, up);
+      *reinterpret_cast<half2 *>(C + row * N_out + cta_offset_n / 2 + col) = out;
+      gemm_epilogue_row_stats_update(amax, sum, out);
+    }
+    if (row_stats != nullptr)
+    {
+      gemm_epilogue_row_stats_reduce(amax, sum, 1, 32);
+      if (threadIdx.x == 0)
+        gemm_epilogue_row_stats_commit(row_stats, row, amax, sum);
+    }
+  }
+}
+
+// Outputs of GEMM_EPILOGUE_ROW_TOPK, passed by value to the GEMM kernels.
+struct GemmEpilogueTopK
+{
+  float *vals;                  // M x num_tiles x k, num_tiles = N / CTA_N
+  int *idxes;                   // M x num_tiles x k, output columns
+  const int *full_logit_rows;   // M, rows whose logits are also written to C. nullptr: all rows.
+  int k;
+};
+
+// Second half of GEMM_EPILOGUE_ROW_TOPK on the staged CTA tile (CTA_M x CTA_N fp16, row-major): one warp per row
+// extracts the k largest values by k warp-wide argmax rounds (lowest column first on ties).
+template <int CTA_M, int CTA_N, int NUM_WARPS>
+__device__ __inline__ void gemm_epilogue_row_topk_tile(const half *C_tile, half *C, const GemmEpilogueTopK &topk,
+                                                       int cta_offset_m, int cta_offset_n, int M, int64_t N)
+{
+  static_assert(CTA_N % 32 == 0 && CTA_N / 32 <= 32, "One taken bit per column of a lane.");
+  constexpr int kColsPerLane = CTA_N / 32;
+  const int num_tiles = N / CTA_N;
+  const int tile = cta_offset_n / CTA_N;
+  for (int r = threadIdx.y; r < CTA_M; r += NUM_WARPS)
+  {
+    int row = cta_offset_m + r;
+    if (row >= M)
+      break;
+    const bool write_row = topk.full_logit_rows == nullptr || topk.full_logit_rows[row] != 0;
+    float vals[kColsPerLane];
+#pragma unroll
+    for (int i = 0; i < kColsPerLane; i++)
+    {
+      half v = C_tile[r * CTA_N + i * 32 + threadIdx.x];
+      vals[i] = __half2float(v);
+      if (write_row)
+        C[row * N + cta_offset_n + i * 32 + threadIdx.x] = v;
+    }
+    const int64_t out_offset = (int64_t(row) * num_tiles + tile) * topk.k;
+    uint32_t taken = 0;
+    for (int j = 0; j < topk.k; j++)
+    {
+      float best = -INFINITY;
+      int best_col = CTA_N;
+#pragma unroll
+      for (int i = 0; i < kColsPerLane; i++)
+      {
+        if (!((taken >> i) & 1) && (best_col == CTA_N || vals[i] > best))
+        {
+          best = vals[i];
+          best_col = i * 32 + threadIdx.x;
+        }
+      }
+#pragma unroll
+      for (int mask = 16; mask > 0; mask >>= 1)
+      {
+        float other = __shfl_xor_sync(0xffffffff, best, mask);
+        int other_col = __shfl_xor_sync(0xffffffff, best_col, mask);
+        if (other_col != CTA_N && (best_col == CTA_N || other > best || (other == best && other_col < best_col)))
+        {
+          best = other;
+          best_col = other_col;
+        }
+      }
+      if (best_col % 32 == threadIdx.x)
+        taken |= 1u << (best_col / 32);
+      if (threadIdx.x == 0)
+      {
+        topk.vals[out_offset + j] = best;
+        topk.idxes[out_offset + j] = cta_offset_n + best_col;
+      }
+    }
+  }
+}
+
+// Merges the num_candidates (value, index) pairs of every row into its k largest, in descending order. One CTA per
+// row: every thread keeps a sorted local top-k, then k block-wide argmax rounds pop the heads.
+template <int NUM_THREADS>
+__global__ void merge_row_topk_kernel(const float *__restrict__ vals, const int *__restrict__ idxes,
+                                      float *__restrict__ out_vals, int *__restrict__ out_idxes,
+                                      int num_candidates, int k)
+{
+  constexpr int NUM_WARPS = NUM_THREADS / 32;
+  __shared__ float s_vals[NUM_WARPS];
+  __shared__ int s_idxes[NUM_WARPS];
+  const int row = blockIdx.x;
+  const int lane = threadIdx.x % 32, warp = threadIdx.x / 32;
+
+  float local_vals[GEMM_EPILOGUE_TOPK_MAX];
+  int local_idxes[GEMM_EPILOGUE_TOPK_MAX];
+#pragma unroll
+  for (int j = 0; j < GEMM_EPILOGUE_TOPK_MAX; j++)
+  {
+    local_vals[j] = -INFINITY;
+    local_idxes[j] = INT_MAX;
+  }
+  for (int c = threadIdx.x; c < num_candidates; c += NUM_THREADS)
+  {
+    float v = vals[int64_t(row) * num_candidates + c];
+    int idx = idxes[int64_t(row) * num_candidates + c];
+    // Insertion into the sorted local list; the candidate indices of a row are unique.
+#pragma unroll
+    for (int j = 0; j < GEMM_EPILOGUE_TOPK_MAX; j++)
+    {
+      if (j < k && (v > local_vals[j] || (v == local_vals[j] && idx < local_idxes[j])))
+      {
+        float tv = local_vals[j];
+        int ti = local_idxes[j];
+        local_vals[j] = v;
+        local_idxes[j] = idx;
+        v = tv;
+        idx = ti;
+      }
+    }
+  }
+
+  for (int j = 0; j < k; j++)
+  {
+    float best = local_vals[0];
+    int best_idx = local_idxes[0];
+#pragma unroll
+    for (int mask = 16; mask > 0; mask >>= 1)
+    {
+      float other = __shfl_xor_sync(0xffffffff, best, mask);
+      int other_idx = __shfl_xor_sync(0xffffffff, best_idx, mask);
+      if (other > best || (other == best && other_idx < best_idx))
+      {
+        best = other;
+        best_idx = other_idx;
+      }
+    }
+    if (lane == 0)
+    {
+      s_vals[warp] = best;
+      s_idxes[warp] = best_idx;
+    }
+    __syncthreads();
+    best = s_vals[0];
+    best_idx = s_idxes[0];
+    for (int w = 1; w < NUM_WARPS; w++)
+    {
+      if (s_vals[w] > best || (s_vals[w] == best && s_idxes[w] < best_idx))
+      {
+        best = s_vals[w];
+        best_idx = s_idxes[w];
+      }
+    }
+    if (threadIdx.x == 0)
+    {
+      out_vals[row * k + j] = best;
+      out_idxes[row * k + j] = best_idx;
+    }
+    if (local_idxes[0] == best_idx)
+    {
+      // Pop the head of the winning thread.
+#pragma unroll
+      for (int i = 0; i + 1 < GEMM_EPILOGUE_TOPK_MAX; i++)
+      {
+        local_vals[i] = local_vals[i + 1];
+        local_idxes[i] = local_idxes[i + 1];
+      }
+      local_vals[GEMM_EPILOGUE_TOPK_MAX - 1] = -INFINITY;
+      local_idxes[GEMM_EPILOGUE_TOPK_MAX - 1] = INT_MAX;
+    }
+    __syncthreads();
+  }
+}
+
+// Per-token int8 quantization of a GEMM output from the row stats of its epilogue. Same result as
+// quant_kernel_fuse_sum (scale = absmax / 127, input_sum = fp16 row sum), without the row reductions.
+__global__ void quant_from_row_stats_kernel(const half *__restrict__ input, int8_t *__restrict__ output,
+                                            const float *__restrict__ row_stats, half *__restrict__ scale,
+                                            half *__restrict__ input_sum, int hidden_size)
+{
+  const int token_idx = blockIdx.x;
+  const int64_t token_idx_mul_hidden_size = token_idx * int64_t(hidden_size);
+  const float amax = row_stats[token_idx * 2];
+  if (threadIdx.x == 0)
+  {
+    scale[token_idx] = __float2half_rn(amax / 127.0f);
+    if (input_sum != nullptr)
+      input_sum[token_idx] = __float2half_rn(row_stats[token_idx * 2 + 1]);
+  }
+  const float tmp_scale = 127.0f / amax;
+  for (int i = threadIdx.x; i < hidden_size; i += blockDim.x)
+  {
+    output[token_idx_mul_hidden_size + i] =
+        float_to_int8_rn(__half2float(input[token_idx_mul_hidden_size + i]) * tmp_scale);
+  }
+}
+
+// Validates the optional epilogue tensors of a *_epilogue_forward_cuda call and returns the
+// zero-initialized row stats buffer when quantized outputs are requested.
+inline torch::Tensor gemm_epilogue_prepare(const torch::Tensor &out_feats, int epilogue,
+                                           const c10::optional<torch::Tensor> &residual,
+                                           const c10::optional<torch::Tensor> &quant_out,
+                                           const c10::optional<torch::Tensor> &quant_scale)
+{
+  TORCH_CHECK((epilogue & ~(GEMM_EPILOGUE_RESIDUAL | GEMM_EPILOGUE_SILU_AND_MUL)) == 0,
+              "Unknown GEMM epilogue ", epilogue);
+  TORCH_CHECK(!((epilogue & GEMM_EPILOGUE_RESIDUAL) && (epilogue & GEMM_EPILOGUE_SILU_AND_MUL)),
+              "The residual and SiLU-and-mul GEMM epilogues are exclusive");
+  if (epilogue & GEMM_EPILOGUE_RESIDUAL)
+  {
+    TORCH_CHECK(residual.has_value(), "GEMM_EPILOGUE_RESIDUAL requires a residual tensor");
+    TORCH_CHECK(residual->sizes() == out_feats.sizes() && residual->is_contiguous(),
+                "residual must be contiguous and shaped like out_feats");
+  }
+  if (!quant_out.has_value())
+    return torch::Tensor();
+  TORCH_CHECK(quant_scale.has_value(), "quant_out requires quant_scale");
+  TORCH_CHECK(quant_out->sizes() == out_feats.sizes(), "quant_out must be shaped like out_feats");
+  return torch::zeros({out_feats.numel() / out_feats.size(-1), 2}, out_feats.options().dtype(torch::kFloat32));
+}
+
+inline void gemm_epilogue_quant(const torch::Tensor &out_feats, const torch::Tensor &row_stats,
+                                torch::Tensor &quant_out, torch::Tensor &quant_scale,
+                                const c10::optional<torch::Tensor> &quant_sum, const cudaStream_t &stream)
+{
+  int hidden_size = out_feats.size(-1);
+  int num_tokens = out_feats.numel() / hidden_size;
+  dim3 grid(num_tokens);
+  dim3 block(std::min(hidden_size, 1024));
+  quant_from_row_stats_kernel<<<grid, block, 0, stream>>>(
+      reinterpret_cast<half *>(out_feats.data_ptr<at::Half>()), quant_out.data_ptr<int8_t>(),
+      row_stats.data_ptr<float>(), reinterpret_cast<half *>(quant_scale.data_ptr<at::Half>()),
+      quant_sum.has_value() ? reinterpret_cast<half *>(quant_sum->data_ptr<at::Half>()) : nullptr, hidden_size);
+}
+
+// Validates the arguments of a *_gemm_topk_forward_cuda call and allocates the per-tile candidates: sized for the
+// narrowest CTA_N of the tile configs, the first N / CTA_N tiles of every row are used.
+inline std::vector<torch::Tensor> gemm_epilogue_topk_prepare(const torch::Tensor &out_feats, int k,
+                                                             const c10::optional<torch::Tensor> &full_logit_rows,
+                                                             int min_cta_n)
+{
+  TORCH_CHECK(k >= 1 && k <= GEMM_EPILOGUE_TOPK_MAX, "GEMM_EPILOGUE_ROW_TOPK supports 1 <= k <= ",
+              GEMM_EPILOGUE_TOPK_MAX, ", got ", k);
+  TORCH_CHECK(out_feats.dim() == 2, "GEMM_EPILOGUE_ROW_TOPK expects 2D out_feats");
+  const int64_t num_rows = out_feats.size(0);
+  if (full_logit_rows.has_value())
+  {
+    TORCH_CHECK(full_logit_rows->scalar_type() == torch::kInt32 && full_logit_rows->numel() == num_rows &&
+                    full_logit_rows->is_contiguous(),
+                "full_logit_rows must be [num_rows] int32");
+  }
+  auto options = out_feats.options();
+  const int64_t max_candidates = out_feats.size(1) / min_cta_n * k;
+  return {torch::empty({num_rows, max_candidates}, options.dtype(torch::kFloat32)),
+          torch::empty({num_rows, max_candidates}, options.dtype(torch::kInt32))};
+}
+
+inline std::vector<torch::Tensor> gemm_epilogue_merge_topk(const torch::Tensor &candidate_vals,
+                                                           const torch::Tensor &candidate_idxes, int num_tiles,
+                                                           int k, const cudaStream_t &stream)
+{
+  const int64_t num_rows = candidate_vals.size(0);
+  auto options = candidate_vals.options();
+  torch::Tensor out_vals = torch::empty({num_rows, k}, options.dtype(torch::kFloat32));
+  torch::Tensor out_idxes = torch::empty({num_rows, k}, options.dtype(torch::kInt32));
+  if (num_rows == 0)
+    return {out_vals, out_idxes};
+  constexpr int kNumThreads = 256;
+  // The candidates of a row are packed behind each other with the row stride of the launched tiles.
+  merge_row_topk_kernel<kNumThreads><<<num_rows, kNumThreads, 0, stream>>>(
+      candidate_vals.data_ptr<float>(), candidate_idxes.data_ptr<int>(), out_vals.data_ptr<float>(),
+      out_idxes.data_ptr<int>(), num_tiles * k, k);
+  return {out_vals, out_idxes};
+}
@@ -0,0 +1,33 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Fused epilogues of the W8A8 / W4A8 per-channel GEMMs, selected at runtime with these bit flags.
+// Independently of the flags, a non-null row_stats (M x 2 floats, zero-initialized) accumulates the
+// absmax and sum of every output row, so that per-token int8 quantization of C needs no row reduction.
+#pragma once
+
+#define GEMM_EPILOGUE_NONE 0
+// C = dequant(acc) + residual. residual may alias C.
+#define GEMM_EPILOGUE_RESIDUAL 1
+// C[:, i] = silu(gate_i) * up_i, C has N / 2 columns. The gate_up weights (and their per-channel
+// scales) must be interleaved in blocks of GEMM_EPILOGUE_GLU_BLOCK output channels:
+// [gate 0:32, up 0:32, gate 32:64, up 32:64, ...], so that one CTA holds both halves.
+#define GEMM_EPILOGUE_SILU_AND_MUL 2
+#define GEMM_EPILOGUE_GLU_BLOCK 32
+// Per-row partial top-k of C (LM head): every CTA writes the GemmEpilogueTopK::k largest logits of each of its
+// rows (values and column indices) and C is only written for the rows flagged in full_logit_rows. The candidates
+// of all the column tiles are merged by gemm_epilogue_merge_topk. Exclusive with the other epilogues.
+#define GEMM_EPILOGUE_ROW_TOPK 4
+#define GEMM_EPILOGUE_TOPK_MAX 8
+// Epilogues that stage the dequantized CTA tile in shared memory.
+#define GEMM_EPILOGUE_STAGED_TILE (GEMM_EPILOGUE_SILU_AND_MUL | GEMM_EPILOGUE_ROW_TOPK)
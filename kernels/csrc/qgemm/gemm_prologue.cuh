@@ -0,0 +1,107 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Per-token int8 quantization of fp16 GEMM inputs in the prologue of the W4A8 GEMMs, so that decode-sized GEMMs
+// need no separate quant_kernel_fuse_sum pass. Every CTA first reduces the rows of its M tile over the whole K
+// (the rows stay in L2 across the N tiles), then quantizes the fp16 A tile of every stage into the int8 A stage
+// buffer instead of copying it with cp.async. Same results as quant_kernel_fuse_sum followed by the int8 GEMM.
+#pragma once
+
+#include <cuda_fp16.h>
+#include "gemm_epilogue.cuh"
+
+// Row stats of the CTA_M rows of the tile, in shared memory: quant_mul = 127 / absmax, ascale = absmax / 127 and
+// (if s_a_ssums is given) the row sum, both rounded to fp16 like in quant_kernel_fuse_sum. With write_global, the
+// fp16 scales / sums are also stored to ascales / a_ssums (one CTA per M tile does this).
+template <int CTA_M, int NUM_WARPS>
+__device__ __inline__ void gemm_prologue_row_stats(const half *__restrict__ A, float *s_quant_mul, half *s_ascales,
+                                                   half *s_a_ssums, half *ascales, half *a_ssums,
+                                                   int cta_offset_m, int M, int64_t K, bool write_global)
+{
+  for (int r = threadIdx.y; r < CTA_M; r += NUM_WARPS)
+  {
+    int row = cta_offset_m + r;
+    float amax = 0.0f, sum = 0.0f;
+    if (row < M)
+    {
+      const uint4 *src = reinterpret_cast<const uint4 *>(A + row * K);
+      for (int64_t i = threadIdx.x; i < K / 8; i += 32)
+      {
+        uint4 packed = src[i];
+        const half2 *h = reinterpret_cast<const half2 *>(&packed);
+#pragma unroll
+        for (int j = 0; j < 4; j++)
+          gemm_epilogue_row_stats_update(amax, sum, h[j]);
+      }
+    }
+    gemm_epilogue_row_stats_reduce(amax, sum, 1, 32);
+    if (threadIdx.x == 0)
+    {
+      half ascale = __float2half_rn(amax / 127.0f);
+      half a_ssum = __float2half_rn(sum);
+      s_quant_mul[r] = 127.0f / amax;
+      s_ascales[r] = ascale;
+      if (s_a_ssums != nullptr)
+        s_a_ssums[r] = a_ssum;
+      if (write_global && row < M)
+      {
+        ascales[row] = ascale;
+        if (a_ssums != nullptr)
+          a_ssums[row] = a_ssum;
+      }
+    }
+  }
+  __syncthreads();
+}
+
+// fp16 counterpart of global_to_share_one_stage_A: the same 16 elements per thread and iteration land in the same
+// (swizzled) int8 shared memory slot, quantized with the row multipliers of gemm_prologue_row_stats. src / dst
+// are hoisted like in global_to_share_one_stage_A, row_begin is the CTA row of the thread's first iteration.
+template <int CTA_M, int CTA_K, int CTA_SIZE, int SHARED_K_ITERS, int SMEM_COL>
+__device__ __inline__ void global_to_share_one_stage_A_quant(const half *__restrict__ src, int8_t *dst,
+                                                             int64_t global_ncols, int row_begin,
+                                                             int global_iter_k, int shared_iter_k, bool mask,
+                                                             const bool *preds, const float *s_quant_mul)
+{
+  constexpr int kPackSize = 16;
+  constexpr int total_global_iters = (CTA_M * CTA_K) / kPackSize / CTA_SIZE;
+  constexpr int partial_global_iters = total_global_iters / SHARED_K_ITERS;
+  constexpr int cta_step_m_or_n = (CTA_SIZE * kPackSize) / CTA_K;
+  if (!mask)
+    return;
+  const half *src_hoisted = src + global_iter_k * CTA_K;
+#pragma unroll
+  for (int _global_iter = 0; _global_iter < partial_global_iters; ++_global_iter)
+  {
+    int global_iter = shared_iter_k * partial_global_iters + _global_iter;
+    if (!preds[global_iter])
+      continue;
+    const uint4 *src_ptr = reinterpret_cast<const uint4 *>(src_hoisted + global_iter * cta_step_m_or_n * global_ncols);
+    const float quant_mul = s_quant_mul[row_begin + global_iter * cta_step_m_or_n];
+    uint4 packed[2] = {src_ptr[0], src_ptr[1]};
+    const half2 *h = reinterpret_cast<const half2 *>(packed);
+    uint32_t out[4];
+#pragma unroll
+    for (int j = 0; j < 4; j++)
+    {
+      float2 lo = __half22float2(h[j * 2]);
+      float2 hi = __half22float2(h[j * 2 + 1]);
+      out[j] = uint32_t(uint8_t(float_to_int8_rn(lo.x * quant_mul))) |
+               (uint32_t(uint8_t(float_to_int8_rn(lo.y * quant_mul))) << 8) |
+               (uint32_t(uint8_t(float_to_int8_rn(hi.x * quant_mul))) << 16) |
+               (uint32_t(uint8_t(float_to_int8_rn(hi.y * quant_mul))) << 24);
+    }
+    *reinterpret_cast<uint4 *>(dst + global_iter * cta_step_m_or_n * SMEM_COL) =
+        make_uint4(out[0], out[1], out[2], out[3]);
+  }
+}
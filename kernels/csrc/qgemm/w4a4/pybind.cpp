@@ -0,0 +1,29 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <pybind11/pybind11.h>
+#include <torch/extension.h>
+#include "w4a4_gemm_cuda.h"
+#include "../../nvtx_utils.h"
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    m.def("w4a4_gemm_forward_cuda", omniserve::nvtx_wrap("w4a4_gemm_forward_cuda", &w4a4_gemm_forward_cuda), "our w4a4 gemm kernel for prefill, with fused epilogues",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("w_szs"),
+          py::arg("a_ssums"), py::arg("out_feats"), py::arg("epilogue") = 0, py::arg("residual") = py::none(),
+          py::arg("config_id") = -1);
+    m.def("w4a4_quant_forward_cuda", omniserve::nvtx_wrap("w4a4_quant_forward_cuda", &w4a4_quant_forward_cuda), "per-group int4 quantization of the w4a4 gemm inputs",
+          py::arg("out"), py::arg("input"), py::arg("scales"), py::arg("sums"));
+    m.def("w4a4_gemm_tile_configs", omniserve::nvtx_wrap("w4a4_gemm_tile_configs", &w4a4_gemm_tile_configs), "tile configs selectable through config_id");
+    m.attr("GROUP_SIZE") = W4A4_GROUP_SIZE;
+}
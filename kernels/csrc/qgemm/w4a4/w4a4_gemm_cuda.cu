@@ -0,0 +1,650 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// W4A4 variant of the W8A8 GEMM (w8a8_gemm_cuda.cu). Two int4 values are packed per byte along K (low nibble
+// first), which is exactly the register layout mma.m16n8k64 expects for int4 operands, so the tiles travel through
+// shared memory and ldmatrix as int8 tiles of K / 2 bytes. Each CTA_K tile of bytes is one activation group:
+// the int32 accumulators of a tile are scaled by the group scales of their rows and folded into fp32 accumulators.
+#include "w4a4_gemm_cuda.h"
+#include "../gemm_epilogue.cuh"
+#include <cuda_fp16.h>
+#include <cuda_pipeline_primitives.h>
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../../launch_plan_utils.h"
+
+#define OP_M 16
+#define OP_N 8
+#define OP_K 64
+#define INTRIN_M 16
+#define INTRIN_N 16
+// In bytes (two int4 values each), like the other K sizes below.
+#define INTRIN_K 32
+#define WARP_SIZE 32
+#define SMEM_PAD_A 0
+#define SMEM_PAD_B 0
+#define PACK_SIZE 16
+#if (__CUDACC_VER_MAJOR__ >= 11) && (__CUDACC_VER_MINOR__ >= 4)
+#define L2_CACHEHINT(size) ".L2::" #size "B"
+#else
+#define L2_CACHEHINT(size)
+#endif
+#define KERNEL_LAUNCH_CODE                                                       \
+  constexpr int NUM_WARPS = (CTA_M / WARP_M) * (CTA_N / WARP_N) * (CTA_K / WARP_K); \
+  constexpr int kSmemByteSize =                                                  \
+      (CTA_M * (CTA_K + SMEM_PAD_A) + CTA_N * (CTA_K + SMEM_PAD_B)) * STAGES *   \
+      sizeof(int8_t);                                                            \
+  constexpr int kEpilogueSmemByteSize = CTA_M * CTA_N * sizeof(half);            \
+  const int smem_byte_size = (epilogue & GEMM_EPILOGUE_STAGED_TILE) &&           \
+                                     kEpilogueSmemByteSize > kSmemByteSize       \
+                                 ? kEpilogueSmemByteSize                         \
+                                 : kSmemByteSize;                                \
+  if (kSmemByteSize >= 99 * 1024)                                                \
+  {                                                                              \
+    printf("This kernel requires %d Bytes of shared memory, which exceeds "      \
+           "device limit.\n",                                                    \
+           kSmemByteSize);                                                       \
+    return;                                                                      \
+  }                                                                              \
+  int num_blocks_m = (num_out_feats + CTA_M - 1) / CTA_M;                        \
+  int num_blocks_n = num_out_channels / CTA_N / 1;                               \
+  const int log_tile = get_log_tile<8>((num_out_feats + CTA_M - 1) / CTA_M);     \
+  const int tile_shift = 1 << log_tile;                                          \
+  dim3 num_blocks(num_blocks_n *tile_shift,                                      \
+                  (num_blocks_m + tile_shift - 1) / tile_shift);                 \
+  dim3 threads_per_block(WARP_SIZE, NUM_WARPS);                                  \
+  auto kernel_func =                                                             \
+      dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES>;        \
+  omniserve::cached_set_max_dynamic_smem(kernel_func, smem_byte_size);           \
+  kernel_func<<<num_blocks, threads_per_block, smem_byte_size, stream>>>(        \
+      in_feats, kernel, wscales, ascales, w_szs, a_ssums, out_feats, residual,   \
+      num_in_feats, num_out_channels, num_in_channels / 2, epilogue);            \
+  return;
+
+// Precompiled tile configurations that can be requested through config_id (e.g. by the autotuner). CTA_K (in
+// bytes) is one activation group and WARP_K == CTA_K. The warp tiles are smaller than the W8A8 ones: every thread
+// keeps an fp32 accumulator next to each int32 one.
+// X(ID, CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES)
+#define GEMM_TILE_CONFIGS(X) \
+  X(0, 128, 128, 64, 64, 32, 64, 4) \
+  X(1, 64, 128, 64, 32, 32, 64, 4) \
+  X(2, 256, 128, 64, 64, 32, 64, 3) \
+  X(3, 128, 64, 64, 32, 32, 64, 5)
+
+#define GEMM_TILE_CONFIG_CASE(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_)              \
+  case ID:                                                                                             \
+  {                                                                                                    \
+    constexpr int CTA_M = CTA_M_;                                                                      \
+    constexpr int CTA_N = CTA_N_;                                                                      \
+    constexpr int CTA_K = CTA_K_;                                                                      \
+    constexpr int WARP_M = WARP_M_;                                                                    \
+    constexpr int WARP_N = WARP_N_;                                                                    \
+    constexpr int WARP_K = WARP_K_;                                                                    \
+    constexpr int STAGES = STAGES_;                                                                    \
+    TORCH_CHECK(num_out_channels % CTA_N == 0,                                                         \
+                "GEMM tile config ", ID, " does not divide N=", num_out_channels);                     \
+    KERNEL_LAUNCH_CODE                                                                                 \
+  }
+
+#define GEMM_TILE_CONFIG_ROW(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_) \
+  {CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_},
+
+std::vector<std::vector<int>> w4a4_gemm_tile_configs()
+{
+  return {GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_ROW)};
+}
+
+template <int N>
+__inline__ __host__ __device__ int get_log_tile(int n)
+{
+  if (N >= 8 && n >= 6)
+    return 3;
+  else if (N >= 4 && n >= 3)
+    return 2;
+  else if (N >= 2 && n >= 2)
+    return 1;
+  else
+    return 0;
+}
+
+__inline__ __device__ uint2 get_block_idx_mapping(int blockIdx_x,
+                                                  int blockIdx_y,
+                                                  int log_tile)
+{
+  return make_uint2((blockIdx_x >> log_tile),
+                    (blockIdx_y << log_tile) +
+                        ((blockIdx_x) & ((1 << (log_tile)) - 1)));
+}
+
+__inline__ __device__ uint32_t cast_smem_ptr_to_uint(void const *const ptr)
+{
+  uint32_t smem_int_ptr;
+
+  asm("{.reg .u64 smem_ptr; cvta.to.shared.u64 smem_ptr, %1; cvt.u32.u64 %0, "
+      "smem_ptr; }\n"
+      : "=r"(smem_int_ptr)
+      : "l"(ptr));
+
+  return smem_int_ptr;
+}
+
+__inline__ __device__ void ldmatrix_m8n8_x4_b16(int8_t *shared_warp, int ax0_0,
+                                                uint32_t addr)
+{
+  __asm__ __volatile__("ldmatrix.sync.aligned.m8n8.x4.shared.b16"
+                       "{%0, %1, %2, %3}, [%4];"
+                       : "=r"(((unsigned *)(shared_warp + (ax0_0 * 16)))[0]),
+                         "=r"(((unsigned *)(shared_warp + (ax0_0 * 16)))[1]),
+                         "=r"(((unsigned *)(shared_warp + (ax0_0 * 16)))[2]),
+                         "=r"(((unsigned *)(shared_warp + (ax0_0 * 16)))[3])
+                       : "r"(addr));
+}
+
+// function from lmdeploy
+__inline__ __device__ void
+cp_async_cg_A(uint32_t smem_int_ptr, const uint4 *__restrict__ src, bool mask)
+{
+  const int cp_size = 16;
+  asm volatile("{"
+                "  .reg .pred p;"
+                "  setp.ne.b32 p, %0, 0;"
+                "  @p cp.async.cg.shared.global" L2_CACHEHINT(128) " [%1], [%2], %3;"
+                "}" ::"r"((int)mask),
+                "r"(smem_int_ptr),
+                "l"(src),
+                "n"(cp_size));
+}
+
+// Signed int4 activations (A) times unsigned int4 weights (B).
+__device__ __inline__ void mma_m16n8k64(void *C_warp, void *A_shared_warp,
+                                        void *B_shared_warp)
+{
+  __asm__ __volatile__(
+      "mma.sync.aligned.m16n8k64.row.col.s32.s4.u4.s32"
+      "{%0, %1, %2, %3}, {%4, %5, %6, %7}, {%8, %9}, {%10, %11, %12, %13};"
+      : "=r"(((int *)C_warp)[0]), "=r"(((int *)C_warp)[1]),
+        "=r"(((int *)C_warp)[2]), "=r"(((int *)C_warp)[3])
+      : "r"(((unsigned *)A_shared_warp)[0]),
+        "r"(((unsigned *)A_shared_warp)[1]),
+        "r"(((unsigned *)A_shared_warp)[2]),
+        "r"(((unsigned *)A_shared_warp)[3]),
+        "r"(((unsigned *)B_shared_warp)[0]),
+        "r"(((unsigned *)B_shared_warp)[1]), "r"(((int *)C_warp)[0]),
+        "r"(((int *)C_warp)[1]), "r"(((int *)C_warp)[2]),
+        "r"(((int *)C_warp)[3]));
+}
+
+template <int CTA_M, int CTA_N, int CTA_K, int CTA_SIZE, int SHARED_K_ITERS,
+          int STAGES>
+__device__ __inline__ void
+global_to_share_one_stage_A(int8_t *src, int8_t *dst, int global_ncols,
+                            int cta_offset_m, int cta_offset_n,
+                            int global_iter_k, int shared_iter_k, bool mask,
+                            bool *preds)
+{
+  constexpr int total_global_iters = (CTA_M * CTA_K) / PACK_SIZE / CTA_SIZE;
+  constexpr int partial_global_iters = total_global_iters / SHARED_K_ITERS;
+  constexpr int cta_step_m_or_n = (CTA_SIZE * PACK_SIZE) / CTA_K;
+  constexpr int kSmemCol = CTA_K + SMEM_PAD_A;
+  int8_t *dst_hoisted = dst;
+  int8_t *src_hoisted = src + global_iter_k * CTA_K;
+
+  if (mask)
+  {
+#pragma unroll
+    for (int _global_iter = 0; _global_iter < partial_global_iters;
+         ++_global_iter)
+    {
+      int global_iter = shared_iter_k * partial_global_iters + _global_iter;
+
+      void *dst_ptr =
+          (void *)(dst_hoisted + global_iter * cta_step_m_or_n * kSmemCol);
+      uint4 *src_ptr =
+          (uint4 *)(src_hoisted + global_iter * cta_step_m_or_n * global_ncols);
+      if constexpr (STAGES > 1)
+      {
+        uint32_t addr = cast_smem_ptr_to_uint(dst_ptr);
+        cp_async_cg_A(addr, src_ptr, preds[global_iter]);
+      }
+      else
+      {
+        if (preds[global_iter])
+          *(uint4 *)dst_ptr = *src_ptr;
+      }
+    }
+  }
+}
+
+template <int CTA_M, int CTA_N, int CTA_K, int CTA_SIZE, int SHARED_K_ITERS,
+          int STAGES>
+__device__ __inline__ void
+global_to_share_one_stage_B(int8_t *src, int8_t *dst, int global_ncols,
+                            int cta_offset_m, int cta_offset_n,
+                            int global_iter_k, int shared_iter_k, bool mask)
+{
+  constexpr int total_global_iters = (CTA_N * CTA_K) / PACK_SIZE / CTA_SIZE;
+  constexpr int partial_global_iters = total_global_iters / SHARED_K_ITERS;
+  constexpr int cta_step_m_or_n = (CTA_SIZE * PACK_SIZE) / CTA_K;
+  constexpr int kSmemCol = CTA_K + SMEM_PAD_B;
+  int8_t *dst_hoisted = dst;
+  int8_t *src_hoisted = src + global_iter_k * CTA_K;
+
+#pragma unroll
+  for (int _global_iter = 0; _global_iter < partial_global_iters;
+       ++_global_iter)
+  {
+    int global_iter = shared_iter_k * partial_global_iters + _global_iter;
+
+    void *dst_ptr =
+        (void *)(dst_hoisted + global_iter * cta_step_m_or_n * kSmemCol);
+    uint4 *src_ptr =
+        (uint4 *)(src_hoisted + global_iter * cta_step_m_or_n * global_ncols);
+    if constexpr (STAGES > 1)
+    {
+      uint32_t addr = cast_smem_ptr_to_uint(dst_ptr);
+      cp_async_cg_A(addr, src_ptr, mask);
+    }
+    else
+    {
+      if (mask)
+        *(uint4 *)dst_ptr = *src_ptr;
+    }
+  }
+}
+
+template <int CTA_M, int CTA_N, int CTA_K, int CTA_SIZE, int STAGES>
+__device__ __inline__ void
+share_to_reg_one_stage_A(int8_t *src, int8_t *dst, int warp_offset_m,
+                         int warp_offset_n, int k_0_1, int shared_iters)
+{
+  constexpr int kSmemCol = CTA_K + SMEM_PAD_A;
+  int ld_col = (k_0_1 * INTRIN_K + (threadIdx.x / 16) * 16) / PACK_SIZE;
+
+  for (int shared_iter = 0; shared_iter < shared_iters; ++shared_iter)
+  {
+    int ld_row = warp_offset_m + shared_iter * INTRIN_M + (threadIdx.x % 16);
+    int ld_col_swizzled = ld_col ^ (ld_row / 2) & 3;
+    void *addr_ptr =
+        (void *)(src + ld_row * kSmemCol + ld_col_swizzled * PACK_SIZE);
+    uint32_t addr = cast_smem_ptr_to_uint(addr_ptr);
+    ldmatrix_m8n8_x4_b16(dst, shared_iter, addr);
+  }
+}
+
+template <int CTA_M, int CTA_N, int CTA_K, int CTA_SIZE, int STAGES>
+__device__ __inline__ void
+share_to_reg_one_stage_B(int8_t *src, int8_t *dst, int warp_offset_m,
+                         int warp_offset_n, int k_0_1, int shared_iters)
+{
+  constexpr int kSmemCol = CTA_K + SMEM_PAD_B;
+  int ld_col = (k_0_1 * INTRIN_K + ((threadIdx.x / 8) % 2) * 16) / PACK_SIZE;
+
+  for (int shared_iter = 0; shared_iter < shared_iters; ++shared_iter)
+  {
+    int ld_row = warp_offset_n + shared_iter * INTRIN_N + ((threadIdx.x / 8 / 2) * 8 + threadIdx.x % 8);
+    int ld_col_swizzled = ld_col ^ (ld_row / 2) & 3;
+    void *addr_ptr =
+        (void *)(src + ld_row * kSmemCol + ld_col_swizzled * PACK_SIZE);
+    uint32_t addr = cast_smem_ptr_to_uint(addr_ptr);
+    ldmatrix_m8n8_x4_b16(dst, shared_iter, addr);
+  }
+}
+
+// K is in bytes (K / 2 int4 input channels), one group of ascales per CTA_K bytes.
+template <int CTA_M, int CTA_N, int CTA_K, int WARP_M, int WARP_N, int WARP_K,
+          int STAGES>
+__global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
+                              half2 *__restrict__ wscales, half *__restrict__ ascales,
+                              half2 *__restrict__ w_szs, half *__restrict__ a_ssums,
+                              half *__restrict__ C, const half *__restrict__ R, int M, int N, int K,
+                              int epilogue)
+{
+  static_assert(CTA_K * 2 == W4A4_GROUP_SIZE, "A CTA_K tile must be one activation group.");
+  static_assert(WARP_K == CTA_K, "The group scales are applied per warp, K must not be split across warps.");
+  constexpr int NUM_WARPS_MN = CTA_M / WARP_M * CTA_N / WARP_N;
+  constexpr int NUM_WARPS = NUM_WARPS_MN * CTA_K / WARP_K;
+  constexpr int CTA_SIZE = NUM_WARPS * WARP_SIZE;
+  constexpr int CTA_SIZE_MN = NUM_WARPS_MN * WARP_SIZE;
+  constexpr int kAccSize = CTA_M * CTA_N / CTA_SIZE_MN;
+
+  int blockIdx_n = blockIdx.x;
+  int blockIdx_m = blockIdx.y;
+  const int log_tile = get_log_tile<8>((M + CTA_M - 1) / CTA_M);
+  const uint2 block_idx_mapping =
+      get_block_idx_mapping(blockIdx_n, blockIdx_m, log_tile);
+  blockIdx_n = block_idx_mapping.x;
+  blockIdx_m = block_idx_mapping.y;
+
+  int C_warp[kAccSize];
+  float C_acc[kAccSize];
+  constexpr int kSmemPadKA = CTA_K + SMEM_PAD_A;
+  constexpr int kSmemPadKB = CTA_K + SMEM_PAD_B;
+  constexpr int kSmemSizeAPerStage = CTA_M * kSmemPadKA;
+  constexpr int kSmemSizeBPerStage = CTA_N * kSmemPadKB;
+  constexpr int kSmemSizeA = kSmemSizeAPerStage * STAGES;
+  extern __shared__ int8_t mem_shared[];
+  int8_t *A_shared = mem_shared;
+  int8_t *B_shared = mem_shared + kSmemSizeA;
+  int8_t A_shared_warp_[2][WARP_M * WARP_K /
+                           WARP_SIZE];
+  int8_t B_shared_warp_[2][WARP_N * WARP_K /
+                           WARP_SIZE];
+  constexpr int A_total_global_iters = (CTA_M * CTA_K) / PACK_SIZE / CTA_SIZE;
+  constexpr int A_src_step_m = (CTA_SIZE * PACK_SIZE) / CTA_K;
+  constexpr int A_warp_step_m = (WARP_SIZE * PACK_SIZE) / CTA_K;
+  constexpr int B_warp_step_n = (WARP_SIZE * PACK_SIZE) / CTA_K;
+  constexpr int A_threads_per_row = CTA_K / PACK_SIZE;
+  constexpr int B_threads_per_row = CTA_K / PACK_SIZE;
+  int cta_offset_m = blockIdx_m * CTA_M;
+  int cta_offset_n = blockIdx_n * CTA_N;
+  int warp_offset_m = (threadIdx.y % (CTA_M / WARP_M)) * WARP_M;
+  int warp_offset_n = (threadIdx.y / (CTA_M / WARP_M)) * WARP_N;
+
+  for (int i = 0; i < kAccSize; i++)
+  {
+    C_warp[i] = 0;
+    C_acc[i] = 0.0f;
+  }
+
+  int gemm_iters = (K + CTA_K - 1) / CTA_K;
+  int k_0_0_ld = 0;
+  int k_0_0 = 0;
+  constexpr int prologue_stages = STAGES == 1 ? 1 : STAGES - 1;
+  int A_hoisted_row = threadIdx.y * A_warp_step_m + (threadIdx.x / A_threads_per_row);
+  int A_hoisted_col = (threadIdx.x % A_threads_per_row);
+  int A_hoisted_col_swizzled = A_hoisted_col ^ (A_hoisted_row / 2) & 3;
+
+  int B_hoisted_row = threadIdx.y * B_warp_step_n + (threadIdx.x / B_threads_per_row);
+  int B_hoisted_col = (threadIdx.x % B_threads_per_row);
+  int B_hoisted_col_swizzled = B_hoisted_col ^ (B_hoisted_row / 2) & 3;
+
+  int8_t *A_shared_hoisted = A_shared +
+                             A_hoisted_row * kSmemPadKA +
+                             A_hoisted_col_swizzled * PACK_SIZE;
+  int8_t *B_shared_hoisted = B_shared + B_hoisted_row * kSmemPadKB +
+                             B_hoisted_col_swizzled * PACK_SIZE;
+  int8_t *A_hoisted = A + cta_offset_m * K + A_hoisted_row * K +
+                      A_hoisted_col * PACK_SIZE;
+  int8_t *B_hoisted = B + cta_offset_n * K + B_hoisted_row * K +
+                      B_hoisted_col * PACK_SIZE;
+  bool A_g2s_preds[A_total_global_iters];
+#pragma unroll
+  for (int i = 0; i < A_total_global_iters; i++)
+  {
+    A_g2s_preds[i] = (cta_offset_m + A_hoisted_row + i * A_src_step_m) < M;
+  }
+
+  // Rows of the accumulators of this thread: row_wb_thd + ax0_0_1 * OP_M + h * 8.
+  const int num_groups = K / CTA_K;
+  int row_wb_thd = cta_offset_m + warp_offset_m + (threadIdx.x / 4);
+  const half *ascales_thd[WARP_M / INTRIN_M][2];
+#pragma unroll
+  for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+  {
+#pragma unroll
+    for (int h = 0; h < 2; ++h)
+    {
+      int row = row_wb_thd + ax0_0_1 * OP_M + h * 8;
+      // Rows past M read the scales of row 0 and are never written back.
+      ascales_thd[ax0_0_1][h] = ascales + (row < M ? row : 0) * num_groups;
+    }
+  }
+
+#pragma unroll
+  for (k_0_0_ld = 0; k_0_0_ld < prologue_stages; ++k_0_0_ld)
+  {
+    global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
+        A_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K,
+        cta_offset_m, cta_offset_n, k_0_0_ld, 0, true, A_g2s_preds);
+    global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
+        B_hoisted, B_shared_hoisted + k_0_0_ld * kSmemSizeBPerStage, K,
+        cta_offset_m, cta_offset_n, k_0_0_ld, 0, true);
+    if constexpr (STAGES > 1)
+      __pipeline_commit();
+  }
+  if constexpr (STAGES > 1)
+    __pipeline_wait_prior(STAGES - 2);
+  __syncthreads();
+
+  share_to_reg_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, STAGES>(
+      A_shared, A_shared_warp_[0], warp_offset_m, warp_offset_n, 0,
+      WARP_M / INTRIN_M);
+  share_to_reg_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE, STAGES>(
+      B_shared, B_shared_warp_[0], warp_offset_m, warp_offset_n, 0,
+      WARP_N / INTRIN_N);
+  constexpr int SHARED_K_ITERS = WARP_K / INTRIN_K;
+
+  for (; k_0_0 < gemm_iters; ++k_0_0, ++k_0_0_ld)
+  {
+    int ld_stage = k_0_0_ld % STAGES;
+    int compute_stage = k_0_0 % STAGES;
+    int8_t *A_shared_this_compute_stage;
+    int8_t *B_shared_this_compute_stage;
+    // Issued before the MMAs of the group, consumed after them.
+    float group_scales[WARP_M / INTRIN_M][2];
+#pragma unroll
+    for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+    {
+      group_scales[ax0_0_1][0] = __half2float(ascales_thd[ax0_0_1][0][k_0_0]);
+      group_scales[ax0_0_1][1] = __half2float(ascales_thd[ax0_0_1][1][k_0_0]);
+    }
+
+    for (int iter_k = 0; iter_k < SHARED_K_ITERS; ++iter_k)
+    {
+      A_shared_this_compute_stage =
+          A_shared + compute_stage * kSmemSizeAPerStage;
+      B_shared_this_compute_stage =
+          B_shared + compute_stage * kSmemSizeBPerStage;
+      share_to_reg_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, STAGES>(
+          A_shared_this_compute_stage, A_shared_warp_[(iter_k + 1) % 2],
+          warp_offset_m, warp_offset_n, (iter_k + 1) % SHARED_K_ITERS,
+          WARP_M / INTRIN_M);
+      share_to_reg_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE, STAGES>(
+          B_shared_this_compute_stage, B_shared_warp_[(iter_k + 1) % 2],
+          warp_offset_m, warp_offset_n, (iter_k + 1) % SHARED_K_ITERS,
+          WARP_N / INTRIN_N);
+      int8_t *A_shared_warp = A_shared_warp_[iter_k % 2];
+      int8_t *B_shared_warp = B_shared_warp_[iter_k % 2];
+      for (int i_0_3 = 0; i_0_3 < WARP_M / INTRIN_M; ++i_0_3)
+      {
+        for (int j_0_4 = 0; j_0_4 < WARP_N / INTRIN_N; ++j_0_4)
+        {
+          mma_m16n8k64(
+              (void *)(C_warp + i_0_3 * WARP_N / INTRIN_N * 8 + j_0_4 * 8),
+              (void *)(A_shared_warp + i_0_3 * 16),
+              (void *)(B_shared_warp + j_0_4 * 16));
+          mma_m16n8k64(
+              (void *)(C_warp + i_0_3 * WARP_N / INTRIN_N * 8 + j_0_4 * 8 + 4),
+              (void *)(A_shared_warp + i_0_3 * 16),
+              (void *)(B_shared_warp + j_0_4 * 16 + 8));
+        }
+      }
+
+      if (iter_k < SHARED_K_ITERS - 1)
+      {
+        if constexpr (STAGES == 1)
+          __syncthreads();
+        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
+                                    WARP_K / INTRIN_K, STAGES>(
+            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k,
+            k_0_0_ld < gemm_iters, A_g2s_preds);
+        global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
+                                    WARP_K / INTRIN_K, STAGES>(
+            B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
+            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k,
+            k_0_0_ld < gemm_iters);
+      }
+
+      if (iter_k == SHARED_K_ITERS - 2)
+      {
+        if constexpr (STAGES == 1 && SHARED_K_ITERS > 2)
+        {
+          __syncthreads();
+        }
+        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
+                                    WARP_K / INTRIN_K, STAGES>(
+            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1,
+            k_0_0_ld < gemm_iters, A_g2s_preds);
+        global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
+                                    WARP_K / INTRIN_K, STAGES>(
+            B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
+            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1,
+            k_0_0_ld < gemm_iters);
+        if constexpr (STAGES > 1)
+        {
+          __pipeline_commit();
+          __pipeline_wait_prior(STAGES - 2);
+        }
+        compute_stage = (k_0_0 + 1) % STAGES;
+        __syncthreads();
+      }
+    }
+
+    // Fold the int32 sums of this group into the fp32 accumulators.
+#pragma unroll
+    for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+    {
+#pragma unroll
+      for (int ax1_0_1 = 0; ax1_0_1 < WARP_N / INTRIN_N; ++ax1_0_1)
+      {
+#pragma unroll
+        for (int local_id = 0; local_id < OP_M * 16 / WARP_SIZE; ++local_id)
+        {
+          int idx = ax0_0_1 * WARP_N / INTRIN_N * 8 + ax1_0_1 * 8 + local_id;
+          C_acc[idx] += group_scales[ax0_0_1][(local_id % 4) / 2] * __int2float_rn(C_warp[idx]);
+          C_warp[idx] = 0;
+        }
+      }
+    }
+  }
+  __pipeline_commit();
+  __pipeline_wait_prior(0);
+  __syncthreads();
+
+  const bool silu_and_mul = epilogue & GEMM_EPILOGUE_SILU_AND_MUL;
+  half *C_tile = reinterpret_cast<half *>(mem_shared);
+
+  int col_wb_thd = cta_offset_n + warp_offset_n + (threadIdx.x % 4) * 2;
+#pragma unroll
+  for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+  {
+    int row_wb_1 = row_wb_thd + ax0_0_1 * OP_M;
+#pragma unroll
+    for (int ax1_0_1 = 0; ax1_0_1 < WARP_N / INTRIN_N; ++ax1_0_1)
+    {
+      int col_wb_1 = col_wb_thd + ax1_0_1 * 16;
+      float *C_acc_local = C_acc + ax0_0_1 * WARP_N / INTRIN_N * 8 + ax1_0_1 * 8;
+#pragma unroll
+      for (int local_id = 0; local_id < OP_M * 16 / WARP_SIZE; local_id += 2)
+      {
+        int row_wb = row_wb_1 + (local_id % 4) / 2 * 8;
+        if (row_wb < M){
+          int col_wb = col_wb_1 + (local_id / 4) * 8 + (local_id % 2);
+          float2 wscale = __half22float2(*(wscales + col_wb / 2));
+          float2 w_sz = __half22float2(*(w_szs + col_wb / 2));
+          float a_ssum = __half2float(a_ssums[row_wb]);
+          float2 psums = make_float2(C_acc_local[local_id], C_acc_local[local_id + 1]);
+          psums.x = psums.x * wscale.x - w_sz.x * a_ssum;
+          psums.y = psums.y * wscale.y - w_sz.y * a_ssum;
+          half2 out = __float22half2_rn(psums);
+          if (silu_and_mul)
+          {
+            *reinterpret_cast<half2 *>(C_tile + (row_wb - cta_offset_m) * CTA_N + col_wb - cta_offset_n) = out;
+            continue;
+          }
+          if (epilogue & GEMM_EPILOGUE_RESIDUAL)
+            out = __hadd2(out, *reinterpret_cast<const half2 *>(R + row_wb * N + col_wb));
+          *reinterpret_cast<half2 *>(C + row_wb * N + col_wb) = out;
+        }
+      };
+    }
+  }
+  if (silu_and_mul)
+  {
+    __syncthreads();
+    gemm_epilogue_silu_and_mul_tile<CTA_M, CTA_N, NUM_WARPS>(C_tile, C, nullptr, cta_offset_m, cta_offset_n,
+                                                             M, N / 2);
+  }
+}
+
+void w4a4_gemm_forward_cuda(torch::Tensor _in_feats,
+                            torch::Tensor _kernel,
+                            torch::Tensor _wscales,
+                            torch::Tensor _ascales,
+                            torch::Tensor _w_szs,
+                            torch::Tensor _a_ssums,
+                            torch::Tensor _out_feats,
+                            int epilogue,
+                            c10::optional<torch::Tensor> _residual,
+                            int config_id)
+{
+  gemm_epilogue_prepare(_out_feats, epilogue, _residual, c10::nullopt, c10::nullopt);
+  int num_in_feats = _in_feats.size(0);
+  int num_in_channels = _in_feats.size(1) * 2;
+  TORCH_CHECK(_kernel.size(1) * 2 == num_in_channels && num_in_channels % W4A4_GROUP_SIZE == 0,
+              "The input channels must match the packed weights and be a multiple of ", W4A4_GROUP_SIZE);
+  TORCH_CHECK(_ascales.numel() >= num_in_feats * (num_in_channels / W4A4_GROUP_SIZE) &&
+                  _a_ssums.numel() >= num_in_feats,
+              "ascales must hold one scale per row and group, a_ssums one sum per row");
+  auto in_feats = reinterpret_cast<int8_t *>(_in_feats.data_ptr<int8_t>());
+  auto kernel = reinterpret_cast<int8_t *>(_kernel.data_ptr<int8_t>());
+  auto wscales = reinterpret_cast<half2 *>(_wscales.data_ptr());
+  auto ascales = reinterpret_cast<half *>(_ascales.data_ptr());
+  auto w_szs = reinterpret_cast<half2 *>(_w_szs.data_ptr());
+  auto a_ssums = reinterpret_cast<half *>(_a_ssums.data_ptr());
+  const half *residual = (epilogue & GEMM_EPILOGUE_RESIDUAL)
+                             ? reinterpret_cast<const half *>(_residual->data_ptr<at::Half>())
+                             : nullptr;
+  int num_out_feats = _out_feats.size(-2);
+  // The SiLU-and-mul epilogue writes one output per gate / up pair.
+  int num_out_channels = _out_feats.size(-1) * ((epilogue & GEMM_EPILOGUE_SILU_AND_MUL) ? 2 : 1);
+  auto out_feats = reinterpret_cast<half *>(_out_feats.data_ptr<at::Half>());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  if (config_id >= 0)
+  {
+    switch (config_id)
+    {
+      GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_CASE)
+    default:
+      TORCH_CHECK(false, "Invalid GEMM tile config ", config_id);
+    }
+  }
+
+  TORCH_CHECK(num_out_channels % 128 == 0, "The W4A4 GEMM requires N to be a multiple of 128, got ", num_out_channels);
+  // Only large prefill chunks take this path, the tile sizes favour throughput.
+  if (num_out_feats > 128)
+  {
+    constexpr int CTA_M = 128;
+    constexpr int CTA_N = 128;
+    constexpr int CTA_K = 64;
+    constexpr int WARP_M = 64;
+    constexpr int WARP_N = 32;
+    constexpr int WARP_K = 64;
+    constexpr int STAGES = 4;
+    KERNEL_LAUNCH_CODE
+  }
+  else
+  {
+    constexpr int CTA_M = 64;
+    constexpr int CTA_N = 128;
+    constexpr int CTA_K = 64;
+    constexpr int WARP_M = 32;
+    constexpr int WARP_N = 32;
+    constexpr int WARP_K = 64;
+    constexpr int STAGES = 4;
+    KERNEL_LAUNCH_CODE
+  }
+}
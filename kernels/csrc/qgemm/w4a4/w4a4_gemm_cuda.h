@@ -0,0 +1,33 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <torch/extension.h>
+#include "../gemm_epilogue.h"
+
+// Input channels per activation scale of the W4A4 GEMM (one CTA_K tile of the main loop).
+#define W4A4_GROUP_SIZE 128
+
+// W4A4 GEMM for compute-bound prefill (int4 tensor cores, mma.m16n8k64). in_feats are signed int4 activations
+// quantized per group of W4A4_GROUP_SIZE input channels (M x K / 2 bytes, see w4a4_quant_forward_cuda), with
+// ascales M x K / W4A4_GROUP_SIZE and a_ssums M (sum of the dequantized activations of a row). kernel holds the
+// unsigned int4 per-channel weights of the W4A8 per-channel GEMM, packed plainly (N x K / 2 bytes, low nibble
+// first) instead of in the W4A8 layout, with the same wscales / w_szs. epilogue is a GEMM_EPILOGUE_RESIDUAL /
+// GEMM_EPILOGUE_SILU_AND_MUL bit mask (see gemm_epilogue.h).
+void w4a4_gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _out_feats, int epilogue, c10::optional<torch::Tensor> _residual, int config_id = -1);
+
+// Per-group symmetric int4 quantization of fp16 activations (M x K) for w4a4_gemm_forward_cuda: writes the packed
+// activations (M x K / 2 int8), their scales (M x K / W4A4_GROUP_SIZE) and row sums (M), like invoke_quant_fuse_sum.
+void w4a4_quant_forward_cuda(torch::Tensor _out, torch::Tensor _input, torch::Tensor _scales, torch::Tensor _sums);
+
+// CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES of every config_id accepted above.
+std::vector<std::vector<int>> w4a4_gemm_tile_configs();
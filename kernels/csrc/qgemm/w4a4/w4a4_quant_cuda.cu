@@ -0,0 +1,87 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include "w4a4_gemm_cuda.h"
+#include "../../utils.cuh"
+#include "../../reduction_utils.cuh"
+#include <cuda_fp16.h>
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+
+#define W4A4_QUANT_WARPS 8
+// fp16 inputs per lane and group (W4A4_GROUP_SIZE / 32).
+#define W4A4_QUANT_VEC 4
+
+// One CTA per row, one warp per group of W4A4_GROUP_SIZE channels. A lane loads 4 fp16 values (64 bits) and
+// stores them as 4 int4 values (16 bits). Symmetric quantization to [-7, 7]: an outlier channel only coarsens
+// the scale of its own group. sums[row] accumulates scale * sum(q) over the groups, the dequantized row sum the
+// W4A4 GEMM needs for the weight zero points.
+__global__ void w4a4_quant_kernel(const half *__restrict__ input, int8_t *__restrict__ output,
+                                  half *__restrict__ scales, half *__restrict__ sums, int hidden_size)
+{
+  static_assert(W4A4_GROUP_SIZE == 32 * W4A4_QUANT_VEC, "A warp quantizes one group.");
+  const int row = blockIdx.x;
+  const int warp = threadIdx.x / 32;
+  const int lane = threadIdx.x % 32;
+  const int num_groups = hidden_size / W4A4_GROUP_SIZE;
+  const half *input_row = input + row * int64_t(hidden_size);
+  int8_t *output_row = output + row * int64_t(hidden_size / 2);
+
+  float sum_val = 0.0f;
+  for (int group = warp; group < num_groups; group += W4A4_QUANT_WARPS)
+  {
+    const int col = group * W4A4_GROUP_SIZE + lane * W4A4_QUANT_VEC;
+    uint2 x = *reinterpret_cast<const uint2 *>(input_row + col);
+    const float2 f01 = __half22float2(*reinterpret_cast<half2 *>(&x.x));
+    const float2 f23 = __half22float2(*reinterpret_cast<half2 *>(&x.y));
+    float amax_val = fmaxf(fmaxf(fabsf(f01.x), fabsf(f01.y)), fmaxf(fabsf(f23.x), fabsf(f23.y)));
+    amax_val = vllm::warpReduceMax(amax_val);
+    // Quantize with the fp16 scale the GEMM reads back.
+    const half scale = __float2half_rn(amax_val / 7.0f);
+    const float scale_f = __half2float(scale);
+    const float inv_scale = scale_f > 0.0f ? 1.0f / scale_f : 0.0f;
+    const int q0 = float_to_int8_rn(f01.x * inv_scale);
+    const int q1 = float_to_int8_rn(f01.y * inv_scale);
+    const int q2 = float_to_int8_rn(f23.x * inv_scale);
+    const int q3 = float_to_int8_rn(f23.y * inv_scale);
+    const uint16_t packed = (q0 & 0xF) | ((q1 & 0xF) << 4) | ((q2 & 0xF) << 8) | ((q3 & 0xF) << 12);
+    *reinterpret_cast<uint16_t *>(output_row + col / 2) = packed;
+    const int q_sum = vllm::warpReduceSum(q0 + q1 + q2 + q3);
+    if (lane == 0)
+    {
+      scales[row * num_groups + group] = scale;
+      sum_val += scale_f * q_sum;
+    }
+  }
+  sum_val = vllm::blockReduceSum(sum_val);
+  if (threadIdx.x == 0)
+    sums[row] = __float2half_rn(sum_val);
+}
+
+void w4a4_quant_forward_cuda(torch::Tensor _out, torch::Tensor _input, torch::Tensor _scales, torch::Tensor _sums)
+{
+  TORCH_CHECK(_input.is_contiguous() && _out.is_contiguous(), "input and out must be contiguous");
+  int hidden_size = _input.size(-1);
+  int num_tokens = _input.numel() / hidden_size;
+  TORCH_CHECK(hidden_size % W4A4_GROUP_SIZE == 0, "hidden_size must be a multiple of ", W4A4_GROUP_SIZE);
+  TORCH_CHECK(_out.numel() == _input.numel() / 2, "out must hold the packed int4 input");
+  TORCH_CHECK(_scales.numel() >= num_tokens * (hidden_size / W4A4_GROUP_SIZE) && _sums.numel() >= num_tokens,
+              "scales must hold one scale per row and group, sums one sum per row");
+  if (num_tokens == 0)
+    return;
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  w4a4_quant_kernel<<<num_tokens, W4A4_QUANT_WARPS * 32, 0, stream>>>(
+      reinterpret_cast<const half *>(_input.data_ptr<at::Half>()), _out.data_ptr<int8_t>(),
+      reinterpret_cast<half *>(_scales.data_ptr<at::Half>()), reinterpret_cast<half *>(_sums.data_ptr<at::Half>()),
+      hidden_size);
+}
@@ -12,9 +12,13 @@
 // }
 
 #include "gemm_cuda.h"
+#include "../gemm_epilogue.cuh"
+#include "../gemm_prologue.cuh"
 #include <cuda_fp16.h>
 #include <cuda_pipeline_primitives.h>
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../../launch_plan_utils.h"
 
 #define OP_M 16
 #define OP_N 8
@@ -37,6 +41,10 @@
   constexpr int kSmemByteSize =                                                                              \
       ((CTA_M * (CTA_K + SMEM_PAD_A) + CTA_N * (CTA_K + SMEM_PAD_B) / 2) * STAGES + SCALES_SMEM_SIZE) *      \
       sizeof(int8_t);                                                                                        \
+  constexpr int kEpilogueSmemByteSize = CTA_M * CTA_N * sizeof(half);                                        \
+  const int smem_byte_size = (epilogue & GEMM_EPILOGUE_SILU_AND_MUL) && kEpilogueSmemByteSize > kSmemByteSize \
+                                 ? kEpilogueSmemByteSize                                                     \
+                                 : kSmemByteSize;                                                            \
   if (kSmemByteSize >= 99 * 1024)                                                                            \
   {                                                                                                          \
     printf("This kernel requires %d Bytes of shared memory, which exceeds "                                  \
@@ -46,18 +54,57 @@
   }                                                                                                          \
   int num_blocks_m = (num_out_feats + CTA_M - 1) / CTA_M;                                                    \
   int num_blocks_n = num_out_channels / CTA_N / 1;                                                           \
-  const int log_tile = get_log_tile<8>((num_out_feats + CTA_M - 1) / CTA_M);                                 \
+  const int log_tile = expert_offsets == nullptr ? get_log_tile<8>(num_blocks_m) : 0;                        \
+  /* Each expert can leave one partial M tile. */                                                            \
+  if (expert_offsets != nullptr)                                                                             \
+    num_blocks_m += num_experts;                                                                             \
   const int tile_shift = 1 << log_tile;                                                                      \
   dim3 num_blocks(num_blocks_n *tile_shift,                                                                  \
                   (num_blocks_m + tile_shift - 1) / tile_shift);                                             \
   dim3 threads_per_block(WARP_SIZE, NUM_WARPS);                                                              \
-  auto kernel_func =                                                                                         \
-      dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G>;                                 \
-  cudaFuncSetAttribute(kernel_func, cudaFuncAttributeMaxDynamicSharedMemorySize,                             \
-                       kSmemByteSize);                                                                       \
-  kernel_func<<<num_blocks, threads_per_block, kSmemByteSize>>>(                                             \
-      in_feats, kernel, wscales, ascales, w_szs, a_ssums, out_feats, num_in_feats, num_out_channels,       \
-       num_in_channels);
+  auto kernel_func = in_feats_fp16 != nullptr                                                                \
+                         ? dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G, true>       \
+                         : dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G, false>;     \
+  omniserve::cached_set_max_dynamic_smem(kernel_func, smem_byte_size);                                       \
+  kernel_func<<<num_blocks, threads_per_block, smem_byte_size, stream>>>(                                    \
+      in_feats, kernel, in_feats_fp16, wscales, ascales, w_szs, a_ssums, out_feats, residual, row_stats,     \
+      expert_offsets, num_experts, num_in_feats, num_out_channels, num_in_channels, epilogue);
+
+// Precompiled tile configurations that can be requested through config_id (e.g. by the autotuner).
+// X(ID, CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES)
+#define GEMM_TILE_CONFIGS(X) \
+  X(0, 128, 128, 64, 64, 32, 64, 3) \
+  X(1, 128, 64, 64, 64, 32, 64, 4) \
+  X(2, 64, 64, 64, 32, 32, 64, 4) \
+  X(3, 64, 64, 128, 32, 32, 64, 3) \
+  X(4, 32, 64, 128, 32, 32, 64, 3) \
+  X(5, 64, 128, 64, 32, 32, 64, 3) \
+  X(6, 32, 64, 128, 32, 32, 64, 4) \
+  X(7, 32, 64, 64, 32, 32, 64, 4)
+
+#define GEMM_TILE_CONFIG_CASE(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_)              \
+  case ID:                                                                                             \
+  {                                                                                                    \
+    constexpr int CTA_M = CTA_M_;                                                                      \
+    constexpr int CTA_N = CTA_N_;                                                                      \
+    constexpr int CTA_K = CTA_K_;                                                                      \
+    constexpr int WARP_M = WARP_M_;                                                                    \
+    constexpr int WARP_N = WARP_N_;                                                                    \
+    constexpr int WARP_K = WARP_K_;                                                                    \
+    constexpr int STAGES = STAGES_;                                                                    \
+    TORCH_CHECK(num_out_channels % CTA_N == 0 && num_in_channels % CTA_K == 0,                         \
+                "GEMM tile config ", ID, " does not divide N=", num_out_channels, " K=", num_in_channels); \
+    KERNEL_LAUNCH_CODE                                                                                 \
+    break;                                                                                             \
+  }
+
+#define GEMM_TILE_CONFIG_ROW(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_) \
+  {CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_},
+
+std::vector<std::vector<int>> gemm_tile_configs()
+{
+  return {GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_ROW)};
+}
 
 template <int N>
 __inline__ __host__ __device__ int get_log_tile(int n)
@@ -305,12 +352,17 @@ share_to_reg_one_stage_B(int8_t *src, int8_t *dst, int8_t *zeros, int8_t *scales
   }
 }
 
+// QUANT_A: A_fp16 replaces A and is quantized per token in the prologue (gemm_prologue.cuh); ascales / a_ssums are
+// outputs then, written by the CTAs of the first N tile. Not supported with expert_offsets.
 template <int CTA_M, int CTA_N, int CTA_K, int WARP_M, int WARP_N, int WARP_K,
-          int STAGES, int G>
+          int STAGES, int G, bool QUANT_A>
 __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
+                              const half *__restrict__ A_fp16,
                               half2 *__restrict__ wscales, half *__restrict__ ascales,
                               half2 *__restrict__ w_szs, half *__restrict__ a_ssums,
-                              half *__restrict__ C, int M, int64_t N, int64_t K)
+                              half *__restrict__ C, const half *__restrict__ R,
+                              float *__restrict__ row_stats, const int *__restrict__ expert_offsets,
+                              int num_experts, int M, int64_t N, int64_t K, int epilogue)
 {
   constexpr int SPLITK = 1;
   constexpr int NUM_WARPS_MN = CTA_M / WARP_M * CTA_N / WARP_N;
@@ -323,11 +375,44 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
 
   int blockIdx_n = blockIdx.x;
   int blockIdx_m = blockIdx.y;
-  const int log_tile = get_log_tile<8>((M + CTA_M - 1) / CTA_M);
-  const uint2 block_idx_mapping =
-      get_block_idx_mapping(blockIdx_n, blockIdx_m, log_tile);
-  blockIdx_n = block_idx_mapping.x;
-  blockIdx_m = block_idx_mapping.y;
+  if (expert_offsets == nullptr)
+  {
+    const int log_tile = get_log_tile<8>((M + CTA_M - 1) / CTA_M);
+    const uint2 block_idx_mapping =
+        get_block_idx_mapping(blockIdx_n, blockIdx_m, log_tile);
+    blockIdx_n = block_idx_mapping.x;
+    blockIdx_m = block_idx_mapping.y;
+  }
+  else
+  {
+    // Grouped GEMM: the rows of A are sorted by expert and blockIdx.y enumerates the M tiles of all
+    // experts back to back. The grid is sized for the worst case, surplus CTAs exit here.
+    int expert = 0;
+    int row_begin = 0;
+    for (; expert < num_experts; ++expert)
+    {
+      row_begin = expert_offsets[expert];
+      int expert_blocks_m = (expert_offsets[expert + 1] - row_begin + CTA_M - 1) / CTA_M;
+      if (blockIdx_m < expert_blocks_m)
+        break;
+      blockIdx_m -= expert_blocks_m;
+    }
+    if (expert == num_experts)
+      return;
+    M = expert_offsets[expert + 1] - row_begin;
+    const int64_t ldc = (epilogue & GEMM_EPILOGUE_SILU_AND_MUL) ? N / 2 : N;
+    A += row_begin * K;
+    ascales += row_begin;
+    a_ssums += row_begin;
+    C += row_begin * ldc;
+    if (R != nullptr)
+      R += row_begin * N;
+    if (row_stats != nullptr)
+      row_stats += row_begin * 2;
+    B += expert * N * K / 2;
+    wscales += expert * N / 2;
+    w_szs += expert * N / 2;
+  }
 
   int C_warp[CTA_M * CTA_N / CTA_SIZE_MN];
   constexpr int kSmemPadKA = CTA_K + SMEM_PAD_A;
@@ -402,14 +487,27 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
     A_g2s_preds[i] = (cta_offset_m + A_hoisted_row + i * A_src_step_m) < M;
   }
 
+  __shared__ float s_quant_mul[QUANT_A ? CTA_M : 1];
+  __shared__ half s_ascales[QUANT_A ? CTA_M : 1];
+  __shared__ half s_a_ssums[QUANT_A ? CTA_M : 1];
+  const half *A_fp16_hoisted = A_fp16 + cta_offset_m * K + A_hoisted_row * K + A_hoisted_col * PACK_SIZE;
+  if constexpr (QUANT_A)
+    gemm_prologue_row_stats<CTA_M, NUM_WARPS>(A_fp16, s_quant_mul, s_ascales, s_a_ssums, ascales, a_ssums,
+                                              cta_offset_m, M, K, blockIdx_n == 0);
+
   int *C_shared = reinterpret_cast<int *>(mem_shared);
 
 #pragma unroll
   for (k_0_0_ld = 0; k_0_0_ld < prologue_stages; ++k_0_0_ld)
   {
-    global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
-        A_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K,
-        cta_offset_m, cta_offset_n, k_0_0_ld, 0, true, A_g2s_preds);
+    if constexpr (QUANT_A)
+      global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, 1, kSmemPadKA>(
+          A_fp16_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K, A_hoisted_row,
+          k_0_0_ld, 0, true, A_g2s_preds, s_quant_mul);
+    else
+      global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
+          A_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K,
+          cta_offset_m, cta_offset_n, k_0_0_ld, 0, true, A_g2s_preds);
     global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
         B_hoisted, B_shared_hoisted + k_0_0_ld * kSmemSizeBPerStage, K,
         cta_offset_m, cta_offset_n, k_0_0_ld, 0, true);
@@ -478,11 +576,14 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
       {
         if constexpr (STAGES == 1)
           __syncthreads();
-        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
-                                    WARP_K / INTRIN_K, STAGES>(
-            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
-            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k,
-            k_0_0_ld < gemm_iters, A_g2s_preds);
+        if constexpr (QUANT_A)
+          global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, kSmemPadKA>(
+              A_fp16_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K, A_hoisted_row,
+              k_0_0_ld, iter_k, k_0_0_ld < gemm_iters, A_g2s_preds, s_quant_mul);
+        else
+          global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, STAGES>(
+              A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+              cta_offset_m, cta_offset_n, k_0_0_ld, iter_k, k_0_0_ld < gemm_iters, A_g2s_preds);
         global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
                                     WARP_K / INTRIN_K, STAGES>(
             B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
@@ -496,11 +597,14 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
         {
           __syncthreads();
         }
-        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
-                                    WARP_K / INTRIN_K, STAGES>(
-            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
-            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1,
-            k_0_0_ld < gemm_iters, A_g2s_preds);
+        if constexpr (QUANT_A)
+          global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, kSmemPadKA>(
+              A_fp16_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K, A_hoisted_row,
+              k_0_0_ld, iter_k + 1, k_0_0_ld < gemm_iters, A_g2s_preds, s_quant_mul);
+        else
+          global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, STAGES>(
+              A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+              cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1, k_0_0_ld < gemm_iters, A_g2s_preds);
         global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
                                     WARP_K / INTRIN_K, STAGES>(
             B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
@@ -566,17 +670,28 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
     }
   }
 
+  const bool silu_and_mul = epilogue & GEMM_EPILOGUE_SILU_AND_MUL;
+  // The SiLU-and-mul tile reuses the shared memory of the slice reduction above.
+  if (SLICES > 1 && silu_and_mul)
+    __syncthreads();
+  half *C_tile = reinterpret_cast<half *>(mem_shared);
+  float row_amax[WARP_M / INTRIN_M][2] = {};
+  float row_sum[WARP_M / INTRIN_M][2] = {};
+
   int row_wb_thd = cta_offset_m + warp_offset_m + (threadIdx.x / 4);
   int col_wb_thd = cta_offset_n + warp_offset_n + (threadIdx.x % 4) * 2;
   if (slice_id == 0)
   {
+#pragma unroll
     for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
     {
       int row_wb_1 = row_wb_thd + ax0_0_1 * OP_M;
+#pragma unroll
       for (int ax1_0_1 = 0; ax1_0_1 < WARP_N / INTRIN_N; ++ax1_0_1)
       {
         int col_wb_1 = col_wb_thd + ax1_0_1 * 16;
         int *C_warp_local = C_warp + ax0_0_1 * WARP_N / INTRIN_N * 8 + ax1_0_1 * 8;
+#pragma unroll
         for (int local_id = 0; local_id < OP_M * 16 / WARP_SIZE; local_id += 2)
         {
           int row_wb = row_wb_1 + (local_id % 4) / 2 * 8;
@@ -585,42 +700,99 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
             int col_wb = col_wb_1 + (local_id / 4) * 8 + (local_id % 2);
             float2 wscale = __half22float2(*(wscales + col_wb / 2));
             float2 w_sz = __half22float2(*(w_szs + col_wb / 2));
-            float ascale = __half2float(ascales[row_wb]);
-            float a_ssum = __half2float(a_ssums[row_wb]);
+            // With QUANT_A, other CTAs may still be writing ascales / a_ssums.
+            float ascale = __half2float(QUANT_A ? s_ascales[row_wb - cta_offset_m] : ascales[row_wb]);
+            float a_ssum = __half2float(QUANT_A ? s_a_ssums[row_wb - cta_offset_m] : a_ssums[row_wb]);
             float2 psums = make_float2(__int2float_rn(C_warp_local[local_id]), __int2float_rn(C_warp_local[local_id + 1]));
             psums.x = psums.x * wscale.x * ascale - w_sz.x * a_ssum;
             psums.y = psums.y * wscale.y * ascale - w_sz.y * a_ssum;
-            *reinterpret_cast<half2 *>(C + row_wb * N + col_wb) = __float22half2_rn(psums);
+            half2 out = __float22half2_rn(psums);
+            if (silu_and_mul)
+            {
+              *reinterpret_cast<half2 *>(C_tile + (row_wb - cta_offset_m) * CTA_N + col_wb - cta_offset_n) = out;
+              continue;
+            }
+            if (epilogue & GEMM_EPILOGUE_RESIDUAL)
+              out = __hadd2(out, *reinterpret_cast<const half2 *>(R + row_wb * N + col_wb));
+            *reinterpret_cast<half2 *>(C + row_wb * N + col_wb) = out;
+            gemm_epilogue_row_stats_update(row_amax[ax0_0_1][(local_id % 4) / 2], row_sum[ax0_0_1][(local_id % 4) / 2], out);
           }
         };
       }
     }
+    if (row_stats != nullptr && !silu_and_mul)
+    {
+      // Lanes 4i..4i+3 share two rows per ax0_0_1.
+#pragma unroll
+      for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+      {
+#pragma unroll
+        for (int h = 0; h < 2; ++h)
+        {
+          gemm_epilogue_row_stats_reduce(row_amax[ax0_0_1][h], row_sum[ax0_0_1][h], 1, 4);
+          int row_wb = row_wb_thd + ax0_0_1 * OP_M + h * 8;
+          if (threadIdx.x % 4 == 0 && row_wb < M)
+            gemm_epilogue_row_stats_commit(row_stats, row_wb, row_amax[ax0_0_1][h], row_sum[ax0_0_1][h]);
+        }
+      }
+    }
+  }
+  if (silu_and_mul)
+  {
+    __syncthreads();
+    gemm_epilogue_silu_and_mul_tile<CTA_M, CTA_N, NUM_WARPS>(C_tile, C, row_stats, cta_offset_m, cta_offset_n,
+                                                             M, N / 2);
   }
 }
 
-void gemm_forward_cuda(torch::Tensor _in_feats,
-                        torch::Tensor _kernel,
-                        torch::Tensor _wscales,
-                        torch::Tensor _ascales,
-                        torch::Tensor _w_szs,
-                        torch::Tensor _a_ssums,
-                        torch::Tensor _out_feats)
+static void gemm_forward_impl(torch::Tensor _in_feats,
+                              torch::Tensor _kernel,
+                              torch::Tensor _wscales,
+                              torch::Tensor _ascales,
+                              torch::Tensor _w_szs,
+                              torch::Tensor _a_ssums,
+                              torch::Tensor _out_feats,
+                              const half *residual,
+                              float *row_stats,
+                              const int *expert_offsets,
+                              int num_experts,
+                              int epilogue,
+                              int config_id)
 {
   int num_in_feats = _in_feats.size(0);
   int num_in_channels = _in_feats.size(1);
-  auto in_feats = reinterpret_cast<int8_t *>(_in_feats.data_ptr<int8_t>());
+  // fp16 in_feats are quantized in the GEMM prologue, ascales / a_ssums receive their scales and sums.
+  const bool quant_a = _in_feats.scalar_type() == at::ScalarType::Half;
+  TORCH_CHECK(!quant_a || expert_offsets == nullptr, "The grouped GEMM needs int8 in_feats");
+  auto in_feats = quant_a ? nullptr : reinterpret_cast<int8_t *>(_in_feats.data_ptr<int8_t>());
+  auto in_feats_fp16 = quant_a ? reinterpret_cast<const half *>(_in_feats.data_ptr<at::Half>()) : nullptr;
   auto kernel = reinterpret_cast<int8_t *>(_kernel.data_ptr<int8_t>());
   auto w_szs = reinterpret_cast<half2 *>(_w_szs.data_ptr());
   auto a_ssums = reinterpret_cast<half *>(_a_ssums.data_ptr());
   auto wscales = reinterpret_cast<half2 *>(_wscales.data_ptr());
   auto ascales = reinterpret_cast<half *>(_ascales.data_ptr());
   int num_out_feats = _out_feats.size(-2);
-  int num_out_channels = _out_feats.size(-1);
+  // The SiLU-and-mul epilogue writes one output per gate / up pair.
+  int num_out_channels = _out_feats.size(-1) * ((epilogue & GEMM_EPILOGUE_SILU_AND_MUL) ? 2 : 1);
   auto out_feats = reinterpret_cast<half *>(_out_feats.data_ptr<at::Half>());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
   constexpr int G = 128;
 
-  if (num_out_feats > 256)
+  if (config_id >= 0)
+  {
+    switch (config_id)
+    {
+      GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_CASE)
+    default:
+      TORCH_CHECK(false, "Invalid GEMM tile config ", config_id);
+    }
+    return ;
+  }
+
+  // Grouped GEMMs pick the tile from the average number of rows per expert.
+  const int num_rows_per_gemm = expert_offsets == nullptr ? num_out_feats : num_out_feats / num_experts;
+  if (num_rows_per_gemm > 256)
   {
     constexpr int CTA_M = 128;
     constexpr int CTA_N = 128;
@@ -631,7 +803,7 @@ void gemm_forward_cuda(torch::Tensor _in_feats,
     constexpr int STAGES = 3;
     KERNEL_LAUNCH_CODE
   }
-  else if (num_out_feats >= 128)
+  else if (num_rows_per_gemm >= 128)
   {
     constexpr int CTA_M = 64;
     constexpr int CTA_N = 64;
@@ -655,3 +827,97 @@ void gemm_forward_cuda(torch::Tensor _in_feats,
   }
   return ;
 }
+
+void gemm_forward_cuda(torch::Tensor _in_feats,
+                        torch::Tensor _kernel,
+                        torch::Tensor _wscales,
+                        torch::Tensor _ascales,
+                        torch::Tensor _w_szs,
+                        torch::Tensor _a_ssums,
+                        torch::Tensor _out_feats,
+                        int config_id)
+{
+  gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _w_szs, _a_ssums, _out_feats, nullptr, nullptr,
+                    nullptr, 0, GEMM_EPILOGUE_NONE, config_id);
+}
+
+void gemm_epilogue_forward_cuda(torch::Tensor _in_feats,
+                                torch::Tensor _kernel,
+                                torch::Tensor _wscales,
+                                torch::Tensor _ascales,
+                                torch::Tensor _w_szs,
+                                torch::Tensor _a_ssums,
+                                torch::Tensor _out_feats,
+                                int epilogue,
+                                c10::optional<torch::Tensor> _residual,
+                                c10::optional<torch::Tensor> _quant_out,
+                                c10::optional<torch::Tensor> _quant_scale,
+                                c10::optional<torch::Tensor> _quant_sum,
+                                int config_id)
+{
+  torch::Tensor _row_stats = gemm_epilogue_prepare(_out_feats, epilogue, _residual, _quant_out, _quant_scale);
+  const half *residual = (epilogue & GEMM_EPILOGUE_RESIDUAL)
+                             ? reinterpret_cast<const half *>(_residual->data_ptr<at::Half>())
+                             : nullptr;
+  float *row_stats = _row_stats.defined() ? _row_stats.data_ptr<float>() : nullptr;
+  gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _w_szs, _a_ssums, _out_feats, residual, row_stats,
+                    nullptr, 0, epilogue, config_id);
+  if (row_stats != nullptr)
+    gemm_epilogue_quant(_out_feats, _row_stats, *_quant_out, *_quant_scale, _quant_sum,
+                        at::cuda::getCurrentCUDAStream());
+}
+
+void grouped_gemm_forward_cuda(torch::Tensor _in_feats,
+                               torch::Tensor _kernel,
+                               torch::Tensor _wscales,
+                               torch::Tensor _ascales,
+                               torch::Tensor _w_szs,
+                               torch::Tensor _a_ssums,
+                               torch::Tensor _expert_offsets,
+                               torch::Tensor _out_feats,
+                               int epilogue,
+                               c10::optional<torch::Tensor> _residual,
+                               c10::optional<torch::Tensor> _quant_out,
+                               c10::optional<torch::Tensor> _quant_scale,
+                               c10::optional<torch::Tensor> _quant_sum,
+                               int config_id)
+{
+  int num_experts = _kernel.size(0);
+  TORCH_CHECK(_kernel.dim() == 3 && _wscales.dim() == 2 && _w_szs.dim() == 2,
+              "Grouped GEMM weights must be stacked per expert");
+  TORCH_CHECK(_expert_offsets.scalar_type() == torch::kInt32 && _expert_offsets.numel() == num_experts + 1,
+              "expert_offsets must hold num_experts + 1 int32 row offsets");
+  TORCH_CHECK(_in_feats.size(0) == _out_feats.size(-2), "in_feats and out_feats must have the same rows");
+  torch::Tensor _row_stats = gemm_epilogue_prepare(_out_feats, epilogue, _residual, _quant_out, _quant_scale);
+  const half *residual = (epilogue & GEMM_EPILOGUE_RESIDUAL)
+                             ? reinterpret_cast<const half *>(_residual->data_ptr<at::Half>())
+                             : nullptr;
+  float *row_stats = _row_stats.defined() ? _row_stats.data_ptr<float>() : nullptr;
+  gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _w_szs, _a_ssums, _out_feats, residual, row_stats,
+                    _expert_offsets.data_ptr<int>(), num_experts, epilogue, config_id);
+  if (row_stats != nullptr)
+    gemm_epilogue_quant(_out_feats, _row_stats, *_quant_out, *_quant_scale, _quant_sum,
+                        at::cuda::getCurrentCUDAStream());
+}
+
+void gemm_quant_a_forward_cuda(torch::Tensor _in_feats,
+                               torch::Tensor _kernel,
+                               torch::Tensor _wscales,
+                               torch::Tensor _ascales,
+                               torch::Tensor _w_szs,
+                               torch::Tensor _a_ssums,
+                               torch::Tensor _out_feats,
+                               int epilogue,
+                               c10::optional<torch::Tensor> _residual,
+                               c10::optional<torch::Tensor> _quant_out,
+                               c10::optional<torch::Tensor> _quant_scale,
+                               c10::optional<torch::Tensor> _quant_sum,
+                               int config_id)
+{
+  TORCH_CHECK(_in_feats.scalar_type() == at::ScalarType::Half && _in_feats.is_contiguous(),
+              "in_feats must be contiguous fp16");
+  TORCH_CHECK(_ascales.numel() >= _in_feats.size(0) && _a_ssums.numel() >= _in_feats.size(0),
+              "ascales and a_ssums must hold one entry per row");
+  gemm_epilogue_forward_cuda(_in_feats, _kernel, _wscales, _ascales, _w_szs, _a_ssums, _out_feats, epilogue,
+                             _residual, _quant_out, _quant_scale, _quant_sum, config_id);
+}
@@ -12,5 +12,22 @@
 // }
 
 #include <torch/extension.h>
+#include "../gemm_epilogue.h"
 
-void gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _out_feats);
+void gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _out_feats, int config_id = -1);
+
+// CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES of every config_id accepted above.
+// Same GEMM with the fused epilogues of gemm_epilogue.cuh (epilogue is a GEMM_EPILOGUE_* bit mask).
+// If quant_out is given, out_feats is additionally quantized per token into quant_out / quant_scale
+// (and its row sum into quant_sum) from row stats accumulated in the epilogue.
+void gemm_epilogue_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _out_feats, int epilogue, c10::optional<torch::Tensor> _residual, c10::optional<torch::Tensor> _quant_out, c10::optional<torch::Tensor> _quant_scale, c10::optional<torch::Tensor> _quant_sum, int config_id = -1);
+
+// Grouped (MoE) variant: the rows of in_feats are sorted by expert, rows [expert_offsets[e], expert_offsets[e + 1])
+// are multiplied with kernel[e] (E x N x K / 2, scales E x N). expert_offsets stays on the device.
+void grouped_gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _expert_offsets, torch::Tensor _out_feats, int epilogue, c10::optional<torch::Tensor> _residual, c10::optional<torch::Tensor> _quant_out, c10::optional<torch::Tensor> _quant_scale, c10::optional<torch::Tensor> _quant_sum, int config_id = -1);
+
+// Same GEMM (and epilogues) on fp16 in_feats, quantized per token in the GEMM prologue instead of by
+// invoke_quant_fuse_sum: ascales / a_ssums are outputs and receive the same scales / row sums.
+void gemm_quant_a_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _w_szs, torch::Tensor _a_ssums, torch::Tensor _out_feats, int epilogue, c10::optional<torch::Tensor> _residual, c10::optional<torch::Tensor> _quant_out, c10::optional<torch::Tensor> _quant_scale, c10::optional<torch::Tensor> _quant_sum, int config_id = -1);
+
+std::vector<std::vector<int>> gemm_tile_configs();
@@ -14,8 +14,31 @@
 #include <pybind11/pybind11.h>
 #include <torch/extension.h>
 #include "gemm_cuda.h"
+#include "../../nvtx_utils.h"
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
-    m.def("gemm_forward_cuda", &gemm_forward_cuda, "our sparse conv kernel");
+    m.def("gemm_forward_cuda", omniserve::nvtx_wrap("gemm_forward_cuda", &gemm_forward_cuda), "our sparse conv kernel",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("w_szs"),
+          py::arg("a_ssums"), py::arg("out_feats"), py::arg("config_id") = -1);
+    m.def("gemm_epilogue_forward_cuda", omniserve::nvtx_wrap("gemm_epilogue_forward_cuda", &gemm_epilogue_forward_cuda), "our w4a8 gemm kernel with fused epilogues",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("w_szs"),
+          py::arg("a_ssums"), py::arg("out_feats"), py::arg("epilogue"), py::arg("residual") = py::none(),
+          py::arg("quant_out") = py::none(), py::arg("quant_scale") = py::none(), py::arg("quant_sum") = py::none(),
+          py::arg("config_id") = -1);
+    m.def("gemm_quant_a_forward_cuda", omniserve::nvtx_wrap("gemm_quant_a_forward_cuda", &gemm_quant_a_forward_cuda),
+          "our w4a8 gemm kernel on fp16 inputs, quantized per token in the prologue",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("w_szs"),
+          py::arg("a_ssums"), py::arg("out_feats"), py::arg("epilogue") = 0, py::arg("residual") = py::none(),
+          py::arg("quant_out") = py::none(), py::arg("quant_scale") = py::none(), py::arg("quant_sum") = py::none(),
+          py::arg("config_id") = -1);
+    m.def("grouped_gemm_forward_cuda", omniserve::nvtx_wrap("grouped_gemm_forward_cuda", &grouped_gemm_forward_cuda), "our w4a8 grouped gemm kernel for MoE experts",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("w_szs"),
+          py::arg("a_ssums"), py::arg("expert_offsets"), py::arg("out_feats"), py::arg("epilogue") = 0,
+          py::arg("residual") = py::none(), py::arg("quant_out") = py::none(), py::arg("quant_scale") = py::none(),
+          py::arg("quant_sum") = py::none(), py::arg("config_id") = -1);
+    m.def("gemm_tile_configs", omniserve::nvtx_wrap("gemm_tile_configs", &gemm_tile_configs), "tile configs selectable through config_id");
+    m.attr("EPILOGUE_RESIDUAL") = GEMM_EPILOGUE_RESIDUAL;
+    m.attr("EPILOGUE_SILU_AND_MUL") = GEMM_EPILOGUE_SILU_AND_MUL;
+    m.attr("EPILOGUE_GLU_BLOCK") = GEMM_EPILOGUE_GLU_BLOCK;
 }
@@ -12,9 +12,12 @@
 // }
 
 #include "gemm_cuda.h"
+#include "../gemm_prologue.cuh"
 #include <cuda_fp16.h>
 #include <cuda_pipeline_primitives.h>
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../../launch_plan_utils.h"
 
 #define OP_M 16
 #define OP_N 8
@@ -48,16 +51,71 @@
   int num_blocks_n = num_out_channels / CTA_N / 1;                                                           \
   const int log_tile = get_log_tile<8>((num_out_feats + CTA_M - 1) / CTA_M);                                 \
   const int tile_shift = 1 << log_tile;                                                                      \
+  const int k_iters = (num_in_channels + CTA_K - 1) / CTA_K;                                                 \
+  const int k_iters_per_split = get_k_iters_per_split(                                                       \
+      num_blocks_n * num_blocks_m, k_iters, G > CTA_K ? G / CTA_K : 1, split_k);                             \
+  const int num_splits = (k_iters + k_iters_per_split - 1) / k_iters_per_split;                              \
   dim3 num_blocks(num_blocks_n *tile_shift,                                                                  \
-                  (num_blocks_m + tile_shift - 1) / tile_shift);                                             \
+                  (num_blocks_m + tile_shift - 1) / tile_shift, num_splits);                                 \
   dim3 threads_per_block(WARP_SIZE, NUM_WARPS);                                                              \
-  auto kernel_func =                                                                                         \
-      dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G>;                                 \
-  cudaFuncSetAttribute(kernel_func, cudaFuncAttributeMaxDynamicSharedMemorySize,                             \
-                       kSmemByteSize);                                                                       \
-  kernel_func<<<num_blocks, threads_per_block, kSmemByteSize>>>(                                             \
-      in_feats, kernel, zeros, scales_i8, wscales, ascales, out_feats, num_in_feats, num_out_channels,       \
-      num_in_channels);
+  torch::Tensor _partial_out;                                                                                \
+  int *partial_out = nullptr;                                                                                \
+  if (num_splits > 1)                                                                                        \
+  {                                                                                                          \
+    _partial_out = torch::empty({num_splits, num_in_feats, num_out_channels},                                \
+                                _in_feats.options().dtype(torch::kInt32));                                   \
+    partial_out = _partial_out.data_ptr<int>();                                                              \
+  }                                                                                                          \
+  auto kernel_func = in_feats_fp16 != nullptr                                                                \
+                         ? dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G, true>       \
+                         : dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES, G, false>;     \
+  omniserve::cached_set_max_dynamic_smem(kernel_func, kSmemByteSize);                                        \
+  kernel_func<<<num_blocks, threads_per_block, kSmemByteSize, stream>>>(                                     \
+      in_feats, kernel, in_feats_fp16, zeros, scales_i8, wscales, ascales, out_feats, partial_out,           \
+      num_in_feats, num_out_channels, num_in_channels, k_iters_per_split);                                   \
+  if (num_splits > 1)                                                                                        \
+  {                                                                                                          \
+    const int64_t num_pairs = (int64_t)num_in_feats * num_out_channels / 2;                                  \
+    splitk_reduce_kernel<<<(num_pairs + 255) / 256, 256, 0, stream>>>(                                       \
+        reinterpret_cast<int2 *>(partial_out), wscales, ascales, reinterpret_cast<half2 *>(out_feats),       \
+        num_in_feats, num_out_channels, num_splits);                                                         \
+  }
+
+// Precompiled tile configurations that can be requested through config_id (e.g. by the autotuner).
+// X(ID, CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES)
+#define GEMM_TILE_CONFIGS(X) \
+  X(0, 128, 128, 64, 64, 32, 64, 3) \
+  X(1, 128, 64, 64, 64, 32, 64, 4) \
+  X(2, 64, 64, 64, 32, 32, 64, 4) \
+  X(3, 64, 64, 128, 32, 32, 64, 3) \
+  X(4, 32, 64, 128, 32, 32, 64, 3) \
+  X(5, 64, 128, 64, 32, 32, 64, 3) \
+  X(6, 32, 64, 128, 32, 32, 64, 4) \
+  X(7, 32, 64, 64, 32, 32, 64, 4)
+
+#define GEMM_TILE_CONFIG_CASE(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_)              \
+  case ID:                                                                                             \
+  {                                                                                                    \
+    constexpr int CTA_M = CTA_M_;                                                                      \
+    constexpr int CTA_N = CTA_N_;                                                                      \
+    constexpr int CTA_K = CTA_K_;                                                                      \
+    constexpr int WARP_M = WARP_M_;                                                                    \
+    constexpr int WARP_N = WARP_N_;                                                                    \
+    constexpr int WARP_K = WARP_K_;                                                                    \
+    constexpr int STAGES = STAGES_;                                                                    \
+    TORCH_CHECK(num_out_channels % CTA_N == 0 && num_in_channels % CTA_K == 0,                         \
+                "GEMM tile config ", ID, " does not divide N=", num_out_channels, " K=", num_in_channels); \
+    KERNEL_LAUNCH_CODE                                                                                 \
+    break;                                                                                             \
+  }
+
+#define GEMM_TILE_CONFIG_ROW(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_) \
+  {CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_},
+
+std::vector<std::vector<int>> gemm_tile_configs()
+{
+  return {GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_ROW)};
+}
 
 template <int N>
 __inline__ __host__ __device__ int get_log_tile(int n)
@@ -330,14 +388,17 @@ share_to_reg_one_stage_B(int8_t *src, int8_t *dst, int8_t *zeros, int8_t *scales
   }
 }
 
+// QUANT_A: A_fp16 replaces A and is quantized per token in the prologue (gemm_prologue.cuh); ascales is an
+// output then, written by the CTAs of the first N tile and K split.
 template <int CTA_M, int CTA_N, int CTA_K, int WARP_M, int WARP_N, int WARP_K,
-          int STAGES, int G>
+          int STAGES, int G, bool QUANT_A>
 __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
+                              const half *__restrict__ A_fp16,
                               int8_t *__restrict__ zeros, int8_t *__restrict__ scales_i8,
                               half2 *__restrict__ wscales, half *__restrict__ ascales,
-                              half *__restrict__ C, int M, int64_t N, int64_t K)
+                              half *__restrict__ C, int *__restrict__ C_partial,
+                              int M, int64_t N, int64_t K, int k_iters_per_split)
 {
-  constexpr int SPLITK = 1;
   constexpr int NUM_WARPS_MN = CTA_M / WARP_M * CTA_N / WARP_N;
   constexpr int NUM_WARPS = NUM_WARPS_MN * CTA_K / WARP_K;
   constexpr int CTA_SIZE = NUM_WARPS * WARP_SIZE;
@@ -397,7 +458,12 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
   for (int i = 0; i < CTA_M * CTA_N / CTA_SIZE_MN; i++)
     C_warp[i] = 0;
 
-  int gemm_iters = (K + CTA_K - 1) / CTA_K;
+  // Split-K: blockIdx.z owns main-loop iterations [k_iter_begin, k_iter_begin + gemm_iters).
+  // k_iter_begin * CTA_K is a multiple of G, so the slice starts on a quantization group.
+  int k_iter_begin = blockIdx.z * k_iters_per_split;
+  int gemm_iters = min(k_iters_per_split, (int)((K + CTA_K - 1) / CTA_K) - k_iter_begin);
+  zeros += k_iter_begin * CTA_K / G * N;
+  scales_i8 += k_iter_begin * CTA_K / G * N;
 
   int k_0_0_ld = 0;
   int k_0_0 = 0;
@@ -414,11 +480,11 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
       (threadIdx.y / B_warps_per_row) * kSmemPadKB * PACK_SIZE +
       threadIdx.x * PACK_SIZE;
   int8_t *A_hoisted = A + cta_offset_m * K + A_hoisted_row * K +
-                      A_hoisted_col * PACK_SIZE;
+                      A_hoisted_col * PACK_SIZE + k_iter_begin * CTA_K;
   int8_t *B_hoisted = B + cta_offset_n / 32 * K * PACK_SIZE +
                       (threadIdx.y % B_warps_per_row) * 32 * PACK_SIZE +
                       (threadIdx.y / B_warps_per_row) * K * PACK_SIZE +
-                      threadIdx.x * PACK_SIZE;
+                      threadIdx.x * PACK_SIZE + k_iter_begin * CTA_K * PACK_SIZE;
 
   bool A_g2s_preds[A_total_global_iters];
 #pragma unroll
@@ -427,17 +493,30 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
     A_g2s_preds[i] = (cta_offset_m + A_hoisted_row + i * A_src_step_m) < M;
   }
 
+  __shared__ float s_quant_mul[QUANT_A ? CTA_M : 1];
+  __shared__ half s_ascales[QUANT_A ? CTA_M : 1];
+  const half *A_fp16_hoisted = A_fp16 + cta_offset_m * K + A_hoisted_row * K + A_hoisted_col * PACK_SIZE +
+                               k_iter_begin * CTA_K;
+  if constexpr (QUANT_A)
+    gemm_prologue_row_stats<CTA_M, NUM_WARPS>(A_fp16, s_quant_mul, s_ascales, nullptr, ascales, nullptr,
+                                              cta_offset_m, M, K, blockIdx_n == 0 && blockIdx.z == 0);
+
   int *C_shared = reinterpret_cast<int *>(mem_shared);
 
 #pragma unroll
   for (k_0_0_ld = 0; k_0_0_ld < prologue_stages; ++k_0_0_ld)
   {
-    global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
-        A_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K,
-        cta_offset_m, cta_offset_n, k_0_0_ld, 0, true, A_g2s_preds);
+    if constexpr (QUANT_A)
+      global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, 1, kSmemPadKA>(
+          A_fp16_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K, A_hoisted_row,
+          k_0_0_ld, 0, k_0_0_ld < gemm_iters, A_g2s_preds, s_quant_mul);
+    else
+      global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
+          A_hoisted, A_shared_hoisted + k_0_0_ld * kSmemSizeAPerStage, K,
+          cta_offset_m, cta_offset_n, k_0_0_ld, 0, k_0_0_ld < gemm_iters, A_g2s_preds);
     global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE, 1, STAGES>(
         B_hoisted, B_shared_hoisted + k_0_0_ld * kSmemSizeBPerStage, K,
-        cta_offset_m, cta_offset_n, k_0_0_ld, 0, true);
+        cta_offset_m, cta_offset_n, k_0_0_ld, 0, k_0_0_ld < gemm_iters);
     global_to_share_one_stage_zeros<CTA_M, CTA_N, CTA_K, CTA_SIZE, STAGES, G>(
         zeros, zeros_shared + (k_0_0_ld)*CTA_N,
         N, cta_offset_m, cta_offset_n, k_0_0_ld, 0, k_0_0_ld < gemm_iters);
@@ -509,11 +588,14 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
       {
         if constexpr (STAGES == 1)
           __syncthreads();
-        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
-                                    WARP_K / INTRIN_K, STAGES>(
-            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
-            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k,
-            k_0_0_ld < gemm_iters, A_g2s_preds);
+        if constexpr (QUANT_A)
+          global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, kSmemPadKA>(
+              A_fp16_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K, A_hoisted_row,
+              k_0_0_ld, iter_k, k_0_0_ld < gemm_iters, A_g2s_preds, s_quant_mul);
+        else
+          global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, STAGES>(
+              A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+              cta_offset_m, cta_offset_n, k_0_0_ld, iter_k, k_0_0_ld < gemm_iters, A_g2s_preds);
         global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
                                     WARP_K / INTRIN_K, STAGES>(
             B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
@@ -527,11 +609,14 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
         {
           __syncthreads();
         }
-        global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE,
-                                    WARP_K / INTRIN_K, STAGES>(
-            A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
-            cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1,
-            k_0_0_ld < gemm_iters, A_g2s_preds);
+        if constexpr (QUANT_A)
+          global_to_share_one_stage_A_quant<CTA_M, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, kSmemPadKA>(
+              A_fp16_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K, A_hoisted_row,
+              k_0_0_ld, iter_k + 1, k_0_0_ld < gemm_iters, A_g2s_preds, s_quant_mul);
+        else
+          global_to_share_one_stage_A<CTA_M, CTA_N, CTA_K, CTA_SIZE, WARP_K / INTRIN_K, STAGES>(
+              A_hoisted, A_shared_hoisted + ld_stage * kSmemSizeAPerStage, K,
+              cta_offset_m, cta_offset_n, k_0_0_ld, iter_k + 1, k_0_0_ld < gemm_iters, A_g2s_preds);
         global_to_share_one_stage_B<CTA_M, CTA_N, CTA_K, CTA_SIZE,
                                     WARP_K / INTRIN_K, STAGES>(
             B_hoisted, B_shared_hoisted + ld_stage * kSmemSizeBPerStage, K,
@@ -619,8 +704,16 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
           if (row_wb < M)
           {
             int col_wb = col_wb_1 + (local_id / 4) * 8 + (local_id % 2);
+            if (C_partial != nullptr)
+            {
+              // Split-K: keep the exact int32 partial sums, scaled in splitk_reduce_kernel.
+              *reinterpret_cast<int2 *>(C_partial + (blockIdx.z * M + row_wb) * N + col_wb) =
+                  make_int2(C_warp_local[local_id], C_warp_local[local_id + 1]);
+              continue;
+            }
             float2 wscale = 	__half22float2(*(wscales + col_wb / 2));
-            float ascale = __half2float(ascales[row_wb]);
+            // With QUANT_A, other CTAs may still be writing ascales.
+            float ascale = __half2float(QUANT_A ? s_ascales[row_wb - cta_offset_m] : ascales[row_wb]);
             float2 psums = make_float2(__int2float_rn(C_warp_local[local_id]), __int2float_rn(C_warp_local[local_id + 1]));
             psums.x *= wscale.x * ascale;
             psums.y *= wscale.y * ascale;
@@ -632,17 +725,70 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
   }
 }
 
-void gemm_forward_cuda(torch::Tensor _in_feats,
-                        torch::Tensor _kernel,
-                        torch::Tensor _zeros,
-                        torch::Tensor _scales_i8,
-                        torch::Tensor _wscales,
-                        torch::Tensor _ascales,
-                        torch::Tensor _out_feats)
+// Sums the int32 split-K partials of dense_kernel0 and applies the same dequantization epilogue.
+// One thread per pair of output channels.
+__global__ void splitk_reduce_kernel(const int2 *__restrict__ C_partial, half2 *__restrict__ wscales,
+                                     half *__restrict__ ascales, half2 *__restrict__ C, int M,
+                                     int64_t N, int num_splits)
+{
+  int64_t idx = (int64_t)blockIdx.x * blockDim.x + threadIdx.x;
+  int64_t num_pairs = M * N / 2;
+  if (idx >= num_pairs)
+    return;
+  int row = idx / (N / 2);
+  int col_pair = idx % (N / 2);
+  int2 acc = C_partial[idx];
+  for (int z = 1; z < num_splits; ++z)
+  {
+    int2 partial = C_partial[z * num_pairs + idx];
+    acc.x += partial.x;
+    acc.y += partial.y;
+  }
+  float2 wscale = __half22float2(wscales[col_pair]);
+  float ascale = __half2float(ascales[row]);
+  float2 psums = make_float2(__int2float_rn(acc.x), __int2float_rn(acc.y));
+  psums.x *= wscale.x * ascale;
+  psums.y *= wscale.y * ascale;
+  C[idx] = __float22half2_rn(psums);
+}
+
+// Decode-time M gives too few M x N tiles to fill the device (e.g. 64 CTAs for N = 4096,
+// CTA_N = 64). In that case K is split over blockIdx.z so that the grid covers every SM.
+// Returns the number of main-loop iterations per split; a multiple of k_iters_align.
+// split_k < 0 selects the number of splits automatically, 1 disables split-K.
+inline int get_k_iters_per_split(int num_ctas, int k_iters, int k_iters_align, int split_k)
+{
+  constexpr int kMinItersPerSplit = 4;
+  constexpr int kMaxSplitK = 8;
+  if (split_k < 0)
+  {
+    const int num_sms = at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+    split_k = 1;
+    if (num_ctas < num_sms)
+      split_k = std::min((num_sms + num_ctas - 1) / num_ctas, std::max(k_iters / kMinItersPerSplit, 1));
+    split_k = std::min(split_k, kMaxSplitK);
+  }
+  TORCH_CHECK(split_k >= 1, "split_k must be positive or -1 (auto), got ", split_k);
+  int k_iters_per_split = (k_iters + split_k - 1) / split_k;
+  return (k_iters_per_split + k_iters_align - 1) / k_iters_align * k_iters_align;
+}
+
+static void gemm_forward_impl(torch::Tensor _in_feats,
+                              torch::Tensor _kernel,
+                              torch::Tensor _zeros,
+                              torch::Tensor _scales_i8,
+                              torch::Tensor _wscales,
+                              torch::Tensor _ascales,
+                              torch::Tensor _out_feats,
+                              int config_id,
+                              int split_k)
 {
   int num_in_feats = _in_feats.size(0);
   int num_in_channels = _in_feats.size(1);
-  auto in_feats = reinterpret_cast<int8_t *>(_in_feats.data_ptr<int8_t>());
+  // fp16 in_feats are quantized in the GEMM prologue, ascales receives their scales.
+  const bool quant_a = _in_feats.scalar_type() == at::ScalarType::Half;
+  auto in_feats = quant_a ? nullptr : reinterpret_cast<int8_t *>(_in_feats.data_ptr<int8_t>());
+  auto in_feats_fp16 = quant_a ? reinterpret_cast<const half *>(_in_feats.data_ptr<at::Half>()) : nullptr;
   auto kernel = reinterpret_cast<int8_t *>(_kernel.data_ptr<int8_t>());
   auto zeros = reinterpret_cast<int8_t *>(_zeros.data_ptr<int8_t>());
   auto scales_i8 = reinterpret_cast<int8_t *>(_scales_i8.data_ptr<int8_t>());
@@ -653,9 +799,25 @@ void gemm_forward_cuda(torch::Tensor _in_feats,
   int num_out_feats = _out_feats.size(-2);
   int num_out_channels = _out_feats.size(-1);
   auto out_feats = reinterpret_cast<half *>(_out_feats.data_ptr<at::Half>());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
   constexpr int G = 128;
 
+  if (config_id >= 0)
+  {
+    switch (config_id)
+    {
+      GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_CASE)
+    default:
+      TORCH_CHECK(false, "Invalid GEMM tile config ", config_id);
+    }
+    return ;
+  }
+
+  // sm_90: TMA / wgmma mainloop for prefill-sized M. split_k > 1 explicitly asks for dense_kernel0.
+  if (!quant_a && split_k <= 1 && gemm_forward_cuda_sm90(_in_feats, _kernel, _zeros, _scales_i8, _wscales, _ascales, _out_feats))
+    return ;
+
   if (num_out_feats > 128)
   {
     constexpr int CTA_M = 128;
@@ -705,3 +867,33 @@ void gemm_forward_cuda(torch::Tensor _in_feats,
   }
   return ;
 }
+
+void gemm_forward_cuda(torch::Tensor _in_feats,
+                        torch::Tensor _kernel,
+                        torch::Tensor _zeros,
+                        torch::Tensor _scales_i8,
+                        torch::Tensor _wscales,
+                        torch::Tensor _ascales,
+                        torch::Tensor _out_feats,
+                        int config_id,
+                        int split_k)
+{
+  TORCH_CHECK(_in_feats.scalar_type() == at::ScalarType::Char, "in_feats must be int8");
+  gemm_forward_impl(_in_feats, _kernel, _zeros, _scales_i8, _wscales, _ascales, _out_feats, config_id, split_k);
+}
+
+void gemm_quant_a_forward_cuda(torch::Tensor _in_feats,
+                               torch::Tensor _kernel,
+                               torch::Tensor _zeros,
+                               torch::Tensor _scales_i8,
+                               torch::Tensor _wscales,
+                               torch::Tensor _ascales,
+                               torch::Tensor _out_feats,
+                               int config_id,
+                               int split_k)
+{
+  TORCH_CHECK(_in_feats.scalar_type() == at::ScalarType::Half && _in_feats.is_contiguous(),
+              "in_feats must be contiguous fp16");
+  TORCH_CHECK(_ascales.numel() >= _in_feats.size(0), "ascales must hold one entry per row");
+  gemm_forward_impl(_in_feats, _kernel, _zeros, _scales_i8, _wscales, _ascales, _out_feats, config_id, split_k);
+}
@@ -13,4 +13,15 @@
 
 #include <torch/extension.h>
 
-void gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _zeros, torch::Tensor _scales_i8, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats);
+void gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _zeros, torch::Tensor _scales_i8, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats, int config_id = -1, int split_k = -1);
+
+// Same GEMM on fp16 in_feats, quantized per token in the GEMM prologue instead of by invoke_quant: ascales is an
+// output and receives the same scales.
+void gemm_quant_a_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _zeros, torch::Tensor _scales_i8, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats, int config_id = -1, int split_k = -1);
+
+// CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES of every config_id accepted above.
+std::vector<std::vector<int>> gemm_tile_configs();
+
+// Same GEMM with the Hopper TMA / wgmma mainloop (gemm_cuda_sm90.cu). Returns false if the device,
+// the build (COMPILE_HOPPER_TMA_GEMMS) or the shape is not supported; the caller falls back to dense_kernel0.
+bool gemm_forward_cuda_sm90(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _zeros, torch::Tensor _scales_i8, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats);
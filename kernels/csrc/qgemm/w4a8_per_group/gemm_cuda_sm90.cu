@@ -0,0 +1,416 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Hopper (sm_90a) mainloop of the W4A8 per-group GEMM: TMA loads into a STAGES-deep shared memory ring,
+// one producer warpgroup and two consumer warpgroups issuing warpgroup MMAs (wgmma).
+//
+// wgmma only takes its B operand from shared memory, while the int4 weights have to be dequantized
+// in registers first. The GEMM is therefore computed transposed, C^T = W * X^T: the dequantized
+// weights are the register A operand (64 output channels per consumer warpgroup) and the int8
+// activations, K-major in 128B-swizzled shared memory, are the B operand (BLOCK_TOK tokens).
+// The packed weight layout is the one of dense_kernel0: the mma.m16n8k32 B fragments of two n8 tiles
+// are exactly the m16 A fragments of wgmma, so the same checkpoints are used on both paths.
+
+#include "gemm_cuda.h"
+#include <cuda_fp16.h>
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../../launch_plan_utils.h"
+
+#ifdef COMPILE_HOPPER_TMA_GEMMS
+#include <cuda.h>
+
+#if defined(__CUDA_ARCH__) && (__CUDA_ARCH__ >= 900) && defined(__CUDA_ARCH_FEAT_SM90_ALL)
+#define SM90_GEMM_ENABLED
+#endif
+
+#define SM90_BLOCK_N 128   // output channels per CTA (2 consumer warpgroups x 64)
+#define SM90_BLOCK_K 128   // = quantization group size; one 128B swizzle row of activations
+#define SM90_NUM_THREADS 384
+#define SM90_PACK_SIZE 16
+
+__device__ __forceinline__ uint32_t sm90_smem_ptr_to_uint(void const *const ptr)
+{
+  return static_cast<uint32_t>(__cvta_generic_to_shared(ptr));
+}
+
+__device__ __forceinline__ void mbarrier_init(uint64_t *bar, int count)
+{
+  asm volatile("mbarrier.init.shared::cta.b64 [%0], %1;" ::"r"(sm90_smem_ptr_to_uint(bar)), "r"(count));
+}
+
+__device__ __forceinline__ void mbarrier_arrive_expect_tx(uint64_t *bar, uint32_t tx_bytes)
+{
+  asm volatile("mbarrier.arrive.expect_tx.shared::cta.b64 _, [%0], %1;" ::"r"(sm90_smem_ptr_to_uint(bar)), "r"(tx_bytes));
+}
+
+__device__ __forceinline__ void mbarrier_arrive(uint64_t *bar)
+{
+  asm volatile("mbarrier.arrive.shared::cta.b64 _, [%0];" ::"r"(sm90_smem_ptr_to_uint(bar)));
+}
+
+__device__ __forceinline__ void mbarrier_wait(uint64_t *bar, int phase)
+{
+  asm volatile(
+      "{\n"
+      ".reg .pred P1;\n"
+      "LAB_WAIT:\n"
+      "mbarrier.try_wait.parity.shared::cta.b64 P1, [%0], %1;\n"
+      "@P1 bra DONE;\n"
+      "bra LAB_WAIT;\n"
+      "DONE:\n"
+      "}\n" ::"r"(sm90_smem_ptr_to_uint(bar)),
+      "r"(phase));
+}
+
+// 2D TMA tile load (coordinates in elements, innermost first).
+__device__ __forceinline__ void tma_load_2d(void *dst, const CUtensorMap *tmap, int c0, int c1, uint64_t *bar)
+{
+  asm volatile(
+      "cp.async.bulk.tensor.2d.shared::cluster.global.mbarrier::complete_tx::bytes [%0], [%1, {%2, %3}], [%4];" ::"r"(sm90_smem_ptr_to_uint(dst)),
+      "l"(reinterpret_cast<uint64_t>(tmap)), "r"(c0), "r"(c1), "r"(sm90_smem_ptr_to_uint(bar))
+      : "memory");
+}
+
+// Contiguous TMA copy; bytes and both addresses are multiples of 16.
+__device__ __forceinline__ void tma_load_1d(void *dst, const void *src, uint32_t bytes, uint64_t *bar)
+{
+  asm volatile(
+      "cp.async.bulk.shared::cluster.global.mbarrier::complete_tx::bytes [%0], [%1], %2, [%3];" ::"r"(sm90_smem_ptr_to_uint(dst)),
+      "l"(src), "r"(bytes), "r"(sm90_smem_ptr_to_uint(bar))
+      : "memory");
+}
+
+__device__ __forceinline__ void wgmma_fence()
+{
+  asm volatile("wgmma.fence.sync.aligned;\n" ::: "memory");
+}
+
+__device__ __forceinline__ void wgmma_commit_group()
+{
+  asm volatile("wgmma.commit_group.sync.aligned;\n" ::: "memory");
+}
+
+template <int N>
+__device__ __forceinline__ void wgmma_wait_group()
+{
+  asm volatile("wgmma.wait_group.sync.aligned %0;\n" ::"n"(N) : "memory");
+}
+
+// Shared memory descriptor of a K-major operand in the 128B swizzle layout written by TMA:
+// rows of 128 bytes, 8-row (1024 B) swizzle atoms. The tile itself is 1024 B aligned.
+__device__ __forceinline__ uint64_t make_smem_desc_sw128(const void *ptr)
+{
+  const uint32_t addr = sm90_smem_ptr_to_uint(ptr);
+  uint64_t desc = 0;
+  desc |= static_cast<uint64_t>((addr & 0x3FFFF) >> 4);
+  desc |= static_cast<uint64_t>(1) << 16;           // leading byte offset, unused for swizzled K-major
+  desc |= static_cast<uint64_t>(1024 >> 4) << 32;   // stride byte offset between 8-row groups
+  desc |= static_cast<uint64_t>(1) << 62;           // 128B swizzle
+  return desc;
+}
+
+// D (64 x N, s32) += A (64 x 32, s8, registers) * B (N x 32, s8, shared memory).
+template <int N>
+struct Wgmma_s8_m64k32;
+
+template <>
+struct Wgmma_s8_m64k32<64>
+{
+  __device__ __forceinline__ static void mma(int (&d)[32], const uint32_t (&a)[4], uint64_t desc_b, int scale_d)
+  {
+    asm volatile(
+        "{\n"
+        ".reg .pred p;\n"
+        "setp.ne.b32 p, %37, 0;\n"
+        "wgmma.mma_async.sync.aligned.m64n64k32.s32.s8.s8 "
+        "{%0, %1, %2, %3, %4, %5, %6, %7, "
+        "%8, %9, %10, %11, %12, %13, %14, %15, "
+        "%16, %17, %18, %19, %20, %21, %22, %23, "
+        "%24, %25, %26, %27, %28, %29, %30, %31}, "
+        "{%32, %33, %34, %35}, %36, p;\n"
+        "}\n"
+        : "+r"(d[0]), "+r"(d[1]), "+r"(d[2]), "+r"(d[3]), "+r"(d[4]), "+r"(d[5]), "+r"(d[6]), "+r"(d[7]),
+          "+r"(d[8]), "+r"(d[9]), "+r"(d[10]), "+r"(d[11]), "+r"(d[12]), "+r"(d[13]), "+r"(d[14]), "+r"(d[15]),
+          "+r"(d[16]), "+r"(d[17]), "+r"(d[18]), "+r"(d[19]), "+r"(d[20]), "+r"(d[21]), "+r"(d[22]), "+r"(d[23]),
+          "+r"(d[24]), "+r"(d[25]), "+r"(d[26]), "+r"(d[27]), "+r"(d[28]), "+r"(d[29]), "+r"(d[30]), "+r"(d[31])
+        : "r"(a[0]), "r"(a[1]), "r"(a[2]), "r"(a[3]), "l"(desc_b), "r"(scale_d));
+  }
+};
+
+template <>
+struct Wgmma_s8_m64k32<128>
+{
+  __device__ __forceinline__ static void mma(int (&d)[64], const uint32_t (&a)[4], uint64_t desc_b, int scale_d)
+  {
+    asm volatile(
+        "{\n"
+        ".reg .pred p;\n"
+        "setp.ne.b32 p, %69, 0;\n"
+        "wgmma.mma_async.sync.aligned.m64n128k32.s32.s8.s8 "
+        "{%0, %1, %2, %3, %4, %5, %6, %7, "
+        "%8, %9, %10, %11, %12, %13, %14, %15, "
+        "%16, %17, %18, %19, %20, %21, %22, %23, "
+        "%24, %25, %26, %27, %28, %29, %30, %31, "
+        "%32, %33, %34, %35, %36, %37, %38, %39, "
+        "%40, %41, %42, %43, %44, %45, %46, %47, "
+        "%48, %49, %50, %51, %52, %53, %54, %55, "
+        "%56, %57, %58, %59, %60, %61, %62, %63}, "
+        "{%64, %65, %66, %67}, %68, p;\n"
+        "}\n"
+        : "+r"(d[0]), "+r"(d[1]), "+r"(d[2]), "+r"(d[3]), "+r"(d[4]), "+r"(d[5]), "+r"(d[6]), "+r"(d[7]),
+          "+r"(d[8]), "+r"(d[9]), "+r"(d[10]), "+r"(d[11]), "+r"(d[12]), "+r"(d[13]), "+r"(d[14]), "+r"(d[15]),
+          "+r"(d[16]), "+r"(d[17]), "+r"(d[18]), "+r"(d[19]), "+r"(d[20]), "+r"(d[21]), "+r"(d[22]), "+r"(d[23]),
+          "+r"(d[24]), "+r"(d[25]), "+r"(d[26]), "+r"(d[27]), "+r"(d[28]), "+r"(d[29]), "+r"(d[30]), "+r"(d[31]),
+          "+r"(d[32]), "+r"(d[33]), "+r"(d[34]), "+r"(d[35]), "+r"(d[36]), "+r"(d[37]), "+r"(d[38]), "+r"(d[39]),
+          "+r"(d[40]), "+r"(d[41]), "+r"(d[42]), "+r"(d[43]), "+r"(d[44]), "+r"(d[45]), "+r"(d[46]), "+r"(d[47]),
+          "+r"(d[48]), "+r"(d[49]), "+r"(d[50]), "+r"(d[51]), "+r"(d[52]), "+r"(d[53]), "+r"(d[54]), "+r"(d[55]),
+          "+r"(d[56]), "+r"(d[57]), "+r"(d[58]), "+r"(d[59]), "+r"(d[60]), "+r"(d[61]), "+r"(d[62]), "+r"(d[63])
+        : "r"(a[0]), "r"(a[1]), "r"(a[2]), "r"(a[3]), "l"(desc_b), "r"(scale_d));
+  }
+};
+
+// Dequantizes one k32 step of the 16 output channels of this warp into its wgmma A fragment.
+// Same arithmetic as share_to_reg_one_stage_B (q * scale_i8 + zero, per byte); j selects the
+// low / high nibbles, i.e. channels [0, 16) or [16, 32) of the 32-channel packing block.
+__device__ __forceinline__ void dequant_a_frag(uint32_t (&a)[4], uint4 loaded, int j, uint32_t packed_scales,
+                                               uint32_t packed_zeros)
+{
+  const int shift = 4 * j;
+  const uint32_t scale_lo = (packed_scales >> (16 * j)) & 0xFF;
+  const uint32_t scale_hi = (packed_scales >> (16 * j + 8)) & 0xFF;
+  const uint32_t zero_lo = __byte_perm(packed_zeros, 0, 0x1111 * (2 * j));
+  const uint32_t zero_hi = __byte_perm(packed_zeros, 0, 0x1111 * (2 * j + 1));
+  // mma B fragments {b0, b1} of the channels [0, 8) / [8, 16) -> A fragment {a0, a2} / {a1, a3}.
+  a[0] = __vadd4(((loaded.x >> shift) & 0x0F0F0F0F) * scale_lo, zero_lo);
+  a[2] = __vadd4(((loaded.z >> shift) & 0x0F0F0F0F) * scale_lo, zero_lo);
+  a[1] = __vadd4(((loaded.y >> shift) & 0x0F0F0F0F) * scale_hi, zero_hi);
+  a[3] = __vadd4(((loaded.w >> shift) & 0x0F0F0F0F) * scale_hi, zero_hi);
+}
+
+template <int BLOCK_TOK, int STAGES>
+__global__ void __launch_bounds__(SM90_NUM_THREADS, 1)
+    dense_kernel0_sm90(const __grid_constant__ CUtensorMap tmap_a, const int8_t *__restrict__ B,
+                       const int8_t *__restrict__ zeros, const int8_t *__restrict__ scales_i8,
+                       const half *__restrict__ wscales, const half *__restrict__ ascales,
+                       half *__restrict__ C, int M, int64_t N, int64_t K)
+{
+#ifdef SM90_GEMM_ENABLED
+  constexpr int kSmemSizeAPerStage = BLOCK_TOK * SM90_BLOCK_K;
+  constexpr int kSmemSizeBPerStage = SM90_BLOCK_N * SM90_BLOCK_K / 2;
+  constexpr int kTxBytes = kSmemSizeAPerStage + kSmemSizeBPerStage + 2 * SM90_BLOCK_N;
+  constexpr int kNumConsumerWarps = (SM90_NUM_THREADS - 128) / 32;
+
+  extern __shared__ int8_t mem_shared_raw[];
+  // The 128B swizzle atoms of the activation tiles must be 1024 B aligned.
+  int8_t *mem_shared = reinterpret_cast<int8_t *>((reinterpret_cast<uintptr_t>(mem_shared_raw) + 1023) & ~uintptr_t(1023));
+  int8_t *A_shared = mem_shared;
+  int8_t *B_shared = A_shared + STAGES * kSmemSizeAPerStage;
+  int8_t *zeros_shared = B_shared + STAGES * kSmemSizeBPerStage;
+  int8_t *scales_i8_shared = zeros_shared + STAGES * SM90_BLOCK_N;
+  uint64_t *full_bar = reinterpret_cast<uint64_t *>(scales_i8_shared + STAGES * SM90_BLOCK_N);
+  uint64_t *empty_bar = full_bar + STAGES;
+
+  const int warpgroup = threadIdx.x / 128;
+  const int cta_offset_n = blockIdx.x * SM90_BLOCK_N;
+  const int cta_offset_m = blockIdx.y * BLOCK_TOK;
+  const int k_iters = K / SM90_BLOCK_K;
+
+  if (threadIdx.x == 0)
+  {
+#pragma unroll
+    for (int s = 0; s < STAGES; ++s)
+    {
+      mbarrier_init(full_bar + s, 1);
+      mbarrier_init(empty_bar + s, kNumConsumerWarps);
+    }
+    asm volatile("fence.mbarrier_init.release.cluster;" ::: "memory");
+  }
+  __syncthreads();
+
+  if (warpgroup == 0)
+  {
+    // Producer: a single thread keeps STAGES k-iterations of A, B, zeros and scales in flight.
+    asm volatile("setmaxnreg.dec.sync.aligned.u32 40;\n");
+    if (threadIdx.x == 0)
+    {
+      for (int k_iter = 0; k_iter < k_iters; ++k_iter)
+      {
+        const int stage = k_iter % STAGES;
+        mbarrier_wait(empty_bar + stage, ((k_iter / STAGES) & 1) ^ 1);
+        mbarrier_arrive_expect_tx(full_bar + stage, kTxBytes);
+        // Rows past M are zero-filled by TMA.
+        tma_load_2d(A_shared + stage * kSmemSizeAPerStage, &tmap_a, k_iter * SM90_BLOCK_K, cta_offset_m, full_bar + stage);
+#pragma unroll
+        for (int b = 0; b < SM90_BLOCK_N / 32; ++b)
+        {
+          tma_load_1d(B_shared + stage * kSmemSizeBPerStage + b * SM90_BLOCK_K * SM90_PACK_SIZE,
+                      B + ((int64_t)(cta_offset_n / 32 + b) * K + k_iter * SM90_BLOCK_K) * SM90_PACK_SIZE,
+                      SM90_BLOCK_K * SM90_PACK_SIZE, full_bar + stage);
+        }
+        // SM90_BLOCK_K == G: one row of zeros / scales per k-iteration.
+        tma_load_1d(zeros_shared + stage * SM90_BLOCK_N, zeros + k_iter * N + cta_offset_n, SM90_BLOCK_N, full_bar + stage);
+        tma_load_1d(scales_i8_shared + stage * SM90_BLOCK_N, scales_i8 + k_iter * N + cta_offset_n, SM90_BLOCK_N,
+                    full_bar + stage);
+      }
+    }
+  }
+  else
+  {
+    asm volatile("setmaxnreg.inc.sync.aligned.u32 232;\n");
+    const int consumer_wg = warpgroup - 1;
+    const int warp = (threadIdx.x / 32) % 4;
+    const int lane = threadIdx.x % 32;
+    // Warp w of consumer warpgroup g owns the output channels [64 g + 16 w, 64 g + 16 w + 16).
+    const int pack_block = consumer_wg * 2 + warp / 2;
+    const int j = warp % 2;
+
+    int acc[BLOCK_TOK / 2];
+#pragma unroll
+    for (int i = 0; i < BLOCK_TOK / 2; ++i)
+      acc[i] = 0;
+
+    for (int k_iter = 0; k_iter < k_iters; ++k_iter)
+    {
+      const int stage = k_iter % STAGES;
+      mbarrier_wait(full_bar + stage, (k_iter / STAGES) & 1);
+
+      const int scales_zeros_offset = stage * SM90_BLOCK_N + pack_block * 32 + (lane / 4) * 4;
+      const uint32_t packed_scales = *reinterpret_cast<const uint32_t *>(scales_i8_shared + scales_zeros_offset);
+      const uint32_t packed_zeros = *reinterpret_cast<const uint32_t *>(zeros_shared + scales_zeros_offset);
+      const uint4 *B_stage = reinterpret_cast<const uint4 *>(B_shared + stage * kSmemSizeBPerStage) + pack_block * SM90_BLOCK_K;
+      uint32_t a_frag[SM90_BLOCK_K / 32][4];
+#pragma unroll
+      for (int k_0_1 = 0; k_0_1 < SM90_BLOCK_K / 32; ++k_0_1)
+        dequant_a_frag(a_frag[k_0_1], B_stage[k_0_1 * 32 + lane], j, packed_scales, packed_zeros);
+
+      wgmma_fence();
+#pragma unroll
+      for (int k_0_1 = 0; k_0_1 < SM90_BLOCK_K / 32; ++k_0_1)
+      {
+        Wgmma_s8_m64k32<BLOCK_TOK>::mma(acc, a_frag[k_0_1],
+                                         make_smem_desc_sw128(A_shared + stage * kSmemSizeAPerStage + k_0_1 * 32), 1);
+      }
+      wgmma_commit_group();
+      // The A fragments are overwritten and the stage is recycled in the next iteration.
+      wgmma_wait_group<0>();
+      if (lane == 0)
+        mbarrier_arrive(empty_bar + stage);
+    }
+
+    // acc[4 i + 2 h + x]: channel (A row) lane / 4 + 8 h, token (B row) 8 i + (lane % 4) * 2 + x.
+    const int ch_0 = cta_offset_n + consumer_wg * 64 + warp * 16 + lane / 4;
+    const float wscale_0 = __half2float(wscales[ch_0]);
+    const float wscale_1 = __half2float(wscales[ch_0 + 8]);
+#pragma unroll
+    for (int i = 0; i < BLOCK_TOK / 8; ++i)
+    {
+#pragma unroll
+      for (int x = 0; x < 2; ++x)
+      {
+        const int row_wb = cta_offset_m + i * 8 + (lane % 4) * 2 + x;
+        if (row_wb < M)
+        {
+          const float ascale = __half2float(ascales[row_wb]);
+          C[row_wb * N + ch_0] = __float2half_rn(__int2float_rn(acc[4 * i + x]) * wscale_0 * ascale);
+          C[row_wb * N + ch_0 + 8] = __float2half_rn(__int2float_rn(acc[4 * i + 2 + x]) * wscale_1 * ascale);
+        }
+      }
+    }
+  }
+#endif // SM90_GEMM_ENABLED
+}
+
+using TensorMapEncodeTiledFn = decltype(&cuTensorMapEncodeTiled);
+
+// The driver entry point is resolved through the runtime, so the extension does not link libcuda.
+static TensorMapEncodeTiledFn get_tensor_map_encode_tiled()
+{
+  static TensorMapEncodeTiledFn fn = nullptr;
+  if (fn == nullptr)
+  {
+    cudaDriverEntryPointQueryResult query_result;
+    cudaError_t err = cudaGetDriverEntryPoint("cuTensorMapEncodeTiled", reinterpret_cast<void **>(&fn),
+                                              cudaEnableDefault, &query_result);
+    TORCH_CHECK(err == cudaSuccess && query_result == cudaDriverEntryPointSuccess,
+                "Cannot resolve cuTensorMapEncodeTiled");
+  }
+  return fn;
+}
+
+// int8 activations (M x K, row-major) as BLOCK_TOK x 128 B boxes in the 128B swizzle layout.
+static CUtensorMap make_activation_tensor_map(const int8_t *in_feats, int M, int64_t K, int block_tok)
+{
+  CUtensorMap tmap;
+  cuuint64_t global_dim[2] = {static_cast<cuuint64_t>(K), static_cast<cuuint64_t>(M)};
+  cuuint64_t global_strides[1] = {static_cast<cuuint64_t>(K)};
+  cuuint32_t box_dim[2] = {SM90_BLOCK_K, static_cast<cuuint32_t>(block_tok)};
+  cuuint32_t element_strides[2] = {1, 1};
+  CUresult res = get_tensor_map_encode_tiled()(
+      &tmap, CU_TENSOR_MAP_DATA_TYPE_UINT8, 2, const_cast<int8_t *>(in_feats), global_dim, global_strides, box_dim,
+      element_strides, CU_TENSOR_MAP_INTERLEAVE_NONE, CU_TENSOR_MAP_SWIZZLE_128B,
+      CU_TENSOR_MAP_L2_PROMOTION_L2_256B, CU_TENSOR_MAP_FLOAT_OOB_FILL_NONE);
+  TORCH_CHECK(res == CUDA_SUCCESS, "cuTensorMapEncodeTiled failed with error ", static_cast<int>(res));
+  return tmap;
+}
+
+template <int BLOCK_TOK, int STAGES>
+static void launch_dense_kernel0_sm90(const int8_t *in_feats, const int8_t *kernel, const int8_t *zeros,
+                                      const int8_t *scales_i8, const half *wscales, const half *ascales,
+                                      half *out_feats, int M, int64_t N, int64_t K, cudaStream_t stream)
+{
+  constexpr int kSmemByteSize =
+      (BLOCK_TOK * SM90_BLOCK_K + SM90_BLOCK_N * SM90_BLOCK_K / 2 + 2 * SM90_BLOCK_N) * STAGES +
+      2 * STAGES * sizeof(uint64_t) + 1024;
+  static_assert(kSmemByteSize <= 227 * 1024, "The sm_90 GEMM pipeline exceeds the shared memory of a CTA.");
+  CUtensorMap tmap_a = make_activation_tensor_map(in_feats, M, K, BLOCK_TOK);
+  auto kernel_func = dense_kernel0_sm90<BLOCK_TOK, STAGES>;
+  omniserve::cached_set_max_dynamic_smem(kernel_func, kSmemByteSize);
+  dim3 num_blocks(N / SM90_BLOCK_N, (M + BLOCK_TOK - 1) / BLOCK_TOK);
+  kernel_func<<<num_blocks, SM90_NUM_THREADS, kSmemByteSize, stream>>>(tmap_a, kernel, zeros, scales_i8, wscales,
+                                                                       ascales, out_feats, M, N, K);
+}
+#endif // COMPILE_HOPPER_TMA_GEMMS
+
+bool gemm_forward_cuda_sm90(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _zeros,
+                            torch::Tensor _scales_i8, torch::Tensor _wscales, torch::Tensor _ascales,
+                            torch::Tensor _out_feats)
+{
+#ifdef COMPILE_HOPPER_TMA_GEMMS
+  if (at::cuda::getCurrentDeviceProperties()->major != 9)
+    return false;
+  int num_in_feats = _in_feats.size(0);
+  int64_t num_in_channels = _in_feats.size(1);
+  int64_t num_out_channels = _out_feats.size(-1);
+  // Decode-sized M stays on dense_kernel0 (weight-bandwidth bound, split-K).
+  if (num_in_feats < 64 || num_out_channels % SM90_BLOCK_N != 0 || num_in_channels % SM90_BLOCK_K != 0)
+    return false;
+  auto in_feats = _in_feats.data_ptr<int8_t>();
+  auto kernel = _kernel.data_ptr<int8_t>();
+  auto zeros = _zeros.data_ptr<int8_t>();
+  auto scales_i8 = _scales_i8.data_ptr<int8_t>();
+  auto wscales = reinterpret_cast<half *>(_wscales.data_ptr());
+  auto ascales = reinterpret_cast<half *>(_ascales.data_ptr());
+  auto out_feats = reinterpret_cast<half *>(_out_feats.data_ptr<at::Half>());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  if (num_in_feats > 128)
+    launch_dense_kernel0_sm90<128, 8>(in_feats, kernel, zeros, scales_i8, wscales, ascales, out_feats,
+                                      num_in_feats, num_out_channels, num_in_channels, stream);
+  else
+    launch_dense_kernel0_sm90<64, 12>(in_feats, kernel, zeros, scales_i8, wscales, ascales, out_feats,
+                                      num_in_feats, num_out_channels, num_in_channels, stream);
+  return true;
+#else
+  return false;
+#endif
+}
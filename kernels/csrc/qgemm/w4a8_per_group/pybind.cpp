@@ -14,8 +14,16 @@
 #include <pybind11/pybind11.h>
 #include <torch/extension.h>
 #include "gemm_cuda.h"
+#include "../../nvtx_utils.h"
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
-    m.def("gemm_forward_cuda", &gemm_forward_cuda, "our sparse conv kernel");
+    m.def("gemm_forward_cuda", omniserve::nvtx_wrap("gemm_forward_cuda", &gemm_forward_cuda), "our sparse conv kernel",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("zeros"), py::arg("scales_i8"), py::arg("wscales"),
+          py::arg("ascales"), py::arg("out_feats"), py::arg("config_id") = -1, py::arg("split_k") = -1);
+    m.def("gemm_quant_a_forward_cuda", omniserve::nvtx_wrap("gemm_quant_a_forward_cuda", &gemm_quant_a_forward_cuda),
+          "our w4a8 gemm kernel on fp16 inputs, quantized per token in the prologue",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("zeros"), py::arg("scales_i8"), py::arg("wscales"),
+          py::arg("ascales"), py::arg("out_feats"), py::arg("config_id") = -1, py::arg("split_k") = -1);
+    m.def("gemm_tile_configs", omniserve::nvtx_wrap("gemm_tile_configs", &gemm_tile_configs), "tile configs selectable through config_id");
 }
@@ -14,9 +14,24 @@
 #include <pybind11/pybind11.h>
 #include <torch/extension.h>
 #include "w8a8_gemm_cuda.h"
+#include "../../nvtx_utils.h"
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
-    m.def("w8a8_gemm_forward_cuda", &w8a8_gemm_forward_cuda, "our w8a8 gemm kernel");
+    m.def("w8a8_gemm_forward_cuda", omniserve::nvtx_wrap("w8a8_gemm_forward_cuda", &w8a8_gemm_forward_cuda), "our w8a8 gemm kernel",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("out_feats"),
+          py::arg("config_id") = -1);
+    m.def("w8a8_gemm_epilogue_forward_cuda", omniserve::nvtx_wrap("w8a8_gemm_epilogue_forward_cuda", &w8a8_gemm_epilogue_forward_cuda), "our w8a8 gemm kernel with fused epilogues",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("out_feats"),
+          py::arg("epilogue"), py::arg("residual") = py::none(), py::arg("quant_out") = py::none(),
+          py::arg("quant_scale") = py::none(), py::arg("quant_sum") = py::none(), py::arg("config_id") = -1);
+    m.def("w8a8_gemm_topk_forward_cuda", omniserve::nvtx_wrap("w8a8_gemm_topk_forward_cuda", &w8a8_gemm_topk_forward_cuda), "our w8a8 gemm kernel with a fused per-row top-k",
+          py::arg("in_feats"), py::arg("kernel"), py::arg("wscales"), py::arg("ascales"), py::arg("out_feats"),
+          py::arg("k"), py::arg("full_logit_rows") = py::none(), py::arg("config_id") = -1);
+    m.def("w8a8_gemm_tile_configs", omniserve::nvtx_wrap("w8a8_gemm_tile_configs", &w8a8_gemm_tile_configs), "tile configs selectable through config_id");
+    m.attr("EPILOGUE_RESIDUAL") = GEMM_EPILOGUE_RESIDUAL;
+    m.attr("EPILOGUE_SILU_AND_MUL") = GEMM_EPILOGUE_SILU_AND_MUL;
+    m.attr("EPILOGUE_GLU_BLOCK") = GEMM_EPILOGUE_GLU_BLOCK;
+    m.attr("EPILOGUE_ROW_TOPK") = GEMM_EPILOGUE_ROW_TOPK;
+    m.attr("EPILOGUE_TOPK_MAX") = GEMM_EPILOGUE_TOPK_MAX;
 }
-
@@ -12,9 +12,12 @@
 // }
 
 #include "w8a8_gemm_cuda.h"
+#include "../gemm_epilogue.cuh"
 #include <cuda_fp16.h>
 #include <cuda_pipeline_primitives.h>
 #include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include "../../launch_plan_utils.h"
 
 #define OP_M 16
 #define OP_N 8
@@ -36,12 +39,17 @@
   constexpr int kSmemByteSize =                                                  \
       (CTA_M * (CTA_K + SMEM_PAD_A) + CTA_N * (CTA_K + SMEM_PAD_B)) * STAGES *   \
       sizeof(int8_t);                                                            \
+  constexpr int kEpilogueSmemByteSize = CTA_M * CTA_N * sizeof(half);            \
+  const int smem_byte_size = (epilogue & GEMM_EPILOGUE_STAGED_TILE) &&           \
+                                     kEpilogueSmemByteSize > kSmemByteSize       \
+                                 ? kEpilogueSmemByteSize                         \
+                                 : kSmemByteSize;                                \
   if (kSmemByteSize >= 99 * 1024)                                                \
   {                                                                              \
     printf("This kernel requires %d Bytes of shared memory, which exceeds "      \
            "device limit.\n",                                                    \
            kSmemByteSize);                                                       \
-    return ;                                                                     \
+    return 0;                                                                    \
   }                                                                              \
   int num_blocks_m = (num_out_feats + CTA_M - 1) / CTA_M;                        \
   int num_blocks_n = num_out_channels / CTA_N / 1;                               \
@@ -52,11 +60,45 @@
   dim3 threads_per_block(WARP_SIZE, NUM_WARPS);                                  \
   auto kernel_func =                                                             \
       dense_kernel0<CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES>;        \
-  cudaFuncSetAttribute(kernel_func, cudaFuncAttributeMaxDynamicSharedMemorySize, \
-                       kSmemByteSize);                                           \
-  kernel_func<<<num_blocks, threads_per_block, kSmemByteSize>>>(                 \
-      in_feats, kernel, wscales, ascales, out_feats, num_in_feats, num_out_channels,               \
-      num_in_channels);
+  omniserve::cached_set_max_dynamic_smem(kernel_func, smem_byte_size);           \
+  kernel_func<<<num_blocks, threads_per_block, smem_byte_size, stream>>>(        \
+      in_feats, kernel, wscales, ascales, out_feats, residual, row_stats, topk,  \
+      num_in_feats, num_out_channels, num_in_channels, epilogue);                \
+  return CTA_N;
+
+// Precompiled tile configurations that can be requested through config_id (e.g. by the autotuner).
+// X(ID, CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES)
+#define GEMM_TILE_CONFIGS(X) \
+  X(0, 128, 256, 64, 128, 32, 64, 3) \
+  X(1, 64, 64, 64, 32, 32, 64, 6) \
+  X(2, 128, 128, 64, 128, 32, 64, 4) \
+  X(3, 64, 128, 64, 32, 32, 64, 4) \
+  X(4, 128, 128, 64, 32, 32, 64, 3) \
+  X(5, 32, 64, 64, 32, 32, 64, 6) \
+  X(6, 64, 64, 64, 32, 32, 64, 4)
+
+#define GEMM_TILE_CONFIG_CASE(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_)              \
+  case ID:                                                                                             \
+  {                                                                                                    \
+    constexpr int CTA_M = CTA_M_;                                                                      \
+    constexpr int CTA_N = CTA_N_;                                                                      \
+    constexpr int CTA_K = CTA_K_;                                                                      \
+    constexpr int WARP_M = WARP_M_;                                                                    \
+    constexpr int WARP_N = WARP_N_;                                                                    \
+    constexpr int WARP_K = WARP_K_;                                                                    \
+    constexpr int STAGES = STAGES_;                                                                    \
+    TORCH_CHECK(num_out_channels % CTA_N == 0 && num_in_channels % CTA_K == 0,                         \
+                "GEMM tile config ", ID, " does not divide N=", num_out_channels, " K=", num_in_channels); \
+    KERNEL_LAUNCH_CODE                                                                                 \
+  }
+
+#define GEMM_TILE_CONFIG_ROW(ID, CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_) \
+  {CTA_M_, CTA_N_, CTA_K_, WARP_M_, WARP_N_, WARP_K_, STAGES_},
+
+std::vector<std::vector<int>> w8a8_gemm_tile_configs()
+{
+  return {GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_ROW)};
+}
 
 template <int N>
 __inline__ __host__ __device__ int get_log_tile(int n)
@@ -273,7 +315,9 @@ template <int CTA_M, int CTA_N, int CTA_K, int WARP_M, int WARP_N, int WARP_K,
           int STAGES>
 __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
                               half2 *__restrict__ wscales, half *__restrict__ ascales,
-                              half *__restrict__ C, int M, int N, int K)
+                              half *__restrict__ C, const half *__restrict__ R,
+                              float *__restrict__ row_stats, const GemmEpilogueTopK topk, int M, int N, int K,
+                              int epilogue)
 {
   constexpr int NUM_WARPS_MN = CTA_M / WARP_M * CTA_N / WARP_N;
   constexpr int NUM_WARPS = NUM_WARPS_MN * CTA_K / WARP_K;
@@ -505,17 +549,30 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
     }
   }
 
+  const bool silu_and_mul = epilogue & GEMM_EPILOGUE_SILU_AND_MUL;
+  const bool row_topk = epilogue & GEMM_EPILOGUE_ROW_TOPK;
+  const bool stage_tile = silu_and_mul || row_topk;
+  // The staged tile reuses the shared memory of the slice reduction above.
+  if (SLICES > 1 && stage_tile)
+    __syncthreads();
+  half *C_tile = reinterpret_cast<half *>(mem_shared);
+  float row_amax[WARP_M / INTRIN_M][2] = {};
+  float row_sum[WARP_M / INTRIN_M][2] = {};
+
   int row_wb_thd = cta_offset_m + warp_offset_m + (threadIdx.x / 4);
   int col_wb_thd = cta_offset_n + warp_offset_n + (threadIdx.x % 4) * 2;
   if (slice_id == 0)
   {
+#pragma unroll
     for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
     {
       int row_wb_1 = row_wb_thd + ax0_0_1 * OP_M;
+#pragma unroll
       for (int ax1_0_1 = 0; ax1_0_1 < WARP_N / INTRIN_N; ++ax1_0_1)
       {
         int col_wb_1 = col_wb_thd + ax1_0_1 * 16;
         int *C_warp_local = C_warp + ax0_0_1 * WARP_N / INTRIN_N * 8 + ax1_0_1 * 8;
+#pragma unroll
         for (int local_id = 0; local_id < OP_M * 16 / WARP_SIZE; local_id += 2)
         {
           int row_wb = row_wb_1 + (local_id % 4) / 2 * 8;
@@ -526,19 +583,61 @@ __global__ void dense_kernel0(int8_t *__restrict__ A, int8_t *__restrict__ B,
             float2 psums = make_float2(__int2float_rn(C_warp_local[local_id]), __int2float_rn(C_warp_local[local_id + 1]));
             psums.x *= wscale.x * ascale;
             psums.y *= wscale.y * ascale;
-            *reinterpret_cast<half2 *>(C + row_wb * N + col_wb) = __float22half2_rn(psums);
+            half2 out = __float22half2_rn(psums);
+            if (stage_tile)
+            {
+              *reinterpret_cast<half2 *>(C_tile + (row_wb - cta_offset_m) * CTA_N + col_wb - cta_offset_n) = out;
+              continue;
+            }
+            if (epilogue & GEMM_EPILOGUE_RESIDUAL)
+              out = __hadd2(out, *reinterpret_cast<const half2 *>(R + row_wb * N + col_wb));
+            *reinterpret_cast<half2 *>(C + row_wb * N + col_wb) = out;
+            gemm_epilogue_row_stats_update(row_amax[ax0_0_1][(local_id % 4) / 2], row_sum[ax0_0_1][(local_id % 4) / 2], out);
           }
         };
       }
     }
+    if (row_stats != nullptr && !stage_tile)
+    {
+      // Lanes 4i..4i+3 share two rows per ax0_0_1.
+#pragma unroll
+      for (int ax0_0_1 = 0; ax0_0_1 < WARP_M / INTRIN_M; ++ax0_0_1)
+      {
+#pragma unroll
+        for (int h = 0; h < 2; ++h)
+        {
+          gemm_epilogue_row_stats_reduce(row_amax[ax0_0_1][h], row_sum[ax0_0_1][h], 1, 4);
+          int row_wb = row_wb_thd + ax0_0_1 * OP_M + h * 8;
+          if (threadIdx.x % 4 == 0 && row_wb < M)
+            gemm_epilogue_row_stats_commit(row_stats, row_wb, row_amax[ax0_0_1][h], row_sum[ax0_0_1][h]);
+        }
+      }
+    }
+  }
+  if (silu_and_mul)
+  {
+    __syncthreads();
+    gemm_epilogue_silu_and_mul_tile<CTA_M, CTA_N, NUM_WARPS>(C_tile, C, row_stats, cta_offset_m, cta_offset_n,
+                                                             M, N / 2);
+  }
+  else if (row_topk)
+  {
+    __syncthreads();
+    gemm_epilogue_row_topk_tile<CTA_M, CTA_N, NUM_WARPS>(C_tile, C, topk, cta_offset_m, cta_offset_n, M, N);
   }
 }
 
-void w8a8_gemm_forward_cuda(torch::Tensor _in_feats,
-                                torch::Tensor _kernel,
-                                torch::Tensor _wscales,
-                                torch::Tensor _ascales,
-                                torch::Tensor _out_feats)
+// Returns the CTA_N of the launched tile config (0 if nothing was launched).
+static int w8a8_gemm_forward_impl(torch::Tensor _in_feats,
+                                   torch::Tensor _kernel,
+                                   torch::Tensor _wscales,
+                                   torch::Tensor _ascales,
+                                   torch::Tensor _out_feats,
+                                   const half *residual,
+                                   float *row_stats,
+                                   const GemmEpilogueTopK &topk,
+                                   int epilogue,
+                                   int config_id)
 {
   int num_in_feats = _in_feats.size(0);
   int num_in_channels = _in_feats.size(1);
@@ -551,10 +650,23 @@ void w8a8_gemm_forward_cuda(torch::Tensor _in_feats,
   // at::Tensor _out_feats =
   //     torch::empty({num_in_feats, _kernel.size(0)}, options);
   int num_out_feats = _out_feats.size(-2);
-  int num_out_channels = _out_feats.size(-1);
+  // The SiLU-and-mul epilogue writes one output per gate / up pair.
+  int num_out_channels = _out_feats.size(-1) * ((epilogue & GEMM_EPILOGUE_SILU_AND_MUL) ? 2 : 1);
 
 
   auto out_feats = reinterpret_cast<half *>(_out_feats.data_ptr<at::Half>());
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  if (config_id >= 0)
+  {
+    switch (config_id)
+    {
+      GEMM_TILE_CONFIGS(GEMM_TILE_CONFIG_CASE)
+    default:
+      TORCH_CHECK(false, "Invalid GEMM tile config ", config_id);
+    }
+    return 0;
+  }
 
   if (num_out_feats > 128)
   {
@@ -578,7 +690,62 @@ void w8a8_gemm_forward_cuda(torch::Tensor _in_feats,
     constexpr int STAGES = 6;
     KERNEL_LAUNCH_CODE
   }
-  
-  return ;
 }
 
+void w8a8_gemm_forward_cuda(torch::Tensor _in_feats,
+                                torch::Tensor _kernel,
+                                torch::Tensor _wscales,
+                                torch::Tensor _ascales,
+                                torch::Tensor _out_feats,
+                                int config_id)
+{
+  w8a8_gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _out_feats, nullptr, nullptr, {},
+                         GEMM_EPILOGUE_NONE, config_id);
+}
+
+void w8a8_gemm_epilogue_forward_cuda(torch::Tensor _in_feats,
+                                     torch::Tensor _kernel,
+                                     torch::Tensor _wscales,
+                                     torch::Tensor _ascales,
+                                     torch::Tensor _out_feats,
+                                     int epilogue,
+                                     c10::optional<torch::Tensor> _residual,
+                                     c10::optional<torch::Tensor> _quant_out,
+                                     c10::optional<torch::Tensor> _quant_scale,
+                                     c10::optional<torch::Tensor> _quant_sum,
+                                     int config_id)
+{
+  torch::Tensor _row_stats = gemm_epilogue_prepare(_out_feats, epilogue, _residual, _quant_out, _quant_scale);
+  const half *residual = (epilogue & GEMM_EPILOGUE_RESIDUAL)
+                             ? reinterpret_cast<const half *>(_residual->data_ptr<at::Half>())
+                             : nullptr;
+  float *row_stats = _row_stats.defined() ? _row_stats.data_ptr<float>() : nullptr;
+  w8a8_gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _out_feats, residual, row_stats, {},
+                         epilogue, config_id);
+  if (row_stats != nullptr)
+    gemm_epilogue_quant(_out_feats, _row_stats, *_quant_out, *_quant_scale, _quant_sum,
+                        at::cuda::getCurrentCUDAStream());
+}
+
+std::vector<torch::Tensor> w8a8_gemm_topk_forward_cuda(torch::Tensor _in_feats,
+                                                       torch::Tensor _kernel,
+                                                       torch::Tensor _wscales,
+                                                       torch::Tensor _ascales,
+                                                       torch::Tensor _out_feats,
+                                                       int k,
+                                                       c10::optional<torch::Tensor> _full_logit_rows,
+                                                       int config_id)
+{
+  // CTA_N = 64 is the narrowest tile of the configs above.
+  std::vector<torch::Tensor> candidates = gemm_epilogue_topk_prepare(_out_feats, k, _full_logit_rows, 64);
+  GemmEpilogueTopK topk;
+  topk.vals = candidates[0].data_ptr<float>();
+  topk.idxes = candidates[1].data_ptr<int>();
+  topk.full_logit_rows = _full_logit_rows.has_value() ? _full_logit_rows->data_ptr<int>() : nullptr;
+  topk.k = k;
+  int cta_n = w8a8_gemm_forward_impl(_in_feats, _kernel, _wscales, _ascales, _out_feats, nullptr, nullptr, topk,
+                                     GEMM_EPILOGUE_ROW_TOPK, config_id);
+  TORCH_CHECK(cta_n > 0, "The top-k GEMM was not launched");
+  return gemm_epilogue_merge_topk(candidates[0], candidates[1], _out_feats.size(1) / cta_n, k,
+                                  at::cuda::getCurrentCUDAStream());
+}
@@ -12,6 +12,20 @@
 // }
 
 #include <torch/extension.h>
+#include "../gemm_epilogue.h"
 
-void w8a8_gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats);
+void w8a8_gemm_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats, int config_id = -1);
+
+// CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES of every config_id accepted above.
+// Same GEMM with the fused epilogues of gemm_epilogue.cuh (epilogue is a GEMM_EPILOGUE_* bit mask).
+// If quant_out is given, out_feats is additionally quantized per token into quant_out / quant_scale
+// (and its row sum into quant_sum) from row stats accumulated in the epilogue.
+void w8a8_gemm_epilogue_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats, int epilogue, c10::optional<torch::Tensor> _residual, c10::optional<torch::Tensor> _quant_out, c10::optional<torch::Tensor> _quant_scale, c10::optional<torch::Tensor> _quant_sum, int config_id = -1);
+
+// GEMM with the GEMM_EPILOGUE_ROW_TOPK epilogue (LM head): returns the k largest logits of every row (fp32 values
+// and int32 columns, descending). out_feats only receives the rows with a non-zero full_logit_rows flag (all rows
+// if it is not given); requires N % CTA_N == 0.
+std::vector<torch::Tensor> w8a8_gemm_topk_forward_cuda(torch::Tensor _in_feats, torch::Tensor _kernel, torch::Tensor _wscales, torch::Tensor _ascales, torch::Tensor _out_feats, int k, c10::optional<torch::Tensor> _full_logit_rows, int config_id = -1);
+
+std::vector<std::vector<int>> w8a8_gemm_tile_configs();
 
@@ -163,8 +163,43 @@ __inline__ __device__ T blockAllReduceMax(T val)
     return val;
 }
 
+/* Reduce over the kThreadsPerRow threads that share a row: a single warp (one row per warp, no block
+   barrier) or the whole block. The result is returned to every thread of the row. */
+template <int kThreadsPerRow>
+__inline__ __device__ float rowReduceSum(float val)
+{
+    val = warpReduceSum(val);
+    if constexpr (kThreadsPerRow > 32)
+    {
+        __shared__ float shared[kThreadsPerRow / 32];
+        if ((threadIdx.x & 0x1f) == 0)
+            shared[threadIdx.x >> 5] = val;
+        __syncthreads();
+        val = 0.0f;
+#pragma unroll
+        for (int i = 0; i < kThreadsPerRow / 32; ++i)
+            val += shared[i];
+        __syncthreads();
+    }
+    return val;
+}
 
-
-
+template <int kThreadsPerRow>
+__inline__ __device__ float rowReduceMax(float val)
+{
+    val = warpReduceMax(val);
+    if constexpr (kThreadsPerRow > 32)
+    {
+        __shared__ float shared[kThreadsPerRow / 32];
+        if ((threadIdx.x & 0x1f) == 0)
+            shared[threadIdx.x >> 5] = val;
+        __syncthreads();
+#pragma unroll
+        for (int i = 0; i < kThreadsPerRow / 32; ++i)
+            val = fmaxf(val, shared[i]);
+        __syncthreads();
+    }
+    return val;
+}
 
 } // namespace vllm
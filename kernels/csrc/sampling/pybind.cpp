@@ -0,0 +1,26 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <pybind11/pybind11.h>
+#include <torch/extension.h>
+#include "sampling_kernels.h"
+#include "../nvtx_utils.h"
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    m.def("batched_sampling", omniserve::nvtx_wrap("batched_sampling", &batched_sampling),
+          "per-row repetition penalty, temperature, top-k / top-p filtering and sampling",
+          py::arg("logits"), py::arg("temperatures"), py::arg("top_ks"), py::arg("top_ps"),
+          py::arg("repetition_penalties"), py::arg("uniforms"), py::arg("penalty_offsets") = py::none(),
+          py::arg("penalty_token_ids") = py::none());
+}
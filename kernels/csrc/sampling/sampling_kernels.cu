@@ -0,0 +1,279 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <cub/cub.cuh>
+#include <float.h>
+#include <torch/extension.h>
+
+#include "../dispatch_utils.h"
+#include "sampling_kernels.h"
+
+#define SAMPLING_THREADS 1024
+#define SAMPLING_RADIX_BITS 8
+#define SAMPLING_RADIX_BINS (1 << SAMPLING_RADIX_BITS)
+#define SAMPLING_EPS 1e-5f
+
+// Order-preserving map of fp32 to uint32: a > b iff key(a) > key(b).
+__device__ __forceinline__ uint32_t ordered_key(const float x)
+{
+  const uint32_t bits = __float_as_uint(x);
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+struct ArgMaxPair
+{
+  float value;
+  int index;
+};
+
+struct ArgMaxOp
+{
+  // Ties go to the lower token id like torch.argmax.
+  __device__ __forceinline__ ArgMaxPair operator()(const ArgMaxPair &a, const ArgMaxPair &b) const
+  {
+    return (b.value > a.value || (b.value == a.value && b.index < a.index)) ? b : a;
+  }
+};
+
+// Key of the token at which the weights summed from the largest logit down (over keys >= min_key) reach target,
+// e.g. the k-th largest logit for unit weights. MSB digit first: every pass histograms the next digit of the keys
+// that match the digits selected so far and picks the bin where the running sum crosses the rest of the target.
+template <typename BinT, typename WeightFn>
+__device__ uint32_t radix_select(const float *x, const int vocab_size, const uint32_t min_key, BinT target,
+                                 const WeightFn &weight, BinT *hist, uint32_t *s_prefix, BinT *s_target)
+{
+  uint32_t prefix = 0, prefix_mask = 0;
+  for (int shift = 32 - SAMPLING_RADIX_BITS; shift >= 0; shift -= SAMPLING_RADIX_BITS)
+  {
+    for (int b = threadIdx.x; b < SAMPLING_RADIX_BINS; b += blockDim.x)
+      hist[b] = BinT(0);
+    __syncthreads();
+    for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    {
+      const float v = x[i];
+      const uint32_t key = ordered_key(v);
+      if (key >= min_key && (key & prefix_mask) == prefix)
+        atomicAdd(hist + ((key >> shift) & (SAMPLING_RADIX_BINS - 1)), weight(v));
+    }
+    __syncthreads();
+    if (threadIdx.x == 0)
+    {
+      // Walk the bins from the largest digit; if rounding leaves the target unreached (fp32 mass), the lowest
+      // bin keeps every candidate.
+      BinT cum = BinT(0);
+      int bin = 0;
+      for (int b = SAMPLING_RADIX_BINS - 1; b >= 0; --b)
+      {
+        if (cum + hist[b] >= target)
+        {
+          bin = b;
+          break;
+        }
+        cum += hist[b];
+      }
+      *s_prefix = prefix | (uint32_t(bin) << shift);
+      *s_target = target - cum;
+    }
+    __syncthreads();
+    prefix = *s_prefix;
+    target = *s_target;
+    prefix_mask |= uint32_t(SAMPLING_RADIX_BINS - 1) << shift;
+  }
+  return prefix;
+}
+
+// One CTA per row. workspace holds the penalized, temperature-scaled fp32 logits of the row, which the passes
+// re-read from L2.
+template <typename scalar_t>
+__global__ void batched_sampling_kernel(const scalar_t *__restrict__ logits, float *__restrict__ workspace,
+                                        int64_t *__restrict__ sampled_tokens, const float *__restrict__ temperatures,
+                                        const int *__restrict__ top_ks, const float *__restrict__ top_ps,
+                                        const float *__restrict__ repetition_penalties,
+                                        const float *__restrict__ uniforms, const int *__restrict__ penalty_offsets,
+                                        const int *__restrict__ penalty_token_ids, const int vocab_size)
+{
+  using BlockArgMax = cub::BlockReduce<ArgMaxPair, SAMPLING_THREADS>;
+  using BlockSum = cub::BlockReduce<float, SAMPLING_THREADS>;
+  using BlockScan = cub::BlockScan<float, SAMPLING_THREADS>;
+  __shared__ union
+  {
+    typename BlockArgMax::TempStorage argmax;
+    typename BlockSum::TempStorage sum;
+    typename BlockScan::TempStorage scan;
+  } temp_storage;
+  __shared__ union
+  {
+    uint32_t counts[SAMPLING_RADIX_BINS];
+    float mass[SAMPLING_RADIX_BINS];
+  } hist;
+  __shared__ uint32_t s_prefix;
+  __shared__ uint32_t s_count_target;
+  __shared__ float s_mass_target;
+  __shared__ float s_float;
+  __shared__ int s_token;
+
+  const int row = blockIdx.x;
+  const scalar_t *row_logits = logits + row * int64_t(vocab_size);
+  float *x = workspace + row * int64_t(vocab_size);
+  const float temperature = temperatures[row];
+  const int top_k = top_ks[row];
+  const float top_p = top_ps[row];
+  const bool greedy = temperature < SAMPLING_EPS || top_k == 1;
+  // A positive scale keeps the sign the penalty looks at.
+  const float inv_temperature = greedy ? 1.0f : 1.0f / temperature;
+
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    x[i] = float(row_logits[i]) * inv_temperature;
+  if (penalty_offsets != nullptr)
+  {
+    const float penalty = repetition_penalties[row];
+    __syncthreads();
+    for (int j = penalty_offsets[row] + threadIdx.x; j < penalty_offsets[row + 1]; j += blockDim.x)
+    {
+      const int token = penalty_token_ids[j];
+      const float v = x[token];
+      x[token] = v < 0.0f ? v * penalty : v / penalty;
+    }
+  }
+  __syncthreads();
+
+  ArgMaxPair best = {-FLT_MAX, vocab_size};
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    best = ArgMaxOp()(best, ArgMaxPair{x[i], i});
+  best = BlockArgMax(temp_storage.argmax).Reduce(best, ArgMaxOp());
+  if (threadIdx.x == 0)
+  {
+    s_token = best.index;
+    s_float = best.value;
+  }
+  __syncthreads();
+  if (greedy)
+  {
+    if (threadIdx.x == 0)
+      sampled_tokens[row] = s_token;
+    return;
+  }
+  const float max_value = s_float;
+  __syncthreads();
+
+  // Tokens with keys below min_key are filtered out.
+  uint32_t min_key = 0;
+  if (top_k > 0 && top_k < vocab_size)
+  {
+    min_key = radix_select<uint32_t>(
+        x, vocab_size, 0u, uint32_t(top_k), [](float) { return 1u; }, hist.counts, &s_prefix, &s_count_target);
+  }
+
+  const auto exp_mass = [max_value](float v) { return __expf(v - max_value); };
+  const auto kept_mass = [&]() {
+    float mass = 0.0f;
+    for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    {
+      const float v = x[i];
+      if (ordered_key(v) >= min_key)
+        mass += exp_mass(v);
+    }
+    mass = BlockSum(temp_storage.sum).Sum(mass);
+    if (threadIdx.x == 0)
+      s_float = mass;
+    __syncthreads();
+    mass = s_float;
+    __syncthreads();
+    return mass;
+  };
+
+  if (top_p < 1.0f)
+  {
+    // Smallest set of the most likely tokens whose probability reaches top_p.
+    const float target = top_p * kept_mass();
+    min_key = radix_select<float>(x, vocab_size, min_key, target, exp_mass, hist.mass, &s_prefix, &s_mass_target);
+  }
+
+  // Inverse transform sampling over the kept tokens in the order (thread, strided index): any fixed order of the
+  // vocabulary gives the same distribution and this one keeps the loads coalesced.
+  float local_mass = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+  {
+    const float v = x[i];
+    if (ordered_key(v) >= min_key)
+      local_mass += exp_mass(v);
+  }
+  float prefix_mass, total_mass;
+  BlockScan(temp_storage.scan).ExclusiveSum(local_mass, prefix_mass, total_mass);
+  const float target = uniforms[row] * total_mass;
+  // The argmax stays selected if rounding puts the target past every interval.
+  if (prefix_mass <= target && target < prefix_mass + local_mass)
+  {
+    float cum = prefix_mass;
+    int last_kept = -1;
+    for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    {
+      const float v = x[i];
+      if (ordered_key(v) < min_key)
+        continue;
+      last_kept = i;
+      cum += exp_mass(v);
+      if (target < cum)
+        break;
+    }
+    s_token = last_kept;
+  }
+  __syncthreads();
+  if (threadIdx.x == 0)
+    sampled_tokens[row] = s_token;
+}
+
+torch::Tensor batched_sampling(torch::Tensor logits, torch::Tensor temperatures, torch::Tensor top_ks,
+                               torch::Tensor top_ps, torch::Tensor repetition_penalties, torch::Tensor uniforms,
+                               c10::optional<torch::Tensor> penalty_offsets,
+                               c10::optional<torch::Tensor> penalty_token_ids)
+{
+  TORCH_CHECK(logits.dim() == 2 && logits.is_contiguous(), "logits must be a contiguous [num_rows, vocab_size]");
+  const int num_rows = logits.size(0);
+  const int vocab_size = logits.size(1);
+  TORCH_CHECK(temperatures.scalar_type() == torch::kFloat32 && temperatures.numel() == num_rows,
+              "temperatures must be [num_rows] fp32");
+  TORCH_CHECK(top_ks.scalar_type() == torch::kInt32 && top_ks.numel() == num_rows, "top_ks must be [num_rows] int32");
+  TORCH_CHECK(top_ps.scalar_type() == torch::kFloat32 && top_ps.numel() == num_rows, "top_ps must be [num_rows] fp32");
+  TORCH_CHECK(repetition_penalties.scalar_type() == torch::kFloat32 && repetition_penalties.numel() == num_rows,
+              "repetition_penalties must be [num_rows] fp32");
+  TORCH_CHECK(uniforms.scalar_type() == torch::kFloat32 && uniforms.numel() == num_rows,
+              "uniforms must be [num_rows] fp32");
+  TORCH_CHECK(penalty_offsets.has_value() == penalty_token_ids.has_value(),
+              "penalty_offsets and penalty_token_ids must be given together");
+  if (penalty_offsets.has_value())
+  {
+    TORCH_CHECK(penalty_offsets->scalar_type() == torch::kInt32 && penalty_offsets->numel() == num_rows + 1,
+                "penalty_offsets must be [num_rows + 1] int32");
+    TORCH_CHECK(penalty_token_ids->scalar_type() == torch::kInt32, "penalty_token_ids must be int32");
+  }
+
+  const at::cuda::OptionalCUDAGuard device_guard(device_of(logits));
+  auto sampled_tokens = torch::empty({num_rows}, logits.options().dtype(torch::kInt64));
+  if (num_rows == 0)
+    return sampled_tokens;
+  auto workspace = torch::empty({num_rows, vocab_size}, logits.options().dtype(torch::kFloat32));
+
+  const cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  VLLM_DISPATCH_FLOATING_TYPES(logits.scalar_type(), "batched_sampling_kernel", [&] {
+    batched_sampling_kernel<scalar_t><<<num_rows, SAMPLING_THREADS, 0, stream>>>(
+        logits.data_ptr<scalar_t>(), workspace.data_ptr<float>(), sampled_tokens.data_ptr<int64_t>(),
+        temperatures.data_ptr<float>(), top_ks.data_ptr<int>(), top_ps.data_ptr<float>(),
+        repetition_penalties.data_ptr<float>(), uniforms.data_ptr<float>(),
+        penalty_offsets.has_value() ? penalty_offsets->data_ptr<int>() : nullptr,
+        penalty_token_ids.has_value() ? penalty_token_ids->data_ptr<int>() : nullptr, vocab_size);
+  });
+  return sampled_tokens;
+}
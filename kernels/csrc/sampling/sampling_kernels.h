@@ -0,0 +1,32 @@
+// Implemented by Haotian Tang and Shang Yang.
+// @article{lin2024qserve,
+//   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+//   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+//   journal={arXiv preprint arXiv:2405.04532},
+//   year={2024}
+// }
+// @article{yang2025lserve,
+//   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+//   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+//   year={2025}
+// }
+
+// Batched token sampling with per-row parameters, so requests with different sampling parameters share a batch.
+// One CTA per row applies the repetition penalty and the temperature, finds the top-k / top-p thresholds with radix
+// selects over the logits (no sort of the vocabulary) and draws the token by inverse transform sampling.
+#pragma once
+
+#include <torch/extension.h>
+
+// Rows with temperature < 1e-5 or top_k == 1 are greedy. top_k <= 0 and top_p >= 1 disable the respective filter;
+// ties at the top-k threshold are all kept. The repetition penalty follows HF (logit < 0: * penalty, else / penalty)
+// on the unique tokens penalty_token_ids[penalty_offsets[b] : penalty_offsets[b + 1]] of row b.
+// Returns the sampled tokens [num_rows] (int64).
+torch::Tensor batched_sampling(torch::Tensor logits,                          // [num_rows, vocab_size]
+                               torch::Tensor temperatures,                    // [num_rows] fp32
+                               torch::Tensor top_ks,                          // [num_rows] int32
+                               torch::Tensor top_ps,                          // [num_rows] fp32
+                               torch::Tensor repetition_penalties,            // [num_rows] fp32
+                               torch::Tensor uniforms,                        // [num_rows] fp32 in [0, 1)
+                               c10::optional<torch::Tensor> penalty_offsets,  // [num_rows + 1] int32
+                               c10::optional<torch::Tensor> penalty_token_ids); // [num_penalty_tokens] int32
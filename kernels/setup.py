@@ -142,10 +142,20 @@ if nvcc_cuda_version < Version("11.8"):
 # Add target compute capabilities to NVCC flags.
 for capability in compute_capabilities:
     num = capability[0] + capability[2]
+    if num == "90" and nvcc_cuda_version >= Version("12.0"):
+        # wgmma / setmaxnreg (Hopper W4A8 GEMM mainloop) need the arch-specific sm_90a target.
+        NVCC_FLAGS += ["-gencode", "arch=compute_90a,code=sm_90a", "-DCOMPILE_HOPPER_TMA_GEMMS"]
+        CXX_FLAGS += ["-DCOMPILE_HOPPER_TMA_GEMMS"]
+        continue
     NVCC_FLAGS += ["-gencode", f"arch=compute_{num},code=sm_{num}"]
     if capability.endswith("+PTX"):
         NVCC_FLAGS += ["-gencode", f"arch=compute_{num},code=compute_{num}"]
 
+# cuda_fp8.h (E4M3 KV cache) ships with CUDA 11.8.
+if nvcc_cuda_version >= Version("11.8"):
+    CXX_FLAGS += ["-DENABLE_FP8"]
+    NVCC_FLAGS += ["-DENABLE_FP8"]
+
 # Use NVCC threads to parallelize the build.
 if nvcc_cuda_version >= Version("11.2"):
     num_threads = min(os.cpu_count(), 32)
@@ -173,6 +183,7 @@ fused_attention_extension_fine_grained_sparse = CUDAExtension(
     sources=[
         "csrc/fused_attention/fused_attention_fine_grained/sparse_attention/fused_attention.cpp",
         "csrc/fused_attention/fused_attention_fine_grained/sparse_attention/decoderMaskedMultiheadAttention.cu",
+        "csrc/fused_attention/fused_attention_fine_grained/sparse_attention/streamingHeadAttention.cu",
         "csrc/fused_attention/fused_attention_fine_grained/fine_grained_common/update_kv_cache.cu",
         "csrc/fused_attention/common/input_metadata_helper.cu"
     ],
@@ -259,6 +270,20 @@ fused_attention_selector_extension = CUDAExtension(
 ext_modules.append(fused_attention_selector_extension)
 
 
+fused_attention_paged_context_extension = CUDAExtension(
+    name="omniserve_backend.fused_attention_paged_context",
+    sources=[
+        "csrc/fused_attention/paged_context_attention/pybind.cpp",
+        "csrc/fused_attention/paged_context_attention/paged_context_attention.cu",
+    ],
+    extra_compile_args={
+        "cxx": CXX_FLAGS,
+        "nvcc": NVCC_FLAGS,
+    },
+)
+ext_modules.append(fused_attention_paged_context_extension)
+
+
 qgemm_w8a8_extension = CUDAExtension(
     name="omniserve_backend.qgemm_w8a8",
     sources=[
@@ -291,6 +316,7 @@ qgemm_w4a8_per_group_extension = CUDAExtension(
     sources=[
         "csrc/qgemm/w4a8_per_group/pybind.cpp",
         "csrc/qgemm/w4a8_per_group/gemm_cuda.cu",
+        "csrc/qgemm/w4a8_per_group/gemm_cuda_sm90.cu",
     ],
     extra_compile_args={
         "cxx": CXX_FLAGS,
@@ -299,6 +325,49 @@ qgemm_w4a8_per_group_extension = CUDAExtension(
 )
 ext_modules.append(qgemm_w4a8_per_group_extension)
 
+# W4A4 GEMM (int4 tensor cores) for long prefill chunks; decoding stays on the W4A8 GEMMs.
+qgemm_w4a4_extension = CUDAExtension(
+    name="omniserve_backend.qgemm_w4a4",
+    sources=[
+        "csrc/qgemm/w4a4/pybind.cpp",
+        "csrc/qgemm/w4a4/w4a4_gemm_cuda.cu",
+        "csrc/qgemm/w4a4/w4a4_quant_cuda.cu",
+    ],
+    extra_compile_args={
+        "cxx": CXX_FLAGS,
+        "nvcc": NVCC_FLAGS,
+    },
+)
+ext_modules.append(qgemm_w4a4_extension)
+
+# MoE routing kernels (gating, permute / un-permute) around the grouped W4A8 GEMM.
+moe_helpers_extension = CUDAExtension(
+    name="omniserve_backend.moe_helpers",
+    sources=[
+        "csrc/moe/pybind.cpp",
+        "csrc/moe/moe_kernels.cu",
+    ],
+    extra_compile_args={
+        "cxx": CXX_FLAGS,
+        "nvcc": NVCC_FLAGS,
+    },
+)
+ext_modules.append(moe_helpers_extension)
+
+# Batched sampling with per-row sampling parameters.
+sampling_extension = CUDAExtension(
+    name="omniserve_backend.sampling_ops",
+    sources=[
+        "csrc/sampling/pybind.cpp",
+        "csrc/sampling/sampling_kernels.cu",
+    ],
+    extra_compile_args={
+        "cxx": CXX_FLAGS,
+        "nvcc": NVCC_FLAGS,
+    },
+)
+ext_modules.append(sampling_extension)
+
 # Fuse kernels.
 fused_extension = CUDAExtension(
     name="omniserve_backend.fused_kernels",
@@ -332,6 +401,17 @@ activation_extension = CUDAExtension(
 )
 ext_modules.append(activation_extension)
 
+# KV cache swap / copy kernels.
+cache_extension = CUDAExtension(
+    name="omniserve_backend.cache_ops",
+    sources=["csrc/cache.cpp", "csrc/cache_kernels.cu"],
+    extra_compile_args={
+        "cxx": CXX_FLAGS,
+        "nvcc": NVCC_FLAGS,
+    },
+)
+ext_modules.append(cache_extension)
+
 
 
 def get_path(*filepath) -> str:
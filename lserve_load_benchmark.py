@@ -0,0 +1,285 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Open-loop load benchmark of the LLMEngine.
+
+Requests arrive by a trace (jsonl, one request per line: "arrival_time" in seconds from the start, "input_len",
+"output_len" and optionally "prompt") or by a Poisson / bursty (gamma inter-arrival) process at --request-rate,
+independently of how fast the engine serves them. Reports TTFT, TPOT and end-to-end latency percentiles, goodput
+under --slo-ttft / --slo-tpot and the KV block utilisation over time. Requires --ifb-mode.
+"""
+
+import argparse
+import json
+import os
+import time
+from typing import Dict, List, Optional
+
+import numpy as np
+import torch
+
+from omniserve import EngineArgs, LLMEngine, SamplingParams
+from omniserve.config import ProfilingConfig
+
+PERCENTILES = (50, 90, 99)
+
+
+class Request:
+    def __init__(self, arrival_time: float, input_len: int, output_len: int, prompt: Optional[str] = None):
+        self.arrival_time = arrival_time
+        self.input_len = input_len
+        self.output_len = output_len
+        self.prompt = prompt
+        self.seq = None
+        self.first_token_time = None
+        self.finish_time = None
+        self.num_output_tokens = 0
+
+
+def load_trace(path: str, num_requests: int) -> List[Request]:
+    requests = []
+    with open(path, "r") as file:
+        for line in file:
+            if not line.strip():
+                continue
+            entry = json.loads(line)
+            requests.append(
+                Request(
+                    float(entry.get("arrival_time", entry.get("timestamp", 0.0))),
+                    int(entry.get("input_len", entry.get("prompt_len", 0))),
+                    int(entry["output_len"]),
+                    entry.get("prompt"),
+                )
+            )
+    requests.sort(key=lambda request: request.arrival_time)
+    if num_requests > 0:
+        requests = requests[:num_requests]
+    # The trace starts when the benchmark does.
+    start = requests[0].arrival_time if requests else 0.0
+    for request in requests:
+        request.arrival_time -= start
+    return requests
+
+
+def sample_lengths(rng: np.random.Generator, mean: int, distribution: str, num_requests: int) -> np.ndarray:
+    if distribution == "fixed":
+        lengths = np.full(num_requests, mean)
+    elif distribution == "uniform":
+        lengths = rng.integers(mean // 2, mean * 3 // 2 + 1, num_requests)
+    elif distribution == "exponential":
+        lengths = rng.exponential(mean, num_requests)
+    else:
+        raise ValueError(f"Unsupported length distribution {distribution}")
+    return np.maximum(lengths.astype(np.int64), 1)
+
+
+def generate_requests(args: argparse.Namespace) -> List[Request]:
+    rng = np.random.default_rng(args.seed)
+    num_requests = args.num_requests
+    if args.arrival_process == "poisson":
+        intervals = rng.exponential(1.0 / args.request_rate, num_requests)
+    elif args.arrival_process == "bursty":
+        # Gamma inter-arrival times of the same mean: shape < 1 clusters the requests into bursts.
+        intervals = rng.gamma(args.burstiness, 1.0 / (args.request_rate * args.burstiness), num_requests)
+    else:
+        raise ValueError(f"Unsupported arrival process {args.arrival_process}")
+    arrival_times = np.cumsum(intervals) - intervals[0]
+    input_lens = sample_lengths(rng, args.input_len, args.len_distribution, num_requests)
+    output_lens = sample_lengths(rng, args.output_len, args.len_distribution, num_requests)
+    return [
+        Request(float(arrival_time), int(input_len), int(output_len))
+        for arrival_time, input_len, output_len in zip(arrival_times, input_lens, output_lens)
+    ]
+
+
+def get_kv_block_utilization(engine: LLMEngine) -> Dict[str, float]:
+    block_manager = engine.scheduler.block_manager
+    utilization = {}
+    for cache_mode, blockspace_manager, num_total_blocks in (
+        ("retrieval", block_manager.retrieval_blockspace_manager, block_manager.num_total_retrieval_gpu_blocks),
+        ("streaming", block_manager.streaming_blockspace_manager, block_manager.num_total_streaming_gpu_blocks),
+    ):
+        if blockspace_manager is None or num_total_blocks == 0:
+            continue
+        utilization[cache_mode] = 1.0 - blockspace_manager.get_num_free_gpu_blocks() / num_total_blocks
+    return utilization
+
+
+def run_open_loop(engine: LLMEngine, requests: List[Request], sample_interval: float) -> List[Dict]:
+    """Adds every request at its arrival time and steps the engine; returns the KV utilisation samples."""
+    pending = list(requests)
+    running: Dict[int, Request] = {}
+    utilization_samples = []
+    sampling_params = SamplingParams(top_p=0.95, top_k=1, temperature=0.0)
+    next_sample_time = 0.0
+    start = time.monotonic()
+    while pending or engine.has_unfinished_requests():
+        now = time.monotonic() - start
+        while pending and pending[0].arrival_time <= now:
+            request = pending.pop(0)
+            request_id = str(len(requests) - len(pending) - 1)
+            if request.prompt is None:
+                added = engine.add_request(
+                    request_id,
+                    prompt=None,
+                    sampling_params=sampling_params,
+                    arrival_time=start + request.arrival_time,
+                    profiling_config=ProfilingConfig(request.input_len, request.output_len),
+                )
+            else:
+                params = SamplingParams(top_p=0.95, top_k=1, temperature=0.0, max_tokens=request.output_len)
+                added = engine.add_request(request_id, request.prompt, params, arrival_time=start + request.arrival_time)
+            if added:
+                request.seq = engine.scheduler.waiting[-1].get_seqs()[0]
+                running[request.seq.seq_id] = request
+        if not engine.has_unfinished_requests():
+            # Idle until the next arrival.
+            time.sleep(max(0.0, pending[0].arrival_time - (time.monotonic() - start)))
+            continue
+
+        request_outputs = engine.step()
+        now = time.monotonic() - start
+        for request_output in request_outputs:
+            request = running.get(request_output["id"])
+            if request is None:
+                continue
+            request.num_output_tokens = request.seq.get_output_len()
+            if request.first_token_time is None and request.num_output_tokens > 0:
+                request.first_token_time = now
+            if request_output["finished"]:
+                request.finish_time = now
+                del running[request_output["id"]]
+        if now >= next_sample_time:
+            utilization_samples.append({"time": now, **get_kv_block_utilization(engine)})
+            next_sample_time = now + sample_interval
+    return utilization_samples
+
+
+def summarize(requests: List[Request], args: argparse.Namespace, utilization_samples: List[Dict]) -> Dict:
+    finished = [request for request in requests if request.finish_time is not None]
+    ttfts = np.array([request.first_token_time - request.arrival_time for request in finished])
+    e2e_latencies = np.array([request.finish_time - request.arrival_time for request in finished])
+    # Time per output token after the first one.
+    tpots = np.array([
+        (request.finish_time - request.first_token_time) / (request.num_output_tokens - 1)
+        for request in finished if request.num_output_tokens > 1
+    ])
+    duration = max(request.finish_time for request in finished) if finished else 0.0
+    num_output_tokens = sum(request.num_output_tokens for request in finished)
+
+    def percentiles(values: np.ndarray) -> Dict[str, float]:
+        if values.size == 0:
+            return {}
+        return {f"p{p}": float(np.percentile(values, p)) for p in PERCENTILES} | {"mean": float(values.mean())}
+
+    # A request meets the SLOs if its TTFT and its TPOT are both within their targets (no target: always met).
+    good = [
+        request for request in finished
+        if (args.slo_ttft <= 0 or request.first_token_time - request.arrival_time <= args.slo_ttft)
+        and (
+            args.slo_tpot <= 0 or request.num_output_tokens <= 1
+            or (request.finish_time - request.first_token_time) / (request.num_output_tokens - 1) <= args.slo_tpot
+        )
+    ]
+    utilization = {}
+    for cache_mode in ("retrieval", "streaming"):
+        values = np.array([sample[cache_mode] for sample in utilization_samples if cache_mode in sample])
+        if values.size > 0:
+            utilization[cache_mode] = {"mean": float(values.mean()), "max": float(values.max())}
+    return {
+        "num_requests": len(requests),
+        "num_finished": len(finished),
+        "duration": duration,
+        "request_throughput": len(finished) / duration if duration > 0 else 0.0,
+        "output_throughput": num_output_tokens / duration if duration > 0 else 0.0,
+        "ttft": percentiles(ttfts),
+        "tpot": percentiles(tpots),
+        "e2e_latency": percentiles(e2e_latencies),
+        "slo_attainment": len(good) / len(requests) if requests else 0.0,
+        "goodput": len(good) / duration if duration > 0 else 0.0,
+        "kv_block_utilization": utilization,
+    }
+
+
+def print_summary(summary: Dict) -> None:
+    print("=" * 50)
+    print(f"Finished requests: {summary['num_finished']} / {summary['num_requests']} in {summary['duration']:.2f} s")
+    print(f"Request throughput: {summary['request_throughput']:.3f} requests / second")
+    print(f"Output throughput: {summary['output_throughput']:.1f} tokens / second")
+    for name, unit_scale, unit in (("ttft", 1e3, "ms"), ("tpot", 1e3, "ms"), ("e2e_latency", 1.0, "s")):
+        stats = summary[name]
+        if stats:
+            print(f"{name.upper()} ({unit}): " + ", ".join(f"{k} {v * unit_scale:.2f}" for k, v in stats.items()))
+    print(f"SLO attainment: {summary['slo_attainment'] * 100:.1f}%, goodput: {summary['goodput']:.3f} requests / second")
+    for cache_mode, stats in summary["kv_block_utilization"].items():
+        print(f"KV block utilization ({cache_mode}): mean {stats['mean'] * 100:.1f}%, max {stats['max'] * 100:.1f}%")
+    print("=" * 50)
+
+
+def main(args: argparse.Namespace):
+    engine_args = EngineArgs.from_cli_args(args)
+    assert engine_args.ifb_mode, "The open-loop benchmark requires --ifb-mode."
+    engine = LLMEngine.from_engine_args(engine_args)
+    if args.trace is not None:
+        requests = load_trace(args.trace, args.num_requests)
+    else:
+        requests = generate_requests(args)
+    # Synthetic prompts are random tokens: run every request to its output length.
+    engine.profiling_mode = args.trace is None or all(request.prompt is None for request in requests)
+
+    with torch.no_grad():
+        utilization_samples = run_open_loop(engine, requests, args.utilization_interval)
+    summary = summarize(requests, args, utilization_samples)
+    print_summary(summary)
+    if args.output_json is not None:
+        os.makedirs(os.path.dirname(os.path.abspath(args.output_json)), exist_ok=True)
+        with open(args.output_json, "w") as file:
+            json.dump(
+                {
+                    "summary": summary,
+                    "kv_block_utilization": utilization_samples,
+                    "requests": [
+                        {
+                            "arrival_time": request.arrival_time,
+                            "input_len": request.input_len,
+                            "output_len": request.output_len,
+                            "first_token_time": request.first_token_time,
+                            "finish_time": request.finish_time,
+                            "num_output_tokens": request.num_output_tokens,
+                        }
+                        for request in requests
+                    ],
+                },
+                file,
+                indent=2,
+            )
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Open-loop load benchmark of the LLMEngine")
+    parser = EngineArgs.add_cli_args(parser)
+    parser.add_argument("--trace", type=str, default=None, help="jsonl trace to replay (default: synthetic arrivals)")
+    parser.add_argument("--num-requests", type=int, default=256, help="requests to send (trace: 0 replays all)")
+    parser.add_argument("--arrival-process", type=str, default="poisson", choices=["poisson", "bursty"])
+    parser.add_argument("--request-rate", type=float, default=1.0, help="mean arrivals per second")
+    parser.add_argument(
+        "--burstiness", type=float, default=0.5,
+        help="shape of the gamma inter-arrival times of --arrival-process bursty (1 is Poisson, < 1 is burstier)",
+    )
+    parser.add_argument("--input-len", type=int, default=4096, help="mean prompt length")
+    parser.add_argument("--output-len", type=int, default=256, help="mean output length")
+    parser.add_argument("--len-distribution", type=str, default="fixed", choices=["fixed", "uniform", "exponential"])
+    parser.add_argument("--slo-ttft", type=float, default=0.0, help="TTFT target of the goodput in seconds (0: none)")
+    parser.add_argument("--slo-tpot", type=float, default=0.0, help="TPOT target of the goodput in seconds (0: none)")
+    parser.add_argument("--utilization-interval", type=float, default=1.0, help="seconds between KV utilization samples")
+    parser.add_argument("--output-json", type=str, default=None, help="write the summary and the per-request times")
+    args = parser.parse_args()
+    main(args)
@@ -17,10 +17,14 @@ class CtxAttnConfig:
         sparse_context_mode: bool,
         ctx_sink_token: Optional[int] = 0,
         ctx_local_token: Optional[int] = 0,
+        ctx_dynamic_sparse: Optional[bool] = False,
     ) -> None:
         self.sparse_context_mode = sparse_context_mode
         self.ctx_sink_token = ctx_sink_token
         self.ctx_local_token = ctx_local_token
+        # Prefill chunks after a cached prefix select the prefix pages of their retrieval heads with the decode page
+        # selector (mean chunk query) instead of attending to the whole prefix.
+        self.ctx_dynamic_sparse = ctx_dynamic_sparse
         
         self._verify_args()
     
@@ -50,7 +54,12 @@ class DecAttnConfig:
         dec_local_token: Optional[int] = 0,
         sub_chunk_per_block: Optional[int] = 0,
         dynamic_sparse_token_budget: Optional[int] = 0,
-        selector_update_interval: Optional[int] = 0
+        selector_update_interval: Optional[int] = 0,
+        super_page_size: Optional[int] = 0,
+        num_selected_super_pages: Optional[int] = 0,
+        selector_drift_threshold: Optional[float] = 0.0,
+        persistent_decode_attention: Optional[bool] = False,
+        gqa_page_selection: Optional[str] = "none",
     ) -> None:
         self.sparse_decode_mode = sparse_decode_mode
         self.cache_block_size = cache_block_size
@@ -60,6 +69,15 @@ class DecAttnConfig:
         self.sub_chunk_per_block = sub_chunk_per_block
         self.dynamic_sparse_token_budget = dynamic_sparse_token_budget
         self.selector_update_interval = selector_update_interval
+        # Hierarchical page selection: pages per super-page (0 = flat selection) and super-pages kept per head.
+        self.super_page_size = super_page_size
+        self.num_selected_super_pages = num_selected_super_pages
+        # Between two scheduled selections, reselect early once the query cosine similarity to the last selecting query drops below this (0 = off).
+        self.selector_drift_threshold = selector_drift_threshold
+        # Sparse decoding attention with persistent CTAs that drain one queue of retrieval- and streaming-head work.
+        self.persistent_decode_attention = persistent_decode_attention
+        # One page set per KV head from the scores of its query heads aggregated by "max" or "sum" ("none": per query head).
+        self.gqa_page_selection = gqa_page_selection
         self.dec_sink_block = self.dec_sink_token // self.cache_block_size
         self.dec_local_block = self.dec_local_token // self.cache_block_size + 1
 
@@ -75,6 +93,15 @@ class DecAttnConfig:
                 raise ValueError(f"Sub chunk per block must be larger than 0. Got {self.sub_chunk_per_block}.")
             if self.dynamic_sparse_token_budget <= 0 or self.dynamic_sparse_token_budget % self.cache_block_size != 0:
                 raise ValueError(f"require self.dynamic_sparse_token_budget > 0 and self.dynamic_sparse_token_budget % self.cache_block_size == 0. Got {self.dynamic_sparse_token_budget} and {self.cache_block_size}.")
+            if self.super_page_size < 0 or self.num_selected_super_pages < 0:
+                raise ValueError(f"Super page size and number of selected super pages must be non-negative. Got {self.super_page_size} and {self.num_selected_super_pages}.")
+            if self.super_page_size > 0 and self.selector_update_interval > self.super_page_size * self.cache_block_size:
+                # The super-page stats of the last two super-pages are refreshed at each selection.
+                raise ValueError(f"Selector update interval must not exceed the tokens of a super page. Got {self.selector_update_interval} and {self.super_page_size * self.cache_block_size}.")
+            if not -1.0 <= self.selector_drift_threshold <= 1.0:
+                raise ValueError(f"Selector drift threshold is a cosine similarity and must be in [-1, 1]. Got {self.selector_drift_threshold}.")
+            if self.gqa_page_selection not in ("none", "max", "sum"):
+                raise ValueError(f"GQA page selection must be one of none, max and sum. Got {self.gqa_page_selection}.")
 
 
 class SpAttnConfig:
@@ -87,6 +114,7 @@ class SpAttnConfig:
         dec_attn_config: DecAttnConfig,
         static_sparse_attn_load_dir: Optional[str] = None,
         static_sparsity: Optional[float] = 0.0,
+        static_sparsity_levels: Optional[list] = None,
     ):
         self.total_num_kv_heads = total_num_kv_heads
         self.total_num_layers = total_num_layers
@@ -95,6 +123,11 @@ class SpAttnConfig:
         self.dec_attn_config = dec_attn_config
         self.static_sparse_attn_load_dir = static_sparse_attn_load_dir
         self.static_sparsity = static_sparsity
+        # Sparser levels a request may prefill with (SamplingParams.static_sparsity). They threshold the same head
+        # scores, so their retrieval heads are a subset of those of static_sparsity, which sets the KV page layout.
+        self.static_sparsity_levels = sorted(set(static_sparsity_levels or []))
+        # Global ids of the KV heads served by this rank, per layer (see partition_kv_heads).
+        self.kv_head_ids = [list(range(total_num_kv_heads)) for _ in range(total_num_layers)]
         
         self._verify_args()
         self._prepare_attn_pattern()
@@ -108,15 +141,17 @@ class SpAttnConfig:
                 raise FileExistsError(f"static sparse attention pattern file: {self.static_sparse_attn_load_dir} does not exist.")
             if self.static_sparsity < 0 or self.static_sparsity > 1:
                 raise ValueError(f"Static sparsity must be between 0 and 1. Got {self.static_sparsity}.")
+        for level in self.static_sparsity_levels:
+            if self.static_sparse_attn_load_dir is None:
+                raise ValueError(f"Static sparsity levels require a static sparse attention pattern file.")
+            if level <= self.static_sparsity or level > 1:
+                raise ValueError(f"Static sparsity levels must be in (static_sparsity, 1]. Got {level} with static_sparsity {self.static_sparsity}.")
         
     def _prepare_attn_pattern(self):
         def _sparsify_attention_heads(
             full_attention_heads, 
             static_sparsity,
         ):
-            # add a very small random noise to full_attention_heads to break ties
-            full_attention_heads += np.random.uniform(0, 1e-6, full_attention_heads.shape)
-
             if static_sparsity is not None:
                 # ignore the threshold and use the static_sparsity
                 # set the static_sparsity small values to 0 and others to 1
@@ -137,7 +172,8 @@ class SpAttnConfig:
             return full_attention_heads
 
     
-        if self.static_sparse_attn_load_dir is None or self.static_sparsity == 0:
+        self.level_full_attention_heads = {}
+        if self.static_sparse_attn_load_dir is None or (self.static_sparsity == 0 and not self.static_sparsity_levels):
             self.static_sparsity = 0
             self.full_attention_heads = torch.ones(self.total_num_layers, self.total_num_kv_heads, dtype=torch.int32)
         else:
@@ -147,21 +183,94 @@ class SpAttnConfig:
                 delimiter="\t",
             )
             full_attention_heads = np.clip(full_attention_heads, 0, 1)
+            # add a very small random noise to full_attention_heads to break ties (once, so the levels are nested)
+            full_attention_heads += np.random.uniform(0, 1e-6, full_attention_heads.shape)
             self.full_attention_heads = torch.tensor(_sparsify_attention_heads(full_attention_heads, self.static_sparsity), dtype=torch.int32)
+            for level in self.static_sparsity_levels:
+                self.level_full_attention_heads[level] = torch.tensor(
+                    _sparsify_attention_heads(full_attention_heads, level), dtype=torch.int32
+                ) & self.full_attention_heads
             config = json.load(open(os.path.join(self.static_sparse_attn_load_dir, "config.json")))
 
     
+    def partition_kv_heads(self, tp_size: int, tp_rank: int) -> None:
+        """Keeps the KV heads served by tp_rank, with the same number of retrieval heads on every rank.
+
+        Every rank's KV pages must have the same layout, so that the scheduler can manage one block table for all
+        of them, and the static sparsity pattern is rarely spread evenly over contiguous head shards. Retrieval
+        heads are dealt round-robin when the contiguous shards are unbalanced, and ranks that still have fewer
+        retrieval heads than the others promote streaming heads (dense attention, so accuracy is unaffected).
+        """
+        if tp_size == 1:
+            return
+        num_kv_heads = self.total_num_kv_heads
+        if num_kv_heads >= tp_size:
+            assert num_kv_heads % tp_size == 0
+            heads_per_rank = num_kv_heads // tp_size
+            num_replicas = 1
+        else:
+            # Fewer KV heads than ranks: every head is replicated on tp_size // num_kv_heads ranks.
+            assert tp_size % num_kv_heads == 0
+            heads_per_rank = 1
+            num_replicas = tp_size // num_kv_heads
+
+        local_full_attention_heads = []
+        local_level_full_attention_heads = {level: [] for level in self.level_full_attention_heads}
+        for layer_idx in range(self.total_num_layers):
+            flags = self.full_attention_heads[layer_idx].tolist()
+            if num_replicas > 1:
+                rank_heads = [[rank // num_replicas] for rank in range(tp_size)]
+            else:
+                rank_heads = [
+                    list(range(rank * heads_per_rank, (rank + 1) * heads_per_rank)) for rank in range(tp_size)
+                ]
+                counts = [sum(flags[h] for h in heads) for heads in rank_heads]
+                if max(counts) != min(counts):
+                    retrieval_heads = [h for h in range(num_kv_heads) if flags[h] == 1]
+                    streaming_heads = [h for h in range(num_kv_heads) if flags[h] == 0]
+                    rank_heads = [retrieval_heads[rank::tp_size] for rank in range(tp_size)]
+                    for heads in rank_heads:
+                        while len(heads) < heads_per_rank:
+                            heads.append(streaming_heads.pop(0))
+                        heads.sort()
+            num_retrieval_heads = max(sum(flags[h] for h in heads) for heads in rank_heads)
+
+            heads = rank_heads[tp_rank]
+            local_flags = [flags[h] for h in heads]
+            for i in range(len(local_flags)):
+                if sum(local_flags) >= num_retrieval_heads:
+                    break
+                local_flags[i] = 1
+            self.kv_head_ids[layer_idx] = heads
+            local_full_attention_heads.append(local_flags)
+            for level, level_flags in self.level_full_attention_heads.items():
+                local_level_full_attention_heads[level].append([level_flags[layer_idx][h].item() for h in heads])
+        self.full_attention_heads = torch.tensor(local_full_attention_heads, dtype=torch.int32)
+        self.level_full_attention_heads = {
+            level: torch.tensor(flags, dtype=torch.int32) for level, flags in local_level_full_attention_heads.items()
+        }
+
+    def get_kv_head_ids(self, layer_idx) -> list:
+        return self.kv_head_ids[layer_idx]
+
     def retrieval_head_num(self, layer_idx):
         return self.full_attention_heads[layer_idx].sum().item()     
     
     def streaming_head_num(self, layer_idx):
-        return self.total_num_kv_heads - self.retrieval_head_num(layer_idx) 
+        return self.full_attention_heads[layer_idx].numel() - self.retrieval_head_num(layer_idx) 
     
     def get_static_sparsity(self) -> float:
         return self.static_sparsity
     
     def get_full_attention_heads(self):
         return self.full_attention_heads
+
+    def get_static_sparsity_levels(self) -> list:
+        return self.static_sparsity_levels
+
+    def get_level_full_attention_heads(self, level: float):
+        """Retrieval head flags of a static sparsity level: a subset of get_full_attention_heads."""
+        return self.level_full_attention_heads[level]
     
     def sparse_kv_cache_enabled(self) -> bool:
         return self.static_sparsity != 0
@@ -178,6 +287,9 @@ class SpAttnConfig:
     def get_ctx_local_size(self) -> int:
         return self.ctx_attn_config.ctx_local_token
     
+    def ctx_dynamic_sparse_enabled(self) -> bool:
+        return self.ctx_attn_config.ctx_dynamic_sparse
+    
     def get_sparse_decode_mode(self) -> bool:
         return self.dec_attn_config.sparse_decode_mode
     
@@ -190,6 +302,21 @@ class SpAttnConfig:
     def get_dec_selector_update_interval(self) -> int:
         return self.dec_attn_config.selector_update_interval
     
+    def get_dec_super_page_size(self) -> int:
+        return self.dec_attn_config.super_page_size
+    
+    def get_dec_num_selected_super_pages(self) -> int:
+        return self.dec_attn_config.num_selected_super_pages
+    
+    def get_dec_selector_drift_threshold(self) -> float:
+        return self.dec_attn_config.selector_drift_threshold
+    
+    def get_dec_persistent_attention(self) -> bool:
+        return self.dec_attn_config.persistent_decode_attention
+    
+    def get_dec_gqa_page_selection(self) -> str:
+        return self.dec_attn_config.gqa_page_selection
+    
     def get_dec_sink_size(self) -> int:
         return self.dec_attn_config.dec_sink_token
     
@@ -211,18 +338,26 @@ def sparse_attn_init(
     sparse_decode_mode: int,
     static_sparse_attn_load_dir: Optional[str] = None,
     static_sparsity: Optional[float] = 0.0,
+    static_sparsity_levels: Optional[list] = None,
     ctx_sink_token: Optional[int] = 0,
     ctx_local_token: Optional[int] = 0,
+    ctx_dynamic_sparse: Optional[bool] = False,
     dec_sink_token: Optional[int] = 0,
     dec_local_token: Optional[int] = 0,
     sub_chunk_per_block: Optional[int] = 0,
     dynamic_sparse_token_budget: Optional[int] = 0,
-    selector_update_interval: Optional[int] = 0
+    selector_update_interval: Optional[int] = 0,
+    super_page_size: Optional[int] = 0,
+    num_selected_super_pages: Optional[int] = 0,
+    selector_drift_threshold: Optional[float] = 0.0,
+    persistent_decode_attention: Optional[bool] = False,
+    gqa_page_selection: Optional[str] = "none",
 ) -> SpAttnConfig:
     ctx_attn_config = CtxAttnConfig(
         sparse_context_mode = sparse_context_mode, 
         ctx_sink_token = ctx_sink_token, 
-        ctx_local_token = ctx_local_token
+        ctx_local_token = ctx_local_token,
+        ctx_dynamic_sparse = ctx_dynamic_sparse,
     )
     dec_attn_config = DecAttnConfig(
         sparse_decode_mode = sparse_decode_mode,
@@ -231,7 +366,12 @@ def sparse_attn_init(
         dec_local_token = dec_local_token,
         sub_chunk_per_block = sub_chunk_per_block,
         dynamic_sparse_token_budget = dynamic_sparse_token_budget,
-        selector_update_interval = selector_update_interval
+        selector_update_interval = selector_update_interval,
+        super_page_size = super_page_size,
+        num_selected_super_pages = num_selected_super_pages,
+        selector_drift_threshold = selector_drift_threshold,
+        persistent_decode_attention = persistent_decode_attention,
+        gqa_page_selection = gqa_page_selection,
     )
     sp_attn_config = SpAttnConfig(
         total_num_kv_heads = total_num_kv_heads,
@@ -240,7 +380,8 @@ def sparse_attn_init(
         ctx_attn_config = ctx_attn_config,
         dec_attn_config = dec_attn_config,
         static_sparse_attn_load_dir = static_sparse_attn_load_dir,
-        static_sparsity = static_sparsity
+        static_sparsity = static_sparsity,
+        static_sparsity_levels = static_sparsity_levels,
     )
     
     return sp_attn_config
\ No newline at end of file
@@ -1,7 +1,7 @@
 # original file: https://github.com/vllm-project/vllm/blob/main/vllm/block.py
 # modified by: Haotian Tang and Shang Yang
 """Token blocks."""
-from typing import List
+from typing import List, Optional
 
 from omniserve.utils.utils import Device
 
@@ -63,12 +63,17 @@ class PhysicalTokenBlock:
         self.block_size = block_size
 
         self.ref_count = 0
+        # Prefix caching: chained hash of the tokens held by the block (None: not cached), and
+        # whether its KV has been written (only computed blocks can be reused by other sequences).
+        self.content_hash: Optional[int] = None
+        self.computed = False
 
     def __repr__(self) -> str:
         return (
             f"PhysicalTokenBlock(device={self.device}, "
             f"block_number={self.block_number}, "
-            f"ref_count={self.ref_count})"
+            f"ref_count={self.ref_count}, "
+            f"content_hash={self.content_hash})"
         )
 
 
@@ -80,7 +80,9 @@ class ModelConfig:
         max_context_len_to_capture: Optional[int] = None,
         kv_quant_granularity: Optional[str] = None,
         chunk_prefill_size: Optional[str] = 4096,
-        multiblock_switch: Optional[int] = 0
+        multiblock_switch: Optional[int] = 0,
+        quantize_lm_head: bool = False,
+        w4a4_prefill_min_tokens: int = 0,
     ) -> None:
         self.model = model
         self.tokenizer = tokenizer
@@ -99,6 +101,9 @@ class ModelConfig:
         self.kv_quant_granularity = kv_quant_granularity
         self.chunk_prefill_size = chunk_prefill_size
         self.multiblock_switch = multiblock_switch
+        self.quantize_lm_head = quantize_lm_head
+        # Prompt steps of at least this many tokens run the MLP as W4A4 GEMMs (0: disabled).
+        self.w4a4_prefill_min_tokens = w4a4_prefill_min_tokens
         
         self.hf_config = AutoConfig.from_pretrained(
             self.model, trust_remote_code=trust_remote_code
@@ -192,6 +197,25 @@ class CacheConfig:
             vLLM execution.
         swap_space: Size of the CPU swap space per GPU (in GiB).
         cache_dtype: Data type for kv cache storage.
+        enable_prefix_caching: Reuse the KV pages of full blocks with the same
+            prefix across requests.
+        num_hot_retrieval_blocks: Retrieval pages kept on the GPU at the end of
+            every sequence; older pages are offloaded to pinned host memory and
+            staged back when the page selector picks them. 0: no offloading.
+        retrieval_offload_space: Size of the host pool of offloaded retrieval
+            pages per GPU (in GiB).
+        num_retrieval_staging_blocks: GPU pages (per layer buffer) to stage the
+            selected offloaded pages into.
+        max_retrieval_blocks_per_seq: Retrieval pages a decoding sequence keeps
+            on the GPU; the pages the decode page selector picked the least are
+            evicted beyond it. 0: no eviction.
+        retrieval_eviction_interval: Steps between two reads of the page
+            selection counts that drive the eviction.
+        retrieval_block_run_size: Free retrieval pages reserved after the
+            first page of a sequence, whose next pages are allocated at
+            consecutive block numbers when possible. 0: any free page.
+        retrieval_compaction_blocks_per_step: Retrieval pages moved per step
+            to join the runs of consecutive pages of the decoding sequences.
     """
 
     def __init__(
@@ -202,6 +226,14 @@ class CacheConfig:
         cache_dtype: str,
         cache_bits: int,
         sliding_window: Optional[int] = None,
+        enable_prefix_caching: bool = False,
+        num_hot_retrieval_blocks: int = 0,
+        retrieval_offload_space: int = 0,
+        num_retrieval_staging_blocks: int = 2048,
+        max_retrieval_blocks_per_seq: int = 0,
+        retrieval_eviction_interval: int = 16,
+        retrieval_block_run_size: int = 0,
+        retrieval_compaction_blocks_per_step: int = 0,
     ) -> None:
         self.block_size = block_size
         self.gpu_memory_utilization = gpu_memory_utilization
@@ -209,6 +241,14 @@ class CacheConfig:
         self.cache_dtype = cache_dtype
         self.cache_bits = cache_bits
         self.sliding_window = sliding_window
+        self.enable_prefix_caching = enable_prefix_caching
+        self.num_hot_retrieval_blocks = num_hot_retrieval_blocks
+        self.retrieval_offload_space_bytes = retrieval_offload_space * _GB
+        self.num_retrieval_staging_blocks = num_retrieval_staging_blocks
+        self.max_retrieval_blocks_per_seq = max_retrieval_blocks_per_seq
+        self.retrieval_eviction_interval = retrieval_eviction_interval
+        self.retrieval_block_run_size = retrieval_block_run_size
+        self.retrieval_compaction_blocks_per_step = retrieval_compaction_blocks_per_step
         self.sp_attn_config = None # assign later
         self._verify_args()
         self._verify_cache_dtype()
@@ -239,7 +279,7 @@ class CacheConfig:
         # FIXME(woosuk): Here, it is assumed that the GPUs in a tensor parallel
         # group are in the same node. However, the GPUs may span multiple nodes.
         num_gpus_per_node = parallel_config.tensor_parallel_size
-        cpu_memory_usage = self.swap_space_bytes * num_gpus_per_node
+        cpu_memory_usage = (self.swap_space_bytes + self.retrieval_offload_space_bytes) * num_gpus_per_node
 
         msg = (
             f"{cpu_memory_usage / _GB:.2f} GiB out of "
@@ -263,6 +303,15 @@ class ParallelConfig:
             parallel and large models.
         disable_custom_all_reduce: Disable the custom all-reduce kernel and
             fall back to NCCL.
+        disaggregated_prefill: Run the prompts on a second model instance
+            (ranks [tp, 2 * tp)), which sends the KV pages of every prompt to
+            the decoding instance (ranks [0, tp)).
+        context_parallel_size: Number of model instances (of
+            tensor_parallel_size ranks each) a long prompt is split across.
+            Instance 0 decodes; the other instances only run the prompt shards
+            and send their KV pages to it.
+        context_parallel_min_tokens: Shortest prompt that is prefilled with
+            context parallelism; shorter prompts run on instance 0 alone.
     """
 
     def __init__(
@@ -271,18 +320,27 @@ class ParallelConfig:
         tensor_parallel_size: int,
         max_parallel_loading_workers: Optional[int] = None,
         disable_custom_all_reduce: bool = False,
+        disaggregated_prefill: bool = False,
+        context_parallel_size: int = 1,
+        context_parallel_min_tokens: int = 32768,
     ) -> None:
         self.pipeline_parallel_size = pipeline_parallel_size
         self.tensor_parallel_size = tensor_parallel_size
         self.max_parallel_loading_workers = max_parallel_loading_workers
         self.disable_custom_all_reduce = disable_custom_all_reduce
+        self.disaggregated_prefill = disaggregated_prefill
+        self.context_parallel_size = context_parallel_size
+        self.context_parallel_min_tokens = context_parallel_min_tokens
+        self.num_instances = 2 if disaggregated_prefill else context_parallel_size
 
-        self.world_size = pipeline_parallel_size * tensor_parallel_size
+        self.world_size = pipeline_parallel_size * tensor_parallel_size * self.num_instances
         self._verify_args()
 
     def _verify_args(self) -> None:
         if self.pipeline_parallel_size > 1:
             raise NotImplementedError("Pipeline parallelism is not supported yet.")
+        if self.context_parallel_size > 1 and self.disaggregated_prefill:
+            raise ValueError("Context parallelism and disaggregated prefill cannot be combined.")
         if not self.disable_custom_all_reduce and self.world_size > 1:
             if is_hip():
                 self.disable_custom_all_reduce = True
@@ -319,6 +377,17 @@ class SchedulerConfig:
         max_model_len: Maximum length of a sequence (including prompt
             and generated text).
         max_paddings: Maximum number of paddings to be added to a batch.
+        step_token_budget: Tokens per step with mixed batching: every step runs
+            all the decoding sequences and fills the rest of the budget with
+            prefill chunks. 0: prefill and decode steps are separate.
+        preemption_policy: "cost" preempts the running sequences that lose the
+            least work and swaps or recomputes each of them, whichever is
+            estimated to be cheaper. "default" preempts the latest arrivals and
+            recomputes them (swaps them if they have several sequences).
+        preemption_prefill_tflops: Prefill throughput (TFLOPS per GPU) assumed
+            by the cost of a recompute.
+        preemption_swap_gbps: Host <-> device bandwidth (GB/s per GPU) assumed
+            by the cost of a swap.
     """
 
     def __init__(
@@ -327,6 +396,10 @@ class SchedulerConfig:
         max_num_seqs: int,
         max_model_len: int,
         max_paddings: int,
+        step_token_budget: int = 0,
+        preemption_policy: str = "cost",
+        preemption_prefill_tflops: float = 300.0,
+        preemption_swap_gbps: float = 20.0,
     ) -> None:
         if max_num_batched_tokens is not None:
             self.max_num_batched_tokens = max_num_batched_tokens
@@ -337,9 +410,36 @@ class SchedulerConfig:
         self.max_num_seqs = max_num_seqs
         self.max_model_len = max_model_len
         self.max_paddings = max_paddings
+        self.step_token_budget = step_token_budget
+        self.preemption_policy = preemption_policy
+        self.preemption_prefill_tflops = preemption_prefill_tflops
+        self.preemption_swap_gbps = preemption_swap_gbps
         self._verify_args()
 
     def _verify_args(self) -> None:
+        if self.preemption_policy not in ("default", "cost"):
+            raise ValueError(
+                f"Unknown preemption policy: {self.preemption_policy}. "
+                "Must be one of default and cost."
+            )
+        if self.preemption_prefill_tflops <= 0 or self.preemption_swap_gbps <= 0:
+            raise ValueError(
+                "preemption_prefill_tflops and preemption_swap_gbps must be "
+                f"positive. Got {self.preemption_prefill_tflops} and "
+                f"{self.preemption_swap_gbps}."
+            )
+        if 0 < self.step_token_budget <= self.max_num_seqs:
+            raise ValueError(
+                f"step_token_budget ({self.step_token_budget}) must be greater "
+                f"than max_num_seqs ({self.max_num_seqs}) to leave room for "
+                "prefill chunks next to the decoding sequences."
+            )
+        if self.step_token_budget > self.max_num_batched_tokens:
+            raise ValueError(
+                f"step_token_budget ({self.step_token_budget}) must be less "
+                f"than or equal to max_num_batched_tokens "
+                f"({self.max_num_batched_tokens})."
+            )
         if self.max_num_batched_tokens < self.max_model_len:
             raise ValueError(
                 f"max_num_batched_tokens ({self.max_num_batched_tokens}) is "
@@ -363,8 +463,10 @@ class DeviceConfig:
 
 
 class IFBConfig:
-    def __init__(self, ifb_mode: bool = False) -> None:
+    def __init__(self, ifb_mode: bool = False, async_engine_loop: bool = False) -> None:
         self.ifb_mode = ifb_mode
+        # Overlap the scheduling / input preparation of the next step with the GPU execution of the current one.
+        self.async_engine_loop = async_engine_loop
 
 
 class ProfilingConfig:
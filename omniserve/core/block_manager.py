@@ -12,6 +12,7 @@
 # }
 """A block manager that manages token blocks."""
 import enum
+from collections import OrderedDict
 from typing import Dict, List, Optional, Set, Tuple
 
 from omniserve.block import BlockTable, PhysicalTokenBlock
@@ -26,6 +27,18 @@ class BlockAllocator:
     The allocator maintains a list of free blocks and allocates a block when
     requested. When a block is freed, its reference count is decremented. If
     the reference count becomes zero, the block is added back to the free list.
+
+    With caching enabled, blocks registered under a content hash are kept in an
+    LRU list instead when they become unreferenced, so that a later sequence
+    with the same prefix can reuse their KV pages. They are only recycled once
+    the free list is empty, least recently freed first.
+
+    With run_size > 0, the allocator keeps sequences in contiguous runs of
+    block numbers: allocate(prev_block) returns the block right after
+    prev_block when it is free, and the first block of a sequence (or of a
+    broken run) starts a free extent of run_size blocks, with as many free
+    blocks before it when possible, so that the runs of other sequences can
+    still grow. The free blocks are then kept in a map by block number.
     """
 
     def __init__(
@@ -33,23 +46,76 @@ class BlockAllocator:
         device: Device,
         block_size: int,
         num_blocks: int,
+        enable_caching: bool = False,
+        run_size: int = 0,
+        max_run_scan: int = 64,
     ) -> None:
         self.device = device
         self.block_size = block_size
         self.num_blocks = num_blocks
+        self.enable_caching = enable_caching
+        self.run_size = run_size
+        # Free blocks checked for a free extent when a run starts.
+        self.max_run_scan = max_run_scan
 
         # Initialize the free blocks.
         self.free_blocks: BlockTable = []
+        # Contiguous runs (run_size > 0): block number -> free block, instead of free_blocks.
+        self.free_block_map: Dict[int, PhysicalTokenBlock] = {}
         for i in range(num_blocks):
             block = PhysicalTokenBlock(
                 device=device, block_number=i, block_size=block_size
             )
-            self.free_blocks.append(block)
-
-    def allocate(self) -> PhysicalTokenBlock:
-        if not self.free_blocks:
+            if run_size > 0:
+                self.free_block_map[i] = block
+            else:
+                self.free_blocks.append(block)
+        # Mapping: content hash -> block holding that content.
+        self.cached_blocks: Dict[int, PhysicalTokenBlock] = {}
+        # Unreferenced cached blocks, least recently freed first.
+        self.evictable_blocks: "OrderedDict[int, PhysicalTokenBlock]" = OrderedDict()
+
+    def _find_run_start(self) -> Optional[int]:
+        # A free block followed by run_size - 1 free blocks, preferably with run_size free blocks before it too.
+        fallback = None
+        for block_number, _ in zip(self.free_block_map, range(self.max_run_scan)):
+            if not all(
+                next_number in self.free_block_map
+                for next_number in range(block_number + 1, min(block_number + self.run_size, self.num_blocks))
+            ):
+                continue
+            if all(
+                prev_number in self.free_block_map
+                for prev_number in range(max(block_number - self.run_size, 0), block_number)
+            ):
+                return block_number
+            if fallback is None:
+                fallback = block_number
+        return fallback
+
+    def _pop_free_block(self, prev_block: Optional[PhysicalTokenBlock]) -> PhysicalTokenBlock:
+        if self.run_size == 0:
+            return self.free_blocks.pop()
+        if prev_block is not None and prev_block.device == self.device:
+            block = self.free_block_map.pop(prev_block.block_number + 1, None)
+            if block is not None:
+                return block
+        block_number = self._find_run_start()
+        if block_number is not None:
+            return self.free_block_map.pop(block_number)
+        return self.free_block_map.popitem()[1]
+
+    def allocate(self, prev_block: Optional[PhysicalTokenBlock] = None) -> PhysicalTokenBlock:
+        """prev_block: the block before the new one in its block table, if any (contiguous runs)."""
+        if self.free_blocks or self.free_block_map:
+            block = self._pop_free_block(prev_block)
+        elif self.evictable_blocks:
+            _, block = self.evictable_blocks.popitem(last=False)
+            del self.cached_blocks[block.content_hash]
+            block.content_hash = None
+            block.computed = False
+        else:
             raise ValueError("Out of memory! No free blocks are available.")
-        block = self.free_blocks.pop()
         block.ref_count = 1
         return block
 
@@ -58,10 +124,48 @@ class BlockAllocator:
             raise ValueError(f"Double free! {block} is already freed.")
         block.ref_count -= 1
         if block.ref_count == 0:
-            self.free_blocks.append(block)
+            if block.content_hash is not None:
+                self.evictable_blocks[block.content_hash] = block
+            elif self.run_size > 0:
+                self.free_block_map[block.block_number] = block
+            else:
+                self.free_blocks.append(block)
 
     def get_num_free_blocks(self) -> int:
-        return len(self.free_blocks)
+        return len(self.free_blocks) + len(self.free_block_map) + len(self.evictable_blocks)
+
+    def take(self, block_number: int) -> Optional[PhysicalTokenBlock]:
+        """Allocates the given free block (contiguous runs), None if it is not free."""
+        block = self.free_block_map.pop(block_number, None)
+        if block is not None:
+            block.ref_count = 1
+        return block
+
+    def lookup(self, content_hash: int) -> Optional[PhysicalTokenBlock]:
+        """Returns the computed block cached under content_hash, if any."""
+        block = self.cached_blocks.get(content_hash)
+        if block is None or not block.computed:
+            return None
+        return block
+
+    def get_computed_hashes(self) -> List[int]:
+        """Content hashes of the cached blocks whose KV is computed."""
+        return [content_hash for content_hash, block in self.cached_blocks.items() if block.computed]
+
+    def acquire(self, block: PhysicalTokenBlock, count: int) -> None:
+        """Adds count references to a cached block, taking it off the LRU list."""
+        if block.ref_count == 0:
+            del self.evictable_blocks[block.content_hash]
+        block.ref_count += count
+
+    def register(self, block: PhysicalTokenBlock, content_hash: int) -> None:
+        """Caches block under content_hash; its KV is computed by the current step."""
+        if not self.enable_caching or content_hash in self.cached_blocks:
+            # Another block already holds (or is computing) this content.
+            return
+        block.content_hash = content_hash
+        block.computed = False
+        self.cached_blocks[content_hash] = block
 
 
 class AllocStatus(enum.Enum):
@@ -89,10 +193,41 @@ class BaseBlockSpaceManager:
         num_cpu_blocks: int,
         watermark: float = 0.01,
         sink_local_blocks: Optional[Tuple[int, int]] = None,
+        enable_caching: bool = False,
+        num_hot_blocks: int = 0,
+        max_blocks_per_seq: int = 0,
+        eviction_sink_local_blocks: Tuple[int, int] = (0, 0),
+        block_run_size: int = 0,
+        compaction_blocks_per_step: int = 0,
     ) -> None:
         self.block_size = block_size
         self.num_total_gpu_blocks = num_gpu_blocks
         self.num_total_cpu_blocks = num_cpu_blocks
+        # Tiered cache: only the first block and the last num_hot_blocks blocks of a running sequence have to stay
+        # on the GPU, the others are moved to CPU blocks when a new block is appended (0: no offloading).
+        self.num_hot_blocks = num_hot_blocks
+        # GPU block -> CPU block, offloaded since the last pop_blocks_to_offload().
+        self.blocks_to_offload: Dict[int, int] = {}
+        # GPU blocks swapped in since then: their data only arrives after the offload copies of the step.
+        self.swapped_in_blocks: Set[int] = set()
+        # Page eviction: a decoding sequence keeps at most max_blocks_per_seq GPU blocks (0: no eviction), see
+        # _evict_blocks. The first / last blocks of eviction_sink_local_blocks are never evicted.
+        self.max_blocks_per_seq = max_blocks_per_seq
+        self.eviction_sink_blocks, self.eviction_local_blocks = eviction_sink_local_blocks
+        # Stands for the evicted entries of the block tables. Not owned by any allocator.
+        self.evicted_block = PhysicalTokenBlock(Device.GPU, 0, block_size)
+        # Seq id -> evicted entries of its table, in eviction order.
+        self.evicted_pages: Dict[int, List[int]] = {}
+        # Seq id -> selection count of every entry of its table, as last read from the page selector.
+        self.page_scores: Dict[int, List[float]] = {}
+        # Contiguous runs: the GPU allocator keeps the tables in runs of consecutive block numbers (see
+        # BlockAllocator), and compact() moves at most compaction_blocks_per_step blocks per step to join them.
+        self.compaction_blocks_per_step = compaction_blocks_per_step
+        self.compaction_budget = compaction_blocks_per_step
+        # Blocks moved away by the current step: only freed by the next one, once their copies have run.
+        self.compacted_blocks: List[PhysicalTokenBlock] = []
+        # Seqs whose tables had entries moved by the current step.
+        self.compacted_seq_ids: Set[int] = set()
 
         self.streaming_enabled = False
         if sink_local_blocks is not None:
@@ -105,7 +240,7 @@ class BaseBlockSpaceManager:
         assert watermark >= 0.0
 
         self.watermark_blocks = int(watermark * num_gpu_blocks)
-        self.gpu_allocator = BlockAllocator(Device.GPU, block_size, num_gpu_blocks)
+        self.gpu_allocator = BlockAllocator(Device.GPU, block_size, num_gpu_blocks, enable_caching, block_run_size)
         self.cpu_allocator = BlockAllocator(Device.CPU, block_size, num_cpu_blocks)
         # Mapping: seq_id -> BlockTable.
         self.block_tables: Dict[int, BlockTable] = {}
@@ -138,11 +273,98 @@ class BaseBlockSpaceManager:
         else:
             return AllocStatus.LATER
 
+    def _get_resident_logical_blocks(self, num_blocks: int) -> List[int]:
+        """Logical blocks whose pages hold the KV of the first num_blocks blocks.
+
+        A streaming table only keeps the sink blocks and the last local blocks,
+        the earlier ones have been overwritten in their ring slots.
+        """
+        if not self.streaming_enabled:
+            return list(range(num_blocks))
+        num_sink_blocks = min(num_blocks, self.block_sink_window)
+        return list(range(num_sink_blocks)) + list(
+            range(max(num_sink_blocks, num_blocks - self.block_local_window), num_blocks)
+        )
+
+    def get_num_cached_blocks(self, seq: Sequence, max_num_blocks: int) -> int:
+        """Number of leading blocks of seq (at most max_num_blocks) with cached pages."""
+        if not self.gpu_allocator.enable_caching or max_num_blocks <= 0:
+            return 0
+        hashes = seq.get_block_hashes(max_num_blocks)
+        num_blocks = 0
+        while (
+            num_blocks < max_num_blocks
+            and self.gpu_allocator.lookup(hashes[num_blocks]) is not None
+        ):
+            num_blocks += 1
+        return num_blocks
+
+    def is_cached(self, seq: Sequence, num_blocks: int) -> bool:
+        """Whether all the pages holding the first num_blocks blocks of seq are cached."""
+        hashes = seq.get_block_hashes(num_blocks)
+        return all(
+            self.gpu_allocator.lookup(hashes[logical_idx]) is not None
+            for logical_idx in self._get_resident_logical_blocks(num_blocks)
+        )
+
+    def _get_cached_block_table(self, seq: Sequence, num_blocks: int) -> BlockTable:
+        hashes = seq.get_block_hashes(num_blocks)
+        block_table: List[Optional[PhysicalTokenBlock]] = [None] * num_blocks
+        for logical_idx in self._get_resident_logical_blocks(num_blocks):
+            table_idx = logical_idx
+            if (
+                self.streaming_enabled
+                and logical_idx >= self.block_sink_window + self.block_local_window
+            ):
+                table_idx = self.block_sink_window + (logical_idx - self.block_sink_window) % self.block_local_window
+            block_table[table_idx] = self.gpu_allocator.lookup(hashes[logical_idx])
+        for logical_idx in range(num_blocks):
+            if block_table[logical_idx] is None:
+                # Overwritten streaming block: same ring slot as in allocate() / append_slot().
+                block_table[logical_idx] = block_table[self.block_sink_window + (logical_idx - self.block_sink_window) % self.block_local_window]
+        return block_table
+
+    def _register_prompt_blocks(
+        self, seq: Sequence, block_table: BlockTable, num_cached_blocks: int
+    ) -> None:
+        # Only cache a ring slot under the last logical block written to it.
+        num_logical_blocks = len(seq.logical_token_blocks)
+        last_logical_idx = {
+            block.block_number: logical_idx
+            for logical_idx, block in enumerate(block_table[:num_logical_blocks])
+        }
+        num_full_blocks = seq.get_len() // self.block_size
+        hashes = seq.get_block_hashes(num_full_blocks)
+        for logical_idx in range(num_cached_blocks, num_full_blocks):
+            block = block_table[logical_idx]
+            if last_logical_idx[block.block_number] == logical_idx:
+                self.gpu_allocator.register(block, hashes[logical_idx])
+
+    def _replace_ring_block(
+        self, block_table: BlockTable, block: PhysicalTokenBlock, num_seqs: int
+    ) -> PhysicalTokenBlock:
+        # A cached page must not be overwritten: the ring slot moves to a fresh page. The tokens left in
+        # the old page are out of the local window (there is one more local block than local tokens).
+        new_block = self.gpu_allocator.allocate()
+        new_block.ref_count = num_seqs
+        for idx, table_block in enumerate(block_table):
+            if table_block is block:
+                block_table[idx] = new_block
+        for _ in range(num_seqs):
+            self.gpu_allocator.free(block)
+        return new_block
+
     def allocate(
-        self, seq_group: SequenceGroup, ifb_mode: bool, init_num_blocks: int = None
+        self,
+        seq_group: SequenceGroup,
+        ifb_mode: bool,
+        init_num_blocks: int = None,
+        num_cached_blocks: Optional[int] = None,
     ) -> None:
         # NOTE: Here we assume that all sequences in the group have the same
         # prompt.
+        # num_cached_blocks: leading blocks reused from the prefix cache (None: prefix caching is off
+        # for this group, its blocks are not cached either).
         seq = seq_group.get_seqs(status=SequenceStatus.WAITING)[0]
 
         # Allocate new physical token blocks that will store the prompt tokens.
@@ -164,15 +386,21 @@ class BaseBlockSpaceManager:
             for block in prefix.block_table:
                 block.ref_count += seq_group.num_seqs()
                 block_table.append(block)
+        if num_cached_blocks:
+            block_table = self._get_cached_block_table(seq, num_cached_blocks)
+            for block in set(block_table):
+                self.gpu_allocator.acquire(block, seq_group.num_seqs())
         # print("################# num_prompt_blocks", num_prompt_blocks)
-        for logical_idx in range(num_prompt_blocks):
+        for logical_idx in range(num_cached_blocks or 0, num_prompt_blocks):
             if (
                 self.streaming_enabled 
                 and logical_idx >= self.block_sink_window + self.block_local_window
             ):
                 block = block_table[self.block_sink_window + (logical_idx - self.block_sink_window) % self.block_local_window]
+                if block.content_hash is not None:
+                    block = self._replace_ring_block(block_table, block, seq_group.num_seqs())
             else:
-                block = self.gpu_allocator.allocate()
+                block = self.gpu_allocator.allocate(block_table[-1] if block_table else None)
             # Set the reference counts of the token blocks.
             block.ref_count = seq_group.num_seqs()
             block_table.append(block)
@@ -187,6 +415,9 @@ class BaseBlockSpaceManager:
                 block.ref_count += 1
             prefix.set_block_table(prefix_block_table)
 
+        if num_cached_blocks is not None:
+            self._register_prompt_blocks(seq, block_table, num_cached_blocks)
+
         # Assign the block table for each sequence.
         # if num_prompt_blocks > self.block_sink_window + self.block_local_window:
         #     block_table = block_table[:self.block_sink_window] + block_table[-self.block_local_window:]
@@ -211,14 +442,17 @@ class BaseBlockSpaceManager:
                 and len(block_table) >= self.block_sink_window + self.block_local_window
             ):
                 # re-use a block
-                block_table.append(
-                    block_table[self.block_sink_window + (len(block_table) - self.block_sink_window) % self.block_local_window]
-                )
+                block = block_table[self.block_sink_window + (len(block_table) - self.block_sink_window) % self.block_local_window]
+                if block.content_hash is not None:
+                    block = self._replace_ring_block(block_table, block, 1)
+                block_table.append(block)
             else:
                 # The sequence has a new logical block.
                 # Allocate a new physical block.
-                block = self.gpu_allocator.allocate()
+                block = self.gpu_allocator.allocate(block_table[-1] if block_table else None)
                 block_table.append(block)
+                self._offload_cold_block(block_table)
+                self._evict_blocks(seq, block_table)
                 return None
 
         # We want to append the token to the last physical block.
@@ -230,18 +464,140 @@ class BaseBlockSpaceManager:
         else:
             # The last block is shared with other sequences.
             # Copy on Write: Allocate a new block and copy the tokens.
-            new_block = self.gpu_allocator.allocate()
-            block_table[-1] = new_block
+            new_block = self.gpu_allocator.allocate(block_table[-2] if len(block_table) > 1 else None)
+            # A streaming block also sits in its ring slot, which has to follow.
+            for idx, table_block in enumerate(block_table):
+                if table_block is last_block:
+                    block_table[idx] = new_block
             self.gpu_allocator.free(last_block)
             return last_block.block_number, new_block.block_number
 
+    def _offload_cold_block(self, block_table: BlockTable) -> None:
+        # The block that just left the hot window. Shared and cached blocks stay on the GPU, and so does the
+        # block once the CPU pool is full.
+        block_idx = len(block_table) - 1 - self.num_hot_blocks
+        if self.num_hot_blocks == 0 or block_idx < 1:
+            return
+        block = block_table[block_idx]
+        if (
+            block.device != Device.GPU
+            or block.block_number in self.swapped_in_blocks
+            or block.ref_count != 1
+            or block.content_hash is not None
+            or self.cpu_allocator.get_num_free_blocks() == 0
+        ):
+            return
+        cpu_block = self.cpu_allocator.allocate()
+        block_table[block_idx] = cpu_block
+        # The worker copies the block out before the step writes to any GPU block.
+        self.gpu_allocator.free(block)
+        self.blocks_to_offload[block.block_number] = cpu_block.block_number
+
+    def _evict_blocks(self, seq: Sequence, block_table: BlockTable) -> None:
+        # Frees the blocks beyond max_blocks_per_seq that the page selector picked the least (the oldest first on
+        # ties). The table keeps its length: the positions of the KV cache are its logical positions (RoPE and the
+        # slot of the current token), so an evicted entry becomes a hole that the selector skips. Shared and cached
+        # blocks stay.
+        if self.max_blocks_per_seq == 0:
+            return
+        evicted_pages = self.evicted_pages.setdefault(seq.seq_id, [])
+        num_evictions = len(block_table) - len(evicted_pages) - self.max_blocks_per_seq
+        if num_evictions <= 0:
+            return
+        scores = self.page_scores.get(seq.seq_id, [])
+        candidates = [
+            block_idx
+            for block_idx in range(self.eviction_sink_blocks, len(block_table) - self.eviction_local_blocks)
+            if block_table[block_idx] is not self.evicted_block
+            and block_table[block_idx].ref_count == 1
+            and block_table[block_idx].content_hash is None
+        ]
+        candidates.sort(key=lambda block_idx: (scores[block_idx] if block_idx < len(scores) else 0.0, block_idx))
+        for block_idx in candidates[:num_evictions]:
+            self.gpu_allocator.free(block_table[block_idx])
+            block_table[block_idx] = self.evicted_block
+            evicted_pages.append(block_idx)
+
+    def start_compaction_step(self) -> None:
+        # The copies out of the blocks moved by the previous step have run.
+        for block in self.compacted_blocks:
+            self.gpu_allocator.free(block)
+        self.compacted_blocks = []
+        self.compacted_seq_ids.clear()
+        self.compaction_budget = self.compaction_blocks_per_step
+
+    def _is_compactable(self, block: PhysicalTokenBlock) -> bool:
+        # Only private GPU blocks move: shared and cached blocks are referenced by other tables.
+        return (
+            block is not self.evicted_block
+            and block.device == Device.GPU
+            and block.ref_count == 1
+            and block.content_hash is None
+        )
+
+    def compact(self, seq: Sequence) -> List[Tuple[int, int]]:
+        """Moves blocks of seq next to their predecessor in its table when that block is free, within the budget of
+        the step. Returns the copies (src, dst) to run before the step.
+
+        A block is left alone when it already starts a run with its successor: runs grow by joining single blocks.
+        """
+        moves: List[Tuple[int, int]] = []
+        block_table = self.block_tables.get(seq.seq_id)
+        if self.compaction_budget == 0 or block_table is None:
+            return moves
+        for block_idx in range(1, len(block_table)):
+            if self.compaction_budget == 0:
+                break
+            prev_block, block = block_table[block_idx - 1], block_table[block_idx]
+            if (
+                prev_block is self.evicted_block
+                or prev_block.device != Device.GPU
+                or block.block_number == prev_block.block_number + 1
+                or not self._is_compactable(block)
+            ):
+                continue
+            if block_idx + 1 < len(block_table) and block_table[block_idx + 1].block_number == block.block_number + 1:
+                continue
+            new_block = self.gpu_allocator.take(prev_block.block_number + 1)
+            if new_block is None:
+                continue
+            block_table[block_idx] = new_block
+            self.compacted_blocks.append(block)
+            self.compacted_seq_ids.add(seq.seq_id)
+            self.compaction_budget -= 1
+            moves.append((block.block_number, new_block.block_number))
+        return moves
+
+    def pop_blocks_to_offload(self) -> Dict[int, int]:
+        blocks_to_offload = self.blocks_to_offload
+        self.blocks_to_offload = {}
+        self.swapped_in_blocks.clear()
+        return blocks_to_offload
+
+    def rollback_slots(self, seq: Sequence) -> None:
+        """Frees the physical blocks past the logical blocks of seq (after Sequence.rollback_tokens)."""
+        block_table = self.block_tables[seq.seq_id]
+        while len(block_table) > len(seq.logical_token_blocks):
+            block = block_table.pop()
+            if self.streaming_enabled and len(block_table) >= self.block_sink_window + self.block_local_window:
+                # A re-used block of the local window, which is still in the table.
+                continue
+            if block.device == Device.CPU:
+                self.cpu_allocator.free(block)
+                continue
+            self.gpu_allocator.free(block)
+
     def fork(self, parent_seq: Sequence, child_seq: Sequence) -> None:
         # NOTE: fork does not allocate a new physical block.
         # Thus, it is always safe from OOM.
         src_block_table = self.block_tables[parent_seq.seq_id]
         self.block_tables[child_seq.seq_id] = src_block_table.copy()
-        for block in src_block_table:
-            block.ref_count += 1
+        # Once per block, as in _free_block_table: the ring slots of a streaming table repeat.
+        for block in set(src_block_table):
+            if block is not self.evicted_block:
+                block.ref_count += 1
+        if parent_seq.seq_id in self.evicted_pages:
+            self.evicted_pages[child_seq.seq_id] = list(self.evicted_pages[parent_seq.seq_id])
 
     def _get_physical_blocks(
         self, seq_group: SequenceGroup
@@ -253,6 +609,7 @@ class BaseBlockSpaceManager:
             if seq.is_finished():
                 continue
             blocks.update(self.block_tables[seq.seq_id])
+        blocks.discard(self.evicted_block)
         return list(blocks)
 
     def can_swap_in(self, seq_group: SequenceGroup) -> bool:
@@ -281,11 +638,14 @@ class BaseBlockSpaceManager:
                     block.ref_count += 1
 
             for cpu_block in block_table:
+                if cpu_block is self.evicted_block:
+                    new_block_table.append(cpu_block)
+                    continue
                 if cpu_block in mapping:
                     gpu_block = mapping[cpu_block]
                     gpu_block.ref_count += 1
                 else:
-                    gpu_block = self.gpu_allocator.allocate()
+                    gpu_block = self.gpu_allocator.allocate(new_block_table[-1] if new_block_table else None)
                     mapping[cpu_block] = gpu_block
                 new_block_table.append(gpu_block)
                 # Free the CPU block swapped in to GPU.
@@ -296,6 +656,8 @@ class BaseBlockSpaceManager:
             cpu_block.block_number: gpu_block.block_number
             for cpu_block, gpu_block in mapping.items()
         }
+        if self.num_hot_blocks > 0:
+            self.swapped_in_blocks.update(block_number_mapping.values())
         return block_number_mapping
 
     def can_swap_out(self, seq_group: SequenceGroup) -> bool:
@@ -310,6 +672,10 @@ class BaseBlockSpaceManager:
             block_table = self.block_tables[seq.seq_id]
 
             for gpu_block in block_table:
+                if gpu_block.device == Device.CPU or gpu_block is self.evicted_block:
+                    # Offloaded already (tiered cache), swap_in brings it back with the others; or evicted.
+                    new_block_table.append(gpu_block)
+                    continue
                 if (
                     seq_group.prefix is not None
                     and gpu_block in seq_group.prefix.block_table
@@ -337,6 +703,8 @@ class BaseBlockSpaceManager:
 
     def _free_block_table(self, block_table: BlockTable) -> None:
         for block in set(block_table):
+            if block is self.evicted_block:
+                continue
             if block.device == Device.GPU:
                 self.gpu_allocator.free(block)
             else:
@@ -349,15 +717,42 @@ class BaseBlockSpaceManager:
         block_table = self.block_tables[seq.seq_id]
         self._free_block_table(block_table)
         del self.block_tables[seq.seq_id]
+        self.evicted_pages.pop(seq.seq_id, None)
+        self.page_scores.pop(seq.seq_id, None)
 
     def reset(self) -> None:
         for block_table in self.block_tables.values():
             self._free_block_table(block_table)
         self.block_tables.clear()
+        self.evicted_pages.clear()
+        self.page_scores.clear()
+
+    def mark_blocks_as_computed(self, seq_group: SequenceGroup) -> None:
+        # Called once the step is scheduled: its prompt pages are written before the next schedule().
+        for seq in seq_group.get_seqs():
+            if seq.seq_id not in self.block_tables:
+                continue
+            for block in self.block_tables[seq.seq_id]:
+                if block.content_hash is not None:
+                    block.computed = True
 
     def get_block_table(self, seq: Sequence) -> List[int]:
+        # The CPU blocks of a running sequence (tiered cache) follow the GPU blocks, see RaggedBlockTables. Evicted
+        # entries read block 0, the page selector skips them.
         block_table = self.block_tables[seq.seq_id]
-        return [block.block_number for block in block_table]
+        return [
+            block.block_number if block.device == Device.GPU else self.num_total_gpu_blocks + block.block_number
+            for block in block_table
+        ]
+
+    def get_evicted_pages(self, seq: Sequence) -> List[int]:
+        # The list itself: it only grows while the sequence runs (see RetrievalPageScores).
+        return self.evicted_pages.setdefault(seq.seq_id, [])
+
+    def update_page_scores(self, page_scores: Dict[int, List[float]]) -> None:
+        for seq_id, scores in page_scores.items():
+            if seq_id in self.block_tables:
+                self.page_scores[seq_id] = scores
 
     def get_num_free_gpu_blocks(self) -> int:
         return self.gpu_allocator.get_num_free_blocks()
@@ -379,6 +774,11 @@ class BlockSpaceManager:
         num_streaming_cpu_blocks: int,
         sp_attn_config: SpAttnConfig,
         watermark: float = 0.01,
+        enable_prefix_caching: bool = False,
+        num_hot_retrieval_blocks: int = 0,
+        max_retrieval_blocks_per_seq: int = 0,
+        retrieval_block_run_size: int = 0,
+        retrieval_compaction_blocks_per_step: int = 0,
     ) -> None:
         self.block_size = block_size
         self.num_total_retrieval_gpu_blocks = num_retrieval_gpu_blocks
@@ -389,12 +789,32 @@ class BlockSpaceManager:
         self.watermark = watermark
         assert watermark >= 0.0
         self.sparse_kv_cache_enabled = sp_attn_config.sparse_kv_cache_enabled()
+        self.enable_prefix_caching = enable_prefix_caching
+        # The super-page stats live in the first page of a super-page, so only whole super-pages are reused.
+        self.super_page_size = sp_attn_config.get_dec_super_page_size() if sp_attn_config.sparse_decode_enabled() else 0
+        # Streaming heads read a cached prefix from the sink / local pages only: their context-stage window has to fit.
+        self.ctx_local_size = sp_attn_config.get_ctx_local_size()
+        self.dec_local_block_num = sp_attn_config.get_dec_local_block_num()
+        self.streaming_prefix_reusable = (
+            sp_attn_config.sparse_context_enabled()
+            and sp_attn_config.get_ctx_sink_size() <= sp_attn_config.get_dec_sink_size()
+            and sp_attn_config.get_ctx_local_size() <= sp_attn_config.get_dec_local_size()
+        )
         self.retrieval_blockspace_manager = BaseBlockSpaceManager(
             block_size, 
             num_retrieval_gpu_blocks, 
             num_retrieval_cpu_blocks, 
-            watermark
+            watermark,
+            enable_caching=enable_prefix_caching,
+            num_hot_blocks=num_hot_retrieval_blocks,
+            max_blocks_per_seq=max_retrieval_blocks_per_seq,
+            # Same sink / local windows as the streaming heads.
+            eviction_sink_local_blocks=(sp_attn_config.get_dec_sink_block_num(), sp_attn_config.get_dec_local_block_num()),
+            block_run_size=retrieval_block_run_size,
+            compaction_blocks_per_step=retrieval_compaction_blocks_per_step,
         )
+        self.retrieval_eviction_enabled = max_retrieval_blocks_per_seq > 0
+        self.retrieval_compaction_enabled = retrieval_block_run_size > 0 and retrieval_compaction_blocks_per_step > 0
         self.streaming_blockspace_manager = None
         if self.sparse_kv_cache_enabled:
             self.streaming_blockspace_manager = BaseBlockSpaceManager(
@@ -402,7 +822,8 @@ class BlockSpaceManager:
                 num_streaming_gpu_blocks, 
                 num_streaming_cpu_blocks, 
                 watermark, 
-                (sp_attn_config.get_dec_sink_block_num(), sp_attn_config.get_dec_local_block_num()) # add by JXGuo: one more local block for future design
+                (sp_attn_config.get_dec_sink_block_num(), sp_attn_config.get_dec_local_block_num()), # add by JXGuo: one more local block for future design
+                enable_caching=enable_prefix_caching,
             )
 
     def can_allocate(
@@ -426,18 +847,57 @@ class BlockSpaceManager:
         return AllocStatus.LATER
     
 
+    def _can_reuse_cached_blocks(self, seq: Sequence, num_blocks: int) -> bool:
+        if self.super_page_size > 0 and num_blocks % self.super_page_size != 0:
+            return False
+        if not self.sparse_kv_cache_enabled:
+            return True
+        # The new tokens must not overwrite local pages that their streaming heads still attend to.
+        num_new_tokens = seq.get_len() - num_blocks * self.block_size
+        if num_new_tokens + self.ctx_local_size > (self.dec_local_block_num - 1) * self.block_size:
+            return False
+        return self.streaming_blockspace_manager.is_cached(seq, num_blocks)
+
+    def _get_num_cached_blocks(
+        self, seq_group: SequenceGroup, init_num_blocks: int = None
+    ) -> Optional[int]:
+        """Leading prompt blocks whose KV is reused from the prefix cache (None: caching does not apply)."""
+        # Non-IFB mode preallocates the decoding blocks, and explicit prefixes manage their own blocks.
+        if not self.enable_prefix_caching or init_num_blocks is not None or seq_group.prefix is not None:
+            return None
+        seq = seq_group.get_seqs(status=SequenceStatus.WAITING)[0]
+        if self.sparse_kv_cache_enabled and not self.streaming_prefix_reusable:
+            return None
+        # The last prompt token is always computed, its logits are sampled.
+        max_num_blocks = (seq.get_len() - 1) // self.block_size
+        num_blocks = self.retrieval_blockspace_manager.get_num_cached_blocks(seq, max_num_blocks)
+        while num_blocks > 0 and not self._can_reuse_cached_blocks(seq, num_blocks):
+            num_blocks -= 1
+        return num_blocks
+
     def allocate(
         self, seq_group: SequenceGroup, ifb_mode: bool, init_num_blocks: int = None
     ) -> None:
         # NOTE: Here we assume that all sequences in the group have the same
         # prompt.
+        num_cached_blocks = self._get_num_cached_blocks(seq_group, init_num_blocks)
         self.retrieval_blockspace_manager.allocate(
-            seq_group, ifb_mode, init_num_blocks
+            seq_group, ifb_mode, init_num_blocks, num_cached_blocks
         )
         if self.sparse_kv_cache_enabled:
             self.streaming_blockspace_manager.allocate(
-                seq_group, ifb_mode, init_num_blocks
+                seq_group, ifb_mode, init_num_blocks, num_cached_blocks
             )
+        # The prompt run skips the cached tokens (their pages, with their scales and K stats, are shared).
+        for seq in seq_group.get_seqs(status=SequenceStatus.WAITING):
+            seq.data.num_cached_tokens = (num_cached_blocks or 0) * self.block_size
+
+    def mark_blocks_as_computed(self, seq_group: SequenceGroup) -> None:
+        if not self.enable_prefix_caching:
+            return
+        self.retrieval_blockspace_manager.mark_blocks_as_computed(seq_group)
+        if self.sparse_kv_cache_enabled:
+            self.streaming_blockspace_manager.mark_blocks_as_computed(seq_group)
 
     def can_append_slot(self, seq_group: SequenceGroup) -> bool:
         # Simple heuristic: If there is at least one free block
@@ -458,16 +918,27 @@ class BlockSpaceManager:
         return retrieval_result, streaming_result
 
 
+    def rollback_slots(self, seq: Sequence) -> None:
+        """Releases the slots of the tokens dropped by Sequence.rollback_tokens (rejected draft tokens).
+
+        The streaming heads keep their window as long as a verification step writes at most one page of draft
+        tokens: the local window has one spare page (DecAttnConfig.dec_local_block).
+        """
+        self.retrieval_blockspace_manager.rollback_slots(seq)
+        if self.sparse_kv_cache_enabled:
+            self.streaming_blockspace_manager.rollback_slots(seq)
+
     def fork(self, parent_seq: Sequence, child_seq: Sequence) -> None:
+        """Shares all the pages of parent_seq with child_seq (parallel sampling).
+
+        The pages, with their scales and K stats, are reference counted: the full ones stay shared, and the first
+        append_slot of a sequence to a shared last page copies it (copy-on-write, cache_ops.copy_blocks).
+        """
         # NOTE: fork does not allocate a new physical block.
         # Thus, it is always safe from OOM.
         self.retrieval_blockspace_manager.fork(parent_seq, child_seq)
         if self.sparse_kv_cache_enabled:
             self.streaming_blockspace_manager.fork(parent_seq, child_seq)
-        # src_block_table = self.block_tables[parent_seq.seq_id]
-        # self.block_tables[child_seq.seq_id] = src_block_table.copy()
-        # for block in src_block_table:
-        #     block.ref_count += 1
 
     def _get_physical_blocks(
         self, seq_group: SequenceGroup
@@ -480,6 +951,11 @@ class BlockSpaceManager:
             streaming_blocks = self.streaming_blockspace_manager._get_physical_blocks(seq_group)
         return retrieval_blocks, streaming_blocks
 
+    def get_num_physical_blocks(self, seq_group: SequenceGroup) -> Tuple[int, int]:
+        """Retrieval and streaming pages of the group, the ones a swap moves."""
+        retrieval_blocks, streaming_blocks = self._get_physical_blocks(seq_group)
+        return len(retrieval_blocks), len(streaming_blocks or [])
+
     def can_swap_in(self, seq_group: SequenceGroup) -> bool:
         retrieval_result = self.retrieval_blockspace_manager.can_swap_in(seq_group)
         if not self.sparse_kv_cache_enabled:
@@ -527,10 +1003,36 @@ class BlockSpaceManager:
         if self.sparse_kv_cache_enabled:
             self.streaming_blockspace_manager.reset()
 
+    def start_retrieval_compaction_step(self) -> None:
+        """Called before a step is scheduled: frees the retrieval blocks moved by the previous one."""
+        self.retrieval_blockspace_manager.start_compaction_step()
+
+    def compact_retrieval_blocks(self, seq: Sequence) -> List[Tuple[int, int]]:
+        """Retrieval block copies (src, dst) that join the runs of contiguous blocks of seq."""
+        return self.retrieval_blockspace_manager.compact(seq)
+
+    def is_retrieval_table_compacted(self, seq: Sequence) -> bool:
+        return seq.seq_id in self.retrieval_blockspace_manager.compacted_seq_ids
+
+    def pop_retrieval_blocks_to_offload(self) -> Dict[int, int]:
+        """Retrieval GPU blocks moved to the CPU tier by the append_slot calls since the last pop (GPU -> CPU)."""
+        return self.retrieval_blockspace_manager.pop_blocks_to_offload()
+
     def get_retrieval_block_table(self, seq: Sequence) -> List[int]:
         retrieval_block_table = self.retrieval_blockspace_manager.get_block_table(seq)
         return retrieval_block_table
     
+    def get_cached_prefix_hashes(self) -> List[int]:
+        """Block hashes (Sequence.get_block_hashes) of the prompt blocks the retrieval pool can reuse."""
+        return self.retrieval_blockspace_manager.gpu_allocator.get_computed_hashes()
+
+    def get_evicted_retrieval_pages(self, seq: Sequence) -> List[int]:
+        return self.retrieval_blockspace_manager.get_evicted_pages(seq)
+
+    def update_retrieval_page_scores(self, page_scores: Dict[int, List[float]]) -> None:
+        """Seq id -> page selection counts read from the workers, which pick the retrieval pages to evict."""
+        self.retrieval_blockspace_manager.update_page_scores(page_scores)
+
     def get_streaming_block_table(self, seq: Sequence) -> Optional[List[int]]:
         if self.sparse_kv_cache_enabled:
             streaming_block_table = self.streaming_blockspace_manager.get_block_table(seq)
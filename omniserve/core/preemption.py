@@ -0,0 +1,80 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Cost model of a preemption: recomputing the KV cache of a sequence vs swapping its pages to the CPU.
+
+Both costs are estimated in seconds of one rank. A recompute redoes the prefill of the tokens whose KV is dropped:
+the linear layers cost 2 * params FLOPs per token, a retrieval head attends to the whole causal prefix and a
+streaming head to its context-stage sink / local window only (dense without sparse prefill). A swap moves the
+quantized pages of the sequence out and back in over PCIe.
+"""
+from omniserve.config import ModelConfig, ParallelConfig, SchedulerConfig
+
+
+class PreemptionCostModel:
+    def __init__(
+        self,
+        model_config: ModelConfig,
+        parallel_config: ParallelConfig,
+        scheduler_config: SchedulerConfig,
+        retrieval_block_bytes: int,
+        streaming_block_bytes: int,
+    ) -> None:
+        hf_config = model_config.hf_config
+        tp_size = parallel_config.tensor_parallel_size
+        hidden_size = model_config.get_hidden_size()
+        head_size = model_config.get_head_size()
+        num_heads = hf_config.num_attention_heads // tp_size
+        num_kv_heads = model_config.get_num_kv_heads(parallel_config)
+        num_layers = model_config.get_num_layers(parallel_config)
+        # A MoE token only runs its top-k experts.
+        num_active_experts = getattr(hf_config, "num_experts_per_tok", 1)
+        layer_params = (
+            hidden_size * (num_heads + 2 * num_kv_heads) * head_size  # qkv_proj
+            + num_heads * head_size * hidden_size  # o_proj
+            + num_active_experts * 3 * hidden_size * hf_config.intermediate_size // tp_size  # gate_up_proj, down_proj
+        )
+        self.linear_flops_per_token = 2 * num_layers * layer_params
+
+        sp_attn_config = model_config.sp_attn_config
+        q_heads_per_kv_head = num_heads // num_kv_heads
+        self.num_retrieval_q_heads = 0
+        self.num_streaming_q_heads = 0
+        for layer_idx in range(num_layers):
+            self.num_retrieval_q_heads += sp_attn_config.retrieval_head_num(layer_idx) * q_heads_per_kv_head
+            self.num_streaming_q_heads += sp_attn_config.streaming_head_num(layer_idx) * q_heads_per_kv_head
+        self.head_size = head_size
+        self.streaming_window = None
+        if sp_attn_config.sparse_context_enabled():
+            self.streaming_window = sp_attn_config.get_ctx_sink_size() + sp_attn_config.get_ctx_local_size()
+
+        self.retrieval_block_bytes = retrieval_block_bytes
+        self.streaming_block_bytes = streaming_block_bytes
+        self.prefill_flops = scheduler_config.preemption_prefill_tflops * 1e12
+        self.swap_bandwidth = scheduler_config.preemption_swap_gbps * 1e9
+
+    def get_recompute_time(self, num_tokens: int) -> float:
+        """Seconds to recompute the KV cache of the first num_tokens tokens of a sequence."""
+        # QK^T and PV: 4 * head_size FLOPs per (query, key) pair.
+        dense_pairs = num_tokens * (num_tokens + 1) // 2
+        if self.streaming_window is None:
+            streaming_pairs = dense_pairs
+        else:
+            streaming_pairs = num_tokens * min(num_tokens, self.streaming_window)
+        attn_flops = 4 * self.head_size * (
+            self.num_retrieval_q_heads * dense_pairs + self.num_streaming_q_heads * streaming_pairs
+        )
+        return (num_tokens * self.linear_flops_per_token + attn_flops) / self.prefill_flops
+
+    def get_swap_time(self, num_retrieval_blocks: int, num_streaming_blocks: int) -> float:
+        """Seconds to swap the given GPU pages out and back in."""
+        num_bytes = num_retrieval_blocks * self.retrieval_block_bytes + num_streaming_blocks * self.streaming_block_bytes
+        return 2 * num_bytes / self.swap_bandwidth
@@ -18,6 +18,7 @@ from typing import Deque, Dict, Iterable, List, Optional, Tuple, Union
 from omniserve.config import CacheConfig, IFBConfig, SchedulerConfig
 from omniserve.core.block_manager import AllocStatus, BlockSpaceManager
 from omniserve.core.policy import PolicyFactory
+from omniserve.core.preemption import PreemptionCostModel
 from omniserve.logger import init_logger
 from omniserve.prefix import PrefixPool
 from omniserve.sequence import (
@@ -58,6 +59,9 @@ class SchedulerOutputs:
         retrieval_blocks_to_copy: Dict[int, List[int]],
         streaming_blocks_to_copy: Dict[int, List[int]],
         ignored_seq_groups: List[SequenceGroup],
+        retrieval_blocks_to_offload: Optional[Dict[int, int]] = None,
+        token_chunk_sizes: Optional[Dict[str, int]] = None,
+        partial_prefill_seq_groups: Optional[List[SequenceGroup]] = None,
     ) -> None:
         self.scheduled_seq_groups = scheduled_seq_groups
         self.prompt_run = prompt_run
@@ -68,6 +72,12 @@ class SchedulerOutputs:
         self.streaming_blocks_to_swap_out = streaming_blocks_to_swap_out
         self.retrieval_blocks_to_copy = retrieval_blocks_to_copy
         self.streaming_blocks_to_copy = streaming_blocks_to_copy
+        # Retrieval GPU blocks moved to the CPU tier (CacheConfig.num_hot_retrieval_blocks), GPU -> CPU.
+        self.retrieval_blocks_to_offload = retrieval_blocks_to_offload or {}
+        # Mixed batching: request_id -> tokens of the group run by this step (1 for a decoding group), and the
+        # groups whose prompt is not finished by the step (their sampled tokens are dropped).
+        self.token_chunk_sizes = token_chunk_sizes
+        self.partial_prefill_seq_groups = partial_prefill_seq_groups or []
         # Swap in and swap out should never happen at the same time.
         assert not (retrieval_blocks_to_swap_in and retrieval_blocks_to_swap_out)
         assert not (streaming_blocks_to_swap_in and streaming_blocks_to_swap_out)
@@ -83,6 +93,7 @@ class SchedulerOutputs:
             and not self.streaming_blocks_to_swap_out
             and not self.retrieval_blocks_to_copy
             and not self.streaming_blocks_to_copy
+            and not self.retrieval_blocks_to_offload
         )
 
 
@@ -92,6 +103,7 @@ class Scheduler:
         scheduler_config: SchedulerConfig,
         cache_config: CacheConfig,
         ifb_config: IFBConfig,
+        preemption_cost_model: Optional[PreemptionCostModel] = None,
     ) -> None:
         self.scheduler_config = scheduler_config
         self.cache_config = cache_config
@@ -105,8 +117,45 @@ class Scheduler:
             self.scheduler_config.max_num_batched_tokens,
         )
 
+        # Mixed batching: every step runs all the decoding sequences and fills the rest of
+        # step_token_budget with prefill chunks, which read the KV of the earlier chunks like a cached prefix.
+        self.mixed_batching = self.scheduler_config.step_token_budget > 0 and self.ifb_mode
+        self.max_prefill_chunk_size = 0
+        sp_attn_config = self.cache_config.sp_attn_config
+        if self.mixed_batching and sp_attn_config.sparse_kv_cache_enabled():
+            streaming_prefix_reusable = (
+                sp_attn_config.sparse_context_enabled()
+                and sp_attn_config.get_ctx_sink_size() <= sp_attn_config.get_dec_sink_size()
+                and sp_attn_config.get_ctx_local_size() <= sp_attn_config.get_dec_local_size()
+            )
+            if not streaming_prefix_reusable:
+                logger.warning(
+                    "Mixed batching is disabled: the context-stage sink / local windows of the streaming heads "
+                    "do not fit in their decoding windows."
+                )
+                self.mixed_batching = False
+        if self.mixed_batching:
+            self.max_prefill_chunk_size = self.scheduler_config.step_token_budget
+            if sp_attn_config.sparse_kv_cache_enabled():
+                # A chunk must not overwrite the local pages that its own streaming heads still attend to
+                # (same limit as BlockSpaceManager._can_reuse_cached_blocks).
+                self.max_prefill_chunk_size = min(
+                    self.max_prefill_chunk_size,
+                    (sp_attn_config.get_dec_local_block_num() - 1) * self.cache_config.block_size
+                    - sp_attn_config.get_ctx_local_size(),
+                )
+            if self.max_prefill_chunk_size > 0:
+                self.prompt_limit = self.scheduler_config.max_model_len
+            else:
+                logger.warning(
+                    "The local window of the streaming heads leaves no room for prefill chunks: prompts longer "
+                    "than the step token budget only run in steps without decoding sequences."
+                )
+
         # Instantiate the scheduling policy.
         self.policy = PolicyFactory.get_policy(policy_name="fcfs")
+        # Picks the preemption victims and their preemption modes (None: the latest arrivals, recomputed).
+        self.preemption_cost_model = preemption_cost_model
         # Create the block space manager.
         self.block_manager = BlockSpaceManager(
             block_size=self.cache_config.block_size,
@@ -115,6 +164,11 @@ class Scheduler:
             num_streaming_gpu_blocks=self.cache_config.num_streaming_gpu_blocks,
             num_streaming_cpu_blocks=self.cache_config.num_streaming_cpu_blocks,
             sp_attn_config=self.cache_config.sp_attn_config,
+            enable_prefix_caching=self.cache_config.enable_prefix_caching,
+            num_hot_retrieval_blocks=self.cache_config.num_hot_retrieval_blocks,
+            max_retrieval_blocks_per_seq=self.cache_config.max_retrieval_blocks_per_seq,
+            retrieval_block_run_size=self.cache_config.retrieval_block_run_size,
+            retrieval_compaction_blocks_per_step=self.cache_config.retrieval_compaction_blocks_per_step,
         )
 
         # Create the prefix pool to cache the prefixes.
@@ -127,6 +181,11 @@ class Scheduler:
         # Sequence groups in the SWAPPED state.
         self.swapped: Deque[SequenceGroup] = deque()
 
+        # Counters of the engine metrics (engine.metrics.EngineMetrics).
+        self.num_preemptions: Dict[str, int] = {"recompute": 0, "swap": 0}
+        self.num_allocated_prompt_tokens = 0
+        self.num_prefix_cached_tokens = 0
+
     def add_seq_group(self, seq_group: SequenceGroup) -> None:
         # Add sequence groups to the waiting queue.
         self.waiting.append(seq_group)
@@ -190,20 +249,249 @@ class Scheduler:
 
         # Join waiting sequences if possible.
         if not self.swapped:
-            ignored_seq_groups: List[SequenceGroup] = []
-            scheduled: List[SequenceGroup] = []
-            # The total number of sequences on the fly, including the
-            # requests in the generation phase.
+            scheduled, ignored_seq_groups, seq_lens = self._schedule_waiting()
+            if scheduled or ignored_seq_groups:
+                scheduler_outputs = SchedulerOutputs(
+                    scheduled_seq_groups=scheduled,
+                    prompt_run=True,
+                    num_batched_tokens=len(seq_lens) * max(seq_lens) if seq_lens else 0,
+                    retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+                    streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+                    retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+                    streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+                    retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+                    streaming_blocks_to_copy=streaming_blocks_to_copy,
+                    ignored_seq_groups=ignored_seq_groups,
+                    retrieval_blocks_to_offload=self.block_manager.pop_retrieval_blocks_to_offload(),
+                )
+                return scheduler_outputs
+
+        self._schedule_running(
+            now,
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+        )
+
+        # Each sequence in the generation phase only takes one token slot.
+        # Therefore, the number of batched tokens is equal to the number of
+        # sequences in the RUNNING state.
+        num_batched_tokens = sum(
+            seq_group.num_seqs(status=SequenceStatus.RUNNING)
+            for seq_group in self.running
+        )
+
+        scheduler_outputs = SchedulerOutputs(
+            scheduled_seq_groups=self.running,
+            prompt_run=False,
+            num_batched_tokens=num_batched_tokens,
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+            ignored_seq_groups=[],
+            retrieval_blocks_to_offload=self.block_manager.pop_retrieval_blocks_to_offload(),
+        )
+        return scheduler_outputs
+
+    def _schedule_disaggregated(self) -> Tuple[SchedulerOutputs, SchedulerOutputs]:
+        # Blocks that need to be swaped or copied before model execution (by the decoding instance).
+        retrieval_blocks_to_swap_in: Dict[int, int] = {}
+        streaming_blocks_to_swap_in: Dict[int, int] = {}
+        retrieval_blocks_to_swap_out: Dict[int, int] = {}
+        streaming_blocks_to_swap_out: Dict[int, int] = {}
+        retrieval_blocks_to_copy: Dict[int, List[int]] = {}
+        streaming_blocks_to_copy: Dict[int, List[int]] = {}
+
+        # Fix the current time.
+        now = time.monotonic()
+
+        # The decoding instance does not wait for the prompts: the running groups decode in every step.
+        preempted = self._schedule_running(
+            now,
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+        )
+        decode_seq_groups = list(self.running)
+        decode_outputs = SchedulerOutputs(
+            scheduled_seq_groups=decode_seq_groups,
+            prompt_run=False,
+            num_batched_tokens=sum(
+                seq_group.num_seqs(status=SequenceStatus.RUNNING)
+                for seq_group in decode_seq_groups
+            ),
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+            ignored_seq_groups=[],
+            retrieval_blocks_to_offload=self.block_manager.pop_retrieval_blocks_to_offload(),
+        )
+
+        # The prefill instance runs the prompts meanwhile, into the blocks allocated here.
+        scheduled: List[SequenceGroup] = []
+        ignored_seq_groups: List[SequenceGroup] = []
+        seq_lens: List[int] = []
+        if not self.swapped and not preempted:
+            scheduled, ignored_seq_groups, seq_lens = self._schedule_waiting()
+        prefill_outputs = SchedulerOutputs(
+            scheduled_seq_groups=scheduled,
+            prompt_run=True,
+            num_batched_tokens=sum(seq_lens),
+            retrieval_blocks_to_swap_in={},
+            streaming_blocks_to_swap_in={},
+            retrieval_blocks_to_swap_out={},
+            streaming_blocks_to_swap_out={},
+            retrieval_blocks_to_copy={},
+            streaming_blocks_to_copy={},
+            ignored_seq_groups=ignored_seq_groups,
+        )
+        return prefill_outputs, decode_outputs
+
+    def _schedule_waiting(self) -> Tuple[List[SequenceGroup], List[SequenceGroup], List[int]]:
+        """Allocates the waiting groups that fit, in order. Returns them, the ignored groups and the prompt lengths."""
+        ignored_seq_groups: List[SequenceGroup] = []
+        scheduled: List[SequenceGroup] = []
+        # The total number of sequences on the fly, including the
+        # requests in the generation phase.
+        num_curr_seqs = sum(
+            seq_group.get_max_num_running_seqs() for seq_group in self.running
+        )
+        seq_lens: List[int] = []
+
+        # Optimization: We do not sort the waiting queue since the preempted
+        # sequence groups are added to the front and the new sequence groups
+        # are added to the back.
+        leftover_waiting_sequences = deque()
+        while self.waiting:
+            seq_group = self.waiting[0]
+            waiting_seqs = seq_group.get_seqs(status=SequenceStatus.WAITING)
+            assert len(waiting_seqs) == 1, (
+                "Waiting sequence group should have only one prompt " "sequence."
+            )
+            num_prompt_tokens = waiting_seqs[0].get_len()
+            if num_prompt_tokens > self.prompt_limit:
+                logger.warning(
+                    f"Input prompt ({num_prompt_tokens} tokens) is too long"
+                    f" and exceeds limit of {self.prompt_limit}"
+                )
+                for seq in waiting_seqs:
+                    seq.status = SequenceStatus.FINISHED_IGNORED
+                ignored_seq_groups.append(seq_group)
+                self.waiting.popleft()
+                continue
+
+            # The prefill attention of a step uses the head partition of a single static sparsity level.
+            if scheduled and seq_group.sampling_params.static_sparsity != scheduled[0].sampling_params.static_sparsity:
+                break
+
+            # If the sequence group cannot be allocated, stop.
+            can_allocate = self.block_manager.can_allocate(
+                seq_group, self.ifb_mode, self.init_num_blocks
+            )
+            if can_allocate == AllocStatus.LATER:
+                break
+            elif can_allocate == AllocStatus.NEVER:
+                logger.warning(
+                    f"Input prompt ({num_prompt_tokens} tokens) is too long"
+                    f" and exceeds the capacity of block_manager"
+                )
+                for seq in waiting_seqs:
+                    seq.status = SequenceStatus.FINISHED_IGNORED
+                ignored_seq_groups.append(seq_group)
+                self.waiting.popleft()
+                continue
+
+            # If the number of batched tokens exceeds the limit, stop.
+            new_seq_lens = seq_lens + [num_prompt_tokens]
+            num_batched_tokens = sum(
+                new_seq_lens
+            )  # len(new_seq_lens) * max(new_seq_lens)
+            if num_batched_tokens > self.scheduler_config.max_num_batched_tokens:
+                break
+
+            # The total number of sequences in the RUNNING state should not
+            # exceed the maximum number of sequences.
+            num_new_seqs = seq_group.get_max_num_running_seqs()
+            if num_curr_seqs + num_new_seqs > self.scheduler_config.max_num_seqs:
+                break
+
+            # num_paddings = num_batched_tokens - sum(new_seq_lens)
+            # if num_paddings > self.scheduler_config.max_paddings:
+            #     break
+            seq_lens = new_seq_lens
+
+            self.waiting.popleft()
+            self._allocate(seq_group)
+            self.running.append(seq_group)
+            num_curr_seqs += num_new_seqs
+            scheduled.append(seq_group)
+
+        self.waiting.extendleft(leftover_waiting_sequences)
+        return scheduled, ignored_seq_groups, seq_lens
+
+    def _schedule_mixed(self) -> SchedulerOutputs:
+        # Blocks that need to be swaped or copied before model execution.
+        retrieval_blocks_to_swap_in: Dict[int, int] = {}
+        streaming_blocks_to_swap_in: Dict[int, int] = {}
+        retrieval_blocks_to_swap_out: Dict[int, int] = {}
+        streaming_blocks_to_swap_out: Dict[int, int] = {}
+        retrieval_blocks_to_copy: Dict[int, List[int]] = {}
+        streaming_blocks_to_copy: Dict[int, List[int]] = {}
+
+        # Fix the current time.
+        now = time.monotonic()
+
+        preempted = self._schedule_running(
+            now,
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+        )
+
+        # Every decoding sequence runs its token, the prefill chunks share the rest of the budget
+        # (step_token_budget > max_num_seqs leaves room for at least one token).
+        token_chunk_sizes: Dict[str, int] = {}
+        for seq_group in self.running:
+            if not self._is_prefilling(seq_group):
+                token_chunk_sizes[seq_group.request_id] = 1
+        token_budget = self.scheduler_config.step_token_budget - len(token_chunk_sizes)
+
+        # Partially computed prompts continue first, in priority order.
+        has_prefill = False
+        for seq_group in self.running:
+            if token_budget == 0:
+                break
+            if not self._is_prefilling(seq_group):
+                continue
+            chunk_size = self._get_prefill_chunk_size(seq_group, token_budget, not token_chunk_sizes)
+            if chunk_size == 0:
+                break
+            token_chunk_sizes[seq_group.request_id] = chunk_size
+            token_budget -= chunk_size
+            has_prefill = True
+
+        # Join waiting sequences if possible.
+        ignored_seq_groups: List[SequenceGroup] = []
+        if not self.swapped and not preempted:
             num_curr_seqs = sum(
                 seq_group.get_max_num_running_seqs() for seq_group in self.running
             )
-            seq_lens: List[int] = []
-
-            # Optimization: We do not sort the waiting queue since the preempted
-            # sequence groups are added to the front and the new sequence groups
-            # are added to the back.
-            leftover_waiting_sequences = deque()
-            while self.waiting:
+            while self.waiting and token_budget > 0:
                 seq_group = self.waiting[0]
                 waiting_seqs = seq_group.get_seqs(status=SequenceStatus.WAITING)
                 assert len(waiting_seqs) == 1, (
@@ -238,12 +526,12 @@ class Scheduler:
                     self.waiting.popleft()
                     continue
 
-                # If the number of batched tokens exceeds the limit, stop.
-                new_seq_lens = seq_lens + [num_prompt_tokens]
-                num_batched_tokens = sum(
-                    new_seq_lens
-                )  # len(new_seq_lens) * max(new_seq_lens)
-                if num_batched_tokens > self.scheduler_config.max_num_batched_tokens:
+                # An unsplittable prompt waits for a step with room for all of it.
+                if (
+                    self.max_prefill_chunk_size <= 0
+                    and num_prompt_tokens > token_budget
+                    and token_chunk_sizes
+                ):
                     break
 
                 # The total number of sequences in the RUNNING state should not
@@ -252,34 +540,56 @@ class Scheduler:
                 if num_curr_seqs + num_new_seqs > self.scheduler_config.max_num_seqs:
                     break
 
-                # num_paddings = num_batched_tokens - sum(new_seq_lens)
-                # if num_paddings > self.scheduler_config.max_paddings:
-                #     break
-                seq_lens = new_seq_lens
-
                 self.waiting.popleft()
                 self._allocate(seq_group)
                 self.running.append(seq_group)
                 num_curr_seqs += num_new_seqs
-                scheduled.append(seq_group)
-
-            self.waiting.extendleft(leftover_waiting_sequences)
+                chunk_size = self._get_prefill_chunk_size(seq_group, token_budget, not token_chunk_sizes)
+                token_chunk_sizes[seq_group.request_id] = chunk_size
+                token_budget -= chunk_size
+                has_prefill = True
+
+        scheduled: List[SequenceGroup] = []
+        partial_prefill_seq_groups: List[SequenceGroup] = []
+        for seq_group in self.running:
+            if seq_group.request_id not in token_chunk_sizes:
+                continue
+            scheduled.append(seq_group)
+            seq = seq_group.get_seqs(status=SequenceStatus.RUNNING)[0]
+            if seq.data.num_computed_tokens + token_chunk_sizes[seq_group.request_id] < seq.get_len():
+                partial_prefill_seq_groups.append(seq_group)
+
+        # Without prefill chunks, this is a plain decoding step.
+        return SchedulerOutputs(
+            scheduled_seq_groups=scheduled,
+            prompt_run=has_prefill,
+            num_batched_tokens=sum(token_chunk_sizes.values()),
+            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=streaming_blocks_to_copy,
+            ignored_seq_groups=ignored_seq_groups,
+            retrieval_blocks_to_offload=self.block_manager.pop_retrieval_blocks_to_offload(),
+            token_chunk_sizes=token_chunk_sizes,
+            partial_prefill_seq_groups=partial_prefill_seq_groups,
+        )
 
-            if scheduled or ignored_seq_groups:
-                scheduler_outputs = SchedulerOutputs(
-                    scheduled_seq_groups=scheduled,
-                    prompt_run=True,
-                    num_batched_tokens=len(seq_lens) * max(seq_lens) if seq_lens else 0,
-                    retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
-                    streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
-                    retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
-                    streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
-                    retrieval_blocks_to_copy=retrieval_blocks_to_copy,
-                    streaming_blocks_to_copy=streaming_blocks_to_copy,
-                    ignored_seq_groups=ignored_seq_groups,
-                )
-                return scheduler_outputs
+    def _schedule_running(
+        self,
+        now: float,
+        retrieval_blocks_to_swap_in: Dict[int, int],
+        streaming_blocks_to_swap_in: Dict[int, int],
+        retrieval_blocks_to_swap_out: Dict[int, int],
+        streaming_blocks_to_swap_out: Dict[int, int],
+        retrieval_blocks_to_copy: Dict[int, List[int]],
+        streaming_blocks_to_copy: Dict[int, List[int]],
+    ) -> List[SequenceGroup]:
+        """Reserves the slots of the running groups (preempting if needed) and swaps groups in.
 
+        Returns the preempted groups.
+        """
         # NOTE(woosuk): Preemption happens only when there is no available slot
         # to keep all the sequence groups in the RUNNING state.
         # In this case, the policy is responsible for deciding which sequence
@@ -291,10 +601,14 @@ class Scheduler:
         preempted: List[SequenceGroup] = []
         while self.running:
             seq_group = self.running.popleft()
+            if self._is_prefilling(seq_group):
+                # The slots of a partially computed prompt are allocated already.
+                running.append(seq_group)
+                continue
             while not self.block_manager.can_append_slot(seq_group):
                 if self.running:
                     # Preempt the lowest-priority sequence groups.
-                    victim_seq_group = self.running.pop()
+                    victim_seq_group = self._pop_preemption_victim()
                     self._preempt(victim_seq_group, retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out, streaming_blocks_to_swap_out=streaming_blocks_to_swap_out)
                     preempted.append(victim_seq_group)
                 else:
@@ -338,46 +652,112 @@ class Scheduler:
                 self.running.append(seq_group)
 
             self.swapped.extendleft(leftover_swapped)
-
-        # Each sequence in the generation phase only takes one token slot.
-        # Therefore, the number of batched tokens is equal to the number of
-        # sequences in the RUNNING state.
-        num_batched_tokens = sum(
-            seq_group.num_seqs(status=SequenceStatus.RUNNING)
-            for seq_group in self.running
+        return preempted
+
+    def _get_preemption_cost(self, seq_group: SequenceGroup) -> Tuple[float, PreemptionMode]:
+        """Estimated seconds of work lost by preempting seq_group, with the cheaper preemption mode."""
+        cost_model = self.preemption_cost_model
+        swap_time = float("inf")
+        if self.block_manager.can_swap_out(seq_group):
+            swap_time = cost_model.get_swap_time(*self.block_manager.get_num_physical_blocks(seq_group))
+        if seq_group.get_max_num_running_seqs() > 1:
+            # Recomputation does not support several sequences per group, see _preempt().
+            return swap_time, PreemptionMode.SWAP
+        seq = seq_group.get_seqs(status=SequenceStatus.RUNNING)[0]
+        # Only the tokens whose KV is computed already are lost (mixed batching: a prompt may be partially computed).
+        num_computed_tokens = seq.data.num_computed_tokens if self.mixed_batching else seq.get_len() - 1
+        recompute_time = cost_model.get_recompute_time(num_computed_tokens)
+        if swap_time < recompute_time:
+            return swap_time, PreemptionMode.SWAP
+        return recompute_time, PreemptionMode.RECOMPUTE
+
+    def _pop_preemption_victim(self) -> SequenceGroup:
+        if self.preemption_cost_model is None:
+            return self.running.pop()
+        # The groups still in self.running have a lower priority than the one that needs a slot; among them, the one
+        # that loses the least work (the latest arrival on a tie).
+        victim_seq_group = min(
+            reversed(self.running), key=lambda seq_group: self._get_preemption_cost(seq_group)[0]
         )
-
-        scheduler_outputs = SchedulerOutputs(
-            scheduled_seq_groups=self.running,
-            prompt_run=False,
-            num_batched_tokens=num_batched_tokens,
-            retrieval_blocks_to_swap_in=retrieval_blocks_to_swap_in,
-            streaming_blocks_to_swap_in=streaming_blocks_to_swap_in,
-            retrieval_blocks_to_swap_out=retrieval_blocks_to_swap_out,
-            streaming_blocks_to_swap_out=streaming_blocks_to_swap_out,
-            retrieval_blocks_to_copy=retrieval_blocks_to_copy,
-            streaming_blocks_to_copy=streaming_blocks_to_copy,
-            ignored_seq_groups=[],
-        )
-        return scheduler_outputs
+        self.running.remove(victim_seq_group)
+        return victim_seq_group
+
+    def _is_prefilling(self, seq_group: SequenceGroup) -> bool:
+        # Mixed batching: more than the last token of the sequence is missing from the KV cache.
+        if not self.mixed_batching:
+            return False
+        seq = seq_group.get_seqs(status=SequenceStatus.RUNNING)[0]
+        return seq.data.num_computed_tokens < seq.get_len() - 1
+
+    def _get_prefill_chunk_size(
+        self, seq_group: SequenceGroup, token_budget: int, batch_empty: bool
+    ) -> int:
+        seq = seq_group.get_seqs(status=SequenceStatus.RUNNING)[0]
+        num_remaining_tokens = seq.get_len() - seq.data.num_computed_tokens
+        if self.max_prefill_chunk_size > 0:
+            return min(num_remaining_tokens, token_budget, self.max_prefill_chunk_size)
+        # Prompts are not split: one larger than the budget only runs alone.
+        if num_remaining_tokens <= token_budget or batch_empty:
+            return num_remaining_tokens
+        return 0
 
     def schedule(self) -> Tuple[List[SequenceGroupMetadata], SchedulerOutputs]:
         # Schedule sequence groups.
         # This function call changes the internal states of the scheduler
         # such as self.running, self.swapped, and self.waiting.
-        scheduler_outputs = self._schedule()
+        self.block_manager.start_retrieval_compaction_step()
+        if self.mixed_batching:
+            scheduler_outputs = self._schedule_mixed()
+        else:
+            scheduler_outputs = self._schedule()
+        return self._create_seq_group_metadata_list(scheduler_outputs), scheduler_outputs
+
+    def schedule_disaggregated(
+        self,
+    ) -> Tuple[List[SequenceGroupMetadata], SchedulerOutputs, List[SequenceGroupMetadata], SchedulerOutputs]:
+        """Schedules a step of both instances with disaggregated prefill: the prompts, and the decoding step of the
+        groups that were running before (their prompt pages have arrived)."""
+        self.block_manager.start_retrieval_compaction_step()
+        prefill_outputs, decode_outputs = self._schedule_disaggregated()
+        return (
+            self._create_seq_group_metadata_list(prefill_outputs),
+            prefill_outputs,
+            self._create_seq_group_metadata_list(decode_outputs),
+            decode_outputs,
+        )
+
+    def _create_seq_group_metadata_list(self, scheduler_outputs: SchedulerOutputs) -> List[SequenceGroupMetadata]:
+        token_chunk_sizes = scheduler_outputs.token_chunk_sizes
 
         # Create input data structures.
         seq_group_metadata_list: List[SequenceGroupMetadata] = []
         for seq_group in scheduler_outputs.scheduled_seq_groups:
+            num_computed_tokens = token_chunk_size = None
+            if token_chunk_sizes is not None:
+                seq = seq_group.get_seqs(status=SequenceStatus.RUNNING)[0]
+                if scheduler_outputs.prompt_run:
+                    num_computed_tokens = seq.data.num_computed_tokens
+                    token_chunk_size = token_chunk_sizes[seq_group.request_id]
+                # The chunk is in the KV cache once the step has run.
+                seq.data.num_computed_tokens = min(
+                    seq.get_len(), seq.data.num_computed_tokens + token_chunk_sizes[seq_group.request_id]
+                )
             seq_data: Dict[int, SequenceData] = {}
             retrieval_block_tables: Dict[int, List[int]] = {}
             streaming_block_tables: Dict[int, Optional[List[int]]] = {}
+            evicted_retrieval_pages: Optional[Dict[int, List[int]]] = (
+                {} if self.block_manager.retrieval_eviction_enabled else None
+            )
+            compacted_retrieval_seq_ids: List[int] = []
             for seq in seq_group.get_seqs(status=SequenceStatus.RUNNING):
                 seq_id = seq.seq_id
                 seq_data[seq_id] = seq.data
                 retrieval_block_tables[seq_id] = self.block_manager.get_retrieval_block_table(seq)
                 streaming_block_tables[seq_id] = self.block_manager.get_streaming_block_table(seq)
+                if evicted_retrieval_pages is not None:
+                    evicted_retrieval_pages[seq_id] = self.block_manager.get_evicted_retrieval_pages(seq)
+                if self.block_manager.is_retrieval_table_compacted(seq):
+                    compacted_retrieval_seq_ids.append(seq_id)
 
             seq_group_metadata = SequenceGroupMetadata(
                 request_id=seq_group.request_id,
@@ -387,9 +767,16 @@ class Scheduler:
                 retrieval_block_tables=retrieval_block_tables,
                 streaming_block_tables=streaming_block_tables,
                 prefix=seq_group.prefix,
+                num_computed_tokens=num_computed_tokens,
+                token_chunk_size=token_chunk_size,
+                evicted_retrieval_pages=evicted_retrieval_pages,
+                compacted_retrieval_seq_ids=compacted_retrieval_seq_ids,
             )
             seq_group_metadata_list.append(seq_group_metadata)
-        return seq_group_metadata_list, scheduler_outputs
+            if scheduler_outputs.prompt_run and seq_group not in scheduler_outputs.partial_prefill_seq_groups:
+                # The prompt pages are written by this step, later prompts may reuse them.
+                self.block_manager.mark_blocks_as_computed(seq_group)
+        return seq_group_metadata_list
 
     def prepare_input(self) -> Tuple[List[SequenceGroupMetadata], SchedulerOutputs]:
         # Simplized version of schedule(), no need to manage kv blocks
@@ -426,6 +813,9 @@ class Scheduler:
     def _allocate(self, seq_group: SequenceGroup) -> None:
         self.block_manager.allocate(seq_group, self.ifb_mode, self.init_num_blocks)
         for seq in seq_group.get_seqs(status=SequenceStatus.WAITING):
+            seq.data.num_computed_tokens = seq.data.num_cached_tokens
+            self.num_allocated_prompt_tokens += seq.get_len()
+            self.num_prefix_cached_tokens += seq.data.num_cached_tokens
             seq.status = SequenceStatus.RUNNING
 
     def _append_slot(
@@ -448,6 +838,9 @@ class Scheduler:
                     streaming_blocks_to_copy[src_block].append(dst_block)
                 else:
                     streaming_blocks_to_copy[src_block] = [dst_block]
+            if self.block_manager.retrieval_compaction_enabled:
+                for src_block, dst_block in self.block_manager.compact_retrieval_blocks(seq):
+                    retrieval_blocks_to_copy.setdefault(src_block, []).append(dst_block)
             
             # if ret is not None:
             #     src_block, dst_block = ret
@@ -474,6 +867,8 @@ class Scheduler:
         # over sequence groups with a single sequence.
         # TODO(woosuk): Support recomputation for sequence groups with multiple
         # sequences. This may require a more sophisticated CUDA kernel.
+        if preemption_mode is None and self.preemption_cost_model is not None:
+            preemption_mode = self._get_preemption_cost(seq_group)[1]
         if preemption_mode is None:
             if seq_group.get_max_num_running_seqs() == 1:
                 preemption_mode = PreemptionMode.RECOMPUTE
@@ -481,8 +876,10 @@ class Scheduler:
                 preemption_mode = PreemptionMode.SWAP
         if preemption_mode == PreemptionMode.RECOMPUTE:
             self._preempt_by_recompute(seq_group)
+            self.num_preemptions["recompute"] += 1
         elif preemption_mode == PreemptionMode.SWAP:
             self._preempt_by_swap(seq_group, retrieval_blocks_to_swap_out, streaming_blocks_to_swap_out)
+            self.num_preemptions["swap"] += 1
         else:
             raise AssertionError("Invalid preemption mode.")
 
@@ -13,7 +13,7 @@
 import argparse
 import dataclasses
 from dataclasses import dataclass
-from typing import Optional, Tuple
+from typing import List, Optional, Tuple
 import os
 import torch
 
@@ -55,13 +55,22 @@ class EngineArgs:
     pipeline_parallel_size: int = 1
     tensor_parallel_size: int = 1
     max_parallel_loading_workers: Optional[int] = None
+    disaggregated_prefill: bool = False
+    context_parallel_size: int = 1
+    context_parallel_min_tokens: int = 32768
     block_size: int = 64
     swap_space: int = 4  # GiB
     gpu_memory_utilization: float = 0.90
     max_num_batched_tokens: int = 262144
     max_num_seqs: int = 256
     max_paddings: int = 256
+    step_token_budget: int = 0
+    preemption_policy: str = "cost"
+    preemption_prefill_tflops: float = 300.0
+    preemption_swap_gbps: float = 20.0
     disable_log_stats: bool = False
+    metrics_port: int = 0
+    background_detokenization: bool = False
     revision: Optional[str] = None
     code_revision: Optional[str] = None
     tokenizer_revision: Optional[str] = None
@@ -71,6 +80,7 @@ class EngineArgs:
     disable_custom_all_reduce: bool = False
     device: str = "cuda"
     ifb_mode: bool = False
+    async_engine_loop: bool = False
     benchmarking: bool = False
     precision: str = "w4a8kv4"
     # int4_kv: bool = False
@@ -79,19 +89,38 @@ class EngineArgs:
     group_size: int = -1
     omit_prompt: bool = False
     kv_quant_granularity: Optional[str] = None #str = "per_tensor"
+    fp8_kv_cache: bool = False
+    streaming_kv_precision: Optional[str] = None
     chunk_prefill_size: int = 32000
     sparse_context_mode: bool = False
     sparse_decode_mode: int = 1
     static_sparse_attn_load_dir: Optional[str] = None
     static_sparsity: float = 0.0
+    static_sparsity_levels: Optional[List[float]] = None
     ctx_sink_token: int = 128
     ctx_local_token: int = 8192
+    ctx_dynamic_sparse: bool = False
     dec_sink_token: int = 128
     dec_local_token: int = 256
     sub_chunk_per_block: int = 4
     dynamic_sparse_token_budget: int = 4096
     selector_update_interval: int = 4
+    super_page_size: int = 0
+    num_selected_super_pages: int = 0
+    selector_drift_threshold: float = 0.0
+    persistent_decode_attention: bool = False
+    gqa_page_selection: str = "none"
+    enable_prefix_caching: bool = False
+    num_hot_retrieval_blocks: int = 0
+    retrieval_offload_space: int = 16  # GiB
+    retrieval_offload_staging_blocks: int = 2048
+    max_retrieval_blocks_per_seq: int = 0
+    retrieval_eviction_interval: int = 16
+    retrieval_block_run_size: int = 0
+    retrieval_compaction_blocks_per_step: int = 0
     multiblock_switch: int = 2048
+    quantize_lm_head: bool = False
+    w4a4_prefill_min_tokens: int = 0
 
     def __post_init__(self):
         if self.tokenizer is None:
@@ -228,6 +257,25 @@ class EngineArgs:
             "to avoid RAM OOM when using tensor "
             "parallel and large models",
         )
+        parser.add_argument(
+            "--disaggregated-prefill",
+            action="store_true",
+            help="run the prompts on a second model instance of --tensor-parallel-size GPUs, which sends the "
+            "quantized KV pages of every prompt to the decoding instance (2 x tensor_parallel_size GPUs)",
+        )
+        parser.add_argument(
+            "--context-parallel-size",
+            type=int,
+            default=EngineArgs.context_parallel_size,
+            help="number of model instances of --tensor-parallel-size GPUs which split the prefill of a long prompt "
+            "along the sequence; the first instance keeps the KV pages and runs every other step",
+        )
+        parser.add_argument(
+            "--context-parallel-min-tokens",
+            type=int,
+            default=EngineArgs.context_parallel_min_tokens,
+            help="shortest prompt prefilled across the --context-parallel-size instances",
+        )
         # KV cache arguments
         parser.add_argument(
             "--block-size",
@@ -266,17 +314,58 @@ class EngineArgs:
             default=EngineArgs.max_num_seqs,
             help="maximum number of sequences per iteration",
         )
+        parser.add_argument(
+            "--step-token-budget",
+            type=int,
+            default=EngineArgs.step_token_budget,
+            help="mixed batching: tokens per step, filled with all the decoding sequences and prefill "
+            "chunks of the waiting prompts, so that long prompts do not stall the decodes "
+            "(0: separate prefill and decode steps). Requires --ifb-mode and fine_grained KV quantization.",
+        )
         parser.add_argument(
             "--max-paddings",
             type=int,
             default=EngineArgs.max_paddings,
             help="maximum number of paddings in a batch",
         )
+        parser.add_argument(
+            "--preemption-policy",
+            type=str,
+            default=EngineArgs.preemption_policy,
+            choices=["default", "cost"],
+            help="cost: preempt the sequences that lose the least work, and swap or recompute each of them "
+            "by an estimate of the cheaper option. default: preempt the latest arrivals and recompute them.",
+        )
+        parser.add_argument(
+            "--preemption-prefill-tflops",
+            type=float,
+            default=EngineArgs.preemption_prefill_tflops,
+            help="prefill throughput per GPU (TFLOPS) assumed by the recompute cost of --preemption-policy cost",
+        )
+        parser.add_argument(
+            "--preemption-swap-gbps",
+            type=float,
+            default=EngineArgs.preemption_swap_gbps,
+            help="host <-> device bandwidth per GPU (GB/s) assumed by the swap cost of --preemption-policy cost",
+        )
         parser.add_argument(
             "--disable-log-stats",
             action="store_true",
             help="disable logging statistics",
         )
+        parser.add_argument(
+            "--metrics-port",
+            type=int,
+            default=EngineArgs.metrics_port,
+            help="serve the engine stats in the Prometheus text format at http://0.0.0.0:<port>/metrics (0: off)",
+        )
+        parser.add_argument(
+            "--background-detokenization",
+            action="store_true",
+            help="detokenize the outputs on a background thread, which also applies the stop strings of the "
+            "requests and streams the text as it is decoded (LLMEngine.set_stream_callback). Finished requests are "
+            "returned by a later step, once their final text is decoded.",
+        )
         # Quantization settings.
         parser.add_argument(
             "--quantization",
@@ -327,6 +416,12 @@ class EngineArgs:
             action="store_true",
             help="Enable In-flight Batching mode.",
         )
+        parser.add_argument(
+            "--async-engine-loop",
+            action="store_true",
+            help="(IFB mode) Schedule and prepare step N+1 while step N runs on the GPU. Stop conditions are "
+            "then detected one step late.",
+        )
         parser.add_argument(
             "--benchmarking",
             action="store_true",
@@ -370,7 +465,22 @@ class EngineArgs:
             "--kv-quant-granularity",
             type=str,
             default=EngineArgs.kv_quant_granularity,
-            help="per_tensor or fine_grained (per_token + per_head)",
+            help="per_tensor, per_page (per-tensor kernels with per-page scales on the retrieval heads) "
+            "or fine_grained (per_token + per_head)",
+        )
+        parser.add_argument(
+            "--fp8-kv-cache",
+            action="store_true",
+            help="Store the 8-bit KV cache as FP8 (E4M3) with per-token-head scales instead of int8 "
+            "with zero points. Requires a kv8 precision and fine_grained KV quantization.",
+        )
+        parser.add_argument(
+            "--streaming-kv-precision",
+            type=str,
+            default=EngineArgs.streaming_kv_precision,
+            choices=["kv4", "kv8"],
+            help="KV cache precision of the streaming heads (default: the kv precision of --precision, which then "
+            "only applies to the retrieval heads). Requires fine_grained KV quantization.",
         )
         parser.add_argument(
             "--chunk-prefill-size",
@@ -390,6 +500,14 @@ class EngineArgs:
             default=EngineArgs.static_sparsity,
             help="Sparsity of the attention pattern.",
         )
+        parser.add_argument(
+            "--static-sparsity-levels",
+            type=float,
+            nargs="*",
+            default=EngineArgs.static_sparsity_levels,
+            help="Sparser static sparsity levels a request can ask for (SamplingParams.static_sparsity). "
+            "They only change the prefill attention of the request; the KV cache layout follows --static-sparsity.",
+        )
         parser.add_argument(
             "--sparse-context-mode",
             action="store_true",
@@ -407,6 +525,13 @@ class EngineArgs:
             default=EngineArgs.ctx_local_token,
             help="Number of local tokens for ctx attn.",
         )
+        parser.add_argument(
+            "--ctx-dynamic-sparse",
+            action="store_true",
+            help="Prefill chunks after a cached prefix (chunked prefill, prefix caching) attend only to the "
+            "prefix pages picked by the decode page selector from their mean query, plus their own pages. "
+            "Requires sparse decoding.",
+        )
         parser.add_argument(
             "--dec-sink-token",
             type=int,
@@ -444,6 +569,111 @@ class EngineArgs:
             default=EngineArgs.selector_update_interval,
             help="Number of intervals between two selecting operation.",
         )
+        parser.add_argument(
+            "--super-page-size",
+            type=int,
+            default=EngineArgs.super_page_size,
+            help="Number of pages per super page for hierarchical page selection (0 to disable).",
+        )
+        parser.add_argument(
+            "--num-selected-super-pages",
+            type=int,
+            default=EngineArgs.num_selected_super_pages,
+            help="Number of super pages kept per head by the hierarchical page selection (0: twice the budget).",
+        )
+        parser.add_argument(
+            "--selector-drift-threshold",
+            type=float,
+            default=EngineArgs.selector_drift_threshold,
+            help="Reselect pages before the next update interval when the query cosine similarity "
+            "to the last selecting query (averaged over the heads of a sequence) falls below this value "
+            "(0 to disable). Checked once per eager decode step by the first layer, at the cost of one "
+            "device-to-host sync per step.",
+        )
+        parser.add_argument(
+            "--persistent-decode-attention",
+            action="store_true",
+            help="Run sparse decoding attention with persistent CTAs that share one work queue "
+            "between retrieval and streaming heads.",
+        )
+        parser.add_argument(
+            "--gqa-page-selection",
+            type=str,
+            choices=["none", "max", "sum"],
+            default=EngineArgs.gqa_page_selection,
+            help="Select one page set per KV head from the max / sum of the scores of its query heads "
+            "(none: one page set per query head).",
+        )
+        parser.add_argument(
+            "--enable-prefix-caching",
+            action="store_true",
+            help="Reuse the KV pages of full blocks whose prefix was already computed, and skip "
+            "those tokens in the prompt run. Requires fine_grained KV quantization.",
+        )
+        parser.add_argument(
+            "--num-hot-retrieval-blocks",
+            type=int,
+            default=EngineArgs.num_hot_retrieval_blocks,
+            help="Keep only the last N retrieval pages of every sequence (and its first one) on the GPU and offload "
+            "the older ones to pinned host memory; the pages chosen by the decode page selector are staged back "
+            "per layer. 0: no offloading. Requires --ifb-mode and sparse decoding.",
+        )
+        parser.add_argument(
+            "--retrieval-offload-space",
+            type=int,
+            default=EngineArgs.retrieval_offload_space,
+            help="Host memory (GiB) per GPU for the offloaded retrieval pages.",
+        )
+        parser.add_argument(
+            "--retrieval-offload-staging-blocks",
+            type=int,
+            default=EngineArgs.retrieval_offload_staging_blocks,
+            help="GPU pages per staging buffer for the offloaded pages selected by a layer; the selected pages "
+            "beyond it are read from host memory directly.",
+        )
+        parser.add_argument(
+            "--max-retrieval-blocks-per-seq",
+            type=int,
+            default=EngineArgs.max_retrieval_blocks_per_seq,
+            help="Retrieval pages a decoding sequence keeps on the GPU: beyond it, the pages picked the least by the "
+            "decode page selector are freed (the sink and local pages, and shared or cached pages, are kept). "
+            "0: no eviction. Requires --ifb-mode and flat sparse decoding.",
+        )
+        parser.add_argument(
+            "--retrieval-eviction-interval",
+            type=int,
+            default=EngineArgs.retrieval_eviction_interval,
+            help="Steps between two reads of the page selection counts that pick the retrieval pages to evict.",
+        )
+        parser.add_argument(
+            "--retrieval-block-run-size",
+            type=int,
+            default=EngineArgs.retrieval_block_run_size,
+            help="Allocate the retrieval pages of a sequence at consecutive block numbers: its first page starts a "
+            "free extent of N pages, and every next page takes the block after the previous one when it is free. "
+            "0: any free page.",
+        )
+        parser.add_argument(
+            "--retrieval-compaction-blocks-per-step",
+            type=int,
+            default=EngineArgs.retrieval_compaction_blocks_per_step,
+            help="Retrieval pages moved per step next to their predecessor in the block table (one block copy each) "
+            "to join the runs of consecutive pages. Requires --retrieval-block-run-size.",
+        )
+        parser.add_argument(
+            "--quantize-lm-head",
+            action="store_true",
+            help="Run the LM head as a W8A8 GEMM (per-channel int8 weights quantized at load time). "
+            "Greedy and small top-k rows sample from a top-k fused into the GEMM epilogue.",
+        )
+        parser.add_argument(
+            "--w4a4-prefill-min-tokens",
+            type=int,
+            default=EngineArgs.w4a4_prefill_min_tokens,
+            help="Run the MLP of prompt steps with at least this many tokens as W4A4 GEMMs (int4 tensor cores, "
+            "per-group int4 activations). Decoding stays W4A8. Per-channel W4A8 models on a single GPU; keeps an "
+            "extra int4 copy of the MLP weights. 0: disabled.",
+        )
         parser.add_argument(
             "--multiblock-switch",
             type=int,
@@ -474,6 +704,8 @@ class EngineArgs:
         str,  # precision
         bool,  # int4_kv
         bool,  # kv_zp
+        bool,  # fp8_kv
+        bool,  # streaming_int4_kv
         str,  # quant_path
         int,  # group_size
         bool,  # omit_prompt
@@ -499,15 +731,97 @@ class EngineArgs:
         # self.kv_zp = True
         # Note (kentang): per-tensor kv8 does not have zero point.
         
-        if self.kv_quant_granularity == "per_tensor":
+        if self.kv_quant_granularity in ("per_tensor", "per_page"):
             self.kv_zp = False
         elif self.kv_quant_granularity == "fine_grained":
             self.kv_zp = True
         else:
             raise NotImplementedError(f"Unsupported kv_quant_granularity {self.kv_quant_granularity}")
 
+        if self.fp8_kv_cache:
+            assert not self.int4_kv and self.kv_quant_granularity == "fine_grained", \
+                "The FP8 KV cache requires a kv8 precision and --kv-quant-granularity fine_grained."
+            # E4M3 is symmetric: per-token-head scales only.
+            self.kv_zp = False
+
+        if self.enable_prefix_caching:
+            # The cached prefix is read back through its per-token-head scales (paged_context_attention).
+            assert self.kv_quant_granularity == "fine_grained", \
+                "Prefix caching requires --kv-quant-granularity fine_grained."
+
+        if self.step_token_budget > 0:
+            # The decoding sequences of a mixed step run as one-token prefill chunks through paged_context_attention,
+            # which reads their pages with per-token-head scales and cannot reach offloaded pages. The async loop
+            # samples every scheduled sequence, while a partial prefill chunk samples nothing.
+            assert self.ifb_mode and not self.async_engine_loop, \
+                "--step-token-budget requires --ifb-mode without --async-engine-loop."
+            assert self.kv_quant_granularity == "fine_grained" and self.num_hot_retrieval_blocks == 0, \
+                "--step-token-budget requires --kv-quant-granularity fine_grained and no retrieval offloading."
+
+        if self.disaggregated_prefill:
+            # The prefill instance writes the prompt pages under the block ids of the decoding instance, which only
+            # manages the pages of that instance: cached prefixes and offloaded pages do not exist on the other one.
+            assert self.ifb_mode and not self.async_engine_loop and self.step_token_budget == 0, \
+                "--disaggregated-prefill requires --ifb-mode without --async-engine-loop and mixed batching."
+            assert not self.enable_prefix_caching and self.num_hot_retrieval_blocks == 0, \
+                "--disaggregated-prefill does not support prefix caching and retrieval offloading."
+
+        if self.context_parallel_size > 1:
+            # Same as disaggregated prefill: the pages of a split prompt are gathered under the block ids of the
+            # first instance. A split prompt runs alone and in one piece.
+            assert self.ifb_mode and not self.async_engine_loop and self.step_token_budget == 0, \
+                "--context-parallel-size requires --ifb-mode without --async-engine-loop and mixed batching."
+            assert not self.enable_prefix_caching and self.num_hot_retrieval_blocks == 0, \
+                "--context-parallel-size does not support prefix caching and retrieval offloading."
+
+        if self.w4a4_prefill_min_tokens > 0:
+            # Mixed steps carry decoding tokens, which stay on the W4A8 GEMMs.
+            assert self.step_token_budget == 0, "--w4a4-prefill-min-tokens does not support mixed batching."
+
+        if self.static_sparsity_levels:
+            # The KV written by a prompt depends on its level, and a step runs the prompts of a single level.
+            assert self.sparse_context_mode and self.step_token_budget == 0 and self.context_parallel_size == 1, \
+                "--static-sparsity-levels requires --sparse-context-mode without mixed batching and context parallelism."
+            assert not self.enable_prefix_caching, \
+                "--static-sparsity-levels does not support prefix caching."
+
+        if self.ctx_dynamic_sparse:
+            # The chunks reuse the decode page selector and its token budget.
+            assert self.sparse_decode_mode != 0, "--ctx-dynamic-sparse requires sparse decoding."
+
+        if self.num_hot_retrieval_blocks > 0:
+            # The page selector picks the cold pages to stage; the staging is per step and not graph captured.
+            assert self.ifb_mode and self.sparse_decode_mode != 0, \
+                "--num-hot-retrieval-blocks requires --ifb-mode and sparse decoding."
+
+        if self.max_retrieval_blocks_per_seq > 0:
+            # Only the page selector skips the evicted pages: every retrieval read of a decoding sequence has to go
+            # through it, which mixed steps (paged context attention) and the super-page candidates do not.
+            assert self.ifb_mode and self.sparse_decode_mode != 0 and self.super_page_size == 0, \
+                "--max-retrieval-blocks-per-seq requires --ifb-mode and sparse decoding without super-pages."
+            assert self.step_token_budget == 0 and self.num_hot_retrieval_blocks == 0, \
+                "--max-retrieval-blocks-per-seq does not support mixed batching and retrieval offloading."
+
+        if self.retrieval_compaction_blocks_per_step > 0:
+            assert self.retrieval_block_run_size > 0, \
+                "--retrieval-compaction-blocks-per-step requires --retrieval-block-run-size."
+
+        streaming_int4_kv = self.int4_kv
+        if self.streaming_kv_precision is not None:
+            assert self.streaming_kv_precision in ["kv4", "kv8"], \
+                f"Invalid streaming KV precision {self.streaming_kv_precision}, choose from kv4, kv8."
+            # Both head classes share the int8 storage and the zero points of the fine-grained cache.
+            assert self.kv_quant_granularity == "fine_grained" and not self.fp8_kv_cache, \
+                "--streaming-kv-precision requires --kv-quant-granularity fine_grained and an int8 / int4 KV cache."
+            streaming_int4_kv = self.streaming_kv_precision == "kv4"
+            if streaming_int4_kv != self.int4_kv:
+                # The decode kernel without dynamic sparsity reads both head classes with one precision.
+                assert self.sparse_decode_mode != 0, \
+                    "A streaming KV precision that differs from the retrieval heads requires sparse decoding."
+
         kv_zp = self.kv_zp
         int4_kv = self.int4_kv
+        fp8_kv = self.fp8_kv_cache
 
         device_config = DeviceConfig(self.device)
         model_config = ModelConfig(
@@ -529,8 +843,13 @@ class EngineArgs:
             self.max_context_len_to_capture,
             self.kv_quant_granularity,
             self.chunk_prefill_size,
-            self.multiblock_switch
+            self.multiblock_switch,
+            self.quantize_lm_head,
+            self.w4a4_prefill_min_tokens,
         )
+        # Only the Llama attention layers run the ring context attention.
+        assert self.context_parallel_size == 1 or "mixtral" not in model_config.hf_config.model_type, \
+            "--context-parallel-size does not support Mixtral models."
         sp_attn_config = sparse_attn_init(
             total_num_kv_heads = model_config.get_total_num_kv_heads(),
             total_num_layers = model_config.hf_config.num_hidden_layers,
@@ -539,14 +858,30 @@ class EngineArgs:
             sparse_decode_mode = self.sparse_decode_mode,
             static_sparse_attn_load_dir = self.static_sparse_attn_load_dir,
             static_sparsity = self.static_sparsity,
+            static_sparsity_levels = self.static_sparsity_levels,
             ctx_sink_token = self.ctx_sink_token,
             ctx_local_token = self.ctx_local_token,
+            ctx_dynamic_sparse = self.ctx_dynamic_sparse,
             dec_sink_token = self.dec_sink_token,
             dec_local_token = self.dec_local_token,
             sub_chunk_per_block = self.sub_chunk_per_block,
             dynamic_sparse_token_budget = self.dynamic_sparse_token_budget,
-            selector_update_interval = self.selector_update_interval
-        )
+            selector_update_interval = self.selector_update_interval,
+            super_page_size = self.super_page_size,
+            num_selected_super_pages = self.num_selected_super_pages,
+            selector_drift_threshold = self.selector_drift_threshold,
+            persistent_decode_attention = self.persistent_decode_attention,
+            gqa_page_selection = self.gqa_page_selection,
+        )
+        if self.max_retrieval_blocks_per_seq > 0:
+            # The selector has to find its engine-wide budget among the resident pages.
+            min_retrieval_blocks = (
+                max(3, self.dynamic_sparse_token_budget // self.block_size)
+                + sp_attn_config.get_dec_sink_block_num()
+                + sp_attn_config.get_dec_local_block_num()
+            )
+            assert self.max_retrieval_blocks_per_seq >= min_retrieval_blocks, \
+                f"--max-retrieval-blocks-per-seq must be at least {min_retrieval_blocks} (budget, sink and local pages)."
         self.kv_cache_bits = _get_dtype_size(
             _STR_DTYPE_TO_TORCH_DTYPE[self.kv_cache_dtype]
         )
@@ -561,6 +896,14 @@ class EngineArgs:
             self.kv_cache_dtype,
             self.kv_cache_bits,
             model_config.get_sliding_window(),
+            self.enable_prefix_caching,
+            self.num_hot_retrieval_blocks,
+            self.retrieval_offload_space if self.num_hot_retrieval_blocks > 0 else 0,
+            self.retrieval_offload_staging_blocks,
+            self.max_retrieval_blocks_per_seq,
+            self.retrieval_eviction_interval,
+            self.retrieval_block_run_size,
+            self.retrieval_compaction_blocks_per_step,
         )
         
         # add sp_attn_config to cache_config and model_config
@@ -572,14 +915,22 @@ class EngineArgs:
             self.tensor_parallel_size,
             self.max_parallel_loading_workers,
             self.disable_custom_all_reduce,
+            self.disaggregated_prefill,
+            self.context_parallel_size,
+            self.context_parallel_min_tokens,
         )
         scheduler_config = SchedulerConfig(
             self.max_num_batched_tokens,
             self.max_num_seqs,
             model_config.max_model_len,
             self.max_paddings,
+            self.step_token_budget,
+            self.preemption_policy,
+            self.preemption_prefill_tflops,
+            self.preemption_swap_gbps,
         )
-        ifb_config = IFBConfig(self.ifb_mode)
+        assert self.ifb_mode or not self.async_engine_loop, "--async-engine-loop requires --ifb-mode."
+        ifb_config = IFBConfig(self.ifb_mode, self.async_engine_loop)
         benchmarking_mode = self.benchmarking
 
         quant_path = self.quant_path
@@ -596,6 +947,8 @@ class EngineArgs:
             precision,
             int4_kv,
             kv_zp,
+            fp8_kv,
+            streaming_int4_kv,
             quant_path,
             group_size,
             omit_prompt,
@@ -0,0 +1,278 @@
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Detokenization, stop strings and output streaming on a background thread (--background-detokenization).
+
+LLMEngine pushes the tokens of every step to a deque and moves on to the next step: deque appends and pops are
+atomic, so neither side ever takes a lock or waits for the other. The thread decodes the tokens incrementally
+(utils.tokenizer.detokenize_incrementally), looks for the stop strings of the request and hands every text delta to
+the stream callback as soon as it is decoded. The sequences that generated a stop string are handed back through a
+second deque, which the engine drains before it schedules a step, and the final texts (the full decode of a finished
+sequence, which used to run inline in the step) through a third.
+"""
+import threading
+from collections import deque
+from typing import Callable, Deque, Dict, List, Optional, Tuple
+
+from omniserve.logger import init_logger
+from omniserve.sampling_params import SamplingParams
+from omniserve.sequence import Sequence
+from omniserve.utils.tokenizer import convert_prompt_ids_to_tokens, detokenize_incrementally
+
+logger = init_logger(__name__)
+
+# Tokens kept before prefix_offset once they can no longer change the decoded text.
+_MAX_STALE_TOKENS = 1024
+
+
+def decode_sequence_text(
+    tokenizer,
+    prompt_token_ids: List[int],
+    output_token_ids: List[int],
+    full_prompt_token_ids: List[int],
+    omit_prompt: bool,
+) -> str:
+    """The text of a finished sequence: prompt and output, or the output and the decoding simulation tokens with
+    omit_prompt."""
+    token_ids = prompt_token_ids + output_token_ids
+    if omit_prompt:
+        n = len(full_prompt_token_ids)
+        i = 0
+        while i <= len(token_ids) - n:
+            if token_ids[i : i + n] == full_prompt_token_ids:
+                del token_ids[i : i + n]
+            else:
+                i += 1
+    return tokenizer.decode(token_ids)
+
+
+class _SequenceState:
+    """Detokenization state of a sequence, only touched by the detokenizer thread."""
+
+    def __init__(
+        self,
+        tokenizer,
+        seq_id: int,
+        request_id: str,
+        prompt_token_ids: List[int],
+        full_prompt_token_ids: List[int],
+        sampling_params: SamplingParams,
+    ) -> None:
+        self.seq_id = seq_id
+        self.request_id = request_id
+        self.prompt_token_ids = prompt_token_ids
+        self.full_prompt_token_ids = full_prompt_token_ids
+        self.stop = sampling_params.stop
+        self.include_stop_str_in_output = sampling_params.include_stop_str_in_output
+        self.skip_special_tokens = sampling_params.skip_special_tokens
+        self.spaces_between_special_tokens = sampling_params.spaces_between_special_tokens
+        self.max_stop_len = max((len(stop) for stop in self.stop), default=0)
+        self.tokens, self.prefix_offset, self.read_offset = convert_prompt_ids_to_tokens(
+            tokenizer, prompt_token_ids, skip_special_tokens=self.skip_special_tokens
+        )
+        self.output_token_ids: List[int] = []
+        self.output_text = ""
+        self.num_streamed_chars = 0
+
+
+class BackgroundDetokenizer:
+    """Detokenizes the output of the engine on a daemon thread, see the module docstring.
+
+    The engine thread calls push, release, get_stopped_seq_ids, get_final_texts and wait; the stream callback runs
+    on the detokenizer thread with {"id", "request_id", "text", "finished"}, where "text" is the new text of the
+    sequence. Without a callback, the stream outputs are kept until get_stream_outputs.
+    """
+
+    def __init__(
+        self,
+        tokenizer,
+        omit_prompt: bool,
+        stream_callback: Optional[Callable[[Dict], None]] = None,
+    ) -> None:
+        self.tokenizer = tokenizer
+        self.omit_prompt = omit_prompt
+        self.stream_callback = stream_callback
+        # Engine -> thread: (seq_id, token_ids, finished, state or None), None stops the thread.
+        self.pending: Deque[Optional[Tuple]] = deque()
+        # Thread -> engine.
+        self.stopped_seq_ids: Deque[int] = deque()
+        self.final_texts: Deque[Tuple[int, str]] = deque()
+        self.stream_outputs: Deque[Dict] = deque()
+        self.pending_event = threading.Event()
+        self.output_event = threading.Event()
+        # Engine side: the sequences the thread has a state for, until they finish or are released.
+        self.registered_seq_ids: set = set()
+        # Thread side.
+        self.states: Dict[int, _SequenceState] = {}
+        self.thread = threading.Thread(target=self._run, name="omniserve-detokenizer", daemon=True)
+        self.thread.start()
+
+    def push(
+        self,
+        seq: Sequence,
+        request_id: str,
+        sampling_params: SamplingParams,
+        token_ids: List[int],
+        finished: bool,
+    ) -> None:
+        """Queues the new tokens of seq; finished: the engine finished seq, its final text is to be computed."""
+        state = None
+        if seq.seq_id not in self.registered_seq_ids:
+            self.registered_seq_ids.add(seq.seq_id)
+            # Built here, the prompt lists are never mutated afterwards.
+            state = (request_id, seq.data.prompt_token_ids, seq.full_prompt_token_ids, sampling_params)
+        if finished:
+            self.registered_seq_ids.discard(seq.seq_id)
+        self.pending.append((seq.seq_id, token_ids, finished, state))
+        self.pending_event.set()
+
+    def release(self, seq_id: int) -> None:
+        """Drops the state of an aborted sequence, without a final text."""
+        if seq_id in self.registered_seq_ids:
+            self.registered_seq_ids.discard(seq_id)
+            self.pending.append((seq_id, [], None, None))
+            self.pending_event.set()
+
+    def get_stopped_seq_ids(self) -> List[int]:
+        """The sequences that generated one of their stop strings since the last call."""
+        return [self.stopped_seq_ids.popleft() for _ in range(len(self.stopped_seq_ids))]
+
+    def get_final_texts(self) -> List[Tuple[int, str]]:
+        """(seq_id, text) of the sequences finished since the last call."""
+        final_texts = [self.final_texts.popleft() for _ in range(len(self.final_texts))]
+        # The sequences stopped by a stop string were never pushed as finished.
+        for seq_id, _ in final_texts:
+            self.registered_seq_ids.discard(seq_id)
+        return final_texts
+
+    def get_stream_outputs(self) -> List[Dict]:
+        return [self.stream_outputs.popleft() for _ in range(len(self.stream_outputs))]
+
+    def wait(self, timeout: Optional[float] = None) -> None:
+        """Blocks until a sequence stopped or finished, when the engine has nothing else to do."""
+        if self.output_event.wait(timeout):
+            self.output_event.clear()
+
+    def stop(self) -> None:
+        if self.thread.is_alive():
+            self.pending.append(None)
+            self.pending_event.set()
+            self.thread.join()
+
+    def _run(self) -> None:
+        while True:
+            self.pending_event.wait()
+            # Cleared before draining: a push after the drain sets it again.
+            self.pending_event.clear()
+            while self.pending:
+                item = self.pending.popleft()
+                if item is None:
+                    return
+                try:
+                    self._process(*item)
+                except Exception:  # pylint: disable=broad-except
+                    logger.exception(f"Detokenization of sequence {item[0]} failed.")
+                    # Finished without text rather than never returned by the engine.
+                    if self.states.pop(item[0], None) is not None:
+                        self.final_texts.append((item[0], ""))
+                        self.output_event.set()
+
+    def _process(self, seq_id: int, token_ids: List[int], finished: Optional[bool], state: Optional[Tuple]) -> None:
+        if state is not None:
+            self.states[seq_id] = _SequenceState(self.tokenizer, seq_id, *state)
+        seq_state = self.states.get(seq_id)
+        if seq_state is None:
+            # Stopped by a stop string: the engine sees it at its next step and meanwhile sampled more tokens.
+            return
+        if finished is None:
+            del self.states[seq_id]
+            return
+        new_text = self._detokenize(seq_state, token_ids)
+        stop_idx = None
+        if new_text:
+            # A stop string ends in the new text.
+            start = len(seq_state.output_text) - len(new_text) - seq_state.max_stop_len + 1
+            stop_idx = self._find_stop_string(seq_state, seq_state.output_text, max(start, 0))
+        if stop_idx is not None:
+            seq_state.output_text = seq_state.output_text[:stop_idx]
+            self.stopped_seq_ids.append(seq_id)
+            self._finish(seq_state, stopped=True)
+        elif finished:
+            self._finish(seq_state, stopped=False)
+        else:
+            # The last max_stop_len - 1 characters are held back while they may start a stop string.
+            num_streamable_chars = len(seq_state.output_text) - max(seq_state.max_stop_len - 1, 0)
+            if num_streamable_chars > seq_state.num_streamed_chars:
+                self._emit({
+                    "id": seq_id,
+                    "request_id": seq_state.request_id,
+                    "text": seq_state.output_text[seq_state.num_streamed_chars : num_streamable_chars],
+                    "finished": False,
+                })
+                seq_state.num_streamed_chars = num_streamable_chars
+
+    def _detokenize(self, seq_state: _SequenceState, token_ids: List[int]) -> str:
+        new_text = ""
+        for token_id in token_ids:
+            seq_state.output_token_ids.append(token_id)
+            text, seq_state.prefix_offset, seq_state.read_offset = detokenize_incrementally(
+                self.tokenizer,
+                seq_state.tokens,
+                token_id,
+                seq_state.prefix_offset,
+                seq_state.read_offset,
+                skip_special_tokens=seq_state.skip_special_tokens,
+                spaces_between_special_tokens=seq_state.spaces_between_special_tokens,
+            )
+            new_text += text
+        if seq_state.prefix_offset > _MAX_STALE_TOKENS:
+            del seq_state.tokens[: seq_state.prefix_offset]
+            seq_state.read_offset -= seq_state.prefix_offset
+            seq_state.prefix_offset = 0
+        seq_state.output_text += new_text
+        return new_text
+
+    def _find_stop_string(self, seq_state: _SequenceState, text: str, start: int) -> Optional[int]:
+        """Where text is cut for the first stop string found from start on, None if none."""
+        cut_idx = None
+        for stop in seq_state.stop:
+            stop_idx = text.find(stop, start)
+            if stop_idx != -1 and (cut_idx is None or stop_idx < cut_idx[0]):
+                cut_idx = (stop_idx, stop_idx + len(stop) if seq_state.include_stop_str_in_output else stop_idx)
+        return cut_idx[1] if cut_idx is not None else None
+
+    def _finish(self, seq_state: _SequenceState, stopped: bool) -> None:
+        text = decode_sequence_text(
+            self.tokenizer,
+            seq_state.prompt_token_ids,
+            seq_state.output_token_ids,
+            seq_state.full_prompt_token_ids,
+            self.omit_prompt,
+        )
+        if stopped:
+            # The incremental text skips the special tokens, the final one does not: the stop string is found
+            # again in the output part of the final text.
+            output_start = len(text) - len(self.tokenizer.decode(seq_state.output_token_ids))
+            stop_idx = self._find_stop_string(seq_state, text, max(output_start, 0))
+            if stop_idx is not None:
+                text = text[:stop_idx]
+        del self.states[seq_state.seq_id]
+        self.final_texts.append((seq_state.seq_id, text))
+        self.output_event.set()
+        self._emit({
+            "id": seq_state.seq_id,
+            "request_id": seq_state.request_id,
+            "text": seq_state.output_text[seq_state.num_streamed_chars :],
+            "finished": True,
+        })
+
+    def _emit(self, stream_output: Dict) -> None:
+        if self.stream_callback is None:
+            self.stream_outputs.append(stream_output)
+            return
+        try:
+            self.stream_callback(stream_output)
+        except Exception:  # pylint: disable=broad-except
+            logger.exception("The stream callback failed.")
@@ -10,10 +10,11 @@
 #   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
 #   year={2025}
 # }
+import atexit
 import os
 import copy
 import time
-from typing import Any, Iterable, List, Optional, Union
+from typing import Any, Callable, Dict, Iterable, List, Optional, Tuple, Union
 
 import torch
 
@@ -26,8 +27,11 @@ from omniserve.config import (
     ProfilingConfig,
     SchedulerConfig,
 )
+from omniserve.core.preemption import PreemptionCostModel
 from omniserve.core.scheduler import Scheduler, SchedulerOutputs
 from omniserve.engine.arg_utils import EngineArgs
+from omniserve.engine.detokenizer import BackgroundDetokenizer, decode_sequence_text
+from omniserve.engine.metrics import EngineMetrics, start_metrics_server
 from omniserve.logger import init_logger
 from omniserve.sampling_params import SamplingParams
 from omniserve.sequence import (
@@ -49,6 +53,15 @@ logger = init_logger(__name__)
 _LOCAL_LOGGING_INTERVAL_SEC = 5
 
 
+def _run_worker_process(rank: int, *args) -> None:
+    # The quantized linear layers pick their default device at import time, so the device of
+    # the worker has to be set before the model modules are imported.
+    torch.cuda.set_device(rank)
+    from omniserve.worker.worker import run_worker_process
+
+    run_worker_process(rank, *args)
+
+
 class LLMEngine:
     """An LLM engine that receives requests and generates texts.
 
@@ -88,11 +101,15 @@ class LLMEngine:
         precision: str,
         int4_kv: bool,
         kv_zp: bool,
+        fp8_kv: bool,
+        streaming_int4_kv: bool,
         quant_path: Optional[str],
         group_size: int,
         omit_prompt: bool,
         log_stats: bool,
         profiling_mode: bool = False,
+        metrics_port: int = 0,
+        background_detokenization: bool = False,
     ) -> None:
         logger.info(
             "Initializing an LLM engine with config: "
@@ -129,8 +146,12 @@ class LLMEngine:
         self.profiling_mode = profiling_mode
         self.benchmarking_mode = benchmarking_mode
         self.ifb_mode = ifb_config.ifb_mode
+        self.async_engine_loop = ifb_config.async_engine_loop
+        # Async engine loop: (scheduled seq groups, pinned host tokens, copy event) of the step on the device.
+        self.inflight_step = None
         self.precision = precision
-        self.kv_cache_config = {"INT4_ENABLED": int4_kv, "ZEROS_ENABLED": kv_zp}
+        self.kv_cache_config = {"INT4_ENABLED": int4_kv, "ZEROS_ENABLED": kv_zp, "FP8_ENABLED": fp8_kv,
+                                "STREAMING_INT4_ENABLED": streaming_int4_kv}
         self.init_num_blocks = (
             None  # Depends on the input & generation length, only used in non-IFB mode
         )
@@ -141,6 +162,12 @@ class LLMEngine:
 
         self._init_tokenizer()
         self.seq_counter = Counter()
+        # Background detokenization: the sequences whose final text is not in yet, by id.
+        self.detokenizer = None
+        self.detokenized_seqs: Dict[int, Tuple[SequenceGroup, Sequence]] = {}
+        if background_detokenization and not (profiling_mode or benchmarking_mode):
+            self.detokenizer = BackgroundDetokenizer(self.tokenizer, omit_prompt)
+            atexit.register(self.detokenizer.stop)
 
         # Create the parallel GPU workers.
         self._init_workers()
@@ -148,7 +175,19 @@ class LLMEngine:
         # Profile the memory usage and initialize the cache.
         self._init_cache()
         # Create the scheduler.
-        self.scheduler = Scheduler(scheduler_config, cache_config, ifb_config)
+        preemption_cost_model = None
+        if scheduler_config.preemption_policy == "cost":
+            preemption_cost_model = self._init_preemption_cost_model()
+        self.scheduler = Scheduler(scheduler_config, cache_config, ifb_config, preemption_cost_model)
+        # Retrieval page eviction: steps since the page selection counts were last read.
+        self.num_steps_since_page_scores = 0
+        # Runtime metrics (get_stats), collected unless --disable-log-stats.
+        self.metrics = EngineMetrics(model_config, cache_config.block_size) if log_stats else None
+        self.metrics_server = None
+        if metrics_port > 0:
+            assert self.metrics is not None, "--metrics-port requires the stats (no --disable-log-stats)."
+            self.metrics_server = start_metrics_server(metrics_port, self.get_stats)
+            logger.info(f"Serving the engine metrics at http://0.0.0.0:{metrics_port}/metrics")
 
         if self.ifb_mode:
             print("Running with ifb mode")
@@ -173,6 +212,32 @@ class LLMEngine:
 
         self.workers: List[Worker] = []
         distributed_init_method = get_distributed_init_method(get_ip(), get_open_port())
+
+        # The driver worker (rank 0) runs in this process. The other tensor parallel workers execute
+        # the calls the driver broadcasts in _run_workers.
+        self.worker_processes = []
+        mp_context = torch.multiprocessing.get_context("spawn")
+        for rank in range(1, self.parallel_config.world_size):
+            process = mp_context.Process(
+                target=_run_worker_process,
+                args=(
+                    rank,
+                    self.model_config,
+                    self.parallel_config,
+                    self.scheduler_config,
+                    self.device_config,
+                    distributed_init_method,
+                    self.cache_config.cache_dtype,
+                    self.precision,
+                    self.kv_cache_config,
+                ),
+                daemon=True,
+            )
+            process.start()
+            self.worker_processes.append(process)
+        if self.worker_processes:
+            atexit.register(self._stop_worker_processes)
+
         self.driver_worker = Worker(
             self.model_config,
             self.parallel_config,
@@ -187,8 +252,14 @@ class LLMEngine:
             kv_cache_config=self.kv_cache_config,
         )
         self.workers.append(self.driver_worker)
-        # self._run_workers("init_model")
-        # self._run_workers("load_model")
+        self.driver_worker.init_model()
+
+    def _stop_worker_processes(self) -> None:
+        from omniserve.modeling.parallel_utils.communication_op import broadcast_object
+
+        broadcast_object((None, None), src=0)
+        for process in self.worker_processes:
+            process.join()
 
     def _init_tokenizer(self, **tokenizer_init_kwargs):
         init_kwargs = dict(
@@ -240,6 +311,24 @@ class LLMEngine:
             group_size=self.group_size,
         )
 
+    def _init_preemption_cost_model(self) -> PreemptionCostModel:
+        # Lazy import, see _init_workers.
+        from omniserve.worker.cache_engine import CacheEngine
+
+        block_bytes = {
+            cache_mode: CacheEngine.get_gpu_block_bytes(
+                self.cache_config, self.model_config, self.parallel_config, self.kv_cache_config, cache_mode
+            )
+            for cache_mode in ("retrieval", "streaming")
+        }
+        return PreemptionCostModel(
+            self.model_config,
+            self.parallel_config,
+            self.scheduler_config,
+            retrieval_block_bytes=block_bytes["retrieval"],
+            streaming_block_bytes=block_bytes["streaming"],
+        )
+
     @classmethod
     def from_engine_args(cls, engine_args: EngineArgs) -> "LLMEngine":
         """Creates an LLM engine from the engine arguments."""
@@ -253,9 +342,55 @@ class LLMEngine:
             *engine_configs,
             # placement_group,
             log_stats=not engine_args.disable_log_stats,
+            metrics_port=engine_args.metrics_port,
+            background_detokenization=engine_args.background_detokenization,
         )
         return engine
 
+    def get_stats(self) -> Dict:
+        """A snapshot of the runtime metrics (see engine.metrics.EngineMetrics.get_stats)."""
+        if self.metrics is None:
+            raise RuntimeError("The engine stats are disabled by --disable-log-stats.")
+        return self.metrics.get_stats(self.scheduler)
+
+    def set_stream_callback(self, stream_callback: Optional[Callable[[Dict], None]]) -> None:
+        """Streams the outputs as soon as they are detokenized (--background-detokenization).
+
+        The callback runs on the detokenizer thread with {"id", "request_id", "text", "finished"} for every new
+        text of a sequence ("text" only holds the new text). Without a callback, get_stream_outputs returns them.
+        """
+        if self.detokenizer is None:
+            raise RuntimeError("Streaming requires --background-detokenization.")
+        self.detokenizer.stream_callback = stream_callback
+
+    def get_stream_outputs(self) -> List[Dict]:
+        """The stream outputs (see set_stream_callback) decoded since the last call."""
+        if self.detokenizer is None:
+            raise RuntimeError("Streaming requires --background-detokenization.")
+        return self.detokenizer.get_stream_outputs()
+
+    def get_prefix_cache_hashes(self) -> List[int]:
+        """Block hashes of the prompt prefixes in the prefix cache (sequence.get_prefix_block_hashes), e.g. for a
+        prefix-aware router in front of several engines (engine.router). Empty without --enable-prefix-caching."""
+        return self.scheduler.block_manager.get_cached_prefix_hashes()
+
+    def _refresh_retrieval_page_scores(self) -> None:
+        # The block manager picks the retrieval pages to evict from the selection counts of the last decode batch,
+        # read every retrieval_eviction_interval steps (a host sync). Those of the driver, for its retrieval heads,
+        # stand for all the ranks.
+        if self.cache_config.max_retrieval_blocks_per_seq == 0:
+            return
+        self.num_steps_since_page_scores += 1
+        if self.num_steps_since_page_scores < self.cache_config.retrieval_eviction_interval:
+            return
+        self.num_steps_since_page_scores = 0
+        page_scores = self._run_workers("get_retrieval_page_scores")[0]
+        self.scheduler.block_manager.update_retrieval_page_scores(page_scores)
+
+    def _record_step_metrics(self, seq_group_metadata_list: List) -> None:
+        if self.metrics is not None and seq_group_metadata_list:
+            self.metrics.record_step(seq_group_metadata_list)
+
     def encode_request(
         self,
         request_id: str,  # pylint: disable=unused-argument
@@ -372,6 +507,18 @@ class LLMEngine:
 
         # Defensive copy of SamplingParams, which are used by the sampler
         sampling_params = copy.deepcopy(sampling_params)
+        if sampling_params.static_sparsity is not None:
+            sp_attn_config = self.model_config.sp_attn_config
+            if sampling_params.static_sparsity == sp_attn_config.get_static_sparsity():
+                # The engine-wide head partition.
+                sampling_params.static_sparsity = None
+            elif sampling_params.static_sparsity not in sp_attn_config.get_static_sparsity_levels():
+                raise ValueError(
+                    f"static_sparsity={sampling_params.static_sparsity} is not one of the levels the engine was "
+                    f"started with: {[sp_attn_config.get_static_sparsity()] + sp_attn_config.get_static_sparsity_levels()}."
+                )
+        if sampling_params.n > 1:
+            self._verify_parallel_sampling(sampling_params)
 
         # Create the sequence group.
         seq_group = SequenceGroup(
@@ -385,6 +532,21 @@ class LLMEngine:
         else:
             return False
 
+    def _verify_parallel_sampling(self, sampling_params: SamplingParams) -> None:
+        # The samples are forked from the prompt sequence once its run has sampled their first tokens, and every
+        # step returns one token per running sequence.
+        if sampling_params.best_of != sampling_params.n:
+            raise ValueError(
+                f"best_of={sampling_params.best_of} > n={sampling_params.n} is not supported: the sampled tokens "
+                "carry no log probabilities to rank the samples."
+            )
+        if len(sampling_params.decoding_sim_token_ids) > 0:
+            raise ValueError("n > 1 is not supported with decoding simulation.")
+        if not self.ifb_mode or self.async_engine_loop or self.parallel_config.disaggregated_prefill:
+            raise ValueError("n > 1 requires the synchronous IFB engine loop without disaggregated prefill.")
+        if self.scheduler.mixed_batching:
+            raise ValueError("n > 1 is not supported with mixed batching (--step-token-budget).")
+
     def abort_request(self, request_id: Union[str, Iterable[str]]) -> None:
         """Aborts a request(s) with the given ID.
 
@@ -402,7 +564,13 @@ class LLMEngine:
             >>> # abort the request
             >>> engine.abort_request(request_id)
         """
-        self.scheduler.abort_seq_group(request_id)
+        request_ids = [request_id] if isinstance(request_id, str) else list(request_id)
+        if self.detokenizer is not None:
+            for seq_id, (seq_group, _) in list(self.detokenized_seqs.items()):
+                if seq_group.request_id in request_ids:
+                    del self.detokenized_seqs[seq_id]
+                    self.detokenizer.release(seq_id)
+        self.scheduler.abort_seq_group(request_ids)
 
     def get_model_config(self) -> ModelConfig:
         """Gets the model configuration."""
@@ -410,60 +578,221 @@ class LLMEngine:
 
     def get_num_unfinished_requests(self) -> int:
         """Gets the number of unfinished requests."""
-        return self.scheduler.get_num_unfinished_seq_groups()
+        # Background detokenization: a finished request is unfinished until its output is returned.
+        num_detokenizing = len(
+            {seq_group.request_id for seq_group, _ in self.detokenized_seqs.values() if seq_group.is_finished()}
+        )
+        return self.scheduler.get_num_unfinished_seq_groups() + num_detokenizing
 
     def has_unfinished_requests(self) -> bool:
         """Returns True if there are unfinished requests."""
-        return self.scheduler.has_unfinished_seqs()
+        return self.scheduler.has_unfinished_seqs() or len(self.detokenized_seqs) > 0
 
     def _process_sequence_group_outputs(
-        self, seq_group: SequenceGroup, outputs: SequenceGroupOutput
+        self, seq_group: SequenceGroup, outputs: List[int]
     ) -> None:
-        token_id = outputs
+        # One token per running sequence, in the order of the rows of the step.
         seqs = seq_group.get_seqs(status=SequenceStatus.RUNNING)
-        assert len(seqs) == 1
-        seqs[0].append_token_id(token_id, {token_id: 0})
-        self._check_stop(seqs[0], seq_group.sampling_params)
+        if len(outputs) > len(seqs):
+            # Parallel sampling: the prompt run sampled the first token of every sample. The children share all
+            # the pages of the prompt sequence, the last one is copied by the first step that writes to it.
+            assert len(seqs) == 1
+            parent_seq = seqs[0]
+            for _ in range(len(outputs) - 1):
+                child_seq = parent_seq.fork(next(self.seq_counter))
+                seq_group.add(child_seq)
+                self.scheduler.fork_seq(parent_seq, child_seq)
+                seqs.append(child_seq)
+        for seq, token_id in zip(seqs, outputs):
+            seq.append_token_id(token_id, {token_id: 0})
+            self._check_stop(seq, seq_group.sampling_params)
+            self._push_detokenization(seq_group, seq, token_id)
 
     def _process_model_outputs(
         self, output: SamplerOutput, scheduler_outputs: SchedulerOutputs
     ) -> List:
         # Update the scheduled sequence groups with the model outputs.
         scheduled_seq_groups = scheduler_outputs.scheduled_seq_groups
-        for seq_group, outputs in zip(scheduled_seq_groups, output):
+        row = 0
+        for seq_group in scheduled_seq_groups:
+            if scheduler_outputs.prompt_run and seq_group.sampling_params.n > 1:
+                # The prompt rows are sampled once per sample (ModelRunner._get_num_prompt_samples).
+                num_rows = seq_group.sampling_params.n
+            else:
+                num_rows = seq_group.num_seqs(status=SequenceStatus.RUNNING)
+            outputs = output[row : row + num_rows]
+            row += num_rows
+            if seq_group in scheduler_outputs.partial_prefill_seq_groups:
+                # Mixed batching: the prompt continues in the next step, the token sampled here is not its output.
+                continue
             self._process_sequence_group_outputs(seq_group, outputs)
 
-        # Create the outputs.
+        return self._create_request_outputs(scheduled_seq_groups)
+
+    def _create_finished_request_output(self, seq_group: SequenceGroup) -> Dict:
+        seqs = seq_group.get_seqs()
+        request_output = {
+            "id": seqs[0].seq_id,
+            "request_id": seq_group.request_id,
+            "text": seqs[0].output_text,
+            "finished": True,
+        }
+        if len(seqs) > 1:
+            request_output["samples"] = [seq.output_text for seq in seqs]
+        return request_output
+
+    def _create_request_outputs(self, scheduled_seq_groups: List[SequenceGroup]) -> List:
+        # One output per request, under the id of its prompt sequence; "samples" lists all the samples when n > 1.
         request_outputs: List = []
         num_finished = 0
         for seq_group in scheduled_seq_groups:
             seqs = seq_group.get_seqs()
-            assert len(seqs) == 1
+            for seq in seqs:
+                if seq.is_finished():
+                    # free kv cache (a sample that finished early releases its own pages only)
+                    self.scheduler.free_seq(seq)
             if seq_group.is_finished():
-                # free kv cache
-                self.scheduler.free_seq(seqs[0])
-                request_outputs.append(
-                    {
-                        "id": seqs[0].seq_id,
-                        "text": seqs[0].output_text,
-                        "finished": True,
-                    }
-                )
                 num_finished += 1
+                if self.detokenizer is not None:
+                    # Returned by _collect_detokenized_outputs once the final texts are in.
+                    continue
+                request_output = self._create_finished_request_output(seq_group)
             else:
-                request_outputs.append(
-                    {
-                        "id": seqs[0].seq_id,
-                        "tokens": seqs[0].get_token_ids(),
-                        "finished": False,
-                    }
-                )
+                request_output = {
+                    "id": seqs[0].seq_id,
+                    "request_id": seq_group.request_id,
+                    "tokens": seqs[0].get_token_ids(),
+                    "finished": False,
+                }
+                if len(seqs) > 1:
+                    request_output["samples"] = [seq.get_token_ids() for seq in seqs]
+            request_outputs.append(request_output)
 
         # Free the finished sequence groups.
         self.scheduler.free_finished_seq_groups()
 
         return request_outputs
 
+    def _push_detokenization(self, seq_group: SequenceGroup, seq: Sequence, token_id: int) -> None:
+        if self.detokenizer is None:
+            return
+        self.detokenized_seqs[seq.seq_id] = (seq_group, seq)
+        self.detokenizer.push(seq, seq_group.request_id, seq_group.sampling_params, [token_id], seq.is_finished())
+
+    def _stop_detokenized_seq(self, seq_group: SequenceGroup, seq: Sequence) -> None:
+        # The detokenizer found a stop string, a few steps after the token that completed it.
+        if seq.is_finished():
+            return
+        seq.status = SequenceStatus.FINISHED_STOPPED
+        self.scheduler.free_seq(seq)
+        if seq_group.is_finished() and seq_group not in self.scheduler.running:
+            # Preempted: leave the waiting / swapped queue.
+            self.scheduler.abort_seq_group(seq_group.request_id)
+
+    def _collect_detokenized_outputs(self) -> List:
+        """Background detokenization: stops the sequences that generated a stop string and returns the outputs of
+        the finished requests whose final texts are all in. Called before a step is scheduled."""
+        if not self.scheduler.has_unfinished_seqs() and self.detokenized_seqs:
+            # Only final texts left to wait for.
+            self.detokenizer.wait(timeout=0.1)
+        seq_groups: Dict[str, SequenceGroup] = {}
+        for seq_id in self.detokenizer.get_stopped_seq_ids():
+            if seq_id in self.detokenized_seqs:
+                seq_group, seq = self.detokenized_seqs[seq_id]
+                self._stop_detokenized_seq(seq_group, seq)
+                seq_groups[seq_group.request_id] = seq_group
+        for seq_id, text in self.detokenizer.get_final_texts():
+            if seq_id not in self.detokenized_seqs:
+                # Aborted.
+                continue
+            seq_group, seq = self.detokenized_seqs.pop(seq_id)
+            seq.output_text = text
+            # The stop string of seq may be in get_stopped_seq_ids of the next call only.
+            self._stop_detokenized_seq(seq_group, seq)
+            seq_groups[seq_group.request_id] = seq_group
+        self.scheduler.free_finished_seq_groups()
+        return [
+            self._create_finished_request_output(seq_group)
+            for seq_group in seq_groups.values()
+            if seq_group.is_finished()
+            and all(seq.seq_id not in self.detokenized_seqs for seq in seq_group.get_seqs())
+        ]
+
+    def _process_async_model_outputs(
+        self, output: SamplerOutput, scheduled_seq_groups: List[SequenceGroup]
+    ) -> List:
+        # The tokens replace the placeholders appended when the step was launched. The next step is already
+        # scheduled: a sequence may have been preempted meanwhile, or finished by the step before.
+        unfinished_seq_groups = []
+        for seq_group, token_id in zip(scheduled_seq_groups, output):
+            seq = seq_group.get_seqs()[0]
+            if seq.is_finished():
+                continue
+            seq.replace_last_token_id(token_id, {token_id: 0})
+            self._check_stop(seq, seq_group.sampling_params)
+            self._push_detokenization(seq_group, seq, token_id)
+            if seq.is_finished() and seq_group not in self.scheduler.running:
+                # Preempted by the schedule of the next step: leave the waiting / swapped queue.
+                self.scheduler.free_seq(seq)
+                self.scheduler.abort_seq_group(seq_group.request_id)
+            unfinished_seq_groups.append(seq_group)
+        return self._create_request_outputs(unfinished_seq_groups)
+
+    def _launch_async_step(self) -> Optional[List[SequenceGroup]]:
+        (
+            self.seq_group_metadata_list,
+            self.scheduler_outputs,
+        ) = self.scheduler.schedule()
+        if self.scheduler_outputs.is_empty():
+            return None
+        self._record_step_metrics(self.seq_group_metadata_list)
+        all_outputs = self._run_workers(
+            "execute_model",
+            seq_group_metadata_list=self.seq_group_metadata_list,
+            retrieval_blocks_to_swap_in=self.scheduler_outputs.retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=self.scheduler_outputs.streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=self.scheduler_outputs.retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=self.scheduler_outputs.streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=self.scheduler_outputs.retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=self.scheduler_outputs.streaming_blocks_to_copy,
+            retrieval_blocks_to_offload=self.scheduler_outputs.retrieval_blocks_to_offload,
+            ifb_mode=self.ifb_mode,
+        )
+        tokens = all_outputs[0]
+        host_tokens = torch.empty(tokens.shape, dtype=tokens.dtype, pin_memory=True)
+        host_tokens.copy_(tokens, non_blocking=True)
+        copy_event = torch.cuda.Event()
+        copy_event.record()
+        scheduled_seq_groups = list(self.scheduler_outputs.scheduled_seq_groups)
+        return scheduled_seq_groups, host_tokens, copy_event
+
+    def _step_async(self) -> List:
+        """Async engine loop: launches step N + 1, then waits for the tokens of step N and processes them.
+
+        The scheduler and the model runner only need the number of tokens of every sequence, so the token of step
+        N is a placeholder while N + 1 is prepared, and the model runner reads it from the device. Stop conditions
+        are detected one step late, the token sampled meanwhile for a finished sequence is dropped.
+        """
+        while True:
+            launched_step = self._launch_async_step()
+            request_outputs: List = []
+            processed = self.inflight_step is not None
+            if processed:
+                scheduled_seq_groups, host_tokens, copy_event = self.inflight_step
+                copy_event.synchronize()
+                request_outputs = self._process_async_model_outputs(
+                    host_tokens.numpy().tolist(), scheduled_seq_groups
+                )
+            self.inflight_step = launched_step
+            if launched_step is not None:
+                for seq_group in launched_step[0]:
+                    seq = seq_group.get_seqs()[0]
+                    if not seq.is_finished():
+                        seq.append_placeholder_token_id()
+            # The first call fills the pipeline before it has results to return.
+            if processed or launched_step is None:
+                return request_outputs
+
     def _process_model_outputs_benchmark(
         self, output: SamplerOutput, scheduler_outputs: SchedulerOutputs
     ) -> List:
@@ -481,6 +810,35 @@ class LLMEngine:
     def update_init_num_blocks(self, init_num_blocks: int) -> None:
         self.init_num_blocks = init_num_blocks
 
+    def _step_disaggregated(self) -> List:
+        # The prefill instance runs the new prompts while the decoding instance runs the other sequences; the
+        # prompts decode from the next step on, once their pages have been received.
+        (
+            prefill_seq_group_metadata_list,
+            prefill_outputs,
+            self.seq_group_metadata_list,
+            self.scheduler_outputs,
+        ) = self.scheduler.schedule_disaggregated()
+        if prefill_outputs.is_empty() and self.scheduler_outputs.is_empty():
+            return self._process_model_outputs([], self.scheduler_outputs)
+        self._record_step_metrics(prefill_seq_group_metadata_list + self.seq_group_metadata_list)
+        tokens, prompt_tokens = self._run_workers(
+            "execute_disaggregated_step",
+            prefill_seq_group_metadata_list=prefill_seq_group_metadata_list,
+            seq_group_metadata_list=self.seq_group_metadata_list,
+            retrieval_blocks_to_swap_in=self.scheduler_outputs.retrieval_blocks_to_swap_in,
+            streaming_blocks_to_swap_in=self.scheduler_outputs.streaming_blocks_to_swap_in,
+            retrieval_blocks_to_swap_out=self.scheduler_outputs.retrieval_blocks_to_swap_out,
+            streaming_blocks_to_swap_out=self.scheduler_outputs.streaming_blocks_to_swap_out,
+            retrieval_blocks_to_copy=self.scheduler_outputs.retrieval_blocks_to_copy,
+            streaming_blocks_to_copy=self.scheduler_outputs.streaming_blocks_to_copy,
+        )[0]
+        output = tokens.cpu().numpy().tolist() if tokens is not None else []
+        prompt_output = prompt_tokens.cpu().numpy().tolist() if prompt_tokens is not None else []
+        return self._process_model_outputs(output, self.scheduler_outputs) + self._process_model_outputs(
+            prompt_output, prefill_outputs
+        )
+
     def step(self) -> List:
         """Performs one decoding iteration and returns newly generated results.
 
@@ -538,17 +896,35 @@ class LLMEngine:
         # (i.e. benchmarking mode)
         # 2. no_ifb basically does not check stop and return output tokens in the end of model
         # execution.
+        step_start = time.perf_counter()
+        detokenized_outputs = []
+        if self.detokenizer is not None:
+            detokenized_outputs = self._collect_detokenized_outputs()
         if self.ifb_mode:
+            self._refresh_retrieval_page_scores()
+        if self.ifb_mode and self.async_engine_loop:
+            out = self._step_async()
+        elif self.ifb_mode and self.parallel_config.disaggregated_prefill:
+            out = self._step_disaggregated()
+        elif self.ifb_mode:
             (
                 self.seq_group_metadata_list,
                 self.scheduler_outputs,
             ) = self.scheduler.schedule()
             # return seq_group_metadata_list, scheduler_outputs
             if not self.scheduler_outputs.is_empty():
+                self._record_step_metrics(self.seq_group_metadata_list)
                 # Execute the model.
                 all_outputs = self._run_workers(
                     "execute_model",
                     seq_group_metadata_list=self.seq_group_metadata_list,
+                    retrieval_blocks_to_swap_in=self.scheduler_outputs.retrieval_blocks_to_swap_in,
+                    streaming_blocks_to_swap_in=self.scheduler_outputs.streaming_blocks_to_swap_in,
+                    retrieval_blocks_to_swap_out=self.scheduler_outputs.retrieval_blocks_to_swap_out,
+                    streaming_blocks_to_swap_out=self.scheduler_outputs.streaming_blocks_to_swap_out,
+                    retrieval_blocks_to_copy=self.scheduler_outputs.retrieval_blocks_to_copy,
+                    streaming_blocks_to_copy=self.scheduler_outputs.streaming_blocks_to_copy,
+                    retrieval_blocks_to_offload=self.scheduler_outputs.retrieval_blocks_to_offload,
                     ifb_mode=self.ifb_mode,
                 )
                 output = all_outputs[0].cpu().numpy().tolist()
@@ -589,6 +965,10 @@ class LLMEngine:
                 )
             else:
                 out = self._process_model_outputs(output, self.scheduler_outputs)
+        if self.metrics is not None:
+            self.metrics.record_step_time(time.perf_counter() - step_start)
+        if detokenized_outputs:
+            out = detokenized_outputs + out
         return out
 
     def _check_stop(self, seq: Sequence, sampling_params: SamplingParams) -> None:
@@ -627,24 +1007,15 @@ class LLMEngine:
             return
 
     def _finalize_sequence(self, seq: Sequence) -> None:
-        if not self.profiling_mode:
-            if self.omit_prompt:
-                token_ids = seq.data.get_token_ids()
-                def remove_sublist(lst, sublist):
-                    n = len(sublist)
-                    i = 0
-                    while i <= len(lst) - n:
-                        if lst[i:i+n] == sublist:
-                            del lst[i:i+n]
-                        else:
-                            i += 1
-                    return lst
-                token_ids = remove_sublist(token_ids, seq.full_prompt_token_ids)
-                seq.output_text = self.get_tokenizer_for_seq(seq).decode(token_ids)
-            else:
-                seq.output_text = self.get_tokenizer_for_seq(seq).decode(
-                    [token for token in seq.data.get_token_ids()]
-                )
+        # With background detokenization, the detokenizer thread decodes the final text.
+        if not self.profiling_mode and self.detokenizer is None:
+            seq.output_text = decode_sequence_text(
+                self.get_tokenizer_for_seq(seq),
+                seq.data.prompt_token_ids,
+                seq.data.output_token_ids,
+                seq.full_prompt_token_ids,
+                self.omit_prompt,
+            )
 
     def _run_workers(
         self,
@@ -654,6 +1025,12 @@ class LLMEngine:
         **kwargs,
     ) -> Any:
         """Runs the given method on all workers."""
+        if self.worker_processes:
+            # Tensor parallel workers only take keyword arguments.
+            assert not args
+            from omniserve.modeling.parallel_utils.communication_op import broadcast_object
+
+            broadcast_object((method, kwargs), src=0)
         all_outputs = []
         for worker in self.workers:
             executor = getattr(worker, method)
@@ -0,0 +1,250 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Runtime metrics of the LLMEngine: KV pools, preemptions, prefix cache hits, sparse decoding and batches.
+
+Counters and histograms are updated by the engine loop (record_step, record_step_time) and the scheduler
+(Scheduler.num_preemptions, num_allocated_prompt_tokens, num_prefix_cached_tokens); the gauges are read from the
+block manager when a snapshot is taken. LLMEngine.get_stats returns a snapshot as a dict, and --metrics-port serves it in the Prometheus text
+format at /metrics.
+"""
+import bisect
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from typing import Callable, Dict, List, Sequence
+
+from omniserve.config import ModelConfig
+from omniserve.sequence import SequenceGroupMetadata
+
+_PREFIX = "omniserve"
+
+
+class Histogram:
+    """Cumulative histogram with fixed bucket upper bounds (Prometheus semantics, +Inf implied)."""
+
+    def __init__(self, buckets: Sequence[float]) -> None:
+        self.buckets = list(buckets)
+        self.counts = [0] * (len(self.buckets) + 1)
+        self.sum = 0.0
+        self.count = 0
+
+    def observe(self, value: float, num: int = 1) -> None:
+        self.counts[bisect.bisect_left(self.buckets, value)] += num
+        self.sum += value * num
+        self.count += num
+
+    def snapshot(self) -> Dict:
+        cumulative, buckets = 0, {}
+        for bound, count in zip(self.buckets + [float("inf")], self.counts):
+            cumulative += count
+            buckets[bound] = cumulative
+        return {"buckets": buckets, "sum": self.sum, "count": self.count}
+
+
+def _exponential_buckets(start: float, factor: float, num: int) -> List[float]:
+    return [start * factor**i for i in range(num)]
+
+
+class EngineMetrics:
+    def __init__(self, model_config: ModelConfig, block_size: int) -> None:
+        self.block_size = block_size
+        sp_attn_config = model_config.sp_attn_config
+        self.sparse_decode_enabled = sp_attn_config.sparse_decode_enabled()
+        self.default_sparse_token_budget = (
+            sp_attn_config.get_dec_dynamic_sparse_token_budget() if self.sparse_decode_enabled else 0
+        )
+        num_layers = model_config.hf_config.num_hidden_layers
+        num_retrieval = sum(sp_attn_config.retrieval_head_num(layer_idx) for layer_idx in range(num_layers))
+        num_streaming = sum(sp_attn_config.streaming_head_num(layer_idx) for layer_idx in range(num_layers))
+        # Share of the KV heads that only keep their sink and local pages (static sparsity).
+        self.streaming_head_fraction = num_streaming / max(num_retrieval + num_streaming, 1)
+
+        self.num_steps = 0
+        self.num_prefill_tokens = 0
+        self.num_decode_tokens = 0
+        # Retrieval pages of the decoding rows, and the pages the dynamic sparse selector reads of them.
+        self.num_retrieval_pages = 0
+        self.num_selected_retrieval_pages = 0
+        self.step_prefill_tokens = Histogram([0] + _exponential_buckets(64, 2, 16))
+        self.step_decode_rows = Histogram([0] + _exponential_buckets(1, 2, 10))
+        self.step_time = Histogram(_exponential_buckets(0.001, 2, 16))
+        self.selected_page_fraction = Histogram([0.05 * i for i in range(1, 21)])
+        self.lock = threading.Lock()
+
+    def _get_selected_pages(self, seq_group_metadata: SequenceGroupMetadata, context_len: int) -> int:
+        # Same rule as ModelRunner._get_dynamic_sparse_page_nums / single_query_page_selector_topk.
+        num_pages = max((context_len - 1 + self.block_size - 1) // self.block_size, 1)
+        if not self.sparse_decode_enabled:
+            return num_pages
+        budget = seq_group_metadata.sampling_params.get_sparse_token_budget(
+            context_len, self.default_sparse_token_budget
+        )
+        return min(max(3, budget // self.block_size), num_pages)
+
+    def record_step(self, seq_group_metadata_list: List[SequenceGroupMetadata]) -> None:
+        """Records the batch of a step: prefill tokens (prompts and prompt chunks) and decoding rows."""
+        num_prefill_tokens = num_decode_rows = 0
+        with self.lock:
+            for seq_group_metadata in seq_group_metadata_list:
+                for seq_data in seq_group_metadata.seq_data.values():
+                    prompt_len = seq_data.get_prompt_len()
+                    if seq_group_metadata.is_prompt:
+                        if seq_group_metadata.token_chunk_size is None:
+                            num_prefill_tokens += seq_data.get_len() - seq_data.num_cached_tokens
+                            continue
+                        if seq_group_metadata.num_computed_tokens < prompt_len:
+                            num_prefill_tokens += seq_group_metadata.token_chunk_size
+                            continue
+                    # A decoding row (a one-token chunk of a mixed step).
+                    num_decode_rows += 1
+                    context_len = seq_data.get_len()
+                    num_pages = max((context_len - 1 + self.block_size - 1) // self.block_size, 1)
+                    num_selected_pages = self._get_selected_pages(seq_group_metadata, context_len)
+                    self.num_retrieval_pages += num_pages
+                    self.num_selected_retrieval_pages += num_selected_pages
+                    self.selected_page_fraction.observe(num_selected_pages / num_pages)
+            self.num_steps += 1
+            self.num_prefill_tokens += num_prefill_tokens
+            self.num_decode_tokens += num_decode_rows
+            self.step_prefill_tokens.observe(num_prefill_tokens)
+            self.step_decode_rows.observe(num_decode_rows)
+
+    def record_step_time(self, step_time: float) -> None:
+        with self.lock:
+            self.step_time.observe(step_time)
+
+    def get_stats(self, scheduler) -> Dict:
+        block_manager = scheduler.block_manager
+        kv_pools = {}
+        for cache_mode, blockspace_manager, num_gpu_blocks, num_cpu_blocks in (
+            (
+                "retrieval", block_manager.retrieval_blockspace_manager,
+                block_manager.num_total_retrieval_gpu_blocks, block_manager.num_total_retrieval_cpu_blocks,
+            ),
+            (
+                "streaming", block_manager.streaming_blockspace_manager,
+                block_manager.num_total_streaming_gpu_blocks, block_manager.num_total_streaming_cpu_blocks,
+            ),
+        ):
+            if blockspace_manager is None:
+                continue
+            kv_pools[cache_mode] = {
+                "gpu_blocks_total": num_gpu_blocks,
+                "gpu_blocks_free": blockspace_manager.get_num_free_gpu_blocks(),
+                "cpu_blocks_total": num_cpu_blocks,
+                "cpu_blocks_free": blockspace_manager.get_num_free_cpu_blocks(),
+            }
+        with self.lock:
+            return {
+                "kv_pools": kv_pools,
+                "num_waiting": len(scheduler.waiting),
+                "num_running": len(scheduler.running),
+                "num_swapped": len(scheduler.swapped),
+                "num_preemptions": dict(scheduler.num_preemptions),
+                "num_prompt_tokens": scheduler.num_allocated_prompt_tokens,
+                "num_prefix_cached_tokens": scheduler.num_prefix_cached_tokens,
+                "prefix_cache_hit_rate": (
+                    scheduler.num_prefix_cached_tokens / scheduler.num_allocated_prompt_tokens
+                    if scheduler.num_allocated_prompt_tokens > 0 else 0.0
+                ),
+                "num_steps": self.num_steps,
+                "num_prefill_tokens": self.num_prefill_tokens,
+                "num_decode_tokens": self.num_decode_tokens,
+                "num_retrieval_pages": self.num_retrieval_pages,
+                "num_selected_retrieval_pages": self.num_selected_retrieval_pages,
+                "streaming_head_fraction": self.streaming_head_fraction,
+                "step_prefill_tokens": self.step_prefill_tokens.snapshot(),
+                "step_decode_rows": self.step_decode_rows.snapshot(),
+                "step_time_seconds": self.step_time.snapshot(),
+                "selected_page_fraction": self.selected_page_fraction.snapshot(),
+            }
+
+
+def render_prometheus(stats: Dict) -> str:
+    """The Prometheus text exposition of an EngineMetrics.get_stats snapshot."""
+    lines = []
+
+    def metric(name: str, metric_type: str, help_text: str, samples: List) -> None:
+        lines.append(f"# HELP {_PREFIX}_{name} {help_text}")
+        lines.append(f"# TYPE {_PREFIX}_{name} {metric_type}")
+        for suffix, labels, value in samples:
+            label_str = "{" + ",".join(f'{k}="{v}"' for k, v in labels.items()) + "}" if labels else ""
+            lines.append(f"{_PREFIX}_{name}{suffix}{label_str} {value}")
+
+    def histogram(name: str, help_text: str, snapshot: Dict) -> None:
+        samples = [
+            ("_bucket", {"le": "+Inf" if bound == float("inf") else f"{bound:g}"}, count)
+            for bound, count in snapshot["buckets"].items()
+        ]
+        samples += [("_sum", {}, snapshot["sum"]), ("_count", {}, snapshot["count"])]
+        metric(name, "histogram", help_text, samples)
+
+    for key, help_text in (
+        ("gpu_blocks_total", "GPU KV blocks of the pool."),
+        ("gpu_blocks_free", "Free GPU KV blocks of the pool."),
+        ("cpu_blocks_total", "CPU swap KV blocks of the pool."),
+        ("cpu_blocks_free", "Free CPU swap KV blocks of the pool."),
+    ):
+        metric(f"kv_{key}", "gauge", help_text, [
+            ("", {"pool": cache_mode}, pool[key]) for cache_mode, pool in stats["kv_pools"].items()
+        ])
+    metric("num_requests", "gauge", "Sequence groups by scheduler queue.", [
+        ("", {"state": state}, stats[f"num_{state}"]) for state in ("waiting", "running", "swapped")
+    ])
+    metric("preemptions_total", "counter", "Preempted sequence groups by preemption mode.", [
+        ("", {"mode": mode}, count) for mode, count in stats["num_preemptions"].items()
+    ])
+    for key, help_text in (
+        ("num_prompt_tokens", "Prompt tokens allocated in the KV cache."),
+        ("num_prefix_cached_tokens", "Prompt tokens found in the prefix cache."),
+        ("num_steps", "Engine steps."),
+        ("num_prefill_tokens", "Prefill tokens run."),
+        ("num_decode_tokens", "Decoding rows run."),
+        ("num_retrieval_pages", "Retrieval KV pages of the decoding rows."),
+        ("num_selected_retrieval_pages", "Retrieval KV pages read by the dynamic sparse decoding."),
+    ):
+        metric(key.replace("num_", "", 1) + "_total", "counter", help_text, [("", {}, stats[key])])
+    metric("prefix_cache_hit_rate", "gauge", "Share of the prompt tokens found in the prefix cache.", [
+        ("", {}, stats["prefix_cache_hit_rate"])
+    ])
+    metric("streaming_head_fraction", "gauge", "Share of the KV heads that are streaming heads.", [
+        ("", {}, stats["streaming_head_fraction"])
+    ])
+    histogram("step_prefill_tokens", "Prefill tokens per step.", stats["step_prefill_tokens"])
+    histogram("step_decode_rows", "Decoding rows per step.", stats["step_decode_rows"])
+    histogram("step_time_seconds", "Wall time of a step.", stats["step_time_seconds"])
+    histogram(
+        "selected_page_fraction", "Retrieval pages read / total pages of a decoding row.", stats["selected_page_fraction"]
+    )
+    return "\n".join(lines) + "\n"
+
+
+def start_metrics_server(port: int, get_stats: Callable[[], Dict]) -> ThreadingHTTPServer:
+    """Serves render_prometheus(get_stats()) at http://0.0.0.0:port/metrics from a daemon thread."""
+
+    class MetricsHandler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            if self.path.split("?")[0] != "/metrics":
+                self.send_error(404)
+                return
+            body = render_prometheus(get_stats()).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            pass
+
+    server = ThreadingHTTPServer(("0.0.0.0", port), MetricsHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
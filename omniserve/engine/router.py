@@ -0,0 +1,299 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Prefix-cache-aware routing of requests over several LLMEngine replicas of a node.
+
+Every replica runs in its own process on its own GPUs (tensor_parallel_size of them), spawned like the tensor
+parallel workers of LLMEngine._init_workers, and is driven over a pipe. The router keeps, per replica, the block
+hashes of its prefix cache (LLMEngine.get_prefix_cache_hashes, refreshed every prefix_refresh_interval steps) plus
+those of the prompts it sent there since, and its load from the metrics API (LLMEngine.get_stats). A request goes to
+the replica holding the longest prefix of its prompt among the replicas whose load is within max_load_imbalance
+requests of the least loaded one and whose retrieval KV pool is below max_kv_occupancy.
+"""
+import argparse
+import atexit
+import copy
+import os
+from collections import OrderedDict
+from typing import Any, Dict, List, Optional
+
+import torch
+
+from omniserve.engine.arg_utils import EngineArgs
+from omniserve.logger import init_logger
+from omniserve.sampling_params import SamplingParams
+from omniserve.sequence import get_prefix_block_hashes
+from omniserve.utils.tokenizer import get_tokenizer
+
+logger = init_logger(__name__)
+
+
+def _run_replica_process(gpu_ids: str, engine_args: EngineArgs, conn) -> None:
+    # The replica only sees its own GPUs, before CUDA is initialized (see _run_worker_process).
+    os.environ["CUDA_VISIBLE_DEVICES"] = gpu_ids
+    torch.cuda.set_device(0)
+    from omniserve.engine.llm_engine import LLMEngine
+
+    engine = LLMEngine.from_engine_args(engine_args)
+    conn.send((True, None))
+    while True:
+        method, args = conn.recv()
+        if method is None:
+            break
+        try:
+            conn.send((True, getattr(engine, method)(*args)))
+        except Exception as e:  # pylint: disable=broad-except
+            conn.send((False, e))
+
+
+class EngineReplica:
+    """An LLMEngine in a child process. Calls are sent with send() and their results read with recv(), so that
+    all the replicas step at the same time."""
+
+    def __init__(self, replica_idx: int, gpu_ids: List[str], engine_args: EngineArgs) -> None:
+        self.replica_idx = replica_idx
+        mp_context = torch.multiprocessing.get_context("spawn")
+        self.conn, child_conn = mp_context.Pipe()
+        self.process = mp_context.Process(
+            target=_run_replica_process,
+            args=(",".join(gpu_ids), engine_args, child_conn),
+            daemon=True,
+        )
+        self.process.start()
+        # Block hashes of the prefix cache, as last exported, and of the prompts routed here since (LRU).
+        self.prefix_hashes: frozenset = frozenset()
+        self.routed_hashes: "OrderedDict[int, None]" = OrderedDict()
+        self.stats: Optional[Dict] = None
+        # Requests sent since the stats were taken, and the requests in the replica.
+        self.num_routed_since_stats = 0
+        self.request_ids: set = set()
+
+    def send(self, method: str, *args: Any) -> None:
+        self.conn.send((method, args))
+
+    def recv(self) -> Any:
+        ok, result = self.conn.recv()
+        if not ok:
+            raise result
+        return result
+
+    def call(self, method: str, *args: Any) -> Any:
+        self.send(method, *args)
+        return self.recv()
+
+    def stop(self) -> None:
+        if self.process.is_alive():
+            self.conn.send((None, None))
+            self.process.join()
+
+    def get_load(self) -> int:
+        if self.stats is None:
+            return self.num_routed_since_stats
+        return self.stats["num_waiting"] + self.stats["num_running"] + self.num_routed_since_stats
+
+    def get_kv_occupancy(self) -> float:
+        if self.stats is None:
+            return 0.0
+        pool = self.stats["kv_pools"]["retrieval"]
+        return 1.0 - pool["gpu_blocks_free"] / max(pool["gpu_blocks_total"], 1)
+
+    def get_num_cached_blocks(self, block_hashes: List[int]) -> int:
+        # Leading blocks only: a block is reused with all the blocks before it.
+        num_blocks = 0
+        for block_hash in block_hashes:
+            if block_hash not in self.prefix_hashes and block_hash not in self.routed_hashes:
+                break
+            num_blocks += 1
+        return num_blocks
+
+    def record_routed(self, block_hashes: List[int], max_routed_hashes: int) -> None:
+        for block_hash in block_hashes:
+            self.routed_hashes[block_hash] = None
+            self.routed_hashes.move_to_end(block_hash)
+        while len(self.routed_hashes) > max_routed_hashes:
+            self.routed_hashes.popitem(last=False)
+        self.num_routed_since_stats += 1
+
+
+class PrefixAwareRouter:
+    """Routes the requests over num_replicas engines built from engine_args, see the module docstring.
+
+    Offers the LLMEngine request API (add_request, abort_request, step, has_unfinished_requests); the outputs of
+    step() carry the "request_id" of the request and the index of its "replica".
+    """
+
+    def __init__(
+        self,
+        engine_args: EngineArgs,
+        num_replicas: int,
+        max_load_imbalance: int = 4,
+        max_kv_occupancy: float = 0.95,
+        prefix_refresh_interval: int = 16,
+    ) -> None:
+        self.block_size = engine_args.block_size
+        self.max_load_imbalance = max_load_imbalance
+        self.max_kv_occupancy = max_kv_occupancy
+        self.prefix_refresh_interval = prefix_refresh_interval
+        self.tokenizer = get_tokenizer(
+            engine_args.tokenizer,
+            tokenizer_mode=engine_args.tokenizer_mode,
+            trust_remote_code=engine_args.trust_remote_code,
+            tokenizer_revision=engine_args.tokenizer_revision,
+        )
+        if not engine_args.enable_prefix_caching:
+            logger.warning("The replicas run without --enable-prefix-caching: requests are routed by load only.")
+        # The replicas report their load through the metrics API.
+        engine_args = copy.deepcopy(engine_args)
+        engine_args.disable_log_stats = False
+        engine_args.metrics_port = 0
+
+        gpus_per_replica = engine_args.tensor_parallel_size
+        visible_devices = os.environ.get("CUDA_VISIBLE_DEVICES")
+        gpu_ids = visible_devices.split(",") if visible_devices else [str(i) for i in range(torch.cuda.device_count())]
+        assert num_replicas * gpus_per_replica <= len(gpu_ids), (
+            f"{num_replicas} replicas of {gpus_per_replica} GPUs need more than the {len(gpu_ids)} GPUs of the node."
+        )
+        self.replicas = [
+            EngineReplica(
+                replica_idx,
+                gpu_ids[replica_idx * gpus_per_replica : (replica_idx + 1) * gpus_per_replica],
+                engine_args,
+            )
+            for replica_idx in range(num_replicas)
+        ]
+        atexit.register(self.stop)
+        # The engines load their models in parallel.
+        for replica in self.replicas:
+            replica.recv()
+        self.request_replicas: Dict[str, int] = {}
+        self.num_steps = 0
+        self._refresh_prefix_hashes()
+
+    @staticmethod
+    def add_cli_args(parser: argparse.ArgumentParser) -> argparse.ArgumentParser:
+        parser.add_argument(
+            "--num-replicas",
+            type=int,
+            default=1,
+            help="Engine replicas of the node, each on its own --tensor-parallel-size GPUs.",
+        )
+        parser.add_argument(
+            "--router-max-load-imbalance",
+            type=int,
+            default=4,
+            help="A request only goes to a replica with at most this many more requests than the least loaded one, "
+            "even if that replica caches a longer prefix of its prompt.",
+        )
+        parser.add_argument(
+            "--router-max-kv-occupancy",
+            type=float,
+            default=0.95,
+            help="Replicas whose retrieval KV pool is fuller than this only get requests when all of them are.",
+        )
+        parser.add_argument(
+            "--router-prefix-refresh-interval",
+            type=int,
+            default=16,
+            help="Router steps between two exports of the prefix caches of the replicas.",
+        )
+        return parser
+
+    @classmethod
+    def from_cli_args(cls, args: argparse.Namespace) -> "PrefixAwareRouter":
+        return cls(
+            EngineArgs.from_cli_args(args),
+            args.num_replicas,
+            max_load_imbalance=args.router_max_load_imbalance,
+            max_kv_occupancy=args.router_max_kv_occupancy,
+            prefix_refresh_interval=args.router_prefix_refresh_interval,
+        )
+
+    def stop(self) -> None:
+        for replica in self.replicas:
+            replica.stop()
+
+    def _refresh_prefix_hashes(self) -> None:
+        for replica in self.replicas:
+            replica.send("get_prefix_cache_hashes")
+        for replica in self.replicas:
+            replica.prefix_hashes = frozenset(replica.recv())
+
+    def route(self, prompt_token_ids: List[int]) -> int:
+        """The replica to run a prompt on."""
+        # The last prompt token is always computed, as in BlockSpaceManager._get_num_cached_blocks.
+        block_hashes = get_prefix_block_hashes(prompt_token_ids[:-1], self.block_size)
+        loads = [replica.get_load() for replica in self.replicas]
+        candidates = [
+            replica for replica, load in zip(self.replicas, loads)
+            if load <= min(loads) + self.max_load_imbalance and replica.get_kv_occupancy() < self.max_kv_occupancy
+        ]
+        if not candidates:
+            candidates = self.replicas
+        best = max(
+            candidates,
+            key=lambda replica: (replica.get_num_cached_blocks(block_hashes), -loads[replica.replica_idx]),
+        )
+        return best.replica_idx
+
+    def add_request(
+        self,
+        request_id: str,
+        prompt: Optional[str],
+        sampling_params: SamplingParams,
+        prompt_token_ids: Optional[List[int]] = None,
+    ) -> Optional[int]:
+        """Routes and adds a request; returns its replica, None if the replica rejected it (too long)."""
+        if prompt_token_ids is None:
+            assert prompt is not None
+            prompt_token_ids = self.tokenizer.encode(prompt)
+        replica = self.replicas[self.route(prompt_token_ids)]
+        if not replica.call("add_request", request_id, prompt, sampling_params, prompt_token_ids):
+            return None
+        stats = replica.stats
+        max_routed_hashes = stats["kv_pools"]["retrieval"]["gpu_blocks_total"] if stats is not None else 1 << 16
+        replica.record_routed(get_prefix_block_hashes(prompt_token_ids[:-1], self.block_size), max_routed_hashes)
+        replica.request_ids.add(request_id)
+        self.request_replicas[request_id] = replica.replica_idx
+        return replica.replica_idx
+
+    def abort_request(self, request_id: str) -> None:
+        replica_idx = self.request_replicas.pop(request_id, None)
+        if replica_idx is None:
+            return
+        replica = self.replicas[replica_idx]
+        replica.request_ids.discard(request_id)
+        replica.call("abort_request", request_id)
+
+    def has_unfinished_requests(self) -> bool:
+        return len(self.request_replicas) > 0
+
+    def step(self) -> List[Dict]:
+        """Steps all the replicas with requests at the same time and returns their outputs."""
+        active = [replica for replica in self.replicas if replica.request_ids]
+        for replica in active:
+            replica.send("step")
+        request_outputs = []
+        for replica in active:
+            for request_output in replica.recv():
+                request_output["replica"] = replica.replica_idx
+                if request_output["finished"]:
+                    replica.request_ids.discard(request_output["request_id"])
+                    self.request_replicas.pop(request_output["request_id"], None)
+                request_outputs.append(request_output)
+        for replica in self.replicas:
+            replica.send("get_stats")
+        for replica in self.replicas:
+            replica.stats = replica.recv()
+            replica.num_routed_since_stats = 0
+        self.num_steps += 1
+        if self.num_steps % self.prefix_refresh_interval == 0:
+            self._refresh_prefix_hashes()
+        return request_outputs
@@ -2,6 +2,9 @@ import torch
 from einops import repeat
 from typing import Optional, Union
 from omniserve.attn_config import SpAttnConfig
+from omniserve.modeling.layers.ctx_attn.paged_ctx_attn import PagedContextAttentionWrapper
+from omniserve.modeling.layers.ctx_attn.ring_ctx_attn import RingContextAttentionWrapper
+from omniserve.modeling.parallel_utils.parallel_state import get_context_parallel_world_size
 from omniserve.modeling.models.llama_w4a8_unpad import LlamaForCausalLM as LlamaForCausalLMW4A8
 from omniserve.modeling.models.llama_w8a8_unpad import LlamaForCausalLM as LlamaForCausalLMW8A8
 from omniserve.modeling.models.llama_w16a16_unpad import LlamaForCausalLM as LlamaForCausalLMW16A16
@@ -25,8 +28,9 @@ def init_ctx_sparse_attn(
             streaming_info = None
         else:
             # print("[enable context sparse attn]")
-            num_heads = model.total_num_heads
-            num_kv_heads = model.total_num_kv_heads
+            # Heads of this tensor parallel rank (full_attention_heads is partitioned by SpAttnConfig).
+            num_heads = module.num_heads
+            num_kv_heads = module.num_kv_heads
             kv_repeat = num_heads // num_kv_heads
             layer_full_attention_heads = repeat(layer_full_attention_heads, 'h -> (h r)', r=kv_repeat)
 
@@ -49,6 +53,44 @@ def init_ctx_sparse_attn(
         module.register_buffer("head_mask_type", head_mask_type)
         module.register_buffer("streaming_info", streaming_info)
 
+        # Sparser static sparsity levels (SamplingParams.static_sparsity): the prefill attention of their prompts
+        # runs the demoted retrieval heads as streaming heads. Their KV still goes to the retrieval pages.
+        module.level_head_mask_types = {}
+        if sparse_context_enabled:
+            kv_repeat = module.num_heads // module.num_kv_heads
+            level_streaming_info = torch.tensor(
+                [sp_attn_config.get_ctx_sink_size(), sp_attn_config.get_ctx_local_size()] * module.num_heads,
+                device=device,
+                dtype=torch.int32,
+            )
+            for level in sp_attn_config.get_static_sparsity_levels():
+                level_full_attention_heads = repeat(
+                    sp_attn_config.get_level_full_attention_heads(level)[idx].to(device), 'h -> (h r)', r=kv_repeat
+                )
+                level_head_mask_type = torch.where(
+                    level_full_attention_heads == 0,
+                    torch.tensor(-1, dtype=torch.int32, device=device),
+                    torch.tensor(0, dtype=torch.int32, device=device),
+                )
+                module.level_head_mask_types[level] = (level_head_mask_type, level_streaming_info)
+
+        # Prompts that start from cached pages (prefix caching) read the cached tokens back from the KV cache.
+        module.paged_context_attention_wrapper = PagedContextAttentionWrapper(
+            idx, sp_attn_config.cache_block_size, module.head_dim,
+            module.kv_cache_config, module.use_int8,
+            sp_attn_config.get_ctx_sink_size() if streaming_info is not None else 0,
+            sp_attn_config.get_ctx_local_size() if streaming_info is not None else 0,
+        )
+        # Prompts split across the model instances (context parallelism) exchange their K / V shards instead.
+        module.ring_context_attention_wrapper = None
+        if get_context_parallel_world_size() > 1:
+            module.ring_context_attention_wrapper = RingContextAttentionWrapper(
+                idx, module.num_heads, module.num_kv_heads,
+                head_mask_type, streaming_info,
+                sp_attn_config.get_ctx_sink_size() if streaming_info is not None else 0,
+                sp_attn_config.get_ctx_local_size() if streaming_info is not None else 0,
+            )
+
             
 
 def init_sparse_kv_cache(
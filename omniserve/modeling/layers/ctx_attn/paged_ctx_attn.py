@@ -0,0 +1,122 @@
+from typing import Dict
+import torch
+import omniserve_backend.fused_attention_paged_context as fused_attention_paged_context
+
+
+class PagedContextAttentionWrapper(torch.nn.Module):
+    """Prefill attention that reads the tokens cached before the current chunk from the quantized pages.
+
+    Drop-in for attention_wrapper when the KV cache already holds a prefix of the sequence (chunked prefill,
+    prefix reuse): only the chunk itself needs fp16 K / V, which apply_bias_rope_update_kv_cache leaves in
+    the QKV buffer. Retrieval heads attend causally to the whole sequence, streaming heads to the
+    context sink / local tokens.
+    """
+
+    def __init__(
+        self,
+        layer_idx: int,
+        tokens_per_block: int,
+        head_dim: int,
+        kv_cache_config: Dict,
+        use_int8: bool,
+        ctx_sink_size: int = 0,
+        ctx_local_size: int = 0,
+    ):
+        super().__init__()
+
+        self.layer_idx = layer_idx
+        self.tokens_per_block = tokens_per_block
+        self.head_dim = head_dim
+        self.kv_cache_config = kv_cache_config
+        self.use_int8 = use_int8
+        self.ctx_sink_size = ctx_sink_size
+        self.ctx_local_size = ctx_local_size
+        self.softmax_scale = head_dim ** -0.5
+
+    @torch.no_grad()
+    def forward(
+        self,
+        q, k, v,
+        input_metadata,
+        kv_lens,
+        max_seqlen_k,
+        retrieval_head_flags,
+        head_rank_table,
+        sink_size, local_size, sink_blocks, local_blocks,
+        num_retrieval_kv_heads, num_streaming_kv_heads,
+        dynamic_sparse_page_idxes=None,
+        dynamic_sparse_page_nums=None,
+    ):
+        # q: [total_q, num_heads, head_dim], k / v: [total_q, num_kv_heads, head_dim] of the current chunk.
+        # kv_lens (int32, [batch_size]): cached tokens of every sequence, including the current chunk.
+        # Speculative decoding: the chunks are draft trees (input_metadata.spec_tree_mask) and the retrieval heads
+        # may attend to one page selection per sequence (int32, [batch_size, num_heads, num_pages]) only. The same
+        # selection restricts the prefix read by the chunks of a long prompt with ctx dynamic sparsity.
+        size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]) else 1)
+
+        return fused_attention_paged_context.paged_context_attention(
+            q, k, v,
+            input_metadata.cu_seqlens,
+            kv_lens,
+            input_metadata.retrieval_block_tables[self.layer_idx],
+            input_metadata.streaming_block_tables[self.layer_idx],
+            retrieval_head_flags,
+            head_rank_table,
+            input_metadata.max_seq_len,
+            max_seqlen_k,
+            self.tokens_per_block,
+            size_per_retrieval_token,
+            size_per_streaming_token,
+            sink_size, local_size,
+            sink_blocks, local_blocks,
+            num_retrieval_kv_heads,
+            num_streaming_kv_heads,
+            self.ctx_sink_size,
+            self.ctx_local_size,
+            self.softmax_scale,
+            self.kv_cache_config["INT4_ENABLED"],   # int4_kv
+            self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]),  # streaming_int4_kv
+            self.kv_cache_config["ZEROS_ENABLED"],  # kv_cache_with_zeros
+            self.kv_cache_config.get("FP8_ENABLED", False),  # fp8_kv_cache
+            input_metadata.spec_tree_mask,
+            input_metadata.spec_position_offsets,
+            dynamic_sparse_page_idxes,
+            dynamic_sparse_page_nums,
+        )
+
+    @torch.no_grad()
+    def accept_draft_tokens(
+        self,
+        input_metadata,
+        past_lens,
+        accepted_idxes,
+        num_accepted,
+        sink_size, local_size, sink_blocks, local_blocks,
+        num_retrieval_kv_heads, num_streaming_kv_heads,
+    ):
+        # KV rollback after verification. past_lens (int32, [batch_size]): tokens cached before the draft tokens;
+        # accepted_idxes (int32, [batch_size, max_accepted]): ascending draft indices of the accepted path, of
+        # which the first num_accepted (int32, [batch_size]) are valid. They move to the slots behind past_lens;
+        # the sequences are then truncated to past_lens + num_accepted tokens (BlockSpaceManager.rollback_slots).
+        size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]) else 1)
+
+        fused_attention_paged_context.accept_draft_tokens(
+            input_metadata.retrieval_block_tables[self.layer_idx],
+            input_metadata.streaming_block_tables[self.layer_idx],
+            past_lens,
+            accepted_idxes,
+            num_accepted,
+            self.tokens_per_block,
+            self.head_dim,
+            size_per_retrieval_token,
+            size_per_streaming_token,
+            sink_size, local_size,
+            sink_blocks, local_blocks,
+            num_retrieval_kv_heads,
+            num_streaming_kv_heads,
+            self.kv_cache_config["INT4_ENABLED"],   # int4_kv
+            self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]),  # streaming_int4_kv
+            self.kv_cache_config["ZEROS_ENABLED"],  # kv_cache_with_zeros
+        )
@@ -0,0 +1,175 @@
+from dataclasses import dataclass
+from typing import List, Optional
+
+import torch
+from block_sparse_attn import flash_attn_varlen_func, token_streaming_attn_func
+
+
+@dataclass
+class ContextParallelShard:
+    """The shard of a prompt one model instance prefills (context parallelism, a single sequence).
+
+    Instance i computes the tokens [sum(shard_lens[:i]), sum(shard_lens[:i + 1])) of the prompt; ranks[i] is the
+    global rank of the same tensor parallel rank in instance i, group the NCCL group over ranks.
+    """
+
+    rank: int
+    shard_lens: List[int]
+    ranks: List[int]
+    group: Optional[object] = None
+
+    @property
+    def world_size(self) -> int:
+        return len(self.shard_lens)
+
+
+def _merge_attn_outputs(out, lse, block_out, block_lse):
+    # out: [L, H, D] fp32, lse: [H, L] fp32 log-sum-exp of the scores; same for the block.
+    if out is None:
+        return block_out.float(), block_lse
+    new_lse = torch.logaddexp(lse, block_lse)
+    out = out * torch.exp(lse - new_lse).t().unsqueeze(-1) + block_out.float() * torch.exp(block_lse - new_lse).t().unsqueeze(-1)
+    return out, new_lse
+
+
+class RingContextAttentionWrapper(torch.nn.Module):
+    """Prefill attention of one context parallel shard of a prompt.
+
+    Drop-in for attention_wrapper when input_metadata.context_parallel is set. The fp16 K / V of the retrieval
+    heads travel from instance to instance: with a causal mask, the shard of instance i is only attended by the
+    instances after it, so the ring is cut after the last instance and every block makes shard_lens - 1 - i hops.
+    Each instance attends to the block it holds while the next one is in flight, and merges the partial outputs
+    by their log-sum-exp. Streaming heads only attend to the context sink and local tokens: they receive the sink
+    tokens of instance 0 and the last local tokens of the previous instance instead.
+    """
+
+    def __init__(
+        self,
+        layer_idx: int,
+        num_heads: int,
+        num_kv_heads: int,
+        head_mask_type: Optional[torch.Tensor],
+        streaming_info: Optional[torch.Tensor],
+        ctx_sink_size: int = 0,
+        ctx_local_size: int = 0,
+    ):
+        super().__init__()
+
+        self.layer_idx = layer_idx
+        self.ctx_sink_size = ctx_sink_size
+        self.ctx_local_size = ctx_local_size
+        kv_repeat = num_heads // num_kv_heads
+        if head_mask_type is None:
+            # Dense layer: every head attends to the whole prompt.
+            self.retrieval_q_heads = None
+            self.streaming_q_heads = None
+            self.num_retrieval_q_heads = num_heads
+        else:
+            retrieval_q_heads = torch.where(head_mask_type == 0)[0]
+            streaming_q_heads = torch.where(head_mask_type == -1)[0]
+            # Whole query groups, so the kv head of every selected query head is selected too.
+            self.retrieval_q_heads = retrieval_q_heads
+            self.retrieval_kv_heads = retrieval_q_heads[::kv_repeat] // kv_repeat
+            self.streaming_q_heads = streaming_q_heads
+            self.streaming_kv_heads = streaming_q_heads[::kv_repeat] // kv_repeat
+            self.num_retrieval_q_heads = retrieval_q_heads.numel()
+            self.streaming_head_mask_type = head_mask_type[streaming_q_heads]
+            self.streaming_info = streaming_info[: 2 * streaming_q_heads.numel()]
+
+    def _attend(self, q, kv, causal):
+        cu_seqlens_q = torch.tensor([0, q.size(0)], dtype=torch.int32, device=q.device)
+        cu_seqlens_k = torch.tensor([0, kv.size(1)], dtype=torch.int32, device=q.device)
+        out, lse, _ = flash_attn_varlen_func(
+            q, kv[0], kv[1],
+            cu_seqlens_q, cu_seqlens_k,
+            q.size(0), kv.size(1),
+            dropout_p=0.0,
+            causal=causal,
+            return_attn_probs=True,
+        )
+        # [batch = 1, H, max_seqlen_q] or [H, total_q] depending on the flash attention version.
+        return out, lse.reshape(q.size(1), -1)[:, : q.size(0)]
+
+    def _ring_attention(self, q, k, v, shard: ContextParallelShard):
+        rank, world_size = shard.rank, shard.world_size
+        send_kv = torch.stack((k, v))
+        out = lse = None
+        to_attend = (send_kv, True)
+        for step in range(1, world_size + 1):
+            # Step s: instance i receives the block of instance i - s from instance i - 1, and forwards the block
+            # of instance i - s + 1 (its own at s = 1) to instance i + 1.
+            ops = []
+            recv_kv = None
+            if step < world_size and rank - step >= 0:
+                recv_kv = send_kv.new_empty((2, shard.shard_lens[rank - step]) + tuple(send_kv.shape[2:]))
+                ops.append(torch.distributed.P2POp(torch.distributed.irecv, recv_kv, shard.ranks[rank - 1]))
+            if step < world_size and rank + 1 < world_size and rank - step + 1 >= 0:
+                ops.append(torch.distributed.P2POp(torch.distributed.isend, send_kv, shard.ranks[rank + 1]))
+            reqs = torch.distributed.batch_isend_irecv(ops) if ops else []
+            if to_attend is not None:
+                block_out, block_lse = self._attend(q, *to_attend)
+                out, lse = _merge_attn_outputs(out, lse, block_out, block_lse)
+            for req in reqs:
+                req.wait()
+            if recv_kv is None:
+                # Every earlier block was received, attended and forwarded.
+                break
+            send_kv = recv_kv
+            to_attend = (recv_kv, False)
+        return out
+
+    def _streaming_attention(self, q, k, v, shard: ContextParallelShard):
+        rank, world_size = shard.rank, shard.world_size
+        sink_kv = torch.stack((k[: self.ctx_sink_size], v[: self.ctx_sink_size])) if rank == 0 else None
+        if rank > 0:
+            sink_kv = k.new_empty((2, self.ctx_sink_size) + tuple(k.shape[1:]))
+        torch.distributed.broadcast(sink_kv, src=shard.ranks[0], group=shard.group)
+        ops = []
+        tail_kv = None
+        if rank + 1 < world_size:
+            ops.append(torch.distributed.P2POp(
+                torch.distributed.isend,
+                torch.stack((k[-self.ctx_local_size :], v[-self.ctx_local_size :])).contiguous(),
+                shard.ranks[rank + 1],
+            ))
+        if rank > 0:
+            tail_kv = k.new_empty((2, self.ctx_local_size) + tuple(k.shape[1:]))
+            ops.append(torch.distributed.P2POp(torch.distributed.irecv, tail_kv, shard.ranks[rank - 1]))
+        for req in torch.distributed.batch_isend_irecv(ops) if ops else []:
+            req.wait()
+        if rank > 0:
+            # The sink tokens, then the local tokens right before the shard. Causal masks are aligned to the last
+            # key, so the local window of every query ends on itself and the sink stays the first keys.
+            k = torch.cat((sink_kv[0], tail_kv[0], k))
+            v = torch.cat((sink_kv[1], tail_kv[1], v))
+        cu_seqlens_q = torch.tensor([0, q.size(0)], dtype=torch.int32, device=q.device)
+        cu_seqlens_k = torch.tensor([0, k.size(0)], dtype=torch.int32, device=q.device)
+        return token_streaming_attn_func(
+            q, k, v,
+            cu_seqlens_q, cu_seqlens_k,
+            self.streaming_head_mask_type, self.streaming_info,
+            q.size(0), k.size(0),
+        )
+
+    @torch.no_grad()
+    def forward(self, q, k, v, input_metadata):
+        # q: [shard_len, num_heads, head_dim], k / v: [shard_len, num_kv_heads, head_dim], after RoPE.
+        shard = input_metadata.context_parallel
+        if self.retrieval_q_heads is None:
+            return self._ring_attention(q, k, v, shard).to(q.dtype)
+        attn_output = torch.empty_like(q)
+        if self.num_retrieval_q_heads > 0:
+            attn_output[:, self.retrieval_q_heads] = self._ring_attention(
+                q[:, self.retrieval_q_heads],
+                k[:, self.retrieval_kv_heads],
+                v[:, self.retrieval_kv_heads],
+                shard,
+            ).to(q.dtype)
+        if self.streaming_q_heads.numel() > 0:
+            attn_output[:, self.streaming_q_heads] = self._streaming_attention(
+                q[:, self.streaming_q_heads],
+                k[:, self.streaming_kv_heads],
+                v[:, self.streaming_kv_heads],
+                shard,
+            )
+        return attn_output
@@ -3,6 +3,7 @@ import torch
 import omniserve_backend.fused_attention_fine_grained_dense as fused_attention_fine_grained_dense
 import omniserve_backend.fused_attention_per_tensor_dense as fused_attention_per_tensor_dense
 import omniserve_backend.fused_attention_ctx_pool as fused_attention_ctx_pool
+from omniserve.modeling.layers.rotary_embedding import get_rope_scaling_factor, get_rotary_cos_sin
 
 class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
     def __init__(
@@ -14,6 +15,9 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
         kv_quant_granularity: str,
         kv_cache_config: Dict,
         use_int8: bool,
+        tokens_per_sub_chunk: int = 0,
+        super_page_size: int = 0,
+        rotary_max_positions: int = 0,
     ):
         super().__init__()
 
@@ -24,20 +28,25 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
         self.head_dim = head_dim
         self.rope_theta = rope_theta
         self.rope_scaling = rope_scaling
-        if self.rope_scaling is not None:
-            self.rope_scaling_factor = self.rope_scaling["factor"]
-            assert self.rope_scaling["type"] == "linear", f"Unsupported rope scaling type {self.rope_scaling['type']}"
-        else:
-            self.rope_scaling_factor = 1.0
+        self.rope_scaling_factor = get_rope_scaling_factor(rope_scaling)
         self.max_position_embeddings = max_position_embeddings
+        # Length of the cos / sin table (0: max_position_embeddings), see get_rotary_cos_sin.
+        self.rotary_max_positions = rotary_max_positions if rotary_max_positions > 0 else max_position_embeddings
+        self.rotary_cos_sin = None
         self.neox_rotary_style = neox_rotary_style
         self.kv_quant_granularity = kv_quant_granularity
         self.kv_cache_config = kv_cache_config
         self.use_int8 = use_int8
+        # > 0: the kernel also maintains the sub-chunk min / max K stats of the retrieval heads (dynamic sparse decoding).
+        self.tokens_per_sub_chunk = tokens_per_sub_chunk
+        # > 0: the super-page stats are merged in the same kernel too, so prefill needs no PagedMinMaxPoolWrapper.
+        self.super_page_size = super_page_size
 
         # NOTE (Shang): dense or sparse does not matter here, since we are using the same kernel
         # Howerver, per-tensor or fine-grained does matter.
-        if kv_quant_granularity == "per_tensor":
+        # per_page: per-tensor kernels with per-page K / V scales on the retrieval heads, set when a page is first written.
+        self.kv_page_scales = kv_quant_granularity == "per_page"
+        if kv_quant_granularity in ("per_tensor", "per_page"):
             self.forward = self.forward_per_tensor
         elif kv_quant_granularity == "fine_grained":
             self.forward = self.forward_fine_grained
@@ -45,6 +54,14 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
             raise NotImplementedError(f"Unsupported kv_quant_granularity {kv_quant_granularity}")
 
 
+    def get_rotary_cos_sin(self, device):
+        # Built at the first (eager) forward, before any CUDA graph capture.
+        if self.rotary_cos_sin is None:
+            self.rotary_cos_sin = get_rotary_cos_sin(
+                self.head_dim, self.rope_theta, self.rope_scaling, self.rotary_max_positions, device
+            )
+        return self.rotary_cos_sin
+
     @torch.no_grad()
     def forward_per_tensor(
         self, 
@@ -89,6 +106,10 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
             self.neox_rotary_style,
             self.kv_cache_config["INT4_ENABLED"],  # int4_kv
             self.kv_cache_config["ZEROS_ENABLED"],  # kv_cache_with_zeros
+            self.tokens_per_sub_chunk,
+            self.super_page_size,
+            self.kv_page_scales,
+            self.get_rotary_cos_sin(qkv_proj_act_buffer.device),
         )
 
 
@@ -104,7 +125,7 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
         kv_scale_orig_quant = None  # Of no use, only keep for interface consistency
     ):
         size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
-        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]) else 1)
 
         fused_attention_fine_grained_dense.apply_bias_rope_update_kv_cache(
             qkv_proj_act_buffer,
@@ -131,7 +152,14 @@ class ApplyBiasRopeUpdateKVCacheWrapper(torch.nn.Module):
             self.max_position_embeddings,
             self.neox_rotary_style,
             self.kv_cache_config["INT4_ENABLED"],   # int4_kv
+            self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]),  # streaming_int4_kv
             self.kv_cache_config["ZEROS_ENABLED"],  # kv_cache_with_zeros
+            self.tokens_per_sub_chunk,
+            self.kv_cache_config.get("FP8_ENABLED", False),  # fp8_kv_cache
+            self.super_page_size,
+            input_metadata.prompt_kv_lens,  # kv_seq_lens, behind a cached prefix
+            input_metadata.spec_position_offsets,  # RoPE positions of the draft tokens (speculative decoding)
+            self.get_rotary_cos_sin(qkv_proj_act_buffer.device),
         )
 
 class PagedMinMaxPoolWrapper(torch.nn.Module):
@@ -143,12 +171,14 @@ class PagedMinMaxPoolWrapper(torch.nn.Module):
         head_dim: int,
         kv_cache_config: Dict,
         use_int8: bool,
+        super_page_size: int = 0,
     ):
         super().__init__()
 
         self.layer_idx = layer_idx
         self.tokens_per_block = tokens_per_block
         self.sub_chunk_per_block = sub_chunk_per_block
+        self.super_page_size = super_page_size
         self.tokens_per_sub_chunk = tokens_per_block // sub_chunk_per_block
         self.head_dim = head_dim
         self.kv_cache_config = kv_cache_config
@@ -161,8 +191,11 @@ class PagedMinMaxPoolWrapper(torch.nn.Module):
         keys, 
         input_metadata,
         pooling_heads_idx,
-        num_retrieval_kv_heads
+        num_retrieval_kv_heads,
+        past_kv_lens: Optional[torch.Tensor] = None,
     ):
+        # past_kv_lens (int32, [batch_size]): tokens already in the KV cache when keys is one prefill chunk.
+        # The chunk is pooled at positions past_kv_lens[b] onwards and merged into a partially filled sub-chunk.
         size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
         
         fused_attention_ctx_pool.paged_min_max_pool(
@@ -174,6 +207,8 @@ class PagedMinMaxPoolWrapper(torch.nn.Module):
             self.tokens_per_sub_chunk,
             self.tokens_per_block,
             size_per_retrieval_token,
-            True # self.kv_cache_config["ZEROS_ENABLED"]    # TODO: Fix this error for buffer offset.
+            self.kv_cache_config["ZEROS_ENABLED"],
+            self.super_page_size,
+            past_kv_lens,
         )
 
@@ -9,6 +9,9 @@ import omniserve_backend.fused_attention_per_tensor_sparse as fused_attention_pe
 import omniserve_backend.fused_attention_selector as fused_attention_selector
 import omniserve_backend.fused_attention_pure_dense as fused_attention_pure_dense
 
+from omniserve.modeling.layers.rotary_embedding import get_rope_scaling_factor, get_rotary_cos_sin
+from omniserve.utils.kernel_profiler import kernel_profiler
+
 
 class DecodingAttentionWrapper(torch.nn.Module):
     def __init__(
@@ -31,6 +34,11 @@ class DecodingAttentionWrapper(torch.nn.Module):
         dynamic_sparse_token_budget: int,
         multiblock_switch: int,
         selector_update_interval: int,
+        super_page_size: int = 0,
+        num_selected_super_pages: int = 0,
+        selector_drift_threshold: float = 0.0,
+        persistent_decode_attention: bool = False,
+        gqa_page_selection: str = "none",
         ):
         super().__init__()
 
@@ -42,11 +50,9 @@ class DecodingAttentionWrapper(torch.nn.Module):
         self.rotary_embedding_dim = rotary_embedding_dim
         self.rotary_base = rotary_base
         self.rope_scaling = rope_scaling
-        if self.rope_scaling is not None:
-            self.rope_scaling_factor = self.rope_scaling["factor"]
-            assert self.rope_scaling["type"] == "linear", f"Unsupported rope scaling type {self.rope_scaling['type']}"
-        else:
-            self.rope_scaling_factor = 1.0
+        self.rope_scaling_factor = get_rope_scaling_factor(rope_scaling)
+        # Shared with the kv cache update of the same model (same key in get_rotary_cos_sin).
+        self.rotary_cos_sin = None
         self.neox_rotary_style = neox_rotary_style
         self.kv_quant_granularity = kv_quant_granularity
         self.kv_cache_config = kv_cache_config
@@ -57,7 +63,26 @@ class DecodingAttentionWrapper(torch.nn.Module):
         self.dynamic_sparse_token_budget = dynamic_sparse_token_budget
         self.multiblock_switch = multiblock_switch
         self.selector_update_interval = selector_update_interval
+        self.super_page_size = super_page_size
+        self.num_selected_super_pages = num_selected_super_pages
+        # Page-selection reuse: between two selections the cached page set is reused with the newest local page
+        # appended. In eager mode, a query that drifted away from the one that made the selection (cosine similarity
+        # averaged over the heads of a sequence below the threshold) triggers an early reselection, decided once per
+        # step by the first layer that checks it.
+        self.selector_drift_threshold = selector_drift_threshold
+        self.selector_q = None    # B x N_head x head_dim (fp32) query of the last selection, only kept with a drift threshold.
+        self.selector_used_page_nums = False    # The last selection used per-sequence page counts (InputMetadata.dynamic_sparse_page_nums).
+        self.persistent_decode_attention = persistent_decode_attention
+        # Group-shared selection: one page set per KV head (B x N_kv_head x pages) from the "max" or "sum" of the
+        # scores of its query heads. The stats of a group are read once, and the attention kernels index the page
+        # sets by KV head.
+        self.gqa_page_selection = gqa_page_selection
         
+        # per_page runs the per-tensor kernels, with per-page K / V scales on the retrieval heads.
+        self.kv_page_scales = kv_quant_granularity == "per_page"
+        if self.kv_page_scales:
+            kv_quant_granularity = "per_tensor"
+
         if self.sparse_decode_mode != 0:
             if kv_quant_granularity == "per_tensor":
                 self.forward = self.forward_w_dynamic_sparse_per_tensor
@@ -84,6 +109,15 @@ class DecodingAttentionWrapper(torch.nn.Module):
                 
 
 
+    def get_rotary_cos_sin(self, device):
+        # Covers every position of the kv cache (memory_max_len). Built at the first (eager) forward, before any
+        # CUDA graph capture.
+        if self.rotary_cos_sin is None:
+            self.rotary_cos_sin = get_rotary_cos_sin(
+                self.rotary_embedding_dim, self.rotary_base, self.rope_scaling, self.memory_max_len, device
+            )
+        return self.rotary_cos_sin
+
     @torch.no_grad()
     def dynamic_select_topk_pages(
         self, 
@@ -91,14 +125,23 @@ class DecodingAttentionWrapper(torch.nn.Module):
         retrieval_block_tables, streaming_block_tables, retrieval_head_flags, head_rank_table,
         lengths_per_sample, sink_size, local_size, sink_blocks, local_blocks,
         size_per_retrieval_token, size_per_streaming_token,
-        num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token
+        num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token,
+        dynamic_sparse_page_nums=None, max_dynamic_sparse_token_budget=0, retrieval_page_scores=None,
     ):
-        if timestep <= self.dynamic_sparse_token_budget:
-            selected_page_idx = torch.range(0, timestep // self.tokens_per_block, device=q.device, dtype=torch.int32).unsqueeze(0).unsqueeze(0).expand(q.shape[0], q.shape[1], -1).contiguous()
+        # dynamic_sparse_page_nums: per-sequence budgets (see InputMetadata), which always go through the selector
+        # kernel; rows within their budget keep all their pages there.
+        # retrieval_page_scores: selection counts of page eviction (see InputMetadata), updated by the selector.
+        if dynamic_sparse_page_nums is None and timestep <= self.dynamic_sparse_token_budget:
+            num_page_idx_heads = k.shape[1] if self.gqa_page_selection != "none" else q.shape[1]
+            selected_page_idx = torch.range(0, timestep // self.tokens_per_block, device=q.device, dtype=torch.int32).unsqueeze(0).unsqueeze(0).expand(q.shape[0], num_page_idx_heads, -1).contiguous()
         
         else:
-            dynamic_sparse_token_budget = min(self.dynamic_sparse_token_budget, timestep)
-            selected_page_stats = fused_attention_selector.single_query_page_selector(
+            if dynamic_sparse_page_nums is None:
+                dynamic_sparse_token_budget = min(self.dynamic_sparse_token_budget, timestep)
+            else:
+                # Already clamped to the pages of every sequence, and sizes the rows of selected_page_idx.
+                dynamic_sparse_token_budget = max_dynamic_sparse_token_budget
+            selected_page_idx = fused_attention_selector.single_query_page_selector_topk(
                 q,
                 k,
                 v,                               # Actually of no use. (just keep for the interface)
@@ -123,24 +166,179 @@ class DecodingAttentionWrapper(torch.nn.Module):
                 self.rope_scaling_factor,
                 self.neox_rotary_style,
                 self.kv_cache_config["INT4_ENABLED"],
-                True, # self.kv_cache_config["ZEROS_ENABLED"],     # TODO: Fix this error for buffer offset.
+                self.kv_cache_config["ZEROS_ENABLED"],
                 self.sub_chunk_size,
                 hidden_dim_per_retrieval_token,
-                1000000,                         # const int multiblock_switch  # FIXME: Currently never activate it in page selector!
+                self.multiblock_switch,
+                dynamic_sparse_token_budget,     # The sub-chunk max, per-head top-k and most-recent-page append are fused into the kernel.
+                self.super_page_size,            # 0: flat selection over all the pages.
+                self.num_selected_super_pages,
+                dynamic_sparse_page_nums,
+                self.gqa_page_selection != "none",
+                self.gqa_page_selection == "sum",
+                self.get_rotary_cos_sin(q.device),
+                retrieval_page_scores,
             )
+            if kernel_profiler.enabled:
+                # The selector scans the sub-chunk min / max K stats (fp16) of every page of the retrieval heads.
+                num_pages = (lengths_per_sample + self.tokens_per_block - 1) // self.tokens_per_block
+                stats_bytes_per_page = 2 * (self.tokens_per_block // self.sub_chunk_size) * hidden_dim_per_retrieval_token * 2
+                kernel_profiler.add_bytes(
+                    "fused_attention_selector.single_query_page_selector_topk", num_pages.sum() * stats_bytes_per_page
+                )
 
-            selected_page_stats = selected_page_stats.view(q.shape[0], q.shape[1], -1, self.tokens_per_block // self.sub_chunk_size)
-            selected_page_stats = torch.max(selected_page_stats, dim=-1).values        # max over sub-chunk-dim
+        if kernel_profiler.enabled:
+            batch_size, num_heads, num_selected_pages = selected_page_idx.shape
+            if dynamic_sparse_page_nums is not None:
+                num_pages = dynamic_sparse_page_nums.clamp(1, num_selected_pages).sum() * num_heads
+            else:
+                num_pages = batch_size * num_heads * num_selected_pages
+            kernel_profiler.add_selected_pages(num_pages, batch_size * num_heads)
 
+        return selected_page_idx
 
-            total_page_num = selected_page_stats.size(-1)
-            _, selected_page_idx = selected_page_stats[:,:,:-1].topk(
-                k=(min(max(3, dynamic_sparse_token_budget // self.tokens_per_block), total_page_num) - 1), dim=-1
-            )
-            selected_page_idx = torch.cat([selected_page_idx, torch.ones_like(selected_page_idx[..., :1]) * (total_page_num - 1)], dim=-1).contiguous()      # Make sure the most recent page is chosen and concatenated in the last
-            selected_page_idx = selected_page_idx.to(torch.int32)
+    @torch.no_grad()
+    def reuse_cached_pages(self, q, cached_dynamic_sparse_page_idx, input_metadata):
+        # Eager mode only: under CUDA graph decode the runner decides the selector cadence.
+        if cached_dynamic_sparse_page_idx is None or cached_dynamic_sparse_page_idx.size(0) != q.size(0):
+            return False
+        timestep = input_metadata.max_seq_len
+        dynamic_sparse_page_nums = input_metadata.dynamic_sparse_page_nums
+        # Since timestep is the length of history, not including the current token. No need to -1 here.
+        if timestep % self.selector_update_interval == 0:
+            return False
+        if dynamic_sparse_page_nums is None:
+            if timestep <= self.dynamic_sparse_token_budget or self.selector_used_page_nums:
+                return False
+        elif not self.selector_used_page_nums or input_metadata.dynamic_sparse_page_nums_changed:
+            # A sequence whose budget grew (budget ratio, or a context still within its budget) needs more pages.
+            return False
+        if self.selector_drift_threshold > 0:
+            if input_metadata.selector_drifted is None:
+                if self.selector_q is None or self.selector_q.shape != q.shape:
+                    return False
+                # B: per-sequence similarity, averaged over the heads. Decided by the first layer of the step, the
+                # others follow: one host sync per step, instead of one per layer.
+                similarity = torch.nn.functional.cosine_similarity(q.float(), self.selector_q, dim=-1).mean(dim=-1)
+                input_metadata.selector_drifted = similarity.min().item() < self.selector_drift_threshold
+            if input_metadata.selector_drifted:
+                return False
+        return True
 
-        return selected_page_idx
+    @torch.no_grad()
+    def append_local_page(self, page_idx, lengths_per_sample, dynamic_sparse_page_nums=None):
+        # The attention kernels read the last entry as the local (most recent) page. Once the sequence has moved to a
+        # new page since the selection, the previous local page replaces the lowest ranked selected page (top-k order).
+        # Updates page_idx in place, so that it also works on the static page index buffers of CUDA graph decode.
+        last_page = torch.clamp((lengths_per_sample + self.tokens_per_block - 2) // self.tokens_per_block - 1, min=0)
+        last_page = last_page.to(page_idx.dtype).unsqueeze(-1)
+        if dynamic_sparse_page_nums is not None:
+            # Same with the last entry of every row at dynamic_sparse_page_nums - 1.
+            last_idx = (dynamic_sparse_page_nums.long() - 1).view(-1, 1, 1).expand(-1, page_idx.size(1), 1)
+            prev_idx = torch.clamp(last_idx - 1, min=0)
+            last_page = last_page.unsqueeze(-1).expand_as(last_idx)
+            prev_last_page = page_idx.gather(-1, last_idx)
+            prev_page = torch.where((prev_last_page != last_page) & (last_idx > 0), prev_last_page, page_idx.gather(-1, prev_idx))
+            page_idx.scatter_(-1, prev_idx, prev_page)
+            page_idx.scatter_(-1, last_idx, last_page)
+            return page_idx
+        prev_last_page = page_idx[..., -1].clone()
+        if page_idx.size(-1) > 1:
+            page_idx[..., -2] = torch.where(prev_last_page != last_page, prev_last_page, page_idx[..., -2])
+        page_idx[..., -1] = last_page
+        return page_idx
+
+    @torch.no_grad()
+    def select_verification_pages(
+        self,
+        root_qkv,
+        input_metadata,
+        retrieval_head_flags, head_rank_table,
+        sink_size, local_size, sink_blocks, local_blocks,
+        num_retrieval_kv_heads, num_streaming_kv_heads,
+    ):
+        # Speculative decoding: one page selection per sequence, made with the query of the root of its draft tree
+        # (the first token after the cached history) and shared by all its draft tokens in paged context attention.
+        # root_qkv: [batch_size, qkv hidden] of the roots, before RoPE (the selector rotates the query itself).
+        return self._select_prefix_pages(
+            root_qkv, input_metadata,
+            retrieval_head_flags, head_rank_table,
+            sink_size, local_size, sink_blocks, local_blocks,
+            num_retrieval_kv_heads, num_streaming_kv_heads,
+        )
+
+    @staticmethod
+    def pool_chunk_qkv(qkv, input_metadata, q_size):
+        # Chunked prefill: [batch_size, qkv hidden] rows holding the mean query of every chunk and the K / V of its
+        # first token. Must be taken before apply_bias_rope_update_kv_cache rotates the QKV buffer in place.
+        first_token_idx = input_metadata.cu_seqlens[:-1].long()
+        q_lens = input_metadata.cu_seqlens[1:] - input_metadata.cu_seqlens[:-1]
+        pooled_qkv = qkv[first_token_idx]
+        seq_idx = torch.repeat_interleave(
+            torch.arange(q_lens.size(0), device=qkv.device), q_lens, output_size=qkv.size(0)
+        )
+        q_sum = torch.zeros((q_lens.size(0), q_size), dtype=torch.float32, device=qkv.device)
+        q_sum.index_add_(0, seq_idx, qkv[:, :q_size].float())
+        pooled_qkv[:, :q_size] = (q_sum / q_lens.unsqueeze(1)).to(qkv.dtype)
+        return pooled_qkv
+
+    @torch.no_grad()
+    def select_chunk_pages(
+        self,
+        pooled_qkv,
+        input_metadata,
+        retrieval_head_flags, head_rank_table,
+        sink_size, local_size, sink_blocks, local_blocks,
+        num_retrieval_kv_heads, num_streaming_kv_heads,
+    ):
+        # Chunked prefill (ctx dynamic sparsity): the retrieval heads of a chunk attend to the pages of the cached
+        # prefix chosen with its mean query (pool_chunk_qkv), scored at the position of its first token, plus the
+        # pages of the chunk itself. The selector stores the K / V of that first token exactly as
+        # apply_bias_rope_update_kv_cache does.
+        return self._select_prefix_pages(
+            pooled_qkv, input_metadata,
+            retrieval_head_flags, head_rank_table,
+            sink_size, local_size, sink_blocks, local_blocks,
+            num_retrieval_kv_heads, num_streaming_kv_heads,
+        )
+
+    def _select_prefix_pages(
+        self,
+        root_qkv,
+        input_metadata,
+        retrieval_head_flags, head_rank_table,
+        sink_size, local_size, sink_blocks, local_blocks,
+        num_retrieval_kv_heads, num_streaming_kv_heads,
+    ):
+        # One selection per prompt chunk over the cached history, with root_qkv at the first token of the chunk.
+        if self.sparse_decode_mode == 0:
+            return None
+        # Upper bound of the cached history over the batch (every sequence verifies at least one token).
+        timestep = input_metadata.max_prompt_kv_len - 1
+        if timestep <= self.dynamic_sparse_token_budget:
+            return None
+        q_lens = input_metadata.cu_seqlens[1:] - input_metadata.cu_seqlens[:-1]
+        lengths_per_sample = (input_metadata.prompt_kv_lens - q_lens + 1).int()
+
+        num_kv_heads = num_retrieval_kv_heads + num_streaming_kv_heads
+        kv_size = num_kv_heads * self.head_dim
+        q, k, v = root_qkv.split([root_qkv.size(-1) - 2 * kv_size, kv_size, kv_size], dim=-1)
+        q = q.reshape(q.size(0), -1, self.head_dim).contiguous()
+        k = k.reshape(k.size(0), num_kv_heads, self.head_dim).contiguous()
+        v = v.reshape(v.size(0), num_kv_heads, self.head_dim).contiguous()
+
+        size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        hidden_dim_per_retrieval_token = num_retrieval_kv_heads * self.head_dim
+        return self.dynamic_select_topk_pages(
+            q, k, v,
+            input_metadata.retrieval_block_tables[self.layer_idx],
+            input_metadata.streaming_block_tables[self.layer_idx],
+            retrieval_head_flags, head_rank_table,
+            lengths_per_sample, sink_size, local_size, sink_blocks, local_blocks,
+            size_per_retrieval_token, size_per_streaming_token,
+            num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token,
+        )
 
     @torch.no_grad()
     def forward_pure_dense(
@@ -172,10 +370,10 @@ class DecodingAttentionWrapper(torch.nn.Module):
                 timestep,
                 self.rotary_embedding_dim,
                 self.rotary_base,
-                # self.rope_scaling_factor, # TODO: Fix rope scaling factor
                 self.neox_rotary_style,
                 self.kv_cache_config["INT4_ENABLED"],
                 self.kv_cache_config["ZEROS_ENABLED"],
+                self.get_rotary_cos_sin(q.device),
             )
 
         selected_page_idx = None
@@ -229,7 +427,9 @@ class DecodingAttentionWrapper(torch.nn.Module):
             self.neox_rotary_style,
             self.kv_cache_config["INT4_ENABLED"],
             self.kv_cache_config["ZEROS_ENABLED"],
+            self.kv_page_scales,
             2048,  # const int multiblock_switch
+            self.get_rotary_cos_sin(q.device),
         )
 
         selected_page_idx = None
@@ -254,8 +454,12 @@ class DecodingAttentionWrapper(torch.nn.Module):
         size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
         hidden_dim_per_retrieval_token = num_retrieval_kv_heads * self.head_dim
 
-        if ((timestep) % self.selector_update_interval != 0) and cached_dynamic_sparse_page_idx is not None:      # Since timestep is the length of history, not including the current token. No need to -1 here.
-            dynamic_sparse_page_idx = cached_dynamic_sparse_page_idx
+        static_page_idx = input_metadata.dynamic_sparse_page_idxes    # Not None under CUDA graph decode.
+        page_nums = input_metadata.dynamic_sparse_page_nums    # Only in eager mode.
+        if static_page_idx is not None and not input_metadata.update_dynamic_sparse_pages:
+            dynamic_sparse_page_idx = self.append_local_page(static_page_idx[self.layer_idx], lengths_per_sample)
+        elif static_page_idx is None and self.reuse_cached_pages(q, cached_dynamic_sparse_page_idx, input_metadata):
+            dynamic_sparse_page_idx = self.append_local_page(cached_dynamic_sparse_page_idx, lengths_per_sample, page_nums)
         else:
             dynamic_sparse_page_idx = self.dynamic_select_topk_pages(    
                 q, k, v,
@@ -264,19 +468,32 @@ class DecodingAttentionWrapper(torch.nn.Module):
                 retrieval_head_flags, head_rank_table,
                 lengths_per_sample, sink_size, local_size, sink_blocks, local_blocks,
                 size_per_retrieval_token, size_per_streaming_token,
-                num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token
+                num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token,
+                page_nums, input_metadata.max_dynamic_sparse_token_budget, input_metadata.retrieval_page_scores,
             )
+            if static_page_idx is not None:
+                dynamic_sparse_page_idx = static_page_idx[self.layer_idx].copy_(dynamic_sparse_page_idx)
+            else:
+                self.selector_used_page_nums = page_nums is not None
+                if self.selector_drift_threshold > 0:
+                    self.selector_q = q.float()
         
         kv_scale_quant_orig = kv_scale_quant_orig.float()
         kv_scale_orig_quant = 1 / kv_scale_quant_orig
 
+        retrieval_block_table = input_metadata.retrieval_block_tables[self.layer_idx]
+        if input_metadata.retrieval_offload is not None:
+            # The selected cold pages are staged into the GPU in a copy of the table (the selector reads the
+            # original one: the K stats of the cold pages never leave the GPU).
+            retrieval_block_table = input_metadata.retrieval_offload.stage(self.layer_idx, dynamic_sparse_page_idx)
+
         attn_output = fused_attention_per_tensor_sparse.single_query_attention(
             q,
             k,
             v,
             kv_scale_quant_orig,
             kv_scale_orig_quant,
-            input_metadata.retrieval_block_tables[self.layer_idx],
+            retrieval_block_table,
             input_metadata.streaming_block_tables[self.layer_idx],
             retrieval_head_flags,
             head_rank_table,
@@ -298,9 +515,13 @@ class DecodingAttentionWrapper(torch.nn.Module):
             self.neox_rotary_style,
             self.kv_cache_config["INT4_ENABLED"],
             self.kv_cache_config["ZEROS_ENABLED"],
+            self.kv_page_scales,
             self.sub_chunk_size,
             hidden_dim_per_retrieval_token,
             self.multiblock_switch,
+            self.persistent_decode_attention,
+            page_nums,
+            self.get_rotary_cos_sin(q.device),
         )
 
         return attn_output, dynamic_sparse_page_idx
@@ -349,6 +570,8 @@ class DecodingAttentionWrapper(torch.nn.Module):
             self.kv_cache_config["INT4_ENABLED"],
             self.kv_cache_config["ZEROS_ENABLED"],
             2048,  # const int multiblock_switch
+            self.kv_cache_config.get("FP8_ENABLED", False),  # fp8_kv_cache
+            self.get_rotary_cos_sin(q.device),
         )
 
         selected_page_idx = None
@@ -370,11 +593,15 @@ class DecodingAttentionWrapper(torch.nn.Module):
         lengths_per_sample = input_metadata.retrieval_context_lens  # + 1
 
         size_per_retrieval_token = num_retrieval_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
-        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config["INT4_ENABLED"] else 1)
+        size_per_streaming_token = num_streaming_kv_heads * self.head_dim * (1 if self.use_int8 else 2) // (2 if self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]) else 1)
         hidden_dim_per_retrieval_token = num_retrieval_kv_heads * self.head_dim
 
-        if ((timestep) % self.selector_update_interval != 0) and cached_dynamic_sparse_page_idx is not None:      # Since timestep is the length of history, not including the current token. No need to -1 here.
-            dynamic_sparse_page_idx = cached_dynamic_sparse_page_idx
+        static_page_idx = input_metadata.dynamic_sparse_page_idxes    # Not None under CUDA graph decode.
+        page_nums = input_metadata.dynamic_sparse_page_nums    # Only in eager mode.
+        if static_page_idx is not None and not input_metadata.update_dynamic_sparse_pages:
+            dynamic_sparse_page_idx = self.append_local_page(static_page_idx[self.layer_idx], lengths_per_sample)
+        elif static_page_idx is None and self.reuse_cached_pages(q, cached_dynamic_sparse_page_idx, input_metadata):
+            dynamic_sparse_page_idx = self.append_local_page(cached_dynamic_sparse_page_idx, lengths_per_sample, page_nums)
         else:
             dynamic_sparse_page_idx = self.dynamic_select_topk_pages(    
                 q, k, v,
@@ -383,14 +610,26 @@ class DecodingAttentionWrapper(torch.nn.Module):
                 retrieval_head_flags, head_rank_table,
                 lengths_per_sample, sink_size, local_size, sink_blocks, local_blocks,
                 size_per_retrieval_token, size_per_streaming_token,
-                num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token
+                num_retrieval_kv_heads, num_streaming_kv_heads, timestep, hidden_dim_per_retrieval_token,
+                page_nums, input_metadata.max_dynamic_sparse_token_budget, input_metadata.retrieval_page_scores,
             )
+            if static_page_idx is not None:
+                dynamic_sparse_page_idx = static_page_idx[self.layer_idx].copy_(dynamic_sparse_page_idx)
+            else:
+                self.selector_used_page_nums = page_nums is not None
+                if self.selector_drift_threshold > 0:
+                    self.selector_q = q.float()
+
+        retrieval_block_table = input_metadata.retrieval_block_tables[self.layer_idx]
+        if input_metadata.retrieval_offload is not None:
+            # See forward_w_dynamic_sparse_per_tensor.
+            retrieval_block_table = input_metadata.retrieval_offload.stage(self.layer_idx, dynamic_sparse_page_idx)
 
         attn_output = fused_attention_fine_grained_sparse.single_query_attention(
             q,
             k,
             v,
-            input_metadata.retrieval_block_tables[self.layer_idx],
+            retrieval_block_table,
             input_metadata.streaming_block_tables[self.layer_idx],
             retrieval_head_flags,
             head_rank_table,
@@ -411,10 +650,15 @@ class DecodingAttentionWrapper(torch.nn.Module):
             self.rope_scaling_factor,
             self.neox_rotary_style,
             self.kv_cache_config["INT4_ENABLED"],
+            self.kv_cache_config.get("STREAMING_INT4_ENABLED", self.kv_cache_config["INT4_ENABLED"]),  # streaming_int4_kv
             self.kv_cache_config["ZEROS_ENABLED"],
             self.sub_chunk_size,
             hidden_dim_per_retrieval_token,
             self.multiblock_switch,
+            self.persistent_decode_attention,
+            self.kv_cache_config.get("FP8_ENABLED", False),  # fp8_kv_cache
+            page_nums,
+            self.get_rotary_cos_sin(q.device),
         )
 
         return attn_output, dynamic_sparse_page_idx
\ No newline at end of file
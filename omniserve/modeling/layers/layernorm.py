@@ -61,6 +61,7 @@ class RMSNormGeneral(nn.Module):
         self.weight = nn.Parameter(torch.ones(hidden_size))
         self.variance_epsilon = eps
         self.use_per_token_quant = use_per_token_quant
+        self.act_sum = act_sum
         if act_sum:
             self.forward = self.forward_with_act_sum
         else:
@@ -100,6 +101,41 @@ class RMSNormGeneral(nn.Module):
             self.use_per_token_quant,
         )
 
+    def forward_fp16(self, x: torch.Tensor, out: torch.Tensor) -> None:
+        # Unquantized norm output, for consumers that quantize it themselves (the W4A4 prefill MLP).
+        layernorm_ops.rms_norm(out, x, self.weight.data, self.variance_epsilon, False)
+
+    def forward_add_residual(
+        self,
+        x: torch.Tensor,
+        residual: torch.Tensor,
+        quantized_hidden_states_buffer: torch.Tensor,
+        quantized_scale_buffer: torch.Tensor,
+        quantized_sum_buffer: torch.Tensor = None,
+    ) -> torch.Tensor:
+        # residual += x in place, then the quantized norm of residual. x is the all-reduced output of a
+        # row parallel projection (tensor parallel), so the reduction result is consumed in one pass.
+        assert self.use_per_token_quant
+        if self.act_sum:
+            layernorm_ops.add_residual_rms_norm_general_fuse_sum(
+                quantized_hidden_states_buffer,
+                x,
+                residual,
+                self.weight.data,
+                quantized_sum_buffer,
+                quantized_scale_buffer,
+                self.variance_epsilon,
+            )
+        else:
+            layernorm_ops.add_residual_rms_norm_general(
+                quantized_hidden_states_buffer,
+                x,
+                residual,
+                self.weight.data,
+                quantized_scale_buffer,
+                self.variance_epsilon,
+            )
+
 
 class DequantAddResidualI8RMSNormQuant(nn.Module):
     """Root mean square normalization.
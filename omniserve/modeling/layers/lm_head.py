@@ -0,0 +1,90 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""W8A8 LM head on the qgemm kernels.
+
+The fp16 checkpoint weight is quantized per output channel (scale = absmax / 127) at load time and the final
+norm output per token, so the vocabulary projection runs as an int8 GEMM instead of an fp16 one. forward_topk
+additionally fuses a per-row top-k into the GEMM epilogue (gemm_epilogue.EPILOGUE_ROW_TOPK): rows that can be
+sampled from their top TOPK_MAX logits never materialise the full fp16 logits.
+"""
+
+from typing import Optional, Tuple
+
+import omniserve_backend.fused_kernels as fused_kernels
+import torch
+import torch.nn as nn
+
+from .quantized_linear import W8A8OF16LinearDynamicInputScale
+from .quantized_linear.gemm_epilogue import TOPK_MAX
+
+# Widest CTA_N of the W8A8 tile configs; the top-k epilogue needs whole column tiles.
+_VOCAB_ALIGNMENT = 256
+_IN_FEATURES_ALIGNMENT = 64
+
+
+class W8A8LMHead(nn.Module):
+    def __init__(self, linear: W8A8OF16LinearDynamicInputScale) -> None:
+        super().__init__()
+        self.linear = linear
+        self.in_features = linear.in_features
+        self.out_features = linear.out_features
+
+    @staticmethod
+    def supports(linear: nn.Linear) -> bool:
+        return (
+            linear.bias is None
+            and linear.out_features % _VOCAB_ALIGNMENT == 0
+            and linear.in_features % _IN_FEATURES_ALIGNMENT == 0
+        )
+
+    @classmethod
+    @torch.no_grad()
+    def from_linear(cls, linear: nn.Linear) -> "W8A8LMHead":
+        # NOTE: quantizes the fp16 weight of linear in place.
+        s1_scale = linear.weight.abs().amax(dim=1).float().clamp(min=1e-5) / 127
+        q_linear = W8A8OF16LinearDynamicInputScale.from_linear(
+            linear,
+            w_bit=8,
+            s1_scale=s1_scale.half(),
+        )
+        return cls(q_linear.to(linear.weight.device))
+
+    def _quantize_input(self, hidden_states: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor]:
+        hidden_states = hidden_states.contiguous()
+        quantized = torch.empty_like(hidden_states, dtype=torch.int8)
+        scale = torch.empty(hidden_states.size(0), dtype=torch.float16, device=hidden_states.device)
+        fused_kernels.invoke_quant(quantized, hidden_states, scale)
+        return quantized, scale
+
+    def _empty_logits(self, hidden_states: torch.Tensor) -> torch.Tensor:
+        return torch.empty(
+            hidden_states.size(0), self.out_features, dtype=torch.float16, device=hidden_states.device
+        )
+
+    def forward(self, hidden_states: torch.Tensor) -> torch.Tensor:
+        quantized, scale = self._quantize_input(hidden_states)
+        logits = self._empty_logits(hidden_states)
+        self.linear(quantized, scale, logits)
+        return logits
+
+    def forward_topk(
+        self,
+        hidden_states: torch.Tensor,
+        k: int = TOPK_MAX,
+        full_logit_rows: Optional[torch.Tensor] = None,
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Returns (logits, topk_vals, topk_idxes). Only the rows with a non-zero full_logit_rows flag (int32)
+        of logits are written; topk_vals (fp32) / topk_idxes (int32) hold the k largest logits of every row."""
+        quantized, scale = self._quantize_input(hidden_states)
+        logits = self._empty_logits(hidden_states)
+        topk_vals, topk_idxes = self.linear.forward_topk(quantized, scale, logits, k, full_logit_rows)
+        return logits, topk_vals, topk_idxes
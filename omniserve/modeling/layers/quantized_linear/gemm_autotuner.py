@@ -0,0 +1,264 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Shape-keyed tile config selection for the W4A8 / W8A8 / W4A4 GEMMs.
+
+Each GEMM extension exposes a precompiled set of tile configs (see
+GEMM_TILE_CONFIGS in kernels/csrc/qgemm). The best config per
+(kernel, arch, M bucket, N, K) is measured offline and stored in a JSON file,
+so that a server restart does not re-tune. Shapes without an entry fall back
+to the built-in heuristic of the kernel (config_id = -1).
+
+Populate the cache with scripts/qserve_benchmark/tune_gemm.sh, or:
+    python -m omniserve.modeling.layers.quantized_linear.gemm_autotuner --model <hf model dir>
+"""
+
+import argparse
+import json
+import os
+from typing import Dict, List, Optional, Tuple
+
+import omniserve_backend.qgemm_w4a4
+import omniserve_backend.qgemm_w4a8_per_chn
+import omniserve_backend.qgemm_w4a8_per_group
+import omniserve_backend.qgemm_w8a8
+import torch
+
+from omniserve.logger import init_logger
+
+logger = init_logger(__name__)
+
+W8A8 = "w8a8"
+W4A8_PER_CHN = "w4a8_per_chn"
+W4A8_PER_GROUP = "w4a8_per_group"
+W4A4 = "w4a4"
+_GROUP_SIZE = 128  # G in the per-group kernel
+
+# M is bucketed to the next power of 2; larger M share the last bucket.
+_MAX_M_BUCKET = 16384
+M_BUCKETS_TO_TUNE = [2**i for i in range(15) if 2**i <= _MAX_M_BUCKET]
+
+_DEFAULT_CACHE_PATH = os.path.join(
+    os.path.expanduser("~"), ".cache", "omniserve", "gemm_tile_configs.json"
+)
+
+
+def get_cache_path() -> str:
+    return os.environ.get("OMNISERVE_GEMM_TUNING_CACHE", _DEFAULT_CACHE_PATH)
+
+
+def get_arch() -> str:
+    major, minor = torch.cuda.get_device_capability()
+    return f"sm{major}{minor}"
+
+
+def get_m_bucket(m: int) -> int:
+    bucket = 1
+    while bucket < m and bucket < _MAX_M_BUCKET:
+        bucket *= 2
+    return bucket
+
+
+def get_tile_configs(kernel: str) -> List[List[int]]:
+    # CTA_M, CTA_N, CTA_K, WARP_M, WARP_N, WARP_K, STAGES
+    if kernel == W8A8:
+        return omniserve_backend.qgemm_w8a8.w8a8_gemm_tile_configs()
+    elif kernel == W4A8_PER_CHN:
+        return omniserve_backend.qgemm_w4a8_per_chn.gemm_tile_configs()
+    elif kernel == W4A8_PER_GROUP:
+        return omniserve_backend.qgemm_w4a8_per_group.gemm_tile_configs()
+    elif kernel == W4A4:
+        return omniserve_backend.qgemm_w4a4.w4a4_gemm_tile_configs()
+    raise ValueError(f"Unknown gemm kernel {kernel}")
+
+
+def _make_key(kernel: str, arch: str, m_bucket: int, n: int, k: int) -> str:
+    return f"{kernel}|{arch}|{m_bucket}|{n}|{k}"
+
+
+class GemmTileConfigCache:
+    def __init__(self, path: Optional[str] = None):
+        self.path = path if path is not None else get_cache_path()
+        self.configs: Dict[str, int] = {}
+        self._arch = None
+        if os.path.exists(self.path):
+            with open(self.path, "r") as f:
+                self.configs = json.load(f)
+            logger.info(f"Loaded {len(self.configs)} tuned GEMM tile configs from {self.path}")
+
+    @property
+    def arch(self) -> str:
+        if self._arch is None:
+            self._arch = get_arch()
+        return self._arch
+
+    def lookup(self, kernel: str, m: int, n: int, k: int) -> int:
+        if not self.configs:
+            return -1
+        return self.configs.get(_make_key(kernel, self.arch, get_m_bucket(m), n, k), -1)
+
+    def update(self, kernel: str, m_bucket: int, n: int, k: int, config_id: int) -> None:
+        self.configs[_make_key(kernel, self.arch, m_bucket, n, k)] = config_id
+
+    def save(self) -> None:
+        os.makedirs(os.path.dirname(os.path.abspath(self.path)), exist_ok=True)
+        tmp_path = self.path + ".tmp"
+        with open(tmp_path, "w") as f:
+            json.dump(self.configs, f, indent=1, sort_keys=True)
+        os.replace(tmp_path, self.path)
+
+
+_cache: Optional[GemmTileConfigCache] = None
+
+
+def get_gemm_config_id(kernel: str, m: int, n: int, k: int) -> int:
+    """Tuned config_id for this GEMM shape, or -1 for the built-in heuristic."""
+    global _cache
+    if _cache is None:
+        _cache = GemmTileConfigCache()
+    return _cache.lookup(kernel, m, n, k)
+
+
+def _make_inputs(kernel: str, m: int, n: int, k: int) -> Tuple:
+    device = torch.device("cuda")
+    if kernel == W4A4:
+        # Packed int4 activations and weights, one activation scale per row and group.
+        x = torch.randint(-127, 127, (m, k // 2), dtype=torch.int8, device=device)
+        w = torch.randint(-127, 127, (n, k // 2), dtype=torch.int8, device=device)
+        ascales = torch.rand(m, k // omniserve_backend.qgemm_w4a4.GROUP_SIZE, dtype=torch.float16, device=device) * 1e-2
+        wscales = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+        w_szs = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+        a_ssums = torch.rand(m, dtype=torch.float16, device=device)
+        return (x, w, wscales, ascales, w_szs, a_ssums)
+    x = torch.randint(-127, 127, (m, k), dtype=torch.int8, device=device)
+    ascales = torch.rand(m, dtype=torch.float16, device=device) * 1e-2
+    wscales = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+    if kernel == W8A8:
+        w = torch.randint(-127, 127, (n, k), dtype=torch.int8, device=device)
+        return (x, w, wscales, ascales)
+    w = torch.randint(-127, 127, (n, k // 2), dtype=torch.int8, device=device)
+    if kernel == W4A8_PER_CHN:
+        w_szs = torch.rand(n, dtype=torch.float16, device=device) * 1e-2
+        a_ssums = torch.rand(m, dtype=torch.float16, device=device)
+        return (x, w, wscales, ascales, w_szs, a_ssums)
+    zeros = torch.randint(-8, 8, (k // _GROUP_SIZE, n), dtype=torch.int8, device=device)
+    scales_i8 = torch.randint(1, 16, (k // _GROUP_SIZE, n), dtype=torch.int8, device=device)
+    return (x, w, zeros, scales_i8, wscales, ascales)
+
+
+def _get_forward(kernel: str):
+    if kernel == W8A8:
+        return omniserve_backend.qgemm_w8a8.w8a8_gemm_forward_cuda
+    elif kernel == W4A8_PER_CHN:
+        return omniserve_backend.qgemm_w4a8_per_chn.gemm_forward_cuda
+    elif kernel == W4A4:
+        return lambda x, w, wscales, ascales, w_szs, a_ssums, out, config_id: (
+            omniserve_backend.qgemm_w4a4.w4a4_gemm_forward_cuda(
+                x, w, wscales, ascales, w_szs, a_ssums, out, 0, None, config_id
+            )
+        )
+    return omniserve_backend.qgemm_w4a8_per_group.gemm_forward_cuda
+
+
+@torch.no_grad()
+def tune_gemm(
+    kernel: str, m: int, n: int, k: int, warmup: int = 5, iters: int = 20
+) -> Tuple[int, float, float]:
+    """Times every applicable tile config on one shape.
+
+    Returns (best config_id, best time in ms, heuristic time in ms). Configs
+    whose output differs from the heuristic are rejected (e.g. a config that
+    exceeds the shared memory limit of this device and never launches).
+    """
+    forward = _get_forward(kernel)
+    inputs = _make_inputs(kernel, m, n, k)
+    ref = torch.zeros(m, n, dtype=torch.float16, device="cuda")
+    forward(*inputs, ref, -1)
+    out = torch.empty_like(ref)
+
+    def bench(config_id: int) -> float:
+        for _ in range(warmup):
+            forward(*inputs, out, config_id)
+        start = torch.cuda.Event(enable_timing=True)
+        end = torch.cuda.Event(enable_timing=True)
+        start.record()
+        for _ in range(iters):
+            forward(*inputs, out, config_id)
+        end.record()
+        torch.cuda.synchronize()
+        return start.elapsed_time(end) / iters
+
+    best_config_id, best_time = -1, bench(-1)
+    heuristic_time = best_time
+    for config_id, (cta_m, cta_n, cta_k, *_) in enumerate(get_tile_configs(kernel)):
+        if n % cta_n != 0 or k % cta_k != 0:
+            continue
+        out.zero_()
+        forward(*inputs, out, config_id)
+        if not torch.allclose(out, ref, rtol=1e-2, atol=1e-2):
+            continue
+        t = bench(config_id)
+        if t < best_time:
+            best_config_id, best_time = config_id, t
+    return best_config_id, best_time, heuristic_time
+
+
+def get_linear_shapes(model_path: str) -> List[Tuple[int, int]]:
+    # (N, K) of qkv_proj, o_proj, gate_up_proj and down_proj.
+    from transformers import AutoConfig
+
+    config = AutoConfig.from_pretrained(model_path)
+    hidden_size = config.hidden_size
+    head_dim = getattr(config, "head_dim", hidden_size // config.num_attention_heads)
+    q_size = config.num_attention_heads * head_dim
+    kv_size = config.num_key_value_heads * head_dim
+    intermediate_size = config.intermediate_size
+    return [
+        (q_size + 2 * kv_size, hidden_size),
+        (hidden_size, q_size),
+        (2 * intermediate_size, hidden_size),
+        (hidden_size, intermediate_size),
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Tune the W4A8/W8A8 GEMM tile configs for a model.")
+    parser.add_argument("--model", type=str, required=True, help="HF model (config) directory.")
+    parser.add_argument(
+        "--kernels",
+        type=str,
+        nargs="+",
+        default=[W4A8_PER_CHN, W4A8_PER_GROUP, W8A8],
+        choices=[W4A8_PER_CHN, W4A8_PER_GROUP, W8A8, W4A4],
+    )
+    parser.add_argument("--max-m", type=int, default=_MAX_M_BUCKET)
+    parser.add_argument("--cache-path", type=str, default=None)
+    args = parser.parse_args()
+
+    cache = GemmTileConfigCache(args.cache_path)
+    for kernel in args.kernels:
+        for n, k in get_linear_shapes(args.model):
+            for m in M_BUCKETS_TO_TUNE:
+                if m > args.max_m:
+                    break
+                config_id, best_time, heuristic_time = tune_gemm(kernel, m, n, k)
+                cache.update(kernel, m, n, k, config_id)
+                print(
+                    f"[{kernel}] M={m} N={n} K={k}: config {config_id} "
+                    f"{best_time:.4f} ms (heuristic {heuristic_time:.4f} ms)"
+                )
+        # Save after every kernel so that an interrupted run keeps its results.
+        cache.save()
+    print(f"Saved tuned GEMM tile configs to {cache.path}")
+
+
+if __name__ == "__main__":
+    main()
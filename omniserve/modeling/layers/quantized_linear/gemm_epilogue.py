@@ -0,0 +1,46 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Fused epilogues of the W8A8 / W4A8 per-channel GEMMs (kernels/csrc/qgemm/gemm_epilogue.h).
+
+EPILOGUE_RESIDUAL:     out = x @ w.T + residual (residual may alias out).
+EPILOGUE_SILU_AND_MUL: out = silu(gate) * up, for a gate_up_proj whose output channels were
+                       reordered with interleave_gate_up_blocks.
+EPILOGUE_ROW_TOPK:     per-row top-k of out (W8A8 only, w8a8_gemm_topk_forward_cuda), out is only
+                       written for the rows that need full logits.
+Passing quant_out / quant_scale (/ quant_sum) additionally quantizes out per token, from row
+stats collected in the epilogue.
+"""
+
+import omniserve_backend.qgemm_w8a8
+import torch
+
+EPILOGUE_RESIDUAL = omniserve_backend.qgemm_w8a8.EPILOGUE_RESIDUAL
+EPILOGUE_SILU_AND_MUL = omniserve_backend.qgemm_w8a8.EPILOGUE_SILU_AND_MUL
+GLU_BLOCK = omniserve_backend.qgemm_w8a8.EPILOGUE_GLU_BLOCK
+EPILOGUE_ROW_TOPK = omniserve_backend.qgemm_w8a8.EPILOGUE_ROW_TOPK
+TOPK_MAX = omniserve_backend.qgemm_w8a8.EPILOGUE_TOPK_MAX
+
+
+def interleave_gate_up_blocks(t: torch.Tensor) -> torch.Tensor:
+    """[gate; up] along dim 0 -> [gate 0:32, up 0:32, gate 32:64, up 32:64, ...].
+
+    The packed W4A8 weights store every 32 output channels contiguously, so whole blocks can be
+    moved without unpacking.
+    """
+    num_blocks = t.shape[0] // GLU_BLOCK
+    assert t.shape[0] % (2 * GLU_BLOCK) == 0
+    half_blocks = num_blocks // 2
+    block_perm = torch.stack(
+        [torch.arange(half_blocks), torch.arange(half_blocks) + half_blocks], dim=1
+    ).flatten().to(t.device)
+    blocks = t.reshape(num_blocks, -1)
+    return blocks[block_perm].reshape(t.shape)
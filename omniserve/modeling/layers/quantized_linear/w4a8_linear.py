@@ -9,10 +9,38 @@
 #   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
 #   year={2025}
 # }
+import omniserve_backend.qgemm_w4a4
 import omniserve_backend.qgemm_w4a8_per_chn
 import omniserve_backend.qgemm_w4a8_per_group
 import torch
 
+from .gemm_autotuner import W4A4, W4A8_PER_CHN, W4A8_PER_GROUP, get_gemm_config_id
+from .gemm_epilogue import interleave_gate_up_blocks
+
+W4A4_GROUP_SIZE = omniserve_backend.qgemm_w4a4.GROUP_SIZE
+
+
+def unpack_per_chn_qweight(qweight: torch.Tensor) -> torch.Tensor:
+    """Inverse of the per-channel weight packing of from_linear: [N, K / 2] int8 -> [N, K] uint4 values (int32)."""
+    n, k = qweight.shape[0], qweight.shape[1] * 2
+    packed = qweight.int().reshape(n // 32, k // 32, 8, 4, 2, 2, 4)
+    # (N // 32, K // 32, 8, 4, 2, 2, 4, [2]): the last dim is the pair of a byte (low nibble first).
+    unpacked = torch.stack([packed & 0xF, (packed >> 4) & 0xF], dim=-1)
+    # Back to the (N // 32, 2, 2, 8, K // 32, 2, 4, 4) view of the [N, K] weight.
+    return unpacked.permute(0, 7, 5, 2, 1, 4, 3, 6).reshape(n, k)
+
+
+def pack_w4a4_qweight(weight: torch.Tensor) -> torch.Tensor:
+    """[N, K] uint4 values -> [N, K / 2] int8 for the W4A4 GEMM: input channel 2i in the low nibble of byte i."""
+    pairs = weight.reshape(weight.shape[0], -1, 2)
+    return (pairs[..., 0] | (pairs[..., 1] << 4)).to(torch.uint8).view(torch.int8).contiguous()
+
+
+def quantize_w4a4_input(out, x, scales, sums):
+    """Per-group int4 quantization of fp16 x (M x K) into out (M x K / 2), scales (M x K / W4A4_GROUP_SIZE) and the
+    dequantized row sums (M), the inputs of W4A8OF16LinearDynamicInputScale.forward_w4a4."""
+    omniserve_backend.qgemm_w4a4.w4a4_quant_forward_cuda(out, x, scales, sums)
+
 
 class W4A8OF16LinearDynamicInputScale(torch.nn.Module):
     def __init__(
@@ -117,11 +145,106 @@ class W4A8OF16LinearDynamicInputScale(torch.nn.Module):
             self.s1_szeros,
             input_sum,
             output_buffer,
+            get_gemm_config_id(W4A8_PER_CHN, x.shape[0], self.out_features, self.in_features),
         )
         output_bias = self.bias
         if output_bias is not None:
             output_buffer += output_bias
 
+    @torch.no_grad()
+    def forward_per_chn_epilogue(
+        self,
+        x,
+        input_scales,
+        input_sum,
+        output_buffer,
+        epilogue,
+        residual=None,
+        quant_out=None,
+        quant_scale=None,
+        quant_sum=None,
+    ):
+        # See gemm_epilogue.py. For EPILOGUE_SILU_AND_MUL, output_buffer has out_features // 2 columns.
+        assert self.per_channel and self.bias is None
+        omniserve_backend.qgemm_w4a8_per_chn.gemm_epilogue_forward_cuda(
+            x,
+            self.qweight,
+            self.s1_scales,
+            input_scales,
+            self.s1_szeros,
+            input_sum,
+            output_buffer,
+            epilogue,
+            residual,
+            quant_out,
+            quant_scale,
+            quant_sum,
+            get_gemm_config_id(W4A8_PER_CHN, x.shape[0], self.out_features, self.in_features),
+        )
+
+    @torch.no_grad()
+    def forward_quant_input(self, x, input_scales, input_sum, output_buffer, epilogue=0, residual=None):
+        # fp16 x, quantized per token in the GEMM prologue; input_scales (/ input_sum for per-channel weights)
+        # receive the same values as invoke_quant(_fuse_sum) would write. Epilogues are per-channel only.
+        assert self.bias is None
+        if self.per_channel:
+            omniserve_backend.qgemm_w4a8_per_chn.gemm_quant_a_forward_cuda(
+                x,
+                self.qweight,
+                self.s1_scales,
+                input_scales,
+                self.s1_szeros,
+                input_sum,
+                output_buffer,
+                epilogue,
+                residual,
+                config_id=get_gemm_config_id(W4A8_PER_CHN, x.shape[0], self.out_features, self.in_features),
+            )
+            return
+        assert epilogue == 0
+        omniserve_backend.qgemm_w4a8_per_group.gemm_quant_a_forward_cuda(
+            x,
+            self.qweight,
+            self.s2_zeros,
+            self.s2_scales,
+            self.s1_scales,
+            input_scales,
+            output_buffer,
+            get_gemm_config_id(W4A8_PER_GROUP, x.shape[0], self.out_features, self.in_features),
+        )
+
+    @torch.no_grad()
+    def prepare_w4a4(self):
+        # Plain int4 copy of the per-channel weights for forward_w4a4 (prefill); qweight stays for decoding. Run
+        # after interleave_gate_up, the output channels keep its order.
+        assert self.per_channel and self.bias is None and self.in_features % W4A4_GROUP_SIZE == 0
+        self.register_buffer("w4a4_qweight", pack_w4a4_qweight(unpack_per_chn_qweight(self.qweight)))
+
+    @torch.no_grad()
+    def forward_w4a4(self, x, input_scales, input_sum, output_buffer, epilogue=0, residual=None):
+        # x: int4 activations packed by quantize_w4a4_input (M x K / 2 int8), input_scales: M x K / W4A4_GROUP_SIZE
+        # group scales, input_sum: dequantized row sums. Same epilogues as forward_per_chn_epilogue, no quant_out.
+        omniserve_backend.qgemm_w4a4.w4a4_gemm_forward_cuda(
+            x,
+            self.w4a4_qweight,
+            self.s1_scales,
+            input_scales,
+            self.s1_szeros,
+            input_sum,
+            output_buffer,
+            epilogue,
+            residual,
+            get_gemm_config_id(W4A4, x.shape[0], self.out_features, self.in_features),
+        )
+
+    @torch.no_grad()
+    def interleave_gate_up(self):
+        # Reorders a fused [gate; up] projection for the SiLU-and-mul GEMM epilogue.
+        assert self.per_channel and self.bias is None
+        self.qweight.copy_(interleave_gate_up_blocks(self.qweight))
+        self.s1_scales.copy_(interleave_gate_up_blocks(self.s1_scales))
+        self.s1_szeros.copy_(interleave_gate_up_blocks(self.s1_szeros))
+
     @torch.no_grad()
     def forward_per_group(self, x, input_scales, input_sum, output_buffer):
         # input sum is of no use here. Only to keep the interface consistent
@@ -133,6 +256,7 @@ class W4A8OF16LinearDynamicInputScale(torch.nn.Module):
             self.s1_scales,
             input_scales,
             output_buffer,
+            get_gemm_config_id(W4A8_PER_GROUP, x.shape[0], self.out_features, self.in_features),
         )
         output_bias = self.bias
         if output_bias is not None:
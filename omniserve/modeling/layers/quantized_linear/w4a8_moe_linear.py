@@ -1,7 +1,8 @@
+import omniserve_backend.qgemm_w4a8_per_chn
 import torch
 
-# import my_moegemm as mygemm
-# MoE release will come in the future.
+from .gemm_autotuner import W4A8_PER_CHN, get_gemm_config_id
+from .gemm_epilogue import interleave_gate_up_blocks
 
 
 class MoEW4A8OF16LinearDynamicInputScale(torch.nn.Module):
@@ -80,22 +81,58 @@ class MoEW4A8OF16LinearDynamicInputScale(torch.nn.Module):
             self.bias = None
 
     @torch.no_grad()
-    def forward(self, x, input_scales, input_sum, problem_sizes):
-        raise NotImplementedError("MOE implementation is yet to be released.")
-        # output_buffer = mygemm.moe_gemm_forward_cuda_api(
-        #     x,
-        #     self.qweight,
-        #     self.s1_scales,
-        #     input_scales,
-        #     self.s1_szeros,
-        #     input_sum,
-        #     problem_sizes,
-        # )
-        # return output_buffer
-
-        # output_bias = self.bias
-        # if output_bias is not None:
-        #     output_buffer += output_bias
+    def forward(
+        self,
+        x,
+        input_scales,
+        input_sum,
+        expert_offsets,
+        output_buffer,
+        epilogue=0,
+        quant_out=None,
+        quant_scale=None,
+        quant_sum=None,
+    ):
+        # x holds the routed rows sorted by expert (moe_helpers.moe_expand_inputs_and_scales);
+        # expert_offsets[e]:expert_offsets[e + 1] are the rows of expert e. See gemm_epilogue.py for
+        # the epilogues; the residual epilogue does not apply to routed rows.
+        assert self.bias is None, "Biased MoE experts are not supported."
+        omniserve_backend.qgemm_w4a8_per_chn.grouped_gemm_forward_cuda(
+            x,
+            self.qweight,
+            self.s1_scales,
+            input_scales,
+            self.s1_szeros,
+            input_sum,
+            expert_offsets,
+            output_buffer,
+            epilogue,
+            None,
+            quant_out,
+            quant_scale,
+            quant_sum,
+            get_gemm_config_id(
+                W4A8_PER_CHN,
+                x.shape[0] // self.num_experts,
+                self.out_features,
+                self.in_features,
+            ),
+        )
+
+    @torch.no_grad()
+    def interleave_gate_up(self):
+        # Reorders the fused [w1; w3] projection of every expert for the SiLU-and-mul GEMM epilogue.
+        assert self.bias is None
+        for expert_idx in range(self.num_experts):
+            self.qweight[expert_idx].copy_(
+                interleave_gate_up_blocks(self.qweight[expert_idx])
+            )
+            self.s1_scales[expert_idx].copy_(
+                interleave_gate_up_blocks(self.s1_scales[expert_idx])
+            )
+            self.s1_szeros[expert_idx].copy_(
+                interleave_gate_up_blocks(self.s1_szeros[expert_idx])
+            )
 
     @classmethod
     def from_linear(
@@ -109,6 +146,7 @@ class MoEW4A8OF16LinearDynamicInputScale(torch.nn.Module):
     ):
         q_linear = cls(
             w_bit,
+            len(linears),
             linears[0].in_features,
             linears[0].out_features,
             linears[0].bias is not None,
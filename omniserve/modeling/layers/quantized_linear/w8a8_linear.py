@@ -14,6 +14,9 @@ from typing import Optional, Union
 import omniserve_backend.qgemm_w8a8 as qgemm
 import torch
 
+from .gemm_autotuner import W8A8, get_gemm_config_id
+from .gemm_epilogue import interleave_gate_up_blocks
+
 
 class W8A8OF16LinearStaticScale(torch.nn.Module):
     def __init__(
@@ -102,7 +105,12 @@ class W8A8OF16LinearDynamicInputScale(W8A8OF16LinearStaticScale):
             assert 0, "Not implemented"
             x = x.view(-1, x_shape[-1])
         qgemm.w8a8_gemm_forward_cuda(
-            x, self.weight, self.dequant_scale.half(), input_scale.half(), output_buffer
+            x,
+            self.weight,
+            self.dequant_scale.half(),
+            input_scale.half(),
+            output_buffer,
+            get_gemm_config_id(W8A8, x.shape[0], output_buffer.shape[-1], x.shape[-1]),
         )
         if len(x.shape) > 2:
             assert 0, "Not implemented 2"
@@ -115,6 +123,58 @@ class W8A8OF16LinearDynamicInputScale(W8A8OF16LinearStaticScale):
         if output_bias is not None:
             output_buffer += output_bias
 
+    @torch.no_grad()
+    def forward_epilogue(
+        self,
+        input_,
+        input_scale,
+        output_buffer,
+        epilogue,
+        residual=None,
+        quant_out=None,
+        quant_scale=None,
+        quant_sum=None,
+    ):
+        # See gemm_epilogue.py. For EPILOGUE_SILU_AND_MUL, output_buffer has out_features // 2 columns.
+        assert self.bias is None
+        qgemm.w8a8_gemm_epilogue_forward_cuda(
+            input_,
+            self.weight,
+            self.dequant_scale.half(),
+            input_scale.half(),
+            output_buffer,
+            epilogue,
+            residual,
+            quant_out,
+            quant_scale,
+            quant_sum,
+            get_gemm_config_id(W8A8, input_.shape[0], self.out_features, input_.shape[-1]),
+        )
+
+    @torch.no_grad()
+    def forward_topk(self, input_, input_scale, output_buffer, k, full_logit_rows=None):
+        # EPILOGUE_ROW_TOPK: returns the k largest outputs of every row (fp32 values, int32 channels), and
+        # output_buffer is only written for the rows with a non-zero full_logit_rows flag.
+        assert self.bias is None
+        return qgemm.w8a8_gemm_topk_forward_cuda(
+            input_,
+            self.weight,
+            self.dequant_scale.half(),
+            input_scale.half(),
+            output_buffer,
+            k,
+            full_logit_rows,
+            get_gemm_config_id(W8A8, input_.shape[0], self.out_features, input_.shape[-1]),
+        )
+
+    @torch.no_grad()
+    def interleave_gate_up(self):
+        # Reorders a fused [gate; up] projection for the SiLU-and-mul GEMM epilogue.
+        assert self.bias is None
+        self.weight.copy_(interleave_gate_up_blocks(self.weight))
+        if self.dequant_scale.numel() == self.out_features:
+            self.dequant_scale.copy_(interleave_gate_up_blocks(self.dequant_scale))
+
     @classmethod
     def from_linear(
         cls,
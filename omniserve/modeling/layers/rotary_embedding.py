@@ -0,0 +1,95 @@
+import math
+from typing import Dict, Optional, Tuple
+
+import torch
+
+# (rotary_dim, base, scaling key, max_positions, device) -> max_positions x rotary_dim / 2 x 2 fp32 (cos, sin).
+# One table is shared by all the layers, and by the kv cache update, page selector and decoding kernels.
+_ROTARY_COS_SIN_CACHE: Dict[Tuple, torch.Tensor] = {}
+
+
+def get_rope_scaling_type(rope_scaling: Optional[Dict]) -> str:
+    if rope_scaling is None:
+        return "none"
+    # transformers >= 4.43 configs (e.g., Llama-3.1) use "rope_type", older ones "type".
+    scaling_type = rope_scaling.get("rope_type", rope_scaling.get("type"))
+    if scaling_type in ("default", None):
+        return "none"
+    if scaling_type not in ("linear", "llama3", "yarn"):
+        raise NotImplementedError(f"Unsupported rope scaling type {scaling_type}")
+    return scaling_type
+
+
+def get_rope_scaling_factor(rope_scaling: Optional[Dict]) -> float:
+    # The factor of the on-the-fly kernel path (RotaryScalingType::kLINEAR). The other scalings only go
+    # through the table.
+    if get_rope_scaling_type(rope_scaling) == "linear":
+        return rope_scaling["factor"]
+    return 1.0
+
+
+def _yarn_find_correction_dim(num_rotations, dim, base, max_position_embeddings):
+    return (dim * math.log(max_position_embeddings / (num_rotations * 2 * math.pi))) / (2 * math.log(base))
+
+
+def _compute_inv_freq(rotary_dim: int, base: float, rope_scaling: Optional[Dict]) -> Tuple[torch.Tensor, float]:
+    # Same frequencies as transformers' ROPE_INIT_FUNCTIONS, in float64. Returns (inv_freq, attention scaling).
+    inv_freq = 1.0 / (base ** (torch.arange(0, rotary_dim, 2, dtype=torch.float64) / rotary_dim))
+    scaling_type = get_rope_scaling_type(rope_scaling)
+    if scaling_type == "none":
+        return inv_freq, 1.0
+    factor = rope_scaling["factor"]
+    if scaling_type == "linear":
+        return inv_freq / factor, 1.0
+    if scaling_type == "llama3":
+        low_freq_factor = rope_scaling["low_freq_factor"]
+        high_freq_factor = rope_scaling["high_freq_factor"]
+        old_context_len = rope_scaling["original_max_position_embeddings"]
+        low_freq_wavelen = old_context_len / low_freq_factor
+        high_freq_wavelen = old_context_len / high_freq_factor
+        wavelen = 2 * math.pi / inv_freq
+        # Long wavelengths are interpolated, short ones kept, and the ones in between smoothly blended.
+        smooth = (old_context_len / wavelen - low_freq_factor) / (high_freq_factor - low_freq_factor)
+        smoothed = (1 - smooth) * inv_freq / factor + smooth * inv_freq
+        inv_freq = torch.where(wavelen > low_freq_wavelen, inv_freq / factor, inv_freq)
+        is_medium = (wavelen >= high_freq_wavelen) & (wavelen <= low_freq_wavelen)
+        return torch.where(is_medium, smoothed, inv_freq), 1.0
+    # YaRN: ramp between the interpolated and extrapolated frequencies. The attention temperature is folded into
+    # cos / sin, so that q . k is scaled by attention_factor ** 2 (= 1 / t in the paper).
+    beta_fast = rope_scaling.get("beta_fast", 32)
+    beta_slow = rope_scaling.get("beta_slow", 1)
+    old_context_len = rope_scaling["original_max_position_embeddings"]
+    low = max(math.floor(_yarn_find_correction_dim(beta_fast, rotary_dim, base, old_context_len)), 0)
+    high = min(math.ceil(_yarn_find_correction_dim(beta_slow, rotary_dim, base, old_context_len)), rotary_dim - 1)
+    if low == high:
+        high += 0.001
+    ramp = torch.clamp((torch.arange(rotary_dim // 2, dtype=torch.float64) - low) / (high - low), 0, 1)
+    extrapolation_factor = 1 - ramp
+    inv_freq = inv_freq / factor * (1 - extrapolation_factor) + inv_freq * extrapolation_factor
+    attention_factor = rope_scaling.get("attention_factor")
+    if attention_factor is None:
+        attention_factor = 0.1 * math.log(factor) + 1.0 if factor > 1 else 1.0
+    return inv_freq, attention_factor
+
+
+def get_rotary_cos_sin(
+    rotary_dim: int,
+    base: float,
+    rope_scaling: Optional[Dict],
+    max_positions: int,
+    device: torch.device,
+) -> torch.Tensor:
+    # The kernels index the table with the absolute position of a token, so it must cover every position
+    # the kv cache can hold (kv_max_seq_len of the model).
+    scaling_key = None
+    if get_rope_scaling_type(rope_scaling) != "none":
+        scaling_key = tuple(sorted((k, v) for k, v in rope_scaling.items() if not isinstance(v, (list, dict))))
+    key = (rotary_dim, float(base), scaling_key, max_positions, str(device))
+    table = _ROTARY_COS_SIN_CACHE.get(key)
+    if table is None:
+        inv_freq, attention_factor = _compute_inv_freq(rotary_dim, base, rope_scaling)
+        freqs = torch.outer(torch.arange(max_positions, dtype=torch.float64), inv_freq)
+        table = torch.stack([freqs.cos(), freqs.sin()], dim=-1) * attention_factor
+        table = table.to(device=device, dtype=torch.float32).contiguous()
+        _ROTARY_COS_SIN_CACHE[key] = table
+    return table
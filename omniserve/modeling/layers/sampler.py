@@ -12,7 +12,8 @@
 # }
 """A layer that samples the next tokens from the model's outputs."""
 
-from typing import List
+from typing import List, Optional, Tuple
+import omniserve_backend.sampling_ops as sampling_ops
 import torch
 import torch.nn as nn
 from transformers.generation.logits_process import (
@@ -23,7 +24,12 @@ from transformers.generation.logits_process import (
 )
 
 from omniserve.sampling_params import SamplingParams
+from omniserve.sequence import SequenceData, SequenceGroupMetadata
 from omniserve.utils.input_metadata import InputMetadata
+from omniserve.utils.utils import async_h2d
+
+from .lm_head import W8A8LMHead
+from .quantized_linear.gemm_epilogue import TOPK_MAX
 
 
 def prepare_logits_processor(
@@ -50,6 +56,95 @@ def prepare_logits_processor(
     return processor_list
 
 
+def _is_candidate_row(sampling_params: SamplingParams, lm_head_topk: int) -> bool:
+    # Same greedy rule as sampling_ops.batched_sampling.
+    greedy = sampling_params.temperature < 1e-5 or sampling_params.top_k == 1
+    return sampling_params.repetition_penalty == 1.0 and (greedy or 0 < sampling_params.top_k <= lm_head_topk)
+
+
+class SamplingTensors:
+    """Sampling parameters of every row of the batch (one row per sequence) for sampling_ops.batched_sampling.
+
+    The repetition penalty covers the prompt and output tokens of the sequence, as a CSR list of unique tokens
+    over the rows whose penalty is not 1.
+
+    With lm_head_topk > 0 (W8A8LMHead.forward_topk), the rows are also split into candidate rows, which can be
+    sampled from their top lm_head_topk logits (greedy, or top-k <= lm_head_topk, without repetition penalty),
+    and full-logit rows: full_logit_rows flags the latter, full_logit_row_ids / full_logit_tensors are their
+    indices and their own SamplingTensors when the batch mixes both kinds.
+    """
+
+    def __init__(
+        self,
+        temperatures: torch.Tensor,
+        top_ks: torch.Tensor,
+        top_ps: torch.Tensor,
+        repetition_penalties: torch.Tensor,
+        penalty_offsets: Optional[torch.Tensor] = None,
+        penalty_token_ids: Optional[torch.Tensor] = None,
+    ) -> None:
+        self.temperatures = temperatures
+        self.top_ks = top_ks
+        self.top_ps = top_ps
+        self.repetition_penalties = repetition_penalties
+        self.penalty_offsets = penalty_offsets
+        self.penalty_token_ids = penalty_token_ids
+        self.num_candidate_rows = 0
+        self.full_logit_rows: Optional[torch.Tensor] = None
+        self.full_logit_row_ids: Optional[torch.Tensor] = None
+        self.full_logit_tensors: Optional["SamplingTensors"] = None
+
+    @classmethod
+    def from_seq_group_metadata_list(
+        cls,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+        device: torch.device,
+        lm_head_topk: int = 0,
+        num_samples: Optional[List[int]] = None,
+    ) -> "SamplingTensors":
+        rows = [
+            (seq_group_metadata.sampling_params, seq_data)
+            for seq_group_metadata in seq_group_metadata_list
+            for seq_data in seq_group_metadata.seq_data.values()
+        ]
+        if num_samples is not None:
+            # Parallel sampling in a prompt run: the single sequence of each group is sampled num_samples times.
+            rows = [row for row, count in zip(rows, num_samples) for _ in range(count)]
+        sampling_tensors = cls._from_rows(rows, device)
+        if lm_head_topk > 0:
+            full_logit_rows = [not _is_candidate_row(sampling_params, lm_head_topk) for sampling_params, _ in rows]
+            full_logit_row_ids = [i for i, full in enumerate(full_logit_rows) if full]
+            sampling_tensors.num_candidate_rows = len(rows) - len(full_logit_row_ids)
+            sampling_tensors.full_logit_rows = async_h2d(full_logit_rows, dtype=torch.int, device=device)
+            if 0 < sampling_tensors.num_candidate_rows < len(rows):
+                sampling_tensors.full_logit_row_ids = async_h2d(full_logit_row_ids, dtype=torch.long, device=device)
+                sampling_tensors.full_logit_tensors = cls._from_rows([rows[i] for i in full_logit_row_ids], device)
+        return sampling_tensors
+
+    @classmethod
+    def _from_rows(cls, rows: List[Tuple[SamplingParams, SequenceData]], device: torch.device) -> "SamplingTensors":
+        temperatures, top_ks, top_ps, repetition_penalties = [], [], [], []
+        penalty_offsets, penalty_token_ids = [0], []
+        for sampling_params, seq_data in rows:
+            temperatures.append(sampling_params.temperature)
+            top_ks.append(sampling_params.top_k)
+            top_ps.append(sampling_params.top_p)
+            repetition_penalties.append(sampling_params.repetition_penalty)
+            if sampling_params.repetition_penalty != 1.0:
+                # Negative ids are tokens still being sampled (async engine loop).
+                penalty_token_ids.extend(token_id for token_id in set(seq_data.get_token_ids()) if token_id >= 0)
+            penalty_offsets.append(len(penalty_token_ids))
+        has_penalty = len(penalty_token_ids) > 0
+        return cls(
+            temperatures=async_h2d(temperatures, dtype=torch.float, device=device),
+            top_ks=async_h2d(top_ks, dtype=torch.int, device=device),
+            top_ps=async_h2d(top_ps, dtype=torch.float, device=device),
+            repetition_penalties=async_h2d(repetition_penalties, dtype=torch.float, device=device),
+            penalty_offsets=async_h2d(penalty_offsets, dtype=torch.int, device=device) if has_penalty else None,
+            penalty_token_ids=async_h2d(penalty_token_ids, dtype=torch.int, device=device) if has_penalty else None,
+        )
+
+
 class Sampler(nn.Module):
     """Samples the next tokens from the model's outputs."""
 
@@ -63,16 +158,70 @@ class Sampler(nn.Module):
             self.sampling_params.top_k,
         )
 
+    def forward_lm_head(
+        self,
+        input_ids: torch.Tensor,
+        lm_head: nn.Module,
+        hidden_states: torch.Tensor,
+        input_metadata: InputMetadata,
+        sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
+    ) -> torch.Tensor:
+        """Runs lm_head on the last hidden states and samples the next tokens.
+
+        With a W8A8LMHead and the row split of SamplingTensors (lm_head_topk), the candidate rows sample from
+        the top-k fused into the LM head GEMM and full logits are computed only for the other rows.
+        """
+        if (
+            not isinstance(lm_head, W8A8LMHead)
+            or sampling_tensors is None
+            or sampling_tensors.num_candidate_rows == 0
+            or len(sampling_params.decoding_sim_token_ids) > 0
+        ):
+            return self(input_ids, lm_head(hidden_states), input_metadata, sampling_params, sampling_tensors)
+        logits, topk_vals, topk_idxes = lm_head.forward_topk(
+            hidden_states, TOPK_MAX, sampling_tensors.full_logit_rows
+        )
+        # The candidates are sorted, so greedy rows pick the first one. The results of the full-logit rows are
+        # replaced below; their top-k is clamped only to stay within the candidates.
+        sampled = sampling_ops.batched_sampling(
+            topk_vals,
+            sampling_tensors.temperatures,
+            sampling_tensors.top_ks.clamp(max=TOPK_MAX),
+            sampling_tensors.top_ps,
+            torch.ones_like(sampling_tensors.repetition_penalties),
+            torch.rand(topk_vals.size(0), dtype=torch.float, device=topk_vals.device),
+        )
+        tokens = topk_idxes.gather(1, sampled.unsqueeze(1)).squeeze(1).long()
+        full_logit_tensors = sampling_tensors.full_logit_tensors
+        if full_logit_tensors is not None:
+            row_ids = sampling_tensors.full_logit_row_ids
+            tokens[row_ids] = self(input_ids, logits[row_ids], input_metadata, sampling_params, full_logit_tensors)
+        return tokens
+
     def forward(
         self,
         input_ids: torch.Tensor,
         logits: torch.Tensor,
         input_metadata: InputMetadata,
         sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
     ) -> torch.Tensor:
         if len(sampling_params.decoding_sim_token_ids) > 0:
             token = sampling_params.decoding_sim_token_ids.pop(0)
             return torch.tensor([token], device=input_ids.device, dtype=input_ids.dtype)
+        if sampling_tensors is not None:
+            # Per-row parameters in a single launch; sampling_params only carries the decoding simulation then.
+            return sampling_ops.batched_sampling(
+                logits.contiguous(),
+                sampling_tensors.temperatures,
+                sampling_tensors.top_ks,
+                sampling_tensors.top_ps,
+                sampling_tensors.repetition_penalties,
+                torch.rand(logits.size(0), dtype=torch.float, device=logits.device),
+                sampling_tensors.penalty_offsets,
+                sampling_tensors.penalty_token_ids,
+            )
         output_ids = input_ids.clone()
         if self.logits_processor:
             if sampling_params.repetition_penalty > 1.0:
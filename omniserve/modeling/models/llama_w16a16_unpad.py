@@ -41,8 +41,9 @@ from transformers import LlamaConfig
 import omniserve.utils.constants
 from omniserve.modeling.layers.activation import SiluAndMul
 from omniserve.modeling.layers.layernorm import RMSNorm, RMSNormGeneral
-from omniserve.modeling.layers.sampler import Sampler
-from omniserve.modeling.layers.ctx_update_kv import ApplyBiasRopeUpdateKVCacheWrapper, PagedMinMaxPoolWrapper
+from omniserve.modeling.layers.lm_head import W8A8LMHead
+from omniserve.modeling.layers.sampler import Sampler, SamplingTensors
+from omniserve.modeling.layers.ctx_update_kv import ApplyBiasRopeUpdateKVCacheWrapper
 from omniserve.sampling_params import SamplingParams
 from omniserve.utils.input_metadata import InputMetadata
 from omniserve.utils.quant_config import QServeQuantConfig
@@ -166,6 +167,12 @@ class LlamaAttention(nn.Module):
         self.dynamic_sparse_token_budget = model_config.sp_attn_config.get_dec_dynamic_sparse_token_budget()
         self.sub_chunk_size = self.tokens_per_block // self.sub_chunk_per_block
         self.selector_update_interval = model_config.sp_attn_config.get_dec_selector_update_interval()
+        self.super_page_size = model_config.sp_attn_config.get_dec_super_page_size()
+        self.num_selected_super_pages = model_config.sp_attn_config.get_dec_num_selected_super_pages()
+        self.selector_drift_threshold = model_config.sp_attn_config.get_dec_selector_drift_threshold()
+        self.persistent_decode_attention = model_config.sp_attn_config.get_dec_persistent_attention()
+        self.gqa_page_selection = model_config.sp_attn_config.get_dec_gqa_page_selection()
+        self.ctx_dynamic_sparse = model_config.sp_attn_config.ctx_dynamic_sparse_enabled()
         self.multiblock_switch = model_config.multiblock_switch
 
         self.alibi_slopes = None                                                            
@@ -178,10 +185,9 @@ class LlamaAttention(nn.Module):
             self.head_dim, self.rope_theta, self.rope_scaling,
             self.max_position_embeddings, self.neox_rotary_style,
             self.kv_quant_granularity, self.kv_cache_config, self.use_int8,
-        )
-        self.paged_min_max_pool_wrapper = PagedMinMaxPoolWrapper(
-            self.layer_idx, self.tokens_per_block, self.sub_chunk_per_block,
-            self.head_dim, self.kv_cache_config, self.use_int8
+            self.sub_chunk_size if self.sparse_decode_mode != 0 else 0,
+            self.super_page_size if self.sparse_decode_mode != 0 else 0,
+            self.kv_max_seq_len,  # rotary_max_positions, same cos / sin table as the decoding wrapper
         )
         self.decoding_attention_wrapper = DecodingAttentionWrapper(
             self.layer_idx, self.sparse_kv_cache_enabled,
@@ -189,7 +195,10 @@ class LlamaAttention(nn.Module):
             self.rotary_embedding_dim, self.rope_theta, self.rope_scaling,
             self.neox_rotary_style, self.kv_quant_granularity, self.kv_cache_config, self.use_int8,
             self.sparse_decode_mode, self.sub_chunk_size, self.dynamic_sparse_token_budget,
-            self.multiblock_switch, self.selector_update_interval
+            self.multiblock_switch, self.selector_update_interval,
+            self.super_page_size, self.num_selected_super_pages, self.selector_drift_threshold,
+            self.persistent_decode_attention,
+            self.gqa_page_selection,
         )
 
 
@@ -223,6 +232,15 @@ class LlamaAttention(nn.Module):
             kv_scale_quant_orig = self.kv_scale_quant_orig.float()
             kv_scale_orig_quant = 1 / kv_scale_quant_orig
 
+            spec_root_qkv = chunk_qkv = None
+            if input_metadata.spec_tree_mask is not None:
+                # Speculative decoding: the page selector applies RoPE itself, so the root queries of the draft
+                # trees are taken before apply_bias_rope_update_kv_cache rotates the QKV buffer in place.
+                spec_root_qkv = qkv[input_metadata.cu_seqlens[:-1].long()]
+            elif self.ctx_dynamic_sparse and input_metadata.prompt_kv_lens is not None:
+                # Same for the chunks after a cached prefix, selecting with their mean query.
+                chunk_qkv = self.decoding_attention_wrapper.pool_chunk_qkv(qkv, input_metadata, self.q_size)
+
             self.apply_bias_rope_update_kv_cache_wrapper(
                 qkv, input_metadata, 
                 self.retrieval_head_flags, self.head_rank_table,
@@ -239,22 +257,51 @@ class LlamaAttention(nn.Module):
             k = k.reshape(k.size(0), self.num_kv_heads, self.head_dim)
             v = v.reshape(v.size(0), self.num_kv_heads, self.head_dim)
             
-            if self.sparse_decode_mode != 0:
-                k = k.contiguous()
-                self.paged_min_max_pool_wrapper(
-                    k, input_metadata, self.pooling_heads_idx, self.num_retrieval_kv_heads
+            if input_metadata.context_parallel is not None:
+                # Context parallelism: the other instances hold the K / V of the rest of the prompt.
+                attn_output = self.ring_context_attention_wrapper(q, k, v, input_metadata)
+            elif input_metadata.prompt_kv_lens is not None:
+                # Prefix caching: the cached tokens are only in the KV pages.
+                prefix_page_idx = None
+                if spec_root_qkv is not None:
+                    prefix_page_idx = self.decoding_attention_wrapper.select_verification_pages(
+                        spec_root_qkv, input_metadata,
+                        self.retrieval_head_flags, self.head_rank_table,
+                        self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                        self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    )
+                elif chunk_qkv is not None:
+                    prefix_page_idx = self.decoding_attention_wrapper.select_chunk_pages(
+                        chunk_qkv, input_metadata,
+                        self.retrieval_head_flags, self.head_rank_table,
+                        self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                        self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    )
+                attn_output = self.paged_context_attention_wrapper(
+                    q, k, v,
+                    input_metadata,
+                    input_metadata.prompt_kv_lens,
+                    input_metadata.max_prompt_kv_len,
+                    self.retrieval_head_flags, self.head_rank_table,
+                    self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                    self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    dynamic_sparse_page_idxes=prefix_page_idx,
+                )
+            else:
+                head_mask_type, streaming_info = self.head_mask_type, self.streaming_info
+                if input_metadata.static_sparsity is not None:
+                    # A sparser static sparsity level requested by the prompts of the step.
+                    head_mask_type, streaming_info = self.level_head_mask_types[input_metadata.static_sparsity]
+                attn_output = attention_wrapper(
+                    q, k, v,
+                    cu_seqlens_q=input_metadata.cu_seqlens,
+                    cu_seqlens_k=input_metadata.cu_seqlens,
+                    max_seqlen_q=input_metadata.max_seq_len,
+                    max_seqlen_k=input_metadata.max_seq_len,
+                    dropout_p=0.0, causal=True,
+                    head_mask_type=head_mask_type,
+                    streaming_info=streaming_info,
                 )
-
-            attn_output = attention_wrapper(
-                q, k, v,
-                cu_seqlens_q=input_metadata.cu_seqlens,
-                cu_seqlens_k=input_metadata.cu_seqlens,
-                max_seqlen_q=input_metadata.max_seq_len,
-                max_seqlen_k=input_metadata.max_seq_len,
-                dropout_p=0.0, causal=True,
-                head_mask_type=self.head_mask_type,
-                streaming_info=self.streaming_info,
-            )
             attn_output = attn_output.reshape(q.size(0), -1)
         else:
             q, k, v = qkv.split(
@@ -433,7 +480,7 @@ class LlamaForCausalLM(nn.Module):
         )
         self.model_config = model_config
         vocab_size = config.vocab_size
-        # NOTE: The LM head is not quantized.
+        # NOTE: The LM head is only quantized by quantize_lm_head (--quantize-lm-head).
         self.lm_head = nn.Linear(config.hidden_size, vocab_size, bias=False)
         self._column_parallel_layers = []
         self._row_parallel_layers = ["o_proj", "down_proj"]
@@ -470,14 +517,15 @@ class LlamaForCausalLM(nn.Module):
         self,
         input_ids: torch.Tensor,
         input_metadata: InputMetadata,
+        compute_logits: bool = True,
     ) -> torch.Tensor:
         hidden_states = self.model(input_ids, input_metadata)
         if input_metadata.is_prompt:
-            output = self.lm_head(
-                hidden_states[input_metadata.cu_seqlens[1:] - 1, :]
-            )  # only compute last logits
-        else:
-            output = self.lm_head(hidden_states)
+            hidden_states = hidden_states[input_metadata.cu_seqlens[1:] - 1, :]  # only compute last logits
+        if not compute_logits:
+            # The LM head runs in sample_hidden_states.
+            return hidden_states
+        output = self.lm_head(hidden_states)
         return output  # .float()
 
     def sample(
@@ -486,6 +534,7 @@ class LlamaForCausalLM(nn.Module):
         logits: torch.Tensor,
         input_metadata: InputMetadata,
         sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
     ):
         # pred_token_idx = logits.argmax(dim=-1).unsqueeze(1)
         # sampled_token_idx = self.sampler(input_ids, logits, input_metadata)
@@ -493,7 +542,27 @@ class LlamaForCausalLM(nn.Module):
         # # print(sampled_token_idx, pred_token_idx)
 
         # return pred_token_idx
-        return self.sampler(input_ids, logits, input_metadata, sampling_params)
+        return self.sampler(input_ids, logits, input_metadata, sampling_params, sampling_tensors)
+
+    def sample_hidden_states(
+        self,
+        input_ids: torch.Tensor,
+        hidden_states: torch.Tensor,
+        input_metadata: InputMetadata,
+        sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
+    ):
+        # LM head and sampling in one step, so that the quantized LM head can fuse the top-k of its candidate rows.
+        return self.sampler.forward_lm_head(
+            input_ids, self.lm_head, hidden_states, input_metadata, sampling_params, sampling_tensors
+        )
+
+    def quantize_lm_head(self) -> bool:
+        # Replaces the fp16 LM head with W8A8LMHead (after the weights were loaded and moved to the GPU).
+        if not W8A8LMHead.supports(self.lm_head):
+            return False
+        self.lm_head = W8A8LMHead.from_linear(self.lm_head)
+        return True
 
 
     def load_weights(
@@ -542,7 +611,7 @@ class LlamaForCausalLM(nn.Module):
         state_dict = self.state_dict()
 
         for name, loaded_weight in hf_model_weights_iterator(
-            model_name_or_path, cache_dir, load_format, revision
+            model_name_or_path, cache_dir, load_format, revision, device=next(self.parameters()).device
         ):
             if "rotary_emb.inv_freq" in name:
                 continue
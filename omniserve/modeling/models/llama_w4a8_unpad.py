@@ -40,15 +40,30 @@ from transformers import LlamaConfig
 
 import omniserve.utils.constants
 from omniserve.modeling.layers.activation import SiluAndMulQuant
+from omniserve.modeling.layers.quantized_linear.gemm_epilogue import (
+    EPILOGUE_RESIDUAL,
+    EPILOGUE_SILU_AND_MUL,
+)
 from omniserve.modeling.layers.layernorm import RMSNorm, RMSNormGeneral
-from omniserve.modeling.layers.quantized_linear import W4A8OF16LinearDynamicInputScale
-from omniserve.modeling.layers.sampler import Sampler
-from omniserve.modeling.layers.ctx_update_kv import ApplyBiasRopeUpdateKVCacheWrapper, PagedMinMaxPoolWrapper
+from omniserve.modeling.layers.quantized_linear import (
+    W4A4_GROUP_SIZE,
+    W4A8OF16LinearDynamicInputScale,
+    quantize_w4a4_input,
+)
+from omniserve.modeling.layers.lm_head import W8A8LMHead
+from omniserve.modeling.layers.sampler import Sampler, SamplingTensors
+from omniserve.modeling.layers.ctx_update_kv import ApplyBiasRopeUpdateKVCacheWrapper
+from omniserve.modeling.parallel_utils.communication_op import tensor_model_parallel_all_reduce
+from omniserve.modeling.parallel_utils.parallel_state import (
+    get_tensor_model_parallel_rank,
+    get_tensor_model_parallel_world_size,
+)
 from omniserve.sampling_params import SamplingParams
 from omniserve.utils.input_metadata import InputMetadata
 from omniserve.utils.quant_config import QServeQuantConfig
 from omniserve.utils.weight_utils import (
     convert_pyslice_to_tensor,
+    get_qserve_tensor_parallel_shard,
     hf_model_weights_iterator,
     load_padded_tensor_parallel_vocab,
     load_tensor_parallel_weights,
@@ -67,7 +82,10 @@ class LlamaMLP(nn.Module):
     def __init__(self, args, model_config, group_size: int) -> None:
         super().__init__()
         hidden_size = args.hidden_size
-        intermediate_size = args.intermediate_size
+        self.tp_size = get_tensor_model_parallel_world_size()
+        assert args.intermediate_size % self.tp_size == 0
+        # gate_up_proj is column parallel and down_proj row parallel over the intermediate channels.
+        intermediate_size = args.intermediate_size // self.tp_size
         self.use_int8 = True
         self.model_config = model_config
         
@@ -79,8 +97,88 @@ class LlamaMLP(nn.Module):
         )
 
         self.act_fn = SiluAndMulQuant(act_sum=(group_size == -1))
+        # SiLU-and-mul + quant and the residual add run in the GEMM epilogues (per-channel kernel only).
+        # gate_up_proj must be reordered with interleave_gate_up() after loading.
+        self.fuse_epilogues = group_size == -1
+        # Prompt steps of at least w4a4_min_tokens tokens run the W4A4 GEMMs (enable_w4a4), 0: always W4A8.
+        self.w4a4_min_tokens = 0
+
+    def supports_w4a4(self) -> bool:
+        # The W4A4 path needs the fused epilogues of the single-GPU layer forward and whole activation groups.
+        return (
+            self.fuse_epilogues
+            and self.tp_size == 1
+            and all(proj.in_features % W4A4_GROUP_SIZE == 0 for proj in (self.gate_up_proj, self.down_proj))
+        )
+
+    def enable_w4a4(self, min_tokens: int) -> None:
+        # After the weights were loaded (and gate_up_proj interleaved).
+        self.gate_up_proj.prepare_w4a4()
+        self.down_proj.prepare_w4a4()
+        self.w4a4_min_tokens = min_tokens
+
+    def use_w4a4(self, input_metadata: InputMetadata) -> bool:
+        # Decided per step: the post_attention_layernorm then writes fp16 into out_down_proj_act_buffer.
+        return (
+            self.w4a4_min_tokens > 0
+            and input_metadata.is_prompt
+            and input_metadata.activation_buffer.batched_seq_len >= self.w4a4_min_tokens
+        )
+
+    def forward_w4a4(self, input_metadata: InputMetadata, residual: torch.Tensor):
+        # residual += mlp(x), x is the fp16 norm output in out_down_proj_act_buffer. Activations are quantized to
+        # int4 per group of W4A4_GROUP_SIZE channels (packed into the int8 buffers of the W4A8 path).
+        activation_buffer = input_metadata.activation_buffer
+        seq_len = activation_buffer.batched_seq_len
+        hidden_size = activation_buffer.hidden_size
+        intermediate_size = activation_buffer.intermediate_size
+        for start_idx in range(0, seq_len, self.model_config.chunk_prefill_size):
+            end_idx = min(seq_len, start_idx + self.model_config.chunk_prefill_size)
+            num_tokens = end_idx - start_idx
+            # FP16 -> INT4
+            quantized_hidden_states = activation_buffer.quantized_hidden_states_buffer.view(-1)[
+                : num_tokens * hidden_size // 2
+            ].view(num_tokens, hidden_size // 2)
+            quantize_w4a4_input(
+                quantized_hidden_states,
+                activation_buffer.out_down_proj_act_buffer[start_idx: end_idx, :],
+                activation_buffer.w4a4_group_scale_buffer,
+                activation_buffer.quantized_sum_buffer[: num_tokens],
+            )
+            # INT4 in, FP16 out (silu(gate) * up)
+            gate_up_out = activation_buffer.gate_up_proj_act_buffer.view(-1)[: num_tokens * intermediate_size].view(
+                num_tokens, intermediate_size
+            )
+            self.gate_up_proj.forward_w4a4(
+                quantized_hidden_states,
+                activation_buffer.w4a4_group_scale_buffer,
+                activation_buffer.quantized_sum_buffer[: num_tokens],
+                gate_up_out,
+                EPILOGUE_SILU_AND_MUL,
+            )
+            # FP16 -> INT4
+            quantized_mlp_act = activation_buffer.quantized_mlp_act_buffer.view(-1)[
+                : num_tokens * intermediate_size // 2
+            ].view(num_tokens, intermediate_size // 2)
+            quantize_w4a4_input(
+                quantized_mlp_act,
+                gate_up_out,
+                activation_buffer.w4a4_group_scale_buffer,
+                activation_buffer.quantized_sum_buffer[: num_tokens],
+            )
+            # INT4 in, FP16 out
+            self.down_proj.forward_w4a4(
+                quantized_mlp_act,
+                activation_buffer.w4a4_group_scale_buffer,
+                activation_buffer.quantized_sum_buffer[: num_tokens],
+                residual[start_idx: end_idx, :],
+                EPILOGUE_RESIDUAL,
+                residual=residual[start_idx: end_idx, :],
+            )
 
-    def forward(self, input_metadata: InputMetadata):
+    def forward(self, input_metadata: InputMetadata, residual: Optional[torch.Tensor] = None):
+        # With fuse_epilogues, residual += mlp(x) in place; otherwise the output is left in out_down_proj_act_buffer
+        # (all-reduced across the tensor parallel ranks).
         activation_buffer = input_metadata.activation_buffer
         # INT8 in, FP16 out
         seq_len = activation_buffer.batched_seq_len
@@ -88,6 +186,39 @@ class LlamaMLP(nn.Module):
         intermediate_size = activation_buffer.intermediate_size
         for start_idx in range(0, seq_len, self.model_config.chunk_prefill_size):
             end_idx = min(seq_len, start_idx + self.model_config.chunk_prefill_size)
+            if self.fuse_epilogues:
+                num_tokens = end_idx - start_idx
+                # INT8 in, INT8 out (through a contiguous num_tokens x intermediate_size FP16 tile)
+                self.gate_up_proj.forward_per_chn_epilogue(
+                    activation_buffer.quantized_hidden_states_buffer[start_idx: end_idx, :],
+                    activation_buffer.quantized_scale_buffer[start_idx: end_idx],
+                    activation_buffer.quantized_sum_buffer[start_idx: end_idx],
+                    activation_buffer.gate_up_proj_act_buffer.view(-1)[: num_tokens * intermediate_size].view(
+                        num_tokens, intermediate_size
+                    ),
+                    EPILOGUE_SILU_AND_MUL,
+                    quant_out=activation_buffer.quantized_mlp_act_buffer[: num_tokens, :],
+                    quant_scale=activation_buffer.quantized_scale_buffer[: num_tokens],
+                    quant_sum=activation_buffer.quantized_sum_buffer[: num_tokens],
+                )
+                # INT8 in, FP16 out
+                if residual is None:
+                    self.down_proj(
+                        activation_buffer.quantized_mlp_act_buffer[: num_tokens, :],
+                        activation_buffer.quantized_scale_buffer[: num_tokens],
+                        activation_buffer.quantized_sum_buffer[: num_tokens],
+                        activation_buffer.out_down_proj_act_buffer[start_idx: end_idx, :],
+                    )
+                    continue
+                self.down_proj.forward_per_chn_epilogue(
+                    activation_buffer.quantized_mlp_act_buffer[: num_tokens, :],
+                    activation_buffer.quantized_scale_buffer[: num_tokens],
+                    activation_buffer.quantized_sum_buffer[: num_tokens],
+                    residual[start_idx: end_idx, :],
+                    EPILOGUE_RESIDUAL,
+                    residual=residual[start_idx: end_idx, :],
+                )
+                continue
             # INT8 in, FP16 out
             self.gate_up_proj(
                 activation_buffer.quantized_hidden_states_buffer[start_idx: end_idx, :],
@@ -110,6 +241,8 @@ class LlamaMLP(nn.Module):
                 activation_buffer.quantized_sum_buffer[: end_idx - start_idx],
                 activation_buffer.out_down_proj_act_buffer[start_idx: end_idx, :],
             )
+        if residual is None:
+            tensor_model_parallel_all_reduce(activation_buffer.out_down_proj_act_buffer)
 
         # # INT8 in, FP16 out
         # self.gate_up_proj(
@@ -155,7 +288,8 @@ class LlamaAttention(nn.Module):
         self.sparse_kv_cache_enabled = model_config.sp_attn_config.sparse_kv_cache_enabled()
 
         self.hidden_size = hidden_size
-        tp_size = 1
+        tp_size = get_tensor_model_parallel_world_size()
+        self.tp_size = tp_size
         self.total_num_heads = num_heads
         assert self.total_num_heads % tp_size == 0
         self.num_heads = self.total_num_heads // tp_size
@@ -169,7 +303,6 @@ class LlamaAttention(nn.Module):
             # the KV heads across multiple tensor parallel GPUs.
             assert tp_size % self.total_num_kv_heads == 0
         self.num_kv_heads = max(1, self.total_num_kv_heads // tp_size)
-        num_kv_heads_replicas = max(1, tp_size // self.total_num_kv_heads)
         self.head_dim = hidden_size // self.total_num_heads
         self.q_size = self.num_heads * self.head_dim
         self.kv_size = self.num_kv_heads * self.head_dim
@@ -189,16 +322,17 @@ class LlamaAttention(nn.Module):
             attention_bias = args.attention_bias
         else:
             attention_bias = False
+        # qkv_proj is column parallel and o_proj row parallel over the heads of this rank
+        # (SpAttnConfig.get_kv_head_ids and their query heads).
         self.qkv_proj = W4A8OF16LinearDynamicInputScale(
             hidden_size,
-            (self.total_num_heads + 2 * self.total_num_kv_heads * num_kv_heads_replicas)
-            * self.head_dim,
+            (self.num_heads + 2 * self.num_kv_heads) * self.head_dim,
             bias=attention_bias,
             group_size=group_size,
         )
 
         self.o_proj = W4A8OF16LinearDynamicInputScale(
-            self.total_num_heads * self.head_dim,
+            self.num_heads * self.head_dim,
             hidden_size,
             bias=attention_bias,
             group_size=group_size,
@@ -221,6 +355,12 @@ class LlamaAttention(nn.Module):
         self.dynamic_sparse_token_budget = model_config.sp_attn_config.get_dec_dynamic_sparse_token_budget()
         self.sub_chunk_size = self.tokens_per_block // self.sub_chunk_per_block
         self.selector_update_interval = model_config.sp_attn_config.get_dec_selector_update_interval()
+        self.super_page_size = model_config.sp_attn_config.get_dec_super_page_size()
+        self.num_selected_super_pages = model_config.sp_attn_config.get_dec_num_selected_super_pages()
+        self.selector_drift_threshold = model_config.sp_attn_config.get_dec_selector_drift_threshold()
+        self.persistent_decode_attention = model_config.sp_attn_config.get_dec_persistent_attention()
+        self.gqa_page_selection = model_config.sp_attn_config.get_dec_gqa_page_selection()
+        self.ctx_dynamic_sparse = model_config.sp_attn_config.ctx_dynamic_sparse_enabled()
         self.multiblock_switch = model_config.multiblock_switch
 
         self.alibi_slopes = None                                                            
@@ -233,10 +373,9 @@ class LlamaAttention(nn.Module):
             self.head_dim, self.rope_theta, self.rope_scaling,
             self.max_position_embeddings, self.neox_rotary_style,
             self.kv_quant_granularity, self.kv_cache_config, self.use_int8,
-        )
-        self.paged_min_max_pool_wrapper = PagedMinMaxPoolWrapper(
-            self.layer_idx, self.tokens_per_block, self.sub_chunk_per_block,
-            self.head_dim, self.kv_cache_config, self.use_int8
+            self.sub_chunk_size if self.sparse_decode_mode != 0 else 0,
+            self.super_page_size if self.sparse_decode_mode != 0 else 0,
+            self.kv_max_seq_len,  # rotary_max_positions, same cos / sin table as the decoding wrapper
         )
         self.decoding_attention_wrapper = DecodingAttentionWrapper(
             self.layer_idx, self.sparse_kv_cache_enabled,
@@ -244,19 +383,22 @@ class LlamaAttention(nn.Module):
             self.rotary_embedding_dim, self.rope_theta, self.rope_scaling,
             self.neox_rotary_style, self.kv_quant_granularity, self.kv_cache_config, self.use_int8,
             self.sparse_decode_mode, self.sub_chunk_size, self.dynamic_sparse_token_budget,
-            self.multiblock_switch, self.selector_update_interval
+            self.multiblock_switch, self.selector_update_interval,
+            self.super_page_size, self.num_selected_super_pages, self.selector_drift_threshold,
+            self.persistent_decode_attention,
+            self.gqa_page_selection,
         )
 
     def invoke_quant_wo_act_sum(self, activation_buffer, attn_output):
         fused_kernels.invoke_quant(
-            activation_buffer.quantized_hidden_states_buffer,
+            activation_buffer.quantized_attn_output_buffer,
             attn_output,
             activation_buffer.quantized_scale_buffer,
         )
 
     def invoke_quant_with_act_sum(self, activation_buffer, attn_output):
         fused_kernels.invoke_quant_fuse_sum(
-            activation_buffer.quantized_hidden_states_buffer,
+            activation_buffer.quantized_attn_output_buffer,
             attn_output,
             activation_buffer.quantized_sum_buffer,
             activation_buffer.quantized_scale_buffer,
@@ -265,7 +407,10 @@ class LlamaAttention(nn.Module):
     def forward(
         self,
         input_metadata: InputMetadata,
+        residual: Optional[torch.Tensor] = None,
     ):
+        # If residual is given, o_proj adds its output to residual in place (fused epilogue);
+        # otherwise the output is left in out_down_proj_act_buffer (all-reduced across the tensor parallel ranks).
         activation_buffer = input_metadata.activation_buffer
         # INT8 in, FP16 out for this module
         self.qkv_proj(
@@ -290,6 +435,15 @@ class LlamaAttention(nn.Module):
             kv_scale_quant_orig = self.kv_scale_quant_orig.float()
             kv_scale_orig_quant = 1 / kv_scale_quant_orig
 
+            spec_root_qkv = chunk_qkv = None
+            if input_metadata.spec_tree_mask is not None:
+                # Speculative decoding: the page selector applies RoPE itself, so the root queries of the draft
+                # trees are taken before apply_bias_rope_update_kv_cache rotates the QKV buffer in place.
+                spec_root_qkv = activation_buffer.qkv_proj_act_buffer[input_metadata.cu_seqlens[:-1].long()]
+            elif self.ctx_dynamic_sparse and input_metadata.prompt_kv_lens is not None:
+                # Same for the chunks after a cached prefix, selecting with their mean query.
+                chunk_qkv = self.decoding_attention_wrapper.pool_chunk_qkv(activation_buffer.qkv_proj_act_buffer, input_metadata, self.q_size)
+
             self.apply_bias_rope_update_kv_cache_wrapper(
                 activation_buffer.qkv_proj_act_buffer, input_metadata, 
                 self.retrieval_head_flags, self.head_rank_table,
@@ -302,32 +456,64 @@ class LlamaAttention(nn.Module):
             q, k, v = activation_buffer.qkv_proj_act_buffer.split(
                 [self.q_size, self.kv_size, self.kv_size], dim=-1
             )
-            q = q.reshape(q.size(0), self.total_num_heads, self.head_dim)
+            q = q.reshape(q.size(0), self.num_heads, self.head_dim)
             k = k.reshape(k.size(0), self.num_kv_heads, self.head_dim)
             v = v.reshape(v.size(0), self.num_kv_heads, self.head_dim)
             
-            if self.sparse_decode_mode != 0:
-                k = k.contiguous()
-                self.paged_min_max_pool_wrapper(
-                    k, input_metadata, self.pooling_heads_idx, self.num_retrieval_kv_heads
+            if input_metadata.context_parallel is not None:
+                # Context parallelism: the other instances hold the K / V of the rest of the prompt.
+                attn_output = self.ring_context_attention_wrapper(q, k, v, input_metadata)
+            elif input_metadata.prompt_kv_lens is not None:
+                # Prefix caching: the cached tokens are only in the KV pages.
+                prefix_page_idx = None
+                if spec_root_qkv is not None:
+                    prefix_page_idx = self.decoding_attention_wrapper.select_verification_pages(
+                        spec_root_qkv, input_metadata,
+                        self.retrieval_head_flags, self.head_rank_table,
+                        self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                        self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    )
+                elif chunk_qkv is not None:
+                    prefix_page_idx = self.decoding_attention_wrapper.select_chunk_pages(
+                        chunk_qkv, input_metadata,
+                        self.retrieval_head_flags, self.head_rank_table,
+                        self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                        self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    )
+                attn_output = self.paged_context_attention_wrapper(
+                    q, k, v,
+                    input_metadata,
+                    input_metadata.prompt_kv_lens,
+                    input_metadata.max_prompt_kv_len,
+                    self.retrieval_head_flags, self.head_rank_table,
+                    self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                    self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                    dynamic_sparse_page_idxes=prefix_page_idx,
+                )
+            else:
+                head_mask_type, streaming_info = self.head_mask_type, self.streaming_info
+                if input_metadata.static_sparsity is not None:
+                    # A sparser static sparsity level requested by the prompts of the step.
+                    head_mask_type, streaming_info = self.level_head_mask_types[input_metadata.static_sparsity]
+                attn_output = attention_wrapper(
+                    q, k, v,
+                    cu_seqlens_q=input_metadata.cu_seqlens,
+                    cu_seqlens_k=input_metadata.cu_seqlens,
+                    max_seqlen_q=input_metadata.max_seq_len,
+                    max_seqlen_k=input_metadata.max_seq_len,
+                    dropout_p=0.0, causal=True,
+                    head_mask_type=head_mask_type,
+                    streaming_info=streaming_info,
                 )
-
-            attn_output = attention_wrapper(
-                q, k, v,
-                cu_seqlens_q=input_metadata.cu_seqlens,
-                cu_seqlens_k=input_metadata.cu_seqlens,
-                max_seqlen_q=input_metadata.max_seq_len,
-                max_seqlen_k=input_metadata.max_seq_len,
-                dropout_p=0.0, causal=True,
-                head_mask_type=self.head_mask_type,
-                streaming_info=self.streaming_info,
-            )
             attn_output = attn_output.reshape(q.size(0), -1)
         else:
+            # Decode: no apply_bias_rope_update_kv_cache pass. The masked MHA kernel rotates q / k in registers and
+            # quantizes and stores the new k / v (and their scales / zeros) into the pages, so the QKV buffer is read
+            # exactly once.
             q, k, v = activation_buffer.qkv_proj_act_buffer.split(
                 [self.q_size, self.kv_size, self.kv_size], dim=-1
             )
-            q = q.reshape(q.size(0), self.total_num_heads, self.head_dim)
+            q = q.reshape(q.size(0), self.num_heads, self.head_dim)
             k = k.reshape(k.size(0), self.num_kv_heads, self.head_dim)
             v = v.reshape(v.size(0), self.num_kv_heads, self.head_dim)
             # alibi_slopes = None
@@ -350,15 +536,47 @@ class LlamaAttention(nn.Module):
 
             attn_output = attn_output.reshape(q.size(0), -1)
         
+        if not input_metadata.is_prompt:
+            # Decode: o_proj quantizes attn_output in its GEMM prologue, no separate quant kernel.
+            attn_output = attn_output.contiguous()
+            if residual is not None:
+                self.o_proj.forward_quant_input(
+                    attn_output,
+                    activation_buffer.quantized_scale_buffer,
+                    activation_buffer.quantized_sum_buffer,
+                    residual,
+                    EPILOGUE_RESIDUAL,
+                    residual=residual,
+                )
+                return
+            self.o_proj.forward_quant_input(
+                attn_output,
+                activation_buffer.quantized_scale_buffer,
+                activation_buffer.quantized_sum_buffer,
+                activation_buffer.out_down_proj_act_buffer,
+            )
+            tensor_model_parallel_all_reduce(activation_buffer.out_down_proj_act_buffer)
+            return
         # FP16 in, INT8 out
         self.invoke_quant(activation_buffer, attn_output)
         # INT8 in, FP16 out
+        if residual is not None:
+            self.o_proj.forward_per_chn_epilogue(
+                activation_buffer.quantized_attn_output_buffer,
+                activation_buffer.quantized_scale_buffer,
+                activation_buffer.quantized_sum_buffer,
+                residual,
+                EPILOGUE_RESIDUAL,
+                residual=residual,
+            )
+            return
         self.o_proj(
-            activation_buffer.quantized_hidden_states_buffer,
+            activation_buffer.quantized_attn_output_buffer,
             activation_buffer.quantized_scale_buffer,
             activation_buffer.quantized_sum_buffer,
             activation_buffer.out_down_proj_act_buffer,
         )
+        tensor_model_parallel_all_reduce(activation_buffer.out_down_proj_act_buffer)
 
 
 class LlamaDecoderLayer(nn.Module):
@@ -372,6 +590,8 @@ class LlamaDecoderLayer(nn.Module):
     ) -> None:
         super().__init__()
         self.hidden_size = config.hidden_size
+        self.layer_idx = layer_idx
+        self.tp_size = get_tensor_model_parallel_world_size()
         self.use_int8 = True
         # Requires transformers > 4.32.0
         rope_theta = getattr(config, "rope_theta", 10000)
@@ -411,6 +631,8 @@ class LlamaDecoderLayer(nn.Module):
         # with nvtx.range("layer_fwd"):
         # FP16 in FP16 out
         activation_buffer = input_metadata.activation_buffer
+        if self.tp_size > 1:
+            return self.forward_tensor_parallel(hidden_states, input_metadata)
         # Self Attention
         residual = hidden_states
         # INT8 quantization
@@ -421,10 +643,19 @@ class LlamaDecoderLayer(nn.Module):
             activation_buffer.quantized_sum_buffer,
         )
         # INT8 -> FP16
-        self.self_attn(input_metadata)
-        hidden_states = residual + activation_buffer.out_down_proj_act_buffer
+        if self.mlp.fuse_epilogues:
+            # hidden_states += attn(hidden_states) in the o_proj epilogue
+            self.self_attn(input_metadata, residual=hidden_states)
+        else:
+            self.self_attn(input_metadata)
+            hidden_states = residual + activation_buffer.out_down_proj_act_buffer
         # Fully Connected
         residual = hidden_states
+        if self.mlp.use_w4a4(input_metadata):
+            # FP16 -> FP16 (the o_proj epilogue left out_down_proj_act_buffer unused), INT4 MLP
+            self.post_attention_layernorm.forward_fp16(hidden_states, activation_buffer.out_down_proj_act_buffer)
+            self.mlp.forward_w4a4(input_metadata, residual=hidden_states)
+            return hidden_states
         # FP16 -> INT8
         self.post_attention_layernorm(
             hidden_states,
@@ -433,8 +664,46 @@ class LlamaDecoderLayer(nn.Module):
             activation_buffer.quantized_sum_buffer,
         )
         # INT8 -> FP16
+        if self.mlp.fuse_epilogues:
+            self.mlp(input_metadata, residual=hidden_states)
+        else:
+            self.mlp(input_metadata)
+            hidden_states = residual + activation_buffer.out_down_proj_act_buffer
+        return hidden_states
+
+    def forward_tensor_parallel(
+        self,
+        hidden_states: torch.Tensor,
+        input_metadata: InputMetadata,
+    ) -> torch.Tensor:
+        # The row parallel o_proj / down_proj outputs are all-reduced into out_down_proj_act_buffer, and the
+        # residual add runs in the following norm. The MLP output of this layer is added by the input_layernorm of
+        # the next layer (or by LlamaModel after the last one), so hidden_states lags one MLP output behind.
+        activation_buffer = input_metadata.activation_buffer
+        if self.layer_idx == 0:
+            self.input_layernorm(
+                hidden_states,
+                activation_buffer.quantized_hidden_states_buffer,
+                activation_buffer.quantized_scale_buffer,
+                activation_buffer.quantized_sum_buffer,
+            )
+        else:
+            self.input_layernorm.forward_add_residual(
+                activation_buffer.out_down_proj_act_buffer,
+                hidden_states,
+                activation_buffer.quantized_hidden_states_buffer,
+                activation_buffer.quantized_scale_buffer,
+                activation_buffer.quantized_sum_buffer,
+            )
+        self.self_attn(input_metadata)
+        self.post_attention_layernorm.forward_add_residual(
+            activation_buffer.out_down_proj_act_buffer,
+            hidden_states,
+            activation_buffer.quantized_hidden_states_buffer,
+            activation_buffer.quantized_scale_buffer,
+            activation_buffer.quantized_sum_buffer,
+        )
         self.mlp(input_metadata)
-        hidden_states = residual + activation_buffer.out_down_proj_act_buffer
         return hidden_states
 
 
@@ -468,6 +737,7 @@ class LlamaModel(nn.Module):
             ]
         )
         self.norm = RMSNorm(config.hidden_size, eps=config.rms_norm_eps)
+        self.tp_size = get_tensor_model_parallel_world_size()
 
     def forward(
         self,
@@ -482,6 +752,9 @@ class LlamaModel(nn.Module):
                     hidden_states,
                     input_metadata
                 )
+            if self.tp_size > 1:
+                # MLP output of the last layer (see LlamaDecoderLayer.forward_tensor_parallel).
+                hidden_states += input_metadata.activation_buffer.out_down_proj_act_buffer
             seq_len = hidden_states.size(0)
             for start_idx in range(0, seq_len, self.model_config.chunk_prefill_size):
                 end_idx = min(seq_len, start_idx + self.model_config.chunk_prefill_size)
@@ -491,6 +764,9 @@ class LlamaModel(nn.Module):
 
 
 class LlamaForCausalLM(nn.Module):
+    # Layout of the activation tensors in the ActivationBuffer arena.
+    activation_layout = "llama"
+
     def __init__(
         self,
         config: LlamaConfig,
@@ -515,7 +791,8 @@ class LlamaForCausalLM(nn.Module):
         )
         self.model_config = model_config
         vocab_size = config.vocab_size
-        # NOTE: The LM head is not quantized.
+        # NOTE: The LM head is replicated (like the embedding) on the tensor parallel ranks, and only quantized by
+        # quantize_lm_head (--quantize-lm-head).
         self.lm_head = nn.Linear(config.hidden_size, vocab_size, bias=False)
         self._column_parallel_layers = []
         self._row_parallel_layers = ["o_proj", "down_proj"]
@@ -526,7 +803,7 @@ class LlamaForCausalLM(nn.Module):
         num_kv_heads = config.num_key_value_heads
 
         self.hidden_size = hidden_size
-        tp_size = 1
+        tp_size = get_tensor_model_parallel_world_size()
         self.total_num_heads = num_heads
         assert self.total_num_heads % tp_size == 0
         self.num_heads = self.total_num_heads // tp_size
@@ -544,6 +821,7 @@ class LlamaForCausalLM(nn.Module):
         self.head_dim = hidden_size // self.total_num_heads
         self.q_size = self.num_heads * self.head_dim
         self.kv_size = self.num_kv_heads * self.head_dim
+        self.intermediate_size = config.intermediate_size // tp_size
 
         if quant_path is not None:
             self.load_weights(quant_path)
@@ -552,14 +830,15 @@ class LlamaForCausalLM(nn.Module):
         self,
         input_ids: torch.Tensor,
         input_metadata: InputMetadata,
+        compute_logits: bool = True,
     ) -> torch.Tensor:
         hidden_states = self.model(input_ids, input_metadata)
         if input_metadata.is_prompt:
-            output = self.lm_head(
-                hidden_states[input_metadata.cu_seqlens[1:] - 1, :]
-            )  # only compute last logits
-        else:
-            output = self.lm_head(hidden_states)
+            hidden_states = hidden_states[input_metadata.cu_seqlens[1:] - 1, :]  # only compute last logits
+        if not compute_logits:
+            # The LM head runs in sample_hidden_states.
+            return hidden_states
+        output = self.lm_head(hidden_states)
         return output  # .float()
 
     def sample(
@@ -568,6 +847,7 @@ class LlamaForCausalLM(nn.Module):
         logits: torch.Tensor,
         input_metadata: InputMetadata,
         sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
     ):
         # pred_token_idx = logits.argmax(dim=-1).unsqueeze(1)
         # sampled_token_idx = self.sampler(input_ids, logits, input_metadata)
@@ -575,7 +855,37 @@ class LlamaForCausalLM(nn.Module):
         # # print(sampled_token_idx, pred_token_idx)
 
         # return pred_token_idx
-        return self.sampler(input_ids, logits, input_metadata, sampling_params)
+        return self.sampler(input_ids, logits, input_metadata, sampling_params, sampling_tensors)
+
+    def sample_hidden_states(
+        self,
+        input_ids: torch.Tensor,
+        hidden_states: torch.Tensor,
+        input_metadata: InputMetadata,
+        sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
+    ):
+        # LM head and sampling in one step, so that the quantized LM head can fuse the top-k of its candidate rows.
+        return self.sampler.forward_lm_head(
+            input_ids, self.lm_head, hidden_states, input_metadata, sampling_params, sampling_tensors
+        )
+
+    def quantize_lm_head(self) -> bool:
+        # Replaces the fp16 LM head with W8A8LMHead (after the weights were loaded and moved to the GPU).
+        if not W8A8LMHead.supports(self.lm_head):
+            return False
+        self.lm_head = W8A8LMHead.from_linear(self.lm_head)
+        return True
+
+    def enable_w4a4_prefill(self, min_tokens: int) -> bool:
+        # Runs the MLPs of prompt steps with at least min_tokens tokens as W4A4 GEMMs (after the weights were loaded).
+        if not all(layer.mlp.supports_w4a4() for layer in self.model.layers):
+            return False
+        for layer in self.model.layers:
+            layer.mlp.enable_w4a4(min_tokens)
+        self.w4a4_prefill_min_tokens = min_tokens
+        self.w4a4_group_size = W4A4_GROUP_SIZE
+        return True
 
 
     def load_weights(
@@ -601,14 +911,10 @@ class LlamaForCausalLM(nn.Module):
             for suffix in row_weight_suffixes:
                 row_parallel_weights.append(f"{layer}.{suffix}")
 
-        # TODO fix the tp parallelism
-        # tp_size = get_tensor_model_parallel_world_size()
-        # tp_rank = get_tensor_model_parallel_rank()
-        tp_size = 1
-        tp_rank = 0
+        tp_size = get_tensor_model_parallel_world_size()
+        tp_rank = get_tensor_model_parallel_rank()
 
         q_proj_shard_size = self.config.hidden_size // tp_size
-        num_kv_heads_replicas = max(1, tp_size // self.config.num_key_value_heads)
         num_kv_heads_per_gpu = max(1, self.config.num_key_value_heads // tp_size)
         kv_proj_shard_size = (
             self.config.hidden_size
@@ -621,10 +927,27 @@ class LlamaForCausalLM(nn.Module):
             ("k_proj", kv_proj_shard_size, q_proj_shard_size),
             ("v_proj", kv_proj_shard_size, q_proj_shard_size + kv_proj_shard_size),
         ]
+        mlp_ranges = [
+            (self.intermediate_size * tp_rank, self.intermediate_size * (tp_rank + 1))
+        ]
+
+        def get_attention_ranges(layer_idx):
+            # Channel ranges of this rank in q_proj (= the o_proj input) and in k_proj / v_proj. The KV heads of a
+            # rank are not contiguous when SpAttnConfig balanced the retrieval heads across the ranks.
+            kv_heads = self.model_config.sp_attn_config.get_kv_head_ids(layer_idx)
+            assert len(kv_heads) == self.num_kv_heads
+            kv_ranges = [(h * self.head_dim, (h + 1) * self.head_dim) for h in kv_heads]
+            if self.total_num_kv_heads >= tp_size:
+                q_size_per_kv_head = self.total_num_heads // self.total_num_kv_heads * self.head_dim
+                q_ranges = [(h * q_size_per_kv_head, (h + 1) * q_size_per_kv_head) for h in kv_heads]
+            else:
+                q_ranges = [(self.q_size * tp_rank, self.q_size * (tp_rank + 1))]
+            return q_ranges, kv_ranges
+
         state_dict = self.state_dict()
 
         for name, loaded_weight in hf_model_weights_iterator(
-            model_name_or_path, cache_dir, load_format, revision
+            model_name_or_path, cache_dir, load_format, revision, device=next(self.parameters()).device
         ):
             if "rotary_emb.inv_freq" in name:
                 continue
@@ -659,13 +982,14 @@ class LlamaForCausalLM(nn.Module):
                         shard_size //= self.quant_config.pack_factor
                         offset //= self.quant_config.pack_factor
 
-                if weight_name in ["k_proj", "v_proj"]:
-                    shard_id = tp_rank // num_kv_heads_replicas
-                else:
-                    shard_id = tp_rank
-                loaded_weight = loaded_weight[
-                    shard_size * shard_id : shard_size * (shard_id + 1)
-                ]
+                q_ranges, kv_ranges = get_attention_ranges(int(name.split(".")[2]))
+                loaded_weight = get_qserve_tensor_parallel_shard(
+                    loaded_weight,
+                    name,
+                    q_ranges if weight_name == "q_proj" else kv_ranges,
+                    False,
+                    self.hidden_size,
+                )
                 if "s2_scales" in name or "s2_zeros" in name:
                     param_slice = param.data[:, offset : offset + shard_size]
                 else:
@@ -696,9 +1020,9 @@ class LlamaForCausalLM(nn.Module):
                     param_slice = param.data[
                         shard_size * stride_id : shard_size * (stride_id + 1)
                     ]
-                loaded_weight = loaded_weight[
-                    shard_size * tp_rank : shard_size * (tp_rank + 1)
-                ]
+                loaded_weight = get_qserve_tensor_parallel_shard(
+                    loaded_weight, name, mlp_ranges, False, self.hidden_size
+                )
                 assert param_slice.shape == loaded_weight.shape
                 param_slice.copy_(loaded_weight)
                 is_gate_up_weight = True
@@ -711,7 +1035,28 @@ class LlamaForCausalLM(nn.Module):
                 param = param.T
 
             if "embed_tokens" in name or "lm_head" in name:
-                load_padded_tensor_parallel_vocab(param, loaded_weight, tp_rank)
+                # Replicated on every tensor parallel rank.
+                load_padded_tensor_parallel_vocab(param, loaded_weight, 0)
+                continue
+
+            if "o_proj" in name or "down_proj" in name:
+                if "o_proj" in name:
+                    ranges = get_attention_ranges(int(name.split(".")[2]))[0]
+                    in_features = self.total_num_heads * self.head_dim
+                else:
+                    ranges = mlp_ranges
+                    in_features = self.config.intermediate_size
+                shard = get_qserve_tensor_parallel_shard(loaded_weight, name, ranges, True, in_features)
+                if shard is None:
+                    # Per output channel tensors are replicated; the bias is added by rank 0 only.
+                    shard = convert_pyslice_to_tensor(loaded_weight)
+                    if "bias" in name and tp_rank != 0:
+                        shard = torch.zeros_like(shard)
+                assert param.shape == shard.shape, (
+                    f"{name} shape mismatch between model and checkpoint: "
+                    f"{param.shape} != {shard.shape}"
+                )
+                param.data.copy_(shard)
                 continue
 
             load_tensor_parallel_weights(
@@ -722,3 +1067,7 @@ class LlamaForCausalLM(nn.Module):
                 row_parallel_weights,
                 tp_rank,
             )
+
+        for layer in self.model.layers:
+            if layer.mlp.fuse_epilogues:
+                layer.mlp.gate_up_proj.interleave_gate_up()
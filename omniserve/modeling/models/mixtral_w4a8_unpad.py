@@ -17,7 +17,6 @@
 #   journal={arXiv preprint arXiv:2401.04088},
 #   year={2024}
 # }
-# MoE release will come in the future.
 from typing import Dict, List, Optional
 
 # import omniserve_backend.fused_attention as fused_attention
@@ -27,20 +26,23 @@ import omniserve_backend.fused_attention_fine_grained_dense as fused_attention #
 import torch
 import torch.nn.functional as F
 from flash_attn.flash_attn_interface import flash_attn_varlen_func
+import omniserve_backend.moe_helpers as moe_helpers
 from omniserve_backend import fused_kernels
 from torch import nn
 from transformers import MixtralConfig
 
 import omniserve.utils.constants
-from omniserve.modeling.layers.activation import SiluAndMulQuant
 from omniserve.modeling.layers.layernorm import RMSNorm, RMSNormGeneral
 from omniserve.modeling.layers.quantized_linear import (
     MoEW4A8OF16LinearDynamicInputScale,
     W4A8OF16LinearDynamicInputScale,
 )
+from omniserve.modeling.layers.quantized_linear.gemm_epilogue import (
+    EPILOGUE_SILU_AND_MUL,
+)
 from omniserve.modeling.layers.sampler import Sampler
 from omniserve.sampling_params import SamplingParams
-from omniserve.utils.input_metadata import InputMetadata
+from omniserve.utils.input_metadata import ActivationBuffer, InputMetadata
 from omniserve.utils.quant_config import QServeQuantConfig
 from omniserve.utils.weight_utils import (
     convert_pyslice_to_tensor,
@@ -49,7 +51,6 @@ from omniserve.utils.weight_utils import (
     load_tensor_parallel_weights,
 )
 from omniserve.modeling.layers.ctx_attn.ctx_attn_func import attention_wrapper
-# import moe_helpers
 from torch.cuda import nvtx
 max_seq_len = omniserve.utils.constants.max_seq_len
 
@@ -165,7 +166,13 @@ class MixtralAttention(nn.Module):
                 self.max_position_embeddings,
                 True,  # neox style
                 self.kv_cache_config["INT4_ENABLED"],  # int4_kv
+                self.kv_cache_config["INT4_ENABLED"],  # streaming_int4_kv
                 self.kv_cache_config["ZEROS_ENABLED"],  # kv_cache_with_zeros
+                0,  # tokens_per_sub_chunk: no dynamic sparse decoding
+                False,  # fp8_kv_cache
+                0,  # super_page_size
+                input_metadata.prompt_kv_lens,  # kv_seq_lens, behind a cached prefix
+                None,  # spec_position_offsets: no speculative decoding
             )
 
             # FIXME: currently qkv share same scale, plan to use seperate scales
@@ -177,16 +184,28 @@ class MixtralAttention(nn.Module):
             k = k.reshape(k.size(0), self.num_kv_heads, self.head_dim)
             v = v.reshape(v.size(0), self.num_kv_heads, self.head_dim)
             # with nvtx.range("context_attention"):
-            attn_output = attention_wrapper(
-                q, k, v,
-                cu_seqlens_q=input_metadata.cu_seqlens,
-                cu_seqlens_k=input_metadata.cu_seqlens,
-                max_seqlen_q=input_metadata.max_seq_len,
-                max_seqlen_k=input_metadata.max_seq_len,
-                dropout_p=0.0, causal=True,
-                head_mask_type=self.head_mask_type,
-                streaming_info=self.streaming_info,
-            )
+            if input_metadata.prompt_kv_lens is not None:
+                # Prefix caching: the cached tokens are only in the KV pages.
+                attn_output = self.paged_context_attention_wrapper(
+                    q, k, v,
+                    input_metadata,
+                    input_metadata.prompt_kv_lens,
+                    input_metadata.max_prompt_kv_len,
+                    self.retrieval_head_flags, self.head_rank_table,
+                    self.sink_size, self.local_size, self.sink_blocks, self.local_blocks,
+                    self.num_retrieval_kv_heads, self.num_streaming_kv_heads,
+                )
+            else:
+                attn_output = attention_wrapper(
+                    q, k, v,
+                    cu_seqlens_q=input_metadata.cu_seqlens,
+                    cu_seqlens_k=input_metadata.cu_seqlens,
+                    max_seqlen_q=input_metadata.max_seq_len,
+                    max_seqlen_k=input_metadata.max_seq_len,
+                    dropout_p=0.0, causal=True,
+                    head_mask_type=self.head_mask_type,
+                    streaming_info=self.streaming_info,
+                )
             attn_output = attn_output.reshape(q.size(0), -1)
         else:
             q, k, v = qkv_proj_act_buffer.split(
@@ -292,42 +311,42 @@ class MixtralSparseMoeBlockOurs(nn.Module):
             bias=False,
             group_size=128,
         )
-        self.act_fn = SiluAndMulQuant()
+        # silu(w1) * w3 and its per-token quantization run in the epilogue of w1_w3;
+        # w1_w3 must be reordered with interleave_gate_up() after loading.
 
         # Jitter parameters
         # self.jitter_noise = config.router_jitter_noise
 
-    def forward(self, hidden_states: torch.Tensor) -> torch.Tensor:
-        """ """
+    def forward(
+        self,
+        hidden_states: torch.Tensor,
+        residual: Optional[torch.Tensor] = None,
+        activation_buffer: Optional[ActivationBuffer] = None,
+    ) -> torch.Tensor:
+        """Routes every token to its top_k experts; adds the result to residual in place if given.
+
+        The intermediate tensors are views into activation_buffer if given, and allocated otherwise.
+        """
         num_tokens, hidden_dim = hidden_states.shape
-        hidden_states = hidden_states.view(-1, hidden_dim)
+        num_rows = num_tokens * self.top_k
+        device = hidden_states.device
         # router_logits: (batch * sequence_length, n_experts)
-        router_logits = self.gate(hidden_states).float()
+        router_logits = self.gate(hidden_states)
         ##################### step1: topk softmax kernel #####################
-
-        # permuted loc to unpermuted loc
-        raise NotImplementedError("MOE is yet to be supported")
-
-        (
-            routing_weights,
-            expert_indices,
-            permuted_loc_to_unpermuted_loc,
-        ) = moe_helpers.moe_topk_gating_softmax(router_logits, self.top_k)
-        problem_sizes = torch.bincount(expert_indices, minlength=self.num_experts).int()
-        problem_sizes = F.pad(problem_sizes, pad=(1, 0), value=0)
-        q_hidden_states = torch.empty(
-            num_tokens, hidden_dim, dtype=torch.int8, device=hidden_states.device
-        )
-        q_input_ssums = torch.empty(
-            num_tokens,
-            device=hidden_states.device,
-            dtype=torch.float16,
-        )
-        q_input_scales = torch.empty(
-            num_tokens,
-            device=hidden_states.device,
-            dtype=torch.float16,
+        routing_weights, expert_indices = moe_helpers.moe_topk_gating_softmax(
+            router_logits, self.top_k
         )
+
+        if activation_buffer is not None:
+            q_hidden_states = activation_buffer.moe_quantized_hidden_states_buffer
+            q_input_ssums = activation_buffer.moe_quantized_sum_buffer
+            q_input_scales = activation_buffer.moe_quantized_scale_buffer
+        else:
+            q_hidden_states = torch.empty(
+                num_tokens, hidden_dim, dtype=torch.int8, device=device
+            )
+            q_input_ssums = torch.empty(num_tokens, device=device, dtype=torch.float16)
+            q_input_scales = torch.empty(num_tokens, device=device, dtype=torch.float16)
         # quantize layernorm outputs to INT8
         fused_kernels.invoke_quant_fuse_sum(
             q_hidden_states,
@@ -335,64 +354,61 @@ class MixtralSparseMoeBlockOurs(nn.Module):
             q_input_ssums,
             q_input_scales,
         )
-        # print("topk softmax", routing_map)
         ##################### step2: expand inputs #####################
+        # Rows are sorted by expert; expert_offsets stays on the GPU, so there is no host sync.
         (
             q_moe_input_feats,
             moe_input_ssums,
             moe_input_scales,
+            expert_offsets,
             unpermuted_loc_to_permuted_loc,
         ) = moe_helpers.moe_expand_inputs_and_scales(
             q_hidden_states,
             q_input_ssums,
             q_input_scales,
-            permuted_loc_to_unpermuted_loc,
+            expert_indices,
+            self.num_experts,
         )
 
-        # print("expand input", q_moe_input_feats)
-        # ##################### step3: MoE-GEMM #####################
-        # ###### 3.1 self.w1, self.w3 ######
-        # # gate_proj
-        q_w1_w3_out = self.w1_w3(
+        ##################### step3: MoE-GEMM #####################
+        ###### 3.1 self.w1, self.w3: silu(w1(x)) * w3(x), quantized in the epilogue ######
+        if activation_buffer is not None:
+            gate_up_out = activation_buffer.moe_gate_up_act_buffer
+            q_gate_up_out = activation_buffer.moe_quantized_gate_up_act_buffer
+        else:
+            gate_up_out = torch.empty(
+                num_rows, self.ffn_dim, device=device, dtype=torch.float16
+            )
+            q_gate_up_out = torch.empty(
+                num_rows, self.ffn_dim, device=device, dtype=torch.int8
+            )
+        self.w1_w3(
             q_moe_input_feats,
             moe_input_scales,
             moe_input_ssums,
-            problem_sizes,
+            expert_offsets,
+            gate_up_out,
+            EPILOGUE_SILU_AND_MUL,
+            quant_out=q_gate_up_out,
+            quant_scale=moe_input_scales,
+            quant_sum=moe_input_ssums,
         )
 
-        # gate_up_out = F.silu(q_w1_out) * q_w3_out
-        q_gate_up_out = torch.empty(
-            num_tokens * self.top_k,
-            self.ffn_dim,
-            device=hidden_states.device,
-            dtype=torch.int8,
-        )
-        moe_input_ssums = torch.empty(
-            num_tokens * self.top_k,
-            device=hidden_states.device,
-            dtype=torch.float16,
-        )
-        moe_input_scales = torch.empty(
-            num_tokens * self.top_k,
-            device=hidden_states.device,
-            dtype=torch.float16,
-        )
-        self.act_fn(q_w1_w3_out, q_gate_up_out, moe_input_scales, moe_input_ssums)
-
         ###### 3.2 self.w2 ######
-        q_w2_out = self.w2(
-            q_gate_up_out, moe_input_scales, moe_input_ssums, problem_sizes
+        if activation_buffer is not None:
+            w2_out = activation_buffer.moe_down_act_buffer
+        else:
+            w2_out = torch.empty(num_rows, hidden_dim, device=device, dtype=torch.float16)
+        self.w2(
+            q_gate_up_out, moe_input_scales, moe_input_ssums, expert_offsets, w2_out
         )
-        # # print("w2 output", q_w2_out)
-        # ##################### step4: Reorder #####################
-        output_hidden_states = moe_helpers.moe_finalize_routing(
-            q_w2_out,
+        ##################### step4: Reorder #####################
+        return moe_helpers.moe_finalize_routing(
+            w2_out,
             routing_weights,
             unpermuted_loc_to_permuted_loc,
-            num_tokens,
+            residual,
         )
-        # print("router", output_hidden_states)
-        return output_hidden_states, routing_weights
 
 
 class MixtralDecoderLayer(nn.Module):
@@ -425,9 +441,7 @@ class MixtralDecoderLayer(nn.Module):
         input_metadata: InputMetadata,
         qkv_proj_act_buffer: torch.Tensor,
         out_down_proj_act_buffer: torch.Tensor,
-        gate_up_proj_act_buffer: torch.Tensor,
         quantized_hidden_states_buffer: torch.Tensor,
-        quantized_mlp_act_buffer: torch.Tensor,
         quantized_scale_buffer: torch.Tensor,
         quantized_sum_buffer: torch.Tensor,
     ) -> torch.Tensor:
@@ -458,8 +472,8 @@ class MixtralDecoderLayer(nn.Module):
 
         hidden_states = self.post_attention_layernorm(hidden_states)
 
-        hidden_states, router_logits = self.block_sparse_moe(hidden_states)
-        hidden_states = residual + hidden_states
+        # The weighted sum of the experts is added to residual in place.
+        hidden_states = self.block_sparse_moe(hidden_states, residual, input_metadata.activation_buffer)
 
         return hidden_states
 
@@ -528,65 +542,18 @@ class MixtralModel(nn.Module):
     ) -> torch.Tensor:
         with torch.no_grad():
             hidden_states = self.embed_tokens(input_ids)
-            batched_seq_len = hidden_states.shape[0]
-
-            # TODO: We may need to change the buffer name.
-            act_buffer = torch.empty(
-                (
-                    batched_seq_len
-                    * max(
-                        self.q_size + 2 * self.kv_size,
-                        2 * self.config.intermediate_size,
-                    )
-                ),
-                device=hidden_states.device,
-                dtype=hidden_states.dtype,
-            )
-
-            qkv_proj_act_buffer = act_buffer[
-                : batched_seq_len * (self.q_size + 2 * self.kv_size)
-            ].view(batched_seq_len, self.q_size + 2 * self.kv_size)
-            out_down_proj_act_buffer = act_buffer[
-                : batched_seq_len * self.config.hidden_size
-            ].view(batched_seq_len, self.config.hidden_size)
-            gate_up_proj_act_buffer = act_buffer[
-                : batched_seq_len * 2 * self.config.intermediate_size
-            ].view(batched_seq_len, 2 * self.config.intermediate_size)
-
-            quantized_act_buffer = torch.empty(
-                (
-                    batched_seq_len
-                    * max(self.config.hidden_size, self.config.intermediate_size)
-                ),
-                device=hidden_states.device,
-                dtype=torch.int8,
-            )
-            quantized_hidden_states_buffer = quantized_act_buffer[
-                : batched_seq_len * self.config.hidden_size
-            ].view(batched_seq_len, self.config.hidden_size)
-            quantized_mlp_act_buffer = quantized_act_buffer[
-                : batched_seq_len * self.config.intermediate_size
-            ].view(batched_seq_len, self.config.intermediate_size)
-
-            quantized_scale_buffer = torch.empty(
-                (batched_seq_len), device=hidden_states.device, dtype=torch.float16
-            )
-            quantized_sum_buffer = torch.empty(
-                (batched_seq_len), device=hidden_states.device, dtype=torch.float16
-            )
+            activation_buffer = input_metadata.activation_buffer
 
             for i in range(len(self.layers)):
                 layer = self.layers[i]
                 hidden_states = layer(
                     hidden_states,
                     input_metadata,
-                    qkv_proj_act_buffer,
-                    out_down_proj_act_buffer,
-                    gate_up_proj_act_buffer,
-                    quantized_hidden_states_buffer,
-                    quantized_mlp_act_buffer,
-                    quantized_scale_buffer,
-                    quantized_sum_buffer,
+                    activation_buffer.qkv_proj_act_buffer,
+                    activation_buffer.out_down_proj_act_buffer,
+                    activation_buffer.quantized_hidden_states_buffer,
+                    activation_buffer.quantized_scale_buffer,
+                    activation_buffer.quantized_sum_buffer,
                 )
             hidden_states = self.norm(hidden_states)
         return hidden_states
@@ -594,6 +561,8 @@ class MixtralModel(nn.Module):
 
 class MixtralForCausalLM(nn.Module):
     _tied_weights_keys = ["lm_head.weight"]
+    # Layout of the activation tensors in the ActivationBuffer arena.
+    activation_layout = "mixtral"
 
     def __init__(
         self,
@@ -622,6 +591,8 @@ class MixtralForCausalLM(nn.Module):
         self.router_aux_loss_coef = config.router_aux_loss_coef
         self.num_experts = config.num_local_experts
         self.num_experts_per_tok = config.num_experts_per_tok
+        self.q_size = self.model.q_size
+        self.kv_size = self.model.kv_size
 
         if quant_path is not None:
             self.load_weights(quant_path)
@@ -725,7 +696,7 @@ class MixtralForCausalLM(nn.Module):
         state_dict = self.state_dict()
 
         for name, loaded_weight in hf_model_weights_iterator(
-            model_name_or_path, cache_dir, load_format, revision
+            model_name_or_path, cache_dir, load_format, revision, device=next(self.parameters()).device
         ):
             if "rotary_emb.inv_freq" in name:
                 continue
@@ -843,3 +814,6 @@ class MixtralForCausalLM(nn.Module):
                 row_parallel_weights,
                 tp_rank,
             )
+
+        for layer in self.model.layers:
+            layer.block_sparse_moe.w1_w3.interleave_gate_up()
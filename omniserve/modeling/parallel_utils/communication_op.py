@@ -0,0 +1,57 @@
+# original file: https://github.com/vllm-project/vllm/blob/main/vllm/model_executor/parallel_utils/communication_op.py
+# modified by: Haotian Tang and Shang Yang
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+from typing import Any
+
+import torch
+
+from omniserve.modeling.parallel_utils.parallel_state import (
+    get_tensor_model_parallel_group,
+    get_tensor_model_parallel_src_rank,
+    get_tensor_model_parallel_world_size,
+    get_world_cpu_group,
+    model_parallel_is_initialized,
+)
+
+
+def tensor_model_parallel_all_reduce(input_: torch.Tensor) -> torch.Tensor:
+    """All-reduce the input tensor across model parallel group.
+
+    NOTE: This operation is applied in-place on the input tensor.
+    """
+    # Bypass the function if we are using only 1 GPU.
+    if get_tensor_model_parallel_world_size() == 1:
+        return input_
+    torch.distributed.all_reduce(input_, group=get_tensor_model_parallel_group())
+    return input_
+
+
+def broadcast_object(obj: Any = None, src: int = 0) -> Any:
+    """Broadcast a picklable object from src (the driver) to all the other ranks."""
+    if not model_parallel_is_initialized() or torch.distributed.get_world_size() == 1:
+        return obj
+    object_list = [obj]
+    torch.distributed.broadcast_object_list(
+        object_list, src=src, group=get_world_cpu_group()
+    )
+    return object_list[0]
+
+
+def tensor_model_parallel_broadcast(input_: torch.Tensor, src: int = 0) -> torch.Tensor:
+    """Broadcast the (device) tensor from src (rank in the tensor parallel group) to the other tensor parallel
+    ranks, in-place."""
+    if get_tensor_model_parallel_world_size() == 1:
+        return input_
+    torch.distributed.broadcast(
+        input_, src=get_tensor_model_parallel_src_rank() + src, group=get_tensor_model_parallel_group()
+    )
+    return input_
@@ -0,0 +1,147 @@
+# original file: https://github.com/vllm-project/vllm/blob/main/vllm/model_executor/parallel_utils/parallel_state.py
+# modified by: Haotian Tang and Shang Yang
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Tensor model parallel groups."""
+
+import torch
+
+# Tensor model parallel group that the current rank belongs to.
+_TENSOR_MODEL_PARALLEL_GROUP = None
+# Gloo group over the same ranks.
+_TENSOR_MODEL_PARALLEL_CPU_GROUP = None
+# Gloo group over all the ranks, used to broadcast the scheduler outputs from the driver.
+_WORLD_CPU_GROUP = None
+# Context parallel group: the ranks of the same tensor parallel rank in every model instance.
+_CONTEXT_PARALLEL_GROUP = None
+
+
+def initialize_model_parallel(
+    tensor_model_parallel_size: int = 1, num_instances: int = 1, context_parallel: bool = False
+) -> None:
+    """Initialize the tensor model parallel groups.
+
+    Pipeline parallelism is not supported. The ranks form num_instances model instances of
+    tensor_model_parallel_size consecutive ranks each (disaggregated prefill: ranks [0, tp) decode,
+    ranks [tp, 2 * tp) prefill), and every instance is one tensor parallel group. With context_parallel,
+    the instances also hold the shards of a prompt: the ranks of one tensor parallel rank across the
+    instances form a context parallel group.
+    """
+    assert torch.distributed.is_initialized()
+    world_size = torch.distributed.get_world_size()
+    if world_size != tensor_model_parallel_size * num_instances:
+        raise RuntimeError(
+            f"world_size ({world_size}) is not equal to "
+            f"tensor_model_parallel_size ({tensor_model_parallel_size}) x "
+            f"num_instances ({num_instances})"
+        )
+
+    global _TENSOR_MODEL_PARALLEL_GROUP, _TENSOR_MODEL_PARALLEL_CPU_GROUP, _WORLD_CPU_GROUP, _CONTEXT_PARALLEL_GROUP
+    assert _TENSOR_MODEL_PARALLEL_GROUP is None, (
+        "tensor model parallel group is already initialized"
+    )
+    rank = torch.distributed.get_rank()
+    # Every rank has to create every group, in the same order.
+    for start in range(0, world_size, tensor_model_parallel_size):
+        ranks = list(range(start, start + tensor_model_parallel_size))
+        group = torch.distributed.new_group(ranks)
+        cpu_group = torch.distributed.new_group(ranks, backend="gloo")
+        if rank in ranks:
+            _TENSOR_MODEL_PARALLEL_GROUP = group
+            _TENSOR_MODEL_PARALLEL_CPU_GROUP = cpu_group
+    if num_instances == 1:
+        _WORLD_CPU_GROUP = _TENSOR_MODEL_PARALLEL_CPU_GROUP
+    else:
+        _WORLD_CPU_GROUP = torch.distributed.new_group(list(range(world_size)), backend="gloo")
+    if context_parallel:
+        for tp_rank in range(tensor_model_parallel_size):
+            ranks = list(range(tp_rank, world_size, tensor_model_parallel_size))
+            group = torch.distributed.new_group(ranks)
+            if rank in ranks:
+                _CONTEXT_PARALLEL_GROUP = group
+
+
+def model_parallel_is_initialized() -> bool:
+    """Check if tensor model parallel groups are initialized."""
+    return _TENSOR_MODEL_PARALLEL_GROUP is not None
+
+
+def get_tensor_model_parallel_group():
+    """Get the tensor model parallel group the caller rank belongs to."""
+    assert _TENSOR_MODEL_PARALLEL_GROUP is not None, (
+        "tensor model parallel group is not initialized"
+    )
+    return _TENSOR_MODEL_PARALLEL_GROUP
+
+
+def get_tensor_model_parallel_cpu_group():
+    """Get the gloo group of the tensor model parallel ranks."""
+    assert _TENSOR_MODEL_PARALLEL_CPU_GROUP is not None, (
+        "tensor model parallel group is not initialized"
+    )
+    return _TENSOR_MODEL_PARALLEL_CPU_GROUP
+
+
+def get_world_cpu_group():
+    """Get the gloo group of all the ranks."""
+    assert _WORLD_CPU_GROUP is not None, (
+        "tensor model parallel group is not initialized"
+    )
+    return _WORLD_CPU_GROUP
+
+
+def get_tensor_model_parallel_world_size() -> int:
+    """Return world size for the tensor model parallel group (1 without distributed execution)."""
+    if not model_parallel_is_initialized():
+        return 1
+    return torch.distributed.get_world_size(group=get_tensor_model_parallel_group())
+
+
+def get_tensor_model_parallel_rank() -> int:
+    """Return my rank for the tensor model parallel group (0 without distributed execution)."""
+    if not model_parallel_is_initialized():
+        return 0
+    return torch.distributed.get_rank(group=get_tensor_model_parallel_group())
+
+
+def get_tensor_model_parallel_src_rank() -> int:
+    """Global rank of the first rank of the caller's tensor parallel group."""
+    if not model_parallel_is_initialized():
+        return 0
+    return torch.distributed.get_rank() - get_tensor_model_parallel_rank()
+
+
+def get_context_parallel_group():
+    """Get the context parallel group the caller rank belongs to (None without context parallelism)."""
+    return _CONTEXT_PARALLEL_GROUP
+
+
+def get_context_parallel_world_size() -> int:
+    """Return the number of model instances a prompt is split across (1 without context parallelism)."""
+    if _CONTEXT_PARALLEL_GROUP is None:
+        return 1
+    return torch.distributed.get_world_size(group=_CONTEXT_PARALLEL_GROUP)
+
+
+def get_context_parallel_rank() -> int:
+    """Return the model instance of the caller rank (0 without context parallelism)."""
+    if _CONTEXT_PARALLEL_GROUP is None:
+        return 0
+    return torch.distributed.get_rank(group=_CONTEXT_PARALLEL_GROUP)
+
+
+def destroy_model_parallel() -> None:
+    """Set the groups to none."""
+    global _TENSOR_MODEL_PARALLEL_GROUP, _TENSOR_MODEL_PARALLEL_CPU_GROUP, _WORLD_CPU_GROUP, _CONTEXT_PARALLEL_GROUP
+    _TENSOR_MODEL_PARALLEL_GROUP = None
+    _TENSOR_MODEL_PARALLEL_CPU_GROUP = None
+    _WORLD_CPU_GROUP = None
+    _CONTEXT_PARALLEL_GROUP = None
@@ -78,6 +78,16 @@ class SamplingParams:
             tokens in the output.  Defaults to True.
         logits_processors: List of functions that modify logits based on
             previously generated tokens.
+        sparse_token_budget: Number of KV tokens the dynamic sparse decoding
+            attention of this request attends to. Defaults to the engine-wide
+            `dynamic_sparse_token_budget`.
+        sparse_token_budget_ratio: Token budget as a fraction of the current
+            context length of the request, in (0, 1]. Ignored when
+            `sparse_token_budget` is set.
+        static_sparsity: Static sparsity level (share of streaming heads) of
+            the prefill attention of this request, one of the engine's
+            `static_sparsity_levels`. Defaults to the engine-wide
+            `static_sparsity`.
     """
 
     def __init__(
@@ -102,6 +112,9 @@ class SamplingParams:
         spaces_between_special_tokens: bool = True,
         logits_processors: Optional[List[LogitsProcessor]] = None,
         decoding_sim_token_ids: List = [],  # Optional, use the part of the context to supervise the decoding of first several tokens.
+        sparse_token_budget: Optional[int] = None,
+        sparse_token_budget_ratio: Optional[float] = None,
+        static_sparsity: Optional[float] = None,
     ) -> None:
         # print(f"temperature: {temperature}; top_p: {top_p}; top_k: {top_k}")
         self.n = n
@@ -131,6 +144,9 @@ class SamplingParams:
         self.spaces_between_special_tokens = spaces_between_special_tokens
         self.logits_processors = logits_processors
         self.include_stop_str_in_output = include_stop_str_in_output
+        self.sparse_token_budget = sparse_token_budget
+        self.sparse_token_budget_ratio = sparse_token_budget_ratio
+        self.static_sparsity = static_sparsity
         self._verify_args()
         if self.temperature < _SAMPLING_EPS:
             # Zero temperature means greedy sampling.
@@ -185,6 +201,19 @@ class SamplingParams:
             raise ValueError(
                 f"prompt_logprobs must be non-negative, got " f"{self.prompt_logprobs}."
             )
+        if self.sparse_token_budget is not None and self.sparse_token_budget < 1:
+            raise ValueError(
+                f"sparse_token_budget must be at least 1, got {self.sparse_token_budget}."
+            )
+        if self.sparse_token_budget_ratio is not None and not 0.0 < self.sparse_token_budget_ratio <= 1.0:
+            raise ValueError(
+                "sparse_token_budget_ratio must be in (0, 1], got "
+                f"{self.sparse_token_budget_ratio}."
+            )
+        if self.static_sparsity is not None and not 0.0 <= self.static_sparsity <= 1.0:
+            raise ValueError(
+                f"static_sparsity must be in [0, 1], got {self.static_sparsity}."
+            )
 
     def _verify_greedy_sampling(self) -> None:
         if self.best_of > 1:
@@ -192,6 +221,17 @@ class SamplingParams:
                 "best_of must be 1 when using greedy sampling." f"Got {self.best_of}."
             )
 
+    def has_sparse_token_budget(self) -> bool:
+        return self.sparse_token_budget is not None or self.sparse_token_budget_ratio is not None
+
+    def get_sparse_token_budget(self, context_len: int, default_budget: int) -> int:
+        """Dynamic sparse decoding token budget of a sequence with context_len cached tokens."""
+        if self.sparse_token_budget is not None:
+            return self.sparse_token_budget
+        if self.sparse_token_budget_ratio is not None:
+            return int(context_len * self.sparse_token_budget_ratio)
+        return default_budget
+
     @cached_property
     def sampling_type(self) -> SamplingType:
         if self.temperature < _SAMPLING_EPS:
@@ -218,5 +258,8 @@ class SamplingParams:
             f"prompt_logprobs={self.prompt_logprobs}, "
             f"skip_special_tokens={self.skip_special_tokens}, "
             "spaces_between_special_tokens="
-            f"{self.spaces_between_special_tokens})"
+            f"{self.spaces_between_special_tokens}, "
+            f"sparse_token_budget={self.sparse_token_budget}, "
+            f"sparse_token_budget_ratio={self.sparse_token_budget_ratio}, "
+            f"static_sparsity={self.static_sparsity})"
         )
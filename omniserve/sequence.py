@@ -14,6 +14,10 @@ from omniserve.sampling_params import SamplingParams
 PromptLogprobs = List[Optional[Dict[int, float]]]
 SampleLogprobs = List[Dict[int, float]]
 
+# Stands for a token that is still being sampled on the GPU (async engine loop). The model runner feeds the
+# sampled token straight from the previous step's output instead.
+PLACEHOLDER_TOKEN_ID = -2
+
 
 class SequenceStatus(enum.Enum):
     """Status of a sequence."""
@@ -72,11 +76,25 @@ class SequenceData:
         self.prompt_token_ids = prompt_token_ids
         self.output_token_ids: List[int] = []
         self.cumulative_logprob = 0.0
+        # Leading tokens whose KV pages were found in the prefix cache and are skipped by the prompt run.
+        self.num_cached_tokens = 0
+        # Mixed batching (SchedulerConfig.step_token_budget): tokens whose KV is in the cache once the scheduled
+        # steps have run. A sequence is still prefilling while more than its last token is missing.
+        self.num_computed_tokens = 0
 
     def append_token_id(self, token_id: int, logprob: float) -> None:
         self.output_token_ids.append(token_id)
         self.cumulative_logprob += logprob
 
+    def replace_last_token_id(self, token_id: int, logprob: float) -> None:
+        assert self.output_token_ids[-1] == PLACEHOLDER_TOKEN_ID
+        self.output_token_ids[-1] = token_id
+        self.cumulative_logprob += logprob
+
+    def truncate_output_token_ids(self, num_tokens: int, logprob: float) -> None:
+        del self.output_token_ids[len(self.output_token_ids) - num_tokens :]
+        self.cumulative_logprob -= logprob
+
     def get_len(self) -> int:
         return len(self.output_token_ids) + len(self.prompt_token_ids)
 
@@ -107,6 +125,23 @@ class SequenceData:
         )
 
 
+def hash_token_block(prev_hash: Optional[int], token_ids: List[int]) -> int:
+    """Content hash of a full token block chained with the hash of the blocks before it (None: first block).
+
+    Only ints are hashed, which Python hashes the same way in every process: the hashes exported by an engine
+    (LLMEngine.get_prefix_cache_hashes) can be compared with those of another process (see engine.router).
+    """
+    return hash((0 if prev_hash is None else prev_hash, tuple(token_ids)))
+
+
+def get_prefix_block_hashes(token_ids: List[int], block_size: int) -> List[int]:
+    """The chained hashes of the full blocks of token_ids, as Sequence.get_block_hashes computes them."""
+    hashes: List[int] = []
+    for start in range(0, len(token_ids) - block_size + 1, block_size):
+        hashes.append(hash_token_block(hashes[-1] if hashes else None, token_ids[start : start + block_size]))
+    return hashes
+
+
 class Sequence:
     """Stores the data, status, and block information of a sequence.
 
@@ -144,6 +179,9 @@ class Sequence:
         self._append_tokens_to_blocks(prompt_token_ids)
         self.status = SequenceStatus.WAITING
 
+        # Chained content hashes of the full logical blocks (prefix caching), filled lazily.
+        self.block_hashes: List[int] = []
+
         # Used for incremental detokenization
         self.prefix_offset = 0
         self.read_offset = 0
@@ -172,6 +210,19 @@ class Sequence:
             last_block.append_tokens(token_ids[cursor : cursor + num_empty_slots])
             cursor += num_empty_slots
 
+    def get_block_hashes(self, num_blocks: int) -> List[int]:
+        """Hashes of the first num_blocks logical blocks, which must be full.
+
+        The hash of a block also covers all the blocks before it, so equal hashes mean equal prefixes.
+        """
+        while len(self.block_hashes) < num_blocks:
+            logical_idx = len(self.block_hashes)
+            block = self.logical_token_blocks[logical_idx]
+            assert block.is_full()
+            prev_hash = self.block_hashes[-1] if logical_idx > 0 else None
+            self.block_hashes.append(hash_token_block(prev_hash, block.token_ids))
+        return self.block_hashes[:num_blocks]
+
     def allocate_kv_scales(
         self,
         num_tokens: int,
@@ -194,6 +245,49 @@ class Sequence:
         self.output_logprobs.append(logprobs)
         self.data.append_token_id(token_id, logprobs[token_id])
 
+    def append_placeholder_token_id(self) -> None:
+        """Reserves the slot of a token whose sampling has not finished yet (see PLACEHOLDER_TOKEN_ID)."""
+        self._append_tokens_to_blocks([PLACEHOLDER_TOKEN_ID])
+        self.output_logprobs.append({})
+        self.data.append_token_id(PLACEHOLDER_TOKEN_ID, 0.0)
+
+    def replace_last_token_id(
+        self,
+        token_id: int,
+        logprobs: Dict[int, float],
+    ) -> None:
+        """Fills in the token reserved by append_placeholder_token_id."""
+        assert token_id in logprobs
+        last_block = self.logical_token_blocks[-1]
+        last_block.token_ids[last_block.num_tokens - 1] = token_id
+        # A hash taken while the placeholder was in the block is stale.
+        del self.block_hashes[len(self.logical_token_blocks) - 1 :]
+        self.output_logprobs[-1] = logprobs
+        self.data.replace_last_token_id(token_id, logprobs[token_id])
+
+    def rollback_tokens(self, num_tokens: int) -> None:
+        """Drops the last num_tokens output tokens, e.g. the rejected draft tokens of speculative decoding.
+
+        The block manager releases the physical blocks left without logical block (rollback_slots).
+        """
+        assert 0 <= num_tokens <= self.get_output_len()
+        if num_tokens == 0:
+            return
+        output_token_ids = self.get_output_token_ids()[-num_tokens:]
+        logprob = sum(
+            logprobs.get(token_id, 0.0)
+            for token_id, logprobs in zip(output_token_ids, self.output_logprobs[-num_tokens:])
+        )
+        del self.output_logprobs[-num_tokens:]
+        self.data.truncate_output_token_ids(num_tokens, logprob)
+
+        seq_len = self.get_len()
+        num_blocks = (seq_len + self.block_size - 1) // self.block_size
+        del self.logical_token_blocks[num_blocks:]
+        self.logical_token_blocks[-1].num_tokens = seq_len - (num_blocks - 1) * self.block_size
+        # Only full blocks are hashed.
+        del self.block_hashes[seq_len // self.block_size :]
+
     def get_len(self) -> int:
         return self.data.get_len()
 
@@ -361,6 +455,10 @@ class SequenceGroupMetadata:
         retrieval_block_tables: Dict[int, List[int]],
         streaming_block_tables: Dict[int, List[int]],
         prefix: Optional[Prefix] = None,
+        num_computed_tokens: Optional[int] = None,
+        token_chunk_size: Optional[int] = None,
+        evicted_retrieval_pages: Optional[Dict[int, List[int]]] = None,
+        compacted_retrieval_seq_ids: Optional[List[int]] = None,
     ) -> None:
         self.request_id = request_id
         self.is_prompt = is_prompt
@@ -369,6 +467,17 @@ class SequenceGroupMetadata:
         self.retrieval_block_tables = retrieval_block_tables
         self.streaming_block_tables = streaming_block_tables
         self.prefix = prefix
+        # Mixed batching: the prompt run computes tokens [num_computed_tokens, num_computed_tokens +
+        # token_chunk_size) of the sequence (a prefill chunk, or the last token of a decoding sequence).
+        # None: the whole prompt behind its cached prefix.
+        self.num_computed_tokens = num_computed_tokens
+        self.token_chunk_size = token_chunk_size
+        # Retrieval page eviction: seq id -> the evicted entries of its retrieval block table, in eviction order
+        # (see BaseBlockSpaceManager._evict_blocks). None when eviction is off.
+        self.evicted_retrieval_pages = evicted_retrieval_pages
+        # Contiguous retrieval blocks: the seqs whose retrieval tables had entries moved by the compaction of this
+        # step (see BaseBlockSpaceManager.compact), which the device-resident tables rewrite.
+        self.compacted_retrieval_seq_ids = compacted_retrieval_seq_ids or []
 
 
 class SequenceOutput:
@@ -10,15 +10,59 @@
 #   year={2025}
 # }
 
-from typing import Optional
+from math import prod
+from typing import Dict, FrozenSet, List, Optional, Tuple
 
 import torch
 # from xformers.ops import AttentionBias
 
+# Offsets in the activation arena are aligned for vectorized kernel accesses.
+_ARENA_ALIGNMENT = 256
+
+
+def _align(num_bytes: int) -> int:
+    return (num_bytes + _ARENA_ALIGNMENT - 1) // _ARENA_ALIGNMENT * _ARENA_ALIGNMENT
+
+
+def plan_activation_arena(tensors: List[Tuple[str, int, FrozenSet[int]]]) -> Tuple[Dict[str, int], int]:
+    """Places (name, num_bytes, live ops) tensors in one allocation; returns their byte offsets and the arena size.
+
+    Two tensors conflict if they are live at a common op. Tensors are placed largest first, at the lowest aligned
+    offset that does not overlap any already placed tensor they conflict with.
+    """
+    placed: List[Tuple[int, int, FrozenSet[int]]] = []
+    offsets: Dict[str, int] = {}
+    arena_bytes = 0
+    for name, num_bytes, live_ops in sorted(tensors, key=lambda tensor: -tensor[1]):
+        offset = 0
+        for other_offset, other_end, other_live_ops in sorted(placed):
+            if not (live_ops & other_live_ops):
+                continue
+            if offset + num_bytes <= other_offset:
+                break
+            offset = max(offset, _align(other_end))
+        placed.append((offset, offset + num_bytes, live_ops))
+        offsets[name] = offset
+        arena_bytes = max(arena_bytes, offset + num_bytes)
+    return offsets, _align(arena_bytes)
+
+
+def _dtype_size(dtype: torch.dtype) -> int:
+    return torch.tensor([], dtype=dtype).element_size()
+
+
+def _ops(*op_idxes: int) -> FrozenSet[int]:
+    return frozenset(op_idxes)
+
+
 class ActivationBuffer:
     """
     Pre-allocated Buffer for activation in the model.
 
+    The activation tensors of a decoder layer are views into a single arena (shared by all the layers), laid out by
+    plan_activation_arena from the ops of the layer at which each tensor is live, so tensors that are never live
+    at the same time share bytes.
+
     Args:
         model: The input model
         batched_seq_len: The batched sequence length. Sum of all the sequence lengths in the batch.
@@ -28,7 +72,8 @@ class ActivationBuffer:
         self.model_class = model.__class__.__name__
         self.model_dtype = model.model.embed_tokens.weight.dtype
         self.device = model.model.embed_tokens.weight.device
-        self.chunk_prefill_size = model.model_config.chunk_prefill_size
+        # "llama" / "mixtral": layout of the activation tensors; None: the model allocates its own activations.
+        self.activation_layout = getattr(model, "activation_layout", None)
         assert self.model_class in [
             "LlamaForCausalLM",
             "MixtralForCausalLM",
@@ -42,66 +87,88 @@ class ActivationBuffer:
             self.batched_seq_len > 0
         ), f"batched_seq_len is expected to be greater than 0 to allocate activation buffer. Current: {self.batched_seq_len}."
 
+        self.tensor_specs = []
+        if self.activation_layout is None:
+            return
         self.q_size = model.q_size
         self.kv_size = model.kv_size
-        self.intermediate_size = model.config.intermediate_size
+        # Per tensor parallel rank (q_size / kv_size are already partitioned).
+        self.intermediate_size = getattr(model, "intermediate_size", model.config.intermediate_size)
         self.hidden_size = model.config.hidden_size
-
-    def allocate_activation_buffer(self):
-        if self.model_class == "LlamaForCausalLM":
-            self.__allocate_activation_buffer_llama()
-        elif self.model_class == "MixtralForCausalLM":
-            raise NotImplementedError("MixtralForCausalLM is not supported yet.")
-        else:
-            raise NotImplementedError(
-                f"model_class: {self.model_class} is currently not supported."
+        if self.activation_layout == "llama":
+            self.chunk_prefill_size = model.model_config.chunk_prefill_size
+            # Set when the model runs long prompt steps through the W4A4 MLP (enable_w4a4_prefill).
+            w4a4_prefill_min_tokens = getattr(model, "w4a4_prefill_min_tokens", 0)
+            self.w4a4_group_size = (
+                model.w4a4_group_size if 0 < w4a4_prefill_min_tokens <= batched_seq_len else 0
             )
-
-    def __allocate_activation_buffer_llama(self):
-        # Allocate fp16 activation buffer.
-        self.act_buffer = torch.empty(
-            (
-                self.batched_seq_len
-                * max(self.q_size + 2 * self.kv_size, 2 * self.intermediate_size)
-            ),
-            device=self.device,
-            dtype=torch.float16,
-        )
-        self.qkv_proj_act_buffer = self.act_buffer[
-            : self.batched_seq_len * (self.q_size + 2 * self.kv_size)
-        ].view(self.batched_seq_len, self.q_size + 2 * self.kv_size)
-        self.out_down_proj_act_buffer = self.act_buffer[
-            : self.batched_seq_len * self.hidden_size
-        ].view(self.batched_seq_len, self.hidden_size)
-        # self.gate_up_proj_act_buffer = self.act_buffer[
-        #     : self.batched_seq_len * 2 * self.intermediate_size
-        # ].view(self.batched_seq_len, 2 * self.intermediate_size)
-        self.gate_up_proj_act_buffer = torch.empty(
-            (min(self.chunk_prefill_size, self.batched_seq_len), 2 * self.intermediate_size), device=self.device, dtype=torch.float16
+            self.tensor_specs = self.__llama_tensor_specs()
+        elif self.activation_layout == "mixtral":
+            self.num_experts_per_tok = model.num_experts_per_tok
+            self.tensor_specs = self.__mixtral_tensor_specs()
+        else:
+            raise NotImplementedError(f"activation_layout: {self.activation_layout} is currently not supported.")
+        self.offsets, self.num_bytes = plan_activation_arena(
+            [(name, prod(shape) * _dtype_size(dtype), live_ops) for name, shape, dtype, live_ops in self.tensor_specs]
         )
 
-        # Allocate quantized activation buffer.
-        self.quantized_act_buffer = torch.empty(
-            (self.batched_seq_len * self.hidden_size),#(self.batched_seq_len * max(self.hidden_size, self.intermediate_size)),
-            device=self.device,
-            dtype=torch.int8,
-        )
-        self.quantized_hidden_states_buffer = self.quantized_act_buffer[
-            : self.batched_seq_len * self.hidden_size
-        ].view(self.batched_seq_len, self.hidden_size)
-        # self.quantized_mlp_act_buffer = self.quantized_act_buffer[
-        #     : self.batched_seq_len * self.intermediate_size
-        # ].view(self.batched_seq_len, self.intermediate_size)
-        self.quantized_mlp_act_buffer = torch.empty(
-            (min(self.chunk_prefill_size, self.batched_seq_len), self.intermediate_size), device=self.device, dtype=torch.int8
-        )
+    @staticmethod
+    def get_num_bytes(model, batched_seq_len: int) -> int:
+        """Size of the arena of a batch of batched_seq_len tokens, without allocating it."""
+        buffer = ActivationBuffer(model, batched_seq_len)
+        return buffer.num_bytes if buffer.tensor_specs else 0
 
-        self.quantized_scale_buffer = torch.empty(
-            (self.batched_seq_len), device=self.device, dtype=torch.float16
-        )
-        self.quantized_sum_buffer = torch.empty(
-            (self.batched_seq_len), device=self.device, dtype=torch.float16
-        )
+    def __llama_tensor_specs(self):
+        # Ops of a decoder layer: 0 input_layernorm, 1 qkv_proj, 2 attention, 3 quantize the attention output,
+        # 4 o_proj, 5 post_attention_layernorm, 6 gate_up_proj + act, 7 down_proj. The MLP runs in chunks of
+        # chunk_prefill_size tokens, so the full quantized_hidden_states / out_down_proj tensors stay live through
+        # ops 6 and 7. With tensor parallelism the MLP output is added by the input_layernorm of the next layer (op 0).
+        num_tokens = self.batched_seq_len
+        num_chunk_tokens = min(self.chunk_prefill_size, num_tokens)
+        specs = [
+            ("qkv_proj_act_buffer", (num_tokens, self.q_size + 2 * self.kv_size), torch.float16, _ops(1, 2)),
+            ("out_down_proj_act_buffer", (num_tokens, self.hidden_size), torch.float16, _ops(4, 5, 6, 7, 0)),
+            ("gate_up_proj_act_buffer", (num_chunk_tokens, 2 * self.intermediate_size), torch.float16, _ops(6)),
+            ("quantized_hidden_states_buffer", (num_tokens, self.hidden_size), torch.int8, _ops(0, 1, 5, 6, 7)),
+            ("quantized_attn_output_buffer", (num_tokens, self.q_size), torch.int8, _ops(3, 4)),
+            ("quantized_mlp_act_buffer", (num_chunk_tokens, self.intermediate_size), torch.int8, _ops(6, 7)),
+            ("quantized_scale_buffer", (num_tokens,), torch.float16, _ops(*range(8))),
+            ("quantized_sum_buffer", (num_tokens,), torch.float16, _ops(*range(8))),
+        ]
+        if self.w4a4_group_size > 0:
+            # W4A4 prefill MLP (LlamaMLP.forward_w4a4): activation scales of a chunk, one per row and group.
+            max_num_groups = max(self.hidden_size, self.intermediate_size) // self.w4a4_group_size
+            specs.append(("w4a4_group_scale_buffer", (num_chunk_tokens * max_num_groups,), torch.float16, _ops(6, 7)))
+        return specs
+
+    def __mixtral_tensor_specs(self):
+        # Ops of a decoder layer: 0 input_layernorm, 1 qkv_proj, 2 attention, 3 quantize the attention output (into
+        # quantized_hidden_states), 4 o_proj, 5 residual add + post_attention_layernorm, 6 router + quantize + expand
+        # the rows, 7 w1_w3 (SiLU-and-mul + quantize in the epilogue), 8 w2, 9 finalize routing.
+        num_tokens = self.batched_seq_len
+        num_rows = num_tokens * self.num_experts_per_tok
+        return [
+            ("qkv_proj_act_buffer", (num_tokens, self.q_size + 2 * self.kv_size), torch.float16, _ops(1, 2)),
+            ("out_down_proj_act_buffer", (num_tokens, self.hidden_size), torch.float16, _ops(4, 5)),
+            ("quantized_hidden_states_buffer", (num_tokens, self.hidden_size), torch.int8, _ops(0, 1, 3, 4)),
+            ("quantized_scale_buffer", (num_tokens,), torch.float16, _ops(0, 1, 3, 4)),
+            ("quantized_sum_buffer", (num_tokens,), torch.float16, _ops(0, 1, 3, 4)),
+            ("moe_quantized_hidden_states_buffer", (num_tokens, self.hidden_size), torch.int8, _ops(6)),
+            ("moe_quantized_scale_buffer", (num_tokens,), torch.float16, _ops(6)),
+            ("moe_quantized_sum_buffer", (num_tokens,), torch.float16, _ops(6)),
+            ("moe_gate_up_act_buffer", (num_rows, self.intermediate_size), torch.float16, _ops(7)),
+            ("moe_quantized_gate_up_act_buffer", (num_rows, self.intermediate_size), torch.int8, _ops(7, 8)),
+            ("moe_down_act_buffer", (num_rows, self.hidden_size), torch.float16, _ops(8, 9)),
+        ]
+
+    def allocate_activation_buffer(self):
+        if not self.tensor_specs:
+            return
+        self.arena = torch.empty((self.num_bytes,), device=self.device, dtype=torch.uint8)
+        for name, shape, dtype, _ in self.tensor_specs:
+            offset = self.offsets[name]
+            num_bytes = prod(shape) * _dtype_size(dtype)
+            setattr(self, name, self.arena[offset : offset + num_bytes].view(dtype).view(shape))
 
 
 class InputMetadata:
@@ -143,6 +210,20 @@ class InputMetadata:
         kv_cache_dtype: torch.dtype,
         batched_seq_len: int,
         model: torch.nn.Module,
+        dynamic_sparse_page_idxes: Optional[list] = None,
+        update_dynamic_sparse_pages: bool = True,
+        prompt_kv_lens: Optional[torch.Tensor] = None,
+        max_prompt_kv_len: int = 0,
+        dynamic_sparse_page_nums: Optional[torch.Tensor] = None,
+        dynamic_sparse_page_nums_changed: bool = True,
+        max_dynamic_sparse_token_budget: int = 0,
+        activation_buffer: Optional[ActivationBuffer] = None,
+        spec_tree_mask: Optional[torch.Tensor] = None,
+        spec_position_offsets: Optional[torch.Tensor] = None,
+        retrieval_offload: Optional = None,
+        retrieval_page_scores: Optional[torch.Tensor] = None,
+        context_parallel: Optional = None,
+        static_sparsity: Optional[float] = None,
     ) -> None:
         # self.seq_groups = seq_groups
         # self.seq_data =
@@ -160,6 +241,40 @@ class InputMetadata:
         self.max_retrieval_block_table_len = max_retrieval_block_table_len
         self.max_streaming_block_table_len = max_streaming_block_table_len
         self.kv_scales = kv_scales
+        # Per-layer static page index buffers (B x N_head x num_pages) used by CUDA graph decode.
+        # When set, the selector writes into them and the runner decides whether this step refreshes them.
+        self.dynamic_sparse_page_idxes = dynamic_sparse_page_idxes
+        self.update_dynamic_sparse_pages = update_dynamic_sparse_pages
+        # Whether the query drifted from the last page selection (--selector-drift-threshold): set by the first layer
+        # that checks it in the step, then followed by the others.
+        self.selector_drifted: Optional[bool] = None
+        # Prefix caching: cached + new tokens of every prompt (retrieval_context_lens only counts the new
+        # tokens). None when no prompt of the batch starts from cached pages.
+        self.prompt_kv_lens = prompt_kv_lens
+        self.max_prompt_kv_len = max_prompt_kv_len
+        # Per-sequence sparse decoding budgets (int32, [B]): pages each row of dynamic_sparse_page_idxes selects,
+        # including the most recent page. None when every sequence uses the engine-wide token budget.
+        self.dynamic_sparse_page_nums = dynamic_sparse_page_nums
+        # Whether dynamic_sparse_page_nums differs from the previous decode step (compared on the host by the runner).
+        self.dynamic_sparse_page_nums_changed = dynamic_sparse_page_nums_changed
+        self.max_dynamic_sparse_token_budget = max_dynamic_sparse_token_budget
+        # Speculative decoding: a prompt step (with prompt_kv_lens) whose chunks are the draft tokens of every
+        # sequence. spec_tree_mask (int64, [total_q]): bit j of a token is set iff it attends to draft token j of
+        # its sequence; spec_position_offsets (int32, [total_q]): depth of the token in its draft tree.
+        self.spec_tree_mask = spec_tree_mask
+        self.spec_position_offsets = spec_position_offsets
+        # Tiered retrieval cache (worker.cache_engine.RetrievalPageOffload): the decode attention of every layer
+        # reads the table returned by its stage() for the selected pages. None when all the pages are on the GPU.
+        self.retrieval_offload = retrieval_offload
+        # Retrieval page eviction (worker.cache_engine.RetrievalPageScores): fp32 [B, >= pages] selection counts the
+        # page selector accumulates, negative for the evicted pages, which it skips. None when eviction is off.
+        self.retrieval_page_scores = retrieval_page_scores
+        # Context parallelism (ctx_attn.ring_ctx_attn.ContextParallelShard): this step prefills one shard of a single
+        # prompt, whose other shards run on the other model instances. None otherwise.
+        self.context_parallel = context_parallel
+        # Static sparsity level of the prompts of a prompt step (SamplingParams.static_sparsity), whose prefill
+        # attention uses the head partition of that level. None: the engine-wide partition.
+        self.static_sparsity = static_sparsity
         # self.selected_token_indices = selected_token_indices
         # self.categorized_sample_indices = categorized_sample_indices
 
@@ -196,8 +311,12 @@ class InputMetadata:
         # Set during the execution of the first attention op.
         self.attn_bias: Optional = None
 
-        self.activation_buffer = ActivationBuffer(model, batched_seq_len)
-        self.activation_buffer.allocate_activation_buffer()
+        # A buffer handed in by the model runner is reused across steps of the same batched_seq_len.
+        if activation_buffer is not None and activation_buffer.batched_seq_len == batched_seq_len:
+            self.activation_buffer = activation_buffer
+        else:
+            self.activation_buffer = ActivationBuffer(model, batched_seq_len)
+            self.activation_buffer.allocate_activation_buffer()
 
     # def __repr__(self) -> str:
     #     # Print only useful metadata.
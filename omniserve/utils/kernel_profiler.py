@@ -0,0 +1,212 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Opt-in per-(layer, op) kernel timing of the model steps.
+
+Every function of the omniserve_backend extensions is wrapped with a pair of CUDA events, keyed by the decoder
+layer it runs in (forward pre-hooks on model.model.layers, -1 outside the layers) and by its module and name, e.g.
+(3, "fused_attention_selector.single_query_page_selector_topk"). The events are read back once they completed, so
+the timing does not synchronize the steps. Every dump_interval steps the aggregate is written as JSON.
+
+Enable with OMNISERVE_KERNEL_PROFILE=<json path> (OMNISERVE_KERNEL_PROFILE_INTERVAL: steps per dump, default 100)
+or kernel_profiler.enable(...) before the model runner is created. The decode steps then run eagerly: per-layer
+events cannot be taken inside a CUDA graph. NVTX ranges around the same entry points come from the extensions
+themselves (OMNISERVE_NVTX=1, kernels/csrc/nvtx_utils.h).
+
+Derived numbers: ops that report the bytes they read (add_bytes, e.g. the K stats scanned by the page selector)
+get an achieved bandwidth, and add_selected_pages gives the average pages selected per retrieval head.
+"""
+
+import functools
+import importlib
+import json
+import os
+import pkgutil
+from collections import defaultdict
+from typing import Dict, List, Optional, Tuple, Union
+
+import torch
+
+from omniserve.logger import init_logger
+
+logger = init_logger(__name__)
+
+_OUTSIDE_LAYERS = -1
+
+
+class KernelProfiler:
+    def __init__(self) -> None:
+        self.enabled = False
+        self.dump_path: Optional[str] = None
+        self.dump_interval = 100
+        self.layer_idx = _OUTSIDE_LAYERS
+        self.num_steps = 0
+        # (layer, op) -> [calls, total ms]
+        self.op_times: Dict[Tuple[int, str], List[float]] = defaultdict(lambda: [0, 0.0])
+        # (layer, op) -> bytes, host ints and the device (int64) counts, only read at the next dump.
+        self.op_bytes: Dict[Tuple[int, str], int] = defaultdict(int)
+        self.op_bytes_device: Dict[Tuple[int, str], torch.Tensor] = {}
+        # Selected pages (host, plus a device int64 count) over head selections (always known on the host).
+        self.selected_pages = 0
+        self.selected_pages_device: Optional[torch.Tensor] = None
+        self.num_head_selections = 0
+        # (layer, op, start, end) of the steps in flight.
+        self.pending: List[Tuple[int, str, torch.cuda.Event, torch.cuda.Event]] = []
+        self._wrapped_modules = set()
+
+    def enable(self, dump_path: Optional[str] = None, dump_interval: int = 100) -> None:
+        self.enabled = True
+        self.dump_path = dump_path
+        self.dump_interval = max(dump_interval, 1)
+
+    def enable_from_env(self) -> None:
+        dump_path = os.environ.get("OMNISERVE_KERNEL_PROFILE")
+        if dump_path:
+            self.enable(dump_path, int(os.environ.get("OMNISERVE_KERNEL_PROFILE_INTERVAL", "100")))
+
+    def install(self, model: torch.nn.Module) -> None:
+        """Wraps the backend entry points and tracks the current decoder layer of model."""
+        if not self.enabled:
+            return
+        import omniserve_backend
+
+        for module_info in pkgutil.iter_modules(omniserve_backend.__path__):
+            self._wrap_module(importlib.import_module(f"omniserve_backend.{module_info.name}"))
+        for layer_idx, layer in enumerate(model.model.layers):
+            layer.register_forward_pre_hook(functools.partial(self._enter_layer, layer_idx))
+            layer.register_forward_hook(self._exit_layer)
+        logger.info(f"Kernel profiling enabled, dumping to {self.dump_path} every {self.dump_interval} steps.")
+
+    def _wrap_module(self, module) -> None:
+        if module.__name__ in self._wrapped_modules:
+            return
+        self._wrapped_modules.add(module.__name__)
+        module_name = module.__name__.split(".")[-1]
+        for name in dir(module):
+            fn = getattr(module, name)
+            if name.startswith("_") or not callable(fn) or isinstance(fn, type):
+                continue
+            setattr(module, name, self._timed(f"{module_name}.{name}", fn))
+
+    def _timed(self, op: str, fn):
+        @functools.wraps(fn)
+        def wrapper(*args, **kwargs):
+            if torch.cuda.is_current_stream_capturing():
+                return fn(*args, **kwargs)
+            start = torch.cuda.Event(enable_timing=True)
+            end = torch.cuda.Event(enable_timing=True)
+            start.record()
+            out = fn(*args, **kwargs)
+            end.record()
+            self.pending.append((self.layer_idx, op, start, end))
+            return out
+
+        return wrapper
+
+    def _enter_layer(self, layer_idx: int, module, args) -> None:
+        self.layer_idx = layer_idx
+
+    def _exit_layer(self, module, args, output) -> None:
+        self.layer_idx = _OUTSIDE_LAYERS
+
+    def add_bytes(self, op: str, num_bytes: Union[int, torch.Tensor]) -> None:
+        """Bytes read by the last call of op in the current layer (a device tensor avoids a sync, an int a copy)."""
+        if not self.enabled or torch.cuda.is_current_stream_capturing():
+            return
+        key = (self.layer_idx, op)
+        if not isinstance(num_bytes, torch.Tensor):
+            self.op_bytes[key] += num_bytes
+        elif key in self.op_bytes_device:
+            self.op_bytes_device[key] += num_bytes
+        else:
+            self.op_bytes_device[key] = num_bytes.to(torch.int64).clone()
+
+    def add_selected_pages(self, num_pages: Union[int, torch.Tensor], num_head_selections: int) -> None:
+        """num_pages: pages selected over num_head_selections (batch x heads) selections of one layer."""
+        if not self.enabled or torch.cuda.is_current_stream_capturing():
+            return
+        self.num_head_selections += num_head_selections
+        if not isinstance(num_pages, torch.Tensor):
+            self.selected_pages += num_pages
+        elif self.selected_pages_device is None:
+            self.selected_pages_device = num_pages.to(torch.int64).clone()
+        else:
+            self.selected_pages_device += num_pages
+
+    def end_step(self) -> None:
+        if not self.enabled:
+            return
+        self.num_steps += 1
+        self._collect(wait=False)
+        if self.dump_path is not None and self.num_steps % self.dump_interval == 0:
+            self.dump(self.dump_path)
+
+    def _collect(self, wait: bool) -> None:
+        num_done = 0
+        for layer_idx, op, start, end in self.pending:
+            if wait:
+                end.synchronize()
+            elif not end.query():
+                break
+            record = self.op_times[(layer_idx, op)]
+            record[0] += 1
+            record[1] += start.elapsed_time(end)
+            num_done += 1
+        del self.pending[:num_done]
+
+    def summary(self) -> Dict:
+        self._collect(wait=True)
+        per_layer = []
+        per_op: Dict[str, Dict] = defaultdict(lambda: {"calls": 0, "total_ms": 0.0, "bytes": 0})
+        for (layer_idx, op), (calls, total_ms) in sorted(self.op_times.items()):
+            entry = {"layer": layer_idx, "op": op, "calls": calls, "total_ms": total_ms, "avg_ms": total_ms / calls}
+            op_total = per_op[op]
+            op_total["calls"] += calls
+            op_total["total_ms"] += total_ms
+            if (layer_idx, op) in self.op_bytes or (layer_idx, op) in self.op_bytes_device:
+                num_bytes = self.op_bytes.get((layer_idx, op), 0)
+                if (layer_idx, op) in self.op_bytes_device:
+                    num_bytes += self.op_bytes_device[(layer_idx, op)].item()
+                entry["bytes"] = num_bytes
+                entry["achieved_gbps"] = num_bytes / (total_ms * 1e6) if total_ms > 0 else 0.0
+                op_total["bytes"] += num_bytes
+            per_layer.append(entry)
+        ops = {}
+        for op, op_total in per_op.items():
+            if op_total["bytes"] > 0 and op_total["total_ms"] > 0:
+                op_total["achieved_gbps"] = op_total["bytes"] / (op_total["total_ms"] * 1e6)
+            else:
+                del op_total["bytes"]
+            ops[op] = op_total
+        result = {"steps": self.num_steps, "ops": ops, "per_layer": per_layer}
+        if self.num_head_selections > 0:
+            num_pages = self.selected_pages
+            if self.selected_pages_device is not None:
+                num_pages += self.selected_pages_device.item()
+            result["avg_selected_pages_per_head"] = num_pages / self.num_head_selections
+        return result
+
+    def dump(self, path: str) -> None:
+        with open(path, "w") as f:
+            json.dump(self.summary(), f, indent=2)
+
+    def reset(self) -> None:
+        self._collect(wait=True)
+        self.num_steps = 0
+        self.op_times.clear()
+        self.op_bytes.clear()
+        self.op_bytes_device.clear()
+        self.selected_pages = 0
+        self.selected_pages_device = None
+        self.num_head_selections = 0
+
+
+kernel_profiler = KernelProfiler()
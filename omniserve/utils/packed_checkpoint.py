@@ -0,0 +1,177 @@
+# File authors: Haotian Tang, Shang Yang, Yujun Lin, Song Han
+# @article{lin2024qserve,
+#   title={QServe: W4A8KV4 Quantization and System Co-design for Efficient LLM Serving},
+#   author={Lin*, Yujun and Tang*, Haotian and Yang*, Shang and Zhang, Zhekai and Xiao, Guangxuan and Gan, Chuang and Han, Song},
+#   year={2024}
+# }
+# @article{yang2025lserve,
+#   title={LServe: Efficient Long-sequence LLM Serving with Unified Sparse Attention},
+#   author={Yang*, Shang and Guo*, Junxian and Tang, Haotian and Hu, Qinghao and Xiao, Guangxuan and Tang, Jiaming and Lin, Yujun and Liu, Zhijian and Lu, Yao and Han, Song},
+#   year={2025}
+# }
+"""Memory-mappable checkpoint of the kernel-ready QServe tensors (model.omnipack).
+
+Layout: b"OMNIPACK", u32 version, u32 reserved, u64 header length, a JSON header
+{"metadata": {...}, "tensors": {name: {"dtype", "shape", "offset", "nbytes"}}}, then the raw tensor bytes in
+state dict order. Every tensor starts at a file offset aligned to PACKED_ALIGNMENT (4 KiB, a page, also what
+O_DIRECT / GPUDirect Storage readers need), so a tensor is a zero-copy view of the mapped file.
+
+The tensors are the ones scripts/ckpt_converter/checkpoint_converter.py produces: the int4 / int8 weights are
+already reordered and interleaved for the GEMM kernels, and the names are the checkpoint names, so load_weights
+still fuses q / k / v and gate / up and shards them for tensor parallelism. stream_packed_checkpoint moves the
+file to the GPU in large chunks through two pinned buffers (disk read of chunk i + 1 overlaps the H2D copy of
+chunk i) and yields device views; these reshuffles then run device to device.
+"""
+
+import json
+import os
+import struct
+from typing import Dict, Iterator, List, Optional, Tuple
+
+import numpy as np
+import torch
+
+PACKED_CHECKPOINT_NAME = "model.omnipack"
+PACKED_ALIGNMENT = 4096
+_MAGIC = b"OMNIPACK"
+_VERSION = 1
+_PREAMBLE = struct.Struct("<8sIIQ")
+_DEFAULT_CHUNK_BYTES = 256 << 20
+
+
+def _align(offset: int) -> int:
+    return (offset + PACKED_ALIGNMENT - 1) // PACKED_ALIGNMENT * PACKED_ALIGNMENT
+
+
+def _dtype_name(dtype: torch.dtype) -> str:
+    return str(dtype).replace("torch.", "")
+
+
+def get_packed_checkpoint_path(model_name_or_path: Optional[str]) -> Optional[str]:
+    """The packed checkpoint of a checkpoint folder (or the file itself), None if there is none."""
+    if model_name_or_path is None:
+        return None
+    if os.path.isfile(model_name_or_path) and model_name_or_path.endswith(".omnipack"):
+        return model_name_or_path
+    path = os.path.join(model_name_or_path, PACKED_CHECKPOINT_NAME)
+    return path if os.path.isfile(path) else None
+
+
+def save_packed_checkpoint(path: str, state_dict: Dict[str, torch.Tensor], metadata: Optional[Dict] = None) -> None:
+    tensors = {name: t.detach().cpu().contiguous() for name, t in state_dict.items()}
+    entries = {}
+    offset = 0
+    for name, t in tensors.items():
+        nbytes = t.numel() * t.element_size()
+        entries[name] = {"dtype": _dtype_name(t.dtype), "shape": list(t.shape), "offset": offset, "nbytes": nbytes}
+        offset = _align(offset + nbytes)
+
+    # The offsets are absolute, and the data section starts after the header that holds them: grow the header
+    # space until it fits.
+    header = {"metadata": metadata or {}, "tensors": entries}
+    relative_offsets = {name: entry["offset"] for name, entry in entries.items()}
+    data_start = PACKED_ALIGNMENT
+    while True:
+        for name, entry in entries.items():
+            entry["offset"] = data_start + relative_offsets[name]
+        header_bytes = json.dumps(header).encode()
+        if _PREAMBLE.size + len(header_bytes) <= data_start:
+            break
+        data_start = _align(_PREAMBLE.size + len(header_bytes))
+
+    with open(path, "wb") as f:
+        f.write(_PREAMBLE.pack(_MAGIC, _VERSION, 0, len(header_bytes)))
+        f.write(header_bytes)
+        for name, t in tensors.items():
+            f.seek(entries[name]["offset"])
+            f.write(t.reshape(-1).view(torch.uint8).numpy().tobytes())
+        f.truncate(_align(f.tell()))
+
+
+class PackedCheckpoint:
+    def __init__(self, path: str):
+        self.path = path
+        with open(path, "rb") as f:
+            magic, version, _, header_len = _PREAMBLE.unpack(f.read(_PREAMBLE.size))
+            if magic != _MAGIC or version != _VERSION:
+                raise ValueError(f"{path} is not a version {_VERSION} packed checkpoint.")
+            header = json.loads(f.read(header_len))
+        self.metadata: Dict = header["metadata"]
+        self.entries: Dict[str, Dict] = header["tensors"]
+        # Copy-on-write mapping: writable for torch.from_numpy, the file is never modified.
+        self._data = torch.from_numpy(np.memmap(path, dtype=np.uint8, mode="c"))
+
+    def _view(self, buffer: torch.Tensor, base: int, entry: Dict) -> torch.Tensor:
+        start = entry["offset"] - base
+        t = buffer[start : start + entry["nbytes"]].view(getattr(torch, entry["dtype"]))
+        return t.view(entry["shape"])
+
+    def items(self) -> Iterator[Tuple[str, torch.Tensor]]:
+        """Zero-copy host views of the mapped file, pages are read on first touch."""
+        for name, entry in self.entries.items():
+            yield name, self._view(self._data, 0, entry)
+
+    def chunks(self, chunk_bytes: int) -> List[Tuple[int, int, List[str]]]:
+        """(start, end, names) file ranges of consecutive tensors, about chunk_bytes each."""
+        chunks = []
+        start, end, names = None, None, []
+        for name, entry in self.entries.items():
+            if start is not None and entry["offset"] + entry["nbytes"] - start > chunk_bytes:
+                chunks.append((start, end, names))
+                start, names = None, []
+            if start is None:
+                start = entry["offset"]
+            end = entry["offset"] + entry["nbytes"]
+            names.append(name)
+        if start is not None:
+            chunks.append((start, end, names))
+        return chunks
+
+
+def stream_packed_checkpoint(
+    path: str, device: torch.device, chunk_bytes: int = _DEFAULT_CHUNK_BYTES
+) -> Iterator[Tuple[str, torch.Tensor]]:
+    """Yields views of the tensors on device, valid until the next chunk is requested.
+
+    The consumer must be done with (or have enqueued its copies of) a tensor on the current stream before
+    asking for the next one; each device staging buffer is only refilled after the current stream passed it.
+    """
+    ckpt = PackedCheckpoint(path)
+    if device.type != "cuda":
+        yield from ckpt.items()
+        return
+    chunks = ckpt.chunks(chunk_bytes)
+    if len(chunks) == 0:
+        return
+    buffer_bytes = max(end - start for start, end, _ in chunks)
+    host_buffers = [torch.empty(buffer_bytes, dtype=torch.uint8, pin_memory=True) for _ in range(2)]
+    device_buffers = [torch.empty(buffer_bytes, dtype=torch.uint8, device=device) for _ in range(2)]
+    copied = [None, None]     # H2D copy of the buffer done (copy stream)
+    consumed = [None, None]   # views of the buffer used (current stream)
+    copy_stream = torch.cuda.Stream(device=device)
+    current_stream = torch.cuda.current_stream(device)
+
+    def load(chunk_idx: int) -> None:
+        slot = chunk_idx % 2
+        start, end, _ = chunks[chunk_idx]
+        if copied[slot] is not None:
+            copied[slot].synchronize()    # the pinned buffer is still the source of the previous copy
+        host_buffers[slot][: end - start].copy_(ckpt._data[start:end])
+        with torch.cuda.stream(copy_stream):
+            if consumed[slot] is not None:
+                copy_stream.wait_event(consumed[slot])
+            device_buffers[slot][: end - start].copy_(host_buffers[slot][: end - start], non_blocking=True)
+            copied[slot] = torch.cuda.Event()
+            copied[slot].record(copy_stream)
+
+    load(0)
+    for chunk_idx, (start, _, names) in enumerate(chunks):
+        if chunk_idx + 1 < len(chunks):
+            load(chunk_idx + 1)
+        slot = chunk_idx % 2
+        current_stream.wait_event(copied[slot])
+        for name in names:
+            yield name, ckpt._view(device_buffers[slot], start, ckpt.entries[name])
+        consumed[slot] = torch.cuda.Event()
+        consumed[slot].record(current_stream)
+    torch.cuda.synchronize(device)
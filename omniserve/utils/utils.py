@@ -15,7 +15,7 @@ import enum
 import os
 import socket
 import subprocess
-from typing import List, TypeVar
+from typing import List, Optional, TypeVar
 
 import psutil
 import torch
@@ -52,6 +52,61 @@ class Counter:
         self.counter = 0
 
 
+def async_h2d(data: list, dtype: torch.dtype, device: torch.device) -> torch.Tensor:
+    """Copies host data to the device through pinned memory without blocking the host.
+
+    A copy from pageable memory waits for the work queued on the stream, which serializes the input
+    preparation of a step with the kernels of the previous one.
+    """
+    return torch.tensor(data, dtype=dtype, pin_memory=True).to(device, non_blocking=True)
+
+
+class PinnedStagingRing:
+    """Reusable pinned host buffers that pack several small host arrays into a single H2D copy.
+
+    Every upload takes the next slot of the ring; a slot is only refilled once the copy issued from it has
+    completed (tracked by an event), so the host can prepare the next steps while earlier copies are in flight.
+    Slots grow to the largest upload seen.
+    """
+
+    def __init__(
+        self,
+        device: torch.device,
+        num_slots: int = 4,
+        dtype: torch.dtype = torch.long,
+        initial_numel: int = 1 << 14,
+    ) -> None:
+        self.device = device
+        self.dtype = dtype
+        self.slots = [torch.empty((initial_numel,), dtype=dtype, pin_memory=True) for _ in range(num_slots)]
+        self.events: List[Optional[torch.cuda.Event]] = [None] * num_slots
+        self.next_slot = 0
+
+    def upload(self, arrays: List[List[int]]) -> List[torch.Tensor]:
+        """Copies `arrays` to the device with one non-blocking copy; returns one device view per array."""
+        sizes = [len(array) for array in arrays]
+        total = sum(sizes)
+        slot_idx = self.next_slot
+        self.next_slot = (slot_idx + 1) % len(self.slots)
+        if self.events[slot_idx] is not None:
+            self.events[slot_idx].synchronize()
+        if self.slots[slot_idx].numel() < total:
+            self.slots[slot_idx] = torch.empty(
+                (max(total, 2 * self.slots[slot_idx].numel()),), dtype=self.dtype, pin_memory=True
+            )
+        host = self.slots[slot_idx].numpy()
+        offset = 0
+        for array, size in zip(arrays, sizes):
+            host[offset : offset + size] = array
+            offset += size
+        packed = torch.empty((total,), dtype=self.dtype, device=self.device)
+        packed.copy_(self.slots[slot_idx][:total], non_blocking=True)
+        event = torch.cuda.Event()
+        event.record()
+        self.events[slot_idx] = event
+        return list(packed.split(sizes))
+
+
 def is_hip() -> bool:
     return torch.version.hip is not None
 
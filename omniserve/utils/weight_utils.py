@@ -13,6 +13,8 @@ from huggingface_hub import snapshot_download
 from safetensors.torch import safe_open
 from tqdm.auto import tqdm
 
+from omniserve.utils.packed_checkpoint import get_packed_checkpoint_path, stream_packed_checkpoint
+
 
 class Disabledtqdm(tqdm):
     def __init__(self, *args, **kwargs):
@@ -90,7 +92,17 @@ def hf_model_weights_iterator(
     cache_dir: Optional[str] = None,
     load_format: str = "auto",
     revision: Optional[str] = None,
+    device: Optional[torch.device] = None,
 ) -> Iterator[Tuple[str, torch.Tensor]]:
+    # A packed checkpoint (omniserve/utils/packed_checkpoint.py) next to, or instead of, the torch checkpoint
+    # is streamed to the device of the model; its tensors are only valid until the next one is requested.
+    packed_path = get_packed_checkpoint_path(model_name_or_path)
+    if load_format == "packed" and packed_path is None:
+        raise RuntimeError(f"Cannot find a packed checkpoint in `{model_name_or_path}`")
+    if packed_path is not None and load_format in ["auto", "packed"]:
+        yield from stream_packed_checkpoint(packed_path, device if device is not None else torch.device("cpu"))
+        return
+
     use_safetensors = False
     use_np_cache = False
     fall_back_to_pt = False
@@ -218,3 +230,39 @@ def load_tensor_parallel_weights(
         f"{param.shape} != {loaded_weight.shape}"
     )
     param.data.copy_(loaded_weight)
+
+
+def get_qserve_tensor_parallel_shard(
+    loaded_weight: Any,  # `torch.Tensor` or `PySafeSlice`
+    param_name: str,
+    channel_ranges: List[Tuple[int, int]],
+    is_row_parallel: bool,
+    in_features: int,
+) -> Optional[torch.Tensor]:
+    """Gathers the [start, end) channel ranges of a QServe linear tensor.
+
+    Column parallel layers are split along the output channels, row parallel layers along the input channels.
+    The ranges are in unpacked channels and must be multiples of 32 (and of the group size for the row parallel
+    s2_scales / s2_zeros). W4A8 qweights are stored as [OC // 32, IC // 32] tiles of 32 x 32 int4 weights, so row
+    parallel shards are gathered tile-wise. Returns None for the tensors that are replicated (per output channel
+    scales of row parallel layers).
+    """
+    loaded_weight = convert_pyslice_to_tensor(loaded_weight)
+
+    def _gather(t: torch.Tensor, dim: int, scale: int = 1) -> torch.Tensor:
+        return torch.cat(
+            [t.narrow(dim, start // scale, (end - start) // scale) for start, end in channel_ranges], dim=dim
+        ).contiguous()
+
+    is_s2 = "s2_scales" in param_name or "s2_zeros" in param_name
+    if not is_row_parallel:
+        return _gather(loaded_weight, 1 if is_s2 else 0)
+    if param_name.endswith("qweight"):
+        out_features = loaded_weight.shape[0]
+        tiles = loaded_weight.reshape(out_features // 32, in_features // 32, -1)
+        return _gather(tiles, 1, 32).reshape(out_features, -1)
+    if param_name.endswith("weight"):
+        return _gather(loaded_weight, 1)
+    if is_s2:
+        return _gather(loaded_weight, 0, in_features // loaded_weight.shape[0])
+    return None
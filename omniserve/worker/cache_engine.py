@@ -14,15 +14,14 @@
 """CacheEngine class for managing the KV cache."""
 
 from math import prod
-from typing import Dict, List, Tuple
+from typing import Dict, List, Optional, Tuple
 
 import torch
 
-# TODO (kentang-mit@): cache_ops is not used now
-# from vllm._C import cache_ops
+import omniserve_backend.cache_ops as cache_ops
 from omniserve.config import CacheConfig, ModelConfig, ParallelConfig
 from omniserve.logger import init_logger
-from omniserve.utils.utils import STR_DTYPE_TO_TORCH_DTYPE
+from omniserve.utils.utils import STR_DTYPE_TO_TORCH_DTYPE, async_h2d
 import os
 
 logger = init_logger(__name__)
@@ -49,7 +48,7 @@ class BaseCacheEngine:
         cache_config: CacheConfig,
         model_config: ModelConfig,
         parallel_config: ParallelConfig,
-        kv_cache_config: Dict,  # INT4_ENABLED: Whether to use int4 for kv_cache, ZEROS_ENABLED: Whether to use zero point for kv_cache
+        kv_cache_config: Dict,  # INT4_ENABLED: Whether to use int4 for kv_cache, ZEROS_ENABLED: Whether to use zero point for kv_cache, STREAMING_INT4_ENABLED: INT4_ENABLED of the streaming heads
         cache_mode: str,
     ) -> None:
         self.cache_config = cache_config
@@ -71,13 +70,10 @@ class BaseCacheEngine:
 
         # Initialize the cache.
         self.elements_per_block = prod(self.get_key_block_shape())
-        # k and v (*2), 2 bytes per unit (*2)
-        self.num_bytes_per_block = self.elements_per_block // (
-            2 if kv_cache_config["INT4_ENABLED"] else 1
-        ) + self.block_size * self.num_heads * (
-            4 # if kv_cache_config["ZEROS_ENABLED"] else 2  # TODO: Fix this error for buffer offset (ctx pooling).
-        )
         assert cache_mode in ["retrieval", "streaming"], f"Invalid cache_mode: {cache_mode}"
+        self.num_bytes_per_block = _get_num_bytes_per_block(
+            self.num_heads, self.block_size, self.head_size, kv_cache_config, cache_mode
+        )
         self.cache_mode = cache_mode
         
         self.sparse_decode_mode = model_config.sp_attn_config.get_sparse_decode_mode()           
@@ -85,22 +81,32 @@ class BaseCacheEngine:
 
         assert self.sub_chunk_per_block > 0 and self.block_size % self.sub_chunk_per_block == 0, f"Invalid sub_chunk_per_block: {self.sub_chunk_per_block}"
         
-        self.num_bytes_k_stats_per_block = (2 * (self.sparse_decode_mode != 0)) * self.sub_chunk_per_block * self.num_heads * self.head_size * 2 * (self.cache_mode == "retrieval")      # The first 2 in (2 * (self.sparse_decode_mode != 0)) is because we have min-max stats, the second 2 is because we have 2 bytes per fp16 element
+        self.num_bytes_k_stats_per_block = _get_num_bytes_k_stats_per_block(
+            self.num_heads, self.head_size, model_config, cache_mode
+        )
 
         _get_dtype_size(self.dtype)
         
-        if kv_cache_config["INT4_ENABLED"]:
+        if _int4_kv_enabled(kv_cache_config, cache_mode):
             assert kv_cache_config[
                 "ZEROS_ENABLED"
             ], "INT4 KV Cache must be used with Zero Points."
-            print("[INFO] USE INT4 w/ ZERO_POINTS for KV CACHE")
+            print(f"[INFO] USE INT4 w/ ZERO_POINTS for {cache_mode.upper()} KV CACHE")
         else:
             # assert kv_cache_config[
             #     "ZEROS_ENABLED"
             # ], "INT8 KV Cache must be used with Zero Points."
-            print("[INFO] USE INT8 for KV CACHE")
+            print(f"[INFO] USE INT8 for {cache_mode.upper()} KV CACHE")
         self.gpu_cache = self.allocate_gpu_cache()
         self.cpu_cache = self.allocate_cpu_cache()
+        # Tiered mode: the K stats of the cold retrieval pages (in the host pool) stay on the GPU, one slot per CPU
+        # block. Their table K pointers are set so that KVBlockArray::getKStatsMaxPtr lands on the slot.
+        self.gpu_stats_pool = None
+        if cache_mode == "retrieval" and cache_config.num_hot_retrieval_blocks > 0:
+            assert self.num_bytes_k_stats_per_block > 0, "Offloading retrieval pages requires sparse decoding."
+            self.gpu_stats_pool = torch.empty(
+                (self.num_cpu_blocks, self.num_bytes_k_stats_per_block), dtype=torch.uint8, device="cuda"
+            )
 
         # Initialize the stream for caching operations.
         self.cache_stream = cache_stream
@@ -147,18 +153,20 @@ class BaseCacheEngine:
 
     def allocate_cpu_cache(self) -> List[KVCache]:
         cpu_cache: KVCache
-        key_block_shape = self.get_key_block_shape()
-        value_block_shape = self.get_value_block_shape()
+        # NOTE: CPU blocks mirror the flat GPU rows (payload + scales/zeros + K stats),
+        # so that a swap is a plain byte copy of whole pages.
         pin_memory = True
-        # for _ in range(self.num_layers):
         key_blocks = torch.empty(
-            size=(self.num_cpu_blocks, *key_block_shape),
+            size=(
+                self.num_cpu_blocks,
+                self.num_bytes_per_block + self.num_bytes_k_stats_per_block,
+            ),
             dtype=self.dtype,
             pin_memory=pin_memory,
             device="cpu",
         )
         value_blocks = torch.empty(
-            size=(self.num_cpu_blocks, *value_block_shape),
+            size=(self.num_cpu_blocks, self.num_bytes_per_block),
             dtype=self.dtype,
             pin_memory=pin_memory,
             device="cpu",
@@ -168,34 +176,44 @@ class BaseCacheEngine:
 
     def _swap(
         self,
-        src: List[KVCache],
-        dst: List[KVCache],
+        src: KVCache,
+        dst: KVCache,
         src_to_dst: Dict[int, int],
     ) -> None:
-        return
+        # The copies are issued on cache_stream; callers wait on self.event before
+        # touching the swapped blocks.
         with torch.cuda.stream(self.cache_stream):
-            for i in range(self.num_layers):
-                src_key_cache, src_value_cache = src[i]
-                dst_key_cache, dst_value_cache = dst[i]
-                # Copy the key blocks.
-                cache_ops.swap_blocks(src_key_cache, dst_key_cache, src_to_dst)
-                # Copy the value blocks.
-                cache_ops.swap_blocks(src_value_cache, dst_value_cache, src_to_dst)
-                event = self.events[i]
-                event.record(stream=self.cache_stream)
+            src_key_cache, src_value_cache = src
+            dst_key_cache, dst_value_cache = dst
+            # Copy the key blocks.
+            cache_ops.swap_blocks(src_key_cache, dst_key_cache, src_to_dst)
+            # Copy the value blocks.
+            cache_ops.swap_blocks(src_value_cache, dst_value_cache, src_to_dst)
+            self.event.record(stream=self.cache_stream)
 
     def swap_in(self, src_to_dst: Dict[int, int]) -> None:
         self._swap(self.cpu_cache, self.gpu_cache, src_to_dst)
 
     def swap_out(self, src_to_dst: Dict[int, int]) -> None:
+        # The blocks to swap out may still be written by the compute stream.
+        self.cache_stream.wait_stream(torch.cuda.current_stream())
+        self._swap(self.gpu_cache, self.cpu_cache, src_to_dst)
+
+    def offload(self, src_to_dst: Dict[int, int]) -> None:
+        # GPU block -> CPU block of the cold tier: the whole rows go to the host pool, the K stats to gpu_stats_pool.
+        self.cache_stream.wait_stream(torch.cuda.current_stream())
+        with torch.cuda.stream(self.cache_stream):
+            blocks = async_h2d([list(src_to_dst.keys()), list(src_to_dst.values())], torch.long, "cuda")
+            key_bytes = self.gpu_cache[0].view(torch.uint8)
+            self.gpu_stats_pool[blocks[1]] = key_bytes[
+                blocks[0], self.num_bytes_per_block : self.num_bytes_per_block + self.num_bytes_k_stats_per_block
+            ]
         self._swap(self.gpu_cache, self.cpu_cache, src_to_dst)
 
     def copy(self, src_to_dsts: Dict[int, List[int]]) -> None:
-        key_caches = [key_cache for key_cache, _ in self.gpu_cache]
-        value_caches = [value_cache for _, value_cache in self.gpu_cache]
-        return
+        key_cache, value_cache = self.gpu_cache
         # NOTE(woosuk): This operation implicitly synchronizes the CPU and GPU.
-        cache_ops.copy_blocks(key_caches, value_caches, src_to_dsts)
+        cache_ops.copy_blocks([key_cache], [value_cache], src_to_dsts)
 
     # @staticmethod
     # def get_cache_block_size(
@@ -215,6 +233,358 @@ class BaseCacheEngine:
 
 LayerCacheEngine = Tuple[BaseCacheEngine, BaseCacheEngine]
 
+
+class RaggedBlockTables:
+    """Ragged (CSR) per-layer block pointer tables of one cache_mode ("retrieval" / "streaming") for the decode
+    batch, kept on device across steps together with the context lengths of the batch.
+
+    Every layer table is a flat int64 row [B + 1 row offsets | pointers] (see KVBlockArray::setRagged): row b
+    holds capacity_b = offsets[b + 1] - offsets[b] K pointers followed by capacity_b V pointers. Rows get
+    `row_granularity` blocks of slack. Only deltas go to the device: the pointers of appended (or rewritten)
+    blocks are scattered by cache_ops.scatter_block_table_entries, and when the batch changes (sequences
+    finished, swapped or added) the rows of the remaining sequences are moved on device by
+    cache_ops.move_block_table_rows.
+
+    With cold retrieval pages (num_hot_blocks > 0, see BaseBlockSpaceManager._offload_cold_block), block numbers
+    from the number of GPU blocks on are CPU blocks: their V pointers point into the host pool and their K
+    pointers at their K stats slot (see RetrievalPageOffload). A page turns cold when it leaves the hot window of
+    the last num_hot_blocks pages, so only the entries that crossed that boundary since the last step are checked.
+    """
+
+    def __init__(
+        self,
+        cache_engine: "CacheEngine",
+        cache_mode: str,
+        row_granularity: int = 16,
+        num_hot_blocks: int = 0,
+    ) -> None:
+        self.row_granularity = row_granularity
+        self.num_hot_blocks = num_hot_blocks
+        engines = cache_engine._engines(cache_mode)
+        elem_size = _get_dtype_size(engines[0].dtype)
+        self.device = engines[0].gpu_cache[0].device
+        # [2, layers] base pointers and block strides (in bytes) of the K and V pools.
+        self.base_ptrs = torch.tensor(
+            [[engine.gpu_cache[0].data_ptr() for engine in engines], [engine.gpu_cache[1].data_ptr() for engine in engines]],
+            dtype=torch.long, device=self.device,
+        )
+        self.block_bytes = torch.tensor(
+            [
+                [(engine.num_bytes_per_block + engine.num_bytes_k_stats_per_block) * elem_size for engine in engines],
+                [engine.num_bytes_per_block * elem_size for engine in engines],
+            ],
+            dtype=torch.long, device=self.device,
+        )
+        self.num_gpu_blocks = engines[0].num_gpu_blocks
+        self.cold_base_ptrs = self.cold_block_bytes = None
+        if num_hot_blocks > 0:
+            self.cold_base_ptrs = torch.tensor(
+                [
+                    [engine.gpu_stats_pool.data_ptr() - engine.num_bytes_per_block for engine in engines],
+                    [engine.cpu_cache[1].data_ptr() for engine in engines],
+                ],
+                dtype=torch.long, device=self.device,
+            )
+            self.cold_block_bytes = torch.tensor(
+                [
+                    [engine.num_bytes_k_stats_per_block for engine in engines],
+                    [engine.num_bytes_per_block * elem_size for engine in engines],
+                ],
+                dtype=torch.long, device=self.device,
+            )
+
+        self.seq_ids: List[int] = []
+        # Per row: blocks written, last block written, capacity and start (in blocks) of the row.
+        self.row_lens: List[int] = []
+        self.row_last_blocks: List[int] = []
+        self.row_capacities: List[int] = []
+        self.row_starts: List[int] = [0]
+        self.tables = torch.zeros((len(engines), 1), dtype=torch.long, device=self.device)
+        self.context_lens_list: List[int] = []
+        self.context_lens = torch.zeros((0,), dtype=torch.int, device=self.device)
+
+    def _table_pos(self, row_idx: int) -> int:
+        return len(self.seq_ids) + 1 + 2 * self.row_starts[row_idx]
+
+    def _relayout(self, seq_ids: List[int], block_tables: List[List[int]]) -> None:
+        old_rows = {seq_id: row_idx for row_idx, seq_id in enumerate(self.seq_ids)}
+        old_table_pos = [self._table_pos(row_idx) for row_idx in range(len(self.seq_ids))]
+        old_row_lens, old_row_last_blocks, old_row_capacities = self.row_lens, self.row_last_blocks, self.row_capacities
+
+        self.seq_ids = list(seq_ids)
+        self.row_capacities = [
+            max(
+                (len(block_table) + self.row_granularity - 1) // self.row_granularity * self.row_granularity,
+                old_row_capacities[old_rows[seq_id]] if seq_id in old_rows else 0,
+            )
+            for seq_id, block_table in zip(seq_ids, block_tables)
+        ]
+        self.row_starts = [0]
+        for capacity in self.row_capacities:
+            self.row_starts.append(self.row_starts[-1] + capacity)
+        self.row_lens = [0] * len(seq_ids)
+        self.row_last_blocks = [-1] * len(seq_ids)
+
+        row_moves = []
+        for row_idx, seq_id in enumerate(seq_ids):
+            old_row_idx = old_rows.get(seq_id)
+            if old_row_idx is None or old_row_lens[old_row_idx] == 0:
+                continue
+            row_moves.append(
+                [
+                    old_table_pos[old_row_idx],
+                    self._table_pos(row_idx),
+                    old_row_lens[old_row_idx],
+                    old_row_capacities[old_row_idx],
+                    self.row_capacities[row_idx],
+                ]
+            )
+            self.row_lens[row_idx] = old_row_lens[old_row_idx]
+            self.row_last_blocks[row_idx] = old_row_last_blocks[old_row_idx]
+
+        batch_size = len(seq_ids)
+        tables = torch.empty(
+            (self.tables.size(0), batch_size + 1 + 2 * self.row_starts[-1]), dtype=torch.long, device=self.device
+        )
+        tables[:, : batch_size + 1] = async_h2d(self.row_starts, torch.long, self.device)
+        if len(row_moves) > 0:
+            row_moves = async_h2d(row_moves, torch.long, self.device)
+            cache_ops.move_block_table_rows(tables, self.tables, row_moves)
+        self.tables = tables
+
+    def update(
+        self,
+        seq_ids: List[int],
+        block_tables: List[List[int]],
+        context_lens: List[int],
+        rewritten_seq_ids: Optional[List[int]] = None,
+    ) -> Tuple[List[torch.Tensor], torch.Tensor]:
+        """Brings the tables and context lengths up to date with the batch (one entry per sequence of
+        seq_ids) and returns the per-layer tables and the int32 context lengths. The rows of rewritten_seq_ids
+        had entries before their last block replaced (block compaction) and are scattered again."""
+        batch_changed = self.seq_ids != seq_ids
+        if batch_changed or any(
+            len(block_table) > capacity for block_table, capacity in zip(block_tables, self.row_capacities)
+        ):
+            self._relayout(seq_ids, block_tables)
+
+        # Running sequences only append blocks, except for copy-on-write of the last block and the rolling
+        # local window of the streaming tables, which rewrite the row, and speculative decoding rollbacks,
+        # which shorten it (rewritten as well). Checking the last block is enough.
+        rewritten_seq_ids = set(rewritten_seq_ids or [])
+        k_positions, v_positions, block_ids = [], [], []
+        for row_idx, block_table in enumerate(block_tables):
+            num_cached = self.row_lens[row_idx]
+            if seq_ids[row_idx] in rewritten_seq_ids or num_cached > len(block_table) or (
+                num_cached > 0 and block_table[num_cached - 1] != self.row_last_blocks[row_idx]
+            ):
+                num_cached = 0
+            if num_cached == len(block_table):
+                continue
+            k_start = self._table_pos(row_idx)
+            v_start = k_start + self.row_capacities[row_idx]
+            if self.num_hot_blocks > 0:
+                for block_idx in range(max(0, num_cached - self.num_hot_blocks - 1), max(0, min(num_cached, len(block_table) - self.num_hot_blocks))):
+                    if block_table[block_idx] >= self.num_gpu_blocks:
+                        k_positions.append(k_start + block_idx)
+                        v_positions.append(v_start + block_idx)
+                        block_ids.append(block_table[block_idx])
+            k_positions.extend(range(k_start + num_cached, k_start + len(block_table)))
+            v_positions.extend(range(v_start + num_cached, v_start + len(block_table)))
+            block_ids.extend(block_table[num_cached:])
+            self.row_lens[row_idx] = len(block_table)
+            self.row_last_blocks[row_idx] = block_table[-1]
+        if len(block_ids) > 0:
+            deltas = async_h2d([k_positions, v_positions, block_ids], torch.long, self.device)
+            cache_ops.scatter_block_table_entries(
+                self.tables, self.base_ptrs, self.block_bytes, deltas,
+                self.cold_base_ptrs, self.cold_block_bytes, self.num_gpu_blocks,
+            )
+
+        if batch_changed or len(context_lens) != len(self.context_lens_list):
+            self.context_lens = async_h2d(context_lens, torch.int, self.device)
+        elif context_lens == [context_len + 1 for context_len in self.context_lens_list]:
+            self.context_lens += 1
+        elif context_lens != self.context_lens_list:
+            self.context_lens.copy_(torch.tensor(context_lens, dtype=torch.int, pin_memory=True), non_blocking=True)
+        self.context_lens_list = list(context_lens)
+
+        return list(self.tables.unbind(0)), self.context_lens
+
+class RetrievalPageOffload:
+    """Decode-time staging of the cold retrieval pages (tiered KV cache, CacheConfig.num_hot_retrieval_blocks > 0).
+
+    The payloads of cold pages live in the pinned host pool (the CPU cache of the retrieval engines), their K stats
+    in BaseCacheEngine.gpu_stats_pool, so the page selector runs on the regular tables. Once a layer knows its
+    pages, stage() copies its table and cache_ops.gather_offloaded_pages brings the selected cold pages into a
+    staging pool and redirects their entries in the copy, which the attention kernel reads. The pool is double
+    buffered by layer parity: while a layer runs, the next one is prefetched on a side stream with the pages it
+    attended to in the previous step (those it reuses until its next selection); its own gather then only copies
+    the pages that are still missing.
+    """
+
+    def __init__(self, cache_engine: "CacheEngine", num_staging_blocks: int) -> None:
+        self.engines = cache_engine._engines("retrieval")
+        self.num_layers = len(self.engines)
+        self.block_size = cache_engine.cache_config.block_size
+        self.copy_bytes = [engine.num_bytes_per_block for engine in self.engines]
+        max_copy_bytes = max(self.copy_bytes)
+        self.staging_k = [
+            torch.empty((num_staging_blocks, max_copy_bytes), dtype=torch.uint8, device="cuda") for _ in range(2)
+        ]
+        self.staging_v = [
+            torch.empty((num_staging_blocks, max_copy_bytes), dtype=torch.uint8, device="cuda") for _ in range(2)
+        ]
+        self.num_staged = torch.zeros((2, 1), dtype=torch.int, device="cuda")
+        self.staged_tables: List[Optional[torch.Tensor]] = [None, None]
+        # Layer whose table copy is in a buffer since the last prefetch (-1: none).
+        self.prefetched_layers = [-1, -1]
+        self.prefetch_events = [torch.cuda.Event(), torch.cuda.Event()]
+        self.prefetch_stream = torch.cuda.Stream()
+        # Per layer: the pages it attended to in the last step.
+        self.page_idxes: List[Optional[torch.Tensor]] = [None] * self.num_layers
+
+        self.layer_tables: List[torch.Tensor] = []
+        self.context_lens: Optional[torch.Tensor] = None
+        self.page_nums: Optional[torch.Tensor] = None
+
+    def begin_step(
+        self, layer_tables: List[torch.Tensor], context_lens: torch.Tensor, page_nums: Optional[torch.Tensor]
+    ) -> None:
+        self.layer_tables = layer_tables
+        self.context_lens = context_lens
+        self.page_nums = page_nums
+        self.prefetched_layers = [-1, -1]
+        self._prefetch(0)
+
+    def _copy_table(self, buf: int, layer_idx: int) -> None:
+        table = self.layer_tables[layer_idx]
+        if self.staged_tables[buf] is None or self.staged_tables[buf].shape != table.shape:
+            self.staged_tables[buf] = torch.empty_like(table)
+        self.staged_tables[buf].copy_(table)
+        self.num_staged[buf].zero_()
+
+    def _gather(self, buf: int, layer_idx: int, page_idx: torch.Tensor) -> None:
+        engine = self.engines[layer_idx]
+        cache_ops.gather_offloaded_pages(
+            self.staged_tables[buf],
+            page_idx,
+            self.page_nums,
+            self.context_lens,
+            self.block_size,
+            engine.cpu_cache[0],
+            engine.cpu_cache[1],
+            self.staging_k[buf],
+            self.staging_v[buf],
+            self.num_staged[buf],
+            self.copy_bytes[layer_idx],
+        )
+
+    def _prefetch(self, layer_idx: int) -> None:
+        if layer_idx >= self.num_layers:
+            return
+        page_idx = self.page_idxes[layer_idx]
+        if page_idx is None or page_idx.size(0) != self.context_lens.size(0):
+            return
+        buf = layer_idx % 2
+        # The buffer was last read by the attention of layer_idx - 2, issued before.
+        self.prefetch_stream.wait_stream(torch.cuda.current_stream())
+        with torch.cuda.stream(self.prefetch_stream):
+            self._copy_table(buf, layer_idx)
+            self._gather(buf, layer_idx, page_idx)
+            self.prefetch_events[buf].record(self.prefetch_stream)
+        page_idx.record_stream(self.prefetch_stream)
+        self.staged_tables[buf].record_stream(self.prefetch_stream)
+        self.prefetched_layers[buf] = layer_idx
+
+    @torch.no_grad()
+    def stage(self, layer_idx: int, page_idx: torch.Tensor) -> torch.Tensor:
+        """Returns the retrieval table of layer_idx with the selected pages (b x heads x pages) on the GPU."""
+        buf = layer_idx % 2
+        page_idx = page_idx.contiguous()
+        if self.prefetched_layers[buf] == layer_idx:
+            torch.cuda.current_stream().wait_event(self.prefetch_events[buf])
+        else:
+            self._copy_table(buf, layer_idx)
+        self.prefetched_layers[buf] = -1
+        self._gather(buf, layer_idx, page_idx)
+        # A snapshot: the attention wrappers update their cached page indices in place.
+        self.page_idxes[layer_idx] = page_idx.clone()
+        staged_table = self.staged_tables[buf]
+        self._prefetch(layer_idx + 1)
+        return staged_table
+
+
+class RetrievalPageScores:
+    """Selection counts of the retrieval pages of the decode batch (page eviction,
+    CacheConfig.max_retrieval_blocks_per_seq > 0).
+
+    scores is an fp32 [B, capacity] tensor, row b for the b-th sequence of the batch. The page selector of every layer
+    adds 1 to the entries of the history pages it selects for a head, and never selects a page whose entry is negative:
+    the pages evicted by BaseBlockSpaceManager._evict_blocks are set to -inf, their table entries still point at the
+    freed pages. Rows follow their sequences when the batch changes; a sequence that leaves the batch, or runs a prompt
+    again, starts over from zero. The engine reads the counts back every few steps (read()) to pick the pages to evict.
+    """
+
+    def __init__(self, device: torch.device, row_granularity: int = 256) -> None:
+        self.device = device
+        self.row_granularity = row_granularity
+        self.seq_ids: List[Optional[int]] = []
+        # Per row: the leading entries of the eviction list of the sequence that are already set to -inf.
+        self.num_evicted: List[int] = []
+        self.scores = torch.zeros((0, 0), dtype=torch.float, device=device)
+
+    def _relayout(self, seq_ids: List[int], num_pages: List[int]) -> None:
+        capacity = max(
+            self.scores.size(1),
+            (max(num_pages) + self.row_granularity - 1) // self.row_granularity * self.row_granularity,
+        )
+        scores = torch.zeros((len(seq_ids), capacity), dtype=torch.float, device=self.device)
+        old_rows = {seq_id: row_idx for row_idx, seq_id in enumerate(self.seq_ids) if seq_id is not None}
+        num_evicted = [0] * len(seq_ids)
+        src_rows, dst_rows = [], []
+        for row_idx, seq_id in enumerate(seq_ids):
+            old_row_idx = old_rows.get(seq_id)
+            if old_row_idx is None:
+                continue
+            src_rows.append(old_row_idx)
+            dst_rows.append(row_idx)
+            num_evicted[row_idx] = self.num_evicted[old_row_idx]
+        if len(dst_rows) > 0:
+            scores[async_h2d(dst_rows, torch.long, self.device), : self.scores.size(1)] = self.scores[
+                async_h2d(src_rows, torch.long, self.device)
+            ]
+        self.seq_ids = list(seq_ids)
+        self.num_evicted = num_evicted
+        self.scores = scores
+
+    def begin_step(self, seq_ids: List[int], num_pages: List[int], evicted_pages: List[List[int]]) -> bool:
+        """Brings the rows up to date with the decode batch (the table lengths and the eviction lists of seq_ids)
+        and returns whether pages were evicted since the previous step."""
+        if self.seq_ids != seq_ids or max(num_pages) > self.scores.size(1):
+            self._relayout(seq_ids, num_pages)
+        # Eviction lists only grow while their sequences run.
+        rows, pages = [], []
+        for row_idx, row_evicted_pages in enumerate(evicted_pages):
+            new_pages = row_evicted_pages[self.num_evicted[row_idx] :]
+            rows.extend([row_idx] * len(new_pages))
+            pages.extend(new_pages)
+            self.num_evicted[row_idx] = len(row_evicted_pages)
+        if len(pages) > 0:
+            indices = async_h2d([rows, pages], torch.long, self.device)
+            self.scores[indices[0], indices[1]] = float("-inf")
+        return len(pages) > 0
+
+    def forget(self, seq_ids: List[int]) -> None:
+        """Drops the rows of sequences whose pages are allocated again (prompt runs)."""
+        self.seq_ids = [None if seq_id in seq_ids else seq_id for seq_id in self.seq_ids]
+
+    def read(self) -> Dict[int, List[float]]:
+        """Seq id -> selection count of every page of the sequences of the last decode batch (synchronizes)."""
+        scores = self.scores.cpu().tolist()
+        return {seq_id: row for seq_id, row in zip(self.seq_ids, scores) if seq_id is not None}
+
+
 class CacheEngine:
     """Manages the KV cache.
 
@@ -272,6 +642,72 @@ class CacheEngine:
             
             self.events.append(layer_event)
 
+        # Block tables of the decode batch (IFB mode), updated in place between steps.
+        self.decode_block_tables: Dict[str, Optional[RaggedBlockTables]] = {
+            "retrieval": RaggedBlockTables(self, "retrieval", num_hot_blocks=cache_config.num_hot_retrieval_blocks),
+            "streaming": (
+                RaggedBlockTables(self, "streaming")
+                if model_config.sp_attn_config.sparse_kv_cache_enabled()
+                else None
+            ),
+        }
+        self.retrieval_offload: Optional[RetrievalPageOffload] = None
+        if cache_config.num_hot_retrieval_blocks > 0:
+            self.retrieval_offload = RetrievalPageOffload(self, cache_config.num_retrieval_staging_blocks)
+        self.retrieval_page_scores: Optional[RetrievalPageScores] = None
+        if cache_config.max_retrieval_blocks_per_seq > 0:
+            self.retrieval_page_scores = RetrievalPageScores(self.decode_block_tables["retrieval"].device)
+
+    @staticmethod
+    def get_retrieval_cpu_block_bytes(
+        cache_config: CacheConfig,
+        model_config: ModelConfig,
+        parallel_config: ParallelConfig,
+        kv_cache_config: Dict,
+    ) -> int:
+        """Pinned host bytes of one retrieval CPU block over all the layers (K and V rows)."""
+        head_size = model_config.get_head_size()
+        if cache_config.cache_dtype == "auto":
+            dtype = model_config.dtype
+        else:
+            dtype = STR_DTYPE_TO_TORCH_DTYPE[cache_config.cache_dtype]
+        num_bytes = 0
+        for layer_idx in range(model_config.get_num_layers(parallel_config)):
+            num_heads = model_config.sp_attn_config.retrieval_head_num(layer_idx)
+            num_bytes_per_block = _get_num_bytes_per_block(num_heads, cache_config.block_size, head_size, kv_cache_config)
+            num_bytes += 2 * num_bytes_per_block + _get_num_bytes_k_stats_per_block(
+                num_heads, head_size, model_config, "retrieval"
+            )
+        return num_bytes * _get_dtype_size(dtype)
+
+    @staticmethod
+    def get_gpu_block_bytes(
+        cache_config: CacheConfig,
+        model_config: ModelConfig,
+        parallel_config: ParallelConfig,
+        kv_cache_config: Dict,
+        cache_mode: str,
+    ) -> int:
+        """GPU bytes of one block of the cache_mode heads over all the layers (K rows with their stats, V rows)."""
+        head_size = model_config.get_head_size()
+        if cache_config.cache_dtype == "auto":
+            dtype = model_config.dtype
+        else:
+            dtype = STR_DTYPE_TO_TORCH_DTYPE[cache_config.cache_dtype]
+        num_bytes = 0
+        for layer_idx in range(model_config.get_num_layers(parallel_config)):
+            if cache_mode == "retrieval":
+                num_heads = model_config.sp_attn_config.retrieval_head_num(layer_idx)
+            else:
+                num_heads = model_config.sp_attn_config.streaming_head_num(layer_idx)
+            num_bytes_per_block = _get_num_bytes_per_block(
+                num_heads, cache_config.block_size, head_size, kv_cache_config, cache_mode
+            )
+            num_bytes += 2 * num_bytes_per_block + _get_num_bytes_k_stats_per_block(
+                num_heads, head_size, model_config, cache_mode
+            )
+        return num_bytes * _get_dtype_size(dtype)
+
 
     # @staticmethod
     # def get_cache_block_size(
@@ -288,6 +724,76 @@ class CacheEngine:
     #     value_cache_block = key_cache_block
     #     total = num_layers * (key_cache_block + value_cache_block)
     #     return cache_bit * total
+    def _engines(self, cache_mode: str) -> List[BaseCacheEngine]:
+        idx = 0 if cache_mode == "retrieval" else 1
+        return [engines[idx] for engines in self.layer_cache_engines]
+
+    def swap_in(self, src_to_dst: Dict[int, int], cache_mode: str) -> None:
+        if not src_to_dst:
+            return
+        for engine in self._engines(cache_mode):
+            engine.swap_in(src_to_dst)
+
+    def swap_out(self, src_to_dst: Dict[int, int], cache_mode: str) -> None:
+        if not src_to_dst:
+            return
+        for engine in self._engines(cache_mode):
+            engine.swap_out(src_to_dst)
+
+    def offload(self, src_to_dst: Dict[int, int]) -> None:
+        """Moves the retrieval pages that left the hot window of their sequences to the cold tier."""
+        if not src_to_dst:
+            return
+        for engine in self._engines("retrieval"):
+            engine.offload(src_to_dst)
+
+    def copy(self, src_to_dsts: Dict[int, List[int]], cache_mode: str) -> None:
+        if not src_to_dsts:
+            return
+        # Copy the blocks of all the layers in a single kernel launch.
+        engines = self._engines(cache_mode)
+        key_caches = [engine.gpu_cache[0] for engine in engines]
+        value_caches = [engine.gpu_cache[1] for engine in engines]
+        cache_ops.copy_blocks(key_caches, value_caches, src_to_dsts)
+
+    def _get_block_rows(self, cache_mode: str) -> List[torch.Tensor]:
+        # The flat K (payload, scales / zeros, K stats) and V rows of every layer, as bytes.
+        return [cache.view(torch.uint8) for engine in self._engines(cache_mode) for cache in engine.gpu_cache]
+
+    def send_blocks(self, block_ids: Dict[str, List[int]], dst: int) -> None:
+        """Sends the GPU pages of block_ids (cache_mode -> blocks) to rank dst, as stored: quantized, with their
+        scales / zeros and K stats. One message per cache mode."""
+        for cache_mode, blocks in block_ids.items():
+            if not blocks:
+                continue
+            blocks = async_h2d(blocks, dtype=torch.long, device="cuda")
+            buffer = torch.cat([rows[blocks].flatten() for rows in self._get_block_rows(cache_mode)])
+            torch.distributed.send(buffer, dst=dst)
+
+    def recv_blocks(self, block_ids: Dict[str, List[int]], src: int) -> None:
+        """Receives the pages sent by send_blocks on rank src into the same GPU blocks."""
+        for cache_mode, blocks in block_ids.items():
+            if not blocks:
+                continue
+            num_blocks = len(blocks)
+            blocks = async_h2d(blocks, dtype=torch.long, device="cuda")
+            block_rows = self._get_block_rows(cache_mode)
+            buffer = torch.empty(
+                num_blocks * sum(rows.size(1) for rows in block_rows), dtype=torch.uint8, device="cuda"
+            )
+            torch.distributed.recv(buffer, src=src)
+            offset = 0
+            for rows in block_rows:
+                num_bytes = num_blocks * rows.size(1)
+                rows[blocks] = buffer[offset : offset + num_bytes].view(num_blocks, rows.size(1))
+                offset += num_bytes
+
+    def wait_for_cache_ops(self) -> None:
+        """Make the compute stream wait for the swaps issued on cache_stream."""
+        current_stream = torch.cuda.current_stream()
+        for event in self.events:
+            current_stream.wait_event(event)
+
     def get_retrieval_k_gpu_cache_ptr(self, layer_idx: int) -> int:
         return self.layer_cache_engines[layer_idx][0].gpu_cache[0].data_ptr()
     
@@ -314,3 +820,30 @@ class CacheEngine:
 
 def _get_dtype_size(dtype: torch.dtype) -> int:
     return torch.tensor([], dtype=dtype).element_size()
+
+
+def _int4_kv_enabled(kv_cache_config: Dict, cache_mode: str) -> bool:
+    # STREAMING_INT4_ENABLED: precision of the streaming heads, defaults to the one of the retrieval heads.
+    if cache_mode == "streaming":
+        return kv_cache_config.get("STREAMING_INT4_ENABLED", kv_cache_config["INT4_ENABLED"])
+    return kv_cache_config["INT4_ENABLED"]
+
+
+def _get_num_bytes_per_block(
+    num_heads: int, block_size: int, head_size: int, kv_cache_config: Dict, cache_mode: str = "retrieval"
+) -> int:
+    # Payload, then the fp16 scales and zeros. The zeros slot is kept without ZEROS_ENABLED: the K stats start at a
+    # fixed offset (KVBlockArray::getKStatsMaxPtr).
+    return num_heads * block_size * head_size // (2 if _int4_kv_enabled(kv_cache_config, cache_mode) else 1) + block_size * num_heads * 4
+
+
+def _get_num_bytes_k_stats_per_block(num_heads: int, head_size: int, model_config: ModelConfig, cache_mode: str) -> int:
+    sp_attn_config = model_config.sp_attn_config
+    if cache_mode != "retrieval" or sp_attn_config.get_sparse_decode_mode() == 0:
+        return 0
+    # min-max stats of every sub-chunk, 2 bytes per fp16 element.
+    num_bytes = 2 * sp_attn_config.get_dec_sub_chunk_per_block() * num_heads * head_size * 2
+    if sp_attn_config.get_dec_super_page_size() > 0:
+        # Super-page min-max stats for the hierarchical page selection (only used in the first page of each super-page).
+        num_bytes += 2 * num_heads * head_size * 2
+    return num_bytes
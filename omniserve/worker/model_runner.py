@@ -11,6 +11,7 @@
 #   year={2025}
 # }
 
+import contextlib
 import os
 from typing import Dict, List, Optional, Tuple, Union
 
@@ -38,16 +39,31 @@ from omniserve.modeling.models.mixtral_w4a8_unpad import (
     MixtralForCausalLM as MixtralForCausalLMW4A8,
 )
 from omniserve.sampling_params import SamplingParams
-from omniserve.sequence import SamplerOutput, SequenceGroupMetadata
-from omniserve.utils.input_metadata import InputMetadata
-from omniserve.utils.utils import STR_DTYPE_TO_TORCH_DTYPE
+from omniserve.modeling.parallel_utils.communication_op import tensor_model_parallel_broadcast
+from omniserve.sequence import PLACEHOLDER_TOKEN_ID, SamplerOutput, SequenceGroupMetadata
+from omniserve.utils.input_metadata import ActivationBuffer, InputMetadata
+from omniserve.utils.kernel_profiler import kernel_profiler
+from omniserve.utils.packed_checkpoint import get_packed_checkpoint_path
+from omniserve.utils.utils import STR_DTYPE_TO_TORCH_DTYPE, PinnedStagingRing, async_h2d
 from omniserve.worker.cache_engine import CacheEngine
 
 from omniserve.modeling.layers.ctx_attn.ctx_attn_init import init_ctx_sparse_attn, init_sparse_kv_cache
-from omniserve.modeling.layers.ctx_attn.block_table_utils import pad_block_tables, get_layer_block_tables, _make_tensor_with_pad
+from omniserve.modeling.layers.ctx_attn.ring_ctx_attn import ContextParallelShard
+from omniserve.modeling.layers.quantized_linear.gemm_epilogue import TOPK_MAX as LM_HEAD_TOPK_MAX
+from omniserve.modeling.layers.sampler import SamplingTensors
+from omniserve.modeling.layers.ctx_attn.block_table_utils import get_layer_block_tables, _make_tensor_with_pad, _pad_to_max
 
 logger = init_logger(__name__)
 
+_BATCH_SIZE_ALIGNMENT = 8
+# Capture graphs for batch size 1, 2, 4, 8, 16, 24, 32, 40, ..., 256.
+# NOTE: _get_graph_batch_size needs to be updated if this list is changed.
+_BATCH_SIZES_TO_CAPTURE = [1, 2, 4] + [
+    _BATCH_SIZE_ALIGNMENT * i for i in range(1, 33)
+]
+# Narrowest block table (in pages) a decode graph is captured with. Wider tables go to the next power of 2.
+_MIN_PAGES_TO_CAPTURE = 8
+
 
 # def _pad_to_max(x: List[int], max_len: int, pad: int) -> List[int]:
 #     assert len(x) <= max_len
@@ -100,80 +116,101 @@ class ModelRunner:
         # Note: Shang's important fix here. Otherwise non-GEMM part will run in FP32.
         model_type = model_config.hf_config.architectures[0]
 
-        if model_type == "LlamaForCausalLM" or model_type == "MistralForCausalLM":
-            if "w4a8" in precision:
-                print(f"[INFO] Using {precision} precision")
-                self.model = (
-                    LlamaForCausalLMW4A8(
-                        self.model_config.hf_config,
-                        self.model_config,
-                        group_size,
-                        SamplingParams(
-                            temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
-                        ),
-                        kv_cache_config=self.kv_cache_config,
-                        quant_path=quant_path,
+        # A packed checkpoint is streamed straight into the parameters, so build the model on the GPU.
+        build_device = (
+            torch.device(self.device) if get_packed_checkpoint_path(quant_path) is not None else contextlib.nullcontext()
+        )
+        with build_device:
+            if model_type == "LlamaForCausalLM" or model_type == "MistralForCausalLM":
+                if "w4a8" in precision:
+                    print(f"[INFO] Using {precision} precision")
+                    self.model = (
+                        LlamaForCausalLMW4A8(
+                            self.model_config.hf_config,
+                            self.model_config,
+                            group_size,
+                            SamplingParams(
+                                temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
+                            ),
+                            kv_cache_config=self.kv_cache_config,
+                            quant_path=quant_path,
+                        )
+                        .half()
+                        .to(self.device)
                     )
-                    .half()
-                    .to(self.device)
-                )
-            elif "w8a8" in precision:
-                print(f"[INFO] Using {precision} precision")
-                self.model = (
-                    LlamaForCausalLMW8A8(
-                        self.model_config.hf_config,
-                        self.model_config,
-                        SamplingParams(
-                            temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
-                        ),
-                        kv_cache_config=self.kv_cache_config,
-                        quant_path=quant_path,
+                elif "w8a8" in precision:
+                    print(f"[INFO] Using {precision} precision")
+                    self.model = (
+                        LlamaForCausalLMW8A8(
+                            self.model_config.hf_config,
+                            self.model_config,
+                            SamplingParams(
+                                temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
+                            ),
+                            kv_cache_config=self.kv_cache_config,
+                            quant_path=quant_path,
+                        )
+                        .half()
+                        .to(self.device)
                     )
-                    .half()
-                    .to(self.device)
-                )
-            elif "w16a16" in precision:
-                print(f"[INFO] Using {precision} precision")
-                self.model = (
-                    LlamaForCausalLMW16A16(
-                        self.model_config.hf_config,
-                        self.model_config,
-                        SamplingParams(
-                            temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
-                        ),
-                        kv_cache_config=self.kv_cache_config,
-                        quant_path=quant_path,
+                elif "w16a16" in precision:
+                    print(f"[INFO] Using {precision} precision")
+                    self.model = (
+                        LlamaForCausalLMW16A16(
+                            self.model_config.hf_config,
+                            self.model_config,
+                            SamplingParams(
+                                temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
+                            ),
+                            kv_cache_config=self.kv_cache_config,
+                            quant_path=quant_path,
+                        )
+                        .half()
+                        .to(self.device)
                     )
-                    .half()
-                    .to(self.device)
-                )
-            else:
-                raise ValueError(
-                    f"Unsupported model precision: {precision}. Expected w8a8 or w4a8."
-                )
-        elif model_type == "MixtralForCausalLM":
-            if "w4a8" in precision:
-                print(f"[INFO] Using {precision} precision")
-                self.model = (
-                    MixtralForCausalLMW4A8(
-                        self.model_config.hf_config,
-                        SamplingParams(
-                            temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
-                        ),
-                        kv_cache_config=self.kv_cache_config,
-                        quant_path=quant_path,
+                else:
+                    raise ValueError(
+                        f"Unsupported model precision: {precision}. Expected w8a8 or w4a8."
                     )
-                    .half()
-                    .to(self.device)
-                )
+            elif model_type == "MixtralForCausalLM":
+                if "w4a8" in precision:
+                    print(f"[INFO] Using {precision} precision")
+                    self.model = (
+                        MixtralForCausalLMW4A8(
+                            self.model_config.hf_config,
+                            SamplingParams(
+                                temperature=1.0, top_p=1.0, top_k=1, max_tokens=512
+                            ),
+                            kv_cache_config=self.kv_cache_config,
+                            quant_path=quant_path,
+                        )
+                        .half()
+                        .to(self.device)
+                    )
+                else:
+                    raise ValueError(
+                        f"Unsupported model precision: {precision}. Expected w4a8."
+                    ) # add by JXGuo: secure the model to be CausalLM
             else:
-                raise ValueError(
-                    f"Unsupported model precision: {precision}. Expected w4a8."
-                ) # add by JXGuo: secure the model to be CausalLM
-        else:
-            raise ValueError(f"Unsupported model type: {model_type}.")
+                raise ValueError(f"Unsupported model type: {model_type}.")
         self.block_size = None  # Set after initial profiling.
 
+        # Top-k of the fused LM head epilogue, 0: the LM head computes full logits for every row.
+        self.lm_head_topk = 0
+        if self.model_config.quantize_lm_head:
+            if hasattr(self.model, "quantize_lm_head") and self.model.quantize_lm_head():
+                self.lm_head_topk = LM_HEAD_TOPK_MAX
+            else:
+                logger.warning("--quantize-lm-head is not supported for this model / vocabulary size, ignored.")
+        if self.model_config.w4a4_prefill_min_tokens > 0:
+            if not (
+                hasattr(self.model, "enable_w4a4_prefill")
+                and self.model.enable_w4a4_prefill(self.model_config.w4a4_prefill_min_tokens)
+            ):
+                logger.warning(
+                    "--w4a4-prefill-min-tokens requires a per-channel W4A8 model on a single GPU, ignored."
+                )
+
         init_ctx_sparse_attn(
             model=self.model,
             sp_attn_config=self.model_config.sp_attn_config,
@@ -184,13 +221,15 @@ class ModelRunner:
         )
         
         self.max_context_len_to_capture = (
-            self.model_config.max_context_len_to_capture
+            (self.model_config.max_context_len_to_capture or 0)
             if self.model_config is not None
             else 0
         )
 
         self.kv_cache_dtype = kv_cache_dtype
         self.num_layers = model_config.get_num_layers(parallel_config)
+        # Pinned staging buffers of the packed prompt metadata upload (see _prepare_prompt).
+        self.prompt_staging_ring = PinnedStagingRing(self.device)
 
         kv_scale_layer_offsets = (
             torch.arange(
@@ -225,13 +264,29 @@ class ModelRunner:
         # )
         num_retrieval_cpu_blocks = 10
         num_streaming_cpu_blocks = 10
+        if cache_config.num_hot_retrieval_blocks > 0:
+            # The CPU blocks of the retrieval cache are the cold tier of the offloaded pages.
+            num_retrieval_cpu_blocks = int(
+                cache_config.retrieval_offload_space_bytes
+                // CacheEngine.get_retrieval_cpu_block_bytes(cache_config, model_config, parallel_config, kv_cache_config)
+            )
 
         manual_num_retrieval_gpu_blocks = os.environ.get("NUM_RETRIEVAL_GPU_PAGE_BLOCKS")
         manual_num_streaming_gpu_blocks = os.environ.get("NUM_STREAMING_GPU_PAGE_BLOCKS")
+        if manual_num_retrieval_gpu_blocks is None or manual_num_streaming_gpu_blocks is None:
+            num_retrieval_gpu_blocks, num_streaming_gpu_blocks = self._get_num_gpu_blocks(
+                cache_config, kv_cache_config, free_gpu_memory, total_gpu_memory
+            )
         if manual_num_retrieval_gpu_blocks is not None:
             num_retrieval_gpu_blocks = int(manual_num_retrieval_gpu_blocks)
         if manual_num_streaming_gpu_blocks is not None:
             num_streaming_gpu_blocks = int(manual_num_streaming_gpu_blocks)
+        if torch.distributed.is_initialized() and torch.distributed.get_world_size() > 1:
+            # The scheduler allocates one set of block ids for all the ranks (and for both instances with
+            # disaggregated prefill): every rank needs all of them.
+            num_gpu_blocks = torch.tensor([num_retrieval_gpu_blocks, num_streaming_gpu_blocks], device="cuda")
+            torch.distributed.all_reduce(num_gpu_blocks, op=torch.distributed.ReduceOp.MIN)
+            num_retrieval_gpu_blocks, num_streaming_gpu_blocks = num_gpu_blocks.tolist()
 
         cache_config.num_retrieval_gpu_blocks = num_retrieval_gpu_blocks
         cache_config.num_streaming_gpu_blocks = num_streaming_gpu_blocks
@@ -248,6 +303,71 @@ class ModelRunner:
         # self.gpu_cache = self.cache_engine.gpu_cache
         self.cache_config = cache_config
 
+        # CUDA graphs of the decode step, captured lazily on first use of a
+        # (padded batch size, block table width, selector update) bucket.
+        self.graph_runners: Dict[Tuple[int, int, bool], CUDAGraphRunner] = {}
+        self.graph_memory_pool: Optional[Tuple[int, int]] = None
+        self.graph_static_buffers: Optional[Dict] = None
+        # Sequences whose page indices are held in the static buffers (None: buffers are stale).
+        self.graph_page_idx_seq_ids: Optional[List[int]] = None
+        self.last_decode_used_graph = False
+        # Tokens sampled by the previous step, still on the device, and the row of every sequence in them.
+        # The async engine loop schedules the next step before they reach the host (see PLACEHOLDER_TOKEN_ID).
+        self.last_sampled_tokens: Optional[torch.Tensor] = None
+        self.last_sampled_rows: Dict[int, int] = {}
+        self.last_sampled_tokens_synced = True
+        # Per-sequence sparse decoding page counts of the previous decode step (see _get_dynamic_sparse_page_nums).
+        self.last_dynamic_sparse_page_nums: Optional[List[int]] = None
+        # Activation buffers of the eager decode steps, alternating between two slots and reused while the
+        # batch size is unchanged, so the step being prepared never reallocates the one of the step in flight.
+        self.decode_activation_buffers: List[Optional[ActivationBuffer]] = [None, None]
+        self.decode_activation_buffer_idx = 0
+        self.set_block_size(cache_config.block_size)
+        # Opt-in per-(layer, op) kernel timing (OMNISERVE_KERNEL_PROFILE), see omniserve/utils/kernel_profiler.py.
+        kernel_profiler.enable_from_env()
+        kernel_profiler.install(self.model)
+
+    def _get_num_gpu_blocks(
+        self,
+        cache_config: CacheConfig,
+        kv_cache_config: Dict,
+        free_gpu_memory: int,
+        total_gpu_memory: int,
+    ) -> Tuple[int, int]:
+        """Retrieval and streaming GPU blocks that fit under gpu_memory_utilization.
+
+        The activation arenas of the largest prefill batch and of the two decode slots are reserved first. The
+        streaming heads get their sink and local blocks for max_num_seqs sequences, the retrieval heads the rest.
+        """
+        max_num_seqs = self.scheduler_config.max_num_seqs
+        activation_bytes = ActivationBuffer.get_num_bytes(
+            self.model, self.scheduler_config.max_num_batched_tokens
+        ) + 2 * ActivationBuffer.get_num_bytes(self.model, max_num_seqs)
+        kv_cache_bytes = (
+            total_gpu_memory * cache_config.gpu_memory_utilization
+            - (total_gpu_memory - free_gpu_memory)
+            - activation_bytes
+        )
+        sp_attn_config = self.model_config.sp_attn_config
+        num_streaming_gpu_blocks = max_num_seqs * max(
+            1, sp_attn_config.get_dec_sink_block_num() + sp_attn_config.get_dec_local_block_num()
+        )
+        streaming_block_bytes = CacheEngine.get_gpu_block_bytes(
+            cache_config, self.model_config, self.parallel_config, kv_cache_config, "streaming"
+        )
+        retrieval_block_bytes = CacheEngine.get_gpu_block_bytes(
+            cache_config, self.model_config, self.parallel_config, kv_cache_config, "retrieval"
+        )
+        num_retrieval_gpu_blocks = int(
+            (kv_cache_bytes - num_streaming_gpu_blocks * streaming_block_bytes) // max(1, retrieval_block_bytes)
+        )
+        assert num_retrieval_gpu_blocks > 0, (
+            f"No GPU memory left for the KV cache ({activation_bytes / 2**30:.2f} GiB of activations). "
+            "Try increasing gpu_memory_utilization or decreasing max_num_batched_tokens."
+        )
+        logger.info(f"# Activation arena memory: {activation_bytes / 2**30:.2f} GiB")
+        return num_retrieval_gpu_blocks, num_streaming_gpu_blocks
+
     def load_model(self) -> None:
         vocab_size = self.model.config.vocab_size
 
@@ -257,6 +377,7 @@ class ModelRunner:
         max_num_blocks = (
             self.max_context_len_to_capture + block_size - 1
         ) // block_size
+        self.graph_max_num_pages = max_num_blocks
 
     def _prepare_prompt(
         self,
@@ -269,6 +390,7 @@ class ModelRunner:
         input_tokens = []
         retrieval_context_lens = []
         streaming_context_lens = []
+        prompt_kv_lens = []
         retrieval_block_tables = []
         streaming_block_tables = []
         kv_scales_ptrs = []
@@ -282,9 +404,17 @@ class ModelRunner:
 
             seq_data = seq_group_metadata.seq_data[seq_id]
             prompt_tokens = seq_data.get_token_ids()
-            input_tokens.append(prompt_tokens)
             context_len = len(prompt_tokens)
-            retrieval_context_lens.append(context_len)
+            # Tokens found in the prefix cache already have their KV pages and are not recomputed.
+            num_cached_tokens = seq_data.num_cached_tokens
+            if seq_group_metadata.token_chunk_size is not None:
+                # Mixed batching: the chunk runs behind the tokens computed by the earlier steps
+                # (a decoding sequence is a one-token chunk).
+                num_cached_tokens = seq_group_metadata.num_computed_tokens
+                context_len = num_cached_tokens + seq_group_metadata.token_chunk_size
+            input_tokens.append(prompt_tokens[num_cached_tokens:context_len])
+            retrieval_context_lens.append(context_len - num_cached_tokens)
+            prompt_kv_lens.append(context_len)
 
             if seq_group_metadata.retrieval_block_tables is not None:
                 retrieval_block_table = seq_group_metadata.retrieval_block_tables[seq_id]
@@ -293,58 +423,77 @@ class ModelRunner:
             if self.model_config.sp_attn_config.sparse_kv_cache_enabled():
                 streaming_context_lens.append(min(context_len, sink_size + local_size))
                 if seq_group_metadata.streaming_block_tables is not None:
-                    streaming_block_table = seq_group_metadata.streaming_block_tables[seq_id]
+                    # The ring slots of the blocks past the chunk are not written yet.
+                    streaming_block_table = seq_group_metadata.streaming_block_tables[seq_id][
+                        : (context_len + self.block_size - 1) // self.block_size
+                    ]
                     if context_len > sink_size + local_size:   
                         streaming_block_table = streaming_block_table[:sink_block] + streaming_block_table[-local_block:]
                     streaming_block_tables.append(streaming_block_table)
 
         max_prompt_len = max(retrieval_context_lens)
-        input_tokens = torch.cat([torch.tensor(x) for x in input_tokens], dim=0).to(
-            device=self.device
+        # The scheduler does not batch prompts of different static sparsity levels.
+        static_sparsity = seq_group_metadata_list[0].sampling_params.static_sparsity
+        assert all(
+            seq_group_metadata.sampling_params.static_sparsity == static_sparsity
+            for seq_group_metadata in seq_group_metadata_list
+        ), "A prompt step runs a single static sparsity level."
+        # Everything the prompt step needs on device goes up in one packed copy from a pinned staging ring, and a
+        # single kernel expands it into the int32 lengths, cu_seqlens, padding offsets and per-layer pointer tables.
+        sparse_kv_cache_enabled = self.model_config.sp_attn_config.sparse_kv_cache_enabled()
+        batch_size = len(retrieval_context_lens)
+        max_retrieval_block_table_len = max(len(block_table) for block_table in retrieval_block_tables)
+        max_streaming_block_table_len = (
+            max(len(block_table) for block_table in streaming_block_tables) if sparse_kv_cache_enabled else 0
         )
-        retrieval_context_lens_tensor = torch.tensor(
-            retrieval_context_lens, dtype=torch.int, device=self.device
-        )
-        
-        if self.model_config.sp_attn_config.sparse_kv_cache_enabled():
-            streaming_context_lens_tensor = torch.tensor(
-                streaming_context_lens, dtype=torch.int, device=self.device
-            )
-        else:
-            streaming_context_lens_tensor = None
-        
-        cu_seqlens_tensor = torch.cumsum(retrieval_context_lens_tensor, dim=0).int()
-        cu_seqlens_tensor = torch.nn.functional.pad(cu_seqlens_tensor, (1, 0), value=0)
-        # Prepare prefix block tables
         (
-            retrieval_block_tables, 
-            streaming_block_tables, 
-            max_retrieval_block_table_len, 
-            max_streaming_block_table_len
-        ) = pad_block_tables(
-            retrieval_block_tables=retrieval_block_tables,                
-            streaming_block_tables=streaming_block_tables, 
-            sparse_kv_cache_enabled=self.model_config.sp_attn_config.sparse_kv_cache_enabled(),
-            device="cpu",
+            input_tokens,
+            lens,
+            retrieval_blocks,
+            streaming_blocks,
+        ) = self.prompt_staging_ring.upload(
+            [
+                [token_id for x in input_tokens for token_id in x],
+                retrieval_context_lens
+                + (streaming_context_lens if sparse_kv_cache_enabled else [0] * batch_size)
+                + prompt_kv_lens,
+                [
+                    block
+                    for block_table in retrieval_block_tables
+                    for block in _pad_to_max(block_table, max_retrieval_block_table_len, 0)
+                ],
+                [
+                    block
+                    for block_table in streaming_block_tables
+                    for block in _pad_to_max(block_table, max_streaming_block_table_len, 0)
+                ],
+            ]
         )
-        
-        layers = self.num_layers
+        retrieval_tables = self.cache_engine.decode_block_tables["retrieval"]
+        streaming_tables = self.cache_engine.decode_block_tables["streaming"]
         (
-            layer_retrieval_block_tables, 
-            layer_streaming_block_tables
-        ) = get_layer_block_tables(
-            cache_engine=self.cache_engine,
-            layers=layers,
-            cache_config=self.cache_config,
-            retrieval_block_tables=retrieval_block_tables,
-            streaming_block_tables=streaming_block_tables,
-            sparse_kv_cache_enabled=self.model_config.sp_attn_config.sparse_kv_cache_enabled(),
-            device=self.device
+            lens_tensor,
+            cu_seqlens_tensor,
+            padding_offsets_tensor,
+            retrieval_ptrs,
+            streaming_ptrs,
+        ) = fused_attention.expand_prompt_metadata(
+            lens.view(3, batch_size),
+            max_prompt_len,
+            input_tokens.size(0),
+            retrieval_blocks.view(batch_size, max_retrieval_block_table_len),
+            retrieval_tables.base_ptrs,
+            retrieval_tables.block_bytes,
+            streaming_blocks.view(batch_size, max_streaming_block_table_len) if sparse_kv_cache_enabled else None,
+            streaming_tables.base_ptrs if sparse_kv_cache_enabled else None,
+            streaming_tables.block_bytes if sparse_kv_cache_enabled else None,
         )
-        
-
-        padding_offsets_tensor = fused_attention.compute_padding_offsets(
-            cu_seqlens_tensor, max_prompt_len, input_tokens.size(0)
+        retrieval_context_lens_tensor = lens_tensor[0]
+        streaming_context_lens_tensor = lens_tensor[1] if sparse_kv_cache_enabled else None
+        prompt_kv_lens_tensor = lens_tensor[2] if prompt_kv_lens != retrieval_context_lens else None
+        layer_retrieval_block_tables = list(retrieval_ptrs.unbind(0))
+        layer_streaming_block_tables = (
+            list(streaming_ptrs.unbind(0)) if sparse_kv_cache_enabled else [None] * self.num_layers
         )
 
         input_metadata = InputMetadata(
@@ -362,14 +511,18 @@ class ModelRunner:
             kv_scales=None,
             batched_seq_len=input_tokens.size(0),
             model=self.model,
+            prompt_kv_lens=prompt_kv_lens_tensor,
+            max_prompt_kv_len=max(prompt_kv_lens),
+            static_sparsity=static_sparsity,
         )
         return (input_tokens, input_metadata)
 
-    def _prepare_decode_ifb(
+    def _collect_decode_inputs(
         self,
         seq_group_metadata_list: List[SequenceGroupMetadata],
-    ) -> Tuple[torch.Tensor, InputMetadata]:
+    ) -> Tuple[List[int], List[List[int]], List[int], List[int], List[List[int]], List[List[int]]]:
         assert len(seq_group_metadata_list) > 0
+        batch_seq_ids = []
         input_tokens = []
         retrieval_context_lens = []
         streaming_context_lens = []
@@ -382,6 +535,7 @@ class ModelRunner:
             assert not seq_group_metadata.is_prompt
             seq_ids = list(seq_group_metadata.seq_data.keys())
             for seq_id in seq_ids:
+                batch_seq_ids.append(seq_id)
                 seq_data = seq_group_metadata.seq_data[seq_id]
                 generation_token = seq_data.get_last_token_id()
                 input_tokens.append([generation_token])
@@ -397,40 +551,167 @@ class ModelRunner:
                         streaming_block_table = streaming_block_table[:sink_block] + streaming_block_table[-local_block:]
                     streaming_block_tables.append(streaming_block_table)
 
-        max_context_len = max(retrieval_context_lens)
+        return (
+            batch_seq_ids,
+            input_tokens,
+            retrieval_context_lens,
+            streaming_context_lens,
+            retrieval_block_tables,
+            streaming_block_tables,
+        )
 
-        input_tokens = _make_tensor_with_pad(
-            input_tokens, max_len=1, pad=0, dtype=torch.long, device=self.device
-        ).squeeze(1)
-        retrieval_context_lens = torch.tensor(retrieval_context_lens, dtype=torch.int, device=self.device)
-        streaming_context_lens = torch.tensor(streaming_context_lens, dtype=torch.int, device=self.device)
-        
-        (
-            retrieval_block_tables, 
-            streaming_block_tables, 
-            max_retrieval_block_table_len, 
-            max_streaming_block_table_len
-        ) = pad_block_tables(
-            retrieval_block_tables=retrieval_block_tables,                
-            streaming_block_tables=streaming_block_tables, 
-            sparse_kv_cache_enabled=self.model_config.sp_attn_config.sparse_kv_cache_enabled(),
-            device=self.device,
+    def _get_dynamic_sparse_page_nums(
+        self,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+    ) -> Tuple[Optional[torch.Tensor], int, bool]:
+        """Pages selected by the dynamic sparse decoding of every sequence (InputMetadata.dynamic_sparse_page_nums),
+        the largest budget in tokens and whether the page counts differ from the previous decode step, or
+        (None, 0, True) if all the sequences use the engine-wide token budget."""
+        sp_attn_config = self.model_config.sp_attn_config
+        if sp_attn_config.get_sparse_decode_mode() == 0 or not any(
+            seq_group_metadata.sampling_params.has_sparse_token_budget()
+            for seq_group_metadata in seq_group_metadata_list
+        ):
+            self.last_dynamic_sparse_page_nums = None
+            return None, 0, True
+        default_budget = sp_attn_config.get_dec_dynamic_sparse_token_budget()
+        page_nums = []
+        for seq_group_metadata in seq_group_metadata_list:
+            for seq_id, seq_data in seq_group_metadata.seq_data.items():
+                context_len = seq_data.get_len()
+                budget = seq_group_metadata.sampling_params.get_sparse_token_budget(context_len, default_budget)
+                # Same rule as single_query_page_selector_topk, capped at the pages of the sequence
+                # (whose history is context_len - 1 tokens).
+                num_pages = max((context_len - 1 + self.block_size - 1) // self.block_size, 1)
+                if seq_group_metadata.evicted_retrieval_pages is not None:
+                    # The selector never picks the evicted pages.
+                    num_pages -= len(seq_group_metadata.evicted_retrieval_pages[seq_id])
+                page_nums.append(min(max(3, budget // self.block_size), num_pages))
+        # Compared on the host, once per step: the layers reuse their page selections only while it is unchanged.
+        page_nums_changed = page_nums != self.last_dynamic_sparse_page_nums
+        self.last_dynamic_sparse_page_nums = page_nums
+        return (
+            async_h2d(page_nums, dtype=torch.int, device=self.device),
+            max(page_nums) * self.block_size,
+            page_nums_changed,
         )
 
-        layers = self.num_layers
+    def _fill_placeholder_tokens(self, input_tokens: torch.Tensor, seq_ids: List[int]) -> None:
+        """Writes the tokens sampled by the previous step into the rows of input_tokens whose sequence is
+        waiting for one (see _get_placeholder_seq_ids; the other rows are None)."""
+        rows = [row for row, seq_id in enumerate(seq_ids) if seq_id in self.last_sampled_rows]
+        if not rows:
+            return
+        if not self.last_sampled_tokens_synced:
+            # Ranks may sample differently (e.g. multinomial); all of them must feed the driver's tokens.
+            tensor_model_parallel_broadcast(self.last_sampled_tokens, src=0)
+            self.last_sampled_tokens_synced = True
+        src_rows = [self.last_sampled_rows[seq_ids[row]] for row in rows]
+        input_tokens[async_h2d(rows, dtype=torch.long, device=self.device)] = self.last_sampled_tokens[
+            async_h2d(src_rows, dtype=torch.long, device=self.device)
+        ]
+
+    def _get_placeholder_seq_ids(self, input_tokens: List[List[int]], seq_ids: List[int]) -> List[int]:
+        # Sequences which are not waiting for a token keep None, so _fill_placeholder_tokens skips their rows.
+        placeholder_seq_ids = [
+            seq_id if tokens[-1] == PLACEHOLDER_TOKEN_ID else None for tokens, seq_id in zip(input_tokens, seq_ids)
+        ]
+        assert all(
+            seq_id is None or seq_id in self.last_sampled_rows for seq_id in placeholder_seq_ids
+        ), "The token of a sequence is pending, but it was not sampled by the previous step."
+        return placeholder_seq_ids
+
+    def _record_sampled_tokens(
+        self,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+        tokens: torch.Tensor,
+        num_prompt_samples: Optional[List[int]] = None,
+    ) -> None:
+        seq_ids = [seq_id for seq_group_metadata in seq_group_metadata_list for seq_id in seq_group_metadata.seq_data]
+        rows = list(range(len(seq_ids)))
+        if num_prompt_samples is not None:
+            # The prompt sequence owns the first of the rows of its samples.
+            rows = [sum(num_prompt_samples[:idx]) for idx in range(len(seq_ids))]
+        self.last_sampled_tokens = tokens
+        self.last_sampled_rows = dict(zip(seq_ids, rows))
+        self.last_sampled_tokens_synced = False
 
+    def _get_num_prompt_samples(self, seq_group_metadata_list: List[SequenceGroupMetadata]) -> Optional[List[int]]:
+        # Parallel sampling: a prompt run samples the first token of each of the n samples of its group, which the
+        # engine forks from the prompt sequence (LLMEngine._process_sequence_group_outputs). None: one row per group.
+        if not seq_group_metadata_list[0].is_prompt:
+            return None
+        num_samples = [seq_group_metadata.sampling_params.n for seq_group_metadata in seq_group_metadata_list]
+        if all(n == 1 for n in num_samples):
+            return None
+        return num_samples
+
+    def _fan_out_prompt_samples(self, rows: torch.Tensor, num_prompt_samples: Optional[List[int]]) -> torch.Tensor:
+        # Repeats the last hidden state (or the logits) of every prompt once per sample.
+        if num_prompt_samples is None:
+            return rows
+        repeats = async_h2d(num_prompt_samples, dtype=torch.long, device=rows.device)
+        return rows.repeat_interleave(repeats, dim=0, output_size=sum(num_prompt_samples))
+
+    def _prepare_decode_ifb(
+        self,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+    ) -> Tuple[torch.Tensor, InputMetadata]:
         (
-            layer_retrieval_block_tables, 
-            layer_streaming_block_tables
-        ) = get_layer_block_tables(
-            cache_engine=self.cache_engine,
-            layers=layers,
-            cache_config=self.cache_config,
-            retrieval_block_tables=retrieval_block_tables,
-            streaming_block_tables=streaming_block_tables,
-            sparse_kv_cache_enabled=self.model_config.sp_attn_config.sparse_kv_cache_enabled(),
-            device=self.device
-        )
+            batch_seq_ids,
+            input_tokens,
+            retrieval_context_lens,
+            streaming_context_lens,
+            retrieval_block_tables,
+            streaming_block_tables,
+        ) = self._collect_decode_inputs(seq_group_metadata_list)
+
+        max_context_len = max(retrieval_context_lens)
+
+        placeholder_seq_ids = self._get_placeholder_seq_ids(input_tokens, batch_seq_ids)
+        input_tokens = async_h2d([x[0] for x in input_tokens], dtype=torch.long, device=self.device)
+        self._fill_placeholder_tokens(input_tokens, placeholder_seq_ids)
+
+        # Only the changes since the previous step are sent to the device-resident tables of the cache engine.
+        max_retrieval_block_table_len = max(len(block_table) for block_table in retrieval_block_tables)
+        compacted_seq_ids = [
+            seq_id
+            for seq_group_metadata in seq_group_metadata_list
+            for seq_id in seq_group_metadata.compacted_retrieval_seq_ids
+        ]
+        layer_retrieval_block_tables, retrieval_context_lens = self.cache_engine.decode_block_tables[
+            "retrieval"
+        ].update(batch_seq_ids, retrieval_block_tables, retrieval_context_lens, compacted_seq_ids)
+        streaming_tables = self.cache_engine.decode_block_tables["streaming"]
+        if streaming_tables is not None:
+            max_streaming_block_table_len = max(len(block_table) for block_table in streaming_block_tables)
+            layer_streaming_block_tables, streaming_context_lens = streaming_tables.update(
+                batch_seq_ids, streaming_block_tables, streaming_context_lens
+            )
+        else:
+            max_streaming_block_table_len = 0
+            layer_streaming_block_tables = [None] * self.num_layers
+            streaming_context_lens = async_h2d(streaming_context_lens, dtype=torch.int, device=self.device)
+        (
+            dynamic_sparse_page_nums,
+            max_dynamic_sparse_token_budget,
+            dynamic_sparse_page_nums_changed,
+        ) = self._get_dynamic_sparse_page_nums(seq_group_metadata_list)
+        retrieval_offload = self.cache_engine.retrieval_offload
+        if retrieval_offload is not None:
+            retrieval_offload.begin_step(layer_retrieval_block_tables, retrieval_context_lens, dynamic_sparse_page_nums)
+        retrieval_page_scores = self.cache_engine.retrieval_page_scores
+        if retrieval_page_scores is not None:
+            evicted_pages = [
+                seq_group_metadata.evicted_retrieval_pages[seq_id]
+                for seq_group_metadata in seq_group_metadata_list
+                for seq_id in seq_group_metadata.seq_data
+            ]
+            if retrieval_page_scores.begin_step(
+                batch_seq_ids, [len(block_table) for block_table in retrieval_block_tables], evicted_pages
+            ):
+                # The page selections the layers reuse may hold the evicted pages.
+                self._reset_dynamic_sparse_page_cache()
 
         input_metadata = InputMetadata(
             is_prompt=False,
@@ -447,7 +728,15 @@ class ModelRunner:
             kv_cache_dtype=self.kv_cache_dtype,
             batched_seq_len=input_tokens.size(0),
             model=self.model,
+            dynamic_sparse_page_nums=dynamic_sparse_page_nums,
+            dynamic_sparse_page_nums_changed=dynamic_sparse_page_nums_changed,
+            max_dynamic_sparse_token_budget=max_dynamic_sparse_token_budget,
+            activation_buffer=self.decode_activation_buffers[self.decode_activation_buffer_idx],
+            retrieval_offload=retrieval_offload,
+            retrieval_page_scores=retrieval_page_scores.scores if retrieval_page_scores is not None else None,
         )
+        self.decode_activation_buffers[self.decode_activation_buffer_idx] = input_metadata.activation_buffer
+        self.decode_activation_buffer_idx ^= 1
 
         return (input_tokens, input_metadata)
 
@@ -501,6 +790,11 @@ class ModelRunner:
         input_tokens = _make_tensor_with_pad(
             input_tokens, max_len=1, pad=0, dtype=torch.long, device=self.device
         ).squeeze(1)
+        (
+            dynamic_sparse_page_nums,
+            max_dynamic_sparse_token_budget,
+            dynamic_sparse_page_nums_changed,
+        ) = self._get_dynamic_sparse_page_nums(seq_group_metadata_list)
         input_metadata = InputMetadata(
             is_prompt=False,
             cu_seqlens=None,
@@ -516,10 +810,282 @@ class ModelRunner:
             kv_cache_dtype=self.kv_cache_dtype,
             batched_seq_len=input_tokens.size(0),
             model=self.model,
+            dynamic_sparse_page_nums=dynamic_sparse_page_nums,
+            dynamic_sparse_page_nums_changed=dynamic_sparse_page_nums_changed,
+            max_dynamic_sparse_token_budget=max_dynamic_sparse_token_budget,
         )
 
         return (input_tokens, input_metadata)
 
+    def _get_graph_num_pages(self, num_pages: int) -> int:
+        graph_num_pages = _MIN_PAGES_TO_CAPTURE
+        while graph_num_pages < num_pages:
+            graph_num_pages *= 2
+        return min(graph_num_pages, self.graph_max_num_pages)
+
+    def _init_graph_static_buffers(self) -> None:
+        # Persistent inputs shared by all the decode graphs. Each graph reads a contiguous
+        # prefix viewed with its own shape, so rows stay aligned across buckets.
+        sp_attn_config = self.model_config.sp_attn_config
+        max_batch_size = _BATCH_SIZES_TO_CAPTURE[-1]
+        self.graph_streaming_num_pages = (
+            sp_attn_config.get_dec_sink_block_num() + sp_attn_config.get_dec_local_block_num()
+        )
+        buffers = {
+            "input_tokens": torch.zeros(max_batch_size, dtype=torch.long, device=self.device),
+            "retrieval_context_lens": torch.ones(max_batch_size, dtype=torch.int, device=self.device),
+            "streaming_context_lens": torch.ones(max_batch_size, dtype=torch.int, device=self.device),
+            "retrieval_block_tables": torch.zeros(
+                max_batch_size * self.graph_max_num_pages, dtype=torch.long, device=self.device
+            ),
+            "streaming_block_tables": torch.zeros(
+                max_batch_size * self.graph_streaming_num_pages, dtype=torch.long, device=self.device
+            ),
+            "dynamic_sparse_page_idxes": None,
+        }
+        if sp_attn_config.get_sparse_decode_mode() != 0:
+            # Same budget rule as single_query_page_selector_topk. Graphs are only used once the
+            # history covers the budget, so the page count does not depend on the bucket.
+            self.graph_num_selected_pages = max(
+                3, sp_attn_config.get_dec_dynamic_sparse_token_budget() // self.block_size
+            )
+            # Rows per sequence: one page set per query head, or per KV head with a group-shared selection.
+            self.graph_page_idx_heads = self.model.config.num_attention_heads
+            if sp_attn_config.get_dec_gqa_page_selection() != "none":
+                self.graph_page_idx_heads = self.model.config.num_key_value_heads
+            buffers["dynamic_sparse_page_idxes"] = [
+                torch.zeros(
+                    max_batch_size * self.graph_page_idx_heads * self.graph_num_selected_pages,
+                    dtype=torch.int,
+                    device=self.device,
+                )
+                for _ in range(self.num_layers)
+            ]
+        self.graph_static_buffers = buffers
+
+    def _get_graph_static_inputs(self, graph_batch_size: int, graph_num_pages: int) -> Dict:
+        buffers = self.graph_static_buffers
+        static_inputs = {
+            "input_tokens": buffers["input_tokens"][:graph_batch_size],
+            "retrieval_context_lens": buffers["retrieval_context_lens"][:graph_batch_size],
+            "streaming_context_lens": buffers["streaming_context_lens"][:graph_batch_size],
+            "retrieval_block_tables": buffers["retrieval_block_tables"][
+                : graph_batch_size * graph_num_pages
+            ].view(graph_batch_size, graph_num_pages),
+            "streaming_block_tables": buffers["streaming_block_tables"][
+                : graph_batch_size * self.graph_streaming_num_pages
+            ].view(graph_batch_size, self.graph_streaming_num_pages),
+            "dynamic_sparse_page_idxes": None,
+        }
+        if buffers["dynamic_sparse_page_idxes"] is not None:
+            num_heads = self.graph_page_idx_heads
+            static_inputs["dynamic_sparse_page_idxes"] = [
+                page_idx[: graph_batch_size * num_heads * self.graph_num_selected_pages].view(
+                    graph_batch_size, num_heads, self.graph_num_selected_pages
+                )
+                for page_idx in buffers["dynamic_sparse_page_idxes"]
+            ]
+        return static_inputs
+
+    def _prepare_decode_cuda_graph(
+        self,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+    ) -> Optional[Tuple[Tuple[int, int, bool], int]]:
+        """Fill the static decode buffers for this step.
+
+        Returns the graph key and the real batch size, or None if the step
+        has to run eagerly.
+        """
+        if self.model_config.enforce_eager or self.model.__class__.__name__ != "LlamaForCausalLM":
+            # ActivationBuffer only supports Llama-style models.
+            return None
+        if self.cache_engine.retrieval_offload is not None:
+            # The cold pages are staged per step on the host side of every layer.
+            return None
+        if self.cache_engine.retrieval_page_scores is not None:
+            # Evictions force a new page selection, outside of the selector cadence of the graphs.
+            return None
+        sp_attn_config = self.model_config.sp_attn_config
+        sparse_kv_cache_enabled = sp_attn_config.sparse_kv_cache_enabled()
+        batch_size = sum(len(seq_group_metadata.seq_data) for seq_group_metadata in seq_group_metadata_list)
+        if batch_size > _BATCH_SIZES_TO_CAPTURE[-1]:
+            return None
+        (
+            batch_seq_ids,
+            input_tokens,
+            retrieval_context_lens,
+            streaming_context_lens,
+            retrieval_block_tables,
+            streaming_block_tables,
+        ) = self._collect_decode_inputs(seq_group_metadata_list)
+
+        max_context_len = max(retrieval_context_lens)
+        max_retrieval_block_table_len = max(len(block_table) for block_table in retrieval_block_tables)
+        if (
+            max_context_len > self.max_context_len_to_capture
+            or max_retrieval_block_table_len > self.graph_max_num_pages
+        ):
+            return None
+        if self.graph_static_buffers is None:
+            self._init_graph_static_buffers()
+        if sparse_kv_cache_enabled and max(
+            len(block_table) for block_table in streaming_block_tables
+        ) > self.graph_streaming_num_pages:
+            return None
+
+        dynamic_sparse = sp_attn_config.get_sparse_decode_mode() != 0
+        if dynamic_sparse:
+            if any(
+                seq_group_metadata.sampling_params.has_sparse_token_budget()
+                for seq_group_metadata in seq_group_metadata_list
+            ):
+                # The static page index buffers are sized for the engine-wide token budget.
+                return None
+            # The graph must take the fused top-k branch of dynamic_select_topk_pages with the
+            # same number of pages as eager mode would.
+            num_history_pages = (max_context_len + self.block_size - 1) // self.block_size
+            if (
+                max_context_len <= sp_attn_config.get_dec_dynamic_sparse_token_budget()
+                or num_history_pages < self.graph_num_selected_pages
+            ):
+                return None
+
+        graph_batch_size = _get_graph_batch_size(batch_size)
+        graph_num_pages = self._get_graph_num_pages(max_retrieval_block_table_len)
+        # Under graph replay the selector cadence is decided here instead of in the layers.
+        update_pages = dynamic_sparse and (
+            max_context_len % sp_attn_config.get_dec_selector_update_interval() == 0
+            or self.graph_page_idx_seq_ids != batch_seq_ids
+        )
+
+        # Padding rows replay the first sequence: they write the same KV entry with the same
+        # values, so no scratch page has to be reserved for them.
+        num_pad = graph_batch_size - batch_size
+        placeholder_seq_ids = self._get_placeholder_seq_ids(input_tokens, batch_seq_ids)
+        placeholder_seq_ids = placeholder_seq_ids + [placeholder_seq_ids[0]] * num_pad
+        input_tokens = [x[0] for x in input_tokens] + [input_tokens[0][0]] * num_pad
+        retrieval_context_lens = retrieval_context_lens + [retrieval_context_lens[0]] * num_pad
+        retrieval_block_tables = retrieval_block_tables + [retrieval_block_tables[0]] * num_pad
+
+        # Pinned sources: a pageable copy would wait for the step still running on the device.
+        static_inputs = self._get_graph_static_inputs(graph_batch_size, graph_num_pages)
+        static_inputs["input_tokens"].copy_(
+            torch.tensor(input_tokens, dtype=torch.long, pin_memory=True), non_blocking=True
+        )
+        self._fill_placeholder_tokens(static_inputs["input_tokens"], placeholder_seq_ids)
+        static_inputs["retrieval_context_lens"].copy_(
+            torch.tensor(retrieval_context_lens, dtype=torch.int, pin_memory=True), non_blocking=True
+        )
+        static_inputs["retrieval_block_tables"].copy_(
+            _make_tensor_with_pad(
+                retrieval_block_tables, max_len=graph_num_pages, pad=0, dtype=torch.long, device="cpu"
+            ).pin_memory(),
+            non_blocking=True,
+        )
+        if sparse_kv_cache_enabled:
+            streaming_context_lens = streaming_context_lens + [streaming_context_lens[0]] * num_pad
+            streaming_block_tables = streaming_block_tables + [streaming_block_tables[0]] * num_pad
+            static_inputs["streaming_context_lens"].copy_(
+                torch.tensor(streaming_context_lens, dtype=torch.int, pin_memory=True), non_blocking=True
+            )
+            static_inputs["streaming_block_tables"].copy_(
+                _make_tensor_with_pad(
+                    streaming_block_tables,
+                    max_len=self.graph_streaming_num_pages,
+                    pad=0,
+                    dtype=torch.long,
+                    device="cpu",
+                ).pin_memory(),
+                non_blocking=True,
+            )
+        if dynamic_sparse:
+            self.graph_page_idx_seq_ids = batch_seq_ids
+
+        return (graph_batch_size, graph_num_pages, update_pages), batch_size
+
+    def _graph_forward(self, graph_key: Tuple[int, int, bool]) -> torch.Tensor:
+        # Everything below, including the per-layer block pointer tables, is recorded into the graph.
+        graph_batch_size, graph_num_pages, update_pages = graph_key
+        sparse_kv_cache_enabled = self.model_config.sp_attn_config.sparse_kv_cache_enabled()
+        static_inputs = self._get_graph_static_inputs(graph_batch_size, graph_num_pages)
+        (
+            layer_retrieval_block_tables,
+            layer_streaming_block_tables
+        ) = get_layer_block_tables(
+            cache_engine=self.cache_engine,
+            layers=self.num_layers,
+            cache_config=self.cache_config,
+            retrieval_block_tables=static_inputs["retrieval_block_tables"],
+            streaming_block_tables=static_inputs["streaming_block_tables"],
+            sparse_kv_cache_enabled=sparse_kv_cache_enabled,
+            device=self.device
+        )
+        input_metadata = InputMetadata(
+            is_prompt=False,
+            cu_seqlens=None,
+            padding_offsets=None,
+            retrieval_context_lens=static_inputs["retrieval_context_lens"],
+            streaming_context_lens=static_inputs["streaming_context_lens"] if sparse_kv_cache_enabled else None,
+            # Upper bound of the bucket: only sizes the launches, the kernels read per-sample lengths.
+            max_seq_len=graph_num_pages * self.block_size,
+            max_retrieval_block_table_len=graph_num_pages,
+            max_streaming_block_table_len=self.graph_streaming_num_pages if sparse_kv_cache_enabled else 0,
+            retrieval_block_tables=layer_retrieval_block_tables,
+            streaming_block_tables=layer_streaming_block_tables,
+            kv_scales=None,
+            kv_cache_dtype=self.kv_cache_dtype,
+            batched_seq_len=graph_batch_size,
+            model=self.model,
+            dynamic_sparse_page_idxes=static_inputs["dynamic_sparse_page_idxes"],
+            update_dynamic_sparse_pages=update_pages,
+        )
+        # The LM head stays outside the graph to keep the per-graph output buffers small.
+        return self.model.model(static_inputs["input_tokens"], input_metadata)
+
+    def _execute_decode_cuda_graph(
+        self,
+        graph_key: Tuple[int, int, bool],
+        batch_size: int,
+        sampling_params: SamplingParams,
+        sampling_tensors: Optional[SamplingTensors] = None,
+    ) -> torch.Tensor:
+        graph_runner = self.graph_runners.get(graph_key)
+        if graph_runner is None:
+            logger.info(
+                f"Capturing the decode graph for batch size {graph_key[0]}, "
+                f"{graph_key[1]} pages, selector update {graph_key[2]}."
+            )
+            graph_runner = CUDAGraphRunner(lambda: self._graph_forward(graph_key))
+            graph_runner.capture(self.graph_memory_pool)
+            self.graph_memory_pool = graph_runner.graph.pool()
+            self.graph_runners[graph_key] = graph_runner
+
+        hidden_states = graph_runner.forward()[:batch_size]
+        input_tokens = self.graph_static_buffers["input_tokens"][:batch_size]
+        # The sampler does not need the input metadata for decode steps.
+        return self.model.sample_hidden_states(input_tokens, hidden_states, None, sampling_params, sampling_tensors)
+
+    def _prepare_sampling_tensors(
+        self,
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+        num_prompt_samples: Optional[List[int]] = None,
+    ) -> Optional[SamplingTensors]:
+        if self.model.__class__.__name__ != "LlamaForCausalLM":
+            # MixtralForCausalLM.sample has no per-row sampling parameters.
+            return None
+        if len(seq_group_metadata_list[0].sampling_params.decoding_sim_token_ids) > 0:
+            # Decoding simulation replays the given tokens instead of sampling.
+            return None
+        return SamplingTensors.from_seq_group_metadata_list(
+            seq_group_metadata_list, self.device, lm_head_topk=self.lm_head_topk, num_samples=num_prompt_samples
+        )
+
+    def _reset_dynamic_sparse_page_cache(self) -> None:
+        # The layers still point at static graph buffers which may have been sized for another batch.
+        for module in self.model.modules():
+            if getattr(module, "cached_dynamic_sparse_page_idx", None) is not None:
+                module.cached_dynamic_sparse_page_idx = None
+
     def prepare_input_tensors(
         self,
         seq_group_metadata_list: Optional[List[SequenceGroupMetadata]],
@@ -541,6 +1107,11 @@ class ModelRunner:
 
         # Prepare input tensors.
         if is_prompt:
+            if self.cache_engine.retrieval_page_scores is not None:
+                # The pages of these sequences have just been (re)allocated.
+                self.cache_engine.retrieval_page_scores.forget(
+                    [seq_id for seq_group_metadata in seq_group_metadata_list for seq_id in seq_group_metadata.seq_data]
+                )
             (input_tokens, input_metadata) = self._prepare_prompt(
                 seq_group_metadata_list, ifb_mode
             )
@@ -572,7 +1143,27 @@ class ModelRunner:
         max_retrieval_block_table_len: int = None,
         max_streaming_block_table_len: int = None,
         layer_kv_scales: torch.Tensor = None,
+        context_parallel: Optional[ContextParallelShard] = None,
     ) -> Optional[SamplerOutput]:
+        is_decode = not seq_group_metadata_list[0].is_prompt
+        num_prompt_samples = self._get_num_prompt_samples(seq_group_metadata_list)
+        sampling_tensors = self._prepare_sampling_tensors(seq_group_metadata_list, num_prompt_samples)
+        # The kernel profiler times every layer, which a graph replay cannot report.
+        if is_decode and ifb_mode and not kernel_profiler.enabled:
+            graph_inputs = self._prepare_decode_cuda_graph(seq_group_metadata_list)
+            if graph_inputs is not None:
+                self.last_decode_used_graph = True
+                tokens = self._execute_decode_cuda_graph(
+                    *graph_inputs, seq_group_metadata_list[0].sampling_params, sampling_tensors
+                )
+                self._record_sampled_tokens(seq_group_metadata_list, tokens)
+                return tokens
+        # Eager step: the static page indices are no longer in sync with the layers.
+        self.graph_page_idx_seq_ids = None
+        if is_decode and self.last_decode_used_graph:
+            self._reset_dynamic_sparse_page_cache()
+        self.last_decode_used_graph = False
+
         (input_tokens, input_metadata, sampling_params) = self.prepare_input_tensors(
             seq_group_metadata_list,
             ifb_mode,
@@ -582,8 +1173,57 @@ class ModelRunner:
             max_streaming_block_table_len,
             layer_kv_scales=layer_kv_scales,
         )
+        input_metadata.context_parallel = context_parallel
         model = self.model
         # return None
-        output = model(input_tokens, input_metadata)
-        tokens = model.sample(input_tokens, output, input_metadata, sampling_params)
+        if self.lm_head_topk > 0:
+            hidden_states = model(input_tokens, input_metadata, compute_logits=False)
+            hidden_states = self._fan_out_prompt_samples(hidden_states, num_prompt_samples)
+            tokens = model.sample_hidden_states(
+                input_tokens, hidden_states, input_metadata, sampling_params, sampling_tensors
+            )
+        else:
+            output = model(input_tokens, input_metadata)
+            output = self._fan_out_prompt_samples(output, num_prompt_samples)
+            tokens = model.sample(input_tokens, output, input_metadata, sampling_params, sampling_tensors)
+        self._record_sampled_tokens(seq_group_metadata_list, tokens, num_prompt_samples)
+        kernel_profiler.end_step()
         return tokens
+
+
+class CUDAGraphRunner:
+    def __init__(self, forward_fn):
+        self.forward_fn = forward_fn
+        self.graph = None
+        self.output = None
+
+    def capture(self, memory_pool: Optional[Tuple[int, int]]) -> None:
+        assert self.graph is None
+        # Run the model once without capturing the graph. This makes sure that
+        # one-time setup (e.g., cudaFuncSetAttribute for large shared memory)
+        # is not recorded. The static inputs already hold this step's data, and
+        # the KV writes of the replay are identical, so the warm-up is harmless.
+        self.forward_fn()
+        torch.cuda.synchronize()
+
+        self.graph = torch.cuda.CUDAGraph()
+        with torch.cuda.graph(self.graph, pool=memory_pool):
+            self.output = self.forward_fn()
+        torch.cuda.synchronize()
+
+    def forward(self) -> torch.Tensor:
+        self.graph.replay()
+        return self.output
+
+
+def _get_graph_batch_size(batch_size: int) -> int:
+    if batch_size <= 2:
+        return batch_size
+    elif batch_size <= 4:
+        return 4
+    else:
+        return (
+            (batch_size + _BATCH_SIZE_ALIGNMENT - 1)
+            // _BATCH_SIZE_ALIGNMENT
+            * _BATCH_SIZE_ALIGNMENT
+        )
@@ -13,8 +13,9 @@
 
 """A GPU worker class."""
 
+import copy
 import os
-from typing import Dict, List, Optional
+from typing import Dict, List, Optional, Tuple
 
 import torch
 import torch.distributed
@@ -26,11 +27,20 @@ from omniserve.config import (
     ParallelConfig,
     SchedulerConfig,
 )
+from omniserve.modeling.parallel_utils.communication_op import broadcast_object
+from omniserve.modeling.layers.ctx_attn.ring_ctx_attn import ContextParallelShard
+from omniserve.modeling.parallel_utils.parallel_state import (
+    get_context_parallel_group,
+    initialize_model_parallel,
+)
 from omniserve.sequence import SamplerOutput, SequenceGroupMetadata
 from omniserve.utils.utils import STR_DTYPE_TO_TORCH_DTYPE
 from omniserve.worker.model_runner import ModelRunner
 from omniserve.modeling.layers.ctx_attn.block_table_utils import pad_block_tables, get_layer_block_tables
 
+# Context parallelism: pages sent to instance 0 per message, which bounds the staging buffers of a long shard.
+_CONTEXT_PARALLEL_BLOCKS_PER_MESSAGE = 256
+
 
 class Worker:
     """A worker class that executes (a partition of) the model on a GPU.
@@ -74,6 +84,13 @@ class Worker:
         self.gpu_cache = None
         self.precision = precision
         self.kv_cache_config = kv_cache_config
+        # Disaggregated prefill: ranks [tp, 2 * tp) run the prompts and send their pages to the rank tp lower.
+        tp_size = parallel_config.tensor_parallel_size
+        self.is_prefill_worker = parallel_config.disaggregated_prefill and rank >= tp_size
+        self.tp_rank = rank % tp_size
+        # Context parallelism: instance 0 owns the KV cache and runs every step, the other instances only help
+        # prefilling long prompts.
+        self.cp_rank = rank // tp_size if parallel_config.context_parallel_size > 1 else 0
 
     def init_model(self, cupy_port: Optional[int] = None) -> None:
         if self.device_config.device.type == "cuda":
@@ -96,9 +113,14 @@ class Worker:
         else:
             raise RuntimeError(f"Not support device type: {self.device_config.device}")
         # Initialize the distributed environment.
-        # init_distributed_environment(
-        #     self.parallel_config, self.rank, cupy_port, self.distributed_init_method
-        # )
+        init_distributed_environment(
+            self.parallel_config, self.rank, self.distributed_init_method
+        )
+        # Keep the KV heads of this rank (balanced retrieval / streaming split) in the sparse attention config,
+        # so the attention layers, the cache engine and the weight loader all see the local partition.
+        self.model_config.sp_attn_config.partition_kv_heads(
+            self.parallel_config.tensor_parallel_size, self.tp_rank
+        )
         # Initialize the model.
         # set_random_seed(self.model_config.seed)
 
@@ -113,6 +135,9 @@ class Worker:
     ) -> None:
         # Cache engine is initialized inside the model runner.
         self.cache_config = cache_config
+        # The cache config of the engine is pickled to the other tensor parallel workers; use the (partitioned)
+        # sparse attention config of this rank.
+        self.cache_config.sp_attn_config = self.model_config.sp_attn_config
         self.model_runner = ModelRunner(
             self.cache_config,
             self.model_config,
@@ -214,6 +239,12 @@ class Worker:
     def warm_up_model(self) -> None:
         pass
 
+    def get_retrieval_page_scores(self) -> Dict[int, List[float]]:
+        """Seq id -> page selection counts of the last decode batch, for retrieval page eviction."""
+        if self.cache_engine.retrieval_page_scores is None:
+            return {}
+        return self.cache_engine.retrieval_page_scores.read()
+
     @torch.inference_mode()
     def execute_model(
         self,
@@ -225,14 +256,51 @@ class Worker:
         retrieval_blocks_to_copy: Optional[Dict[int, List[int]]] = None,
         streaming_blocks_to_copy: Optional[Dict[int, List[int]]] = None,
         ifb_mode: bool = True,
+        retrieval_blocks_to_offload: Optional[Dict[int, int]] = None,
     ) -> Optional[SamplerOutput]:
         assert seq_group_metadata_list is not None
         num_seq_groups = len(seq_group_metadata_list)
 
+        shard_lens = None
+        if self.parallel_config.context_parallel_size > 1:
+            shard_lens = self._get_context_parallel_shard_lens(seq_group_metadata_list)
+            if self.cp_rank > 0:
+                # The scheduler only manages the KV cache of instance 0.
+                if shard_lens is not None:
+                    self._execute_context_parallel_shard(seq_group_metadata_list[0], shard_lens)
+                return None
+
+        if retrieval_blocks_to_offload:
+            # The GPU blocks are free again: read them before the swap-ins and copies of the step reuse them.
+            self.cache_engine.offload(retrieval_blocks_to_offload)
+            self.cache_engine.wait_for_cache_ops()
+
+        # Issue cache operations.
+        issued_cache_op = False
+        for cache_mode, blocks_to_swap_in, blocks_to_swap_out, blocks_to_copy in (
+            ("retrieval", retrieval_blocks_to_swap_in, retrieval_blocks_to_swap_out, retrieval_blocks_to_copy),
+            ("streaming", streaming_blocks_to_swap_in, streaming_blocks_to_swap_out, streaming_blocks_to_copy),
+        ):
+            if blocks_to_swap_in:
+                self.cache_engine.swap_in(blocks_to_swap_in, cache_mode)
+                issued_cache_op = True
+            if blocks_to_swap_out:
+                self.cache_engine.swap_out(blocks_to_swap_out, cache_mode)
+                issued_cache_op = True
+            if blocks_to_copy:
+                self.cache_engine.copy(blocks_to_copy, cache_mode)
+
+        # Wait for cache operations to finish.
+        if issued_cache_op:
+            self.cache_engine.wait_for_cache_ops()
+
         # If there is no input, we don't need to execute the model.
         if num_seq_groups == 0:
             return {}
 
+        if shard_lens is not None:
+            return self._execute_context_parallel_shard(seq_group_metadata_list[0], shard_lens)
+
         if ifb_mode:
             # print("$$$$$$$$$$Worker IFB mode")
             output = self.model_runner.execute_model(
@@ -251,3 +319,237 @@ class Worker:
                 layer_kv_scales=self.layer_kv_scales,
             )
         return output
+
+    @torch.inference_mode()
+    def execute_disaggregated_step(
+        self,
+        prefill_seq_group_metadata_list: List[SequenceGroupMetadata],
+        seq_group_metadata_list: List[SequenceGroupMetadata],
+        **kwargs,
+    ) -> Optional[Tuple[Optional[SamplerOutput], Optional[torch.Tensor]]]:
+        """One step of both instances (disaggregated prefill).
+
+        The prefill instance runs the prompts of prefill_seq_group_metadata_list and sends their pages to the
+        decoding instance, which meanwhile runs the decoding step of seq_group_metadata_list (with the swaps and
+        copies of kwargs, see execute_model) and then receives the pages into the same blocks. Returns the
+        decoded tokens and the first tokens of the prompts on the driver worker.
+        """
+        tp_size = self.parallel_config.tensor_parallel_size
+        block_ids = self._get_prompt_block_ids(prefill_seq_group_metadata_list)
+        if self.is_prefill_worker:
+            if not prefill_seq_group_metadata_list:
+                return None
+            prompt_tokens = self.model_runner.execute_model(
+                prefill_seq_group_metadata_list, self.gpu_cache, ifb_mode=True
+            )
+            self.cache_engine.send_blocks(block_ids, dst=self.rank - tp_size)
+            if self.tp_rank == 0:
+                torch.distributed.send(prompt_tokens.to(torch.long), dst=0)
+            return None
+
+        tokens = self.execute_model(seq_group_metadata_list, ifb_mode=True, **kwargs)
+        if not seq_group_metadata_list:
+            tokens = None
+        prompt_tokens = None
+        if prefill_seq_group_metadata_list:
+            self.cache_engine.recv_blocks(block_ids, src=self.rank + tp_size)
+            if self.is_driver_worker:
+                prompt_tokens = torch.empty(len(prefill_seq_group_metadata_list), dtype=torch.long, device="cuda")
+                torch.distributed.recv(prompt_tokens, src=tp_size)
+        return tokens, prompt_tokens
+
+    def _get_context_parallel_shard_lens(
+        self, seq_group_metadata_list: List[SequenceGroupMetadata]
+    ) -> Optional[List[int]]:
+        """The prompt lengths each instance prefills, or None if instance 0 runs the step alone.
+
+        Only a single prompt of at least context_parallel_min_tokens is split. Shards are contiguous and aligned to
+        super-pages (the page stats of a super-page are computed by one instance); the last one takes the
+        remainder. Every rank computes the same split from the broadcast metadata.
+        """
+        if len(seq_group_metadata_list) != 1 or not seq_group_metadata_list[0].is_prompt:
+            return None
+        seq_group_metadata = seq_group_metadata_list[0]
+        if seq_group_metadata.token_chunk_size is not None or len(seq_group_metadata.seq_data) != 1:
+            return None
+        prompt_len = next(iter(seq_group_metadata.seq_data.values())).get_len()
+        if prompt_len < self.parallel_config.context_parallel_min_tokens:
+            return None
+        cp_size = self.parallel_config.context_parallel_size
+        sp_attn_config = self.model_config.sp_attn_config
+        block_size = sp_attn_config.cache_block_size
+        shard_align = block_size * max(1, sp_attn_config.get_dec_super_page_size())
+        shard_len = prompt_len // cp_size // shard_align * shard_align
+        last_shard_len = prompt_len - shard_len * (cp_size - 1)
+        if shard_len == 0:
+            return None
+        if sp_attn_config.sparse_context_enabled():
+            # Streaming heads take the sink of instance 0 and the local tokens of the previous instance only.
+            if shard_len < max(sp_attn_config.get_ctx_sink_size(), sp_attn_config.get_ctx_local_size()):
+                return None
+        if sp_attn_config.sparse_kv_cache_enabled():
+            # The streaming ring pages (beyond the sink pages) are all written by the last instance.
+            if last_shard_len < (sp_attn_config.get_dec_local_block_num() + 1) * block_size:
+                return None
+        return [shard_len] * (cp_size - 1) + [last_shard_len]
+
+    def _execute_context_parallel_shard(
+        self, seq_group_metadata: SequenceGroupMetadata, shard_lens: List[int]
+    ) -> Optional[SamplerOutput]:
+        """Prefills the shard of this instance, then gathers the pages of the whole prompt on instance 0.
+
+        Returns the first token of the prompt (sampled by the last instance) on the driver worker.
+        """
+        tp_size = self.parallel_config.tensor_parallel_size
+        cp_size = self.parallel_config.context_parallel_size
+        shard_start = sum(shard_lens[: self.cp_rank])
+        shard_end = shard_start + shard_lens[self.cp_rank]
+        shard_metadata = copy.copy(seq_group_metadata)
+        shard_metadata.num_computed_tokens = shard_start
+        shard_metadata.token_chunk_size = shard_end - shard_start
+        context_parallel = ContextParallelShard(
+            rank=self.cp_rank,
+            shard_lens=shard_lens,
+            ranks=[instance * tp_size + self.tp_rank for instance in range(cp_size)],
+            group=get_context_parallel_group(),
+        )
+        tokens = self.model_runner.execute_model(
+            [shard_metadata], self.gpu_cache, ifb_mode=True, context_parallel=context_parallel
+        )
+
+        block_size = self.model_config.sp_attn_config.cache_block_size
+        seq_id = next(iter(seq_group_metadata.seq_data))
+        if self.cp_rank > 0:
+            block_ids = {"retrieval": seq_group_metadata.retrieval_block_tables[seq_id][
+                shard_start // block_size : (shard_end + block_size - 1) // block_size
+            ]}
+            if self.cp_rank == cp_size - 1:
+                block_ids["streaming"] = self._get_streaming_ring_block_ids(seq_group_metadata, seq_id)
+            self._transfer_context_parallel_blocks(block_ids, dst=self.rank - self.cp_rank * tp_size)
+            if self.cp_rank == cp_size - 1 and self.tp_rank == 0:
+                torch.distributed.send(tokens.to(torch.long), dst=0)
+            return None
+
+        shard_start = shard_end
+        for instance in range(1, cp_size):
+            shard_end = shard_start + shard_lens[instance]
+            block_ids = {"retrieval": seq_group_metadata.retrieval_block_tables[seq_id][
+                shard_start // block_size : (shard_end + block_size - 1) // block_size
+            ]}
+            if instance == cp_size - 1:
+                block_ids["streaming"] = self._get_streaming_ring_block_ids(seq_group_metadata, seq_id)
+            self._transfer_context_parallel_blocks(block_ids, src=self.rank + instance * tp_size)
+            shard_start = shard_end
+        if not self.is_driver_worker:
+            return None
+        tokens = torch.empty(1, dtype=torch.long, device="cuda")
+        torch.distributed.recv(tokens, src=(cp_size - 1) * tp_size)
+        self.model_runner._record_sampled_tokens([seq_group_metadata], tokens)
+        return tokens
+
+    def _get_streaming_ring_block_ids(self, seq_group_metadata: SequenceGroupMetadata, seq_id: int) -> List[int]:
+        # The pages past the sink pages of the streaming table: the local window ring.
+        if seq_group_metadata.streaming_block_tables is None:
+            return []
+        streaming_block_table = seq_group_metadata.streaming_block_tables[seq_id] or []
+        sink_blocks = set(streaming_block_table[: self.model_config.sp_attn_config.get_dec_sink_block_num()])
+        return sorted(set(streaming_block_table) - sink_blocks)
+
+    def _transfer_context_parallel_blocks(
+        self, block_ids: Dict[str, List[int]], dst: Optional[int] = None, src: Optional[int] = None
+    ) -> None:
+        # Sends (dst) or receives (src) the pages in messages of _CONTEXT_PARALLEL_BLOCKS_PER_MESSAGE pages.
+        for cache_mode, blocks in block_ids.items():
+            for i in range(0, len(blocks), _CONTEXT_PARALLEL_BLOCKS_PER_MESSAGE):
+                chunk = {cache_mode: blocks[i : i + _CONTEXT_PARALLEL_BLOCKS_PER_MESSAGE]}
+                if dst is not None:
+                    self.cache_engine.send_blocks(chunk, dst=dst)
+                else:
+                    self.cache_engine.recv_blocks(chunk, src=src)
+
+    def _get_prompt_block_ids(
+        self, seq_group_metadata_list: List[SequenceGroupMetadata]
+    ) -> Dict[str, List[int]]:
+        # The blocks of a streaming ring are shared by several table entries.
+        block_ids = {"retrieval": set(), "streaming": set()}
+        for seq_group_metadata in seq_group_metadata_list:
+            for seq_id in seq_group_metadata.seq_data:
+                block_ids["retrieval"].update(seq_group_metadata.retrieval_block_tables[seq_id])
+                if seq_group_metadata.streaming_block_tables is not None:
+                    block_ids["streaming"].update(seq_group_metadata.streaming_block_tables[seq_id] or [])
+        return {cache_mode: sorted(blocks) for cache_mode, blocks in block_ids.items()}
+
+    def start_worker_execution_loop(self) -> None:
+        """Executes the calls broadcast by the driver worker (see LLMEngine._run_workers) until it sends None."""
+        while True:
+            method, kwargs = broadcast_object(src=0)
+            if method is None:
+                break
+            getattr(self, method)(**kwargs)
+
+
+def init_distributed_environment(
+    parallel_config: ParallelConfig,
+    rank: int,
+    distributed_init_method: Optional[str] = None,
+) -> None:
+    """Initialize the distributed environment."""
+    if parallel_config.world_size == 1:
+        return
+    if torch.distributed.is_initialized():
+        torch_world_size = torch.distributed.get_world_size()
+        if torch_world_size != parallel_config.world_size:
+            raise RuntimeError(
+                "torch.distributed is already initialized but the torch world "
+                "size does not match parallel_config.world_size "
+                f"({torch_world_size} vs. {parallel_config.world_size})."
+            )
+    elif not distributed_init_method:
+        raise ValueError(
+            "distributed_init_method must be set if torch.distributed "
+            "is not already initialized"
+        )
+    else:
+        torch.distributed.init_process_group(
+            backend="nccl",
+            world_size=parallel_config.world_size,
+            rank=rank,
+            init_method=distributed_init_method,
+        )
+
+    # A small all_reduce for warmup.
+    torch.distributed.all_reduce(torch.zeros(1).cuda())
+    initialize_model_parallel(
+        parallel_config.tensor_parallel_size,
+        parallel_config.num_instances,
+        context_parallel=parallel_config.context_parallel_size > 1,
+    )
+
+
+def run_worker_process(
+    rank: int,
+    model_config: ModelConfig,
+    parallel_config: ParallelConfig,
+    scheduler_config: SchedulerConfig,
+    device_config: DeviceConfig,
+    distributed_init_method: str,
+    kv_cache_dtype: Optional[torch.dtype],
+    precision: str,
+    kv_cache_config: Optional[Dict],
+) -> None:
+    """Entry point of the non-driver tensor parallel workers spawned by LLMEngine."""
+    worker = Worker(
+        model_config,
+        parallel_config,
+        scheduler_config,
+        device_config,
+        local_rank=rank,
+        rank=rank,
+        distributed_init_method=distributed_init_method,
+        kv_cache_dtype=kv_cache_dtype,
+        is_driver_worker=False,
+        precision=precision,
+        kv_cache_config=kv_cache_config,
+    )
+    worker.init_model()
+    worker.start_worker_execution_loop()
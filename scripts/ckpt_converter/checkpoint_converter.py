@@ -2,6 +2,7 @@ import os
 import torch
 import argparse
 from omniserve.modeling.layers.quantized_linear import W4A8OF16LinearDynamicInputScale, W8A8OF16LinearDynamicInputScale
+from omniserve.utils.packed_checkpoint import PACKED_CHECKPOINT_NAME, save_packed_checkpoint
 from quant_utils import get_blocks, get_named_linears, scale_activations, set_op_by_name
 from transformers import AutoTokenizer, AutoModelForCausalLM, AutoConfig, modeling_utils
 from tqdm import tqdm
@@ -60,6 +61,11 @@ if __name__ == "__main__":
         action="store_true",
         help="save the KV scaling factors in the model checkpoint",
     )
+    parser.add_argument(
+        "--packed",
+        action="store_true",
+        help="save a memory-mappable model.omnipack (aligned, kernel-ready tensors) instead of pytorch_model.bin",
+    )
 
     args = parser.parse_args()
     assert args.model_type.lower() in [
@@ -150,15 +156,21 @@ if __name__ == "__main__":
 
                 model_state_dict[kv_scale_key] = torch.tensor([k_scale_quant_orig, v_scale_quant_orig]).to(param.device)      # Add dummy kv scaling factors
 
-    torch.save(model_state_dict, f"{args.output_path}/quant_model.pt")
-
     # Organize checkpoint and config files
     model_name = args.model_path.rstrip("/").split("/")[-1]
     model_name = model_name + f"-w{args.w_bit}a8-per-channel" if args.group_size == -1 else model_name + f"-w{args.w_bit}a8-g{args.group_size}"
     model_name = model_name + "-kv-per-tensor" if args.kv_per_tensor else model_name
     os.system(f"mkdir -p {args.output_path}")
     os.system(f"mkdir -p {args.output_path}/{model_name}")
-    os.system(f"mv {args.output_path}/quant_model.pt {args.output_path}/{model_name}/pytorch_model.bin")
+    if args.packed:
+        save_packed_checkpoint(
+            f"{args.output_path}/{model_name}/{PACKED_CHECKPOINT_NAME}",
+            model_state_dict,
+            metadata={"w_bit": args.w_bit, "group_size": args.group_size, "kv_per_tensor": args.kv_per_tensor},
+        )
+    else:
+        torch.save(model_state_dict, f"{args.output_path}/quant_model.pt")
+        os.system(f"mv {args.output_path}/quant_model.pt {args.output_path}/{model_name}/pytorch_model.bin")
     os.system(f"scp {args.model_path}/*.json {args.output_path}/{model_name}")
     os.system(f"scp {args.model_path}/tokenizer.model {args.output_path}/{model_name}")
     os.system(f"rm -f {args.output_path}/{model_name}/pytorch_model.bin.index.json")
@@ -15,7 +15,7 @@ decode_len=($5)
 
 # Quantization config
 precision=($6)
-kv_quant_granularity=($7)           # Granularity of kv quantization. Choose from ['per_tensor', 'fine_grained']
+kv_quant_granularity=($7)           # Granularity of kv quantization. Choose from ['per_tensor', 'per_page', 'fine_grained']
 
 # Sparsity config
 static_sparsity=($8)                # Sparsity for static sparse attention, the ratio of attention heads to prune to streaming.
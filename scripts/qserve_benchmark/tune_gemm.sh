@@ -0,0 +1,14 @@
+# Tune the W4A8/W8A8 GEMM tile configs of the benchmark models on the current GPU.
+# Results are cached in ~/.cache/omniserve/gemm_tile_configs.json (override with OMNISERVE_GEMM_TUNING_CACHE)
+# and picked up automatically by the QServe linear layers. Run once per device type before benchmarking.
+
+# Download the model config files for benchmarking
+MODEL_CONFIG_DIR_PATH=./QServe-benchmarks
+if [ ! -d "$MODEL_CONFIG_DIR_PATH" ]; then
+    git clone https://huggingface.co/datasets/mit-han-lab/QServe-benchmarks
+fi
+
+for MODEL in Llama-3-8B Llama-2-7B Mistral-7B Llama-2-13B Llama-30B Yi-34B Llama-2-70B Qwen-1.5-72B
+do
+    python -m omniserve.modeling.layers.quantized_linear.gemm_autotuner --model $MODEL_CONFIG_DIR_PATH/$MODEL
+done